@@ -0,0 +1,499 @@
+#include <getopt.h>  /* getopt_long */
+#include <stdio.h>  /* fprintf */
+#include <stdlib.h>  /* malloc, free, atoi */
+#include <string.h>  /* memset, strcmp */
+#include <sys/socket.h>  /* setsockopt, SO_LINGER */
+
+#include "uv.h"
+#include "openssl/bio.h"
+#include "openssl/err.h"
+#include "openssl/ssl.h"
+
+#include "bench-common.h"
+#include "common.h"
+
+/*
+ * Accept path benchmark: `concurrency` connections to a running bud, each
+ * sends its first flight, waits for the first byte of the reply and is
+ * reset, for `duration` seconds. Nothing past the first read is done, so
+ * it is the accept, balancing and the first read of bud that are timed.
+ *
+ * `--mode plain` - HTTP request that `frontend.http_redirect` answers
+ * `--mode hello` - ClientHello, the reply is the ServerHello flight
+ */
+
+typedef enum bud_accept_mode_e bud_accept_mode_t;
+typedef struct bud_accept_s bud_accept_t;
+typedef struct bud_accept_conn_s bud_accept_conn_t;
+
+enum bud_accept_mode_e {
+  kBudAcceptPlain,
+  kBudAcceptHello
+};
+
+struct bud_accept_s {
+  uv_loop_t* loop;
+  struct sockaddr_in addr;
+  uv_timer_t timer;
+  int stopped;
+
+  /* Options */
+  bud_accept_mode_t mode;
+  int concurrency;
+  int duration;
+
+  /* First flight, the same for every connection */
+  char* flight;
+  size_t flight_len;
+
+  /* Results */
+  uint64_t start;
+  uint64_t accepted;
+  uint64_t connect_errors;
+  uint64_t errors;
+  bud_bench_samples_t connect_latency;
+  bud_bench_samples_t read_latency;
+  bud_bench_cpu_t master;
+  bud_bench_cpu_t workers;
+  int active;
+};
+
+struct bud_accept_conn_s {
+  bud_accept_t* bench;
+  uv_tcp_t tcp;
+  uv_connect_t connect;
+  uv_write_t write;
+  uint64_t start;
+  uint64_t connected;
+  char buf[1024];
+};
+
+static int bud_accept_hello(bud_accept_t* bench,
+                            const char* servername,
+                            const char* ciphers);
+static int bud_accept_connect(bud_accept_t* bench);
+static void bud_accept_connect_cb(uv_connect_t* req, int status);
+static void bud_accept_write_cb(uv_write_t* req, int status);
+static void bud_accept_alloc_cb(uv_handle_t* handle,
+                                size_t suggested_size,
+                                uv_buf_t* buf);
+static void bud_accept_read_cb(uv_stream_t* stream,
+                               ssize_t nread,
+                               const uv_buf_t* buf);
+static void bud_accept_done(bud_accept_conn_t* conn, int success);
+static void bud_accept_close_cb(uv_handle_t* handle);
+static void bud_accept_timer_cb(uv_timer_t* handle, int status);
+static void bud_accept_report(bud_accept_t* bench);
+static void bud_accept_usage(const char* name);
+
+static const char bud_accept_request[] = "GET / HTTP/1.1\r\n"
+                                         "Host: bench\r\n"
+                                         "\r\n";
+
+
+int main(int argc, char** argv) {
+  int c;
+  int i;
+  int index;
+  const char* host;
+  int port;
+  const char* servername;
+  const char* ciphers;
+  bud_accept_t bench;
+
+  struct option long_options[] = {
+    { "host", 1, NULL, 'h' },
+    { "port", 1, NULL, 'p' },
+    { "concurrency", 1, NULL, 'c' },
+    { "duration", 1, NULL, 'd' },
+    { "mode", 1, NULL, 'm' },
+    { "servername", 1, NULL, 1000 },
+    { "ciphers", 1, NULL, 1001 },
+    { "master", 1, NULL, 1002 },
+    { "pid", 1, NULL, 1003 },
+    { "help", 0, NULL, 1004 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  memset(&bench, 0, sizeof(bench));
+  host = "127.0.0.1";
+  port = 1443;
+  servername = NULL;
+  ciphers = NULL;
+  bench.mode = kBudAcceptHello;
+  bench.concurrency = 64;
+  bench.duration = 10;
+
+  for (;;) {
+    index = 0;
+    c = getopt_long(argc, argv, "h:p:c:d:m:", long_options, &index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        bench.concurrency = atoi(optarg);
+        break;
+      case 'd':
+        bench.duration = atoi(optarg);
+        break;
+      case 'm':
+        if (strcmp(optarg, "plain") == 0) {
+          bench.mode = kBudAcceptPlain;
+        } else if (strcmp(optarg, "hello") == 0) {
+          bench.mode = kBudAcceptHello;
+        } else {
+          fprintf(stderr, "Unknown --mode: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 1000:
+        servername = optarg;
+        break;
+      case 1001:
+        ciphers = optarg;
+        break;
+      case 1002:
+        if (bench.master.pid_count != 0 ||
+            bud_bench_cpu_add_pid(&bench.master, optarg) != 0) {
+          fprintf(stderr, "Invalid or repeated --master: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 1003:
+        if (bud_bench_cpu_add_pid(&bench.workers, optarg) != 0) {
+          fprintf(stderr, "Invalid or too many --pid: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 1004:
+        bud_accept_usage(argv[0]);
+        return 0;
+      default:
+        bud_accept_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (bench.concurrency <= 0 || bench.duration <= 0) {
+    bud_accept_usage(argv[0]);
+    return 1;
+  }
+
+  if (bench.mode == kBudAcceptPlain) {
+    bench.flight = (char*) bud_accept_request;
+    bench.flight_len = sizeof(bud_accept_request) - 1;
+  } else if (bud_accept_hello(&bench, servername, ciphers) != 0) {
+    return 1;
+  }
+
+  if (uv_ip4_addr(host, port, &bench.addr) != 0) {
+    fprintf(stderr, "Invalid host: %s\n", host);
+    return 1;
+  }
+
+  bench.loop = uv_default_loop();
+  bud_bench_samples_init(&bench.connect_latency);
+  bud_bench_samples_init(&bench.read_latency);
+
+  if (uv_timer_init(bench.loop, &bench.timer) != 0 ||
+      uv_timer_start(&bench.timer,
+                     bud_accept_timer_cb,
+                     bench.duration * 1000,
+                     0) != 0) {
+    fprintf(stderr, "Failed to start timer\n");
+    return 1;
+  }
+
+  bench.start = uv_hrtime();
+  bud_bench_cpu_start(&bench.master);
+  bud_bench_cpu_start(&bench.workers);
+  for (i = 0; i < bench.concurrency; i++)
+    if (bud_accept_connect(&bench) != 0)
+      break;
+
+  uv_run(bench.loop, UV_RUN_DEFAULT);
+
+  bud_accept_report(&bench);
+  bud_bench_samples_destroy(&bench.connect_latency);
+  bud_bench_samples_destroy(&bench.read_latency);
+  if (bench.mode == kBudAcceptHello)
+    free(bench.flight);
+  return 0;
+}
+
+
+void bud_accept_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -h, --host <ip>            bud's frontend (127.0.0.1)\n"
+          "  -p, --port <port>          (1443)\n"
+          "  -c, --concurrency <n>      connections in flight (64)\n"
+          "  -d, --duration <seconds>   (10)\n"
+          "  -m, --mode <plain|hello>   first flight to send (hello)\n"
+          "  --servername <name>        send SNI extension in the hello\n"
+          "  --ciphers <list>           OpenSSL cipher list of the hello\n"
+          "  --master <pid>             report CPU of bud's master\n"
+          "  --pid <pid>                report CPU of bud's worker, could "
+              "be repeated\n",
+          name);
+}
+
+
+/* ClientHello of a throwaway SSL, sent by every connection as it is */
+int bud_accept_hello(bud_accept_t* bench,
+                     const char* servername,
+                     const char* ciphers) {
+  SSL_CTX* ctx;
+  SSL* ssl;
+  BIO* in;
+  BIO* out;
+  long len;
+  int r;
+
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+  SSL_load_error_strings();
+
+  r = -1;
+  ssl = NULL;
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  if (ctx == NULL) {
+    fprintf(stderr, "SSL_CTX_new() failed\n");
+    return -1;
+  }
+  if (ciphers != NULL && SSL_CTX_set_cipher_list(ctx, ciphers) != 1) {
+    fprintf(stderr, "Invalid cipher list: %s\n", ciphers);
+    goto done;
+  }
+
+  ssl = SSL_new(ctx);
+  in = BIO_new(BIO_s_mem());
+  out = BIO_new(BIO_s_mem());
+  if (ssl == NULL || in == NULL || out == NULL) {
+    fprintf(stderr, "SSL_new() failed\n");
+    if (in != NULL)
+      BIO_free(in);
+    if (out != NULL)
+      BIO_free(out);
+    goto done;
+  }
+  SSL_set_bio(ssl, in, out);
+  SSL_set_connect_state(ssl);
+  if (servername != NULL)
+    SSL_set_tlsext_host_name(ssl, servername);
+
+  /* Stops right after the hello, waiting for the server */
+  SSL_do_handshake(ssl);
+  len = BIO_pending(out);
+  if (len <= 0) {
+    fprintf(stderr, "No ClientHello\n");
+    goto done;
+  }
+  bench->flight = malloc(len);
+  if (bench->flight == NULL)
+    goto done;
+  bench->flight_len = BIO_read(out, bench->flight, len);
+  r = 0;
+
+done:
+  ERR_clear_error();
+  if (ssl != NULL)
+    SSL_free(ssl);
+  SSL_CTX_free(ctx);
+  return r;
+}
+
+
+int bud_accept_connect(bud_accept_t* bench) {
+  int r;
+  bud_accept_conn_t* conn;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return -1;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->bench = bench;
+  conn->start = uv_hrtime();
+  r = uv_tcp_init(bench->loop, &conn->tcp);
+  if (r != 0) {
+    free(conn);
+    return r;
+  }
+  conn->tcp.data = conn;
+  bench->active++;
+
+  r = uv_tcp_connect(&conn->connect,
+                     &conn->tcp,
+                     (struct sockaddr*) &bench->addr,
+                     bud_accept_connect_cb);
+  if (r != 0) {
+    bench->connect_errors++;
+    bud_accept_done(conn, 0);
+  }
+  return 0;
+}
+
+
+void bud_accept_connect_cb(uv_connect_t* req, int status) {
+  bud_accept_conn_t* conn;
+  bud_accept_t* bench;
+  uv_buf_t buf;
+
+  conn = container_of(req, bud_accept_conn_t, connect);
+  bench = conn->bench;
+  if (status != 0) {
+    bench->connect_errors++;
+    return bud_accept_done(conn, 0);
+  }
+
+  /* In the kernel's accept queue by now, but not accepted yet */
+  conn->connected = uv_hrtime();
+  bud_bench_samples_add(&bench->connect_latency,
+                        (conn->connected - conn->start) / 1000);
+
+  uv_tcp_nodelay(&conn->tcp, 1);
+  buf = uv_buf_init(bench->flight, bench->flight_len);
+  if (uv_write(&conn->write,
+               (uv_stream_t*) &conn->tcp,
+               &buf,
+               1,
+               bud_accept_write_cb) != 0) {
+    return bud_accept_done(conn, 0);
+  }
+
+  if (uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_accept_alloc_cb,
+                    bud_accept_read_cb) != 0) {
+    return bud_accept_done(conn, 0);
+  }
+}
+
+
+void bud_accept_write_cb(uv_write_t* req, int status) {
+  /* `flight` is shared, nothing to free */
+}
+
+
+void bud_accept_alloc_cb(uv_handle_t* handle,
+                         size_t suggested_size,
+                         uv_buf_t* buf) {
+  bud_accept_conn_t* conn;
+
+  conn = handle->data;
+  *buf = uv_buf_init(conn->buf, sizeof(conn->buf));
+}
+
+
+void bud_accept_read_cb(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf) {
+  bud_accept_conn_t* conn;
+  bud_accept_t* bench;
+
+  conn = stream->data;
+  bench = conn->bench;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return bud_accept_done(conn, 0);
+
+  /* The worker has accepted, read the flight and answered */
+  bench->accepted++;
+  bud_bench_samples_add(&bench->read_latency,
+                        (uv_hrtime() - conn->connected) / 1000);
+  bud_accept_done(conn, 1);
+}
+
+
+void bud_accept_done(bud_accept_conn_t* conn, int success) {
+  struct linger linger;
+  uv_os_fd_t fd;
+
+  if (!success)
+    conn->bench->errors++;
+
+  /* RST instead of FIN, no TIME_WAIT to run out of ports */
+  if (uv_fileno((uv_handle_t*) &conn->tcp, &fd) == 0) {
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+  }
+
+  uv_read_stop((uv_stream_t*) &conn->tcp);
+  uv_close((uv_handle_t*) &conn->tcp, bud_accept_close_cb);
+}
+
+
+void bud_accept_close_cb(uv_handle_t* handle) {
+  bud_accept_conn_t* conn;
+  bud_accept_t* bench;
+
+  conn = handle->data;
+  bench = conn->bench;
+  free(conn);
+
+  /* Keep `concurrency` connections in flight */
+  bench->active--;
+  if (!bench->stopped)
+    bud_accept_connect(bench);
+}
+
+
+void bud_accept_timer_cb(uv_timer_t* handle, int status) {
+  bud_accept_t* bench;
+
+  /* Let connections in flight finish, the loop exits after the last one */
+  bench = container_of(handle, bud_accept_t, timer);
+  bench->stopped = 1;
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+void bud_accept_report(bud_accept_t* bench) {
+  double elapsed;
+  uint64_t self;
+  uint64_t master;
+  uint64_t workers;
+
+  elapsed = (uv_hrtime() - bench->start) / 1e9;
+  bud_bench_cpu_elapsed(&bench->master, &self, &master);
+  bud_bench_cpu_elapsed(&bench->workers, &self, &workers);
+
+  fprintf(stdout,
+          "duration: %.2fs, concurrency: %d, mode: %s\n",
+          elapsed,
+          bench->concurrency,
+          bench->mode == kBudAcceptPlain ? "plain" : "hello");
+  fprintf(stdout,
+          "accepts: %llu (%.1f/s) errors=%llu (in connect %llu)\n",
+          (unsigned long long) bench->accepted,
+          bench->accepted / elapsed,
+          (unsigned long long) bench->errors,
+          (unsigned long long) bench->connect_errors);
+  bud_bench_samples_print(&bench->connect_latency, "connect latency");
+  bud_bench_samples_print(&bench->read_latency, "first read latency");
+
+  /* Master's share is what the balancing modes differ in */
+  fprintf(stdout,
+          "cpu (%% of a core): bench=%.1f",
+          self / elapsed / 1e4);
+  if (bench->master.pid_count != 0)
+    fprintf(stdout, " master=%.1f", master / elapsed / 1e4);
+  if (bench->workers.pid_count != 0)
+    fprintf(stdout, " workers=%.1f", workers / elapsed / 1e4);
+  fprintf(stdout, "\n");
+
+  if (bench->accepted == 0 || bench->master.pid_count == 0)
+    return;
+  fprintf(stdout,
+          "master cpu per accept (us): %.2f\n",
+          (double) master / bench->accepted);
+}
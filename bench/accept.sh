@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# Run bud-bench-accept against a temporary bud in every accept mode: master
+# balancing over IPC, `frontend.reuseport` and `frontend.shared_listen`, for
+# each of WORKER_COUNTS, with plain HTTP (answered by `http_redirect`) and
+# ClientHello-only clients. The last scenario kills the worker every
+# RESTART_INTERVAL seconds, so that master queues the accepts
+# (`pending_accept`) until it is respawned. Run from the repository root,
+# after `make -C out/`.
+#
+# Tunables (environment):
+#   OUT               build directory (out/Release)
+#   WORKER_COUNTS     worker counts to try ("1 2 4 8")
+#   MODES             accept modes ("balance reuseport shared")
+#   DURATION          seconds per scenario (10)
+#   CLIENTS           connections in flight (256)
+#   RESTART_INTERVAL  seconds between worker kills (1)
+#
+# NOTE: clients reset their connections, so TIME_WAIT doesn't run out the
+# ports, but `ulimit -n` should still cover CLIENTS for bud.
+
+set -e
+
+OUT=${OUT:-out/Release}
+WORKER_COUNTS=${WORKER_COUNTS:-"1 2 4 8"}
+MODES=${MODES:-"balance reuseport shared"}
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-256}
+RESTART_INTERVAL=${RESTART_INTERVAL:-1}
+
+FRONTEND_PORT=${FRONTEND_PORT:-11443}
+BACKEND_PORT=${BACKEND_PORT:-19001}
+CONFIG=`mktemp /tmp/bud-accept.XXXXXX`
+BUD_PID=
+KILLER_PID=
+
+cleanup() {
+  kill $KILLER_PID $BUD_PID 2>/dev/null || true
+  rm -f $CONFIG
+}
+trap cleanup EXIT INT TERM
+
+start_bud() {
+  workers=$1
+  reuseport=false
+  shared=false
+  case $2 in
+    reuseport) reuseport=true ;;
+    shared) shared=true ;;
+  esac
+
+  cat > $CONFIG <<JSON
+{
+  "workers": $workers,
+  "restart_timeout": 100,
+  "log": { "level": "warning" },
+  "frontend": {
+    "port": $FRONTEND_PORT,
+    "host": "127.0.0.1",
+    "cert": "keys/cert.pem",
+    "key": "keys/key.pem",
+    "reuseport": $reuseport,
+    "shared_listen": $shared,
+    "http_redirect": true,
+    "timeout": { "handshake": 0, "idle": 0 }
+  },
+  "backend": { "port": $BACKEND_PORT, "host": "127.0.0.1" }
+}
+JSON
+
+  $OUT/bud --config $CONFIG &
+  BUD_PID=$!
+  sleep 1
+}
+
+stop_bud() {
+  kill $BUD_PID 2>/dev/null || true
+  wait $BUD_PID 2>/dev/null || true
+  BUD_PID=
+}
+
+# Workers die in the restart scenario, their CPU can't be summed up then
+run() {
+  echo "== $1"
+  shift
+  pids="--master $BUD_PID"
+  if [ -z "$KILLER_PID" ]; then
+    for pid in `pgrep -P $BUD_PID`; do
+      pids="$pids --pid $pid"
+    done
+  fi
+  $OUT/bud-bench-accept --port $FRONTEND_PORT -d $DURATION -c $CLIENTS \
+      $pids "$@"
+  echo
+}
+
+for mode in $MODES; do
+  for workers in $WORKER_COUNTS; do
+    start_bud $workers $mode
+    run "$mode, $workers workers, plain" --mode plain
+    run "$mode, $workers workers, hello" --mode hello
+    stop_bud
+  done
+done
+
+start_bud 1 balance
+(
+  while sleep $RESTART_INTERVAL; do
+    pkill -KILL -P $BUD_PID || true
+  done
+) &
+KILLER_PID=$!
+run "balance, 1 worker killed every ${RESTART_INTERVAL}s, hello" --mode hello
+kill $KILLER_PID 2>/dev/null || true
+KILLER_PID=
+stop_bud
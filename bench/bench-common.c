@@ -0,0 +1,207 @@
+#include <stdio.h>  /* fprintf, fopen, fscanf */
+#include <stdlib.h>  /* malloc, realloc, free, qsort, strtol */
+#include <string.h>  /* snprintf */
+#include <sys/resource.h>  /* getrusage */
+#include <unistd.h>  /* sysconf */
+
+#include "bench-common.h"
+
+static int bud_bench_samples_cmp(const void* a, const void* b);
+static uint64_t bud_bench_samples_at(bud_bench_samples_t* samples,
+                                     double q);
+static uint64_t bud_bench_cpu_self();
+static uint64_t bud_bench_cpu_pid(int pid);
+static uint64_t bud_bench_rss_pid(int pid);
+
+
+void bud_bench_samples_init(bud_bench_samples_t* samples) {
+  samples->list = NULL;
+  samples->count = 0;
+  samples->cap = 0;
+}
+
+
+void bud_bench_samples_destroy(bud_bench_samples_t* samples) {
+  free(samples->list);
+  bud_bench_samples_init(samples);
+}
+
+
+int bud_bench_samples_add(bud_bench_samples_t* samples, uint64_t us) {
+  size_t cap;
+  uint32_t* list;
+
+  if (samples->count == samples->cap) {
+    cap = samples->cap == 0 ? 65536 : samples->cap * 2;
+    list = realloc(samples->list, cap * sizeof(*list));
+    if (list == NULL)
+      return -1;
+    samples->list = list;
+    samples->cap = cap;
+  }
+
+  samples->list[samples->count++] = us > UINT32_MAX ? UINT32_MAX : us;
+  return 0;
+}
+
+
+int bud_bench_samples_cmp(const void* a, const void* b) {
+  uint32_t x;
+  uint32_t y;
+
+  x = *(const uint32_t*) a;
+  y = *(const uint32_t*) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+uint64_t bud_bench_samples_at(bud_bench_samples_t* samples, double q) {
+  size_t index;
+
+  index = (size_t) (q * samples->count);
+  if (index >= samples->count)
+    index = samples->count - 1;
+  return samples->list[index];
+}
+
+
+void bud_bench_samples_print(bud_bench_samples_t* samples, const char* name) {
+  if (samples->count == 0) {
+    fprintf(stdout, "%s: no samples\n", name);
+    return;
+  }
+
+  qsort(samples->list,
+        samples->count,
+        sizeof(*samples->list),
+        bud_bench_samples_cmp);
+  fprintf(stdout,
+          "%s (us): count=%llu p50=%llu p90=%llu p99=%llu p99.9=%llu "
+              "max=%llu\n",
+          name,
+          (unsigned long long) samples->count,
+          (unsigned long long) bud_bench_samples_at(samples, 0.5),
+          (unsigned long long) bud_bench_samples_at(samples, 0.9),
+          (unsigned long long) bud_bench_samples_at(samples, 0.99),
+          (unsigned long long) bud_bench_samples_at(samples, 0.999),
+          (unsigned long long) samples->list[samples->count - 1]);
+}
+
+
+int bud_bench_cpu_add_pid(bud_bench_cpu_t* cpu, const char* pid) {
+  char* end;
+  long r;
+
+  if (cpu->pid_count == BUD_BENCH_MAX_PIDS)
+    return -1;
+
+  r = strtol(pid, &end, 10);
+  if (*end != '\0' || r <= 0)
+    return -1;
+
+  cpu->pids[cpu->pid_count++] = (int) r;
+  return 0;
+}
+
+
+void bud_bench_cpu_start(bud_bench_cpu_t* cpu) {
+  int i;
+
+  cpu->self_start = bud_bench_cpu_self();
+  cpu->pids_start = 0;
+  for (i = 0; i < cpu->pid_count; i++)
+    cpu->pids_start += bud_bench_cpu_pid(cpu->pids[i]);
+}
+
+
+void bud_bench_cpu_elapsed(bud_bench_cpu_t* cpu,
+                           uint64_t* self,
+                           uint64_t* pids) {
+  int i;
+  uint64_t total;
+
+  total = 0;
+  for (i = 0; i < cpu->pid_count; i++)
+    total += bud_bench_cpu_pid(cpu->pids[i]);
+
+  *self = bud_bench_cpu_self() - cpu->self_start;
+  *pids = total - cpu->pids_start;
+}
+
+
+uint64_t bud_bench_cpu_self() {
+  struct rusage usage;
+
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+
+  return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+             1000000 +
+         usage.ru_utime.tv_usec +
+         usage.ru_stime.tv_usec;
+}
+
+
+uint64_t bud_bench_cpu_pid(int pid) {
+  char path[64];
+  FILE* f;
+  unsigned long long utime;
+  unsigned long long stime;
+  int r;
+  long ticks;
+
+  /* Linux only, fields 14 and 15 of stat are utime and stime in ticks */
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+
+  r = fscanf(f,
+             "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+             &utime,
+             &stime);
+  fclose(f);
+  if (r != 2)
+    return 0;
+
+  ticks = sysconf(_SC_CLK_TCK);
+  if (ticks <= 0)
+    ticks = 100;
+  return (utime + stime) * 1000000 / ticks;
+}
+
+
+uint64_t bud_bench_cpu_rss(bud_bench_cpu_t* cpu) {
+  int i;
+  uint64_t total;
+
+  total = 0;
+  for (i = 0; i < cpu->pid_count; i++)
+    total += bud_bench_rss_pid(cpu->pids[i]);
+  return total;
+}
+
+
+uint64_t bud_bench_rss_pid(int pid) {
+  char path[64];
+  FILE* f;
+  unsigned long long pages;
+  int r;
+  long page_size;
+
+  /* Linux only, second field of statm is resident pages */
+  snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+  f = fopen(path, "r");
+  if (f == NULL)
+    return 0;
+
+  r = fscanf(f, "%*u %llu", &pages);
+  fclose(f);
+  if (r != 1)
+    return 0;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  if (page_size <= 0)
+    page_size = 4096;
+  return pages * page_size;
+}
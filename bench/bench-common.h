@@ -0,0 +1,48 @@
+#ifndef BENCH_BENCH_COMMON_H_
+#define BENCH_BENCH_COMMON_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t */
+#include <stdlib.h>  /* size_t */
+
+/* Processes (bud master and workers) whose CPU time is reported */
+#define BUD_BENCH_MAX_PIDS 64
+
+typedef struct bud_bench_samples_s bud_bench_samples_t;
+typedef struct bud_bench_cpu_s bud_bench_cpu_t;
+
+/* Latency samples in microseconds, kept all for exact percentiles */
+struct bud_bench_samples_s {
+  uint32_t* list;
+  size_t count;
+  size_t cap;
+};
+
+struct bud_bench_cpu_s {
+  int pids[BUD_BENCH_MAX_PIDS];
+  int pid_count;
+
+  /* In microseconds, since bud_bench_cpu_start() */
+  uint64_t self_start;
+  uint64_t pids_start;
+};
+
+void bud_bench_samples_init(bud_bench_samples_t* samples);
+void bud_bench_samples_destroy(bud_bench_samples_t* samples);
+int bud_bench_samples_add(bud_bench_samples_t* samples, uint64_t us);
+
+/* Print count, p50, p90, p99, p99.9 and max. Sorts the samples */
+void bud_bench_samples_print(bud_bench_samples_t* samples, const char* name);
+
+/* Add process to watch, `pid` should be a decimal string */
+int bud_bench_cpu_add_pid(bud_bench_cpu_t* cpu, const char* pid);
+void bud_bench_cpu_start(bud_bench_cpu_t* cpu);
+
+/* CPU time used by this process and by the watched ones, in microseconds */
+void bud_bench_cpu_elapsed(bud_bench_cpu_t* cpu,
+                           uint64_t* self,
+                           uint64_t* pids);
+
+/* Resident memory of the watched processes, in bytes */
+uint64_t bud_bench_cpu_rss(bud_bench_cpu_t* cpu);
+
+#endif  /* BENCH_BENCH_COMMON_H_ */
@@ -0,0 +1,526 @@
+#include <getopt.h>  /* getopt_long */
+#include <stdio.h>  /* fprintf */
+#include <stdlib.h>  /* malloc, free, atoi */
+#include <string.h>  /* memset, strcmp */
+
+#include "uv.h"
+#include "openssl/bio.h"
+#include "openssl/err.h"
+#include "openssl/ssl.h"
+
+#include "bench-common.h"
+#include "common.h"
+
+/*
+ * Handshake benchmark: opens `concurrency` TLS connections to a running bud,
+ * completes the handshake and reconnects, for `duration` seconds.
+ */
+
+typedef struct bud_bench_s bud_bench_t;
+typedef struct bud_bench_conn_s bud_bench_conn_t;
+
+struct bud_bench_s {
+  uv_loop_t* loop;
+  struct sockaddr_in addr;
+  SSL_CTX* ctx;
+  uv_timer_t timer;
+  int stopped;
+
+  /* Options */
+  int concurrency;
+  int duration;
+  const char* servername;
+  int names;
+  int stapling;
+  int resume;
+
+  /* Session to resume, from the first full handshake */
+  SSL_SESSION* session;
+
+  /* Prefix of the next servername with `names` */
+  int next_name;
+
+  /* Results */
+  uint64_t start;
+  uint64_t full;
+  uint64_t resumed;
+  uint64_t stapled;
+  uint64_t errors;
+  bud_bench_samples_t full_latency;
+  bud_bench_samples_t resumed_latency;
+  bud_bench_cpu_t cpu;
+  int active;
+};
+
+struct bud_bench_conn_s {
+  bud_bench_t* bench;
+  uv_tcp_t tcp;
+  uv_connect_t connect;
+  SSL* ssl;
+  uint64_t start;
+
+  /* Until they are given to `ssl` */
+  BIO* in;
+  BIO* out;
+  char buf[16384];
+};
+
+static int bud_bench_connect(bud_bench_t* bench);
+static void bud_bench_connect_cb(uv_connect_t* req, int status);
+static void bud_bench_alloc_cb(uv_handle_t* handle,
+                               size_t suggested_size,
+                               uv_buf_t* buf);
+static void bud_bench_read_cb(uv_stream_t* stream,
+                              ssize_t nread,
+                              const uv_buf_t* buf);
+static int bud_bench_cycle(bud_bench_conn_t* conn);
+static int bud_bench_flush(bud_bench_conn_t* conn);
+static void bud_bench_write_cb(uv_write_t* req, int status);
+static void bud_bench_done(bud_bench_conn_t* conn, int success);
+static void bud_bench_close_cb(uv_handle_t* handle);
+static void bud_bench_timer_cb(uv_timer_t* handle, int status);
+static void bud_bench_report(bud_bench_t* bench);
+static void bud_bench_usage(const char* name);
+
+
+int main(int argc, char** argv) {
+  int c;
+  int i;
+  int index;
+  const char* host;
+  int port;
+  const char* ciphers;
+  const char* key;
+  char cipher_list[1024];
+  bud_bench_t bench;
+
+  struct option long_options[] = {
+    { "host", 1, NULL, 'h' },
+    { "port", 1, NULL, 'p' },
+    { "concurrency", 1, NULL, 'c' },
+    { "duration", 1, NULL, 'd' },
+    { "ciphers", 1, NULL, 1000 },
+    { "key", 1, NULL, 1001 },
+    { "servername", 1, NULL, 1002 },
+    { "stapling", 0, NULL, 1003 },
+    { "resume", 0, NULL, 1004 },
+    { "pid", 1, NULL, 1005 },
+    { "help", 0, NULL, 1006 },
+    { "names", 1, NULL, 1007 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  memset(&bench, 0, sizeof(bench));
+  host = "127.0.0.1";
+  port = 1443;
+  ciphers = NULL;
+  key = NULL;
+  bench.concurrency = 64;
+  bench.duration = 10;
+
+  for (;;) {
+    index = 0;
+    c = getopt_long(argc, argv, "h:p:c:d:", long_options, &index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        bench.concurrency = atoi(optarg);
+        break;
+      case 'd':
+        bench.duration = atoi(optarg);
+        break;
+      case 1000:
+        ciphers = optarg;
+        break;
+      case 1001:
+        key = optarg;
+        break;
+      case 1002:
+        bench.servername = optarg;
+        break;
+      case 1003:
+        bench.stapling = 1;
+        break;
+      case 1004:
+        bench.resume = 1;
+        break;
+      case 1005:
+        if (bud_bench_cpu_add_pid(&bench.cpu, optarg) != 0) {
+          fprintf(stderr, "Invalid or too many --pid: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 1006:
+        bud_bench_usage(argv[0]);
+        return 0;
+      case 1007:
+        bench.names = atoi(optarg);
+        break;
+      default:
+        bud_bench_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (bench.concurrency <= 0 ||
+      bench.duration <= 0 ||
+      bench.names < 0 ||
+      (bench.names != 0 && bench.servername == NULL)) {
+    bud_bench_usage(argv[0]);
+    return 1;
+  }
+
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+  SSL_load_error_strings();
+
+  bench.ctx = SSL_CTX_new(SSLv23_client_method());
+  if (bench.ctx == NULL) {
+    fprintf(stderr, "SSL_CTX_new() failed\n");
+    return 1;
+  }
+  SSL_CTX_set_session_cache_mode(bench.ctx, SSL_SESS_CACHE_OFF);
+
+  /* Server's certificate is picked by the authentication of the cipher */
+  if (ciphers == NULL)
+    ciphers = "DEFAULT";
+  if (key == NULL || strcmp(key, "any") == 0) {
+    snprintf(cipher_list, sizeof(cipher_list), "%s", ciphers);
+  } else if (strcmp(key, "rsa") == 0) {
+    snprintf(cipher_list, sizeof(cipher_list), "%s:!aECDSA:!aDSS", ciphers);
+  } else if (strcmp(key, "ecdsa") == 0) {
+    snprintf(cipher_list, sizeof(cipher_list), "%s:!aRSA:!aDSS", ciphers);
+  } else {
+    fprintf(stderr, "Unknown --key: %s\n", key);
+    return 1;
+  }
+  if (SSL_CTX_set_cipher_list(bench.ctx, cipher_list) != 1) {
+    fprintf(stderr, "Invalid cipher list: %s\n", cipher_list);
+    return 1;
+  }
+
+  if (uv_ip4_addr(host, port, &bench.addr) != 0) {
+    fprintf(stderr, "Invalid host: %s\n", host);
+    return 1;
+  }
+
+  bench.loop = uv_default_loop();
+  bud_bench_samples_init(&bench.full_latency);
+  bud_bench_samples_init(&bench.resumed_latency);
+
+  if (uv_timer_init(bench.loop, &bench.timer) != 0 ||
+      uv_timer_start(&bench.timer,
+                     bud_bench_timer_cb,
+                     bench.duration * 1000,
+                     0) != 0) {
+    fprintf(stderr, "Failed to start timer\n");
+    return 1;
+  }
+
+  bench.start = uv_hrtime();
+  bud_bench_cpu_start(&bench.cpu);
+  for (i = 0; i < bench.concurrency; i++)
+    if (bud_bench_connect(&bench) != 0)
+      break;
+
+  uv_run(bench.loop, UV_RUN_DEFAULT);
+
+  bud_bench_report(&bench);
+  bud_bench_samples_destroy(&bench.full_latency);
+  bud_bench_samples_destroy(&bench.resumed_latency);
+  if (bench.session != NULL)
+    SSL_SESSION_free(bench.session);
+  SSL_CTX_free(bench.ctx);
+  return 0;
+}
+
+
+void bud_bench_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -h, --host <ip>            bud's frontend (127.0.0.1)\n"
+          "  -p, --port <port>          (1443)\n"
+          "  -c, --concurrency <n>      connections in flight (64)\n"
+          "  -d, --duration <seconds>   (10)\n"
+          "  --ciphers <list>           OpenSSL cipher list (DEFAULT)\n"
+          "  --key <rsa|ecdsa|any>      certificate type to negotiate (any)\n"
+          "  --servername <name>        send SNI extension\n"
+          "  --names <n>                cycle through n servernames: "
+              "<i>.<name>\n"
+          "  --stapling                 request OCSP staple\n"
+          "  --resume                   resume the first session\n"
+          "  --pid <pid>                report CPU of bud's process, could "
+              "be repeated\n",
+          name);
+}
+
+
+int bud_bench_connect(bud_bench_t* bench) {
+  int r;
+  bud_bench_conn_t* conn;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return -1;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->bench = bench;
+  conn->start = uv_hrtime();
+  r = uv_tcp_init(bench->loop, &conn->tcp);
+  if (r != 0) {
+    free(conn);
+    return r;
+  }
+  conn->tcp.data = conn;
+  bench->active++;
+
+  r = uv_tcp_connect(&conn->connect,
+                     &conn->tcp,
+                     (struct sockaddr*) &bench->addr,
+                     bud_bench_connect_cb);
+  if (r != 0)
+    bud_bench_done(conn, 0);
+  return 0;
+}
+
+
+void bud_bench_connect_cb(uv_connect_t* req, int status) {
+  bud_bench_conn_t* conn;
+  bud_bench_t* bench;
+  char name[256];
+
+  conn = container_of(req, bud_bench_conn_t, connect);
+  bench = conn->bench;
+  if (status != 0)
+    return bud_bench_done(conn, 0);
+
+  uv_tcp_nodelay(&conn->tcp, 1);
+  conn->ssl = SSL_new(bench->ctx);
+  conn->in = BIO_new(BIO_s_mem());
+  conn->out = BIO_new(BIO_s_mem());
+  if (conn->ssl == NULL || conn->in == NULL || conn->out == NULL)
+    return bud_bench_done(conn, 0);
+
+  /* SSL owns BIOs now */
+  SSL_set_bio(conn->ssl, conn->in, conn->out);
+  conn->in = NULL;
+  conn->out = NULL;
+  SSL_set_connect_state(conn->ssl);
+  if (bench->names != 0) {
+    /* Distinct names miss the caches, and don't share lookups in flight */
+    snprintf(name,
+             sizeof(name),
+             "%d.%s",
+             bench->next_name++ % bench->names,
+             bench->servername);
+    SSL_set_tlsext_host_name(conn->ssl, name);
+  } else if (bench->servername != NULL) {
+    SSL_set_tlsext_host_name(conn->ssl, bench->servername);
+  }
+  if (bench->stapling)
+    SSL_set_tlsext_status_type(conn->ssl, TLSEXT_STATUSTYPE_ocsp);
+  if (bench->resume && bench->session != NULL)
+    SSL_set_session(conn->ssl, bench->session);
+
+  if (uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_bench_alloc_cb,
+                    bud_bench_read_cb) != 0) {
+    return bud_bench_done(conn, 0);
+  }
+
+  bud_bench_cycle(conn);
+}
+
+
+void bud_bench_alloc_cb(uv_handle_t* handle,
+                        size_t suggested_size,
+                        uv_buf_t* buf) {
+  bud_bench_conn_t* conn;
+
+  conn = handle->data;
+  *buf = uv_buf_init(conn->buf, sizeof(conn->buf));
+}
+
+
+void bud_bench_read_cb(uv_stream_t* stream,
+                       ssize_t nread,
+                       const uv_buf_t* buf) {
+  bud_bench_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return bud_bench_done(conn, 0);
+
+  BIO_write(SSL_get_rbio(conn->ssl), buf->base, nread);
+  bud_bench_cycle(conn);
+}
+
+
+int bud_bench_cycle(bud_bench_conn_t* conn) {
+  int r;
+  int err;
+  bud_bench_t* bench;
+  const unsigned char* staple;
+
+  bench = conn->bench;
+  r = SSL_do_handshake(conn->ssl);
+  if (bud_bench_flush(conn) != 0) {
+    bud_bench_done(conn, 0);
+    return -1;
+  }
+
+  if (r != 1) {
+    err = SSL_get_error(conn->ssl, r);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+      return 0;
+
+    ERR_clear_error();
+    bud_bench_done(conn, 0);
+    return -1;
+  }
+
+  if (bench->stapling &&
+      SSL_get_tlsext_status_ocsp_resp(conn->ssl, &staple) > 0) {
+    bench->stapled++;
+  }
+  if (bench->resume && bench->session == NULL)
+    bench->session = SSL_get1_session(conn->ssl);
+
+  bud_bench_done(conn, 1);
+  return 0;
+}
+
+
+int bud_bench_flush(bud_bench_conn_t* conn) {
+  int r;
+  char* data;
+  long len;
+  uv_write_t* req;
+  uv_buf_t buf;
+
+  len = BIO_pending(SSL_get_wbio(conn->ssl));
+  if (len <= 0)
+    return 0;
+
+  /* Request and data are freed together in write_cb */
+  req = malloc(sizeof(*req) + len);
+  if (req == NULL)
+    return -1;
+  data = (char*) (req + 1);
+  BIO_read(SSL_get_wbio(conn->ssl), data, len);
+
+  buf = uv_buf_init(data, len);
+  r = uv_write(req, (uv_stream_t*) &conn->tcp, &buf, 1, bud_bench_write_cb);
+  if (r != 0) {
+    free(req);
+    return -1;
+  }
+  return 0;
+}
+
+
+void bud_bench_write_cb(uv_write_t* req, int status) {
+  free(req);
+}
+
+
+void bud_bench_done(bud_bench_conn_t* conn, int success) {
+  bud_bench_t* bench;
+  uint64_t latency;
+
+  bench = conn->bench;
+  latency = (uv_hrtime() - conn->start) / 1000;
+  if (!success) {
+    bench->errors++;
+  } else if (SSL_session_reused(conn->ssl)) {
+    bench->resumed++;
+    bud_bench_samples_add(&bench->resumed_latency, latency);
+  } else {
+    bench->full++;
+    bud_bench_samples_add(&bench->full_latency, latency);
+  }
+
+  uv_close((uv_handle_t*) &conn->tcp, bud_bench_close_cb);
+}
+
+
+void bud_bench_close_cb(uv_handle_t* handle) {
+  bud_bench_conn_t* conn;
+  bud_bench_t* bench;
+
+  conn = handle->data;
+  bench = conn->bench;
+  if (conn->ssl != NULL)
+    SSL_free(conn->ssl);
+  if (conn->in != NULL)
+    BIO_free(conn->in);
+  if (conn->out != NULL)
+    BIO_free(conn->out);
+  free(conn);
+
+  /* Keep `concurrency` connections in flight */
+  bench->active--;
+  if (!bench->stopped)
+    bud_bench_connect(bench);
+}
+
+
+void bud_bench_timer_cb(uv_timer_t* handle, int status) {
+  bud_bench_t* bench;
+
+  /* Let connections in flight finish, the loop exits after the last one */
+  bench = container_of(handle, bud_bench_t, timer);
+  bench->stopped = 1;
+  uv_close((uv_handle_t*) handle, NULL);
+}
+
+
+void bud_bench_report(bud_bench_t* bench) {
+  double elapsed;
+  uint64_t total;
+  uint64_t self;
+  uint64_t pids;
+
+  elapsed = (uv_hrtime() - bench->start) / 1e9;
+  total = bench->full + bench->resumed;
+  bud_bench_cpu_elapsed(&bench->cpu, &self, &pids);
+
+  fprintf(stdout,
+          "duration: %.2fs, concurrency: %d\n",
+          elapsed,
+          bench->concurrency);
+  fprintf(stdout,
+          "handshakes: full=%llu (%.1f/s) resumed=%llu (%.1f/s) "
+              "errors=%llu\n",
+          (unsigned long long) bench->full,
+          bench->full / elapsed,
+          (unsigned long long) bench->resumed,
+          bench->resumed / elapsed,
+          (unsigned long long) bench->errors);
+  if (bench->stapling) {
+    fprintf(stdout,
+            "stapled: %llu\n",
+            (unsigned long long) bench->stapled);
+  }
+  bud_bench_samples_print(&bench->full_latency, "full latency");
+  bud_bench_samples_print(&bench->resumed_latency, "resumed latency");
+
+  if (total == 0)
+    return;
+  fprintf(stdout,
+          "cpu per handshake (us): bench=%.1f",
+          (double) self / total);
+  if (bench->cpu.pid_count != 0)
+    fprintf(stdout, " bud=%.1f", (double) pids / total);
+  fprintf(stdout, "\n");
+}
@@ -0,0 +1,997 @@
+#include <getopt.h>  /* getopt_long */
+#include <signal.h>  /* SIGINT, SIGTERM */
+#include <stdio.h>  /* fprintf, fopen, fread */
+#include <stdlib.h>  /* malloc, realloc, free, atoi, rand, strtol */
+#include <string.h>  /* memset, memcpy, memmove, memcmp */
+#include <strings.h>  /* strncasecmp */
+
+#include "uv.h"
+#include "openssl/bio.h"
+#include "openssl/err.h"
+#include "openssl/evp.h"
+#include "openssl/pem.h"
+#include "openssl/x509.h"
+
+#include "common.h"
+#include "queue.h"
+
+/*
+ * Mock SNI and OCSP stapling backend for benchmarks of bud's lookups. Speaks
+ * both protocols of README.md on one port (binary frames start with a zero
+ * byte, HTTP requests don't), and answers every servername with the same
+ * in-memory certificate chain and key, every stapling request with the same
+ * OCSP response (404 without `--ocsp`).
+ *
+ * Responses are delayed by `latency` ms plus up to `jitter` ms, `slow`
+ * percent of them by `slow-latency` ms instead (stragglers, see `hedge`).
+ * `miss`, `error` and `drop` percent of requests get a 404, a 500 or a
+ * closed connection. Totals are printed on SIGINT and SIGTERM.
+ */
+
+/* Longest HTTP request head, and largest binary frame */
+#define BUD_MOCK_MAX_HEAD 8192
+#define BUD_MOCK_MAX_FRAME (4 * 1024 * 1024)
+
+/* See "Binary lookup protocol" in README.md */
+#define BUD_MOCK_HEADER_SIZE 9
+#define BUD_MOCK_REPLY_SIZE (BUD_MOCK_HEADER_SIZE + 10)
+#define BUD_MOCK_RECORD_SIZE 5
+
+typedef enum bud_mock_proto_e bud_mock_proto_t;
+typedef enum bud_mock_type_e bud_mock_type_t;
+typedef struct bud_mock_s bud_mock_t;
+typedef struct bud_mock_conn_s bud_mock_conn_t;
+typedef struct bud_mock_reply_s bud_mock_reply_t;
+
+enum bud_mock_proto_e {
+  kBudMockUnknown,
+  kBudMockHTTP,
+  kBudMockBinary
+};
+
+/* Same values as the request types of the binary protocol */
+enum bud_mock_type_e {
+  kBudMockOther = 0x0,
+  kBudMockSNI = 0x1,
+  kBudMockStapling = 0x2
+};
+
+/* Records of the responses */
+enum bud_mock_tag_e {
+  kBudMockTagCert = 0x2,
+  kBudMockTagKey = 0x3,
+  kBudMockTagOCSP = 0x4
+};
+
+struct bud_mock_s {
+  uv_loop_t* loop;
+  struct sockaddr_in addr;
+  uv_tcp_t server;
+  uv_signal_t sigint;
+  uv_signal_t sigterm;
+
+  /* Options */
+  int latency;
+  int jitter;
+  int slow;
+  int slow_latency;
+  int miss;
+  int error;
+  int drop;
+
+  /* Bodies of 200 responses: JSON for HTTP, records for binary */
+  char* sni_json;
+  size_t sni_json_len;
+  char* sni_records;
+  size_t sni_records_len;
+  char* ocsp_json;
+  size_t ocsp_json_len;
+  char* ocsp_records;
+  size_t ocsp_records_len;
+
+  /* Results */
+  uint64_t start;
+  uint64_t connections;
+  uint64_t sni;
+  uint64_t stapling;
+  uint64_t misses;
+  uint64_t errors;
+  uint64_t drops;
+};
+
+struct bud_mock_conn_s {
+  bud_mock_t* mock;
+  uv_tcp_t tcp;
+  bud_mock_proto_t proto;
+  int closed;
+
+  /* The socket and every reply that isn't freed yet */
+  int refs;
+
+  /* Replies in order of requests, HTTP ones are written in that order */
+  QUEUE replies;
+
+  /* Unparsed input */
+  char* buf;
+  size_t len;
+  size_t cap;
+};
+
+struct bud_mock_reply_s {
+  bud_mock_conn_t* conn;
+  QUEUE member;
+  uv_timer_t timer;
+  uv_write_t req;
+  int ready;
+  int drop;
+
+  /* Status line and headers or frame header, the body is shared */
+  char head[128];
+  size_t head_len;
+  const char* body;
+  size_t body_len;
+};
+
+static void bud_mock_usage(const char* name);
+static int bud_mock_load(bud_mock_t* mock,
+                         const char* cert,
+                         const char* key,
+                         const char* ocsp);
+static int bud_mock_append(char** buf,
+                           size_t* len,
+                           const void* data,
+                           size_t size);
+static int bud_mock_append_record(char** buf,
+                                  size_t* len,
+                                  int tag,
+                                  const char* data,
+                                  size_t size);
+static char* bud_mock_json(const char* fmt,
+                           const char* a,
+                           size_t a_len,
+                           const char* b,
+                           size_t b_len,
+                           size_t* size);
+static int bud_mock_serve(bud_mock_t* mock);
+static void bud_mock_connection_cb(uv_stream_t* server, int status);
+static void bud_mock_alloc_cb(uv_handle_t* handle,
+                              size_t suggested_size,
+                              uv_buf_t* buf);
+static void bud_mock_read_cb(uv_stream_t* stream,
+                             ssize_t nread,
+                             const uv_buf_t* buf);
+static int bud_mock_parse(bud_mock_conn_t* conn);
+static int bud_mock_parse_http(bud_mock_conn_t* conn);
+static int bud_mock_parse_binary(bud_mock_conn_t* conn);
+static bud_mock_reply_t* bud_mock_reply_new(bud_mock_conn_t* conn,
+                                            bud_mock_type_t type,
+                                            int* status);
+static void bud_mock_reply_http(bud_mock_reply_t* reply,
+                                bud_mock_type_t type,
+                                int status);
+static void bud_mock_reply_binary(bud_mock_reply_t* reply,
+                                  bud_mock_type_t type,
+                                  uint32_t id,
+                                  int status);
+static void bud_mock_reply_timer_cb(uv_timer_t* handle, int status);
+static void bud_mock_flush(bud_mock_conn_t* conn);
+static void bud_mock_write_cb(uv_write_t* req, int status);
+static void bud_mock_reply_free(bud_mock_reply_t* reply);
+static void bud_mock_reply_close_cb(uv_handle_t* handle);
+static void bud_mock_close(bud_mock_conn_t* conn);
+static void bud_mock_close_cb(uv_handle_t* handle);
+static void bud_mock_unref(bud_mock_conn_t* conn);
+static void bud_mock_signal_cb(uv_signal_t* handle, int signum);
+static void bud_mock_report(bud_mock_t* mock);
+static void bud_mock_write_uint32(char* out, uint32_t value);
+static uint32_t bud_mock_read_uint32(const char* data);
+
+
+int main(int argc, char** argv) {
+  int c;
+  int index;
+  const char* host;
+  int port;
+  const char* cert;
+  const char* key;
+  const char* ocsp;
+  bud_mock_t mock;
+
+  struct option long_options[] = {
+    { "host", 1, NULL, 'h' },
+    { "port", 1, NULL, 'p' },
+    { "cert", 1, NULL, 1000 },
+    { "key", 1, NULL, 1001 },
+    { "ocsp", 1, NULL, 1002 },
+    { "latency", 1, NULL, 1003 },
+    { "jitter", 1, NULL, 1004 },
+    { "slow", 1, NULL, 1005 },
+    { "slow-latency", 1, NULL, 1006 },
+    { "miss", 1, NULL, 1007 },
+    { "error", 1, NULL, 1008 },
+    { "drop", 1, NULL, 1009 },
+    { "help", 0, NULL, 1010 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  memset(&mock, 0, sizeof(mock));
+  host = "127.0.0.1";
+  port = 9000;
+  cert = "keys/cert.pem";
+  key = "keys/key.pem";
+  ocsp = NULL;
+  mock.slow_latency = 200;
+
+  for (;;) {
+    index = 0;
+    c = getopt_long(argc, argv, "h:p:", long_options, &index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 1000:
+        cert = optarg;
+        break;
+      case 1001:
+        key = optarg;
+        break;
+      case 1002:
+        ocsp = optarg;
+        break;
+      case 1003:
+        mock.latency = atoi(optarg);
+        break;
+      case 1004:
+        mock.jitter = atoi(optarg);
+        break;
+      case 1005:
+        mock.slow = atoi(optarg);
+        break;
+      case 1006:
+        mock.slow_latency = atoi(optarg);
+        break;
+      case 1007:
+        mock.miss = atoi(optarg);
+        break;
+      case 1008:
+        mock.error = atoi(optarg);
+        break;
+      case 1009:
+        mock.drop = atoi(optarg);
+        break;
+      case 1010:
+        bud_mock_usage(argv[0]);
+        return 0;
+      default:
+        bud_mock_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (mock.latency < 0 || mock.jitter < 0 || mock.slow_latency < 0) {
+    bud_mock_usage(argv[0]);
+    return 1;
+  }
+
+  if (uv_ip4_addr(host, port, &mock.addr) != 0) {
+    fprintf(stderr, "Invalid host: %s\n", host);
+    return 1;
+  }
+
+  OpenSSL_add_all_algorithms();
+  ERR_load_crypto_strings();
+  if (bud_mock_load(&mock, cert, key, ocsp) != 0)
+    return 1;
+
+  mock.loop = uv_default_loop();
+  if (bud_mock_serve(&mock) != 0)
+    return 1;
+  if (uv_signal_init(mock.loop, &mock.sigint) != 0 ||
+      uv_signal_start(&mock.sigint, bud_mock_signal_cb, SIGINT) != 0 ||
+      uv_signal_init(mock.loop, &mock.sigterm) != 0 ||
+      uv_signal_start(&mock.sigterm, bud_mock_signal_cb, SIGTERM) != 0) {
+    fprintf(stderr, "Failed to start signal handlers\n");
+    return 1;
+  }
+  mock.sigint.data = &mock;
+  mock.sigterm.data = &mock;
+
+  mock.start = uv_hrtime();
+  uv_run(mock.loop, UV_RUN_DEFAULT);
+  return 0;
+}
+
+
+void bud_mock_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -h, --host <ip>            address to listen on (127.0.0.1)\n"
+          "  -p, --port <port>          (9000)\n"
+          "  --cert <file>              PEM certificate and intermediates "
+              "(keys/cert.pem)\n"
+          "  --key <file>               PEM private key (keys/key.pem)\n"
+          "  --ocsp <file>              DER OCSP response to staple\n"
+          "  --latency <ms>             delay of every response (0)\n"
+          "  --jitter <ms>              random extra delay, up to (0)\n"
+          "  --slow <percent>           responses delayed by --slow-latency "
+              "instead (0)\n"
+          "  --slow-latency <ms>        (200)\n"
+          "  --miss <percent>           requests answered with 404 (0)\n"
+          "  --error <percent>          requests answered with 500 (0)\n"
+          "  --drop <percent>           requests that close the connection "
+              "(0)\n",
+          name);
+}
+
+
+int bud_mock_load(bud_mock_t* mock,
+                  const char* cert,
+                  const char* key,
+                  const char* ocsp) {
+  BIO* bio;
+  X509* x509;
+  EVP_PKEY* pkey;
+  FILE* fp;
+  unsigned char* der;
+  char* chain;
+  size_t chain_len;
+  char* pkey_der;
+  size_t pkey_len;
+  char* resp;
+  size_t resp_len;
+  char buf[4096];
+  size_t read;
+  int len;
+  int r;
+
+  chain = NULL;
+  chain_len = 0;
+  pkey_der = NULL;
+  pkey_len = 0;
+  resp = NULL;
+  resp_len = 0;
+  r = -1;
+
+  /* Certificate followed by its intermediates, back to back */
+  bio = BIO_new_file(cert, "r");
+  if (bio == NULL) {
+    fprintf(stderr, "Failed to open --cert: %s\n", cert);
+    goto done;
+  }
+  while ((x509 = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+    der = NULL;
+    len = i2d_X509(x509, &der);
+    X509_free(x509);
+    if (len <= 0 || bud_mock_append(&chain, &chain_len, der, len) != 0) {
+      OPENSSL_free(der);
+      BIO_free_all(bio);
+      goto done;
+    }
+    OPENSSL_free(der);
+  }
+  BIO_free_all(bio);
+  ERR_clear_error();
+  if (chain_len == 0) {
+    fprintf(stderr, "No certificates in --cert: %s\n", cert);
+    goto done;
+  }
+
+  bio = BIO_new_file(key, "r");
+  pkey = bio == NULL ? NULL : PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+  if (bio != NULL)
+    BIO_free_all(bio);
+  if (pkey == NULL) {
+    fprintf(stderr, "Failed to load --key: %s\n", key);
+    goto done;
+  }
+  der = NULL;
+  len = i2d_PrivateKey(pkey, &der);
+  EVP_PKEY_free(pkey);
+  if (len <= 0 || bud_mock_append(&pkey_der, &pkey_len, der, len) != 0) {
+    OPENSSL_free(der);
+    goto done;
+  }
+  OPENSSL_free(der);
+
+  /* Served as is, bud checks it against the certificate */
+  if (ocsp != NULL) {
+    fp = fopen(ocsp, "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "Failed to open --ocsp: %s\n", ocsp);
+      goto done;
+    }
+    while ((read = fread(buf, 1, sizeof(buf), fp)) != 0) {
+      if (bud_mock_append(&resp, &resp_len, buf, read) != 0) {
+        fclose(fp);
+        goto done;
+      }
+    }
+    fclose(fp);
+  }
+
+  /* Base64 of DER in JSON, raw DER in records */
+  mock->sni_json = bud_mock_json("{\"cert\":\"%s\",\"key\":\"%s\"}",
+                                 chain,
+                                 chain_len,
+                                 pkey_der,
+                                 pkey_len,
+                                 &mock->sni_json_len);
+  if (mock->sni_json == NULL ||
+      bud_mock_append_record(&mock->sni_records,
+                             &mock->sni_records_len,
+                             kBudMockTagCert,
+                             chain,
+                             chain_len) != 0 ||
+      bud_mock_append_record(&mock->sni_records,
+                             &mock->sni_records_len,
+                             kBudMockTagKey,
+                             pkey_der,
+                             pkey_len) != 0) {
+    goto done;
+  }
+  if (resp != NULL) {
+    mock->ocsp_json = bud_mock_json("{\"response\":\"%s\"}",
+                                    resp,
+                                    resp_len,
+                                    NULL,
+                                    0,
+                                    &mock->ocsp_json_len);
+    if (mock->ocsp_json == NULL ||
+        bud_mock_append_record(&mock->ocsp_records,
+                               &mock->ocsp_records_len,
+                               kBudMockTagOCSP,
+                               resp,
+                               resp_len) != 0) {
+      goto done;
+    }
+  }
+  r = 0;
+
+done:
+  if (r != 0)
+    fprintf(stderr, "Failed to prepare responses\n");
+  free(chain);
+  free(pkey_der);
+  free(resp);
+  return r;
+}
+
+
+int bud_mock_append(char** buf, size_t* len, const void* data, size_t size) {
+  char* res;
+
+  res = realloc(*buf, *len + size);
+  if (res == NULL)
+    return -1;
+  memcpy(res + *len, data, size);
+  *buf = res;
+  *len += size;
+  return 0;
+}
+
+
+int bud_mock_append_record(char** buf,
+                           size_t* len,
+                           int tag,
+                           const char* data,
+                           size_t size) {
+  char header[BUD_MOCK_RECORD_SIZE];
+
+  header[0] = tag;
+  bud_mock_write_uint32(header + 1, size);
+  if (bud_mock_append(buf, len, header, sizeof(header)) != 0)
+    return -1;
+  return bud_mock_append(buf, len, data, size);
+}
+
+
+/* `fmt` with one or two `%s`, replaced by base64 of `a` and `b` */
+char* bud_mock_json(const char* fmt,
+                    const char* a,
+                    size_t a_len,
+                    const char* b,
+                    size_t b_len,
+                    size_t* size) {
+  unsigned char* a64;
+  unsigned char* b64;
+  char* res;
+  int len;
+
+  a64 = malloc((a_len + 2) / 3 * 4 + 1);
+  b64 = malloc((b_len + 2) / 3 * 4 + 1);
+  res = NULL;
+  if (a64 == NULL || b64 == NULL)
+    goto done;
+  EVP_EncodeBlock(a64, (const unsigned char*) a, a_len);
+  EVP_EncodeBlock(b64, (const unsigned char*) b, b_len);
+
+  len = snprintf(NULL, 0, fmt, a64, b64);
+  res = malloc(len + 1);
+  if (res == NULL)
+    goto done;
+  snprintf(res, len + 1, fmt, a64, b64);
+  *size = len;
+
+done:
+  free(a64);
+  free(b64);
+  return res;
+}
+
+
+int bud_mock_serve(bud_mock_t* mock) {
+  int r;
+
+  r = uv_tcp_init(mock->loop, &mock->server);
+  if (r == 0)
+    r = uv_tcp_bind(&mock->server, (struct sockaddr*) &mock->addr);
+  if (r == 0) {
+    r = uv_listen((uv_stream_t*) &mock->server,
+                  1024,
+                  bud_mock_connection_cb);
+  }
+  if (r != 0) {
+    fprintf(stderr, "Failed to listen: %s\n", uv_strerror(r));
+    return -1;
+  }
+
+  mock->server.data = mock;
+  return 0;
+}
+
+
+void bud_mock_connection_cb(uv_stream_t* server, int status) {
+  bud_mock_conn_t* conn;
+
+  if (status != 0)
+    return;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->mock = server->data;
+  conn->refs = 1;
+  QUEUE_INIT(&conn->replies);
+  if (uv_tcp_init(conn->mock->loop, &conn->tcp) != 0) {
+    free(conn);
+    return;
+  }
+  conn->tcp.data = conn;
+  conn->mock->connections++;
+
+  if (uv_accept(server, (uv_stream_t*) &conn->tcp) != 0 ||
+      uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_mock_alloc_cb,
+                    bud_mock_read_cb) != 0) {
+    return bud_mock_close(conn);
+  }
+  uv_tcp_nodelay(&conn->tcp, 1);
+}
+
+
+void bud_mock_alloc_cb(uv_handle_t* handle,
+                       size_t suggested_size,
+                       uv_buf_t* buf) {
+  bud_mock_conn_t* conn;
+  size_t cap;
+  char* res;
+
+  /* Input is appended to the unparsed tail */
+  conn = handle->data;
+  if (conn->cap - conn->len < 16384) {
+    cap = conn->cap == 0 ? 65536 : conn->cap * 2;
+    res = realloc(conn->buf, cap);
+    if (res == NULL) {
+      *buf = uv_buf_init(NULL, 0);
+      return;
+    }
+    conn->buf = res;
+    conn->cap = cap;
+  }
+  *buf = uv_buf_init(conn->buf + conn->len, conn->cap - conn->len);
+}
+
+
+void bud_mock_read_cb(uv_stream_t* stream,
+                      ssize_t nread,
+                      const uv_buf_t* buf) {
+  bud_mock_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return bud_mock_close(conn);
+
+  conn->len += nread;
+  if (bud_mock_parse(conn) != 0)
+    return bud_mock_close(conn);
+  bud_mock_flush(conn);
+}
+
+
+int bud_mock_parse(bud_mock_conn_t* conn) {
+  if (conn->proto == kBudMockUnknown && conn->len != 0)
+    conn->proto = conn->buf[0] == 0 ? kBudMockBinary : kBudMockHTTP;
+
+  if (conn->proto == kBudMockBinary)
+    return bud_mock_parse_binary(conn);
+  return bud_mock_parse_http(conn);
+}
+
+
+int bud_mock_parse_http(bud_mock_conn_t* conn) {
+  bud_mock_reply_t* reply;
+  bud_mock_type_t type;
+  const char* line;
+  size_t off;
+  size_t head;
+  size_t line_end;
+  long body;
+  int status;
+
+  /* Pipelined requests, one at a time */
+  for (;;) {
+    head = 0;
+    line_end = 0;
+    body = 0;
+    for (off = 0; off + 1 < conn->len; off++) {
+      if (conn->buf[off] != '\r' || conn->buf[off + 1] != '\n')
+        continue;
+      if (line_end == 0)
+        line_end = off;
+
+      if (off + 3 < conn->len &&
+          conn->buf[off + 2] == '\r' &&
+          conn->buf[off + 3] == '\n') {
+        head = off + 4;
+        break;
+      }
+
+      /* Only POSTs of stapling have a body */
+      line = conn->buf + off + 2;
+      if (conn->len - off - 2 > 15 &&
+          strncasecmp(line, "Content-Length:", 15) == 0) {
+        body = strtol(line + 15, NULL, 10);
+      }
+    }
+    if (head == 0)
+      return conn->len > BUD_MOCK_MAX_HEAD ? -1 : 0;
+    if (body < 0 || body > BUD_MOCK_MAX_FRAME)
+      return -1;
+    if (conn->len < head + body)
+      return 0;
+
+    /* Stapling first, servernames may not have slashes */
+    type = kBudMockOther;
+    for (off = 0; off < line_end; off++) {
+      line = conn->buf + off;
+      if (line_end - off >= 10 && memcmp(line, "/stapling/", 10) == 0) {
+        type = kBudMockStapling;
+        break;
+      }
+      if (line_end - off >= 5 && memcmp(line, "/sni/", 5) == 0) {
+        type = kBudMockSNI;
+        break;
+      }
+    }
+
+    reply = bud_mock_reply_new(conn, type, &status);
+    if (reply == NULL)
+      return -1;
+    bud_mock_reply_http(reply, type, status);
+
+    conn->len -= head + body;
+    memmove(conn->buf, conn->buf + head + body, conn->len);
+  }
+}
+
+
+int bud_mock_parse_binary(bud_mock_conn_t* conn) {
+  bud_mock_reply_t* reply;
+  bud_mock_type_t type;
+  uint32_t len;
+  uint32_t id;
+  size_t off;
+  int status;
+
+  /* Records of requests are not needed, every name has the same answer */
+  off = 0;
+  while (conn->len - off >= BUD_MOCK_HEADER_SIZE) {
+    len = bud_mock_read_uint32(conn->buf + off);
+    if (len < BUD_MOCK_HEADER_SIZE - 4 || len > BUD_MOCK_MAX_FRAME)
+      return -1;
+    if (conn->len - off < 4 + len)
+      break;
+
+    id = bud_mock_read_uint32(conn->buf + off + 4);
+    type = (unsigned char) conn->buf[off + 8];
+    if (type != kBudMockSNI && type != kBudMockStapling)
+      type = kBudMockOther;
+
+    reply = bud_mock_reply_new(conn, type, &status);
+    if (reply == NULL)
+      return -1;
+    bud_mock_reply_binary(reply, type, id, status);
+    off += 4 + len;
+  }
+
+  conn->len -= off;
+  memmove(conn->buf, conn->buf + off, conn->len);
+  return 0;
+}
+
+
+bud_mock_reply_t* bud_mock_reply_new(bud_mock_conn_t* conn,
+                                     bud_mock_type_t type,
+                                     int* status) {
+  bud_mock_t* mock;
+  bud_mock_reply_t* reply;
+  uint64_t delay;
+
+  mock = conn->mock;
+  reply = malloc(sizeof(*reply));
+  if (reply == NULL)
+    return NULL;
+
+  memset(reply, 0, sizeof(*reply));
+  reply->conn = conn;
+  if (uv_timer_init(mock->loop, &reply->timer) != 0) {
+    free(reply);
+    return NULL;
+  }
+  conn->refs++;
+  QUEUE_INSERT_TAIL(&conn->replies, &reply->member);
+
+  if (type == kBudMockSNI)
+    mock->sni++;
+  else if (type == kBudMockStapling)
+    mock->stapling++;
+
+  /* Injected failures first, then regular 404s */
+  *status = 200;
+  if (rand() % 100 < mock->drop) {
+    reply->drop = 1;
+    mock->drops++;
+  } else if (rand() % 100 < mock->error) {
+    *status = 500;
+    mock->errors++;
+  } else if (type == kBudMockOther ||
+             (type == kBudMockStapling && mock->ocsp_json == NULL) ||
+             rand() % 100 < mock->miss) {
+    *status = 404;
+    mock->misses++;
+  }
+
+  delay = mock->latency;
+  if (mock->jitter != 0)
+    delay += rand() % (mock->jitter + 1);
+  if (rand() % 100 < mock->slow)
+    delay = mock->slow_latency;
+  if (uv_timer_start(&reply->timer, bud_mock_reply_timer_cb, delay, 0) != 0)
+    reply->ready = 1;
+
+  return reply;
+}
+
+
+void bud_mock_reply_http(bud_mock_reply_t* reply,
+                         bud_mock_type_t type,
+                         int status) {
+  bud_mock_t* mock;
+  const char* reason;
+
+  mock = reply->conn->mock;
+  if (status == 200 && type == kBudMockSNI) {
+    reply->body = mock->sni_json;
+    reply->body_len = mock->sni_json_len;
+  } else if (status == 200) {
+    reply->body = mock->ocsp_json;
+    reply->body_len = mock->ocsp_json_len;
+  } else {
+    reply->body = "{}";
+    reply->body_len = 2;
+  }
+
+  if (status == 200)
+    reason = "OK";
+  else if (status == 404)
+    reason = "Not Found";
+  else
+    reason = "Internal Server Error";
+  reply->head_len = snprintf(reply->head,
+                             sizeof(reply->head),
+                             "HTTP/1.1 %d %s\r\n"
+                                 "Content-Type: application/json\r\n"
+                                 "Content-Length: %d\r\n"
+                                 "\r\n",
+                             status,
+                             reason,
+                             (int) reply->body_len);
+}
+
+
+void bud_mock_reply_binary(bud_mock_reply_t* reply,
+                           bud_mock_type_t type,
+                           uint32_t id,
+                           int status) {
+  bud_mock_t* mock;
+  char* out;
+
+  mock = reply->conn->mock;
+  if (status == 200 && type == kBudMockSNI) {
+    reply->body = mock->sni_records;
+    reply->body_len = mock->sni_records_len;
+  } else if (status == 200) {
+    reply->body = mock->ocsp_records;
+    reply->body_len = mock->ocsp_records_len;
+  }
+
+  /* Header, status, and no max-age or stale-while-revalidate */
+  out = reply->head;
+  bud_mock_write_uint32(out, BUD_MOCK_REPLY_SIZE - 4 + reply->body_len);
+  bud_mock_write_uint32(out + 4, id);
+  out[8] = type;
+  out[9] = (status >> 8) & 0xff;
+  out[10] = status & 0xff;
+  bud_mock_write_uint32(out + 11, 0xffffffff);
+  bud_mock_write_uint32(out + 15, 0xffffffff);
+  reply->head_len = BUD_MOCK_REPLY_SIZE;
+}
+
+
+void bud_mock_reply_timer_cb(uv_timer_t* handle, int status) {
+  bud_mock_reply_t* reply;
+
+  reply = container_of(handle, bud_mock_reply_t, timer);
+  reply->ready = 1;
+  bud_mock_flush(reply->conn);
+}
+
+
+void bud_mock_flush(bud_mock_conn_t* conn) {
+  bud_mock_reply_t* reply;
+  uv_buf_t bufs[2];
+  QUEUE* q;
+  QUEUE* next;
+
+  /* HTTP responses go in order, binary ones as soon as they are ready */
+  for (q = QUEUE_HEAD(&conn->replies);
+       !conn->closed && q != &conn->replies;
+       q = next) {
+    next = QUEUE_NEXT(q);
+    reply = QUEUE_DATA(q, bud_mock_reply_t, member);
+    if (!reply->ready) {
+      if (conn->proto == kBudMockHTTP)
+        break;
+      continue;
+    }
+
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
+    if (reply->drop) {
+      bud_mock_reply_free(reply);
+      return bud_mock_close(conn);
+    }
+
+    bufs[0] = uv_buf_init(reply->head, reply->head_len);
+    bufs[1] = uv_buf_init((char*) reply->body, reply->body_len);
+    if (uv_write(&reply->req,
+                 (uv_stream_t*) &conn->tcp,
+                 bufs,
+                 reply->body_len == 0 ? 1 : 2,
+                 bud_mock_write_cb) != 0) {
+      bud_mock_reply_free(reply);
+      return bud_mock_close(conn);
+    }
+  }
+}
+
+
+void bud_mock_write_cb(uv_write_t* req, int status) {
+  bud_mock_reply_t* reply;
+
+  reply = container_of(req, bud_mock_reply_t, req);
+  bud_mock_reply_free(reply);
+}
+
+
+void bud_mock_reply_free(bud_mock_reply_t* reply) {
+  QUEUE_REMOVE(&reply->member);
+  uv_close((uv_handle_t*) &reply->timer, bud_mock_reply_close_cb);
+}
+
+
+void bud_mock_reply_close_cb(uv_handle_t* handle) {
+  bud_mock_reply_t* reply;
+  bud_mock_conn_t* conn;
+
+  reply = container_of(handle, bud_mock_reply_t, timer);
+  conn = reply->conn;
+  free(reply);
+  bud_mock_unref(conn);
+}
+
+
+void bud_mock_close(bud_mock_conn_t* conn) {
+  QUEUE* q;
+
+  if (conn->closed)
+    return;
+  conn->closed = 1;
+
+  /* Writes in flight are cancelled, and free their replies */
+  while (!QUEUE_EMPTY(&conn->replies)) {
+    q = QUEUE_HEAD(&conn->replies);
+    bud_mock_reply_free(QUEUE_DATA(q, bud_mock_reply_t, member));
+  }
+  uv_close((uv_handle_t*) &conn->tcp, bud_mock_close_cb);
+}
+
+
+void bud_mock_close_cb(uv_handle_t* handle) {
+  bud_mock_unref(handle->data);
+}
+
+
+void bud_mock_unref(bud_mock_conn_t* conn) {
+  if (--conn->refs != 0)
+    return;
+
+  free(conn->buf);
+  free(conn);
+}
+
+
+void bud_mock_signal_cb(uv_signal_t* handle, int signum) {
+  bud_mock_report(handle->data);
+  exit(0);
+}
+
+
+void bud_mock_report(bud_mock_t* mock) {
+  double elapsed;
+
+  elapsed = (uv_hrtime() - mock->start) / 1e9;
+  fprintf(stdout,
+          "duration: %.2fs, connections: %llu\n",
+          elapsed,
+          (unsigned long long) mock->connections);
+  fprintf(stdout,
+          "requests: sni=%llu (%.1f/s) stapling=%llu (%.1f/s)\n",
+          (unsigned long long) mock->sni,
+          mock->sni / elapsed,
+          (unsigned long long) mock->stapling,
+          mock->stapling / elapsed);
+  fprintf(stdout,
+          "injected: misses=%llu errors=%llu drops=%llu\n",
+          (unsigned long long) mock->misses,
+          (unsigned long long) mock->errors,
+          (unsigned long long) mock->drops);
+  fflush(stdout);
+}
+
+
+void bud_mock_write_uint32(char* out, uint32_t value) {
+  out[0] = (value >> 24) & 0xff;
+  out[1] = (value >> 16) & 0xff;
+  out[2] = (value >> 8) & 0xff;
+  out[3] = value & 0xff;
+}
+
+
+uint32_t bud_mock_read_uint32(const char* data) {
+  const unsigned char* p;
+
+  p = (const unsigned char*) data;
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | p[3];
+}
@@ -0,0 +1,162 @@
+#!/bin/sh
+#
+# Run bud-bench against a temporary bud whose SNI (and, with OCSP, stapling)
+# lookups go to two bud-bench-lookup instances on 127.0.0.1 and 127.0.0.2.
+# Every scenario is run with the lookup cache on and off, for each of NAMES
+# distinct servernames: with one name and no cache the handshakes in flight
+# share one lookup (coalescing), distinct names can't. HTTP lookups are run
+# with and without `hedge`, against backends that answer SLOW percent of the
+# requests in SLOW_LATENCY ms. Each backend prints its request counts after
+# the scenario. Run from the repository root, after `make -C out/`.
+#
+# Tunables (environment):
+#   OUT           build directory (out/Release)
+#   PROTOCOLS     lookup protocols ("http binary")
+#   NAMES         distinct servernames to try ("1 10000")
+#   CACHE_SIZE    `sni.cache.size` when the cache is on (16384)
+#   HEDGE         `hedge` in ms when hedging is on (20)
+#   LATENCY       backend latency in ms (5)
+#   SLOW          percent of slow backend responses (5)
+#   SLOW_LATENCY  their latency in ms (200)
+#   MOCK_FLAGS    extra flags of bud-bench-lookup, e.g. "--error 1 --drop 1"
+#   OCSP          DER OCSP response for keys/cert.pem, enables stapling
+#   WORKERS       bud workers (1)
+#   DURATION      seconds per scenario (10)
+#   CLIENTS       handshakes in flight (64)
+
+set -e
+
+OUT=${OUT:-out/Release}
+PROTOCOLS=${PROTOCOLS:-"http binary"}
+NAMES=${NAMES:-"1 10000"}
+CACHE_SIZE=${CACHE_SIZE:-16384}
+HEDGE=${HEDGE:-20}
+LATENCY=${LATENCY:-5}
+SLOW=${SLOW:-5}
+SLOW_LATENCY=${SLOW_LATENCY:-200}
+MOCK_FLAGS=${MOCK_FLAGS:-}
+OCSP=${OCSP:-}
+WORKERS=${WORKERS:-1}
+DURATION=${DURATION:-10}
+CLIENTS=${CLIENTS:-64}
+
+FRONTEND_PORT=${FRONTEND_PORT:-11443}
+BACKEND_PORT=${BACKEND_PORT:-19001}
+LOOKUP_PORT=${LOOKUP_PORT:-19100}
+LOOKUP_HOSTS="127.0.0.1 127.0.0.2"
+CONFIG=`mktemp /tmp/bud-lookup.XXXXXX`
+BUD_PID=
+MOCK_PIDS=
+
+stapling=false
+bench_flags=
+mock_flags="--latency $LATENCY --slow $SLOW --slow-latency $SLOW_LATENCY"
+if [ -n "$OCSP" ]; then
+  stapling=true
+  bench_flags=--stapling
+  mock_flags="$mock_flags --ocsp $OCSP"
+fi
+
+cleanup() {
+  kill $BUD_PID $MOCK_PIDS 2>/dev/null || true
+  rm -f $CONFIG
+}
+trap cleanup EXIT INT TERM
+
+start_mocks() {
+  for host in $LOOKUP_HOSTS; do
+    $OUT/bud-bench-lookup --host $host --port $LOOKUP_PORT $mock_flags \
+        $MOCK_FLAGS &
+    MOCK_PIDS="$MOCK_PIDS $!"
+  done
+}
+
+# Each one prints its totals on SIGINT
+stop_mocks() {
+  for pid in $MOCK_PIDS; do
+    echo "-- lookup backend $pid"
+    kill -INT $pid 2>/dev/null || true
+    wait $pid 2>/dev/null || true
+  done
+  MOCK_PIDS=
+}
+
+start_bud() {
+  binary=false
+  [ $1 = binary ] && binary=true
+
+  lookup=$(cat <<JSON
+    "port": $LOOKUP_PORT,
+    "host": ["127.0.0.1", "127.0.0.2"],
+    "binary": $binary,
+    "hedge": $3,
+    "max_connections": 64,
+    "pipeline": 1
+JSON
+)
+
+  cat > $CONFIG <<JSON
+{
+  "workers": $WORKERS,
+  "log": { "level": "warning" },
+  "frontend": {
+    "port": $FRONTEND_PORT,
+    "host": "127.0.0.1",
+    "cert": "keys/cert.pem",
+    "key": "keys/key.pem",
+    "timeout": { "handshake": 0, "idle": 0 }
+  },
+  "backend": { "port": $BACKEND_PORT, "host": "127.0.0.1" },
+  "sni": {
+    "enabled": true,
+    "query": "/bud/sni/%s",
+$lookup,
+    "cache": { "size": $2 }
+  },
+  "stapling": {
+    "enabled": $stapling,
+    "query": "/bud/stapling/%s",
+$lookup
+  }
+}
+JSON
+
+  $OUT/bud --config $CONFIG &
+  BUD_PID=$!
+  sleep 1
+}
+
+stop_bud() {
+  kill $BUD_PID 2>/dev/null || true
+  wait $BUD_PID 2>/dev/null || true
+  BUD_PID=
+}
+
+run() {
+  echo "== $1"
+  start_mocks
+  start_bud $2 $3 $4
+  pids=
+  for pid in $BUD_PID `pgrep -P $BUD_PID`; do
+    pids="$pids --pid $pid"
+  done
+  $OUT/bud-bench --port $FRONTEND_PORT -d $DURATION -c $CLIENTS \
+      --servername bench.test --names $5 $bench_flags $pids
+  stop_bud
+  stop_mocks
+  echo
+}
+
+for proto in $PROTOCOLS; do
+  hedges=0
+  [ $proto = http ] && hedges="0 $HEDGE"
+
+  for names in $NAMES; do
+    for hedge in $hedges; do
+      for cache in $CACHE_SIZE 0; do
+        run "$proto, $names names, cache $cache, hedge $hedge" \
+            $proto $cache $hedge $names
+      done
+    done
+  done
+done
@@ -0,0 +1,655 @@
+#include <getopt.h>  /* getopt_long */
+#include <stdint.h>  /* uint8_t, uint64_t */
+#include <stdio.h>  /* fprintf */
+#include <stdlib.h>  /* malloc, free, atoi, qsort */
+#include <string.h>  /* memcmp, memcpy, memset, strcmp */
+
+#include "uv.h"
+#include "ringbuffer.h"
+
+#include "common.h"
+#include "error.h"
+#include "hello-parser.h"
+
+/*
+ * Microbenchmarks of the per-connection hot paths that don't need a network:
+ * ringbuffer writes/reads, ClientHello parsing, base64 of OCSP responses and
+ * URL escaping of OCSP/SNI requests. Every case checks its own result first,
+ * so a run doubles as a smoke test.
+ */
+
+#define BUD_MICRO_ROUNDS 5
+#define BUD_MICRO_QUICK_ROUNDS 1
+#define BUD_MICRO_QUICK_DIV 20
+#define BUD_MICRO_MAX_ROUNDS 64
+
+/* DER-encoded OCSP response with a single certificate and RSA signature */
+#define BUD_MICRO_OCSP_SIZE 1536
+#define BUD_MICRO_BURST_COUNT 256
+#define BUD_MICRO_HELLO_MAX 1024
+
+typedef struct bud_micro_s bud_micro_t;
+typedef struct bud_micro_case_s bud_micro_case_t;
+typedef struct bud_micro_writer_s bud_micro_writer_t;
+typedef int (*bud_micro_cb)(bud_micro_t* micro, void* arg, int iterations);
+
+struct bud_micro_s {
+  int rounds;
+  int quick;
+  const char* filter;
+
+  /* Keep the compiler from throwing the work away */
+  volatile uint64_t sink;
+
+  /* Inputs shared by the cases */
+  char hello[BUD_MICRO_HELLO_MAX];
+  size_t hello_len;
+  char ocsp[BUD_MICRO_OCSP_SIZE];
+  char* ocsp_b64;
+  size_t ocsp_b64_len;
+  char* scratch;
+  size_t bursts[BUD_MICRO_BURST_COUNT];
+  size_t bursts_total;
+};
+
+struct bud_micro_case_s {
+  const char* name;
+  bud_micro_cb cb;
+
+  /* Per-case argument, and bytes processed per iteration (0 - no MB/s) */
+  intptr_t arg;
+  size_t bytes;
+  int iterations;
+};
+
+struct bud_micro_writer_s {
+  char* data;
+  size_t len;
+};
+
+static void bud_micro_usage(const char* name);
+static int bud_micro_prepare(bud_micro_t* micro);
+static void bud_micro_build_hello(bud_micro_t* micro);
+static size_t bud_micro_u8(bud_micro_writer_t* w, uint8_t v);
+static size_t bud_micro_u16(bud_micro_writer_t* w, uint16_t v);
+static void bud_micro_u24_at(bud_micro_writer_t* w, size_t off, size_t v);
+static void bud_micro_u16_at(bud_micro_writer_t* w, size_t off, size_t v);
+static void bud_micro_bytes(bud_micro_writer_t* w, const char* v, size_t len);
+static int bud_micro_run(bud_micro_t* micro, bud_micro_case_t* c);
+static int bud_micro_cmp(const void* a, const void* b);
+static int bud_micro_ringbuffer(bud_micro_t* micro, void* arg, int iterations);
+static size_t bud_micro_ringbuffer_flush(bud_micro_t* micro,
+                                         ringbuffer* rb);
+static int bud_micro_hello(bud_micro_t* micro, void* arg, int iterations);
+static int bud_micro_b64_encode(bud_micro_t* micro, void* arg, int iterations);
+static int bud_micro_b64_decode(bud_micro_t* micro, void* arg, int iterations);
+static int bud_micro_escape(bud_micro_t* micro, void* arg, int iterations);
+
+enum {
+  kBudMicroRingMalloc,
+  kBudMicroRingPool,
+  kBudMicroRingLazy
+};
+
+static const char* bud_micro_servername = "www.example.com";
+
+/* Base64 of OCSP request, as it goes into `stapling.url` */
+static const char* bud_micro_ocsp_req =
+    "MFMwUTBPME0wSzAJBgUrDgMCGgUABBTqX7ZE3+xLqW+aRqvBv2Vz/8flwgQUUWUs3y9xzVxe"
+    "Qano6TF+fLsNW8ECEA+yS2DQQ5hQmtIw7wQ/Ah0=";
+
+
+int main(int argc, char** argv) {
+  int c;
+  int index;
+  int i;
+  int failed;
+  bud_micro_t micro;
+  bud_micro_case_t cases[] = {
+    { "ringbuffer/malloc", bud_micro_ringbuffer, kBudMicroRingMalloc, 0,
+      2000 },
+    { "ringbuffer/pool", bud_micro_ringbuffer, kBudMicroRingPool, 0, 2000 },
+    { "ringbuffer/lazy", bud_micro_ringbuffer, kBudMicroRingLazy, 0, 2000 },
+    { "hello/whole", bud_micro_hello, 0, 0, 200000 },
+    { "hello/1400", bud_micro_hello, 1400, 0, 200000 },
+    { "hello/64", bud_micro_hello, 64, 0, 100000 },
+    { "hello/1", bud_micro_hello, 1, 0, 20000 },
+    { "base64/encode", bud_micro_b64_encode, 0, BUD_MICRO_OCSP_SIZE, 200000 },
+    { "base64/decode", bud_micro_b64_decode, 0, BUD_MICRO_OCSP_SIZE, 200000 },
+    { "escape_url/ocsp", bud_micro_escape, 0, 0, 500000 },
+    { "escape_url/sni", bud_micro_escape, 1, 0, 500000 }
+  };
+
+  struct option long_options[] = {
+    { "rounds", 1, NULL, 'r' },
+    { "filter", 1, NULL, 'f' },
+    { "quick", 0, NULL, 'q' },
+    { "help", 0, NULL, 1000 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  memset(&micro, 0, sizeof(micro));
+  micro.rounds = BUD_MICRO_ROUNDS;
+
+  for (;;) {
+    index = 0;
+    c = getopt_long(argc, argv, "r:f:q", long_options, &index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'r':
+        micro.rounds = atoi(optarg);
+        break;
+      case 'f':
+        micro.filter = optarg;
+        break;
+      case 'q':
+        micro.quick = 1;
+        break;
+      case 1000:
+        bud_micro_usage(argv[0]);
+        return 0;
+      default:
+        bud_micro_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (micro.quick)
+    micro.rounds = BUD_MICRO_QUICK_ROUNDS;
+  if (micro.rounds <= 0 || micro.rounds > BUD_MICRO_MAX_ROUNDS) {
+    bud_micro_usage(argv[0]);
+    return 1;
+  }
+
+  if (bud_micro_prepare(&micro) != 0) {
+    fprintf(stderr, "Failed to prepare inputs\n");
+    return 1;
+  }
+
+  /* Payload sizes are known only after preparation */
+  for (i = 0; i < (int) ARRAY_SIZE(cases); i++) {
+    if (cases[i].cb == bud_micro_ringbuffer)
+      cases[i].bytes = micro.bursts_total;
+    else if (cases[i].cb == bud_micro_hello)
+      cases[i].bytes = micro.hello_len;
+  }
+
+  failed = 0;
+  for (i = 0; i < (int) ARRAY_SIZE(cases); i++) {
+    if (micro.filter != NULL && strstr(cases[i].name, micro.filter) == NULL)
+      continue;
+    if (bud_micro_run(&micro, &cases[i]) != 0)
+      failed = 1;
+  }
+
+  free(micro.ocsp_b64);
+  free(micro.scratch);
+  return failed;
+}
+
+
+void bud_micro_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  -r, --rounds <n>           repeat each case, report min and "
+              "median (5)\n"
+          "  -f, --filter <substring>   run only matching cases\n"
+          "  -q, --quick                one short round, for CI\n",
+          name);
+}
+
+
+int bud_micro_prepare(bud_micro_t* micro) {
+  size_t i;
+  uint32_t seed;
+
+  /* Pseudo-random, but the same on every run */
+  seed = 0x12345678;
+  for (i = 0; i < sizeof(micro->ocsp); i++) {
+    seed = seed * 1103515245 + 12345;
+    micro->ocsp[i] = (char) (seed >> 16);
+  }
+
+  micro->ocsp_b64_len = bud_base64_encoded_size(sizeof(micro->ocsp));
+  micro->ocsp_b64 = malloc(micro->ocsp_b64_len);
+  if (micro->ocsp_b64 == NULL)
+    return -1;
+  bud_base64_encode(micro->ocsp,
+                    sizeof(micro->ocsp),
+                    micro->ocsp_b64,
+                    micro->ocsp_b64_len);
+
+  /*
+   * Bursts like the ones frontend sees: mostly small records (requests,
+   * acks, interactive traffic) with occasional uploads spanning chunks.
+   */
+  micro->bursts_total = 0;
+  for (i = 0; i < ARRAY_SIZE(micro->bursts); i++) {
+    seed = seed * 1103515245 + 12345;
+    switch ((seed >> 16) % 8) {
+      case 0:
+        micro->bursts[i] = 64 * 1024;
+        break;
+      case 1:
+      case 2:
+        micro->bursts[i] = 16 * 1024 + (seed >> 8) % 1024;
+        break;
+      case 3:
+        micro->bursts[i] = 1;
+        break;
+      default:
+        micro->bursts[i] = 1 + (seed >> 4) % 1400;
+        break;
+    }
+    micro->bursts_total += micro->bursts[i];
+  }
+
+  micro->scratch = malloc(64 * 1024);
+  if (micro->scratch == NULL)
+    return -1;
+  memset(micro->scratch, 'x', 64 * 1024);
+
+  bud_micro_build_hello(micro);
+  return 0;
+}
+
+
+/*
+ * Browser-like ClientHello: session id, 16 ciphers, SNI, OCSP status
+ * request, groups, ALPN, signature algorithms, supported versions, an
+ * empty ticket and padding up to 512 bytes of handshake message.
+ */
+void bud_micro_build_hello(bud_micro_t* micro) {
+  static const uint16_t ciphers[] = {
+    0x1301, 0x1302, 0x1303, 0xc02b, 0xc02f, 0xc02c, 0xc030, 0xcca9,
+    0xcca8, 0xc013, 0xc014, 0x009c, 0x009d, 0x002f, 0x0035, 0x000a
+  };
+  static const uint16_t groups[] = { 0x001d, 0x0017, 0x0018 };
+  static const uint16_t sig_algs[] = {
+    0x0403, 0x0804, 0x0401, 0x0503, 0x0805, 0x0501, 0x0806, 0x0601
+  };
+  bud_micro_writer_t w;
+  size_t record;
+  size_t msg;
+  size_t exts;
+  size_t ext;
+  size_t i;
+  size_t name_len;
+
+  w.data = micro->hello;
+  w.len = 0;
+
+  /* Record and handshake headers, lengths are filled in the end */
+  bud_micro_u8(&w, 0x16);
+  bud_micro_u16(&w, 0x0301);
+  record = bud_micro_u16(&w, 0);
+  msg = bud_micro_u8(&w, 0x01);
+  bud_micro_u8(&w, 0);
+  bud_micro_u16(&w, 0);
+
+  bud_micro_u16(&w, 0x0303);
+  for (i = 0; i < 32; i++)
+    bud_micro_u8(&w, (uint8_t) i);
+  bud_micro_u8(&w, 32);
+  for (i = 0; i < 32; i++)
+    bud_micro_u8(&w, (uint8_t) (0xff - i));
+
+  bud_micro_u16(&w, sizeof(ciphers));
+  for (i = 0; i < ARRAY_SIZE(ciphers); i++)
+    bud_micro_u16(&w, ciphers[i]);
+  bud_micro_u8(&w, 1);
+  bud_micro_u8(&w, 0);
+
+  exts = bud_micro_u16(&w, 0);
+
+  name_len = strlen(bud_micro_servername);
+  bud_micro_u16(&w, 0x0000);
+  bud_micro_u16(&w, name_len + 5);
+  bud_micro_u16(&w, name_len + 3);
+  bud_micro_u8(&w, 0);
+  bud_micro_u16(&w, name_len);
+  bud_micro_bytes(&w, bud_micro_servername, name_len);
+
+  bud_micro_u16(&w, 0x0005);
+  bud_micro_u16(&w, 5);
+  bud_micro_u8(&w, 1);
+  bud_micro_u16(&w, 0);
+  bud_micro_u16(&w, 0);
+
+  bud_micro_u16(&w, 0x000a);
+  bud_micro_u16(&w, sizeof(groups) + 2);
+  bud_micro_u16(&w, sizeof(groups));
+  for (i = 0; i < ARRAY_SIZE(groups); i++)
+    bud_micro_u16(&w, groups[i]);
+
+  bud_micro_u16(&w, 0x000b);
+  bud_micro_u16(&w, 2);
+  bud_micro_u8(&w, 1);
+  bud_micro_u8(&w, 0);
+
+  bud_micro_u16(&w, 0x0023);
+  bud_micro_u16(&w, 0);
+
+  bud_micro_u16(&w, 0x0010);
+  bud_micro_u16(&w, 14);
+  bud_micro_u16(&w, 12);
+  bud_micro_u8(&w, 2);
+  bud_micro_bytes(&w, "h2", 2);
+  bud_micro_u8(&w, 8);
+  bud_micro_bytes(&w, "http/1.1", 8);
+
+  bud_micro_u16(&w, 0x000d);
+  bud_micro_u16(&w, sizeof(sig_algs) + 2);
+  bud_micro_u16(&w, sizeof(sig_algs));
+  for (i = 0; i < ARRAY_SIZE(sig_algs); i++)
+    bud_micro_u16(&w, sig_algs[i]);
+
+  bud_micro_u16(&w, 0x002b);
+  bud_micro_u16(&w, 5);
+  bud_micro_u8(&w, 4);
+  bud_micro_u16(&w, 0x0304);
+  bud_micro_u16(&w, 0x0303);
+
+  /* Padding extension, 4 bytes of type and length + body */
+  bud_micro_u16(&w, 0x0015);
+  ext = bud_micro_u16(&w, 0);
+  while (w.len - msg < 512)
+    bud_micro_u8(&w, 0);
+  bud_micro_u16_at(&w, ext, w.len - ext - 2);
+
+  bud_micro_u16_at(&w, exts, w.len - exts - 2);
+  bud_micro_u24_at(&w, msg + 1, w.len - msg - 4);
+  bud_micro_u16_at(&w, record, w.len - record - 2);
+  micro->hello_len = w.len;
+}
+
+
+size_t bud_micro_u8(bud_micro_writer_t* w, uint8_t v) {
+  ASSERT(w->len + 1 <= BUD_MICRO_HELLO_MAX, "hello OOB");
+  w->data[w->len] = (char) v;
+  return w->len++;
+}
+
+
+size_t bud_micro_u16(bud_micro_writer_t* w, uint16_t v) {
+  size_t off;
+
+  off = bud_micro_u8(w, v >> 8);
+  bud_micro_u8(w, v & 0xff);
+  return off;
+}
+
+
+void bud_micro_u24_at(bud_micro_writer_t* w, size_t off, size_t v) {
+  w->data[off] = (char) ((v >> 16) & 0xff);
+  bud_micro_u16_at(w, off + 1, v & 0xffff);
+}
+
+
+void bud_micro_u16_at(bud_micro_writer_t* w, size_t off, size_t v) {
+  w->data[off] = (char) ((v >> 8) & 0xff);
+  w->data[off + 1] = (char) (v & 0xff);
+}
+
+
+void bud_micro_bytes(bud_micro_writer_t* w, const char* v, size_t len) {
+  ASSERT(w->len + len <= BUD_MICRO_HELLO_MAX, "hello OOB");
+  memcpy(w->data + w->len, v, len);
+  w->len += len;
+}
+
+
+int bud_micro_run(bud_micro_t* micro, bud_micro_case_t* c) {
+  int i;
+  int iterations;
+  uint64_t start;
+  uint64_t ns[BUD_MICRO_MAX_ROUNDS];
+  double best;
+  double median;
+
+  iterations = c->iterations;
+  if (micro->quick)
+    iterations /= BUD_MICRO_QUICK_DIV;
+  if (iterations == 0)
+    iterations = 1;
+
+  /* Warm up caches and pools, and check the result */
+  if (c->cb(micro, (void*) c->arg, 1) != 0) {
+    fprintf(stderr, "%s: FAILED\n", c->name);
+    return -1;
+  }
+
+  for (i = 0; i < micro->rounds; i++) {
+    start = uv_hrtime();
+    if (c->cb(micro, (void*) c->arg, iterations) != 0) {
+      fprintf(stderr, "%s: FAILED\n", c->name);
+      return -1;
+    }
+    ns[i] = uv_hrtime() - start;
+  }
+  qsort(ns, micro->rounds, sizeof(*ns), bud_micro_cmp);
+
+  best = (double) ns[0] / iterations;
+  median = (double) ns[micro->rounds / 2] / iterations;
+  fprintf(stdout,
+          "%-20s %12.1f ns/op (median %.1f)",
+          c->name,
+          best,
+          median);
+  if (c->bytes != 0)
+    fprintf(stdout, " %10.1f MB/s", c->bytes * 1e3 / best);
+  fprintf(stdout, "\n");
+  return 0;
+}
+
+
+int bud_micro_cmp(const void* a, const void* b) {
+  uint64_t x;
+  uint64_t y;
+
+  x = *(const uint64_t*) a;
+  y = *(const uint64_t*) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+/*
+ * One iteration: every burst is read into the buffer with
+ * `ringbuffer_write_ptr()`/`ringbuffer_write_append()` as in `read_cb`,
+ * and drained with `ringbuffer_read_nextv()` once it is full, the way it is
+ * flushed to the other side.
+ */
+int bud_micro_ringbuffer(bud_micro_t* micro, void* arg, int iterations) {
+  int r;
+  int i;
+  size_t j;
+  size_t left;
+  size_t avail;
+  size_t drained;
+  char* ptr;
+  ringbuffer_pool pool;
+  ringbuffer rb;
+
+  ringbuffer_pool_init(&pool, RING_BUFFER_LEN, 16, 64);
+  if ((intptr_t) arg == kBudMicroRingMalloc)
+    ringbuffer_init(&rb);
+  else
+    ringbuffer_init_pool(&rb, &pool, (intptr_t) arg == kBudMicroRingLazy);
+
+  r = 0;
+  drained = 0;
+  for (i = 0; i < iterations; i++) {
+    for (j = 0; j < ARRAY_SIZE(micro->bursts); j++) {
+      left = micro->bursts[j];
+      while (left > 0) {
+        avail = 0;
+        ptr = ringbuffer_write_ptr(&rb, &avail);
+        if (ptr == NULL) {
+          r = -1;
+          goto done;
+        }
+        if (avail > left)
+          avail = left;
+        memcpy(ptr, micro->scratch, avail);
+        if (ringbuffer_write_append(&rb, avail) != 0) {
+          r = -1;
+          goto done;
+        }
+        left -= avail;
+
+        if (ringbuffer_is_full(&rb))
+          drained += bud_micro_ringbuffer_flush(micro, &rb);
+      }
+    }
+  }
+  drained += bud_micro_ringbuffer_flush(micro, &rb);
+
+  if (drained != micro->bursts_total * iterations)
+    r = -1;
+
+done:
+  ringbuffer_destroy(&rb);
+  ringbuffer_pool_destroy(&pool);
+  return r;
+}
+
+
+/* Drain everything, as if the other side has writable socket */
+size_t bud_micro_ringbuffer_flush(bud_micro_t* micro, ringbuffer* rb) {
+  size_t i;
+  size_t count;
+  size_t total;
+  size_t drained;
+  size_t size[RING_BUFFER_COUNT];
+  char* out[RING_BUFFER_COUNT];
+
+  drained = 0;
+  while (!ringbuffer_is_empty(rb)) {
+    count = ARRAY_SIZE(out);
+    total = ringbuffer_read_nextv(rb, out, size, &count);
+    for (i = 0; i < count; i++)
+      micro->sink += (uint8_t) out[i][0];
+    ringbuffer_read_skip(rb, total);
+    drained += total;
+  }
+
+  return drained;
+}
+
+
+/*
+ * Feeds ClientHello in `arg`-sized pieces (0 - at once), the way
+ * `bud_client_parse_hello()` does when it arrives in several reads.
+ */
+int bud_micro_hello(bud_micro_t* micro, void* arg, int iterations) {
+  int i;
+  size_t off;
+  size_t piece;
+  size_t len;
+  bud_error_t err;
+  bud_hello_parser_t parser;
+  bud_client_hello_t hello;
+
+  piece = (size_t) (intptr_t) arg;
+  if (piece == 0)
+    piece = micro->hello_len;
+
+  for (i = 0; i < iterations; i++) {
+    bud_hello_parser_init(&parser);
+    err = bud_error(kBudErrParserNeedMore);
+    for (off = 0;
+         off < micro->hello_len && err.code == kBudErrParserNeedMore;
+         off += len) {
+      len = micro->hello_len - off;
+      if (len > piece)
+        len = piece;
+      err = bud_hello_parser_execute(&parser,
+                                     micro->hello + off,
+                                     len,
+                                     &hello);
+    }
+
+    if (!bud_is_ok(err) ||
+        hello.servername_len != strlen(bud_micro_servername) ||
+        memcmp(hello.servername,
+               bud_micro_servername,
+               hello.servername_len) != 0 ||
+        hello.alpn_len != 12 ||
+        !hello.ocsp_request) {
+      bud_hello_parser_destroy(&parser);
+      return -1;
+    }
+    micro->sink += hello.ciphers_len;
+    bud_hello_parser_destroy(&parser);
+  }
+
+  return 0;
+}
+
+
+int bud_micro_b64_encode(bud_micro_t* micro, void* arg, int iterations) {
+  int i;
+  size_t r;
+
+  for (i = 0; i < iterations; i++) {
+    r = bud_base64_encode(micro->ocsp,
+                          sizeof(micro->ocsp),
+                          micro->scratch,
+                          micro->ocsp_b64_len);
+    if (r != micro->ocsp_b64_len)
+      return -1;
+    micro->sink += (uint8_t) micro->scratch[r - 1];
+  }
+
+  return memcmp(micro->scratch, micro->ocsp_b64, micro->ocsp_b64_len) == 0 ?
+      0 : -1;
+}
+
+
+int bud_micro_b64_decode(bud_micro_t* micro, void* arg, int iterations) {
+  int i;
+  size_t r;
+
+  for (i = 0; i < iterations; i++) {
+    r = bud_base64_decode(micro->scratch,
+                          bud_base64_decoded_size_fast(micro->ocsp_b64_len),
+                          micro->ocsp_b64,
+                          micro->ocsp_b64_len);
+    if (r != sizeof(micro->ocsp))
+      return -1;
+    micro->sink += (uint8_t) micro->scratch[r - 1];
+  }
+
+  return memcmp(micro->scratch, micro->ocsp, sizeof(micro->ocsp)) == 0 ?
+      0 : -1;
+}
+
+
+/* `arg`: 0 - OCSP request id, 1 - servername, as in stapling/SNI urls */
+int bud_micro_escape(bud_micro_t* micro, void* arg, int iterations) {
+  int i;
+  char* url;
+  size_t len;
+  const char* fmt;
+  const char* value;
+
+  if ((intptr_t) arg == 0) {
+    fmt = "/bud/stapling/%s";
+    value = bud_micro_ocsp_req;
+  } else {
+    fmt = "/bud/sni/%s";
+    value = bud_micro_servername;
+  }
+
+  for (i = 0; i < iterations; i++) {
+    url = bud_escape_url(fmt, value, strlen(value), &len);
+    if (url == NULL)
+      return -1;
+    micro->sink += len;
+    free(url);
+  }
+
+  return 0;
+}
@@ -0,0 +1,722 @@
+#include <getopt.h>  /* getopt_long */
+#include <stdio.h>  /* fprintf */
+#include <stdlib.h>  /* malloc, free, atoi */
+#include <string.h>  /* memset, memcpy, strcmp */
+
+#include "uv.h"
+#include "openssl/bio.h"
+#include "openssl/err.h"
+#include "openssl/ssl.h"
+
+#include "bench-common.h"
+#include "common.h"
+#include "queue.h"
+
+/*
+ * Relay benchmark, either side of it:
+ *
+ * `--serve echo|sink` - plain TCP backend for bud, echoing or discarding data
+ * `--mode idle` - hold N TLS connections open, report bud's memory per each
+ * `--mode bulk` - N connections sending `size` bytes and reading them back,
+ *                 or just sending them with `--upload` (against `sink`)
+ * `--mode pingpong` - N connections exchanging `size`-byte messages
+ */
+
+/* Stop reading (echo) or writing (bulk) above that much unsent data */
+#define BUD_RELAY_HIGH_WATERMARK (256 * 1024)
+
+typedef enum bud_relay_mode_e bud_relay_mode_t;
+typedef struct bud_relay_s bud_relay_t;
+typedef struct bud_relay_conn_s bud_relay_conn_t;
+typedef struct bud_relay_write_s bud_relay_write_t;
+
+enum bud_relay_mode_e {
+  kBudRelayIdle,
+  kBudRelayBulk,
+  kBudRelayPingPong,
+  kBudRelayEcho,
+  kBudRelaySink
+};
+
+struct bud_relay_s {
+  uv_loop_t* loop;
+  struct sockaddr_in addr;
+  SSL_CTX* ctx;
+  uv_timer_t timer;
+  uv_tcp_t server;
+  int stopped;
+  QUEUE conns;
+
+  /* Options */
+  bud_relay_mode_t mode;
+  int concurrency;
+  int duration;
+  size_t size;
+  int upload;
+  char* payload;
+
+  /* Results */
+  uint64_t start;
+  int ready;
+  uint64_t rss_start;
+  uint64_t rss_ready;
+  uint64_t bytes;
+  uint64_t errors;
+  bud_bench_samples_t latency;
+  bud_bench_cpu_t cpu;
+};
+
+struct bud_relay_conn_s {
+  bud_relay_t* relay;
+  QUEUE member;
+  uv_tcp_t tcp;
+  uv_connect_t connect;
+  SSL* ssl;
+  int ready;
+  int closed;
+
+  /* Current transfer or message */
+  uint64_t start;
+  size_t written;
+  size_t received;
+
+  char buf[16384];
+};
+
+struct bud_relay_write_s {
+  uv_write_t req;
+  bud_relay_conn_t* conn;
+  char data[1];
+};
+
+static int bud_relay_connect(bud_relay_t* relay);
+static void bud_relay_connect_cb(uv_connect_t* req, int status);
+static void bud_relay_alloc_cb(uv_handle_t* handle,
+                               size_t suggested_size,
+                               uv_buf_t* buf);
+static void bud_relay_read_cb(uv_stream_t* stream,
+                              ssize_t nread,
+                              const uv_buf_t* buf);
+static void bud_relay_cycle(bud_relay_conn_t* conn);
+static void bud_relay_on_ready(bud_relay_conn_t* conn);
+static void bud_relay_on_data(bud_relay_conn_t* conn, size_t size);
+static void bud_relay_complete(bud_relay_conn_t* conn);
+static void bud_relay_send(bud_relay_conn_t* conn);
+static int bud_relay_write(bud_relay_conn_t* conn,
+                           const char* data,
+                           size_t size);
+static void bud_relay_write_cb(uv_write_t* req, int status);
+static void bud_relay_close(bud_relay_conn_t* conn, int error);
+static void bud_relay_close_cb(uv_handle_t* handle);
+static void bud_relay_timer_cb(uv_timer_t* handle, int status);
+static void bud_relay_report(bud_relay_t* relay);
+static int bud_relay_serve(bud_relay_t* relay);
+static void bud_relay_serve_cb(uv_stream_t* server, int status);
+static void bud_relay_serve_read_cb(uv_stream_t* stream,
+                                    ssize_t nread,
+                                    const uv_buf_t* buf);
+static void bud_relay_serve_write_cb(uv_write_t* req, int status);
+static void bud_relay_usage(const char* name);
+
+
+int main(int argc, char** argv) {
+  int c;
+  int i;
+  int index;
+  const char* host;
+  int port;
+  const char* mode;
+  const char* serve;
+  bud_relay_t relay;
+
+  struct option long_options[] = {
+    { "host", 1, NULL, 'h' },
+    { "port", 1, NULL, 'p' },
+    { "concurrency", 1, NULL, 'c' },
+    { "duration", 1, NULL, 'd' },
+    { "size", 1, NULL, 's' },
+    { "mode", 1, NULL, 'm' },
+    { "serve", 1, NULL, 1000 },
+    { "pid", 1, NULL, 1001 },
+    { "help", 0, NULL, 1002 },
+    { "upload", 0, NULL, 1003 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  memset(&relay, 0, sizeof(relay));
+  host = "127.0.0.1";
+  port = 1443;
+  mode = "bulk";
+  serve = NULL;
+  relay.concurrency = 64;
+  relay.duration = 10;
+  relay.size = 1024 * 1024;
+
+  for (;;) {
+    index = 0;
+    c = getopt_long(argc, argv, "h:p:c:d:s:m:", long_options, &index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'c':
+        relay.concurrency = atoi(optarg);
+        break;
+      case 'd':
+        relay.duration = atoi(optarg);
+        break;
+      case 's':
+        relay.size = atoi(optarg);
+        break;
+      case 'm':
+        mode = optarg;
+        break;
+      case 1000:
+        serve = optarg;
+        break;
+      case 1001:
+        if (bud_bench_cpu_add_pid(&relay.cpu, optarg) != 0) {
+          fprintf(stderr, "Invalid or too many --pid: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 1002:
+        bud_relay_usage(argv[0]);
+        return 0;
+      case 1003:
+        relay.upload = 1;
+        break;
+      default:
+        bud_relay_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (serve != NULL && strcmp(serve, "echo") == 0) {
+    relay.mode = kBudRelayEcho;
+  } else if (serve != NULL && strcmp(serve, "sink") == 0) {
+    relay.mode = kBudRelaySink;
+  } else if (serve != NULL) {
+    fprintf(stderr, "Unknown --serve: %s\n", serve);
+    return 1;
+  } else if (strcmp(mode, "idle") == 0) {
+    relay.mode = kBudRelayIdle;
+  } else if (strcmp(mode, "bulk") == 0) {
+    relay.mode = kBudRelayBulk;
+  } else if (strcmp(mode, "pingpong") == 0) {
+    relay.mode = kBudRelayPingPong;
+  } else {
+    fprintf(stderr, "Unknown --mode: %s\n", mode);
+    return 1;
+  }
+
+  if (relay.concurrency <= 0 || relay.duration <= 0 || relay.size == 0) {
+    bud_relay_usage(argv[0]);
+    return 1;
+  }
+
+  if (uv_ip4_addr(host, port, &relay.addr) != 0) {
+    fprintf(stderr, "Invalid host: %s\n", host);
+    return 1;
+  }
+
+  relay.loop = uv_default_loop();
+  QUEUE_INIT(&relay.conns);
+  if (relay.mode == kBudRelayEcho || relay.mode == kBudRelaySink) {
+    if (bud_relay_serve(&relay) != 0)
+      return 1;
+    uv_run(relay.loop, UV_RUN_DEFAULT);
+    return 0;
+  }
+
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+  SSL_load_error_strings();
+
+  relay.ctx = SSL_CTX_new(SSLv23_client_method());
+  relay.payload = malloc(relay.size);
+  if (relay.ctx == NULL || relay.payload == NULL) {
+    fprintf(stderr, "Failed to allocate context or payload\n");
+    return 1;
+  }
+  memset(relay.payload, 'x', relay.size);
+  bud_bench_samples_init(&relay.latency);
+
+  if (uv_timer_init(relay.loop, &relay.timer) != 0 ||
+      uv_timer_start(&relay.timer,
+                     bud_relay_timer_cb,
+                     relay.duration * 1000,
+                     0) != 0) {
+    fprintf(stderr, "Failed to start timer\n");
+    return 1;
+  }
+
+  relay.start = uv_hrtime();
+  relay.rss_start = bud_bench_cpu_rss(&relay.cpu);
+  bud_bench_cpu_start(&relay.cpu);
+  for (i = 0; i < relay.concurrency; i++)
+    if (bud_relay_connect(&relay) != 0)
+      break;
+
+  uv_run(relay.loop, UV_RUN_DEFAULT);
+
+  bud_relay_report(&relay);
+  bud_bench_samples_destroy(&relay.latency);
+  free(relay.payload);
+  SSL_CTX_free(relay.ctx);
+  return 0;
+}
+
+
+void bud_relay_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "  --serve <echo|sink>        run as bud's backend on --port\n"
+          "  -m, --mode <mode>          idle, bulk (default) or pingpong\n"
+          "  -h, --host <ip>            bud's frontend (127.0.0.1)\n"
+          "  -p, --port <port>          (1443)\n"
+          "  -c, --concurrency <n>      connections (64)\n"
+          "  -d, --duration <seconds>   (10)\n"
+          "  -s, --size <bytes>         transfer or message size (1048576)\n"
+          "  --upload                   bulk transfers are not echoed back\n"
+          "  --pid <pid>                report CPU and memory of bud's "
+              "process, could be repeated\n",
+          name);
+}
+
+
+int bud_relay_connect(bud_relay_t* relay) {
+  int r;
+  bud_relay_conn_t* conn;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return -1;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->relay = relay;
+  r = uv_tcp_init(relay->loop, &conn->tcp);
+  if (r != 0) {
+    free(conn);
+    return r;
+  }
+  conn->tcp.data = conn;
+  QUEUE_INSERT_TAIL(&relay->conns, &conn->member);
+
+  r = uv_tcp_connect(&conn->connect,
+                     &conn->tcp,
+                     (struct sockaddr*) &relay->addr,
+                     bud_relay_connect_cb);
+  if (r != 0)
+    bud_relay_close(conn, 1);
+  return 0;
+}
+
+
+void bud_relay_connect_cb(uv_connect_t* req, int status) {
+  bud_relay_conn_t* conn;
+  BIO* in;
+  BIO* out;
+
+  conn = container_of(req, bud_relay_conn_t, connect);
+  if (status == UV_ECANCELED)
+    return;
+  if (status != 0)
+    return bud_relay_close(conn, 1);
+
+  uv_tcp_nodelay(&conn->tcp, 1);
+  conn->ssl = SSL_new(conn->relay->ctx);
+  if (conn->ssl == NULL)
+    return bud_relay_close(conn, 1);
+
+  in = BIO_new(BIO_s_mem());
+  out = BIO_new(BIO_s_mem());
+  if (in == NULL || out == NULL) {
+    if (in != NULL)
+      BIO_free(in);
+    if (out != NULL)
+      BIO_free(out);
+    return bud_relay_close(conn, 1);
+  }
+  SSL_set_bio(conn->ssl, in, out);
+  SSL_set_connect_state(conn->ssl);
+
+  if (uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_relay_alloc_cb,
+                    bud_relay_read_cb) != 0) {
+    return bud_relay_close(conn, 1);
+  }
+
+  bud_relay_cycle(conn);
+}
+
+
+void bud_relay_alloc_cb(uv_handle_t* handle,
+                        size_t suggested_size,
+                        uv_buf_t* buf) {
+  bud_relay_conn_t* conn;
+
+  conn = handle->data;
+  *buf = uv_buf_init(conn->buf, sizeof(conn->buf));
+}
+
+
+void bud_relay_read_cb(uv_stream_t* stream,
+                       ssize_t nread,
+                       const uv_buf_t* buf) {
+  bud_relay_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return bud_relay_close(conn, !conn->relay->stopped);
+
+  BIO_write(SSL_get_rbio(conn->ssl), buf->base, nread);
+  bud_relay_cycle(conn);
+}
+
+
+void bud_relay_cycle(bud_relay_conn_t* conn) {
+  int r;
+  int err;
+
+  if (!conn->ready) {
+    r = SSL_do_handshake(conn->ssl);
+    if (r == 1) {
+      conn->ready = 1;
+      bud_relay_on_ready(conn);
+    }
+  } else {
+    /* NOTE: `buf` is free, the data was already given to the rbio */
+    while ((r = SSL_read(conn->ssl, conn->buf, sizeof(conn->buf))) > 0) {
+      bud_relay_on_data(conn, r);
+      if (conn->closed)
+        return;
+    }
+  }
+  if (conn->closed)
+    return;
+
+  if (bud_relay_write(conn, NULL, 0) != 0)
+    return bud_relay_close(conn, 1);
+
+  if (r <= 0) {
+    err = SSL_get_error(conn->ssl, r);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+      ERR_clear_error();
+      bud_relay_close(conn, 1);
+    }
+  }
+}
+
+
+void bud_relay_on_ready(bud_relay_conn_t* conn) {
+  bud_relay_t* relay;
+
+  relay = conn->relay;
+  switch (relay->mode) {
+    case kBudRelayIdle:
+      /* Memory is measured once every connection is established */
+      if (++relay->ready == relay->concurrency)
+        relay->rss_ready = bud_bench_cpu_rss(&relay->cpu);
+      break;
+    case kBudRelayBulk:
+    case kBudRelayPingPong:
+      bud_relay_send(conn);
+      break;
+    default:
+      UNEXPECTED;
+  }
+}
+
+
+void bud_relay_on_data(bud_relay_conn_t* conn, size_t size) {
+  bud_relay_t* relay;
+
+  relay = conn->relay;
+  relay->bytes += size;
+  conn->received += size;
+  if (conn->received < relay->size)
+    return;
+
+  /* Transfer or message is back */
+  conn->received -= relay->size;
+  bud_relay_complete(conn);
+}
+
+
+void bud_relay_complete(bud_relay_conn_t* conn) {
+  bud_relay_t* relay;
+
+  /* Start the next one */
+  relay = conn->relay;
+  if (relay->upload)
+    relay->bytes += relay->size;
+  bud_bench_samples_add(&relay->latency,
+                        (uv_hrtime() - conn->start) / 1000);
+  conn->written = 0;
+  if (relay->stopped)
+    return bud_relay_close(conn, 0);
+  bud_relay_send(conn);
+}
+
+
+void bud_relay_send(bud_relay_conn_t* conn) {
+  bud_relay_t* relay;
+  size_t chunk;
+  int r;
+
+  relay = conn->relay;
+  if (conn->written == 0)
+    conn->start = uv_hrtime();
+
+  /* Do not buffer more than the watermark, write_cb will continue */
+  while (conn->written < relay->size &&
+         conn->tcp.write_queue_size < BUD_RELAY_HIGH_WATERMARK) {
+    chunk = relay->size - conn->written;
+    if (chunk > sizeof(conn->buf))
+      chunk = sizeof(conn->buf);
+
+    r = SSL_write(conn->ssl, relay->payload + conn->written, chunk);
+    if (r <= 0)
+      return bud_relay_close(conn, 1);
+    conn->written += r;
+
+    if (bud_relay_write(conn, NULL, 0) != 0)
+      return bud_relay_close(conn, 1);
+  }
+}
+
+
+int bud_relay_write(bud_relay_conn_t* conn, const char* data, size_t size) {
+  int r;
+  long len;
+  BIO* out;
+  bud_relay_write_t* w;
+  uv_buf_t buf;
+
+  /* Either `data`, or everything pending in the wbio */
+  out = conn->ssl == NULL ? NULL : SSL_get_wbio(conn->ssl);
+  len = data != NULL ? (long) size : BIO_pending(out);
+  if (len <= 0)
+    return 0;
+
+  w = malloc(sizeof(*w) + len);
+  if (w == NULL)
+    return -1;
+  w->conn = conn;
+  if (data != NULL)
+    memcpy(w->data, data, len);
+  else
+    BIO_read(out, w->data, len);
+
+  buf = uv_buf_init(w->data, len);
+  r = uv_write(&w->req,
+               (uv_stream_t*) &conn->tcp,
+               &buf,
+               1,
+               data != NULL ? bud_relay_serve_write_cb : bud_relay_write_cb);
+  if (r != 0) {
+    free(w);
+    return -1;
+  }
+  return 0;
+}
+
+
+void bud_relay_write_cb(uv_write_t* req, int status) {
+  bud_relay_write_t* w;
+  bud_relay_conn_t* conn;
+
+  w = container_of(req, bud_relay_write_t, req);
+  conn = w->conn;
+  free(w);
+  if (status != 0 || conn->closed)
+    return;
+  if (conn->relay->mode != kBudRelayBulk)
+    return;
+
+  /* Upload is done once everything is handed to the kernel */
+  if (conn->relay->upload &&
+      conn->written == conn->relay->size &&
+      conn->tcp.write_queue_size == 0) {
+    return bud_relay_complete(conn);
+  }
+
+  if (conn->tcp.write_queue_size < BUD_RELAY_HIGH_WATERMARK / 2)
+    bud_relay_send(conn);
+}
+
+
+void bud_relay_close(bud_relay_conn_t* conn, int error) {
+  if (conn->closed)
+    return;
+  conn->closed = 1;
+  if (error)
+    conn->relay->errors++;
+
+  QUEUE_REMOVE(&conn->member);
+  uv_close((uv_handle_t*) &conn->tcp, bud_relay_close_cb);
+}
+
+
+void bud_relay_close_cb(uv_handle_t* handle) {
+  bud_relay_conn_t* conn;
+
+  conn = handle->data;
+  if (conn->ssl != NULL)
+    SSL_free(conn->ssl);
+  free(conn);
+}
+
+
+void bud_relay_timer_cb(uv_timer_t* handle, int status) {
+  bud_relay_t* relay;
+  bud_relay_conn_t* conn;
+  QUEUE* q;
+
+  relay = container_of(handle, bud_relay_t, timer);
+  relay->stopped = 1;
+  uv_close((uv_handle_t*) handle, NULL);
+
+  /* Transfers in flight are not counted */
+  while (!QUEUE_EMPTY(&relay->conns)) {
+    q = QUEUE_HEAD(&relay->conns);
+    conn = QUEUE_DATA(q, bud_relay_conn_t, member);
+    bud_relay_close(conn, 0);
+  }
+}
+
+
+void bud_relay_report(bud_relay_t* relay) {
+  double elapsed;
+  uint64_t self;
+  uint64_t pids;
+
+  elapsed = (uv_hrtime() - relay->start) / 1e9;
+  bud_bench_cpu_elapsed(&relay->cpu, &self, &pids);
+
+  fprintf(stdout,
+          "duration: %.2fs, connections: %d, errors: %llu\n",
+          elapsed,
+          relay->concurrency,
+          (unsigned long long) relay->errors);
+
+  if (relay->mode == kBudRelayIdle) {
+    fprintf(stdout, "established: %d\n", relay->ready);
+    if (relay->cpu.pid_count != 0 && relay->ready == relay->concurrency) {
+      fprintf(stdout,
+              "bud memory per connection: %.0f bytes\n",
+              ((double) relay->rss_ready - relay->rss_start) / relay->ready);
+    }
+    return;
+  }
+
+  fprintf(stdout,
+          "relayed: %.1f MB/s\n",
+          relay->bytes / elapsed / (1024 * 1024));
+  if (relay->cpu.pid_count != 0 && pids != 0) {
+    fprintf(stdout,
+            "relayed per bud core: %.1f MB/s\n",
+            relay->bytes / (pids / 1e6) / (1024 * 1024));
+  }
+  bud_bench_samples_print(&relay->latency,
+                          relay->mode == kBudRelayBulk ? "transfer latency" :
+                                                         "message latency");
+}
+
+
+int bud_relay_serve(bud_relay_t* relay) {
+  int r;
+
+  r = uv_tcp_init(relay->loop, &relay->server);
+  if (r == 0)
+    r = uv_tcp_bind(&relay->server, (struct sockaddr*) &relay->addr);
+  if (r == 0) {
+    r = uv_listen((uv_stream_t*) &relay->server,
+                  1024,
+                  bud_relay_serve_cb);
+  }
+  if (r != 0) {
+    fprintf(stderr, "Failed to listen: %s\n", uv_strerror(r));
+    return -1;
+  }
+
+  relay->server.data = relay;
+  return 0;
+}
+
+
+void bud_relay_serve_cb(uv_stream_t* server, int status) {
+  bud_relay_conn_t* conn;
+
+  if (status != 0)
+    return;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->relay = server->data;
+  QUEUE_INIT(&conn->member);
+  if (uv_tcp_init(conn->relay->loop, &conn->tcp) != 0) {
+    free(conn);
+    return;
+  }
+  conn->tcp.data = conn;
+
+  if (uv_accept(server, (uv_stream_t*) &conn->tcp) != 0 ||
+      uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_relay_alloc_cb,
+                    bud_relay_serve_read_cb) != 0) {
+    bud_relay_close(conn, 0);
+  }
+}
+
+
+void bud_relay_serve_read_cb(uv_stream_t* stream,
+                             ssize_t nread,
+                             const uv_buf_t* buf) {
+  bud_relay_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return bud_relay_close(conn, 0);
+  if (conn->relay->mode == kBudRelaySink)
+    return;
+
+  if (bud_relay_write(conn, buf->base, nread) != 0)
+    return bud_relay_close(conn, 0);
+
+  /* Client is not reading, stop echoing */
+  if (conn->tcp.write_queue_size >= BUD_RELAY_HIGH_WATERMARK)
+    uv_read_stop(stream);
+}
+
+
+void bud_relay_serve_write_cb(uv_write_t* req, int status) {
+  bud_relay_write_t* w;
+  bud_relay_conn_t* conn;
+
+  w = container_of(req, bud_relay_write_t, req);
+  conn = w->conn;
+  free(w);
+  if (status != 0 || conn->closed)
+    return;
+
+  if (conn->tcp.write_queue_size < BUD_RELAY_HIGH_WATERMARK / 2) {
+    uv_read_start((uv_stream_t*) &conn->tcp,
+                  bud_relay_alloc_cb,
+                  bud_relay_serve_read_cb);
+  }
+}
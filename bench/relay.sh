@@ -0,0 +1,80 @@
+#!/bin/sh
+#
+# Stand up bud in front of the built-in echo backend and run the relay
+# scenarios: idle keepalive clients, bulk transfers and small-message
+# ping-pong. Run from the repository root, after `make -C out/`.
+#
+# Tunables (environment):
+#   OUT           build directory (out/Release)
+#   WORKERS       bud workers (1)
+#   DURATION      seconds per scenario (10)
+#   IDLE_CLIENTS  connections of the idle scenario (100000)
+#   BULK_CLIENTS  connections of the bulk scenario (1000)
+#   BULK_SIZE     bytes per bulk transfer (1048576)
+#   PING_CLIENTS  connections of the ping-pong scenario (1000)
+#   PING_SIZE     bytes per message (64)
+#
+# NOTE: 100k connections need `ulimit -n` and `net.ipv4.ip_local_port_range`
+# to be raised for both the benchmark and bud.
+
+set -e
+
+OUT=${OUT:-out/Release}
+WORKERS=${WORKERS:-1}
+DURATION=${DURATION:-10}
+IDLE_CLIENTS=${IDLE_CLIENTS:-100000}
+BULK_CLIENTS=${BULK_CLIENTS:-1000}
+BULK_SIZE=${BULK_SIZE:-1048576}
+PING_CLIENTS=${PING_CLIENTS:-1000}
+PING_SIZE=${PING_SIZE:-64}
+
+FRONTEND_PORT=${FRONTEND_PORT:-11443}
+BACKEND_PORT=${BACKEND_PORT:-19001}
+CONFIG=`mktemp /tmp/bud-relay.XXXXXX`
+
+cleanup() {
+  kill $BUD_PID $BACKEND_PID 2>/dev/null || true
+  rm -f $CONFIG
+}
+trap cleanup EXIT INT TERM
+
+cat > $CONFIG <<JSON
+{
+  "workers": $WORKERS,
+  "log": { "level": "warning" },
+  "frontend": {
+    "port": $FRONTEND_PORT,
+    "host": "127.0.0.1",
+    "cert": "keys/cert.pem",
+    "key": "keys/key.pem",
+    "timeout": { "handshake": 0, "idle": 0 }
+  },
+  "backend": { "port": $BACKEND_PORT, "host": "127.0.0.1" }
+}
+JSON
+
+$OUT/bud-bench-relay --serve echo --host 127.0.0.1 --port $BACKEND_PORT &
+BACKEND_PID=$!
+
+$OUT/bud --config $CONFIG &
+BUD_PID=$!
+sleep 1
+
+# Master and all of its workers
+PIDS="--pid $BUD_PID"
+for pid in `pgrep -P $BUD_PID`; do
+  PIDS="$PIDS --pid $pid"
+done
+
+run() {
+  echo "== $1"
+  shift
+  $OUT/bud-bench-relay --port $FRONTEND_PORT -d $DURATION $PIDS "$@"
+  echo
+}
+
+run "idle, $IDLE_CLIENTS clients" --mode idle -c $IDLE_CLIENTS
+run "bulk, $BULK_CLIENTS clients x $BULK_SIZE bytes" \
+    --mode bulk -c $BULK_CLIENTS -s $BULK_SIZE
+run "ping-pong, $PING_CLIENTS clients x $PING_SIZE bytes" \
+    --mode pingpong -c $PING_CLIENTS -s $PING_SIZE
@@ -0,0 +1,918 @@
+#include <getopt.h>  /* getopt_long */
+#include <stdio.h>  /* fprintf, fopen, fgets */
+#include <stdlib.h>  /* malloc, realloc, free, qsort, atoi, atof */
+#include <string.h>  /* memset, memcpy, strcmp, strlen */
+
+#include "uv.h"
+#include "openssl/bio.h"
+#include "openssl/err.h"
+#include "openssl/ssl.h"
+
+#include "bench-common.h"
+#include "capture.h"
+#include "common.h"
+#include "hello-parser.h"
+
+/*
+ * Replay of `log.capture` (see src/capture.h) against a test bud, whose
+ * backend is `bud-bench-relay --serve echo`. Connections start with the
+ * recorded gaps (scaled by `speed`, or back to back with `--speed 0`), offer
+ * the recorded servername, ciphers, ALPN and OCSP request, resume when the
+ * client did (with the last session of the servername), and send the
+ * recorded upload, waiting for its echo.
+ */
+
+/* Distinct servernames whose sessions are kept */
+#define BUD_REPLAY_SESSIONS 4096
+
+/* Stop writing above that much unsent data */
+#define BUD_REPLAY_HIGH_WATERMARK (256 * 1024)
+
+typedef struct bud_replay_s bud_replay_t;
+typedef struct bud_replay_record_s bud_replay_record_t;
+typedef struct bud_replay_session_s bud_replay_session_t;
+typedef struct bud_replay_conn_s bud_replay_conn_t;
+typedef enum bud_replay_result_e bud_replay_result_t;
+
+enum bud_replay_result_e {
+  kBudReplayFull,
+  kBudReplayResumed,
+  kBudReplayFailed
+};
+
+struct bud_replay_record_s {
+  uint64_t accept;
+  char servername[256];
+  int resume;
+  char alpn[64];
+  int ocsp;
+  bud_replay_result_t result;
+  uint64_t upload;
+
+  /* OpenSSL names of the offered ciphers, NULL - unknown or not recorded */
+  char* ciphers;
+};
+
+struct bud_replay_session_s {
+  char servername[256];
+  SSL_SESSION* session;
+};
+
+struct bud_replay_s {
+  uv_loop_t* loop;
+  struct sockaddr_in addr;
+  SSL_CTX* ctx;
+  uv_timer_t timer;
+  int stopped;
+
+  /* Options */
+  double speed;
+  int concurrency;
+  int repeat;
+  char* payload;
+
+  /* Records, and the next one to start */
+  bud_replay_record_t* records;
+  size_t record_count;
+  size_t next;
+  int round;
+  uint64_t round_start;
+
+  /* Open addressing by servername */
+  bud_replay_session_t sessions[BUD_REPLAY_SESSIONS];
+
+  /* Results, by the recorded and by the replayed result */
+  uint64_t start;
+  uint64_t recorded[3];
+  uint64_t replayed[3];
+  uint64_t late;
+  uint64_t bytes;
+  bud_bench_samples_t full_latency;
+  bud_bench_samples_t resumed_latency;
+  bud_bench_samples_t relay_latency;
+  bud_bench_cpu_t cpu;
+  int active;
+};
+
+struct bud_replay_conn_s {
+  bud_replay_t* replay;
+  bud_replay_record_t* record;
+  uv_tcp_t tcp;
+  uv_connect_t connect;
+  SSL* ssl;
+  int ready;
+  int closed;
+
+  uint64_t start;
+  uint64_t relay_start;
+  size_t written;
+  size_t received;
+
+  char buf[16384];
+};
+
+static int bud_replay_load(bud_replay_t* replay, const char* path);
+static int bud_replay_record_compare(const void* a, const void* b);
+static int bud_replay_parse(bud_replay_t* replay,
+                            bud_replay_record_t* record,
+                            char* line);
+static char* bud_replay_ciphers(bud_replay_t* replay, const char* hex);
+static bud_replay_session_t* bud_replay_session(bud_replay_t* replay,
+                                                const char* servername);
+static void bud_replay_timer_cb(uv_timer_t* handle, int status);
+static void bud_replay_schedule(bud_replay_t* replay);
+static int bud_replay_connect(bud_replay_t* replay,
+                              bud_replay_record_t* record);
+static void bud_replay_connect_cb(uv_connect_t* req, int status);
+static void bud_replay_alloc_cb(uv_handle_t* handle,
+                                size_t suggested_size,
+                                uv_buf_t* buf);
+static void bud_replay_read_cb(uv_stream_t* stream,
+                               ssize_t nread,
+                               const uv_buf_t* buf);
+static void bud_replay_cycle(bud_replay_conn_t* conn);
+static void bud_replay_on_ready(bud_replay_conn_t* conn);
+static void bud_replay_send(bud_replay_conn_t* conn);
+static int bud_replay_flush(bud_replay_conn_t* conn);
+static void bud_replay_write_cb(uv_write_t* req, int status);
+static void bud_replay_close(bud_replay_conn_t* conn, int error);
+static void bud_replay_close_cb(uv_handle_t* handle);
+static void bud_replay_report(bud_replay_t* replay);
+static void bud_replay_usage(const char* name);
+
+static const char* const bud_replay_results[] = {
+  "full",
+  "resumed",
+  "failed"
+};
+
+
+int main(int argc, char** argv) {
+  int c;
+  int index;
+  size_t i;
+  const char* host;
+  int port;
+  const char* file;
+  bud_replay_t* replay;
+
+  struct option long_options[] = {
+    { "host", 1, NULL, 'h' },
+    { "port", 1, NULL, 'p' },
+    { "file", 1, NULL, 'f' },
+    { "concurrency", 1, NULL, 'c' },
+    { "speed", 1, NULL, 1000 },
+    { "repeat", 1, NULL, 1001 },
+    { "pid", 1, NULL, 1002 },
+    { "help", 0, NULL, 1003 },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Sessions table is large for the stack */
+  replay = calloc(1, sizeof(*replay));
+  if (replay == NULL)
+    return 1;
+  host = "127.0.0.1";
+  port = 1443;
+  file = NULL;
+  replay->speed = 1.0;
+  replay->concurrency = 1024;
+  replay->repeat = 1;
+
+  for (;;) {
+    index = 0;
+    c = getopt_long(argc, argv, "h:p:f:c:", long_options, &index);
+    if (c == -1)
+      break;
+
+    switch (c) {
+      case 'h':
+        host = optarg;
+        break;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'f':
+        file = optarg;
+        break;
+      case 'c':
+        replay->concurrency = atoi(optarg);
+        break;
+      case 1000:
+        replay->speed = atof(optarg);
+        break;
+      case 1001:
+        replay->repeat = atoi(optarg);
+        break;
+      case 1002:
+        if (bud_bench_cpu_add_pid(&replay->cpu, optarg) != 0) {
+          fprintf(stderr, "Invalid or too many --pid: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 1003:
+        bud_replay_usage(argv[0]);
+        return 0;
+      default:
+        bud_replay_usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (file == NULL ||
+      replay->concurrency <= 0 ||
+      replay->repeat <= 0 ||
+      replay->speed < 0) {
+    bud_replay_usage(argv[0]);
+    return 1;
+  }
+
+  SSL_library_init();
+  OpenSSL_add_all_algorithms();
+  SSL_load_error_strings();
+
+  replay->ctx = SSL_CTX_new(SSLv23_client_method());
+  if (replay->ctx == NULL) {
+    fprintf(stderr, "SSL_CTX_new() failed\n");
+    return 1;
+  }
+  SSL_CTX_set_session_cache_mode(replay->ctx, SSL_SESS_CACHE_OFF);
+
+  if (bud_replay_load(replay, file) != 0)
+    return 1;
+  if (replay->record_count == 0) {
+    fprintf(stderr, "No records in %s\n", file);
+    return 1;
+  }
+
+  if (uv_ip4_addr(host, port, &replay->addr) != 0) {
+    fprintf(stderr, "Invalid host: %s\n", host);
+    return 1;
+  }
+
+  /* Zeroes, TLS doesn't compress them anyway */
+  replay->payload = calloc(1, sizeof(((bud_replay_conn_t*) NULL)->buf));
+  if (replay->payload == NULL)
+    return 1;
+
+  replay->loop = uv_default_loop();
+  bud_bench_samples_init(&replay->full_latency);
+  bud_bench_samples_init(&replay->resumed_latency);
+  bud_bench_samples_init(&replay->relay_latency);
+
+  if (uv_timer_init(replay->loop, &replay->timer) != 0 ||
+      uv_timer_start(&replay->timer, bud_replay_timer_cb, 1, 1) != 0) {
+    fprintf(stderr, "Failed to start timer\n");
+    return 1;
+  }
+
+  replay->start = uv_hrtime();
+  replay->round_start = replay->start;
+  bud_bench_cpu_start(&replay->cpu);
+  bud_replay_schedule(replay);
+
+  uv_run(replay->loop, UV_RUN_DEFAULT);
+
+  bud_replay_report(replay);
+  bud_bench_samples_destroy(&replay->full_latency);
+  bud_bench_samples_destroy(&replay->resumed_latency);
+  bud_bench_samples_destroy(&replay->relay_latency);
+  for (i = 0; i < BUD_REPLAY_SESSIONS; i++)
+    if (replay->sessions[i].session != NULL)
+      SSL_SESSION_free(replay->sessions[i].session);
+  for (i = 0; i < replay->record_count; i++)
+    free(replay->records[i].ciphers);
+  free(replay->records);
+  free(replay->payload);
+  SSL_CTX_free(replay->ctx);
+  free(replay);
+  return 0;
+}
+
+
+void bud_replay_usage(const char* name) {
+  fprintf(stderr,
+          "Usage: %s -f <capture> [options]\n"
+          "  -f, --file <path>          `log.capture` of bud\n"
+          "  -h, --host <ip>            bud's frontend (127.0.0.1)\n"
+          "  -p, --port <port>          (1443)\n"
+          "  -c, --concurrency <n>      most connections in flight (1024)\n"
+          "  --speed <x>                time scale of the gaps, 0 - back to "
+              "back (1)\n"
+          "  --repeat <n>               replay the file n times (1)\n"
+          "  --pid <pid>                report CPU of bud's process, could "
+              "be repeated\n",
+          name);
+}
+
+
+int bud_replay_load(bud_replay_t* replay, const char* path) {
+  FILE* f;
+  char* line;
+  size_t cap;
+  size_t lineno;
+  bud_replay_record_t* records;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return -1;
+  }
+
+  line = malloc(BUD_CAPTURE_MAX_HELLO * 2 + 512);
+  if (line == NULL) {
+    fclose(f);
+    return -1;
+  }
+
+  cap = 0;
+  lineno = 0;
+  while (fgets(line, BUD_CAPTURE_MAX_HELLO * 2 + 512, f) != NULL) {
+    lineno++;
+    if (replay->record_count == cap) {
+      cap = cap == 0 ? 1024 : cap * 2;
+      records = realloc(replay->records, cap * sizeof(*records));
+      if (records == NULL)
+        goto fatal;
+      replay->records = records;
+    }
+
+    /* Torn lines of a live file are skipped */
+    if (bud_replay_parse(replay,
+                         &replay->records[replay->record_count],
+                         line) != 0) {
+      fprintf(stderr, "Skipping line %lu\n", (unsigned long) lineno);
+      continue;
+    }
+    replay->record_count++;
+  }
+
+  free(line);
+  fclose(f);
+
+  /* Lines are appended at close, by every process */
+  qsort(replay->records,
+        replay->record_count,
+        sizeof(*replay->records),
+        bud_replay_record_compare);
+  return 0;
+
+fatal:
+  free(line);
+  fclose(f);
+  return -1;
+}
+
+
+int bud_replay_record_compare(const void* a, const void* b) {
+  const bud_replay_record_t* ra;
+  const bud_replay_record_t* rb;
+
+  ra = a;
+  rb = b;
+  if (ra->accept == rb->accept)
+    return 0;
+  return ra->accept < rb->accept ? -1 : 1;
+}
+
+
+int bud_replay_parse(bud_replay_t* replay,
+                     bud_replay_record_t* record,
+                     char* line) {
+  unsigned long long accept;
+  unsigned long long handshake;
+  unsigned long long upload;
+  unsigned long long download;
+  unsigned long long duration;
+  char offer[16];
+  char result[16];
+  int hello;
+  size_t len;
+
+  len = strlen(line);
+  if (len == 0 || line[len - 1] != '\n')
+    return -1;
+  line[len - 1] = '\0';
+
+  memset(record, 0, sizeof(*record));
+  if (sscanf(line,
+             "%llu %255s %15s %63s %d %15s %llu %llu %llu %llu %n",
+             &accept,
+             record->servername,
+             offer,
+             record->alpn,
+             &record->ocsp,
+             result,
+             &handshake,
+             &upload,
+             &download,
+             &duration,
+             &hello) != 10) {
+    return -1;
+  }
+
+  record->accept = accept;
+  record->upload = upload;
+  record->resume = strcmp(offer, "none") != 0;
+  if (strcmp(result, "full") == 0)
+    record->result = kBudReplayFull;
+  else if (strcmp(result, "resumed") == 0)
+    record->result = kBudReplayResumed;
+  else
+    record->result = kBudReplayFailed;
+
+  /* Failed handshakes are replayed too, they just have no payload */
+  if (record->result == kBudReplayFailed)
+    record->upload = 0;
+
+  record->ciphers = bud_replay_ciphers(replay, line + hello);
+  return 0;
+}
+
+
+/* OpenSSL cipher list with the offered suites that it knows */
+char* bud_replay_ciphers(bud_replay_t* replay, const char* hex) {
+  char* msg;
+  char* res;
+  size_t len;
+  size_t res_len;
+  size_t i;
+  int j;
+  unsigned int id;
+  const char* name;
+  bud_hello_parser_t parser;
+  bud_client_hello_t hello;
+  bud_error_t err;
+  STACK_OF(SSL_CIPHER)* known;
+  SSL* ssl;
+
+  len = strlen(hex);
+  if (len < 8 || len % 2 != 0)
+    return NULL;
+
+  /* Handshake message in a record, the way the parser wants it */
+  len /= 2;
+  msg = malloc(len + 5);
+  if (msg == NULL)
+    return NULL;
+  msg[0] = 0x16;
+  msg[1] = 0x03;
+  msg[2] = 0x01;
+  msg[3] = (len >> 8) & 0xff;
+  msg[4] = len & 0xff;
+  for (i = 0; i < len; i++) {
+    if (sscanf(hex + i * 2, "%2x", &id) != 1) {
+      free(msg);
+      return NULL;
+    }
+    msg[5 + i] = id;
+  }
+
+  res = NULL;
+  ssl = NULL;
+  bud_hello_parser_init(&parser);
+  err = bud_hello_parser_execute(&parser, msg, len + 5, &hello);
+  if (!bud_is_ok(err) || hello.ciphers_len == 0)
+    goto done;
+
+  /* Everything OpenSSL has, to look the ids up */
+  ssl = SSL_new(replay->ctx);
+  if (ssl == NULL || SSL_set_cipher_list(ssl, "ALL:COMPLEMENTOFALL") != 1)
+    goto done;
+  known = SSL_get_ciphers(ssl);
+
+  res = malloc(hello.ciphers_len / 2 * 64 + 1);
+  if (res == NULL)
+    goto done;
+  res_len = 0;
+  for (i = 0; i + 1 < hello.ciphers_len; i += 2) {
+    id = ((unsigned char) hello.ciphers[i] << 8) |
+         (unsigned char) hello.ciphers[i + 1];
+    for (j = 0; j < sk_SSL_CIPHER_num(known); j++) {
+      if ((SSL_CIPHER_get_id(sk_SSL_CIPHER_value(known, j)) & 0xffff) != id)
+        continue;
+      name = SSL_CIPHER_get_name(sk_SSL_CIPHER_value(known, j));
+      if (strlen(name) > 62)
+        break;
+      if (res_len != 0)
+        res[res_len++] = ':';
+      memcpy(res + res_len, name, strlen(name));
+      res_len += strlen(name);
+      break;
+    }
+  }
+  res[res_len] = '\0';
+
+  /* Nothing in common, use the defaults */
+  if (res_len == 0) {
+    free(res);
+    res = NULL;
+  }
+
+done:
+  if (ssl != NULL)
+    SSL_free(ssl);
+  bud_hello_parser_destroy(&parser);
+  free(msg);
+  return res;
+}
+
+
+bud_replay_session_t* bud_replay_session(bud_replay_t* replay,
+                                         const char* servername) {
+  uint32_t index;
+  uint32_t i;
+  bud_replay_session_t* s;
+
+  index = bud_hash_lower(BUD_HASH_INIT, servername, strlen(servername));
+  for (i = 0; i < BUD_REPLAY_SESSIONS; i++) {
+    s = &replay->sessions[(index + i) % BUD_REPLAY_SESSIONS];
+    if (s->servername[0] == '\0' || strcmp(s->servername, servername) == 0)
+      break;
+  }
+  if (i == BUD_REPLAY_SESSIONS)
+    return NULL;
+
+  if (s->servername[0] == '\0')
+    snprintf(s->servername, sizeof(s->servername), "%s", servername);
+  return s;
+}
+
+
+void bud_replay_timer_cb(uv_timer_t* handle, int status) {
+  bud_replay_t* replay;
+
+  replay = container_of(handle, bud_replay_t, timer);
+  bud_replay_schedule(replay);
+}
+
+
+/* Start the records that are due, as many as `concurrency` allows */
+void bud_replay_schedule(bud_replay_t* replay) {
+  uint64_t now;
+  uint64_t due;
+  bud_replay_record_t* record;
+
+  now = uv_hrtime();
+  while (!replay->stopped) {
+    if (replay->next == replay->record_count) {
+      if (++replay->round == replay->repeat) {
+        replay->stopped = 1;
+        break;
+      }
+      replay->next = 0;
+      replay->round_start = now;
+    }
+
+    record = &replay->records[replay->next];
+    if (replay->speed > 0) {
+      due = replay->round_start +
+            (uint64_t) ((record->accept - replay->records[0].accept) *
+                        1e6 / replay->speed);
+      if (due > now)
+        break;
+
+      /* Over a ms behind the schedule, the load is not what it was */
+      if (now - due > 1000000)
+        replay->late++;
+    }
+    if (replay->active >= replay->concurrency)
+      break;
+
+    replay->next++;
+    replay->recorded[record->result]++;
+    if (bud_replay_connect(replay, record) != 0)
+      replay->replayed[kBudReplayFailed]++;
+  }
+
+  /* The loop exits after the last connection */
+  if (replay->stopped && !uv_is_closing((uv_handle_t*) &replay->timer))
+    uv_close((uv_handle_t*) &replay->timer, NULL);
+}
+
+
+int bud_replay_connect(bud_replay_t* replay, bud_replay_record_t* record) {
+  int r;
+  bud_replay_conn_t* conn;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return -1;
+
+  memset(conn, 0, sizeof(*conn));
+  conn->replay = replay;
+  conn->record = record;
+  conn->start = uv_hrtime();
+  r = uv_tcp_init(replay->loop, &conn->tcp);
+  if (r != 0) {
+    free(conn);
+    return r;
+  }
+  conn->tcp.data = conn;
+  replay->active++;
+
+  r = uv_tcp_connect(&conn->connect,
+                     &conn->tcp,
+                     (struct sockaddr*) &replay->addr,
+                     bud_replay_connect_cb);
+  if (r != 0)
+    bud_replay_close(conn, 1);
+  return 0;
+}
+
+
+void bud_replay_connect_cb(uv_connect_t* req, int status) {
+  bud_replay_conn_t* conn;
+  bud_replay_record_t* record;
+  bud_replay_session_t* s;
+  BIO* in;
+  BIO* out;
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  unsigned char alpn[64];
+  size_t alpn_len;
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+
+  conn = container_of(req, bud_replay_conn_t, connect);
+  record = conn->record;
+  if (status != 0)
+    return bud_replay_close(conn, 1);
+
+  uv_tcp_nodelay(&conn->tcp, 1);
+  conn->ssl = SSL_new(conn->replay->ctx);
+  if (conn->ssl == NULL)
+    return bud_replay_close(conn, 1);
+  in = BIO_new(BIO_s_mem());
+  out = BIO_new(BIO_s_mem());
+  if (in == NULL || out == NULL) {
+    if (in != NULL)
+      BIO_free(in);
+    if (out != NULL)
+      BIO_free(out);
+    return bud_replay_close(conn, 1);
+  }
+  SSL_set_bio(conn->ssl, in, out);
+  SSL_set_connect_state(conn->ssl);
+
+  if (strcmp(record->servername, "-") != 0)
+    SSL_set_tlsext_host_name(conn->ssl, record->servername);
+  if (record->ocsp)
+    SSL_set_tlsext_status_type(conn->ssl, TLSEXT_STATUSTYPE_ocsp);
+  if (record->ciphers != NULL)
+    SSL_set_cipher_list(conn->ssl, record->ciphers);
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+  alpn_len = strlen(record->alpn);
+  if (strcmp(record->alpn, "-") != 0 && alpn_len < sizeof(alpn)) {
+    alpn[0] = alpn_len;
+    memcpy(alpn + 1, record->alpn, alpn_len);
+    SSL_set_alpn_protos(conn->ssl, alpn, alpn_len + 1);
+  }
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+
+  /* Last session of the servername, the way that client would have it */
+  if (record->resume) {
+    s = bud_replay_session(conn->replay, record->servername);
+    if (s != NULL && s->session != NULL)
+      SSL_set_session(conn->ssl, s->session);
+  }
+
+  if (uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_replay_alloc_cb,
+                    bud_replay_read_cb) != 0) {
+    return bud_replay_close(conn, 1);
+  }
+
+  bud_replay_cycle(conn);
+}
+
+
+void bud_replay_alloc_cb(uv_handle_t* handle,
+                         size_t suggested_size,
+                         uv_buf_t* buf) {
+  bud_replay_conn_t* conn;
+
+  conn = handle->data;
+  *buf = uv_buf_init(conn->buf, sizeof(conn->buf));
+}
+
+
+void bud_replay_read_cb(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf) {
+  bud_replay_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return bud_replay_close(conn, 1);
+
+  BIO_write(SSL_get_rbio(conn->ssl), buf->base, nread);
+  bud_replay_cycle(conn);
+}
+
+
+void bud_replay_cycle(bud_replay_conn_t* conn) {
+  int r;
+  int err;
+
+  if (!conn->ready) {
+    r = SSL_do_handshake(conn->ssl);
+    if (r == 1) {
+      conn->ready = 1;
+      bud_replay_on_ready(conn);
+    }
+  } else {
+    /* NOTE: `buf` is free, the data was already given to the rbio */
+    while ((r = SSL_read(conn->ssl, conn->buf, sizeof(conn->buf))) > 0) {
+      conn->received += r;
+      conn->replay->bytes += r;
+      if (conn->received < conn->record->upload)
+        continue;
+
+      /* Echo of the whole upload is back */
+      bud_bench_samples_add(&conn->replay->relay_latency,
+                            (uv_hrtime() - conn->relay_start) / 1000);
+      return bud_replay_close(conn, 0);
+    }
+  }
+  if (conn->closed)
+    return;
+
+  if (bud_replay_flush(conn) != 0)
+    return bud_replay_close(conn, 1);
+
+  if (r <= 0) {
+    err = SSL_get_error(conn->ssl, r);
+    if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+      ERR_clear_error();
+      bud_replay_close(conn, 1);
+    }
+  }
+}
+
+
+void bud_replay_on_ready(bud_replay_conn_t* conn) {
+  bud_replay_t* replay;
+  bud_replay_session_t* s;
+  uint64_t latency;
+
+  replay = conn->replay;
+  latency = (uv_hrtime() - conn->start) / 1000;
+  if (SSL_session_reused(conn->ssl)) {
+    replay->replayed[kBudReplayResumed]++;
+    bud_bench_samples_add(&replay->resumed_latency, latency);
+  } else {
+    replay->replayed[kBudReplayFull]++;
+    bud_bench_samples_add(&replay->full_latency, latency);
+
+    s = bud_replay_session(replay, conn->record->servername);
+    if (s != NULL) {
+      if (s->session != NULL)
+        SSL_SESSION_free(s->session);
+      s->session = SSL_get1_session(conn->ssl);
+    }
+  }
+
+  /* Handshake is all there was to it */
+  if (conn->record->upload == 0)
+    return bud_replay_close(conn, 0);
+
+  conn->relay_start = uv_hrtime();
+  bud_replay_send(conn);
+}
+
+
+void bud_replay_send(bud_replay_conn_t* conn) {
+  size_t chunk;
+  int r;
+
+  /* Do not buffer more than the watermark, write_cb will continue */
+  while (conn->written < conn->record->upload &&
+         conn->tcp.write_queue_size < BUD_REPLAY_HIGH_WATERMARK) {
+    chunk = conn->record->upload - conn->written;
+    if (chunk > sizeof(conn->buf))
+      chunk = sizeof(conn->buf);
+
+    r = SSL_write(conn->ssl, conn->replay->payload, chunk);
+    if (r <= 0)
+      return bud_replay_close(conn, 1);
+    conn->written += r;
+
+    if (bud_replay_flush(conn) != 0)
+      return bud_replay_close(conn, 1);
+  }
+}
+
+
+int bud_replay_flush(bud_replay_conn_t* conn) {
+  int r;
+  char* data;
+  long len;
+  uv_write_t* req;
+  uv_buf_t buf;
+
+  len = BIO_pending(SSL_get_wbio(conn->ssl));
+  if (len <= 0)
+    return 0;
+
+  /* Request and data are freed together in write_cb */
+  req = malloc(sizeof(*req) + len);
+  if (req == NULL)
+    return -1;
+  req->data = conn;
+  data = (char*) (req + 1);
+  BIO_read(SSL_get_wbio(conn->ssl), data, len);
+
+  buf = uv_buf_init(data, len);
+  r = uv_write(req, (uv_stream_t*) &conn->tcp, &buf, 1, bud_replay_write_cb);
+  if (r != 0) {
+    free(req);
+    return -1;
+  }
+  return 0;
+}
+
+
+void bud_replay_write_cb(uv_write_t* req, int status) {
+  bud_replay_conn_t* conn;
+
+  conn = req->data;
+  free(req);
+  if (status != 0 || conn->closed || !conn->ready)
+    return;
+  if (conn->tcp.write_queue_size < BUD_REPLAY_HIGH_WATERMARK / 2)
+    bud_replay_send(conn);
+}
+
+
+void bud_replay_close(bud_replay_conn_t* conn, int error) {
+  if (conn->closed)
+    return;
+  conn->closed = 1;
+
+  /* Handshake failures are counted here, the rest - in on_ready */
+  if (error && !conn->ready)
+    conn->replay->replayed[kBudReplayFailed]++;
+  uv_close((uv_handle_t*) &conn->tcp, bud_replay_close_cb);
+}
+
+
+void bud_replay_close_cb(uv_handle_t* handle) {
+  bud_replay_conn_t* conn;
+  bud_replay_t* replay;
+
+  conn = handle->data;
+  replay = conn->replay;
+  if (conn->ssl != NULL)
+    SSL_free(conn->ssl);
+  free(conn);
+
+  /* `--speed 0` keeps `concurrency` in flight */
+  replay->active--;
+  bud_replay_schedule(replay);
+}
+
+
+void bud_replay_report(bud_replay_t* replay) {
+  double elapsed;
+  uint64_t total;
+  uint64_t self;
+  uint64_t pids;
+  int i;
+
+  elapsed = (uv_hrtime() - replay->start) / 1e9;
+  bud_bench_cpu_elapsed(&replay->cpu, &self, &pids);
+
+  fprintf(stdout,
+          "duration: %.2fs, records: %lu, rounds: %d, late: %llu\n",
+          elapsed,
+          (unsigned long) replay->record_count,
+          replay->repeat,
+          (unsigned long long) replay->late);
+  total = 0;
+  for (i = 0; i < 3; i++) {
+    fprintf(stdout,
+            "%s: recorded=%llu replayed=%llu (%.1f/s)\n",
+            bud_replay_results[i],
+            (unsigned long long) replay->recorded[i],
+            (unsigned long long) replay->replayed[i],
+            replay->replayed[i] / elapsed);
+    total += replay->replayed[i];
+  }
+  bud_bench_samples_print(&replay->full_latency, "full latency");
+  bud_bench_samples_print(&replay->resumed_latency, "resumed latency");
+  bud_bench_samples_print(&replay->relay_latency, "echo latency");
+  fprintf(stdout,
+          "echoed: %.2f MB (%.2f MB/s)\n",
+          replay->bytes / 1e6,
+          replay->bytes / 1e6 / elapsed);
+
+  if (total == 0)
+    return;
+  fprintf(stdout,
+          "cpu per connection (us): replay=%.1f",
+          (double) self / total);
+  if (replay->cpu.pid_count != 0)
+    fprintf(stdout, " bud=%.1f", (double) pids / total);
+  fprintf(stdout, "\n");
+}
@@ -1,4 +1,15 @@
 {
+  "variables": {
+    # Minimum log level compiled in: 0 - debug ... 4 - fatal
+    "bud_log_level%": 0,
+
+    # USDT probes, see src/probes.h
+    "bud_usdt%": 0,
+
+    # Tagged allocations, see src/memstat.h
+    "bud_memstat%": 0,
+  },
+
   "targets": [{
     "target_name": "bud",
     "type": "executable",
@@ -12,21 +23,158 @@
     "include_dirs": [
       "src",
     ],
+    "defines": [
+      "BUD_LOG_MIN_LEVEL=<(bud_log_level)",
+    ],
+    "conditions": [
+      ["bud_usdt == 1", {
+        "defines": [ "BUD_USDT" ],
+      }],
+      ["bud_memstat == 1", {
+        "defines": [ "BUD_MEMSTAT" ],
+      }],
+    ],
     "sources": [
+      "src/admin.c",
+      "src/access.c",
+      "src/affinity.c",
+      "src/arena.c",
+      "src/backend.c",
+      "src/backend-pool.c",
+      "src/base64-simd.c",
       "src/bio.c",
       "src/bud.c",
+      "src/capture.c",
+      "src/cert-cache.c",
       "src/client.c",
       "src/common.c",
       "src/config.c",
+      "src/disk-cache.c",
+      "src/engine.c",
       "src/error.c",
+      "src/fingerprint.c",
+      "src/handoff.c",
       "src/hello-parser.c",
       "src/http-pool.c",
+      "src/ipc.c",
+      "src/json-stream.c",
       "src/logger.c",
+      "src/lookup.c",
       "src/master.c",
+      "src/memstat.c",
+      "src/metrics.c",
       "src/ocsp.c",
+      "src/preload.c",
+      "src/proxy-parser.c",
+      "src/ratelimit.c",
       "src/server.c",
+      "src/session-cache.c",
+      "src/shared-cache.c",
+      "src/slab.c",
+      "src/snapshot.c",
       "src/sni.c",
+      "src/sni-cache.c",
+      "src/spill.c",
+      "src/tcp-info.c",
+      "src/threads.c",
+      "src/ticket.c",
+      "src/timer-wheel.c",
+      "src/uring.c",
+      "src/verify.c",
       "src/worker.c",
     ],
+  }, {
+    "target_name": "bud-bench",
+    "type": "executable",
+    "dependencies": [
+      "deps/openssl/openssl.gyp:openssl",
+      "deps/uv/uv.gyp:libuv",
+    ],
+    "include_dirs": [
+      "src",
+    ],
+    "sources": [
+      "bench/bench-common.c",
+      "bench/handshake.c",
+    ],
+  }, {
+    "target_name": "bud-bench-accept",
+    "type": "executable",
+    "dependencies": [
+      "deps/openssl/openssl.gyp:openssl",
+      "deps/uv/uv.gyp:libuv",
+    ],
+    "include_dirs": [
+      "src",
+    ],
+    "sources": [
+      "bench/accept.c",
+      "bench/bench-common.c",
+    ],
+  }, {
+    "target_name": "bud-bench-relay",
+    "type": "executable",
+    "dependencies": [
+      "deps/openssl/openssl.gyp:openssl",
+      "deps/uv/uv.gyp:libuv",
+    ],
+    "include_dirs": [
+      "src",
+    ],
+    "sources": [
+      "bench/bench-common.c",
+      "bench/relay.c",
+    ],
+  }, {
+    "target_name": "bud-bench-replay",
+    "type": "executable",
+    "dependencies": [
+      "deps/openssl/openssl.gyp:openssl",
+      "deps/uv/uv.gyp:libuv",
+    ],
+    "include_dirs": [
+      "src",
+    ],
+    "sources": [
+      "bench/bench-common.c",
+      "bench/replay.c",
+      "src/base64-simd.c",
+      "src/common.c",
+      "src/error.c",
+      "src/hello-parser.c",
+      "src/logger.c",
+    ],
+  }, {
+    "target_name": "bud-bench-micro",
+    "type": "executable",
+    "dependencies": [
+      "deps/openssl/openssl.gyp:openssl",
+      "deps/uv/uv.gyp:libuv",
+      "deps/ringbuffer/ringbuffer.gyp:ringbuffer",
+    ],
+    "include_dirs": [
+      "src",
+    ],
+    "sources": [
+      "bench/micro.c",
+      "src/base64-simd.c",
+      "src/common.c",
+      "src/error.c",
+      "src/hello-parser.c",
+      "src/logger.c",
+    ],
+  }, {
+    "target_name": "bud-bench-lookup",
+    "type": "executable",
+    "dependencies": [
+      "deps/openssl/openssl.gyp:openssl",
+      "deps/uv/uv.gyp:libuv",
+    ],
+    "include_dirs": [
+      "src",
+    ],
+    "sources": [
+      "bench/lookup.c",
+    ],
   }]
 }
@@ -21,8 +21,39 @@
 
 #include "ringbuffer.h"
 #include <assert.h>  /* assert */
+#include <stdint.h>  /* uintptr_t */
 #include <stdlib.h>  /* malloc/free */
 #include <string.h>  /* memcpy */
+#ifndef _WIN32
+# include <errno.h>  /* errno */
+# include <fcntl.h>  /* O_RDWR */
+# include <stdio.h>  /* snprintf */
+# include <sys/mman.h>  /* mmap, munmap, shm_open */
+# include <sys/syscall.h>  /* SYS_memfd_create */
+# include <unistd.h>  /* close, ftruncate, sysconf */
+#endif  /* !_WIN32 */
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+# define MAP_ANONYMOUS MAP_ANON
+#endif  /* !MAP_ANONYMOUS && MAP_ANON */
+
+#ifndef MAP_POPULATE
+# define MAP_POPULATE 0
+#endif  /* !MAP_POPULATE */
+
+/* Size and alignment of huge pages on x86-64 and arm64 */
+#define RING_HUGE_PAGE (2 * 1024 * 1024)
+
+/* Reserved chunks start on cache line boundaries */
+#define RING_RESERVE_ALIGN 64
+
+static bufent* ringbuffer_bufent_new(ringbuffer* rb);
+static void ringbuffer_bufent_free(ringbuffer* rb, bufent* b);
+static void ringbuffer_release(ringbuffer* rb);
+static void ringbuffer_pool_trim(ringbuffer_pool* pool, size_t count);
+static char* ringbuffer_pool_map(size_t size, int huge, int* pages);
+static int ringbuffer_mirror_fd(void);
+
 
 void ringbuffer_bufent_init(bufent* b) {
   b->read_pos = 0;
@@ -30,65 +61,456 @@ void ringbuffer_bufent_init(bufent* b) {
   b->next = NULL;
 }
 
+
+void ringbuffer_pool_init(ringbuffer_pool* pool,
+                          size_t chunk_size,
+                          size_t low_watermark,
+                          size_t high_watermark) {
+  assert(chunk_size > 0);
+  if (low_watermark > high_watermark)
+    low_watermark = high_watermark;
+
+  pool->chunk_size = chunk_size;
+  pool->free_list = NULL;
+  pool->free_count = 0;
+  pool->low_watermark = low_watermark;
+  pool->high_watermark = high_watermark;
+  pool->used_count = 0;
+  pool->dirty_count = 0;
+  pool->reserve = NULL;
+  pool->reserve_size = 0;
+  pool->reserve_list = NULL;
+  pool->reserve_count = 0;
+  pool->reserve_pages = kRingbufferPagesNormal;
+  pool->hits = 0;
+  pool->misses = 0;
+}
+
+
+void ringbuffer_pool_destroy(ringbuffer_pool* pool) {
+  ringbuffer_pool_trim(pool, 0);
+#ifndef _WIN32
+  if (pool->reserve != NULL)
+    munmap(pool->reserve, pool->reserve_size);
+#endif  /* !_WIN32 */
+  pool->reserve = NULL;
+  pool->reserve_size = 0;
+  pool->reserve_list = NULL;
+  pool->reserve_count = 0;
+}
+
+
+int ringbuffer_pool_reserve(ringbuffer_pool* pool, size_t count, int huge) {
+  size_t stride;
+  size_t size;
+  size_t i;
+  bufent* b;
+
+  if (count == 0 || pool->reserve != NULL)
+    return 0;
+
+  stride = sizeof(*b) + pool->chunk_size;
+  stride = (stride + RING_RESERVE_ALIGN - 1) & ~(RING_RESERVE_ALIGN - 1);
+  size = (count * stride + RING_HUGE_PAGE - 1) & ~(RING_HUGE_PAGE - 1);
+
+  pool->reserve = ringbuffer_pool_map(size, huge, &pool->reserve_pages);
+  if (pool->reserve == NULL)
+    return -1;
+  pool->reserve_size = size;
+
+  /* Lowest addresses are handed out first */
+  for (i = count; i > 0; i--) {
+    b = (bufent*) (pool->reserve + (i - 1) * stride);
+    b->next = pool->reserve_list;
+    pool->reserve_list = b;
+  }
+  pool->reserve_count = count;
+
+  return 0;
+}
+
+
+char* ringbuffer_pool_map(size_t size, int huge, int* pages) {
+#ifndef _WIN32
+  char* base;
+
+# ifdef MAP_HUGETLB
+  if (huge) {
+    base = mmap(NULL,
+                size,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                -1,
+                0);
+    if (base != MAP_FAILED) {
+      *pages = kRingbufferPagesHugeTLB;
+      return base;
+    }
+  }
+# endif  /* MAP_HUGETLB */
+
+  *pages = kRingbufferPagesNormal;
+# ifdef MADV_HUGEPAGE
+  if (huge) {
+    char* aligned;
+    size_t head;
+
+    /* Khugepaged wants 2MB-aligned ranges, map more and cut the edges */
+    base = mmap(NULL,
+                size + RING_HUGE_PAGE,
+                PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS,
+                -1,
+                0);
+    if (base == MAP_FAILED)
+      return NULL;
+
+    aligned = (char*) (((uintptr_t) base + RING_HUGE_PAGE - 1) &
+                       ~((uintptr_t) RING_HUGE_PAGE - 1));
+    head = aligned - base;
+    if (head != 0)
+      munmap(base, head);
+    munmap(aligned + size, RING_HUGE_PAGE - head);
+
+    /* Fault in after the advice, so that pages are huge from the start */
+    if (madvise(aligned, size, MADV_HUGEPAGE) == 0)
+      *pages = kRingbufferPagesTransparent;
+    memset(aligned, 0, size);
+    return aligned;
+  }
+# endif  /* MADV_HUGEPAGE */
+
+  base = mmap(NULL,
+              size,
+              PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+              -1,
+              0);
+  if (base == MAP_FAILED)
+    return NULL;
+  return base;
+#else  /* _WIN32 */
+  return NULL;
+#endif  /* !_WIN32 */
+}
+
+
+void ringbuffer_pool_trim(ringbuffer_pool* pool, size_t count) {
+  bufent* next;
+
+  while (pool->free_count > count) {
+    next = pool->free_list->next;
+    free(pool->free_list);
+    pool->free_list = next;
+    pool->free_count--;
+    if (pool->dirty_count > 0)
+      pool->dirty_count--;
+  }
+}
+
+
+size_t ringbuffer_pool_purge(ringbuffer_pool* pool) {
+#ifndef _WIN32
+  bufent* b;
+  long page;
+  uintptr_t start;
+  uintptr_t end;
+  size_t purged;
+
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0)
+    return 0;
+
+  /*
+   * Chunks come from `malloc()`, only whole pages inside of `data` are ours.
+   * Freed chunks are pushed to the head, so purged ones are all at the tail.
+   */
+  purged = 0;
+  for (b = pool->free_list; pool->dirty_count > 0; b = b->next) {
+    pool->dirty_count--;
+    start = ((uintptr_t) b->data + page - 1) & ~((uintptr_t) page - 1);
+    end = ((uintptr_t) b->data + pool->chunk_size) & ~((uintptr_t) page - 1);
+    if (end <= start)
+      continue;
+    if (madvise((void*) start, end - start, MADV_DONTNEED) == 0)
+      purged += end - start;
+  }
+
+  return purged;
+#else  /* _WIN32 */
+  return 0;
+#endif  /* !_WIN32 */
+}
+
+
+bufent* ringbuffer_bufent_new(ringbuffer* rb) {
+  bufent* b;
+  ringbuffer_pool* pool;
+
+  pool = rb->pool;
+  if (pool != NULL && pool->reserve_list != NULL) {
+    b = pool->reserve_list;
+    pool->reserve_list = b->next;
+    pool->reserve_count--;
+    pool->hits++;
+  } else if (pool != NULL && pool->free_list != NULL) {
+    b = pool->free_list;
+    pool->free_list = b->next;
+    pool->free_count--;
+    if (pool->dirty_count > 0)
+      pool->dirty_count--;
+    pool->hits++;
+  } else {
+    b = malloc(sizeof(*b) + rb->chunk_size);
+    if (b == NULL)
+      return NULL;
+    if (pool != NULL)
+      pool->misses++;
+  }
+
+  if (pool != NULL)
+    pool->used_count++;
+  ringbuffer_bufent_init(b);
+  return b;
+}
+
+
+void ringbuffer_bufent_free(ringbuffer* rb, bufent* b) {
+  ringbuffer_pool* pool;
+
+  pool = rb->pool;
+  if (pool == NULL) {
+    free(b);
+    return;
+  }
+
+  assert(pool->used_count > 0);
+  pool->used_count--;
+
+  /* Reserved chunks stay in the mapping */
+  if ((char*) b >= pool->reserve &&
+      (char*) b < pool->reserve + pool->reserve_size) {
+    b->next = pool->reserve_list;
+    pool->reserve_list = b;
+    pool->reserve_count++;
+    return;
+  }
+
+  b->next = pool->free_list;
+  pool->free_list = b;
+  pool->free_count++;
+  pool->dirty_count++;
+
+  if (pool->free_count > pool->high_watermark)
+    ringbuffer_pool_trim(pool, pool->low_watermark);
+}
+
+
 void ringbuffer_init(ringbuffer* rb) {
+  ringbuffer_init_pool(rb, NULL, 0);
+}
+
+
+void ringbuffer_init_pool(ringbuffer* rb, ringbuffer_pool* pool, int lazy) {
   rb->length = 0;
-  ringbuffer_bufent_init(&rb->head);
-  rb->head.next = &rb->head;
-  rb->read_head = &rb->head;
-  rb->write_head = &rb->head;
+  rb->chunk_size = pool == NULL ? RING_BUFFER_LEN : pool->chunk_size;
+  rb->max_size = rb->chunk_size * RING_BUFFER_COUNT;
+  rb->pool = pool;
+  rb->lazy = lazy;
+  rb->read_head = NULL;
+  rb->write_head = NULL;
+  rb->mirror = NULL;
+  rb->mirror_size = 0;
+  rb->mirror_read = 0;
+  if (lazy)
+    return;
+
+  /* Allocate first chunk eagerly, `ringbuffer_write_ptr` will retry on OOM */
+  rb->read_head = ringbuffer_bufent_new(rb);
+  if (rb->read_head != NULL)
+    rb->read_head->next = rb->read_head;
+  rb->write_head = rb->read_head;
 }
 
 
-void ringbuffer_destroy(ringbuffer* rb) {
+int ringbuffer_init_mirror(ringbuffer* rb, size_t size) {
+#ifndef _WIN32
+  long page;
+  int fd;
+  char* base;
+
+  page = sysconf(_SC_PAGESIZE);
+  if (page <= 0 || size == 0)
+    return -1;
+  size = (size + page - 1) / page * page;
+
+  fd = ringbuffer_mirror_fd();
+  if (fd == -1)
+    return -1;
+  if (ftruncate(fd, size) != 0)
+    goto failed_truncate;
+
+  /* Reserve both halves, then put the same pages into each */
+  base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED)
+    goto failed_truncate;
+  if (mmap(base,
+           size,
+           PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED,
+           fd,
+           0) != base) {
+    goto failed_map;
+  }
+  if (mmap(base + size,
+           size,
+           PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED,
+           fd,
+           0) != base + size) {
+    goto failed_map;
+  }
+  close(fd);
+
+  ringbuffer_init_pool(rb, NULL, 1);
+  rb->chunk_size = size;
+  rb->max_size = size;
+  rb->mirror = base;
+  rb->mirror_size = size;
+  return 0;
+
+failed_map:
+  munmap(base, 2 * size);
+
+failed_truncate:
+  close(fd);
+  return -1;
+#else  /* _WIN32 */
+  return -1;
+#endif  /* !_WIN32 */
+}
+
+
+int ringbuffer_mirror_fd(void) {
+#ifndef _WIN32
+  static unsigned int counter;
+  char name[64];
+  int fd;
+  int i;
+
+# ifdef SYS_memfd_create
+  /* Linux 3.17+, falls back to POSIX shm on ENOSYS */
+  fd = syscall(SYS_memfd_create, "ringbuffer", 0);
+  if (fd != -1)
+    return fd;
+# endif  /* SYS_memfd_create */
+
+  /* Anonymous file, which is gone as soon as it is mapped */
+  for (i = 0; i < 8; i++) {
+    snprintf(name,
+             sizeof(name),
+             "/ringbuffer-%d-%u",
+             (int) getpid(),
+             counter++);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd != -1) {
+      shm_unlink(name);
+      return fd;
+    }
+    if (errno != EEXIST)
+      break;
+  }
+#endif  /* !_WIN32 */
+  return -1;
+}
+
+
+void ringbuffer_set_max_size(ringbuffer* rb, size_t max_size) {
+  /* Mirror can't grow */
+  if (rb->mirror != NULL && max_size > rb->mirror_size)
+    max_size = rb->mirror_size;
+  rb->max_size = max_size;
+}
+
+
+void ringbuffer_release(ringbuffer* rb) {
   bufent* current;
   bufent* next;
 
-  current = rb->head.next;
-  while (current != &rb->head) {
+  if (rb->read_head == NULL)
+    return;
+
+  current = rb->read_head->next;
+  while (current != rb->read_head) {
     next = current->next;
-    free(current);
+    ringbuffer_bufent_free(rb, current);
     current = next;
   }
+  ringbuffer_bufent_free(rb, rb->read_head);
 
   rb->read_head = NULL;
   rb->write_head = NULL;
 }
 
 
-/* Free excessive data */
+void ringbuffer_destroy(ringbuffer* rb) {
+#ifndef _WIN32
+  if (rb->mirror != NULL) {
+    munmap(rb->mirror, 2 * rb->mirror_size);
+    rb->mirror = NULL;
+  }
+#endif  /* !_WIN32 */
+  ringbuffer_release(rb);
+  rb->length = 0;
+}
+
+
+size_t ringbuffer_trim(ringbuffer* rb) {
+  bufent* current;
+  size_t count;
+
+  if (rb->length != 0 || rb->mirror != NULL || rb->read_head == NULL)
+    return 0;
+
+  count = 1;
+  for (current = rb->read_head->next;
+       current != rb->read_head;
+       current = current->next) {
+    count++;
+  }
+  ringbuffer_release(rb);
+
+  return count;
+}
+
+
+/* Free excessive data, but keep one spare chunk after the write head */
 void ringbuffer_free_empty(ringbuffer* rb) {
   bufent* child;
   bufent* cur;
-  bufent* prev;
   bufent* next;
 
+  /* Lazy buffers give everything back once drained */
+  if (rb->lazy && rb->length == 0)
+    return ringbuffer_release(rb);
+
+  if (rb->write_head == NULL)
+    return;
+
   child = rb->write_head->next;
   if (child == rb->write_head || child == rb->read_head)
     return;
-  cur = child->next;
-  if (cur == rb->write_head || cur == rb->read_head)
-    return;
 
-  prev = child;
+  cur = child->next;
   while (cur != rb->read_head) {
-    /* Skip embedded buffer, and continue deallocating
-     * again starting from it
-     */
-    if (cur == &rb->head) {
-      prev->next = cur;
-      prev = cur;
-      cur = rb->head.next;
-      continue;
-    }
     assert(cur != rb->write_head);
     assert(cur->write_pos == cur->read_pos);
 
     next = cur->next;
-    free(cur);
+    ringbuffer_bufent_free(rb, cur);
     cur = next;
   }
-  assert(prev == child || prev == &rb->head);
-  prev->next = cur;
+  child->next = cur;
 }
 
 
@@ -118,6 +540,14 @@ size_t ringbuffer_read_into(ringbuffer* rb, char* out, size_t length) {
   offset = 0;
   left = length;
 
+  if (rb->mirror != NULL) {
+    if (out != NULL)
+      memcpy(out, rb->mirror + rb->mirror_read, expected);
+    rb->mirror_read = (rb->mirror_read + expected) % rb->mirror_size;
+    rb->length -= expected;
+    return expected;
+  }
+
   while (bytes_read < expected) {
     read_head = rb->read_head;
     assert(read_head->read_pos <= read_head->write_pos);
@@ -149,6 +579,16 @@ size_t ringbuffer_read_into(ringbuffer* rb, char* out, size_t length) {
 
 
 char* ringbuffer_read_next(ringbuffer* rb, size_t* length) {
+  if (rb->mirror != NULL) {
+    *length = rb->length;
+    return rb->mirror + rb->mirror_read;
+  }
+
+  if (rb->read_head == NULL) {
+    *length = 0;
+    return NULL;
+  }
+
   *length = rb->read_head->write_pos - rb->read_head->read_pos;
   return rb->read_head->data + rb->read_head->read_pos;
 }
@@ -158,18 +598,57 @@ size_t ringbuffer_read_nextv(ringbuffer* rb,
                              char** out,
                              size_t* size,
                              size_t* count) {
+  return ringbuffer_read_nextv_at(rb, 0, out, size, count);
+}
+
+
+size_t ringbuffer_read_nextv_at(ringbuffer* rb,
+                                size_t offset,
+                                char** out,
+                                size_t* size,
+                                size_t* count) {
   size_t i;
   size_t max;
   size_t total;
+  size_t avail;
   bufent* pos;
 
+  /* All in one piece */
+  if (rb->mirror != NULL) {
+    if (*count == 0 || offset >= rb->length) {
+      *count = 0;
+      return 0;
+    }
+    out[0] = rb->mirror + rb->mirror_read + offset;
+    size[0] = rb->length - offset;
+    *count = 1;
+    return size[0];
+  }
+
   pos = rb->read_head;
+  if (pos == NULL) {
+    *count = 0;
+    return 0;
+  }
+
+  /* Skip `offset` bytes, i.e. ones that are already being written */
+  for (;;) {
+    avail = pos->write_pos - pos->read_pos;
+    if (offset < avail || pos == rb->write_head)
+      break;
+    offset -= avail;
+    pos = pos->next;
+  }
+  if (offset > avail)
+    offset = avail;
+
   max = *count;
   total = 0;
   for (i = 0; i < max; i++) {
-    size[i] = pos->write_pos - pos->read_pos;
+    size[i] = pos->write_pos - pos->read_pos - offset;
     total += size[i];
-    out[i] = pos->data + pos->read_pos;
+    out[i] = pos->data + pos->read_pos + offset;
+    offset = 0;
 
     /* Don't get past write head */
     if (pos == rb->write_head)
@@ -195,6 +674,12 @@ void ringbuffer_read_skip(ringbuffer* rb, size_t length) {
 void ringbuffer_read_pop(ringbuffer* rb) {
   size_t avail;
 
+  if (rb->mirror != NULL)
+    return ringbuffer_read_skip(rb, rb->length);
+
+  if (rb->read_head == NULL)
+    return;
+
   avail = rb->read_head->write_pos - rb->read_head->read_pos;
   ringbuffer_read_skip(rb, avail);
 }
@@ -203,16 +688,26 @@ void ringbuffer_read_pop(ringbuffer* rb) {
 int ringbuffer_try_allocate_for_write(ringbuffer* rb) {
   bufent* next;
 
+  /* Empty (lazy or OOM-ed) buffer, allocate first chunk */
+  if (rb->write_head == NULL) {
+    next = ringbuffer_bufent_new(rb);
+    if (next == NULL)
+      return -1;
+    next->next = next;
+    rb->read_head = next;
+    rb->write_head = next;
+    return 0;
+  }
+
   /* If write head is full, next buffer is
    * either read head or not empty.
    */
-  if (rb->write_head->write_pos == RING_BUFFER_LEN &&
+  if (rb->write_head->write_pos == rb->chunk_size &&
       (rb->write_head->next == rb->read_head ||
        rb->write_head->next->write_pos != 0)) {
-    next = malloc(sizeof(bufent));
+    next = ringbuffer_bufent_new(rb);
     if (next == NULL)
       return -1;
-    ringbuffer_bufent_init(next);
     next->next = rb->write_head->next;
     rb->write_head->next = next;
   }
@@ -230,13 +725,32 @@ size_t ringbuffer_write_into(ringbuffer* rb,
   size_t avail;
   bufent* write_head;
 
+  if (length == 0)
+    return 0;
+
+  if (rb->mirror != NULL) {
+    avail = rb->mirror_size - rb->length;
+    to_write = length > avail ? avail : length;
+    if (to_write == 0)
+      return (size_t) -1;
+    memcpy(rb->mirror + (rb->mirror_read + rb->length) % rb->mirror_size,
+           data,
+           to_write);
+    rb->length += to_write;
+    return to_write == length ? 0 : to_write;
+  }
+
+  /* Report failure, even though nothing was written */
+  if (rb->write_head == NULL && ringbuffer_try_allocate_for_write(rb))
+    return (size_t) -1;
+
   offset = 0;
   left = length;
   while (left > 0) {
     to_write = left;
     write_head = rb->write_head;
-    assert(write_head->write_pos <= RING_BUFFER_LEN);
-    avail = RING_BUFFER_LEN - rb->write_head->write_pos;
+    assert(write_head->write_pos <= rb->chunk_size);
+    avail = rb->chunk_size - rb->write_head->write_pos;
 
     if (to_write > avail)
       to_write = avail;
@@ -251,11 +765,11 @@ size_t ringbuffer_write_into(ringbuffer* rb,
     offset += to_write;
     rb->length += to_write;
     write_head->write_pos += to_write;
-    assert(write_head->write_pos <= RING_BUFFER_LEN);
+    assert(write_head->write_pos <= rb->chunk_size);
 
     /* Go to next buffer if there still are some bytes to write */
     if (left != 0) {
-      assert(write_head->write_pos == RING_BUFFER_LEN);
+      assert(write_head->write_pos == rb->chunk_size);
       if (ringbuffer_try_allocate_for_write(rb))
         return offset;
       rb->write_head = write_head->next;
@@ -273,7 +787,22 @@ size_t ringbuffer_write_into(ringbuffer* rb,
 char* ringbuffer_write_ptr(ringbuffer* rb, size_t* length) {
   size_t available;
 
-  available = RING_BUFFER_LEN - rb->write_head->write_pos;
+  if (rb->mirror != NULL) {
+    available = rb->mirror_size - rb->length;
+    if (*length == 0 || available < *length)
+      *length = available;
+    if (available == 0)
+      return NULL;
+    return rb->mirror + (rb->mirror_read + rb->length) % rb->mirror_size;
+  }
+
+  /* Pull chunk from the pool only when data arrives */
+  if (rb->write_head == NULL && ringbuffer_try_allocate_for_write(rb)) {
+    *length = 0;
+    return NULL;
+  }
+
+  available = rb->chunk_size - rb->write_head->write_pos;
   if (*length == 0 || available < *length)
     *length = available;
 
@@ -281,10 +810,96 @@ char* ringbuffer_write_ptr(ringbuffer* rb, size_t* length) {
 }
 
 
+size_t ringbuffer_write_ptrv(ringbuffer* rb,
+                             char** out,
+                             size_t* size,
+                             size_t* count) {
+  size_t i;
+  size_t max;
+  size_t total;
+  bufent* pos;
+  bufent* next;
+
+  max = *count;
+  *count = 0;
+  if (max == 0)
+    return 0;
+
+  /* All in one piece */
+  if (rb->mirror != NULL) {
+    size[0] = 0;
+    out[0] = ringbuffer_write_ptr(rb, &size[0]);
+    if (out[0] == NULL)
+      return 0;
+    *count = 1;
+    return size[0];
+  }
+
+  if (rb->write_head == NULL && ringbuffer_try_allocate_for_write(rb))
+    return 0;
+
+  pos = rb->write_head;
+  total = 0;
+  for (i = 0; i < max; i++) {
+    out[i] = pos->data + pos->write_pos;
+    size[i] = rb->chunk_size - pos->write_pos;
+    total += size[i];
+    if (i + 1 == max)
+      break;
+
+    /* Same rule as in ringbuffer_try_allocate_for_write() */
+    if (pos->next == rb->read_head || pos->next->write_pos != 0) {
+      next = ringbuffer_bufent_new(rb);
+      if (next == NULL)
+        break;
+      next->next = pos->next;
+      pos->next = next;
+    }
+    pos = pos->next;
+  }
+  *count = i + 1;
+
+  return total;
+}
+
+
 int ringbuffer_write_append(ringbuffer* rb, size_t length) {
+  size_t avail;
+
+  if (rb->mirror != NULL) {
+    assert(rb->length + length <= rb->mirror_size);
+    rb->length += length;
+    return 0;
+  }
+
+  if (rb->write_head == NULL) {
+    assert(length == 0);
+    return 0;
+  }
+
+  /* Filled regions of ringbuffer_write_ptrv() */
+  for (;;) {
+    avail = rb->chunk_size - rb->write_head->write_pos;
+    if (length <= avail)
+      break;
+
+    rb->write_head->write_pos = rb->chunk_size;
+    rb->length += avail;
+    length -= avail;
+    rb->write_head = rb->write_head->next;
+    assert(rb->write_head->write_pos == 0);
+    ringbuffer_try_move_read_head(rb);
+  }
+
   rb->write_head->write_pos += length;
   rb->length += length;
-  assert(rb->write_head->write_pos <= RING_BUFFER_LEN);
+  assert(rb->write_head->write_pos <= rb->chunk_size);
+
+  /* Nothing was read into lazily allocated chunk, give it back */
+  if (rb->length == 0) {
+    ringbuffer_free_empty(rb);
+    return 0;
+  }
 
   /* Allocate new buffer if write head is full,
    * and there're no other place to go
@@ -292,7 +907,7 @@ int ringbuffer_write_append(ringbuffer* rb, size_t length) {
   if (ringbuffer_try_allocate_for_write(rb))
     return -1;
 
-  if (rb->write_head->write_pos == RING_BUFFER_LEN) {
+  if (rb->write_head->write_pos == rb->chunk_size) {
     rb->write_head = rb->write_head->next;
 
     /* Read head may be full */
@@ -314,5 +929,5 @@ int ringbuffer_is_empty(ringbuffer* rb) {
 
 
 int ringbuffer_is_full(ringbuffer* rb) {
-  return ringbuffer_size(rb) >= RING_MAX_SIZE;
+  return ringbuffer_size(rb) >= rb->max_size;
 }
@@ -25,7 +25,7 @@
 #include <stddef.h>
 #include <sys/types.h>  /* size_t */
 
-/* Tweak these for potential memory/throughput tradeoffs */
+/* Defaults, pooled buffers may use different chunk size and count */
 
 /* 16 * 1024 - 3 * 8 - 360, to make `proxystate` aligned */
 #define RING_BUFFER_LEN 16000
@@ -36,30 +36,149 @@ typedef struct bufent {
     size_t read_pos;
     size_t write_pos;
     struct bufent* next;
-    char data[RING_BUFFER_LEN];
+    char data[];
 } bufent;
 
+/*
+ * Shared source of chunks for ringbuffers: drained buffers return their
+ * chunks here instead of `free()`-ing them, and lazy buffers take chunks
+ * from it only when data arrives.
+ *
+ * Once more than `high_watermark` chunks are cached, the free list is
+ * trimmed down to `low_watermark`.
+ */
+typedef enum {
+  kRingbufferPagesNormal,
+
+  /* Transparent huge pages, `madvise(MADV_HUGEPAGE)` */
+  kRingbufferPagesTransparent,
+
+  /* Preallocated huge pages, `mmap(MAP_HUGETLB)` */
+  kRingbufferPagesHugeTLB
+} ringbuffer_pool_pages_t;
+
+typedef struct ringbuffer_pool {
+    size_t chunk_size;
+    bufent* free_list;
+    size_t free_count;
+    size_t low_watermark;
+    size_t high_watermark;
+
+    /* Chunks handed out to ringbuffers */
+    size_t used_count;
+
+    /* Cached chunks at the head of `free_list` that weren't purged yet */
+    size_t dirty_count;
+
+    /*
+     * Chunks preallocated by `ringbuffer_pool_reserve()` in one mapping of
+     * `reserve_size` bytes, free ones are in `reserve_list` and are handed
+     * out first. They are never trimmed or purged.
+     */
+    char* reserve;
+    size_t reserve_size;
+    bufent* reserve_list;
+    size_t reserve_count;
+
+    /* Pages of the reservation, see ringbuffer_pool_pages_t */
+    int reserve_pages;
+
+    /* Allocations served from the free list / by `malloc()` */
+    unsigned long long hits;
+    unsigned long long misses;
+} ringbuffer_pool;
+
 typedef struct ringbuffer {
     size_t length;
+    size_t chunk_size;
+
+    /* `ringbuffer_is_full()` threshold */
+    size_t max_size;
+
     bufent* read_head;
     bufent* write_head;
-    bufent head;
+
+    /* NULL - chunks are allocated with `malloc()` */
+    ringbuffer_pool* pool;
+
+    /* If non-zero - all chunks are released once buffer is drained */
+    int lazy;
+
+    /*
+     * Mirror mode, see `ringbuffer_init_mirror()`: no chunks, `mirror` is
+     * `mirror_size` bytes mapped twice in a row, data starts at `mirror_read`
+     */
+    char* mirror;
+    size_t mirror_size;
+    size_t mirror_read;
 } ringbuffer;
 
+void ringbuffer_pool_init(ringbuffer_pool* pool,
+                          size_t chunk_size,
+                          size_t low_watermark,
+                          size_t high_watermark);
+void ringbuffer_pool_destroy(ringbuffer_pool* pool);
+
+/*
+ * Give pages of cached chunks back to the kernel (the chunks stay cached,
+ * and are faulted in again on reuse). Returns number of bytes purged.
+ */
+size_t ringbuffer_pool_purge(ringbuffer_pool* pool);
+
+/*
+ * Map and fault in `count` chunks at once, once per pool. If `huge` is
+ * non-zero - 2MB pages are tried first: `MAP_HUGETLB` (needs
+ * `vm.nr_hugepages`), then transparent huge pages, then normal pages.
+ * Returns non-zero if even the normal mapping failed.
+ */
+int ringbuffer_pool_reserve(ringbuffer_pool* pool, size_t count, int huge);
+
 void ringbuffer_init(ringbuffer* rb);
+void ringbuffer_init_pool(ringbuffer* rb, ringbuffer_pool* pool, int lazy);
+
+/*
+ * One region of at least `size` bytes (rounded up to pages) mapped twice
+ * back to back, so that all data and all free space are always contiguous:
+ * `ringbuffer_read_next()` returns everything that was written. Returns
+ * non-zero if the mapping can't be created, `rb` is not initialized then.
+ */
+int ringbuffer_init_mirror(ringbuffer* rb, size_t size);
+void ringbuffer_set_max_size(ringbuffer* rb, size_t max_size);
 void ringbuffer_destroy(ringbuffer* rb);
 
+/*
+ * Release all chunks of an empty buffer, they are allocated again on the
+ * next write. Returns number of chunks released.
+ */
+size_t ringbuffer_trim(ringbuffer* rb);
+
 size_t ringbuffer_read_into(ringbuffer* rb, char* out, size_t length);
 char* ringbuffer_read_next(ringbuffer* rb, size_t* length);
 size_t ringbuffer_read_nextv(ringbuffer* rb,
                              char** out,
                              size_t* size,
                              size_t* count);
+size_t ringbuffer_read_nextv_at(ringbuffer* rb,
+                                size_t offset,
+                                char** out,
+                                size_t* size,
+                                size_t* count);
 void ringbuffer_read_skip(ringbuffer* rb, size_t length);
 void ringbuffer_read_pop(ringbuffer *rb);
 
 size_t ringbuffer_write_into(ringbuffer* rb, const char* data, size_t length);
 char* ringbuffer_write_ptr(ringbuffer* rb, size_t* length);
+
+/*
+ * Free space of the write head and of up to `*count - 1` chunks after it,
+ * allocating the missing ones. Regions are meant to be filled in order, and
+ * committed at once: `ringbuffer_write_append()` may span all of them.
+ * Returns total size, `*count` is set to the number of regions.
+ */
+size_t ringbuffer_write_ptrv(ringbuffer* rb,
+                             char** out,
+                             size_t* size,
+                             size_t* count);
 int ringbuffer_write_append(ringbuffer* rb, size_t length);
 
 size_t ringbuffer_size(ringbuffer* rb);
@@ -6,6 +6,7 @@
 #include <string.h>  /* memcpy */
 
 #define TEST_DATA_SIZE 256 * 1024 * 1024
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 #define ASSERT(e) \
     if (!(e)) {\
       fprintf(stderr, "ASSERT: " #e " failed on %d\n", __LINE__); \
@@ -14,22 +15,15 @@
 
 static char* data;
 static ringbuffer rb;
+static ringbuffer_pool pool;
 
-int main() {
+static void test_fill_and_drain() {
   int i;
   int j;
   int r;
   ssize_t len;
   char* ptr;
 
-  data = malloc(TEST_DATA_SIZE);
-  assert(data != NULL);
-  ringbuffer_init(&rb);
-
-  /* Fill test data */
-  for (i = 0; i < TEST_DATA_SIZE; i++)
-    data[i] = (i * i) % 137;
-
   /* Fill ringbuffer */
   i = 0;
   while (i < TEST_DATA_SIZE) {
@@ -63,9 +57,170 @@ int main() {
     ringbuffer_read_skip(&rb, len);
     i += len;
   }
+  ASSERT(ringbuffer_is_empty(&rb));
 
   /* Destroy it */
   ringbuffer_destroy(&rb);
+}
+
+static void test_mirror() {
+  int i;
+  int r;
+  size_t len;
+  size_t off;
+  size_t total;
+  char* ptr;
+  char* out[RING_BUFFER_COUNT];
+  size_t size[RING_BUFFER_COUNT];
+
+  r = ringbuffer_init_mirror(&rb, 3 * 4096 + 1);
+  ASSERT(r == 0);
+  ASSERT(rb.mirror_size == 4 * 4096);
+  ringbuffer_set_max_size(&rb, rb.mirror_size);
+
+  /* Odd steps, so that both data and free space wrap around */
+  off = 0;
+  for (i = 0; i < 1000; i++) {
+    len = 0;
+    ptr = ringbuffer_write_ptr(&rb, &len);
+    ASSERT(ptr != NULL);
+    ASSERT(len == rb.mirror_size - ringbuffer_size(&rb));
+    if (len > 7777)
+      len = 7777;
+    memcpy(ptr, data + off + ringbuffer_size(&rb), len);
+    r = ringbuffer_write_append(&rb, len);
+    ASSERT(r == 0);
+
+    /* Everything is readable in one piece */
+    ptr = ringbuffer_read_next(&rb, &len);
+    ASSERT(len == ringbuffer_size(&rb));
+    ASSERT(memcmp(ptr, data + off, len) == 0);
+    len = ARRAY_SIZE(out);
+    total = ringbuffer_read_nextv_at(&rb, 100, out, size, &len);
+    ASSERT(len == 1 && total == ringbuffer_size(&rb) - 100);
+    ASSERT(out[0] == ptr + 100);
+
+    len = ringbuffer_size(&rb) / 2 + 1;
+    ringbuffer_read_skip(&rb, len);
+    off += len;
+  }
+
+  /* Copying in, up to the free space */
+  ringbuffer_read_pop(&rb);
+  ASSERT(ringbuffer_is_empty(&rb));
+  ASSERT(ringbuffer_write_into(&rb, data, 5000) == 0);
+  ASSERT(ringbuffer_write_into(&rb, data + 5000, rb.mirror_size) ==
+         rb.mirror_size - 5000);
+  ASSERT(ringbuffer_is_full(&rb));
+  len = 0;
+  ASSERT(ringbuffer_write_ptr(&rb, &len) == NULL && len == 0);
+  ptr = ringbuffer_read_next(&rb, &len);
+  ASSERT(len == rb.mirror_size && memcmp(ptr, data, len) == 0);
+
+  ringbuffer_destroy(&rb);
+  ASSERT(rb.mirror == NULL);
+}
+
+int main() {
+  int i;
+  size_t len;
+  char* out[RING_BUFFER_COUNT];
+  size_t size[RING_BUFFER_COUNT];
+  char copy[4096 + 100];
+
+  data = malloc(TEST_DATA_SIZE);
+  assert(data != NULL);
+
+  /* Fill test data */
+  for (i = 0; i < TEST_DATA_SIZE; i++)
+    data[i] = (i * i) % 137;
+
+  /* Eagerly allocated buffer */
+  ringbuffer_init(&rb);
+  test_fill_and_drain();
+
+  /* Lazy buffer, should give all chunks back to the pool */
+  ringbuffer_pool_init(&pool, RING_BUFFER_LEN, 8, 16);
+  ringbuffer_init_pool(&rb, &pool, 1);
+  ASSERT(ringbuffer_read_next(&rb, &len) == NULL && len == 0);
+  test_fill_and_drain();
+  ASSERT(pool.used_count == 0);
+  ASSERT(pool.free_count >= 8 && pool.free_count <= 16);
+
+  /* Eager pooled buffer, should reuse cached chunks */
+  ringbuffer_init_pool(&rb, &pool, 0);
+  ASSERT(pool.hits == 1);
+  test_fill_and_drain();
+  ASSERT(pool.used_count == 0);
+  ASSERT(pool.free_count >= 8 && pool.free_count <= 16);
+  ringbuffer_pool_destroy(&pool);
+  ASSERT(pool.free_count == 0);
+
+  /* Small chunks, custom limit */
+  ringbuffer_pool_init(&pool, 4096, 8, 16);
+  ringbuffer_init_pool(&rb, &pool, 1);
+  ASSERT(!ringbuffer_is_full(&rb));
+  ringbuffer_set_max_size(&rb, 3 * 4096);
+  ASSERT(ringbuffer_write_into(&rb, data, 3 * 4096 - 1) == 0);
+  ASSERT(!ringbuffer_is_full(&rb));
+  ASSERT(ringbuffer_write_into(&rb, data, 1) == 0);
+  ASSERT(ringbuffer_is_full(&rb));
+  ASSERT(pool.used_count == 3);
+  ringbuffer_destroy(&rb);
+  ringbuffer_init_pool(&rb, &pool, 1);
+  test_fill_and_drain();
+  ASSERT(pool.used_count == 0);
+
+  /* Free space of several chunks, committed at once */
+  ringbuffer_init_pool(&rb, &pool, 1);
+  ASSERT(ringbuffer_write_into(&rb, data, 1000) == 0);
+  len = ARRAY_SIZE(out);
+  ASSERT(ringbuffer_write_ptrv(&rb, out, size, &len) == 4 * 4096 - 1000);
+  ASSERT(len == 4 && size[0] == 4096 - 1000 && size[3] == 4096);
+  ASSERT(pool.used_count == 4);
+  memcpy(out[0], data + 1000, size[0]);
+  memcpy(out[1], data + 4096, 100);
+  ASSERT(ringbuffer_write_append(&rb, size[0] + 100) == 0);
+  ASSERT(ringbuffer_size(&rb) == 4096 + 100);
+  ASSERT(ringbuffer_read_into(&rb, copy, sizeof(copy)) == sizeof(copy));
+  ASSERT(memcmp(copy, data, sizeof(copy)) == 0);
+  ringbuffer_destroy(&rb);
+  ASSERT(pool.used_count == 0);
+  ringbuffer_pool_destroy(&pool);
+
+  /* Trimming idle buffer, and purging the chunks it gave back */
+  ringbuffer_pool_init(&pool, RING_BUFFER_LEN, 8, 16);
+  ringbuffer_init_pool(&rb, &pool, 0);
+  ASSERT(ringbuffer_write_into(&rb, data, 3 * RING_BUFFER_LEN) == 0);
+  ASSERT(ringbuffer_trim(&rb) == 0);
+  ringbuffer_read_skip(&rb, 3 * RING_BUFFER_LEN);
+  ASSERT(ringbuffer_trim(&rb) > 0 && rb.read_head == NULL);
+  ASSERT(pool.used_count == 0 && pool.dirty_count == pool.free_count);
+  ASSERT(ringbuffer_pool_purge(&pool) > 0);
+  ASSERT(pool.dirty_count == 0 && ringbuffer_pool_purge(&pool) == 0);
+  test_fill_and_drain();
+  ASSERT(pool.used_count == 0);
+  ASSERT(pool.dirty_count <= pool.free_count);
+  ringbuffer_pool_destroy(&pool);
+  ASSERT(pool.dirty_count == 0);
+
+  /* Reserved chunks are used first, and go back to the reservation */
+  ringbuffer_pool_init(&pool, RING_BUFFER_LEN, 8, 16);
+  ASSERT(ringbuffer_pool_reserve(&pool, 6, 1) == 0);
+  ASSERT(pool.reserve_count == 6 && (pool.reserve_size & ((2 << 20) - 1)) == 0);
+  ringbuffer_init_pool(&rb, &pool, 1);
+  test_fill_and_drain();
+  ASSERT(pool.used_count == 0 && pool.reserve_count == 6);
+  ASSERT(pool.free_count > 0);
+  ringbuffer_init_pool(&rb, &pool, 0);
+  ASSERT(pool.reserve_count == 5);
+  ASSERT(rb.read_head == (bufent*) pool.reserve);
+  ringbuffer_destroy(&rb);
+  ringbuffer_pool_destroy(&pool);
+  ASSERT(pool.reserve == NULL && pool.free_count == 0);
+
+  /* Double-mapped buffer */
+  test_mirror();
 
   return 0;
 }
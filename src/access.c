@@ -0,0 +1,377 @@
+#include <netinet/in.h>  /* sockaddr_in, sockaddr_in6 */
+#include <stdio.h>  /* FILE, fopen, fgets, fclose */
+#include <stdlib.h>  /* calloc, realloc, free, strtol */
+#include <string.h>  /* memcpy, memset, strchr, strcspn, strspn */
+
+#include "uv.h"
+
+#include "access.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+static bud_error_t bud_access_load(bud_config_t* config,
+                                   bud_access_t* access,
+                                   const bud_config_strs_t* list,
+                                   const char* file,
+                                   bud_access_action_t action);
+static bud_error_t bud_access_load_file(bud_config_t* config,
+                                        bud_access_t* access,
+                                        const char* path,
+                                        bud_access_action_t action);
+static int bud_access_parse(const char* str,
+                            size_t len,
+                            uint8_t* key,
+                            int* bits);
+static int bud_access_insert(bud_access_t* access,
+                             const uint8_t* key,
+                             int bits,
+                             bud_access_action_t action);
+static uint32_t bud_access_node_new(bud_access_t* access,
+                                    const uint8_t* key,
+                                    int bits,
+                                    bud_access_action_t action);
+static int bud_access_common(const uint8_t* a, const uint8_t* b, int limit);
+static int bud_access_bit(const uint8_t* key, int bit);
+
+static const uint8_t bud_access_v4_prefix[12] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+
+bud_error_t bud_access_new(bud_config_t* config, bud_access_t** out) {
+  bud_access_t* access;
+  bud_error_t err;
+
+  *out = NULL;
+  access = calloc(1, sizeof(*access));
+  if (access == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_access_t");
+
+  /* Deny first, so that the same prefix in both lists stays denied */
+  err = bud_access_load(config,
+                        access,
+                        config->frontend.access.deny,
+                        config->frontend.access.deny_file,
+                        kBudAccessDeny);
+  if (!bud_is_ok(err))
+    goto fatal;
+  err = bud_access_load(config,
+                        access,
+                        config->frontend.access.allow,
+                        config->frontend.access.allow_file,
+                        kBudAccessAllow);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  if (access->root == 0) {
+    bud_access_free(access);
+    return bud_ok();
+  }
+
+  *out = access;
+  return bud_ok();
+
+fatal:
+  bud_access_free(access);
+  return err;
+}
+
+
+void bud_access_free(bud_access_t* access) {
+  if (access == NULL)
+    return;
+
+  free(access->nodes);
+  free(access);
+}
+
+
+int bud_access_allowed(bud_access_t* access,
+                       const struct sockaddr_storage* addr) {
+  const struct sockaddr_in* addr4;
+  const struct sockaddr_in6* addr6;
+  const bud_access_node_t* node;
+  uint8_t key[16];
+  uint32_t idx;
+  int action;
+
+  if (addr->ss_family == AF_INET) {
+    addr4 = (const struct sockaddr_in*) addr;
+    memcpy(key, bud_access_v4_prefix, sizeof(bud_access_v4_prefix));
+    memcpy(key + 12, &addr4->sin_addr, 4);
+  } else if (addr->ss_family == AF_INET6) {
+    addr6 = (const struct sockaddr_in6*) addr;
+    memcpy(key, &addr6->sin6_addr, 16);
+  } else {
+    /* Unix sockets and unknown PROXY addresses */
+    return 1;
+  }
+
+  /* Remember the deepest prefix with an action on the way down */
+  action = kBudAccessNone;
+  idx = access->root;
+  while (idx != 0) {
+    node = &access->nodes[idx];
+    if (bud_access_common(key, node->key, node->bits) < node->bits)
+      break;
+    if (node->action != kBudAccessNone)
+      action = node->action;
+    if (node->bits == BUD_ACCESS_BITS)
+      break;
+    idx = node->child[bud_access_bit(key, node->bits)];
+  }
+
+  if (action == kBudAccessNone)
+    return access->allow_count == 0;
+  return action == kBudAccessAllow;
+}
+
+
+bud_error_t bud_access_load(bud_config_t* config,
+                            bud_access_t* access,
+                            const bud_config_strs_t* list,
+                            const char* file,
+                            bud_access_action_t action) {
+  const char* entry;
+  uint8_t key[16];
+  int bits;
+  int i;
+
+  /* Path of the file with the entries */
+  if (file != NULL)
+    return bud_access_load_file(config, access, file, action);
+  if (list == NULL)
+    return bud_ok();
+
+  for (i = 0; i < list->count; i++) {
+    entry = list->items[i];
+    if (entry == NULL)
+      return bud_error_str(kBudErrAccessEntry, "(not a string)");
+    if (bud_access_parse(entry, strlen(entry), key, &bits) != 0)
+      return bud_error_str(kBudErrAccessEntry, entry);
+    if (bud_access_insert(access, key, bits, action) != 0)
+      return bud_error_str(kBudErrNoMem, "access list node");
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_access_load_file(bud_config_t* config,
+                                 bud_access_t* access,
+                                 const char* path,
+                                 bud_access_action_t action) {
+  FILE* fp;
+  char line[BUD_ACCESS_LINE_MAX];
+  const char* entry;
+  size_t len;
+  uint8_t key[16];
+  int bits;
+  int lineno;
+  bud_error_t err;
+
+  fp = fopen(path, "r");
+  if (fp == NULL)
+    return bud_error_str(kBudErrAccessFile, path);
+
+  err = bud_ok();
+  lineno = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+
+    /* One entry per line, `#` starts a comment */
+    entry = line + strspn(line, " \t");
+    len = strcspn(entry, " \t\r\n#");
+    if (len == 0)
+      continue;
+
+    if (bud_access_parse(entry, len, key, &bits) != 0) {
+      bud_log(config,
+              kBudLogWarning,
+              "invalid entry on line %d of %s: \"%.*s\"",
+              lineno,
+              path,
+              (int) len,
+              entry);
+      err = bud_error_str(kBudErrAccessFile, path);
+      break;
+    }
+    if (bud_access_insert(access, key, bits, action) != 0) {
+      err = bud_error_str(kBudErrNoMem, "access list node");
+      break;
+    }
+  }
+  fclose(fp);
+
+  return err;
+}
+
+
+int bud_access_parse(const char* str, size_t len, uint8_t* key, int* bits) {
+  char buf[INET6_ADDRSTRLEN + 4];
+  char* slash;
+  char* end;
+  long prefix;
+  int max;
+  int i;
+
+  if (len >= sizeof(buf))
+    return -1;
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+
+  slash = strchr(buf, '/');
+  if (slash != NULL)
+    *slash++ = '\0';
+
+  if (uv_inet_pton(AF_INET, buf, key + 12) == 0) {
+    memcpy(key, bud_access_v4_prefix, sizeof(bud_access_v4_prefix));
+    max = 32;
+  } else if (uv_inet_pton(AF_INET6, buf, key) == 0) {
+    max = 128;
+  } else {
+    return -1;
+  }
+
+  /* No prefix - just the host */
+  prefix = max;
+  if (slash != NULL) {
+    prefix = strtol(slash, &end, 10);
+    if (*end != '\0' || end == slash || prefix < 0 || prefix > max)
+      return -1;
+  }
+  *bits = BUD_ACCESS_BITS - max + prefix;
+
+  /* Host bits are ignored, i.e. 10.1.2.3/8 is 10.0.0.0/8 */
+  for (i = *bits; i < BUD_ACCESS_BITS; i++)
+    key[i >> 3] &= ~(0x80 >> (i & 7));
+
+  return 0;
+}
+
+
+int bud_access_insert(bud_access_t* access,
+                      const uint8_t* key,
+                      int bits,
+                      bud_access_action_t action) {
+  bud_access_node_t* nodes;
+  bud_access_node_t* node;
+  uint32_t* link;
+  uint32_t idx;
+  uint32_t fork;
+  uint32_t leaf;
+  uint32_t cap;
+  int common;
+
+  /*
+   * At most a fork and a leaf are added, grow beforehand so that `link`
+   * into `nodes` stays valid
+   */
+  if (access->count + 2 >= access->cap) {
+    cap = access->cap == 0 ? 64 : access->cap * 2;
+    nodes = realloc(access->nodes, cap * sizeof(*nodes));
+    if (nodes == NULL)
+      return -1;
+    access->nodes = nodes;
+    access->cap = cap;
+    if (access->count == 0)
+      access->count = 1;
+  }
+
+  if (action == kBudAccessAllow)
+    access->allow_count++;
+  else
+    access->deny_count++;
+
+  link = &access->root;
+  for (;;) {
+    idx = *link;
+    if (idx == 0) {
+      *link = bud_access_node_new(access, key, bits, action);
+      return 0;
+    }
+
+    node = &access->nodes[idx];
+    common = bud_access_common(key,
+                               node->key,
+                               bits < node->bits ? bits : node->bits);
+
+    /* Covers the node, or is covered by it */
+    if (common == node->bits && common == bits) {
+      if (node->action != kBudAccessDeny)
+        node->action = action;
+      return 0;
+    }
+    if (common == node->bits) {
+      link = &node->child[bud_access_bit(key, common)];
+      continue;
+    }
+
+    /* New entry is a shorter prefix of the node */
+    if (common == bits) {
+      leaf = bud_access_node_new(access, key, bits, action);
+      access->nodes[leaf].child[bud_access_bit(node->key, bits)] = idx;
+      *link = leaf;
+      return 0;
+    }
+
+    /* They diverge at `common`, fork there */
+    fork = bud_access_node_new(access, key, common, kBudAccessNone);
+    leaf = bud_access_node_new(access, key, bits, action);
+    access->nodes[fork].child[bud_access_bit(key, common)] = leaf;
+    access->nodes[fork].child[bud_access_bit(node->key, common)] = idx;
+    *link = fork;
+    return 0;
+  }
+}
+
+
+uint32_t bud_access_node_new(bud_access_t* access,
+                             const uint8_t* key,
+                             int bits,
+                             bud_access_action_t action) {
+  bud_access_node_t* node;
+  int i;
+
+  node = &access->nodes[access->count];
+  memcpy(node->key, key, sizeof(node->key));
+  node->bits = bits;
+  node->action = action;
+  node->child[0] = 0;
+  node->child[1] = 0;
+
+  /* Keys of forks are cut to their prefix too */
+  for (i = bits; i < BUD_ACCESS_BITS; i++)
+    node->key[i >> 3] &= ~(0x80 >> (i & 7));
+
+  return access->count++;
+}
+
+
+int bud_access_common(const uint8_t* a, const uint8_t* b, int limit) {
+  int i;
+  int bits;
+  uint8_t diff;
+
+  /* Whole bytes first, then the bits of the first different one */
+  for (i = 0; i * 8 < limit; i++) {
+    diff = a[i] ^ b[i];
+    if (diff == 0)
+      continue;
+
+    bits = i * 8;
+    while ((diff & 0x80) == 0) {
+      diff <<= 1;
+      bits++;
+    }
+    return bits < limit ? bits : limit;
+  }
+  return limit;
+}
+
+
+int bud_access_bit(const uint8_t* key, int bit) {
+  return (key[bit >> 3] >> (7 - (bit & 7))) & 1;
+}
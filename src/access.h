@@ -0,0 +1,70 @@
+#ifndef SRC_ACCESS_H_
+#define SRC_ACCESS_H_
+
+#include <stdint.h>  /* uint8_t, uint32_t */
+#include <sys/socket.h>  /* sockaddr_storage */
+
+#include "error.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+/* IPv4 addresses are looked up as IPv4-mapped IPv6 ones (::ffff:0:0/96) */
+#define BUD_ACCESS_BITS 128
+
+/* Longest line of the `frontend.access` files */
+#define BUD_ACCESS_LINE_MAX 256
+
+typedef struct bud_access_s bud_access_t;
+typedef struct bud_access_node_s bud_access_node_t;
+typedef enum bud_access_action_e bud_access_action_t;
+
+enum bud_access_action_e {
+  kBudAccessNone,
+  kBudAccessAllow,
+  kBudAccessDeny
+};
+
+/*
+ * Node of the path-compressed binary trie: the first `bits` of `key` are
+ * its prefix, the next bit of the address picks the child. Nodes without
+ * an `action` are just the forks of the longer prefixes.
+ */
+struct bud_access_node_s {
+  uint8_t key[16];
+  uint8_t bits;
+  uint8_t action;
+
+  /* Indexes in `nodes`, 0 - none */
+  uint32_t child[2];
+};
+
+struct bud_access_s {
+  /* Grown as the entries are added, `nodes[0]` is never used */
+  bud_access_node_t* nodes;
+  uint32_t count;
+  uint32_t cap;
+  uint32_t root;
+
+  int allow_count;
+  int deny_count;
+};
+
+/*
+ * Trie of `frontend.access.allow` and `frontend.access.deny` (inline lists
+ * of CIDRs, or files with one per line), NULL if both are empty. Called
+ * again on `reload access` of the admin socket to read the files anew.
+ */
+bud_error_t bud_access_new(struct bud_config_s* config,
+                           bud_access_t** out);
+void bud_access_free(bud_access_t* access);
+
+/*
+ * The longest matching prefix decides, deny wins over allow of the same
+ * one. Address that matches nothing is allowed, unless `allow` has entries.
+ * Lookup visits at most one node per bit of the longest prefix.
+ */
+int bud_access_allowed(bud_access_t* access,
+                       const struct sockaddr_storage* addr);
+
+#endif  /* SRC_ACCESS_H_ */
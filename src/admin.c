@@ -0,0 +1,1139 @@
+#include <netinet/in.h>  /* sockaddr_in, sockaddr_in6, ntohs */
+#include <stdarg.h>  /* va_list */
+#include <stdio.h>  /* vsnprintf */
+#include <stdlib.h>  /* malloc, realloc, free, strtol */
+#include <string.h>  /* memset, memcpy, strcmp, strchr, strcspn, strspn */
+#include <sys/stat.h>  /* stat, chmod */
+#include <time.h>  /* time */
+#include <unistd.h>  /* unlink */
+
+#include "uv.h"
+
+#include "admin.h"
+#include "access.h"
+#include "fingerprint.h"
+#include "cert-cache.h"
+#include "client.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "ipc.h"
+#include "logger.h"
+#include "master.h"
+#include "ocsp.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "sni-cache.h"
+#include "verify.h"
+
+#define BUD_ADMIN_BACKLOG 16
+
+/* Workers that didn't reply in time are left out (ms) */
+#define BUD_ADMIN_TIMEOUT 1000
+
+/* Clients listed per worker, the rest are just counted */
+#define BUD_ADMIN_MAX_CLIENTS 1000
+
+#define BUD_ADMIN_MAX_ARGS 8
+
+/* Where the command runs, the only process does both */
+#define BUD_ADMIN_MASTER 0x1
+#define BUD_ADMIN_WORKERS 0x2
+
+typedef struct bud_admin_buf_s bud_admin_buf_t;
+typedef struct bud_admin_conn_s bud_admin_conn_t;
+typedef struct bud_admin_cmd_s bud_admin_cmd_t;
+typedef void (*bud_admin_cmd_cb)(bud_config_t* config,
+                                 int argc,
+                                 char** argv,
+                                 bud_admin_buf_t* out);
+
+struct bud_admin_buf_s {
+  char* data;
+  size_t len;
+  size_t cap;
+
+  /* Some of the output was lost */
+  int oom;
+};
+
+struct bud_admin_conn_s {
+  bud_config_t* config;
+  uv_pipe_t pipe;
+  uv_timer_t timer;
+  uv_write_t req;
+  bud_admin_buf_t out;
+
+  /* In config's `admin.waiting` until all workers reply */
+  QUEUE member;
+  int queued;
+  uint32_t id;
+  int waiting;
+
+  char in[1024];
+  size_t in_len;
+};
+
+struct bud_admin_cmd_s {
+  const char* name;
+
+  /* First argument, NULL - any */
+  const char* arg;
+  int flags;
+  const char* usage;
+  bud_admin_cmd_cb cb;
+};
+
+static int bud_admin_printf(bud_admin_buf_t* buf, const char* fmt, ...);
+static const bud_admin_cmd_t* bud_admin_parse(char* line,
+                                              int* argc,
+                                              char** argv);
+static const char* bud_admin_progress(bud_client_progress_t progress);
+static void bud_admin_help(bud_config_t* config,
+                           int argc,
+                           char** argv,
+                           bud_admin_buf_t* out);
+static void bud_admin_clients(bud_config_t* config,
+                              int argc,
+                              char** argv,
+                              bud_admin_buf_t* out);
+static void bud_admin_client(bud_client_t* client,
+                             uint64_t now,
+                             bud_admin_buf_t* out);
+static void bud_admin_close_idle(bud_config_t* config,
+                                 int argc,
+                                 char** argv,
+                                 bud_admin_buf_t* out);
+static void bud_admin_caches(bud_config_t* config,
+                             int argc,
+                             char** argv,
+                             bud_admin_buf_t* out);
+static void bud_admin_flush_sni(bud_config_t* config,
+                                int argc,
+                                char** argv,
+                                bud_admin_buf_t* out);
+static void bud_admin_flush_staples(bud_config_t* config,
+                                    int argc,
+                                    char** argv,
+                                    bud_admin_buf_t* out);
+static void bud_admin_prewarm_sni(bud_config_t* config,
+                                  int argc,
+                                  char** argv,
+                                  bud_admin_buf_t* out);
+static void bud_admin_prewarm_staples(bud_config_t* config,
+                                      int argc,
+                                      char** argv,
+                                      bud_admin_buf_t* out);
+static void bud_admin_reload_access(bud_config_t* config,
+                                    int argc,
+                                    char** argv,
+                                    bud_admin_buf_t* out);
+static void bud_admin_reload_fingerprint(bud_config_t* config,
+                                         int argc,
+                                         char** argv,
+                                         bud_admin_buf_t* out);
+static void bud_admin_log(bud_config_t* config,
+                          int argc,
+                          char** argv,
+                          bud_admin_buf_t* out);
+static void bud_admin_set(bud_config_t* config,
+                          int argc,
+                          char** argv,
+                          bud_admin_buf_t* out);
+static void bud_admin_set_watermark(bud_config_t* config,
+                                    bud_client_side_type_t type,
+                                    int high,
+                                    int value,
+                                    bud_admin_buf_t* out);
+static void bud_admin_connection_cb(uv_stream_t* server, int status);
+static void bud_admin_alloc_cb(uv_handle_t* handle,
+                               size_t suggested_size,
+                               uv_buf_t* buf);
+static void bud_admin_read_cb(uv_stream_t* stream,
+                              ssize_t nread,
+                              const uv_buf_t* buf);
+static void bud_admin_respond(bud_admin_conn_t* conn);
+static void bud_admin_timer_cb(uv_timer_t* handle, int status);
+static void bud_admin_finish(bud_admin_conn_t* conn);
+static void bud_admin_write_cb(uv_write_t* req, int status);
+static void bud_admin_close_cb(uv_handle_t* handle);
+static void bud_admin_free_cb(uv_handle_t* handle);
+
+static const bud_admin_cmd_t bud_admin_cmds[] = {
+  { "help", NULL, BUD_ADMIN_MASTER, "help", bud_admin_help },
+  { "clients",
+    NULL,
+    BUD_ADMIN_WORKERS,
+    "clients - connections and their state, least recently active first",
+    bud_admin_clients },
+  { "close",
+    "idle",
+    BUD_ADMIN_WORKERS,
+    "close idle <ms> - close connections quiet for that long",
+    bud_admin_close_idle },
+  { "caches",
+    NULL,
+    BUD_ADMIN_WORKERS,
+    "caches - entries of the caches",
+    bud_admin_caches },
+  { "flush",
+    "sni",
+    BUD_ADMIN_WORKERS,
+    "flush sni - drop SNI cache entries",
+    bud_admin_flush_sni },
+  { "flush",
+    "staples",
+    BUD_ADMIN_MASTER,
+    "flush staples - fetch all staples again",
+    bud_admin_flush_staples },
+  { "prewarm",
+    "sni",
+    BUD_ADMIN_WORKERS,
+    "prewarm sni <servername>... - fetch contexts into SNI cache",
+    bud_admin_prewarm_sni },
+  { "prewarm",
+    "staples",
+    BUD_ADMIN_MASTER,
+    "prewarm staples - fetch missing and expiring staples",
+    bud_admin_prewarm_staples },
+  { "reload",
+    "access",
+    BUD_ADMIN_WORKERS,
+    "reload access - read frontend.access files again",
+    bud_admin_reload_access },
+  { "reload",
+    "fingerprint",
+    BUD_ADMIN_WORKERS,
+    "reload fingerprint - read frontend.fingerprint.deny file again",
+    bud_admin_reload_fingerprint },
+  { "log",
+    NULL,
+    BUD_ADMIN_MASTER | BUD_ADMIN_WORKERS,
+    "log <debug|notice|info|warning|fatal> - change log level",
+    bud_admin_log },
+  { "set",
+    NULL,
+    BUD_ADMIN_WORKERS,
+    "set <frontend.rate_limit.rate|frontend.rate_limit.burst|"
+        "frontend.bandwidth.connection|frontend.bandwidth.context|"
+        "frontend.bandwidth.burst|frontend.buffer.high_watermark|"
+        "frontend.buffer.low_watermark|backend.buffer.high_watermark|"
+        "backend.buffer.low_watermark> <value>",
+    bud_admin_set },
+  { NULL, NULL, 0, NULL, NULL }
+};
+
+
+bud_error_t bud_admin_start(bud_config_t* config) {
+  int r;
+  bud_error_t err;
+#ifndef _WIN32
+  struct stat st;
+#endif  /* !_WIN32 */
+
+  if (config->admin.path == NULL)
+    return bud_ok();
+
+#ifndef _WIN32
+  /* Left by a previous run that was killed */
+  if (stat(config->admin.path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(config->admin.path);
+#endif  /* !_WIN32 */
+
+  r = uv_pipe_init(config->loop, &config->admin.server, 0);
+  if (r != 0)
+    return bud_error_num(kBudErrAdminInit, r);
+  config->admin.server.data = config;
+  config->admin.server_init = 1;
+
+  r = uv_pipe_bind(&config->admin.server, config->admin.path);
+  if (r != 0) {
+    err = bud_error_num(kBudErrAdminBind, r);
+    goto fatal;
+  }
+
+#ifndef _WIN32
+  /* Anyone who can connect can drop caches and change limits */
+  chmod(config->admin.path, S_IRUSR | S_IWUSR);
+#endif  /* !_WIN32 */
+
+  r = uv_listen((uv_stream_t*) &config->admin.server,
+                BUD_ADMIN_BACKLOG,
+                bud_admin_connection_cb);
+  if (r != 0) {
+    err = bud_error_num(kBudErrAdminListen, r);
+    goto fatal;
+  }
+
+  bud_log(config,
+          kBudLogInfo,
+          "admin socket available on %s",
+          config->admin.path);
+  return bud_ok();
+
+fatal:
+  bud_admin_finalize(config);
+  return err;
+}
+
+
+void bud_admin_finalize(bud_config_t* config) {
+  QUEUE* q;
+  bud_admin_conn_t* conn;
+
+  /* Workers are going away, nobody will reply */
+  while (!QUEUE_EMPTY(&config->admin.waiting)) {
+    q = QUEUE_HEAD(&config->admin.waiting);
+    conn = QUEUE_DATA(q, bud_admin_conn_t, member);
+    QUEUE_REMOVE(q);
+    conn->queued = 0;
+    uv_close((uv_handle_t*) &conn->pipe, bud_admin_close_cb);
+  }
+
+  if (config->admin.server_init) {
+    config->admin.server_init = 0;
+    uv_close((uv_handle_t*) &config->admin.server, NULL);
+  }
+}
+
+
+void bud_admin_ipc_request(bud_config_t* config,
+                           const char* data,
+                           size_t size) {
+  const unsigned char* p;
+  const bud_admin_cmd_t* cmd;
+  char line[1024];
+  char* argv[BUD_ADMIN_MAX_ARGS];
+  int argc;
+  bud_admin_buf_t out;
+  bud_error_t err;
+
+  if (size < 4)
+    return;
+
+  /* Id is sent back as is */
+  p = (const unsigned char*) data;
+  size -= 4;
+  if (size >= sizeof(line))
+    size = sizeof(line) - 1;
+  memcpy(line, data + 4, size);
+  line[size] = '\0';
+
+  memset(&out, 0, sizeof(out));
+  cmd = bud_admin_parse(line, &argc, argv);
+  if (cmd != NULL && (cmd->flags & BUD_ADMIN_WORKERS) != 0)
+    cmd->cb(config, argc, argv, &out);
+  else
+    bud_admin_printf(&out, "unknown command\n");
+
+  if (out.oom) {
+    out.len = 0;
+    bud_admin_printf(&out, "out of memory\n");
+  }
+
+  err = bud_ipc_send(config,
+                     (uv_stream_t*) &config->ipc,
+                     kBudIPCAdmin,
+                     (const char*) p,
+                     4,
+                     out.data,
+                     out.len);
+  if (!bud_is_ok(err))
+    bud_error_log(config, kBudLogWarning, err);
+  free(out.data);
+}
+
+
+void bud_admin_ipc_reply(bud_worker_t* worker,
+                         const char* data,
+                         size_t size) {
+  bud_config_t* config;
+  const unsigned char* p;
+  uint32_t id;
+  QUEUE* q;
+  bud_admin_conn_t* conn;
+
+  config = worker->config;
+  if (size < 4)
+    return;
+
+  p = (const unsigned char*) data;
+  id = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+
+  /* Connection may have timed out already */
+  conn = NULL;
+  QUEUE_FOREACH(q, &config->admin.waiting) {
+    conn = QUEUE_DATA(q, bud_admin_conn_t, member);
+    if (conn->id == id)
+      break;
+    conn = NULL;
+  }
+  if (conn == NULL)
+    return;
+
+  if (worker->spare) {
+    bud_admin_printf(&conn->out,
+                     "spare worker (pid %d):\n",
+                     worker->proc.pid);
+  } else {
+    bud_admin_printf(&conn->out,
+                     "worker %d (pid %d):\n",
+                     worker->id,
+                     worker->proc.pid);
+  }
+  bud_admin_printf(&conn->out, "%.*s", (int) size - 4, data + 4);
+
+  if (--conn->waiting == 0)
+    bud_admin_finish(conn);
+}
+
+
+int bud_admin_printf(bud_admin_buf_t* buf, const char* fmt, ...) {
+  va_list ap;
+  int r;
+  size_t cap;
+  char* data;
+
+  for (;;) {
+    va_start(ap, fmt);
+    r = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+    if (r < 0)
+      break;
+    if ((size_t) r < buf->cap - buf->len) {
+      buf->len += r;
+      return 0;
+    }
+
+    cap = buf->cap == 0 ? 4096 : buf->cap * 2;
+    while (cap - buf->len <= (size_t) r)
+      cap *= 2;
+    data = realloc(buf->data, cap);
+    if (data == NULL)
+      break;
+    buf->data = data;
+    buf->cap = cap;
+  }
+
+  buf->oom = 1;
+  return -1;
+}
+
+
+const bud_admin_cmd_t* bud_admin_parse(char* line, int* argc, char** argv) {
+  const bud_admin_cmd_t* cmd;
+  char* p;
+
+  /* Space-separated words, up to the end of the line */
+  line[strcspn(line, "\r\n")] = '\0';
+  *argc = 0;
+  p = line;
+  while (*argc < BUD_ADMIN_MAX_ARGS) {
+    p += strspn(p, " \t");
+    if (*p == '\0')
+      break;
+    argv[(*argc)++] = p;
+    p += strcspn(p, " \t");
+    if (*p == '\0')
+      break;
+    *p++ = '\0';
+  }
+  if (*argc == 0)
+    return NULL;
+
+  for (cmd = bud_admin_cmds; cmd->name != NULL; cmd++) {
+    if (strcmp(cmd->name, argv[0]) != 0)
+      continue;
+    if (cmd->arg == NULL || (*argc > 1 && strcmp(cmd->arg, argv[1]) == 0))
+      return cmd;
+  }
+  return NULL;
+}
+
+
+const char* bud_admin_progress(bud_client_progress_t progress) {
+  switch (progress) {
+    case kBudProgressNone:
+      return "none";
+    case kBudProgressRunning:
+      return "running";
+    case kBudProgressDone:
+      return "done";
+    default:
+      return "?";
+  }
+}
+
+
+void bud_admin_help(bud_config_t* config,
+                    int argc,
+                    char** argv,
+                    bud_admin_buf_t* out) {
+  const bud_admin_cmd_t* cmd;
+
+  for (cmd = bud_admin_cmds; cmd->name != NULL; cmd++)
+    bud_admin_printf(out, "%s\n", cmd->usage);
+}
+
+
+void bud_admin_clients(bud_config_t* config,
+                       int argc,
+                       char** argv,
+                       bud_admin_buf_t* out) {
+  QUEUE* q;
+  uint64_t now;
+  int count;
+
+  now = uv_now(config->loop);
+  count = 0;
+  QUEUE_FOREACH(q, &config->clients) {
+    if (count++ < BUD_ADMIN_MAX_CLIENTS)
+      bud_admin_client(QUEUE_DATA(q, bud_client_t, member), now, out);
+  }
+  if (count > BUD_ADMIN_MAX_CLIENTS)
+    bud_admin_printf(out, "%d more\n", count - BUD_ADMIN_MAX_CLIENTS);
+  bud_admin_printf(out, "%d clients\n", count);
+}
+
+
+void bud_admin_client(bud_client_t* client,
+                      uint64_t now,
+                      bud_admin_buf_t* out) {
+  struct sockaddr_in* addr;
+  struct sockaddr_in6* addr6;
+  char host[INET6_ADDRSTRLEN];
+  char servername[256];
+  const char* name;
+  uint16_t port;
+  size_t len;
+  size_t i;
+  int r;
+
+  addr = (struct sockaddr_in*) &client->peer;
+  addr6 = (struct sockaddr_in6*) &client->peer;
+  if (client->peer.ss_family == AF_INET) {
+    port = ntohs(addr->sin_port);
+    r = uv_inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host));
+  } else {
+    port = ntohs(addr6->sin6_port);
+    r = uv_inet_ntop(AF_INET6, &addr6->sin6_addr, host, sizeof(host));
+  }
+  if (r != 0)
+    host[0] = '\0';
+
+  /* Servername comes from the client, keep the line readable */
+  name = bud_client_servername(client, &len);
+  if (name == NULL)
+    len = 0;
+  if (len >= sizeof(servername))
+    len = sizeof(servername) - 1;
+  for (i = 0; i < len; i++) {
+    if (name[i] <= 0x20 || name[i] > 0x7e)
+      servername[i] = '?';
+    else
+      servername[i] = name[i];
+  }
+  servername[len] = '\0';
+
+  bud_admin_printf(out,
+                   "[%s]:%d servername=%s age=%llu idle=%llu "
+                   "hello=%s connect=%s close=%s "
+                   "frontend=%s/%s/%s/%s backend=%s/%s/%s/%s "
+                   "in=%llu out=%llu cpu=%llu/%llu pending=%d/%d\n",
+                   host,
+                   port,
+                   len == 0 ? "-" : servername,
+                   (unsigned long long) (now - client->stats.accept),
+                   (unsigned long long) (now - client->last_active),
+                   bud_admin_progress(client->hello_parse),
+                   bud_admin_progress(client->connect),
+                   bud_admin_progress(client->close),
+                   bud_admin_progress(client->frontend.reading),
+                   bud_admin_progress(client->frontend.write),
+                   bud_admin_progress(client->frontend.shutdown),
+                   bud_admin_progress(client->frontend.close),
+                   bud_admin_progress(client->backend.reading),
+                   bud_admin_progress(client->backend.write),
+                   bud_admin_progress(client->backend.shutdown),
+                   bud_admin_progress(client->backend.close),
+                   (unsigned long long) client->stats.bytes_in,
+                   (unsigned long long) client->stats.bytes_out,
+                   (unsigned long long) client->stats.cpu_handshake / 1000,
+                   (unsigned long long) client->stats.cpu_crypto / 1000,
+                   (int) ringbuffer_size(&client->frontend.output),
+                   (int) ringbuffer_size(&client->backend.output));
+}
+
+
+void bud_admin_close_idle(bud_config_t* config,
+                          int argc,
+                          char** argv,
+                          bud_admin_buf_t* out) {
+  char* end;
+  long idle;
+  int count;
+
+  if (argc < 3) {
+    bud_admin_printf(out, "usage: close idle <ms>\n");
+    return;
+  }
+  idle = strtol(argv[2], &end, 10);
+  if (*end != '\0' || end == argv[2] || idle < 0) {
+    bud_admin_printf(out, "invalid value: %s\n", argv[2]);
+    return;
+  }
+
+  count = bud_client_close_idle(config, (uint64_t) idle, "admin close idle");
+  bud_admin_printf(out, "%d clients closed\n", count);
+}
+
+
+void bud_admin_caches(bud_config_t* config,
+                      int argc,
+                      char** argv,
+                      bud_admin_buf_t* out) {
+  int i;
+  int staples;
+  int expired;
+  time_t now;
+  bud_cert_cache_t* certs;
+
+  if (config->sni_cache != NULL) {
+    bud_admin_printf(out,
+                     "sni: %d/%d entries\n",
+                     (int) config->sni_cache->count,
+                     (int) config->sni_cache->max);
+  }
+
+  certs = config->cert_cache;
+  if (certs != NULL) {
+    bud_admin_printf(out,
+                     "certs: %d/%d entries, %llu hits, %llu misses\n",
+                     certs->count,
+                     certs->max,
+                     (unsigned long long) certs->hits,
+                     (unsigned long long) certs->misses);
+  }
+
+  /* Static contexts, SNI ones carry their staples in the cache */
+  staples = 0;
+  expired = 0;
+  now = time(NULL);
+  for (i = 0; i < config->context_count + 1; i++) {
+    if (config->contexts[i].staple == NULL)
+      continue;
+    staples++;
+    if (config->contexts[i].staple_expire <= now)
+      expired++;
+  }
+  bud_admin_printf(out,
+                   "staples: %d of %d contexts, %d expired\n",
+                   staples,
+                   config->context_count + 1,
+                   expired);
+
+  if (config->verify_cache.cache != NULL) {
+    bud_admin_printf(out,
+                     "verify: %u slots\n",
+                     config->verify_cache.cache->mask + 1);
+  }
+  bud_admin_printf(out,
+                   "ssl objects: %d/%d\n",
+                   config->ssl_pool_count,
+                   config->pool.ssl_objects);
+  bud_admin_printf(out,
+                   "clients: %d used, %d free\n",
+                   (int) config->client_slab.used_count,
+                   (int) config->client_slab.free_count);
+}
+
+
+void bud_admin_flush_sni(bud_config_t* config,
+                         int argc,
+                         char** argv,
+                         bud_admin_buf_t* out) {
+  if (config->sni_cache == NULL) {
+    bud_admin_printf(out, "SNI is disabled\n");
+    return;
+  }
+
+  bud_admin_printf(out,
+                   "%d entries flushed\n",
+                   (int) config->sni_cache->count);
+  bud_sni_cache_flush(config->sni_cache);
+}
+
+
+void bud_admin_flush_staples(bud_config_t* config,
+                             int argc,
+                             char** argv,
+                             bud_admin_buf_t* out) {
+  int i;
+
+  if (!config->stapling.enabled) {
+    bud_admin_printf(out, "stapling is disabled\n");
+    return;
+  }
+
+  /* Current staples are served until the new ones arrive */
+  for (i = 0; i < config->context_count + 1; i++)
+    config->contexts[i].staple_refresh = 0;
+  bud_ocsp_prewarm(config);
+  bud_admin_printf(out, "ok\n");
+}
+
+
+void bud_admin_prewarm_sni(bud_config_t* config,
+                           int argc,
+                           char** argv,
+                           bud_admin_buf_t* out) {
+  int i;
+  bud_error_t err;
+
+  if (config->sni_cache == NULL) {
+    bud_admin_printf(out, "SNI is disabled\n");
+    return;
+  }
+
+  for (i = 2; i < argc; i++) {
+    err = bud_client_sni_prewarm(config, argv[i], strlen(argv[i]));
+    if (bud_is_ok(err)) {
+      bud_admin_printf(out, "%s: ok\n", argv[i]);
+    } else {
+      bud_admin_printf(out,
+                       "%s: failed %d - \"%s\"\n",
+                       argv[i],
+                       err.code,
+                       err.str);
+    }
+  }
+}
+
+
+void bud_admin_prewarm_staples(bud_config_t* config,
+                               int argc,
+                               char** argv,
+                               bud_admin_buf_t* out) {
+  if (!config->stapling.enabled) {
+    bud_admin_printf(out, "stapling is disabled\n");
+    return;
+  }
+
+  bud_ocsp_prewarm(config);
+  bud_admin_printf(out, "ok\n");
+}
+
+
+void bud_admin_reload_access(bud_config_t* config,
+                             int argc,
+                             char** argv,
+                             bud_admin_buf_t* out) {
+  bud_access_t* access;
+  bud_error_t err;
+
+  /* Old lists stay in use if the new ones can't be read */
+  err = bud_access_new(config, &access);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    bud_admin_printf(out, "failed %d - \"%s\"\n", err.code, err.str);
+    return;
+  }
+
+  bud_access_free(config->access);
+  config->access = access;
+  if (access == NULL) {
+    bud_admin_printf(out, "access lists are empty\n");
+    return;
+  }
+  bud_admin_printf(out,
+                   "%d allowed, %d denied entries\n",
+                   access->allow_count,
+                   access->deny_count);
+}
+
+
+void bud_admin_reload_fingerprint(bud_config_t* config,
+                                  int argc,
+                                  char** argv,
+                                  bud_admin_buf_t* out) {
+  bud_fingerprint_t* fp;
+  bud_error_t err;
+
+  /* Old list stays in use if the new one can't be read */
+  err = bud_fingerprint_new(config, config->fingerprint, &fp);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    bud_admin_printf(out, "failed %d - \"%s\"\n", err.code, err.str);
+    return;
+  }
+
+  bud_fingerprint_free(config->fingerprint);
+  config->fingerprint = fp;
+  if (fp == NULL) {
+    bud_admin_printf(out, "fingerprint checks are disabled\n");
+    return;
+  }
+  bud_admin_printf(out,
+                   "%d denied, %d blocked by the detector\n",
+                   fp->deny_count,
+                   bud_fingerprint_blocked_count(fp, uv_now(config->loop)));
+}
+
+
+void bud_admin_log(bud_config_t* config,
+                   int argc,
+                   char** argv,
+                   bud_admin_buf_t* out) {
+  if (argc < 2 || bud_logger_set_level(config->logger, argv[1]) != 0) {
+    bud_admin_printf(out, "unknown log level\n");
+    return;
+  }
+
+  bud_admin_printf(out, "ok\n");
+}
+
+
+void bud_admin_set(bud_config_t* config,
+                   int argc,
+                   char** argv,
+                   bud_admin_buf_t* out) {
+  const char* name;
+  char* end;
+  long value;
+  int i;
+  int old;
+
+  if (argc < 3) {
+    bud_admin_printf(out, "usage: set <name> <value>\n");
+    return;
+  }
+  name = argv[1];
+  value = strtol(argv[2], &end, 10);
+  if (*end != '\0' || end == argv[2] || value < 0 || value > 0x7fffffff) {
+    bud_admin_printf(out, "invalid value: %s\n", argv[2]);
+    return;
+  }
+
+  if (strcmp(name, "frontend.rate_limit.rate") == 0 ||
+      strcmp(name, "frontend.rate_limit.burst") == 0) {
+    /* Table is allocated on start, only if `rate` is non-zero */
+    if (config->ratelimit == NULL) {
+      bud_admin_printf(out, "rate limit is disabled in config\n");
+      return;
+    }
+    if (strcmp(name, "frontend.rate_limit.rate") == 0) {
+      if (value == 0) {
+        bud_admin_printf(out, "rate should be positive\n");
+        return;
+      }
+      config->frontend.rate_limit.rate = value;
+      config->ratelimit->rate = value;
+    } else {
+      config->frontend.rate_limit.burst = value;
+      config->ratelimit->burst = value == 0 ? 1 : value;
+    }
+  } else if (strcmp(name, "frontend.bandwidth.connection") == 0 ||
+             strcmp(name, "frontend.bandwidth.context") == 0 ||
+             strcmp(name, "frontend.bandwidth.burst") == 0) {
+    /* Timer wheel of the pauses is started only if some limit is set */
+    if (!config->shape_wheel_init) {
+      bud_admin_printf(out, "bandwidth limit is disabled in config\n");
+      return;
+    }
+    if (strcmp(name, "frontend.bandwidth.connection") == 0) {
+      config->frontend.bandwidth.connection = value;
+    } else if (strcmp(name, "frontend.bandwidth.context") == 0) {
+      /* Contexts with their own `bandwidth` keep it */
+      old = config->frontend.bandwidth.context;
+      config->frontend.bandwidth.context = value;
+      for (i = 0; i < config->context_count + 1; i++)
+        if (config->contexts[i].bandwidth == old)
+          config->contexts[i].bandwidth = value;
+    } else {
+      config->frontend.bandwidth.burst = value;
+    }
+  } else if (strcmp(name, "frontend.buffer.high_watermark") == 0) {
+    return bud_admin_set_watermark(config, kBudFrontend, 1, value, out);
+  } else if (strcmp(name, "frontend.buffer.low_watermark") == 0) {
+    return bud_admin_set_watermark(config, kBudFrontend, 0, value, out);
+  } else if (strcmp(name, "backend.buffer.high_watermark") == 0) {
+    return bud_admin_set_watermark(config, kBudBackend, 1, value, out);
+  } else if (strcmp(name, "backend.buffer.low_watermark") == 0) {
+    return bud_admin_set_watermark(config, kBudBackend, 0, value, out);
+  } else {
+    bud_admin_printf(out, "unknown setting: %s\n", name);
+    return;
+  }
+
+  bud_admin_printf(out, "ok\n");
+}
+
+
+void bud_admin_set_watermark(bud_config_t* config,
+                             bud_client_side_type_t type,
+                             int high,
+                             int value,
+                             bud_admin_buf_t* out) {
+  bud_config_buffer_t* conf;
+  bud_client_t* client;
+  bud_client_side_t* side;
+  QUEUE* q;
+
+  conf = type == kBudFrontend ? &config->frontend.buffer :
+                                &config->backend.buffer;
+  if ((high && value < conf->low_watermark) ||
+      (!high && value > conf->high_watermark)) {
+    bud_admin_printf(out, "low_watermark should not exceed high_watermark\n");
+    return;
+  }
+  if (high)
+    conf->high_watermark = value;
+  else
+    conf->low_watermark = value;
+
+  /* Sides copy them on creation, existing clients are throttled by them */
+  QUEUE_FOREACH(q, &config->clients) {
+    client = QUEUE_DATA(q, bud_client_t, member);
+    side = type == kBudFrontend ? &client->frontend : &client->backend;
+    side->high_watermark = conf->high_watermark;
+    side->low_watermark = conf->low_watermark;
+  }
+
+  bud_admin_printf(out, "ok\n");
+}
+
+
+void bud_admin_connection_cb(uv_stream_t* server, int status) {
+  int r;
+  bud_config_t* config;
+  bud_admin_conn_t* conn;
+
+  config = server->data;
+  if (status != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "admin connection_cb() failed with (%d) \"%s\"",
+            status,
+            uv_strerror(status));
+    return;
+  }
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return;
+
+  conn->config = config;
+  conn->in_len = 0;
+  conn->queued = 0;
+  conn->waiting = 0;
+  memset(&conn->out, 0, sizeof(conn->out));
+
+  r = uv_timer_init(config->loop, &conn->timer);
+  if (r != 0) {
+    free(conn);
+    return;
+  }
+  conn->timer.data = conn;
+
+  r = uv_pipe_init(config->loop, &conn->pipe, 0);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &conn->timer, bud_admin_free_cb);
+    return;
+  }
+  conn->pipe.data = conn;
+
+  r = uv_accept(server, (uv_stream_t*) &conn->pipe);
+  if (r == 0) {
+    r = uv_read_start((uv_stream_t*) &conn->pipe,
+                      bud_admin_alloc_cb,
+                      bud_admin_read_cb);
+  }
+  if (r != 0)
+    uv_close((uv_handle_t*) &conn->pipe, bud_admin_close_cb);
+}
+
+
+void bud_admin_alloc_cb(uv_handle_t* handle,
+                        size_t suggested_size,
+                        uv_buf_t* buf) {
+  bud_admin_conn_t* conn;
+
+  /* Keep one byte for the terminating NUL */
+  conn = handle->data;
+  *buf = uv_buf_init(conn->in + conn->in_len,
+                     sizeof(conn->in) - conn->in_len - 1);
+}
+
+
+void bud_admin_read_cb(uv_stream_t* stream,
+                       ssize_t nread,
+                       const uv_buf_t* buf) {
+  bud_admin_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+
+  /* Command without the newline, before the shutdown */
+  if (nread == UV_EOF && conn->in_len != 0) {
+    uv_read_stop(stream);
+    return bud_admin_respond(conn);
+  }
+  if (nread < 0)
+    return uv_close((uv_handle_t*) stream, bud_admin_close_cb);
+
+  conn->in_len += nread;
+  conn->in[conn->in_len] = '\0';
+
+  /* Wait for the end of the line, unless it doesn't fit */
+  if (strchr(conn->in, '\n') == NULL &&
+      conn->in_len < sizeof(conn->in) - 1) {
+    return;
+  }
+
+  uv_read_stop(stream);
+  bud_admin_respond(conn);
+}
+
+
+void bud_admin_respond(bud_admin_conn_t* conn) {
+  bud_config_t* config;
+  const bud_admin_cmd_t* cmd;
+  bud_worker_t* worker;
+  char line[sizeof(conn->in)];
+  char header[4];
+  char* argv[BUD_ADMIN_MAX_ARGS];
+  int argc;
+  size_t len;
+  int i;
+  int r;
+  bud_error_t err;
+
+  config = conn->config;
+  conn->in[strcspn(conn->in, "\r\n")] = '\0';
+  len = strlen(conn->in);
+
+  /* Parsing splits the copy, workers get the whole line */
+  memcpy(line, conn->in, len + 1);
+  cmd = bud_admin_parse(line, &argc, argv);
+  if (cmd == NULL) {
+    bud_admin_printf(&conn->out, "unknown command, see `help`\n");
+    return bud_admin_finish(conn);
+  }
+
+  /* The only process runs everything by itself */
+  if (config->worker_count == 0) {
+    cmd->cb(config, argc, argv, &conn->out);
+    return bud_admin_finish(conn);
+  }
+
+  if ((cmd->flags & BUD_ADMIN_MASTER) != 0) {
+    if ((cmd->flags & BUD_ADMIN_WORKERS) != 0)
+      bud_admin_printf(&conn->out, "master:\n");
+    cmd->cb(config, argc, argv, &conn->out);
+  }
+  if ((cmd->flags & BUD_ADMIN_WORKERS) == 0)
+    return bud_admin_finish(conn);
+
+  conn->id = ++config->admin.last_id;
+  header[0] = (conn->id >> 24) & 0xff;
+  header[1] = (conn->id >> 16) & 0xff;
+  header[2] = (conn->id >> 8) & 0xff;
+  header[3] = conn->id & 0xff;
+
+  /* Both generations, draining workers still have clients */
+  for (i = 0; i < config->worker_slots * 2; i++) {
+    worker = &config->workers[i];
+    if (!worker->active)
+      continue;
+
+    err = bud_ipc_send(config,
+                       (uv_stream_t*) &worker->ipc,
+                       kBudIPCAdmin,
+                       header,
+                       sizeof(header),
+                       conn->in,
+                       len);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogWarning, err);
+      continue;
+    }
+    conn->waiting++;
+  }
+  if (conn->waiting == 0)
+    return bud_admin_finish(conn);
+
+  QUEUE_INSERT_TAIL(&config->admin.waiting, &conn->member);
+  conn->queued = 1;
+  r = uv_timer_start(&conn->timer, bud_admin_timer_cb, BUD_ADMIN_TIMEOUT, 0);
+  if (r != 0)
+    bud_admin_finish(conn);
+}
+
+
+void bud_admin_timer_cb(uv_timer_t* handle, int status) {
+  bud_admin_conn_t* conn;
+
+  conn = handle->data;
+  bud_admin_printf(&conn->out,
+                   "%d workers did not reply in time\n",
+                   conn->waiting);
+  bud_admin_finish(conn);
+}
+
+
+void bud_admin_finish(bud_admin_conn_t* conn) {
+  int r;
+  uv_buf_t buf;
+
+  if (conn->queued) {
+    QUEUE_REMOVE(&conn->member);
+    conn->queued = 0;
+  }
+  uv_timer_stop(&conn->timer);
+
+  if (conn->out.oom) {
+    conn->out.len = 0;
+    conn->out.oom = 0;
+    if (bud_admin_printf(&conn->out, "out of memory\n") != 0)
+      return uv_close((uv_handle_t*) &conn->pipe, bud_admin_close_cb);
+  }
+
+  buf = uv_buf_init(conn->out.data, conn->out.len);
+  r = uv_write(&conn->req,
+               (uv_stream_t*) &conn->pipe,
+               &buf,
+               1,
+               bud_admin_write_cb);
+  if (r != 0)
+    uv_close((uv_handle_t*) &conn->pipe, bud_admin_close_cb);
+}
+
+
+void bud_admin_write_cb(uv_write_t* req, int status) {
+  bud_admin_conn_t* conn;
+
+  conn = container_of(req, bud_admin_conn_t, req);
+  uv_close((uv_handle_t*) &conn->pipe, bud_admin_close_cb);
+}
+
+
+void bud_admin_close_cb(uv_handle_t* handle) {
+  bud_admin_conn_t* conn;
+
+  conn = handle->data;
+  if (conn->queued) {
+    QUEUE_REMOVE(&conn->member);
+    conn->queued = 0;
+  }
+  uv_close((uv_handle_t*) &conn->timer, bud_admin_free_cb);
+}
+
+
+void bud_admin_free_cb(uv_handle_t* handle) {
+  bud_admin_conn_t* conn;
+
+  conn = handle->data;
+  free(conn->out.data);
+  free(conn);
+}
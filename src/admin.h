@@ -0,0 +1,30 @@
+#ifndef SRC_ADMIN_H_
+#define SRC_ADMIN_H_
+
+#include <stdlib.h>  /* size_t */
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+struct bud_worker_s;
+
+/*
+ * Unix socket of the master, `admin.path`. Every connection sends one
+ * command line, gets the text reply and is closed. Commands for workers
+ * are forwarded over IPC (kBudIPCAdmin) and their replies are gathered.
+ */
+bud_error_t bud_admin_start(struct bud_config_s* config);
+void bud_admin_finalize(struct bud_config_s* config);
+
+/* Worker: run the forwarded command, reply to the master */
+void bud_admin_ipc_request(struct bud_config_s* config,
+                           const char* data,
+                           size_t size);
+
+/* Master: worker's reply to the forwarded command */
+void bud_admin_ipc_reply(struct bud_worker_s* worker,
+                         const char* data,
+                         size_t size);
+
+#endif  /* SRC_ADMIN_H_ */
@@ -0,0 +1,290 @@
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif  /* !_GNU_SOURCE */
+# include <dirent.h>  /* opendir, readdir, closedir */
+# include <sched.h>  /* sched_setaffinity, cpu_set_t */
+# include <sys/syscall.h>  /* SYS_set_mempolicy */
+# include <unistd.h>  /* syscall */
+#endif  /* __linux__ */
+#include <stdio.h>  /* fopen, fscanf, snprintf */
+#include <stdlib.h>  /* calloc, free, qsort */
+#include <string.h>  /* strcmp, strncmp */
+
+#include "affinity.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+#ifdef __linux__
+
+/* From linux/mempolicy.h */
+#define BUD_MPOL_DEFAULT 0
+#define BUD_MPOL_PREFERRED 1
+
+typedef struct bud_affinity_cpu_s bud_affinity_cpu_t;
+
+struct bud_affinity_cpu_s {
+  int cpu;
+  int node;
+};
+
+static bud_error_t bud_affinity_auto(bud_config_t* config);
+static bud_error_t bud_affinity_list(bud_config_t* config,
+                                     const int* cpus,
+                                     int count);
+static int bud_affinity_cpu_node(int cpu);
+static int bud_affinity_cpu_primary(int cpu);
+static int bud_affinity_cpu_compare(const void* a, const void* b);
+static void bud_affinity_set_mempolicy(bud_config_t* config,
+                                       int mode,
+                                       int node);
+
+static cpu_set_t bud_affinity_saved;
+static int bud_affinity_saved_ok;
+
+#endif  /* __linux__ */
+
+
+bud_error_t bud_affinity_init(bud_config_t* config) {
+  const char* str;
+
+  str = config->workers_affinity;
+  if ((str == NULL && config->affinity_cpus == NULL) ||
+      config->is_worker ||
+      config->worker_count == 0) {
+    return bud_ok();
+  }
+
+#ifdef __linux__
+  config->worker_cpus = calloc(config->worker_count,
+                               sizeof(*config->worker_cpus));
+  if (config->worker_cpus == NULL)
+    return bud_error_str(kBudErrNoMem, "worker_cpus");
+
+  if (config->affinity_cpus != NULL) {
+    return bud_affinity_list(config,
+                             config->affinity_cpus,
+                             config->affinity_cpu_count);
+  }
+
+  if (strcmp(str, "auto") == 0)
+    return bud_affinity_auto(config);
+
+  return bud_error(kBudErrAffinity);
+#else  /* !__linux__ */
+  (void) str;
+  return bud_error(kBudErrAffinityNotSupported);
+#endif  /* __linux__ */
+}
+
+
+void bud_affinity_free(bud_config_t* config) {
+  free(config->worker_cpus);
+  config->worker_cpus = NULL;
+}
+
+
+#ifdef __linux__
+bud_error_t bud_affinity_list(bud_config_t* config,
+                              const int* cpus,
+                              int count) {
+  int i;
+
+  if (count == 0)
+    return bud_error(kBudErrAffinity);
+
+  /* Non-numbers are stored as -1 */
+  for (i = 0; i < count; i++)
+    if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+      return bud_error(kBudErrAffinity);
+
+  /* Wrap around, if there are more workers than CPUs */
+  for (i = 0; i < config->worker_count; i++)
+    config->worker_cpus[i] = cpus[i % count];
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_affinity_auto(bud_config_t* config) {
+  int i;
+  int cpu;
+  int count;
+  cpu_set_t set;
+  bud_affinity_cpu_t* cpus;
+
+  /* Respect the mask that master was started with (taskset, cgroups) */
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    return bud_error(kBudErrAffinity);
+
+  cpus = calloc(CPU_COUNT(&set), sizeof(*cpus));
+  if (cpus == NULL)
+    return bud_error_str(kBudErrNoMem, "affinity cpus");
+
+  /* One CPU per physical core, skip hyper-threading siblings */
+  count = 0;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, &set) || !bud_affinity_cpu_primary(cpu))
+      continue;
+    cpus[count].cpu = cpu;
+    cpus[count].node = bud_affinity_cpu_node(cpu);
+    count++;
+  }
+
+  if (count == 0) {
+    free(cpus);
+    return bud_error(kBudErrAffinity);
+  }
+
+  /* Fill NUMA nodes one by one, so that neighbour workers share a node */
+  qsort(cpus, count, sizeof(*cpus), bud_affinity_cpu_compare);
+  for (i = 0; i < config->worker_count; i++) {
+    config->worker_cpus[i] = cpus[i % count].cpu;
+    bud_log(config,
+            kBudLogDebug,
+            "worker %d will run on cpu %d (node %d)",
+            i,
+            cpus[i % count].cpu,
+            cpus[i % count].node);
+  }
+  free(cpus);
+
+  return bud_ok();
+}
+
+
+int bud_affinity_cpu_node(int cpu) {
+  char path[128];
+  DIR* dir;
+  struct dirent* ent;
+  int node;
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  dir = opendir(path);
+  if (dir == NULL)
+    return 0;
+
+  /* cpuN/nodeK is a link to the node's directory */
+  node = 0;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) == 0 &&
+        sscanf(ent->d_name + 4, "%d", &node) == 1) {
+      break;
+    }
+  }
+  closedir(dir);
+
+  return node;
+}
+
+
+int bud_affinity_cpu_primary(int cpu) {
+  char path[128];
+  FILE* fp;
+  int first;
+  int r;
+
+  snprintf(path,
+           sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list",
+           cpu);
+  fp = fopen(path, "r");
+
+  /* No topology information - treat every CPU as a core */
+  if (fp == NULL)
+    return 1;
+
+  /* The list starts with the lowest sibling, i.e. "0,16" or "0-1" */
+  r = fscanf(fp, "%d", &first);
+  fclose(fp);
+
+  return r != 1 || first == cpu;
+}
+
+
+int bud_affinity_cpu_compare(const void* a, const void* b) {
+  const bud_affinity_cpu_t* ca;
+  const bud_affinity_cpu_t* cb;
+
+  ca = a;
+  cb = b;
+  if (ca->node != cb->node)
+    return ca->node - cb->node;
+  return ca->cpu - cb->cpu;
+}
+
+
+void bud_affinity_set_mempolicy(bud_config_t* config, int mode, int node) {
+#ifdef SYS_set_mempolicy
+  unsigned long mask;
+  int r;
+
+  if (mode == BUD_MPOL_DEFAULT) {
+    r = syscall(SYS_set_mempolicy, mode, NULL, 0);
+  } else {
+    if (node < 0 || node >= (int) (sizeof(mask) * 8))
+      return;
+    mask = 1UL << node;
+
+    /* Kernel expects maxnode to be one more than the mask's bit count */
+    r = syscall(SYS_set_mempolicy, mode, &mask, sizeof(mask) * 8 + 1);
+  }
+
+  if (r != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "set_mempolicy(%d) failed, node: %d",
+            mode,
+            node);
+  }
+#endif  /* SYS_set_mempolicy */
+}
+#endif  /* __linux__ */
+
+
+void bud_affinity_spawn_start(bud_config_t* config, int index) {
+#ifdef __linux__
+  cpu_set_t set;
+  int cpu;
+
+  if (config->worker_cpus == NULL)
+    return;
+
+  cpu = config->worker_cpus[index];
+  bud_affinity_saved_ok =
+      sched_getaffinity(0, sizeof(bud_affinity_saved), &bud_affinity_saved) ==
+      0;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "sched_setaffinity() failed for worker %d, cpu: %d",
+            index,
+            cpu);
+  }
+
+  if (config->workers_membind)
+    bud_affinity_set_mempolicy(config,
+                               BUD_MPOL_PREFERRED,
+                               bud_affinity_cpu_node(cpu));
+#endif  /* __linux__ */
+}
+
+
+void bud_affinity_spawn_end(bud_config_t* config) {
+#ifdef __linux__
+  if (config->worker_cpus == NULL)
+    return;
+
+  if (bud_affinity_saved_ok)
+    sched_setaffinity(0, sizeof(bud_affinity_saved), &bud_affinity_saved);
+  bud_affinity_saved_ok = 0;
+
+  if (config->workers_membind)
+    bud_affinity_set_mempolicy(config, BUD_MPOL_DEFAULT, -1);
+#endif  /* __linux__ */
+}
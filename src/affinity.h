@@ -0,0 +1,22 @@
+#ifndef SRC_AFFINITY_H_
+#define SRC_AFFINITY_H_
+
+#include "error.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+/* Master maps workers to CPUs according to `workers_affinity` */
+bud_error_t bud_affinity_init(struct bud_config_s* config);
+void bud_affinity_free(struct bud_config_s* config);
+
+/*
+ * Pin master to the worker's CPU (and its NUMA node with `workers_membind`)
+ * just for the uv_spawn() call. Both are inherited by forked child and
+ * survive exec, so the worker starts on its CPU and allocates everything,
+ * including the config and contexts, on the local node.
+ */
+void bud_affinity_spawn_start(struct bud_config_s* config, int index);
+void bud_affinity_spawn_end(struct bud_config_s* config);
+
+#endif  /* SRC_AFFINITY_H_ */
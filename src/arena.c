@@ -0,0 +1,135 @@
+#include <string.h>  /* memcpy, memset, strcmp, strlen */
+
+#include "arena.h"
+#include "memstat.h"
+
+static uint32_t bud_arena_hash(const char* str, size_t len);
+static int bud_arena_grow(bud_arena_t* arena);
+
+
+void bud_arena_init(bud_arena_t* arena) {
+  memset(arena, 0, sizeof(*arena));
+}
+
+
+void bud_arena_destroy(bud_arena_t* arena) {
+  bud_arena_chunk_t* chunk;
+  bud_arena_chunk_t* next;
+
+  for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+    next = chunk->next;
+    bud_mem_free(chunk);
+  }
+  bud_mem_free(arena->strings);
+  memset(arena, 0, sizeof(*arena));
+}
+
+
+void* bud_arena_alloc(bud_arena_t* arena, size_t size) {
+  bud_arena_chunk_t* chunk;
+  size_t chunk_size;
+  void* res;
+
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+  chunk = arena->chunks;
+  if (chunk == NULL || chunk->size - chunk->used < size) {
+    chunk_size = size > BUD_ARENA_CHUNK ? size : BUD_ARENA_CHUNK;
+    chunk = bud_mem_alloc(kBudMemOther, sizeof(*chunk) + chunk_size);
+    if (chunk == NULL) {
+      arena->failed = 1;
+      return NULL;
+    }
+    chunk->size = chunk_size;
+    chunk->used = 0;
+
+    /* Oversized one goes behind, so that the current one is still filled */
+    if (arena->chunks != NULL && size > BUD_ARENA_CHUNK) {
+      chunk->next = arena->chunks->next;
+      arena->chunks->next = chunk;
+    } else {
+      chunk->next = arena->chunks;
+      arena->chunks = chunk;
+    }
+    arena->total += chunk_size;
+  }
+
+  res = chunk->data + chunk->used;
+  chunk->used += size;
+  return res;
+}
+
+
+const char* bud_arena_intern(bud_arena_t* arena, const char* str) {
+  size_t len;
+  uint32_t i;
+  char* copy;
+
+  if (str == NULL)
+    return NULL;
+
+  if (arena->count >= (arena->mask + 1) / 2 && bud_arena_grow(arena) != 0)
+    return NULL;
+
+  len = strlen(str);
+  i = bud_arena_hash(str, len) & arena->mask;
+  while (arena->strings[i] != NULL) {
+    if (strcmp(arena->strings[i], str) == 0)
+      return arena->strings[i];
+    i = (i + 1) & arena->mask;
+  }
+
+  copy = bud_arena_alloc(arena, len + 1);
+  if (copy == NULL)
+    return NULL;
+  memcpy(copy, str, len + 1);
+
+  arena->strings[i] = copy;
+  arena->count++;
+  return copy;
+}
+
+
+uint32_t bud_arena_hash(const char* str, size_t len) {
+  uint32_t hash;
+  size_t i;
+
+  /* FNV-1a, case matters here */
+  hash = 2166136261u;
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char) str[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+int bud_arena_grow(bud_arena_t* arena) {
+  const char** strings;
+  uint32_t size;
+  uint32_t mask;
+  uint32_t i;
+  uint32_t j;
+
+  size = arena->strings == NULL ? BUD_ARENA_STRINGS : (arena->mask + 1) * 2;
+  strings = bud_mem_calloc(kBudMemOther, size, sizeof(*strings));
+  if (strings == NULL) {
+    arena->failed = 1;
+    return -1;
+  }
+
+  mask = size - 1;
+  for (i = 0; arena->strings != NULL && i <= arena->mask; i++) {
+    if (arena->strings[i] == NULL)
+      continue;
+    j = bud_arena_hash(arena->strings[i], strlen(arena->strings[i])) & mask;
+    while (strings[j] != NULL)
+      j = (j + 1) & mask;
+    strings[j] = arena->strings[i];
+  }
+
+  bud_mem_free(arena->strings);
+  arena->strings = strings;
+  arena->mask = mask;
+  return 0;
+}
@@ -0,0 +1,50 @@
+#ifndef SRC_ARENA_H_
+#define SRC_ARENA_H_
+
+#include <stddef.h>  /* size_t */
+#include <stdint.h>  /* uint32_t */
+
+/* Allocations are carved out of chunks this large, larger ones get theirs */
+#define BUD_ARENA_CHUNK (64 * 1024)
+
+/* Slots of the string table to begin with, doubled at half full */
+#define BUD_ARENA_STRINGS 256
+
+typedef struct bud_arena_s bud_arena_t;
+typedef struct bud_arena_chunk_s bud_arena_chunk_t;
+
+struct bud_arena_chunk_s {
+  bud_arena_chunk_t* next;
+  size_t size;
+  size_t used;
+  char data[1];
+};
+
+/*
+ * Storage of the things that live as long as the config: copies of its
+ * strings (each distinct one is stored once) and flat arrays. Nothing is
+ * freed on its own, everything goes away in bud_arena_destroy().
+ */
+struct bud_arena_s {
+  bud_arena_chunk_t* chunks;
+  size_t total;
+
+  /* Open addressing, `mask + 1` slots */
+  const char** strings;
+  uint32_t mask;
+  uint32_t count;
+
+  /* Some allocation has failed, checked once everything is copied */
+  int failed;
+};
+
+void bud_arena_init(bud_arena_t* arena);
+void bud_arena_destroy(bud_arena_t* arena);
+
+/* Pointer-aligned, NULL (and `failed` set) if out of memory */
+void* bud_arena_alloc(bud_arena_t* arena, size_t size);
+
+/* Copy of `str`, the same one for equal strings. NULL for NULL */
+const char* bud_arena_intern(bud_arena_t* arena, const char* str);
+
+#endif  /* SRC_ARENA_H_ */
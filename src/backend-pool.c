@@ -0,0 +1,353 @@
+#include <stdlib.h>  /* malloc, free */
+#include <unistd.h>  /* close, dup */
+
+#include "uv.h"
+
+#include "backend-pool.h"
+#include "backend.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+#include "queue.h"
+
+#define BUD_BACKEND_POOL_INTERVAL 1000
+
+static void bud_backend_pool_fill(bud_backend_t* backend, int target);
+static int bud_backend_pool_connect(bud_backend_t* backend);
+static void bud_backend_pool_idle(bud_backend_conn_t* conn);
+static void bud_backend_pool_timer_cb(uv_timer_t* timer, int status);
+static void bud_backend_conn_connect_cb(uv_connect_t* req, int status);
+static void bud_backend_conn_alloc_cb(uv_handle_t* handle,
+                                      size_t suggested_size,
+                                      uv_buf_t* buf);
+static void bud_backend_conn_read_cb(uv_stream_t* stream,
+                                     ssize_t nread,
+                                     const uv_buf_t* buf);
+static void bud_backend_conn_close(bud_backend_conn_t* conn);
+static void bud_backend_conn_close_cb(uv_handle_t* handle);
+
+/* Idle connections should not receive anything, discard it */
+static char bud_backend_pool_discard[64];
+
+
+bud_error_t bud_backend_pool_start(bud_config_t* config,
+                                   bud_backend_t* backend) {
+  int r;
+  bud_backend_pool_t* pool;
+
+  pool = &backend->pool;
+  QUEUE_INIT(&pool->idle);
+  QUEUE_INIT(&pool->connecting);
+  pool->idle_count = 0;
+  pool->connecting_count = 0;
+
+  /* Connecting to the Unix socket is cheap enough */
+  if (config->backend.pool.max_idle <= 0 || backend->is_pipe)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &pool->timer);
+  if (r != 0)
+    return bud_error_num(kBudErrBackendPoolTimer, r);
+  pool->timer.data = backend;
+  pool->enabled = 1;
+
+  r = uv_timer_start(&pool->timer,
+                     bud_backend_pool_timer_cb,
+                     BUD_BACKEND_POOL_INTERVAL,
+                     BUD_BACKEND_POOL_INTERVAL);
+  if (r != 0)
+    return bud_error_num(kBudErrBackendPoolTimer, r);
+  uv_unref((uv_handle_t*) &pool->timer);
+
+  bud_backend_pool_fill(backend, config->backend.pool.min_idle);
+  return bud_ok();
+}
+
+
+void bud_backend_pool_close(bud_backend_t* backend) {
+  bud_backend_pool_t* pool;
+  QUEUE* q;
+
+  pool = &backend->pool;
+  if (!pool->enabled)
+    return;
+  pool->enabled = 0;
+
+  uv_close((uv_handle_t*) &pool->timer, NULL);
+  while (!QUEUE_EMPTY(&pool->idle)) {
+    q = QUEUE_HEAD(&pool->idle);
+    bud_backend_conn_close(QUEUE_DATA(q, bud_backend_conn_t, member));
+  }
+  while (!QUEUE_EMPTY(&pool->connecting)) {
+    q = QUEUE_HEAD(&pool->connecting);
+    bud_backend_conn_close(QUEUE_DATA(q, bud_backend_conn_t, member));
+  }
+}
+
+
+int bud_backend_pool_take(bud_backend_t* backend, uv_tcp_t* tcp) {
+  int r;
+  int fd;
+  int level;
+  uv_os_fd_t ofd;
+  bud_backend_pool_t* pool;
+  bud_backend_conn_t* conn;
+  QUEUE* q;
+
+  pool = &backend->pool;
+  if (!pool->enabled)
+    return -1;
+
+  level = pool->idle_count + pool->connecting_count;
+  while (!QUEUE_EMPTY(&pool->idle)) {
+    q = QUEUE_HEAD(&pool->idle);
+    conn = QUEUE_DATA(q, bud_backend_conn_t, member);
+
+    /*
+     * libuv handles can't be moved, so pass the socket on and close the
+     * handle. Both descriptors share the connection.
+     */
+    fd = -1;
+    if (uv_fileno((uv_handle_t*) &conn->tcp, &ofd) == 0)
+      fd = dup(ofd);
+    bud_backend_conn_close(conn);
+    if (fd == -1)
+      continue;
+
+    r = uv_tcp_open(tcp, fd);
+    if (r != 0) {
+      close(fd);
+      break;
+    }
+
+    /* Replace the taken connection */
+    bud_backend_pool_fill(backend, level);
+    return 0;
+  }
+
+  /* Miss - grow the pool, up to `max_idle` */
+  bud_backend_pool_fill(backend, level + 1);
+  return -1;
+}
+
+
+int bud_backend_pool_put(bud_backend_t* backend, uv_tcp_t* tcp) {
+  int r;
+  int fd;
+  uv_os_fd_t ofd;
+  bud_backend_pool_t* pool;
+  bud_backend_conn_t* conn;
+
+  pool = &backend->pool;
+  if (!pool->enabled ||
+      pool->idle_count >= backend->config->backend.pool.max_idle) {
+    return -1;
+  }
+
+  if (uv_fileno((uv_handle_t*) tcp, &ofd) != 0)
+    return -1;
+  fd = dup(ofd);
+  if (fd == -1)
+    return -1;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    goto fatal;
+
+  conn->backend = backend;
+  conn->idle = 0;
+  r = uv_tcp_init(backend->config->loop, &conn->tcp);
+  if (r != 0)
+    goto fatal;
+  conn->tcp.data = conn;
+
+  /* Handle is initialized, close it the usual way on failure */
+  QUEUE_INSERT_TAIL(&pool->connecting, &conn->member);
+  pool->connecting_count++;
+  r = uv_tcp_open(&conn->tcp, fd);
+  if (r != 0) {
+    close(fd);
+    bud_backend_conn_close(conn);
+    return r;
+  }
+
+  bud_backend_pool_idle(conn);
+  return 0;
+
+fatal:
+  free(conn);
+  close(fd);
+  return -1;
+}
+
+
+void bud_backend_pool_fill(bud_backend_t* backend, int target) {
+  bud_config_t* config;
+  bud_backend_pool_t* pool;
+
+  config = backend->config;
+  pool = &backend->pool;
+  if (!pool->enabled)
+    return;
+
+  /* Do not hammer the dead backend, health checks will revive it */
+  if (backend->dead_until > uv_now(config->loop))
+    return;
+
+  if (target > config->backend.pool.max_idle)
+    target = config->backend.pool.max_idle;
+  while (pool->idle_count + pool->connecting_count < target)
+    if (bud_backend_pool_connect(backend) != 0)
+      break;
+}
+
+
+int bud_backend_pool_connect(bud_backend_t* backend) {
+  int r;
+  bud_backend_conn_t* conn;
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return -1;
+
+  conn->backend = backend;
+  conn->idle = 0;
+  r = uv_tcp_init(backend->config->loop, &conn->tcp);
+  if (r != 0) {
+    free(conn);
+    return r;
+  }
+  conn->tcp.data = conn;
+
+  r = uv_tcp_connect(&conn->req,
+                     &conn->tcp,
+                     (struct sockaddr*) &backend->addr,
+                     bud_backend_conn_connect_cb);
+  if (r == 0)
+    r = uv_tcp_nodelay(&conn->tcp, 1);
+  if (r == 0 && backend->keepalive > 0)
+    r = uv_tcp_keepalive(&conn->tcp, 1, backend->keepalive);
+
+  QUEUE_INSERT_TAIL(&backend->pool.connecting, &conn->member);
+  backend->pool.connecting_count++;
+  if (r != 0) {
+    bud_backend_failed(backend);
+    bud_backend_conn_close(conn);
+  }
+  return r;
+}
+
+
+void bud_backend_pool_timer_cb(uv_timer_t* timer, int status) {
+  bud_backend_t* backend;
+  bud_config_t* config;
+  bud_backend_conn_t* conn;
+  uint64_t now;
+  QUEUE* q;
+
+  backend = timer->data;
+  config = backend->config;
+  now = uv_now(config->loop);
+
+  /* Oldest connections are at the tail */
+  while (config->backend.pool.idle_timeout > 0 &&
+         !QUEUE_EMPTY(&backend->pool.idle)) {
+    q = QUEUE_PREV(&backend->pool.idle);
+    conn = QUEUE_DATA(q, bud_backend_conn_t, member);
+    if (conn->idle_since + config->backend.pool.idle_timeout > now)
+      break;
+    bud_backend_conn_close(conn);
+  }
+
+  bud_backend_pool_fill(backend, config->backend.pool.min_idle);
+}
+
+
+void bud_backend_conn_connect_cb(uv_connect_t* req, int status) {
+  bud_backend_conn_t* conn;
+  bud_backend_t* backend;
+
+  /* Pool is closing */
+  if (status == UV_ECANCELED)
+    return;
+
+  conn = container_of(req, bud_backend_conn_t, req);
+  backend = conn->backend;
+  if (status != 0) {
+    bud_backend_addr_failed(backend, &backend->addr);
+    bud_backend_failed(backend);
+    return bud_backend_conn_close(conn);
+  }
+  bud_backend_succeeded(backend);
+  bud_backend_pool_idle(conn);
+}
+
+
+void bud_backend_pool_idle(bud_backend_conn_t* conn) {
+  int r;
+  bud_backend_t* backend;
+
+  backend = conn->backend;
+
+  /* Watch for EOF, backend may close idle connections by itself */
+  r = uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_backend_conn_alloc_cb,
+                    bud_backend_conn_read_cb);
+  if (r != 0)
+    return bud_backend_conn_close(conn);
+
+  QUEUE_REMOVE(&conn->member);
+  backend->pool.connecting_count--;
+  QUEUE_INSERT_HEAD(&backend->pool.idle, &conn->member);
+  backend->pool.idle_count++;
+  conn->idle = 1;
+  conn->idle_since = uv_now(backend->config->loop);
+}
+
+
+void bud_backend_conn_alloc_cb(uv_handle_t* handle,
+                               size_t suggested_size,
+                               uv_buf_t* buf) {
+  *buf = uv_buf_init(bud_backend_pool_discard,
+                     sizeof(bud_backend_pool_discard));
+}
+
+
+void bud_backend_conn_read_cb(uv_stream_t* stream,
+                              ssize_t nread,
+                              const uv_buf_t* buf) {
+  bud_backend_conn_t* conn;
+
+  if (nread == 0)
+    return;
+
+  /* EOF, error or unexpected data - connection is not usable anymore */
+  conn = stream->data;
+  bud_log(conn->backend->config,
+          kBudLogDebug,
+          "backend %s:%d pooled connection closed: %d",
+          conn->backend->host,
+          conn->backend->port,
+          (int) nread);
+  bud_backend_conn_close(conn);
+}
+
+
+void bud_backend_conn_close(bud_backend_conn_t* conn) {
+  bud_backend_pool_t* pool;
+
+  pool = &conn->backend->pool;
+  if (conn->idle)
+    pool->idle_count--;
+  else
+    pool->connecting_count--;
+
+  QUEUE_REMOVE(&conn->member);
+  uv_close((uv_handle_t*) &conn->tcp, bud_backend_conn_close_cb);
+}
+
+
+void bud_backend_conn_close_cb(uv_handle_t* handle) {
+  free(handle->data);
+}
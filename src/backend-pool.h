@@ -0,0 +1,62 @@
+#ifndef SRC_BACKEND_POOL_H_
+#define SRC_BACKEND_POOL_H_
+
+#include <stdint.h>  /* uint64_t */
+
+#include "uv.h"
+
+#include "error.h"
+#include "queue.h"
+
+/* Forward declarations */
+struct bud_backend_s;
+struct bud_config_s;
+
+typedef struct bud_backend_pool_s bud_backend_pool_t;
+typedef struct bud_backend_conn_s bud_backend_conn_t;
+
+struct bud_backend_pool_s {
+  int enabled;
+
+  /* Connected and waiting for a client, most recent first */
+  QUEUE idle;
+  int idle_count;
+
+  /* Connects in flight */
+  QUEUE connecting;
+  int connecting_count;
+
+  /* Expires idle connections and tops the pool up to `min_idle` */
+  uv_timer_t timer;
+};
+
+struct bud_backend_conn_s {
+  struct bud_backend_s* backend;
+  uv_tcp_t tcp;
+  uv_connect_t req;
+  QUEUE member;
+  int idle;
+  uint64_t idle_since;
+};
+
+/* Per-process pool of warm connections, if `backend.pool.max_idle` is set */
+bud_error_t bud_backend_pool_start(struct bud_config_s* config,
+                                   struct bud_backend_s* backend);
+void bud_backend_pool_close(struct bud_backend_s* backend);
+
+/*
+ * Move an idle connection into `tcp` (which should be initialized, but not
+ * connected). Returns non-zero if the pool is empty, client should connect
+ * by itself then.
+ */
+int bud_backend_pool_take(struct bud_backend_s* backend, uv_tcp_t* tcp);
+
+/*
+ * Return connection of the finished client (with no request in progress,
+ * see `backend.http_reuse`) to the idle ones. The socket is duplicated, so
+ * `tcp` should be closed by the caller anyway. Returns non-zero if the pool
+ * is full or disabled.
+ */
+int bud_backend_pool_put(struct bud_backend_s* backend, uv_tcp_t* tcp);
+
+#endif  /* SRC_BACKEND_POOL_H_ */
@@ -0,0 +1,1084 @@
+#include <netdb.h>  /* getaddrinfo, freeaddrinfo, addrinfo */
+#include <netinet/in.h>  /* sockaddr_in, sockaddr_in6 */
+#include <stdlib.h>  /* calloc, malloc, free */
+#include <string.h>  /* memcmp, memcpy, memset, strcmp, strdup, strlen */
+
+#include "uv.h"
+#include "openssl/ssl.h"
+#include "parson.h"
+
+#include "backend.h"
+#include "backend-pool.h"
+#include "client.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+/* Health probe states */
+#define BUD_HEALTH_IDLE 0
+#define BUD_HEALTH_CONNECTING 1
+#define BUD_HEALTH_CLOSING 2
+
+static bud_error_t bud_backend_tls_init(bud_config_t* config);
+static bud_error_t bud_backend_init(bud_config_t* config,
+                                    bud_backend_t* backend,
+                                    const bud_backend_conf_t* conf,
+                                    int copy);
+static bud_error_t bud_backend_list_start(bud_config_t* config,
+                                          bud_backend_list_t* list);
+static void bud_backend_list_finalize(bud_backend_list_t* list);
+static bud_error_t bud_backend_resolve(bud_backend_t* backend);
+static int bud_backend_set_addrs(bud_backend_t* backend,
+                                 struct addrinfo* res);
+static int bud_backend_list_names(bud_backend_list_t* list);
+static void bud_backend_list_resolve(bud_config_t* config,
+                                     bud_backend_list_t* list);
+static void bud_backend_resolve_timer_cb(uv_timer_t* timer, int status);
+static void bud_backend_resolve_cb(uv_getaddrinfo_t* req,
+                                   int status,
+                                   struct addrinfo* res);
+static int bud_backend_addr_find(bud_backend_t* backend,
+                                 const struct sockaddr_storage* addr);
+static int bud_backend_is_alive(bud_backend_t* backend, uint64_t now);
+static bud_backend_t* bud_backend_select_ewma(bud_backend_list_t* list,
+                                              int alive,
+                                              uint64_t now);
+static bud_backend_t* bud_backend_nth(bud_backend_list_t* list,
+                                      int alive,
+                                      uint64_t now,
+                                      int n,
+                                      bud_backend_t* skip);
+static uint64_t bud_backend_cost(bud_backend_t* backend, uint64_t now);
+static uint32_t bud_backend_score(bud_backend_t* backend, uint32_t hash);
+static void bud_backend_health_timer_cb(uv_timer_t* timer, int status);
+static void bud_backend_health_connect_cb(uv_connect_t* req, int status);
+static void bud_backend_health_close_cb(uv_handle_t* handle);
+
+
+bud_error_t bud_backends_init(bud_config_t* config) {
+  int i;
+  const char* balance;
+  bud_context_t* ctx;
+  bud_error_t err;
+
+  balance = config->backend.balance;
+  if (strcmp(balance, "roundrobin") == 0)
+    config->backend.balance_type = kBudBalanceRoundRobin;
+  else if (strcmp(balance, "leastconn") == 0)
+    config->backend.balance_type = kBudBalanceLeastConn;
+  else if (strcmp(balance, "ip-hash") == 0)
+    config->backend.balance_type = kBudBalanceIPHash;
+  else if (strcmp(balance, "sni-hash") == 0)
+    config->backend.balance_type = kBudBalanceSNIHash;
+  else if (strcmp(balance, "peak-ewma") == 0)
+    config->backend.balance_type = kBudBalancePeakEWMA;
+  else
+    return bud_error_str(kBudErrBalance, balance);
+
+  err = bud_backend_tls_init(config);
+  if (!bud_is_ok(err))
+    return err;
+
+  /* Latency is forgotten right away, but not divided by zero */
+  if (config->backend.ewma_decay <= 0)
+    config->backend.ewma_decay = 1;
+
+  /* `min_idle` alone is enough to enable the pool */
+  if (config->backend.pool.max_idle < config->backend.pool.min_idle)
+    config->backend.pool.max_idle = config->backend.pool.min_idle;
+
+  /*
+   * SNI responses may carry backends too. PROXY header is parsed before the
+   * hello, so `ip-hash` (and `proxyline`) get the real address.
+   */
+  config->backend.defer = config->backend.balance_type == kBudBalanceSNIHash ||
+                          config->sni.enabled ||
+                          config->frontend.passthrough ||
+                          config->frontend.accept_proxyline;
+
+  err = bud_backend_list_init(config,
+                              &config->backends,
+                              config->backend.list,
+                              0);
+  if (!bud_is_ok(err))
+    return err;
+
+  /* No `backends` - use `backend` as the only one */
+  if (config->backends.count == 0) {
+    config->backends.list = calloc(1, sizeof(*config->backends.list));
+    if (config->backends.list == NULL)
+      return bud_error_str(kBudErrNoMem, "backends");
+    config->backends.count = 1;
+
+    err = bud_backend_init(config, config->backends.list, NULL, 0);
+    if (!bud_is_ok(err))
+      return err;
+  }
+
+  /* Protocol is known after the handshake, connect only then */
+  err = bud_backend_list_init(config,
+                              &config->h2_backends,
+                              config->backend.h2_list,
+                              0);
+  if (!bud_is_ok(err))
+    return err;
+  if (config->h2_backends.count != 0)
+    config->backend.defer = 1;
+
+  /* Contexts are selected by the servername, connect after parsing hello */
+  for (i = 1; i < config->context_count + 1; i++) {
+    ctx = &config->contexts[i];
+    err = bud_backend_list_init(config, &ctx->backends, ctx->backend_list, 0);
+    if (!bud_is_ok(err))
+      return err;
+    if (ctx->backends.count != 0)
+      config->backend.defer = 1;
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_backend_tls_init(bud_config_t* config) {
+  SSL_CTX* ctx;
+
+  /* Passthrough relays client's own TLS */
+  config->backend.tls.ctx = NULL;
+  if (config->frontend.passthrough)
+    return bud_ok();
+
+  ctx = SSL_CTX_new(SSLv23_client_method());
+  if (ctx == NULL)
+    return bud_error_str(kBudErrNoMem, "backend SSL_CTX");
+
+  SSL_CTX_set_options(ctx, SSL_OP_ALL | SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  SSL_CTX_set_mode(ctx,
+                   SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                   SSL_MODE_ENABLE_PARTIAL_WRITE);
+  if (config->backend.tls.ciphers != NULL &&
+      !SSL_CTX_set_cipher_list(ctx, config->backend.tls.ciphers)) {
+    SSL_CTX_free(ctx);
+    return bud_error_str(kBudErrBackendTLS, "ciphers");
+  }
+
+  if (config->backend.tls.ca != NULL) {
+    if (!SSL_CTX_load_verify_locations(ctx, config->backend.tls.ca, NULL)) {
+      SSL_CTX_free(ctx);
+      return bud_error_str(kBudErrBackendTLS, config->backend.tls.ca);
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  }
+
+  /*
+   * Sessions are stored in backends by the new session callback (it also
+   * sees TLS 1.3 tickets, which arrive after the handshake)
+   */
+  if (config->backend.tls.session_reuse) {
+    SSL_CTX_set_session_cache_mode(ctx,
+                                   SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, bud_client_upstream_session_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  }
+
+  config->backend.tls.ctx = ctx;
+  return bud_ok();
+}
+
+
+bud_error_t bud_backend_conf_read(const JSON_Object* obj,
+                                  bud_backend_conf_t* conf) {
+  const JSON_Value* val;
+
+  if (obj == NULL)
+    return bud_error(kBudErrJSONNonObjectBackend);
+
+  conf->host = json_object_get_string(obj, "host");
+  conf->port = -1;
+  if (json_object_get_number(obj, "port") != 0)
+    conf->port = (uint16_t) json_object_get_number(obj, "port");
+  conf->keepalive = -1;
+  val = json_object_get_value(obj, "keepalive");
+  if (val != NULL)
+    conf->keepalive = json_value_get_number(val);
+  conf->server_first = -1;
+  val = json_object_get_value(obj, "server_first");
+  if (val != NULL)
+    conf->server_first = json_value_get_boolean(val);
+  conf->tls = -1;
+  val = json_object_get_value(obj, "tls");
+  if (val != NULL)
+    conf->tls = json_value_get_boolean(val);
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_backend_list_init(bud_config_t* config,
+                                  bud_backend_list_t* list,
+                                  const bud_backend_confs_t* confs,
+                                  int copy) {
+  int i;
+  int count;
+  bud_error_t err;
+
+  list->list = NULL;
+  list->count = 0;
+  list->last = -1;
+  list->copy = copy;
+
+  count = confs == NULL ? 0 : confs->count;
+  if (count == 0)
+    return bud_ok();
+
+  list->list = calloc(count, sizeof(*list->list));
+  if (list->list == NULL)
+    return bud_error_str(kBudErrNoMem, "backends");
+
+  for (i = 0; i < count; i++) {
+    err = bud_backend_init(config, &list->list[i], &confs->items[i], copy);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    /* Let bud_backend_list_free() release copied hosts */
+    list->count++;
+  }
+
+  return bud_ok();
+
+fatal:
+  bud_backend_list_free(list);
+  return err;
+}
+
+
+bud_error_t bud_backend_list_init_json(bud_config_t* config,
+                                       bud_backend_list_t* list,
+                                       const JSON_Array* json) {
+  int i;
+  int count;
+  bud_backend_confs_t* confs;
+  bud_error_t err;
+
+  count = json == NULL ? 0 : json_array_get_count(json);
+  if (count == 0)
+    return bud_backend_list_init(config, list, NULL, 1);
+
+  confs = malloc(sizeof(*confs) + (count - 1) * sizeof(*confs->items));
+  if (confs == NULL)
+    return bud_error_str(kBudErrNoMem, "backends");
+  confs->count = count;
+
+  for (i = 0; i < count; i++) {
+    err = bud_backend_conf_read(json_array_get_object(json, i),
+                                &confs->items[i]);
+    if (!bud_is_ok(err))
+      goto done;
+  }
+
+  /* Hosts are copied, `confs` points into the response */
+  err = bud_backend_list_init(config, list, confs, 1);
+
+done:
+  free(confs);
+  return err;
+}
+
+
+void bud_backend_list_free(bud_backend_list_t* list) {
+  int i;
+
+  for (i = 0; i < list->count; i++) {
+    if (list->copy)
+      free((char*) list->list[i].host);
+    if (list->list[i].tls_session != NULL)
+      SSL_SESSION_free(list->list[i].tls_session);
+  }
+  free(list->list);
+  list->list = NULL;
+  list->count = 0;
+}
+
+
+bud_error_t bud_backend_init(bud_config_t* config,
+                             bud_backend_t* backend,
+                             const bud_backend_conf_t* conf,
+                             int copy) {
+  int r;
+  bud_error_t err;
+
+  backend->config = config;
+  backend->host = config->backend.host;
+  backend->port = config->backend.port;
+  backend->keepalive = config->backend.keepalive;
+  backend->server_first = config->backend.server_first;
+  backend->tls = config->backend.tls.enabled;
+  backend->tls_session = NULL;
+  backend->ewma = 0;
+  backend->ewma_stamp = 0;
+
+  /* Missing fields are inherited from `backend` */
+  if (conf != NULL) {
+    if (conf->host != NULL)
+      backend->host = conf->host;
+    if (conf->port != -1)
+      backend->port = conf->port;
+    if (conf->keepalive != -1)
+      backend->keepalive = conf->keepalive;
+    if (conf->server_first != -1)
+      backend->server_first = conf->server_first;
+    if (conf->tls != -1)
+      backend->tls = conf->tls;
+  }
+  if (config->backend.tls.ctx == NULL)
+    backend->tls = 0;
+
+  backend->is_pipe = BUD_HOST_IS_PIPE(backend->host);
+  backend->is_name = 0;
+  backend->resolving = 0;
+  backend->addr_count = 0;
+  backend->addr_index = 0;
+  if (!backend->is_pipe) {
+    r = bud_config_str_to_addr(backend->host, backend->port, &backend->addr);
+    if (r == 0) {
+      memcpy(&backend->addrs[0], &backend->addr, sizeof(backend->addr));
+      backend->retry_at[0] = 0;
+      backend->addr_count = 1;
+    } else if (copy) {
+      /* SNI responses are parsed on the loop, no blocking lookups there */
+      return bud_error_num(kBudErrPton, r);
+    } else {
+      backend->is_name = 1;
+      err = bud_backend_resolve(backend);
+      if (!bud_is_ok(err))
+        return err;
+    }
+  }
+
+  /* Position in the list does not matter, only the address does */
+  backend->hash = bud_hash_lower(BUD_HASH_INIT,
+                                 backend->host,
+                                 strlen(backend->host));
+  backend->hash = bud_hash_lower(backend->hash,
+                                 (const char*) &backend->port,
+                                 sizeof(backend->port));
+
+  if (copy) {
+    backend->host = strdup(backend->host);
+    if (backend->host == NULL)
+      return bud_error_str(kBudErrNoMem, "backend host");
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_backend_resolve(bud_backend_t* backend) {
+  struct addrinfo hints;
+  struct addrinfo* res;
+  int r;
+
+  /* Once on start, the later lookups are done off the loop */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  r = getaddrinfo(backend->host, NULL, &hints, &res);
+  if (r != 0)
+    return bud_error_str(kBudErrBackendResolve, backend->host);
+
+  r = bud_backend_set_addrs(backend, res);
+  freeaddrinfo(res);
+  if (r == 0)
+    return bud_error_str(kBudErrBackendResolve, backend->host);
+
+  return bud_ok();
+}
+
+
+int bud_backend_set_addrs(bud_backend_t* backend, struct addrinfo* res) {
+  struct sockaddr_storage addrs[BUD_BACKEND_MAX_ADDRS];
+  uint64_t retry_at[BUD_BACKEND_MAX_ADDRS];
+  struct sockaddr_storage* addr;
+  uint16_t port;
+  int index;
+  int count;
+  int i;
+
+  port = htons(backend->port);
+  index = 0;
+  count = 0;
+  for (; res != NULL && count < (int) ARRAY_SIZE(addrs); res = res->ai_next) {
+    if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+      continue;
+
+    addr = &addrs[count];
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    if (res->ai_family == AF_INET)
+      ((struct sockaddr_in*) addr)->sin_port = port;
+    else
+      ((struct sockaddr_in6*) addr)->sin6_port = port;
+
+    /* Failed address stays behind, the one that works stays first */
+    retry_at[count] = 0;
+    for (i = 0; i < backend->addr_count; i++) {
+      if (memcmp(&backend->addrs[i], addr, sizeof(*addr)) != 0)
+        continue;
+      retry_at[count] = backend->retry_at[i];
+      if (i == backend->addr_index)
+        index = count;
+    }
+    count++;
+  }
+
+  /* Keep the old ones */
+  if (count == 0)
+    return 0;
+
+  memcpy(backend->addrs, addrs, sizeof(addrs[0]) * count);
+  memcpy(backend->retry_at, retry_at, sizeof(retry_at[0]) * count);
+  backend->addr_count = count;
+  backend->addr_index = index;
+  memcpy(&backend->addr, &addrs[index], sizeof(backend->addr));
+  return count;
+}
+
+
+bud_error_t bud_backends_start(bud_config_t* config) {
+  int i;
+  int r;
+  int names;
+  bud_error_t err;
+
+  err = bud_backend_list_start(config, &config->backends);
+  if (bud_is_ok(err))
+    err = bud_backend_list_start(config, &config->h2_backends);
+  for (i = 1; bud_is_ok(err) && i < config->context_count + 1; i++)
+    err = bud_backend_list_start(config, &config->contexts[i].backends);
+  if (!bud_is_ok(err))
+    return err;
+
+  /* Literal addresses don't change */
+  names = bud_backend_list_names(&config->backends) +
+          bud_backend_list_names(&config->h2_backends);
+  for (i = 1; i < config->context_count + 1; i++)
+    names += bud_backend_list_names(&config->contexts[i].backends);
+  if (names == 0 || config->backend.resolve_interval <= 0)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &config->backend.resolve_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrResolveTimer, r);
+  config->backend.resolve_init = 1;
+
+  r = uv_timer_start(&config->backend.resolve_timer,
+                     bud_backend_resolve_timer_cb,
+                     config->backend.resolve_interval,
+                     config->backend.resolve_interval);
+  if (r != 0)
+    return bud_error_num(kBudErrResolveTimer, r);
+  uv_unref((uv_handle_t*) &config->backend.resolve_timer);
+
+  return bud_ok();
+}
+
+
+int bud_backend_list_names(bud_backend_list_t* list) {
+  int i;
+  int names;
+
+  names = 0;
+  for (i = 0; i < list->count; i++)
+    if (list->list[i].is_name)
+      names++;
+  return names;
+}
+
+
+bud_error_t bud_backend_list_start(bud_config_t* config,
+                                   bud_backend_list_t* list) {
+  int i;
+  int r;
+  bud_backend_t* backend;
+  bud_error_t err;
+
+  for (i = 0; i < list->count; i++) {
+    backend = &list->list[i];
+
+    err = bud_backend_pool_start(config, backend);
+    if (!bud_is_ok(err))
+      return err;
+
+    if (config->backend.health.interval <= 0)
+      continue;
+
+    r = uv_timer_init(config->loop, &backend->health_timer);
+    if (r != 0)
+      return bud_error_num(kBudErrHealthTimer, r);
+    backend->health_timer.data = backend;
+    backend->health_init = 1;
+
+    r = uv_timer_start(&backend->health_timer,
+                       bud_backend_health_timer_cb,
+                       config->backend.health.interval,
+                       config->backend.health.interval);
+    if (r != 0)
+      return bud_error_num(kBudErrHealthTimer, r);
+    uv_unref((uv_handle_t*) &backend->health_timer);
+  }
+
+  return bud_ok();
+}
+
+
+void bud_backends_finalize(bud_config_t* config) {
+  int i;
+
+  /* Lookups in flight are cancelled, or ignored once they are back */
+  if (config->backend.resolve_init) {
+    config->backend.resolve_init = 0;
+    uv_close((uv_handle_t*) &config->backend.resolve_timer, NULL);
+  }
+
+  bud_backend_list_finalize(&config->backends);
+  bud_backend_list_finalize(&config->h2_backends);
+  for (i = 1; i < config->context_count + 1; i++)
+    bud_backend_list_finalize(&config->contexts[i].backends);
+}
+
+
+void bud_backend_list_finalize(bud_backend_list_t* list) {
+  int i;
+  bud_backend_t* backend;
+
+  for (i = 0; i < list->count; i++) {
+    backend = &list->list[i];
+    bud_backend_pool_close(backend);
+    if (backend->resolving)
+      uv_cancel((uv_req_t*) &backend->resolver);
+    if (!backend->health_init)
+      continue;
+
+    uv_close((uv_handle_t*) &backend->health_timer, NULL);
+    if (backend->health_state == BUD_HEALTH_CONNECTING) {
+      uv_close((uv_handle_t*) &backend->health_tcp,
+               bud_backend_health_close_cb);
+      backend->health_state = BUD_HEALTH_CLOSING;
+    }
+    backend->health_init = 0;
+  }
+}
+
+
+void bud_backends_free(bud_config_t* config) {
+  int i;
+
+  bud_backend_list_free(&config->backends);
+  bud_backend_list_free(&config->h2_backends);
+  for (i = 1; i < config->context_count + 1; i++)
+    bud_backend_list_free(&config->contexts[i].backends);
+
+  if (config->backend.tls.ctx != NULL)
+    SSL_CTX_free(config->backend.tls.ctx);
+  config->backend.tls.ctx = NULL;
+}
+
+
+int bud_backend_is_alive(bud_backend_t* backend, uint64_t now) {
+  return backend->dead_until <= now;
+}
+
+
+uint32_t bud_backend_score(bud_backend_t* backend, uint32_t hash) {
+  uint32_t h;
+
+  /* Murmur3 finalizer, spreads bits of the (key, backend) pair */
+  h = hash ^ backend->hash;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
+}
+
+
+bud_backend_t* bud_backend_select(bud_config_t* config,
+                                  bud_backend_list_t* list,
+                                  const char* key,
+                                  size_t key_len) {
+  int i;
+  int index;
+  int best_index;
+  int alive;
+  uint64_t now;
+  uint32_t hash;
+  uint32_t score;
+  uint32_t best_score;
+  bud_backend_balance_t balance;
+  bud_backend_t* backend;
+  bud_backend_t* best;
+
+  if (list->count == 1)
+    return &list->list[0];
+
+  now = uv_now(config->loop);
+  alive = 0;
+  for (i = 0; i < list->count; i++)
+    if (bud_backend_is_alive(&list->list[i], now))
+      alive++;
+
+  /* No key to hash - fallback to round-robin */
+  balance = config->backend.balance_type;
+  if (balance == kBudBalancePeakEWMA)
+    return bud_backend_select_ewma(list, alive, now);
+  hash = 0;
+  if (balance == kBudBalanceIPHash || balance == kBudBalanceSNIHash) {
+    if (key_len == 0)
+      balance = kBudBalanceRoundRobin;
+    else
+      hash = bud_hash_lower(BUD_HASH_INIT, key, key_len);
+  }
+
+  /*
+   * Rendezvous hashing picks the backend with the highest score, so only
+   * keys of the removed (or dead) backend are remapped.
+   */
+  best = NULL;
+  best_index = 0;
+  best_score = 0;
+  for (i = 0; i < list->count; i++) {
+    index = (list->last + 1 + i) % list->count;
+    backend = &list->list[index];
+
+    /* All dead - try them anyway */
+    if (alive != 0 && !bud_backend_is_alive(backend, now))
+      continue;
+
+    if (balance == kBudBalanceRoundRobin) {
+      best = backend;
+      best_index = index;
+      break;
+    } else if (balance == kBudBalanceLeastConn) {
+      if (best != NULL && backend->active >= best->active)
+        continue;
+      best = backend;
+      best_index = index;
+    } else {
+      score = bud_backend_score(backend, hash);
+      if (best != NULL && score <= best_score)
+        continue;
+      best = backend;
+      best_score = score;
+    }
+  }
+
+  /* Hash policies should not disturb the round-robin order */
+  if (balance == kBudBalanceRoundRobin || balance == kBudBalanceLeastConn)
+    list->last = best_index;
+
+  return best;
+}
+
+
+bud_backend_t* bud_backend_select_ewma(bud_backend_list_t* list,
+                                       int alive,
+                                       uint64_t now) {
+  int count;
+  bud_backend_t* first;
+  bud_backend_t* second;
+
+  /*
+   * Power of two choices: the better of two random ones. Comparing all of
+   * them would send every new client to the same backend until its cost
+   * catches up.
+   */
+  count = alive != 0 ? alive : list->count;
+  first = bud_backend_nth(list, alive, now, rand() % count, NULL);
+  if (count == 1)
+    return first;
+  second = bud_backend_nth(list, alive, now, rand() % (count - 1), first);
+
+  /* Unsampled ones are cheap, but not free while they have clients */
+  if ((bud_backend_cost(first, now) + 1) * (first->active + 1) <=
+      (bud_backend_cost(second, now) + 1) * (second->active + 1)) {
+    return first;
+  }
+  return second;
+}
+
+
+bud_backend_t* bud_backend_nth(bud_backend_list_t* list,
+                               int alive,
+                               uint64_t now,
+                               int n,
+                               bud_backend_t* skip) {
+  int i;
+  bud_backend_t* backend;
+
+  /* All dead - try them anyway */
+  for (i = 0; i < list->count; i++) {
+    backend = &list->list[i];
+    if (backend == skip)
+      continue;
+    if (alive != 0 && !bud_backend_is_alive(backend, now))
+      continue;
+    if (n-- == 0)
+      return backend;
+  }
+
+  ASSERT(0, "Backend out of range");
+  return NULL;
+}
+
+
+uint64_t bud_backend_cost(bud_backend_t* backend, uint64_t now) {
+  uint64_t elapsed;
+  uint64_t decay;
+
+  /* Idle one decays towards zero, so it gets a new sample eventually */
+  decay = backend->config->backend.ewma_decay;
+  elapsed = now - backend->ewma_stamp;
+  return backend->ewma * decay / (decay + elapsed);
+}
+
+
+void bud_backend_observe(bud_backend_t* backend, uint64_t latency) {
+  uint64_t now;
+  uint64_t elapsed;
+  uint64_t decay;
+
+  now = uv_now(backend->config->loop);
+  decay = backend->config->backend.ewma_decay;
+  elapsed = now - backend->ewma_stamp + 1;
+  backend->ewma_stamp = now;
+
+  /*
+   * Peak is taken as it is, and forgotten slowly: a backend that pauses
+   * (GC, ...) is avoided right away. Weight of the old value is
+   * `decay / (decay + elapsed)`, close enough to `exp(-elapsed / decay)`
+   */
+  if (latency >= backend->ewma)
+    backend->ewma = latency;
+  else
+    backend->ewma = (backend->ewma * decay + latency * elapsed) /
+                    (decay + elapsed);
+}
+
+
+int bud_backend_list_down(bud_config_t* config, bud_backend_list_t* list) {
+  int i;
+  uint64_t now;
+
+  now = uv_now(config->loop);
+  for (i = 0; i < list->count; i++)
+    if (bud_backend_is_alive(&list->list[i], now))
+      return 0;
+
+  return list->count != 0;
+}
+
+
+void bud_backend_failed(bud_backend_t* backend) {
+  bud_config_t* config;
+  uint64_t now;
+
+  config = backend->config;
+  backend->fails++;
+  if (config->backend.health.max_fails <= 0 ||
+      backend->fails < config->backend.health.max_fails) {
+    return;
+  }
+
+  now = uv_now(config->loop);
+  if (bud_backend_is_alive(backend, now)) {
+    bud_log(config,
+            kBudLogWarning,
+            "backend %s:%d is down after %d failures",
+            backend->host,
+            backend->port,
+            backend->fails);
+  }
+  backend->dead_until = now + config->backend.health.fail_timeout;
+}
+
+
+void bud_backend_succeeded(bud_backend_t* backend) {
+  if (backend->dead_until != 0) {
+    bud_log(backend->config,
+            kBudLogInfo,
+            "backend %s:%d is up",
+            backend->host,
+            backend->port);
+  }
+  backend->fails = 0;
+  backend->dead_until = 0;
+}
+
+
+int bud_backend_addrs(bud_backend_t* backend,
+                      struct sockaddr_storage* out,
+                      int max) {
+  int order[BUD_BACKEND_MAX_ADDRS];
+  int used[BUD_BACKEND_MAX_ADDRS];
+  uint64_t now;
+  int healthy;
+  int family;
+  int first;
+  int pick;
+  int count;
+  int i;
+  int j;
+
+  now = uv_now(backend->config->loop);
+
+  /* Healthy ones first, both groups start from the one that connected last */
+  count = 0;
+  for (i = 0; i < backend->addr_count; i++) {
+    j = (backend->addr_index + i) % backend->addr_count;
+    if (backend->retry_at[j] <= now)
+      order[count++] = j;
+  }
+  healthy = count;
+  for (i = 0; i < backend->addr_count; i++) {
+    j = (backend->addr_index + i) % backend->addr_count;
+    if (backend->retry_at[j] > now)
+      order[count++] = j;
+  }
+
+  /* Next one is of the other family, unless the group has none left */
+  memset(used, 0, sizeof(used));
+  family = AF_UNSPEC;
+  for (i = 0; i < count && i < max; i++) {
+    first = -1;
+    pick = -1;
+    for (j = 0; j < count; j++) {
+      if (used[j])
+        continue;
+      if (first == -1)
+        first = j;
+      if ((j < healthy) != (first < healthy))
+        break;
+      if (backend->addrs[order[j]].ss_family != family) {
+        pick = j;
+        break;
+      }
+    }
+    if (pick == -1)
+      pick = first;
+
+    used[pick] = 1;
+    family = backend->addrs[order[pick]].ss_family;
+    memcpy(&out[i], &backend->addrs[order[pick]], sizeof(out[i]));
+  }
+
+  return i;
+}
+
+
+int bud_backend_addr_find(bud_backend_t* backend,
+                          const struct sockaddr_storage* addr) {
+  int i;
+
+  for (i = 0; i < backend->addr_count; i++)
+    if (memcmp(&backend->addrs[i], addr, sizeof(*addr)) == 0)
+      return i;
+  return -1;
+}
+
+
+void bud_backend_addr_failed(bud_backend_t* backend,
+                             const struct sockaddr_storage* addr) {
+  uint64_t now;
+  int i;
+  int j;
+  int k;
+
+  /* Gone with the last lookup */
+  i = bud_backend_addr_find(backend, addr);
+  if (i == -1)
+    return;
+
+  now = uv_now(backend->config->loop);
+  backend->retry_at[i] = now + BUD_BACKEND_ADDR_BACKOFF;
+  if (i != backend->addr_index)
+    return;
+
+  /* Pool and health checks move on to the next healthy one */
+  for (j = 1; j < backend->addr_count; j++) {
+    k = (i + j) % backend->addr_count;
+    if (backend->retry_at[k] > now)
+      continue;
+    backend->addr_index = k;
+    memcpy(&backend->addr, &backend->addrs[k], sizeof(backend->addr));
+    return;
+  }
+}
+
+
+void bud_backend_addr_succeeded(bud_backend_t* backend,
+                                const struct sockaddr_storage* addr) {
+  int i;
+
+  i = bud_backend_addr_find(backend, addr);
+  if (i == -1)
+    return;
+
+  backend->retry_at[i] = 0;
+  backend->addr_index = i;
+  memcpy(&backend->addr, &backend->addrs[i], sizeof(backend->addr));
+}
+
+
+void bud_backend_resolve_timer_cb(uv_timer_t* timer, int status) {
+  bud_config_t* config;
+  int i;
+
+  config = container_of(timer, bud_config_t, backend.resolve_timer);
+  bud_backend_list_resolve(config, &config->backends);
+  bud_backend_list_resolve(config, &config->h2_backends);
+  for (i = 1; i < config->context_count + 1; i++)
+    bud_backend_list_resolve(config, &config->contexts[i].backends);
+}
+
+
+void bud_backend_list_resolve(bud_config_t* config,
+                              bud_backend_list_t* list) {
+  bud_backend_t* backend;
+  struct addrinfo hints;
+  int i;
+  int r;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  for (i = 0; i < list->count; i++) {
+    backend = &list->list[i];
+    if (!backend->is_name || backend->resolving)
+      continue;
+
+    r = uv_getaddrinfo(config->loop,
+                       &backend->resolver,
+                       bud_backend_resolve_cb,
+                       backend->host,
+                       NULL,
+                       &hints);
+    if (r != 0) {
+      bud_log(config,
+              kBudLogWarning,
+              "failed to resolve backend %s: \"%s\"",
+              backend->host,
+              uv_strerror(r));
+      continue;
+    }
+    backend->resolving = 1;
+  }
+}
+
+
+void bud_backend_resolve_cb(uv_getaddrinfo_t* req,
+                            int status,
+                            struct addrinfo* res) {
+  bud_backend_t* backend;
+
+  backend = container_of(req, bud_backend_t, resolver);
+  backend->resolving = 0;
+
+  /* Cancelled by bud_backends_finalize() */
+  if (!backend->config->backend.resolve_init) {
+    uv_freeaddrinfo(res);
+    return;
+  }
+
+  /* Keep using the old addresses until DNS is back */
+  if (status != 0) {
+    bud_log(backend->config,
+            kBudLogWarning,
+            "failed to resolve backend %s: \"%s\"",
+            backend->host,
+            uv_strerror(status));
+  } else if (bud_backend_set_addrs(backend, res) == 0) {
+    bud_log(backend->config,
+            kBudLogWarning,
+            "backend %s has no addresses",
+            backend->host);
+  }
+  uv_freeaddrinfo(res);
+}
+
+
+void bud_backend_health_timer_cb(uv_timer_t* timer, int status) {
+  int r;
+  bud_backend_t* backend;
+
+  backend = timer->data;
+
+  /* Previous probe has not finished within the interval */
+  if (backend->health_state == BUD_HEALTH_CONNECTING) {
+    bud_backend_failed(backend);
+    uv_close((uv_handle_t*) &backend->health_tcp, bud_backend_health_close_cb);
+    backend->health_state = BUD_HEALTH_CLOSING;
+    return;
+  } else if (backend->health_state == BUD_HEALTH_CLOSING) {
+    return;
+  }
+
+  if (backend->is_pipe)
+    r = uv_pipe_init(backend->config->loop, &backend->health_pipe, 0);
+  else
+    r = uv_tcp_init(backend->config->loop, &backend->health_tcp);
+  if (r != 0)
+    return;
+  backend->health_tcp.data = backend;
+  backend->health_state = BUD_HEALTH_CONNECTING;
+
+  if (backend->is_pipe) {
+    uv_pipe_connect(&backend->health_req,
+                    &backend->health_pipe,
+                    backend->host,
+                    bud_backend_health_connect_cb);
+    return;
+  }
+
+  r = uv_tcp_connect(&backend->health_req,
+                     &backend->health_tcp,
+                     (struct sockaddr*) &backend->addr,
+                     bud_backend_health_connect_cb);
+  if (r != 0) {
+    bud_backend_failed(backend);
+    uv_close((uv_handle_t*) &backend->health_tcp, bud_backend_health_close_cb);
+    backend->health_state = BUD_HEALTH_CLOSING;
+  }
+}
+
+
+void bud_backend_health_connect_cb(uv_connect_t* req, int status) {
+  bud_backend_t* backend;
+
+  /* Probe was closed by the timer, or by finalize */
+  if (status == UV_ECANCELED)
+    return;
+
+  backend = container_of(req, bud_backend_t, health_req);
+  if (status == 0) {
+    bud_backend_succeeded(backend);
+  } else {
+    bud_backend_addr_failed(backend, &backend->addr);
+    bud_backend_failed(backend);
+  }
+
+  uv_close((uv_handle_t*) &backend->health_tcp, bud_backend_health_close_cb);
+  backend->health_state = BUD_HEALTH_CLOSING;
+}
+
+
+void bud_backend_health_close_cb(uv_handle_t* handle) {
+  bud_backend_t* backend;
+
+  backend = handle->data;
+  backend->health_state = BUD_HEALTH_IDLE;
+}
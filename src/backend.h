@@ -0,0 +1,200 @@
+#ifndef SRC_BACKEND_H_
+#define SRC_BACKEND_H_
+
+#include <stdint.h>  /* uint16_t, uint32_t, uint64_t */
+#include <sys/socket.h>  /* sockaddr_storage */
+
+#include "uv.h"
+#include "openssl/ssl.h"
+#include "parson.h"
+
+#include "backend-pool.h"
+#include "error.h"
+#include "metrics.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+/* Addresses kept per hostname, see `backend.resolve_interval` */
+#define BUD_BACKEND_MAX_ADDRS 8
+
+/* Address that has failed to connect is tried last for that long (ms) */
+#define BUD_BACKEND_ADDR_BACKOFF 10000
+
+typedef struct bud_backend_s bud_backend_t;
+typedef struct bud_backend_list_s bud_backend_list_t;
+typedef struct bud_backend_conf_s bud_backend_conf_t;
+typedef struct bud_backend_confs_s bud_backend_confs_t;
+typedef enum bud_backend_balance_e bud_backend_balance_t;
+
+enum bud_backend_balance_e {
+  kBudBalanceRoundRobin,
+  kBudBalanceLeastConn,
+  kBudBalanceIPHash,
+  kBudBalanceSNIHash,
+  kBudBalancePeakEWMA
+};
+
+struct bud_backend_s {
+  struct bud_config_s* config;
+  const char* host;
+  uint16_t port;
+  int keepalive;
+
+  /* Protocol where backend talks first (SMTP, IMAP, ...) */
+  int server_first;
+
+  /* TLS to backend, and the last session it has given to this worker */
+  int tls;
+  SSL_SESSION* tls_session;
+
+  /* `host` is a Unix socket path, `port` and `keepalive` are ignored */
+  int is_pipe;
+
+  /* Rendezvous hash seed, derived from `host:port` */
+  uint32_t hash;
+
+  /* Clients connected (or connecting) to this backend */
+  int active;
+
+  /*
+   * "peak-ewma": latency in microseconds (connect, and first byte of the
+   * response), moving average that jumps to the peaks. `ewma_stamp` - ms
+   */
+  uint64_t ewma;
+  uint64_t ewma_stamp;
+
+  /* Row of `metrics.breakdown`, looked up on the first connect */
+  bud_metrics_row_t* metrics_row;
+
+  /* Passive ejection and health state */
+  int fails;
+  uint64_t dead_until;
+
+  /* Active health check */
+  uv_timer_t health_timer;
+  union {
+    uv_tcp_t health_tcp;
+    uv_pipe_t health_pipe;
+  };
+  uv_connect_t health_req;
+  int health_init;
+  int health_state;
+
+  /* Pre-connected idle connections */
+  bud_backend_pool_t pool;
+
+  /* Not an IP address, looked up again every `backend.resolve_interval` */
+  int is_name;
+  uv_getaddrinfo_t resolver;
+  int resolving;
+
+  /*
+   * Connect to an address is attempted after the others until its
+   * `retry_at`, 0 - healthy. `addr` is `addrs[addr_index]`, the one that
+   * connected last, pool and health checks use it
+   */
+  struct sockaddr_storage addrs[BUD_BACKEND_MAX_ADDRS];
+  uint64_t retry_at[BUD_BACKEND_MAX_ADDRS];
+  int addr_count;
+  int addr_index;
+
+  /* internal */
+  struct sockaddr_storage addr;
+};
+
+/* Entry of `backends`, unset fields are -1 (NULL) and come from `backend` */
+struct bud_backend_conf_s {
+  const char* host;
+  int port;
+  int keepalive;
+  int server_first;
+  int tls;
+};
+
+/* Flat list of them, in the config's arena */
+struct bud_backend_confs_s {
+  int count;
+  bud_backend_conf_t items[1];
+};
+
+struct bud_backend_list_s {
+  bud_backend_t* list;
+  int count;
+
+  /* Round-robin position */
+  int last;
+
+  /* Hosts are copied, the JSON they came from is gone (SNI responses) */
+  int copy;
+};
+
+/*
+ * Parse `backends` and resolve addresses of the global list and of the
+ * static contexts. Global list is just a `backend` if there are no `backends`
+ */
+bud_error_t bud_backends_init(struct bud_config_s* config);
+
+/*
+ * Start active health checks, if `backend.health_check.interval` is set, and
+ * fill connection pools, if `backend.pool.max_idle` is set
+ */
+bud_error_t bud_backends_start(struct bud_config_s* config);
+
+/* Close health check and pool handles, must be followed by `uv_run` */
+void bud_backends_finalize(struct bud_config_s* config);
+void bud_backends_free(struct bud_config_s* config);
+
+/* `host` points into `obj` */
+bud_error_t bud_backend_conf_read(const JSON_Object* obj,
+                                  bud_backend_conf_t* conf);
+
+/* Backends of a single context, `copy` - if `confs` won't outlive the list */
+bud_error_t bud_backend_list_init(struct bud_config_s* config,
+                                  bud_backend_list_t* list,
+                                  const bud_backend_confs_t* confs,
+                                  int copy);
+
+/* Same for `backends` of the SNI response, hosts are copied */
+bud_error_t bud_backend_list_init_json(struct bud_config_s* config,
+                                       bud_backend_list_t* list,
+                                       const JSON_Array* json);
+void bud_backend_list_free(bud_backend_list_t* list);
+
+/*
+ * Pick a backend for a new connection. `key` is either peer address or
+ * servername, for hash-based policies. Dead backends are skipped, unless all
+ * of them are dead.
+ */
+bud_backend_t* bud_backend_select(struct bud_config_s* config,
+                                  bud_backend_list_t* list,
+                                  const char* key,
+                                  size_t key_len);
+
+/* All backends of the list are ejected by `backend.health_check` */
+int bud_backend_list_down(struct bud_config_s* config,
+                          bud_backend_list_t* list);
+
+/* Outcome of connection to the backend */
+void bud_backend_failed(bud_backend_t* backend);
+void bud_backend_succeeded(bud_backend_t* backend);
+
+/*
+ * Addresses in the order of connect attempts (RFC 8305): `addr` first, then
+ * the others with the families interleaved, recently failed ones last.
+ * Returns their count, at least one
+ */
+int bud_backend_addrs(bud_backend_t* backend,
+                      struct sockaddr_storage* out,
+                      int max);
+
+/* Outcome of connection to one of the addresses */
+void bud_backend_addr_failed(bud_backend_t* backend,
+                             const struct sockaddr_storage* addr);
+void bud_backend_addr_succeeded(bud_backend_t* backend,
+                                const struct sockaddr_storage* addr);
+
+/* Latency sample of "peak-ewma" balancing, in microseconds */
+void bud_backend_observe(bud_backend_t* backend, uint64_t latency);
+
+#endif  /* SRC_BACKEND_H_ */
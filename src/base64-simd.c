@@ -0,0 +1,445 @@
+#include <stdint.h>  /* uint8_t */
+#include <stdlib.h>  /* size_t, NULL */
+
+#include "base64-simd.h"
+
+/*
+ * x86 kernels are compiled with function-level `target` attributes, so the
+ * rest of bud keeps the baseline ISA and the choice is made by `cpuid`.
+ */
+#if (defined(__x86_64__) || defined(__i386__)) &&                             \
+    (defined(__clang__) ||                                                    \
+     (defined(__GNUC__) &&                                                    \
+      (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+# define BUD_BASE64_X86 1
+# include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+# define BUD_BASE64_NEON 1
+# include <arm_neon.h>
+#endif
+
+typedef size_t (*bud_base64_encode_cb)(const char* src,
+                                       size_t slen,
+                                       char* dst);
+typedef size_t (*bud_base64_decode_cb)(char* dst,
+                                       size_t dlen,
+                                       const char* src,
+                                       size_t slen,
+                                       size_t* consumed);
+
+#ifdef BUD_BASE64_X86
+static void bud_base64_simd_select();
+static size_t bud_base64_encode_ssse3(const char* src, size_t slen, char* dst);
+static size_t bud_base64_encode_avx2(const char* src, size_t slen, char* dst);
+static size_t bud_base64_decode_ssse3(char* dst,
+                                      size_t dlen,
+                                      const char* src,
+                                      size_t slen,
+                                      size_t* consumed);
+static size_t bud_base64_decode_avx2(char* dst,
+                                     size_t dlen,
+                                     const char* src,
+                                     size_t slen,
+                                     size_t* consumed);
+
+/* NULL, until the first call - no suitable instruction set */
+static int bud_base64_simd_selected;
+static bud_base64_encode_cb bud_base64_encode_impl;
+static bud_base64_decode_cb bud_base64_decode_impl;
+#endif  /* BUD_BASE64_X86 */
+
+#ifdef BUD_BASE64_NEON
+static size_t bud_base64_encode_neon(const char* src, size_t slen, char* dst);
+static size_t bud_base64_decode_neon(char* dst,
+                                     size_t dlen,
+                                     const char* src,
+                                     size_t slen,
+                                     size_t* consumed);
+#endif  /* BUD_BASE64_NEON */
+
+
+size_t bud_base64_encode_simd(const char* src, size_t slen, char* dst) {
+#if defined(BUD_BASE64_X86)
+  if (!bud_base64_simd_selected)
+    bud_base64_simd_select();
+  if (bud_base64_encode_impl == NULL)
+    return 0;
+  return bud_base64_encode_impl(src, slen, dst);
+#elif defined(BUD_BASE64_NEON)
+  return bud_base64_encode_neon(src, slen, dst);
+#else
+  return 0;
+#endif
+}
+
+
+size_t bud_base64_decode_simd(char* dst,
+                              size_t dlen,
+                              const char* src,
+                              size_t slen,
+                              size_t* consumed) {
+#if defined(BUD_BASE64_X86)
+  if (!bud_base64_simd_selected)
+    bud_base64_simd_select();
+  if (bud_base64_decode_impl == NULL) {
+    *consumed = 0;
+    return 0;
+  }
+  return bud_base64_decode_impl(dst, dlen, src, slen, consumed);
+#elif defined(BUD_BASE64_NEON)
+  return bud_base64_decode_neon(dst, dlen, src, slen, consumed);
+#else
+  *consumed = 0;
+  return 0;
+#endif
+}
+
+
+#ifdef BUD_BASE64_X86
+
+/* Racing threads would pick the same functions, so no locking here */
+void bud_base64_simd_select() {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    bud_base64_encode_impl = bud_base64_encode_avx2;
+    bud_base64_decode_impl = bud_base64_decode_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    bud_base64_encode_impl = bud_base64_encode_ssse3;
+    bud_base64_decode_impl = bud_base64_decode_ssse3;
+  }
+  bud_base64_simd_selected = 1;
+}
+
+
+/*
+ * Encoding, per 12 input bytes: spread each 3 bytes into a 32-bit lane,
+ * split them into four 6-bit indices with multiplies (W. Mula's method) and
+ * translate indices to ASCII by adding per-range offset from `shift_lut`.
+ */
+#define BUD_BASE64_ENC_SPLIT(in, V, W)                                        \
+    do {                                                                      \
+      __m##W##i t0;                                                           \
+      __m##W##i t1;                                                           \
+      t0 = _mm##V##_and_si##W(in, _mm##V##_set1_epi32(0x0fc0fc00));           \
+      t0 = _mm##V##_mulhi_epu16(t0, _mm##V##_set1_epi32(0x04000040));         \
+      t1 = _mm##V##_and_si##W(in, _mm##V##_set1_epi32(0x003f03f0));           \
+      t1 = _mm##V##_mullo_epi16(t1, _mm##V##_set1_epi32(0x01000010));         \
+      in = _mm##V##_or_si##W(t0, t1);                                         \
+    } while (0)
+
+#define BUD_BASE64_ENC_ASCII(in, lut, V, W)                                   \
+    do {                                                                      \
+      __m##W##i r;                                                            \
+      __m##W##i less;                                                         \
+      r = _mm##V##_subs_epu8(in, _mm##V##_set1_epi8(51));                     \
+      less = _mm##V##_cmpgt_epi8(_mm##V##_set1_epi8(26), in);                 \
+      r = _mm##V##_or_si##W(r,                                                \
+                            _mm##V##_and_si##W(less,                          \
+                                               _mm##V##_set1_epi8(13)));      \
+      in = _mm##V##_add_epi8(_mm##V##_shuffle_epi8(lut, r), in);              \
+    } while (0)
+
+
+__attribute__((target("ssse3")))
+size_t bud_base64_encode_ssse3(const char* src, size_t slen, char* dst) {
+  size_t i;
+  __m128i in;
+  __m128i spread;
+  __m128i lut;
+
+  spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                      '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+  /* Loads 16 bytes, uses 12 */
+  for (i = 0; i + 16 <= slen; i += 12, dst += 16) {
+    in = _mm_loadu_si128((const __m128i*) (src + i));
+    in = _mm_shuffle_epi8(in, spread);
+    BUD_BASE64_ENC_SPLIT(in, , 128);
+    BUD_BASE64_ENC_ASCII(in, lut, , 128);
+    _mm_storeu_si128((__m128i*) dst, in);
+  }
+
+  return i;
+}
+
+
+__attribute__((target("avx2")))
+size_t bud_base64_encode_avx2(const char* src, size_t slen, char* dst) {
+  size_t i;
+  __m256i in;
+  __m256i spread;
+  __m256i lut;
+
+  spread = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                            1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                         '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0,
+                         'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                         '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                         '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+  /* 12 bytes in each 128-bit lane, the second load reads 16 at `i + 12` */
+  for (i = 0; i + 28 <= slen; i += 24, dst += 32) {
+    in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (src + i))),
+        _mm_loadu_si128((const __m128i*) (src + i + 12)),
+        1);
+    in = _mm256_shuffle_epi8(in, spread);
+    BUD_BASE64_ENC_SPLIT(in, 256, 256);
+    BUD_BASE64_ENC_ASCII(in, lut, 256, 256);
+    _mm256_storeu_si256((__m256i*) dst, in);
+  }
+
+  /* Up to 27 bytes left, let SSSE3 take another group if it can */
+  return i + bud_base64_encode_ssse3(src + i, slen - i, dst);
+}
+
+
+/*
+ * Decoding, per 16 characters: map every character to its 6-bit value by
+ * ranges (both `+/` and `-_` are accepted), bail out if any of them is not
+ * in the alphabet, then pack four values into three bytes with
+ * multiply-adds and compact the lanes with a shuffle.
+ */
+#define BUD_BASE64_IN_RANGE(in, lo, hi, V, W)                                 \
+    _mm##V##_and_si##W(                                                       \
+        _mm##V##_cmpgt_epi8(in, _mm##V##_set1_epi8((lo) - 1)),                \
+        _mm##V##_cmpgt_epi8(_mm##V##_set1_epi8((hi) + 1), in))
+
+#define BUD_BASE64_IS(in, a, b, V, W)                                         \
+    _mm##V##_or_si##W(_mm##V##_cmpeq_epi8(in, _mm##V##_set1_epi8(a)),         \
+                      _mm##V##_cmpeq_epi8(in, _mm##V##_set1_epi8(b)))
+
+#define BUD_BASE64_DEC_VALUES(in, valid, V, W)                                \
+    do {                                                                      \
+      __m##W##i upper;                                                        \
+      __m##W##i lower;                                                        \
+      __m##W##i digit;                                                        \
+      __m##W##i plus;                                                         \
+      __m##W##i slash;                                                        \
+      __m##W##i shift;                                                        \
+      upper = BUD_BASE64_IN_RANGE(in, 'A', 'Z', V, W);                        \
+      lower = BUD_BASE64_IN_RANGE(in, 'a', 'z', V, W);                        \
+      digit = BUD_BASE64_IN_RANGE(in, '0', '9', V, W);                        \
+      plus = BUD_BASE64_IS(in, '+', '-', V, W);                               \
+      slash = BUD_BASE64_IS(in, '/', '_', V, W);                              \
+      valid = _mm##V##_or_si##W(_mm##V##_or_si##W(upper, lower),              \
+                                _mm##V##_or_si##W(digit,                      \
+                                                  _mm##V##_or_si##W(plus,     \
+                                                                    slash))); \
+      shift = _mm##V##_or_si##W(                                              \
+          _mm##V##_and_si##W(upper, _mm##V##_set1_epi8(-'A')),                \
+          _mm##V##_or_si##W(                                                  \
+              _mm##V##_and_si##W(lower, _mm##V##_set1_epi8(26 - 'a')),        \
+              _mm##V##_and_si##W(digit, _mm##V##_set1_epi8(52 - '0'))));      \
+      in = _mm##V##_add_epi8(in, shift);                                      \
+      in = _mm##V##_andnot_si##W(_mm##V##_or_si##W(plus, slash), in);         \
+      in = _mm##V##_or_si##W(                                                 \
+          in,                                                                 \
+          _mm##V##_or_si##W(                                                  \
+              _mm##V##_and_si##W(plus, _mm##V##_set1_epi8(62)),               \
+              _mm##V##_and_si##W(slash, _mm##V##_set1_epi8(63))));            \
+    } while (0)
+
+#define BUD_BASE64_DEC_PACK(in, V)                                            \
+    do {                                                                      \
+      in = _mm##V##_maddubs_epi16(in, _mm##V##_set1_epi32(0x01400140));       \
+      in = _mm##V##_madd_epi16(in, _mm##V##_set1_epi32(0x00011000));          \
+    } while (0)
+
+
+__attribute__((target("ssse3")))
+size_t bud_base64_decode_ssse3(char* dst,
+                               size_t dlen,
+                               const char* src,
+                               size_t slen,
+                               size_t* consumed) {
+  size_t i;
+  size_t j;
+  __m128i in;
+  __m128i valid;
+  __m128i compact;
+
+  compact = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                          -1, -1, -1, -1);
+
+  /* Stores 16 bytes, 12 of them are meaningful */
+  for (i = 0, j = 0; i + 16 <= slen && j + 16 <= dlen; i += 16, j += 12) {
+    in = _mm_loadu_si128((const __m128i*) (src + i));
+    BUD_BASE64_DEC_VALUES(in, valid, , 128);
+    if (_mm_movemask_epi8(valid) != 0xffff)
+      break;
+    BUD_BASE64_DEC_PACK(in, );
+    in = _mm_shuffle_epi8(in, compact);
+    _mm_storeu_si128((__m128i*) (dst + j), in);
+  }
+
+  *consumed = i;
+  return j;
+}
+
+
+__attribute__((target("avx2")))
+size_t bud_base64_decode_avx2(char* dst,
+                              size_t dlen,
+                              const char* src,
+                              size_t slen,
+                              size_t* consumed) {
+  size_t i;
+  size_t j;
+  size_t tail;
+  size_t tail_consumed;
+  __m256i in;
+  __m256i valid;
+  __m256i compact;
+  __m256i lanes;
+
+  compact = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                             -1, -1, -1, -1,
+                             2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12,
+                             -1, -1, -1, -1);
+  lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1);
+
+  /* Stores 32 bytes, 24 of them are meaningful */
+  for (i = 0, j = 0; i + 32 <= slen && j + 32 <= dlen; i += 32, j += 24) {
+    in = _mm256_loadu_si256((const __m256i*) (src + i));
+    BUD_BASE64_DEC_VALUES(in, valid, 256, 256);
+    if (_mm256_movemask_epi8(valid) != -1)
+      break;
+    BUD_BASE64_DEC_PACK(in, 256);
+    in = _mm256_shuffle_epi8(in, compact);
+    in = _mm256_permutevar8x32_epi32(in, lanes);
+    _mm256_storeu_si256((__m256i*) (dst + j), in);
+  }
+
+  /* Less than 32 characters (or a bad group) left, try 16 at once */
+  tail = bud_base64_decode_ssse3(dst + j,
+                                 dlen - j,
+                                 src + i,
+                                 slen - i,
+                                 &tail_consumed);
+  *consumed = i + tail_consumed;
+  return j + tail;
+}
+
+#undef BUD_BASE64_ENC_SPLIT
+#undef BUD_BASE64_ENC_ASCII
+#undef BUD_BASE64_IN_RANGE
+#undef BUD_BASE64_IS
+#undef BUD_BASE64_DEC_VALUES
+#undef BUD_BASE64_DEC_PACK
+
+#endif  /* BUD_BASE64_X86 */
+
+
+#ifdef BUD_BASE64_NEON
+
+/* NEON is mandatory on aarch64, no dispatch needed */
+size_t bud_base64_encode_neon(const char* src, size_t slen, char* dst) {
+  static const uint8_t table[64] = {
+    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M', 'N',
+    'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
+    'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
+    'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
+    '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '+', '/'
+  };
+  size_t i;
+  uint8x16x4_t lut;
+  uint8x16x3_t in;
+  uint8x16x4_t out;
+  uint8x16_t mask;
+
+  lut.val[0] = vld1q_u8(table);
+  lut.val[1] = vld1q_u8(table + 16);
+  lut.val[2] = vld1q_u8(table + 32);
+  lut.val[3] = vld1q_u8(table + 48);
+  mask = vdupq_n_u8(0x3f);
+
+  /* vld3 de-interleaves 48 bytes, vst4 interleaves 64 characters */
+  for (i = 0; i + 48 <= slen; i += 48, dst += 64) {
+    in = vld3q_u8((const uint8_t*) (src + i));
+    out.val[0] = vshrq_n_u8(in.val[0], 2);
+    out.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[0], 4),
+                                   vshrq_n_u8(in.val[1], 4)),
+                          mask);
+    out.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(in.val[1], 2),
+                                   vshrq_n_u8(in.val[2], 6)),
+                          mask);
+    out.val[3] = vandq_u8(in.val[2], mask);
+    out.val[0] = vqtbl4q_u8(lut, out.val[0]);
+    out.val[1] = vqtbl4q_u8(lut, out.val[1]);
+    out.val[2] = vqtbl4q_u8(lut, out.val[2]);
+    out.val[3] = vqtbl4q_u8(lut, out.val[3]);
+    vst4q_u8((uint8_t*) dst, out);
+  }
+
+  return i;
+}
+
+
+size_t bud_base64_decode_neon(char* dst,
+                              size_t dlen,
+                              const char* src,
+                              size_t slen,
+                              size_t* consumed) {
+  size_t i;
+  size_t j;
+  int k;
+  uint8x16x4_t in;
+  uint8x16x3_t out;
+  uint8x16_t c;
+  uint8x16_t upper;
+  uint8x16_t lower;
+  uint8x16_t digit;
+  uint8x16_t plus;
+  uint8x16_t slash;
+  uint8x16_t valid;
+
+  for (i = 0, j = 0; i + 64 <= slen && j + 48 <= dlen; i += 64, j += 48) {
+    in = vld4q_u8((const uint8_t*) (src + i));
+
+    valid = vdupq_n_u8(0xff);
+    for (k = 0; k < 4; k++) {
+      c = in.val[k];
+
+      /* Unsigned wrap-around turns every range check into one compare */
+      upper = vcltq_u8(vsubq_u8(c, vdupq_n_u8('A')), vdupq_n_u8(26));
+      lower = vcltq_u8(vsubq_u8(c, vdupq_n_u8('a')), vdupq_n_u8(26));
+      digit = vcltq_u8(vsubq_u8(c, vdupq_n_u8('0')), vdupq_n_u8(10));
+      plus = vorrq_u8(vceqq_u8(c, vdupq_n_u8('+')),
+                      vceqq_u8(c, vdupq_n_u8('-')));
+      slash = vorrq_u8(vceqq_u8(c, vdupq_n_u8('/')),
+                       vceqq_u8(c, vdupq_n_u8('_')));
+      valid = vandq_u8(valid,
+                       vorrq_u8(vorrq_u8(upper, lower),
+                                vorrq_u8(digit, vorrq_u8(plus, slash))));
+
+      c = vaddq_u8(c,
+                   vorrq_u8(vandq_u8(upper, vdupq_n_u8((uint8_t) -'A')),
+                            vorrq_u8(vandq_u8(lower,
+                                              vdupq_n_u8(26 - 'a')),
+                                     vandq_u8(digit,
+                                              vdupq_n_u8(52 - '0')))));
+      c = vbslq_u8(plus, vdupq_n_u8(62), c);
+      c = vbslq_u8(slash, vdupq_n_u8(63), c);
+      in.val[k] = c;
+    }
+    if (vminvq_u8(valid) != 0xff)
+      break;
+
+    out.val[0] = vorrq_u8(vshlq_n_u8(in.val[0], 2),
+                          vshrq_n_u8(in.val[1], 4));
+    out.val[1] = vorrq_u8(vshlq_n_u8(in.val[1], 4),
+                          vshrq_n_u8(in.val[2], 2));
+    out.val[2] = vorrq_u8(vshlq_n_u8(in.val[2], 6), in.val[3]);
+    vst3q_u8((uint8_t*) (dst + j), out);
+  }
+
+  *consumed = i;
+  return j;
+}
+
+#endif  /* BUD_BASE64_NEON */
@@ -0,0 +1,32 @@
+#ifndef SRC_BASE64_SIMD_H_
+#define SRC_BASE64_SIMD_H_
+
+#include <stdlib.h>  /* size_t */
+
+/*
+ * Vector kernels behind `bud_base64_encode()`/`bud_base64_decode()`, picked
+ * once at runtime (AVX2, SSSE3 or NEON). Both handle only the bulk of the
+ * input and leave the tail to the scalar code in common.c, returning 0 when
+ * there is no suitable instruction set.
+ */
+
+/*
+ * Encode whole 3-byte groups from `src`, `dst` must have room for
+ * `bud_base64_encoded_size(slen)` bytes. Returns number of `src` bytes
+ * consumed, always a multiple of 3.
+ */
+size_t bud_base64_encode_simd(const char* src, size_t slen, char* dst);
+
+/*
+ * Decode leading run of 4-character groups that contain only alphabet
+ * characters (regular or URL-safe), stopping before the first group with
+ * padding, whitespace or garbage. Never writes past `dst + dlen`. Returns
+ * number of bytes written, `*consumed` is set to number of `src` bytes read.
+ */
+size_t bud_base64_decode_simd(char* dst,
+                              size_t dlen,
+                              const char* src,
+                              size_t slen,
+                              size_t* consumed);
+
+#endif  /* SRC_BASE64_SIMD_H_ */
@@ -44,6 +44,12 @@ ringbuffer* bud_bio_get_buffer(BIO* bio) {
 }
 
 
+void bud_bio_set_buffer(BIO* bio, ringbuffer* buffer) {
+  bio->ptr = buffer;
+  BIO_clear_retry_flags(bio);
+}
+
+
 int bud_bio_init(BIO* bio) {
   bio->shutdown = 1;
   bio->init = 1;
@@ -67,6 +73,18 @@ int bud_bio_write(BIO* bio, const char* data, int len) {
 
   buffer = bio->ptr;
 
+  /*
+   * Hard cap at the buffer's `max_size`, so that a slow reader can't make
+   * SSL_write() allocate chunks without limit. OpenSSL keeps the record
+   * and retries it once the output drains. Empty buffer takes any record,
+   * otherwise a flight bigger than the cap would never be written.
+   */
+  if (!ringbuffer_is_empty(buffer) &&
+      ringbuffer_size(buffer) + (size_t) len > buffer->max_size) {
+    BIO_set_retry_write(bio);
+    return -1;
+  }
+
   if (ringbuffer_write_into(buffer, data, len) == 0)
     return len;
 
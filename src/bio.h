@@ -7,4 +7,7 @@
 BIO* bud_bio_new();
 ringbuffer* bud_bio_get_buffer(BIO* bio);
 
+/* Point BIO of a recycled SSL at the new client's buffer */
+void bud_bio_set_buffer(BIO* bio, ringbuffer* buffer);
+
 #endif  /* SRC_BIO_H_ */
@@ -1,12 +1,15 @@
 #include <stdio.h>  /* stderr */
 #include <stdlib.h>  /* NULL */
 
+#include "openssl/engine.h"
 #include "openssl/ssl.h"
 #include "openssl/err.h"
 
 #include "config.h"
+#include "memstat.h"
 #include "server.h"
 #include "master.h"
+#include "threads.h"
 #include "worker.h"
 
 static void bud_init_openssl();
@@ -16,6 +19,8 @@ int main(int argc, char** argv) {
   bud_config_t* config;
   bud_error_t err;
 
+  /* OpenSSL hooks can't be installed once it has allocated anything */
+  bud_mem_init();
   bud_init_openssl();
 
   config = bud_config_cli_load(uv_default_loop(), argc, argv, &err);
@@ -32,12 +37,15 @@ int main(int argc, char** argv) {
   if (bud_is_ok(err))
     uv_run(config->loop, UV_RUN_DEFAULT);
 
-  /* Finalize server */
-  if (config->server != NULL) {
-    if (!config->is_worker)
-      err = bud_master_finalize(config);
-    bud_server_free(config);
-  }
+  /* Let the other event loops finish their clients */
+  bud_threads_stop(config);
+
+  /* Finalize master, it may not have a server in reuseport mode */
+  if (!config->is_worker && bud_is_ok(err))
+    err = bud_master_finalize(config);
+
+  /* Finalize servers */
+  bud_server_free(config);
 
   uv_run(config->loop, UV_RUN_ONCE);
 
@@ -59,4 +67,5 @@ void bud_init_openssl() {
   OpenSSL_add_all_digests();
   SSL_load_error_strings();
   ERR_load_crypto_strings();
+  ENGINE_load_builtin_engines();
 }
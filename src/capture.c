@@ -0,0 +1,193 @@
+#include <errno.h>  /* errno */
+#include <fcntl.h>  /* open, O_* */
+#include <stdio.h>  /* snprintf */
+#include <string.h>  /* memcpy, memset */
+#include <unistd.h>  /* write, close */
+
+#include "uv.h"
+#include "openssl/ssl.h"
+
+#include "capture.h"
+#include "client.h"
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+
+static void bud_capture_token(char* out,
+                              size_t size,
+                              const char* str,
+                              size_t len);
+static size_t bud_capture_hello(bud_client_t* client,
+                                char* out,
+                                size_t size);
+
+
+bud_error_t bud_capture_init(bud_config_t* config) {
+  config->capture_fd = -1;
+  config->capture_seq = 0;
+  if (config->log.capture.path == NULL || config->log.capture.sample <= 0)
+    return bud_ok();
+
+  config->capture_fd = open(config->log.capture.path,
+                            O_WRONLY | O_APPEND | O_CREAT,
+                            0600);
+  if (config->capture_fd == -1)
+    return bud_error_num(kBudErrCaptureOpen, errno);
+  return bud_ok();
+}
+
+
+void bud_capture_free(bud_config_t* config) {
+  if (config->capture_fd != -1)
+    close(config->capture_fd);
+  config->capture_fd = -1;
+}
+
+
+/* Printable, without spaces, `-` if empty */
+void bud_capture_token(char* out,
+                       size_t size,
+                       const char* str,
+                       size_t len) {
+  size_t i;
+
+  if (len > size - 1)
+    len = size - 1;
+  for (i = 0; i < len; i++)
+    out[i] = (str[i] < 0x21 || str[i] > 0x7e) ? '?' : str[i];
+  if (len == 0)
+    out[len++] = '-';
+  out[len] = '\0';
+}
+
+
+size_t bud_capture_hello(bud_client_t* client, char* out, size_t size) {
+  static const char hex[] = "0123456789abcdef";
+  const unsigned char* msg;
+  size_t msg_len;
+  size_t i;
+  unsigned char c;
+  const char* session;
+  const char* ticket;
+
+  msg = (const unsigned char*) client->hs->hello_parser.msg;
+  msg_len = client->hs->hello_parser.msg_len;
+  if (!client->hs->hello_parser.done ||
+      msg == NULL ||
+      msg_len > BUD_CAPTURE_MAX_HELLO ||
+      msg_len * 2 + 1 > size) {
+    out[0] = '-';
+    out[1] = '\0';
+    return 1;
+  }
+
+  session = client->hs->hello.session;
+  ticket = client->hs->hello.ticket;
+  for (i = 0; i < msg_len; i++) {
+    c = msg[i];
+
+    /* Header (4), version (2), then 32 bytes of random */
+    if (i >= 6 && i < 6 + 32)
+      c = 0;
+    else if (session != NULL &&
+             (const char*) msg + i >= session &&
+             (const char*) msg + i < session + client->hs->hello.session_len)
+      c = 0;
+    else if (ticket != NULL &&
+             (const char*) msg + i >= ticket &&
+             (const char*) msg + i < ticket + client->hs->hello.ticket_len)
+      c = 0;
+
+    out[i * 2] = hex[c >> 4];
+    out[i * 2 + 1] = hex[c & 0xf];
+  }
+  out[msg_len * 2] = '\0';
+  return msg_len * 2;
+}
+
+
+void bud_capture_client(bud_client_t* client) {
+  bud_config_t* config;
+  char line[BUD_CAPTURE_MAX_HELLO * 2 + 512];
+  char servername[256];
+  char alpn[64];
+  const char* offer;
+  const char* result;
+  uint64_t now;
+  uint64_t handshake;
+  uint64_t upload;
+  uint64_t download;
+  int r;
+  size_t len;
+
+  config = client->config;
+  if (config->capture_fd == -1 || client->ssl == NULL || client->hs == NULL)
+    return;
+  if (++config->capture_seq % config->log.capture.sample != 0)
+    return;
+
+  bud_capture_token(servername,
+                    sizeof(servername),
+                    client->hs->hello.servername,
+                    client->hs->hello.servername_len);
+
+  /* Protocol names are length-prefixed */
+  if (client->hs->hello.alpn_len > 1 &&
+      (size_t) (unsigned char) client->hs->hello.alpn[0] <
+          client->hs->hello.alpn_len) {
+    bud_capture_token(alpn,
+                      sizeof(alpn),
+                      client->hs->hello.alpn + 1,
+                      (unsigned char) client->hs->hello.alpn[0]);
+  } else {
+    bud_capture_token(alpn, sizeof(alpn), NULL, 0);
+  }
+
+  if (client->hs->hello.ticket_len != 0)
+    offer = "ticket";
+  else if (client->hs->hello.session_len != 0)
+    offer = "id";
+  else
+    offer = "none";
+
+  handshake = 0;
+  upload = 0;
+  download = 0;
+  if (client->stats.handshake == 0) {
+    result = "failed";
+  } else {
+    result = SSL_session_reused(client->ssl) ? "resumed" : "full";
+    handshake = client->stats.handshake - client->stats.accept;
+    upload = client->stats.bytes_in - client->stats.handshake_in;
+    download = client->stats.bytes_out - client->stats.handshake_out;
+  }
+
+  now = uv_now(config->loop);
+  r = snprintf(line,
+               sizeof(line),
+               "%llu %s %s %s %d %s %llu %llu %llu %llu ",
+               (unsigned long long) client->stats.accept,
+               servername,
+               offer,
+               alpn,
+               client->hs->hello.ocsp_request ? 1 : 0,
+               result,
+               (unsigned long long) handshake,
+               (unsigned long long) upload,
+               (unsigned long long) download,
+               (unsigned long long) (now - client->stats.accept));
+  if (r < 0 || (size_t) r >= sizeof(line))
+    return;
+
+  len = r;
+  len += bud_capture_hello(client, line + len, sizeof(line) - len - 1);
+  line[len++] = '\n';
+
+  /* One write per line, O_APPEND keeps the lines of the processes whole */
+  if (write(config->capture_fd, line, len) != (ssize_t) len) {
+    bud_log(config,
+            kBudLogWarning,
+            "failed to write capture, errno: %d",
+            errno);
+  }
+}
@@ -0,0 +1,37 @@
+#ifndef SRC_CAPTURE_H_
+#define SRC_CAPTURE_H_
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+struct bud_client_s;
+
+/* Longest ClientHello that is recorded, longer ones are written as `-` */
+#define BUD_CAPTURE_MAX_HELLO 4096
+
+/*
+ * `log.capture`: a line per sampled connection, appended by every process
+ * at close, for `bud-bench-replay`. Space-separated fields:
+ *
+ *   accept        monotonic ms, only differences between lines matter
+ *   servername    `-` if none
+ *   offer         `none`, `id` or `ticket` - resumption the client tried
+ *   alpn          first protocol offered, `-` if none
+ *   ocsp          1 if the staple was requested
+ *   result        `full`, `resumed` or `failed`
+ *   handshake     ms from accept to the handshake done, 0 if failed
+ *   upload        frontend bytes received after the handshake
+ *   download      frontend bytes sent after the handshake
+ *   duration      ms from accept to close
+ *   hello         hex of the ClientHello message, `-` if not parsed
+ *
+ * Peer address is not recorded. Random, session id and ticket bytes of the
+ * hello are zeroed, lengths are kept.
+ */
+bud_error_t bud_capture_init(struct bud_config_s* config);
+void bud_capture_free(struct bud_config_s* config);
+
+void bud_capture_client(struct bud_client_s* client);
+
+#endif  /* SRC_CAPTURE_H_ */
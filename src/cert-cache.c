@@ -0,0 +1,307 @@
+#include <stdlib.h>  /* calloc, malloc, free */
+#include <string.h>  /* memcmp, memcpy */
+
+#include "openssl/asn1.h"
+#include "openssl/crypto.h"
+#include "openssl/evp.h"
+#include "openssl/ocsp.h"
+#include "openssl/sha.h"
+#include "openssl/x509.h"
+#include "openssl/x509v3.h"
+
+#include "cert-cache.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+#include "memstat.h"
+
+static bud_cert_entry_t** bud_cert_cache_find(bud_cert_cache_t* cache,
+                                              bud_cert_kind_t kind,
+                                              const unsigned char* digest);
+static void bud_cert_x509_digest(X509* x, unsigned char* digest);
+static int bud_cert_entry_refs(bud_cert_entry_t* entry);
+static void bud_cert_entry_free(bud_cert_entry_t* entry);
+static void bud_cert_cache_sweep(bud_cert_cache_t* cache);
+static void bud_cert_cache_insert(bud_cert_cache_t* cache,
+                                  bud_cert_entry_t** pentry,
+                                  bud_cert_kind_t kind,
+                                  const unsigned char* digest,
+                                  void* obj);
+
+
+bud_cert_cache_t* bud_cert_cache_new(bud_config_t* config, bud_error_t* err) {
+  bud_cert_cache_t* cache;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_cert_cache_t");
+    return NULL;
+  }
+
+  cache->config = config;
+  cache->max = config->sni.cache.certs;
+
+  /* Power of two, not less than the max count */
+  cache->bucket_count = 16;
+  while (cache->bucket_count < (uint32_t) cache->max)
+    cache->bucket_count <<= 1;
+  cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+  if (cache->buckets == NULL) {
+    free(cache);
+    *err = bud_error_str(kBudErrNoMem, "bud_cert_cache_t buckets");
+    return NULL;
+  }
+
+  *err = bud_ok();
+  return cache;
+}
+
+
+void bud_cert_cache_free(bud_cert_cache_t* cache) {
+  uint32_t i;
+  bud_cert_entry_t* entry;
+
+  bud_log(cache->config,
+          kBudLogDebug,
+          "cert cache hits: %llu misses: %llu",
+          (unsigned long long) cache->hits,
+          (unsigned long long) cache->misses);
+
+  /* Contexts keep their own references */
+  for (i = 0; i < cache->bucket_count; i++) {
+    while (cache->buckets[i] != NULL) {
+      entry = cache->buckets[i];
+      cache->buckets[i] = entry->next;
+      bud_cert_entry_free(entry);
+    }
+  }
+  free(cache->buckets);
+  free(cache);
+}
+
+
+bud_cert_entry_t** bud_cert_cache_find(bud_cert_cache_t* cache,
+                                       bud_cert_kind_t kind,
+                                       const unsigned char* digest) {
+  bud_cert_entry_t** pentry;
+  uint32_t hash;
+
+  /* SHA-1 is as good a hash as any */
+  memcpy(&hash, digest, sizeof(hash));
+  pentry = &cache->buckets[hash & (cache->bucket_count - 1)];
+  for (; *pentry != NULL; pentry = &(*pentry)->next) {
+    if ((*pentry)->kind == kind &&
+        memcmp((*pentry)->digest, digest, SHA_DIGEST_LENGTH) == 0) {
+      break;
+    }
+  }
+
+  return pentry;
+}
+
+
+void bud_cert_x509_digest(X509* x, unsigned char* digest) {
+  /* Fills `sha1_hash` (of DER), SSL_CTX_use_certificate() does it anyway */
+  X509_check_purpose(x, -1, 0);
+  memcpy(digest, x->sha1_hash, SHA_DIGEST_LENGTH);
+}
+
+
+int bud_cert_entry_refs(bud_cert_entry_t* entry) {
+  if (entry->kind == kBudCertX509)
+    return entry->obj.x509->references;
+  else
+    return entry->obj.key->references;
+}
+
+
+void bud_cert_entry_free(bud_cert_entry_t* entry) {
+  if (entry->ocsp_id != NULL)
+    OCSP_CERTID_free(entry->ocsp_id);
+  if (entry->kind == kBudCertX509)
+    X509_free(entry->obj.x509);
+  else
+    EVP_PKEY_free(entry->obj.key);
+  bud_mem_free(entry);
+}
+
+
+void bud_cert_cache_sweep(bud_cert_cache_t* cache) {
+  uint32_t i;
+  bud_cert_entry_t** pentry;
+  bud_cert_entry_t* entry;
+
+  /* Drop everything that is referenced only by the cache */
+  for (i = 0; i < cache->bucket_count; i++) {
+    pentry = &cache->buckets[i];
+    while (*pentry != NULL) {
+      entry = *pentry;
+      if (bud_cert_entry_refs(entry) > 1) {
+        pentry = &entry->next;
+        continue;
+      }
+      *pentry = entry->next;
+      bud_cert_entry_free(entry);
+      cache->count--;
+    }
+  }
+}
+
+
+void bud_cert_cache_insert(bud_cert_cache_t* cache,
+                           bud_cert_entry_t** pentry,
+                           bud_cert_kind_t kind,
+                           const unsigned char* digest,
+                           void* obj) {
+  bud_cert_entry_t* entry;
+
+  if (cache->count >= cache->max) {
+    bud_cert_cache_sweep(cache);
+
+    /* Everything is in use, `pentry` may be gone too */
+    if (cache->count >= cache->max)
+      return;
+    pentry = bud_cert_cache_find(cache, kind, digest);
+  }
+
+  entry = bud_mem_alloc(kBudMemCaches, sizeof(*entry));
+  if (entry == NULL)
+    return;
+
+  entry->kind = kind;
+  memcpy(entry->digest, digest, sizeof(entry->digest));
+  entry->ocsp_id = NULL;
+  if (kind == kBudCertX509) {
+    entry->obj.x509 = obj;
+    CRYPTO_add(&entry->obj.x509->references, 1, CRYPTO_LOCK_X509);
+  } else {
+    entry->obj.key = obj;
+    CRYPTO_add(&entry->obj.key->references, 1, CRYPTO_LOCK_EVP_PKEY);
+  }
+  entry->next = *pentry;
+  *pentry = entry;
+  cache->count++;
+}
+
+
+X509* bud_cert_cache_x509(bud_cert_cache_t* cache,
+                          const unsigned char** der,
+                          size_t len) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  bud_cert_entry_t** pentry;
+  const unsigned char* p;
+  long body_len;
+  int tag;
+  int xclass;
+  size_t size;
+  X509* x;
+
+  /* DER is self-delimiting, hash just this certificate */
+  p = *der;
+  if (ASN1_get_object(&p, &body_len, &tag, &xclass, len) & 0x80)
+    return NULL;
+  size = (p - *der) + body_len;
+  SHA1(*der, size, digest);
+
+  pentry = bud_cert_cache_find(cache, kBudCertX509, digest);
+  if (*pentry != NULL) {
+    cache->hits++;
+    *der += size;
+    x = (*pentry)->obj.x509;
+    CRYPTO_add(&x->references, 1, CRYPTO_LOCK_X509);
+    return x;
+  }
+
+  cache->misses++;
+  p = *der;
+  x = d2i_X509(NULL, &p, size);
+  if (x == NULL)
+    return NULL;
+  *der = p;
+
+  bud_cert_cache_insert(cache, pentry, kBudCertX509, digest, x);
+  return x;
+}
+
+
+X509* bud_cert_cache_intern(bud_cert_cache_t* cache, X509* x) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  bud_cert_entry_t** pentry;
+  X509* res;
+
+  bud_cert_x509_digest(x, digest);
+  pentry = bud_cert_cache_find(cache, kBudCertX509, digest);
+  if (*pentry == NULL) {
+    cache->misses++;
+    bud_cert_cache_insert(cache, pentry, kBudCertX509, digest, x);
+    return x;
+  }
+
+  cache->hits++;
+  res = (*pentry)->obj.x509;
+  if (res != x) {
+    CRYPTO_add(&res->references, 1, CRYPTO_LOCK_X509);
+    X509_free(x);
+  }
+  return res;
+}
+
+
+OCSP_CERTID* bud_cert_cache_ocsp_id(bud_cert_cache_t* cache,
+                                    X509* cert,
+                                    X509* issuer) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  bud_cert_entry_t* entry;
+  OCSP_CERTID* id;
+
+  /* Issuer from the cert store, not one of ours */
+  bud_cert_x509_digest(issuer, digest);
+  entry = *bud_cert_cache_find(cache, kBudCertX509, digest);
+  if (entry == NULL)
+    return OCSP_cert_to_id(NULL, cert, issuer);
+
+  /* The first one hashes issuer's name and key */
+  if (entry->ocsp_id == NULL) {
+    entry->ocsp_id = OCSP_cert_to_id(NULL, cert, issuer);
+    if (entry->ocsp_id == NULL)
+      return NULL;
+  }
+
+  /* The rest only differ in serial */
+  id = OCSP_CERTID_dup(entry->ocsp_id);
+  if (id == NULL)
+    return NULL;
+  ASN1_INTEGER_free(id->serialNumber);
+  id->serialNumber = ASN1_INTEGER_dup(X509_get_serialNumber(cert));
+  if (id->serialNumber == NULL) {
+    OCSP_CERTID_free(id);
+    return NULL;
+  }
+  return id;
+}
+
+
+EVP_PKEY* bud_cert_cache_key(bud_cert_cache_t* cache,
+                             const unsigned char* der,
+                             size_t len) {
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  bud_cert_entry_t** pentry;
+  EVP_PKEY* key;
+
+  SHA1(der, len, digest);
+  pentry = bud_cert_cache_find(cache, kBudCertKey, digest);
+  if (*pentry != NULL) {
+    cache->hits++;
+    key = (*pentry)->obj.key;
+    CRYPTO_add(&key->references, 1, CRYPTO_LOCK_EVP_PKEY);
+    return key;
+  }
+
+  cache->misses++;
+  key = d2i_AutoPrivateKey(NULL, &der, len);
+  if (key == NULL)
+    return NULL;
+
+  bud_cert_cache_insert(cache, pentry, kBudCertKey, digest, key);
+  return key;
+}
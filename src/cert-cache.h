@@ -0,0 +1,88 @@
+#ifndef SRC_CERT_CACHE_H_
+#define SRC_CERT_CACHE_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t */
+#include <stdlib.h>  /* size_t */
+
+#include "openssl/evp.h"
+#include "openssl/ocsp.h"
+#include "openssl/sha.h"
+#include "openssl/x509.h"
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+
+typedef struct bud_cert_cache_s bud_cert_cache_t;
+typedef struct bud_cert_entry_s bud_cert_entry_t;
+typedef enum bud_cert_kind_e bud_cert_kind_t;
+
+enum bud_cert_kind_e {
+  kBudCertX509,
+  kBudCertKey
+};
+
+struct bud_cert_entry_s {
+  bud_cert_kind_t kind;
+  unsigned char digest[SHA_DIGEST_LENGTH];
+  union {
+    X509* x509;
+    EVP_PKEY* key;
+  } obj;
+
+  /* Certificates only: OCSP id of one of those it has issued */
+  OCSP_CERTID* ocsp_id;
+  bud_cert_entry_t* next;
+};
+
+/*
+ * DER certificates and keys parsed once per process, keyed by SHA-1 of
+ * their bytes (i.e. fingerprint). Intermediates that thousands of contexts
+ * chain to end up as one `X509` referenced by all of their SSL_CTXs.
+ * Entries no one else references any longer are dropped when the cache
+ * fills up.
+ */
+struct bud_cert_cache_s {
+  struct bud_config_s* config;
+  int max;
+  int count;
+  uint32_t bucket_count;
+  bud_cert_entry_t** buckets;
+
+  uint64_t hits;
+  uint64_t misses;
+};
+
+bud_cert_cache_t* bud_cert_cache_new(struct bud_config_s* config,
+                                     bud_error_t* err);
+void bud_cert_cache_free(bud_cert_cache_t* cache);
+
+/*
+ * Certificate at `*der` (of at most `len` bytes), `*der` is moved past it.
+ * Returns new reference, NULL - malformed.
+ */
+X509* bud_cert_cache_x509(bud_cert_cache_t* cache,
+                          const unsigned char** der,
+                          size_t len);
+
+/*
+ * Takes ownership of already parsed `x`, returns new reference to the
+ * certificate with the same fingerprint (`x` itself, if it is the first).
+ */
+X509* bud_cert_cache_intern(bud_cert_cache_t* cache, X509* x);
+
+/*
+ * OCSP id of `cert`, issuer name and key hashes are computed once per
+ * cached `issuer`. Should be OCSP_CERTID_free()'d.
+ */
+OCSP_CERTID* bud_cert_cache_ocsp_id(bud_cert_cache_t* cache,
+                                    X509* cert,
+                                    X509* issuer);
+
+/* Private key of any type, returns new reference, NULL - malformed */
+EVP_PKEY* bud_cert_cache_key(bud_cert_cache_t* cache,
+                             const unsigned char* der,
+                             size_t len);
+
+#endif  /* SRC_CERT_CACHE_H_ */
@@ -12,20 +12,40 @@ void bud_client_log(bud_client_t* client,
                     const char* fmt,
                     ...);
 
+/*
+ * Levels below `BUD_LOG_MIN_LEVEL` (gyp's `bud_log_level`) compile to
+ * nothing, the rest are checked before evaluating any arguments
+ */
+#ifndef BUD_LOG_MIN_LEVEL
+# define BUD_LOG_MIN_LEVEL 0
+#endif  /* !BUD_LOG_MIN_LEVEL */
+
+#define LOG_ENABLED(lvl)                                                      \
+    ((lvl) >= BUD_LOG_MIN_LEVEL &&                                            \
+     (lvl) >= client->config->logger->level)
+
 #define LOG(level, side, fmt, ...)                                            \
-    bud_client_log(client,                                                    \
-                   (level),                                                   \
-                   "client %p on %s " fmt,                                    \
-                   client,                                                    \
-                   bud_side_str((side)->type),                                \
-                   __VA_ARGS__)
+    do {                                                                      \
+      if (LOG_ENABLED(level)) {                                               \
+        bud_client_log(client,                                                \
+                       (level),                                               \
+                       "client %p on %s " fmt,                                \
+                       client,                                                \
+                       bud_side_str((side)->type),                            \
+                       __VA_ARGS__);                                          \
+      }                                                                       \
+    } while (0)
 
 #define LOG_LN(level, side, fmt)                                              \
-    bud_client_log(client,                                                    \
-                   (level),                                                   \
-                   "client %p on %s " fmt,                                    \
-                   client,                                                    \
-                   bud_side_str((side)->type))
+    do {                                                                      \
+      if (LOG_ENABLED(level)) {                                               \
+        bud_client_log(client,                                                \
+                       (level),                                               \
+                       "client %p on %s " fmt,                                \
+                       client,                                                \
+                       bud_side_str((side)->type));                           \
+      }                                                                       \
+    } while (0)
 
 #define INFO(side, fmt, ...)                                                  \
     LOG(kBudLogInfo, side, fmt, __VA_ARGS__)
@@ -1,28 +1,191 @@
-#include <arpa/inet.h>  /* ntohs */
+#include <arpa/inet.h>  /* htonl, ntohs */
+#include <errno.h>  /* errno */
+#include <fcntl.h>  /* fcntl, F_DUPFD_CLOEXEC */
+#include <netinet/in.h>  /* IPPROTO_TCP, IP_RECVERR */
+#include <netinet/tcp.h>  /* TCP_FASTOPEN_CONNECT */
 #include <stdlib.h>
+#include <string.h>  /* memcpy, strlen */
+#include <strings.h>  /* strncasecmp */
+#include <sys/socket.h>  /* socket, setsockopt, sendmsg */
+#include <unistd.h>  /* close */
+#ifdef __linux__
+# include <linux/errqueue.h>  /* sock_extended_err */
+#endif  /* __linux__ */
 
 #include "uv.h"
 #include "bio.h"
 #include "ringbuffer.h"
 #include "openssl/bio.h"
+#include "openssl/evp.h"
+#include "openssl/objects.h"
+#include "openssl/sha.h"
+#include "openssl/x509.h"
 #include "parson.h"
 
+#include "access.h"
+#include "fingerprint.h"
+#include "backend.h"
+#include "backend-pool.h"
+#include "capture.h"
 #include "common.h"
 #include "client.h"
 #include "client-private.h"
+#include "handoff.h"
 #include "hello-parser.h"
 #include "http-pool.h"
+#include "lookup.h"
+#include "proxy-parser.h"
+#include "session-cache.h"
 #include "logger.h"
+#include "memstat.h"
+#include "metrics.h"
+#include "probes.h"
+#include "ratelimit.h"
 #include "sni.h"
+#include "sni-cache.h"
+#include "spill.h"
 #include "ocsp.h"
-
+#include "server.h"
+#include "threads.h"
+#include "worker.h"
+
+/* Linux 4.11+, older libc headers don't have it */
+#if defined(__linux__) && !defined(TCP_FASTOPEN_CONNECT)
+# define TCP_FASTOPEN_CONNECT 30
+#endif  /* __linux__ && !TCP_FASTOPEN_CONNECT */
+
+/* Linux 4.14+, `frontend.zerocopy` */
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(SO_EE_ORIGIN_ZEROCOPY)
+# define BUD_CLIENT_ZEROCOPY 1
+#endif  /* MSG_ZEROCOPY && SO_ZEROCOPY && SO_EE_ORIGIN_ZEROCOPY */
+
+/* Error queues of clients that aren't read are polled that often (ms) */
+#define BUD_CLIENT_ZEROCOPY_POLL 10
+
+/* `recent_bytes` of the clients are halved that often (ms) */
+#define BUD_CLIENT_RECENT_HALFLIFE 1000
+
+/* Granularity of `frontend.timeout`, in ms */
+#define BUD_CLIENT_WHEEL_RESOLUTION 250
+
+/* Granularity of `frontend.bandwidth` pauses, in ms */
+#define BUD_CLIENT_SHAPE_RESOLUTION 10
+
+/* Largest read() through `config->read_buf`, spread over several chunks */
+#define BUD_CLIENT_READ_BUF_SIZE 65536
+
+/* Traffic of the clients is classified that often (ms), see `bulk_count` */
+#define BUD_CLIENT_CLASS_WINDOW 1000
+
+/* Interactive: under this many bytes per window, and per read on average */
+#define BUD_CLIENT_CLASS_SMALL_RATE 65536
+#define BUD_CLIENT_CLASS_SMALL_READ 2048
+
+/* Bulk: at least this many bytes per window, or throttled in it */
+#define BUD_CLIENT_CLASS_BULK_RATE (1024 * 1024)
+
+/* Free chunks of `plain_out` one batch of SSL_read()s may fill */
+#define BUD_CLIENT_READ_REGIONS 4
+
+/* Request head of plain HTTP, see `frontend.http_redirect` */
+#define BUD_CLIENT_PLAINTEXT_MAX 4096
+
+/* `pool.budget` is checked that often (ms) */
+#define BUD_CLIENT_RECLAIM_INTERVAL 1000
+
+/* PROXY v2 TLVs, SSL one carries client flags, verify result and sub-TLVs */
+#define BUD_PP2_TYPE_ALPN 0x01
+#define BUD_PP2_TYPE_AUTHORITY 0x02
+#define BUD_PP2_TYPE_SSL 0x20
+#define BUD_PP2_SUBTYPE_SSL_VERSION 0x21
+#define BUD_PP2_SUBTYPE_SSL_CN 0x22
+#define BUD_PP2_SUBTYPE_SSL_CIPHER 0x23
+#define BUD_PP2_CLIENT_SSL 0x01
+#define BUD_PP2_CLIENT_CERT_CONN 0x02
+#define BUD_PP2_CLIENT_CERT_SESS 0x04
+
+/* From the custom range: one byte, 1 - TLS session was resumed */
+#define BUD_PP2_TYPE_RESUMED 0xe0
+
+/* One byte, 1 - request came (at least partly) in replayable 0-RTT data */
+#define BUD_PP2_TYPE_EARLY_DATA 0xe1
+
+/* SHA-256 of the verified client certificate, see `verify_client` */
+#define BUD_PP2_TYPE_CLIENT_CERT 0xe2
+
+typedef struct bud_client_race_s bud_client_race_t;
+typedef struct bud_client_attempt_s bud_client_attempt_t;
+
+/* Connect to `addrs[index]` of the race */
+struct bud_client_attempt_s {
+  bud_client_race_t* race;
+  uv_tcp_t tcp;
+  uv_connect_t req;
+  int index;
+  int open;
+};
+
+/*
+ * Next address is tried every `backend.happy_eyeballs` ms (or once the
+ * previous attempts have failed) while the others are still connecting.
+ * Socket of the first to connect goes to the client. Freed once all handles
+ * are closed, `client` is NULL after that
+ */
+struct bud_client_race_s {
+  bud_client_t* client;
+  bud_backend_t* backend;
+  struct sockaddr_storage addrs[BUD_BACKEND_MAX_ADDRS];
+  bud_client_attempt_t attempts[BUD_BACKEND_MAX_ADDRS];
+  int count;
+  int next;
+  int pending;
+  int last_err;
+  uv_timer_t timer;
+  int refs;
+};
+
+static void bud_client_new(bud_config_t* config,
+                           bud_config_listener_t* listener,
+                           uv_stream_t* stream,
+                           int fd,
+                           bud_handoff_t* handoff);
+static int bud_client_resume(bud_client_t* client, bud_handoff_t* handoff);
+static void bud_client_latency_observe(bud_client_t* client);
+static void bud_client_handoff_cb(bud_handoff_t* handoff, int status);
+static void bud_client_handoff_close(bud_client_t* client);
+static int bud_client_ssl_new(bud_client_t* client);
+static int bud_client_shed(bud_client_t* client);
+static void bud_client_touch(bud_client_t* client);
+static void bud_client_session_bind(bud_client_t* client);
+static void bud_client_class_count(bud_client_t* client, size_t size);
+static void bud_client_classify(bud_client_t* client, uint64_t now);
+static void bud_client_side_resize(bud_client_t* client,
+                                   bud_client_side_t* side,
+                                   bud_config_buffer_t* conf);
 static void bud_client_side_init(bud_client_side_t* side,
                                  bud_client_side_type_t type,
                                  bud_client_t* client);
 static void bud_client_side_destroy(bud_client_side_t* side);
+static void bud_client_side_tune(bud_client_t* client,
+                                 bud_client_side_t* side,
+                                 bud_config_buffer_t* conf);
+static void bud_client_cork(bud_client_t* client, int on);
+static void bud_client_uncork(bud_client_t* client);
+static int bud_client_backend_init(bud_client_t* client, int is_pipe);
+static void bud_client_side_close(bud_client_t* client,
+                                  bud_client_side_t* side);
+static ringbuffer* bud_client_side_in(bud_client_t* client,
+                                      bud_client_side_t* side);
+static int bud_client_passthrough_start(bud_client_t* client);
 static bud_client_side_t* bud_client_side_by_tcp(bud_client_t* client,
                                                  uv_tcp_t* tcp);
 static void bud_client_close_cb(uv_handle_t* handle);
+static void bud_client_destroy(bud_client_t* client);
+static void bud_client_handshake_free(bud_client_t* client);
+static SSL* bud_client_ssl_reuse(bud_client_t* client, SSL_CTX* ctx);
+static int bud_client_ssl_recycle(bud_client_t* client);
+static void bud_client_teardown_cb(uv_idle_t* handle, int status);
 static void bud_client_alloc_cb(uv_handle_t* handle,
                                 size_t suggested_size,
                                 uv_buf_t* buf);
@@ -30,69 +193,516 @@ static void bud_client_read_cb(uv_stream_t* stream,
                                ssize_t nread,
                                const uv_buf_t* buf);
 static void bud_client_parse_hello(bud_client_t* client);
+#ifndef SSL_OP_PRIORITIZE_CHACHA
+static void bud_client_prefer_chacha(bud_client_t* client);
+#endif  /* !SSL_OP_PRIORITIZE_CHACHA */
+static bud_error_t bud_client_sni_lookup(bud_client_t* client);
+static bud_sni_pending_t* bud_client_sni_request(bud_client_t* client,
+                                                 bud_error_t* err);
+static bud_sni_pending_t* bud_client_sni_fetch(bud_config_t* config,
+                                               const char* servername,
+                                               size_t servername_len,
+                                               bud_error_t* err);
+static void bud_client_sni_revalidate(bud_client_t* client);
+static int bud_client_sni_restore(bud_client_t* client,
+                                  bud_context_t** ctx,
+                                  int* stale);
+static void bud_client_sni_leave(bud_client_t* client);
 static void bud_client_sni_cb(bud_http_request_t* req, bud_error_t err);
+static void bud_client_sni_lookup_cb(bud_lookup_req_t* req, bud_error_t err);
+static void bud_client_sni_response(bud_config_t* config,
+                                    bud_sni_pending_t* pending,
+                                    bud_error_t err,
+                                    int code,
+                                    JSON_Value* response,
+                                    bud_json_stream_t* stream,
+                                    int max_age,
+                                    int stale);
+static void bud_client_sni_file_cb(bud_sni_file_t* file,
+                                   bud_context_t* ctx,
+                                   bud_error_t err);
+static void bud_client_sni_resume(bud_config_t* config,
+                                  bud_sni_pending_t* pending,
+                                  bud_context_t* ctx,
+                                  bud_error_t err);
+static void bud_client_sni_done(bud_client_t* client,
+                                bud_context_t* ctx,
+                                bud_error_t err);
+static bud_error_t bud_client_sni_use(bud_client_t* client,
+                                      bud_context_t* ctx);
+static int bud_client_handshake_allowed(bud_client_t* client);
+static void bud_client_handshake_idle_cb(uv_idle_t* handle, int status);
+static int bud_client_handshake_admit(bud_client_t* client);
+static void bud_client_handshake_release(bud_client_t* client);
+static void bud_client_handshake_continue(bud_client_t* client);
+static void bud_client_flush(bud_client_t* client);
+static void bud_client_flush_cb(uv_check_t* handle, int status);
+static void bud_client_spin_check_cb(uv_check_t* handle, int status);
+static void bud_client_spin_idle_cb(uv_idle_t* handle, int status);
+static void bud_client_flush_idle_cb(uv_idle_t* handle, int status);
+static int bud_client_flush_class(bud_client_t* client);
+static uint64_t bud_client_recent_bytes(bud_client_t* client);
+static void bud_client_timeout_update(bud_client_t* client);
+static void bud_client_timeout_cb(bud_timer_entry_t* entry);
+static void bud_client_shape_spend(bud_client_t* client, size_t size);
+static void bud_client_shape_cb(bud_timer_entry_t* entry);
+static void bud_client_log_access(bud_client_t* client);
+static void bud_client_log_trace(bud_client_t* client);
+static void bud_client_log_names(bud_client_t* client,
+                                 char* host,
+                                 size_t host_size,
+                                 uint16_t* port,
+                                 char* servername,
+                                 size_t servername_size);
+static long long bud_client_since_accept(bud_client_t* client, uint64_t t);
+static void bud_client_count_failure(bud_client_t* client);
+static bud_metrics_row_t* bud_client_context_row(bud_client_t* client);
+static bud_metrics_row_t* bud_client_backend_row(bud_config_t* config,
+                                                 bud_backend_t* backend);
+static void bud_client_count_close(bud_client_t* client);
+static void bud_client_cycle_ssl(bud_client_t* client);
+static int bud_client_backend_down(bud_client_t* client);
+static int bud_client_plaintext(bud_client_t* client);
+static int bud_client_plaintext_reply(char* reply,
+                                      size_t reply_len,
+                                      const char* head,
+                                      size_t len);
 static int bud_client_backend_in(bud_client_t* client);
+static size_t bud_client_record_limit(bud_client_t* client);
+static int bud_client_coalesce_wait(bud_client_t* client, size_t limit);
+static size_t bud_client_coalesce(bud_client_t* client,
+                                  size_t limit,
+                                  char** data);
+static void bud_client_coalesce_cb(uv_timer_t* timer, int status);
+#ifdef SSL_MODE_ASYNC
+static int bud_client_async_wait(bud_client_t* client, int err);
+static void bud_client_async_poll_cb(uv_poll_t* handle,
+                                     int status,
+                                     int events);
+static void bud_client_async_timer_cb(uv_timer_t* timer, int status);
+static void bud_client_async_close_cb(uv_handle_t* handle);
+#endif  /* SSL_MODE_ASYNC */
 static int bud_client_backend_out(bud_client_t* client);
+static size_t bud_client_ssl_readv(bud_client_t* client, int* last);
+static uint64_t bud_client_cpu_start(bud_client_t* client,
+                                     SSL* ssl,
+                                     int* handshake);
+static void bud_client_cpu_stop(bud_client_t* client,
+                                uint64_t start,
+                                int handshake);
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+static int bud_client_early_data_out(bud_client_t* client);
+#endif  /* SSL_READ_EARLY_DATA_SUCCESS */
+static int bud_client_budget_spend(bud_client_t* client, size_t size);
+static void bud_client_budget_idle_cb(uv_idle_t* handle, int status);
+static uint64_t bud_client_buffer_usage(bud_config_t* config);
+static uint64_t bud_client_side_trim(bud_client_side_t* side);
+static void bud_client_reclaim_cb(uv_timer_t* handle, int status);
+static void bud_client_tcp_info_cb(uv_timer_t* handle, int status);
+static void bud_client_tcp_sample(bud_client_t* client);
+static void bud_client_queue_marks(bud_client_t* client);
+static void bud_client_queue_mark(bud_client_t* client,
+                                  bud_client_queue_t* queue,
+                                  ringbuffer* rb);
+static void bud_client_queue_consume(bud_client_t* client,
+                                     bud_client_queue_t* queue,
+                                     ringbuffer* rb,
+                                     size_t size,
+                                     bud_metric_t hist);
 static int bud_client_throttle(bud_client_t* client,
                                bud_client_side_t* side,
                                ringbuffer* buf);
+static int bud_client_spill_start(bud_client_t* client);
+static int bud_client_spill_write(bud_client_t* client,
+                                  const char* data,
+                                  size_t size);
+static int bud_client_spill_refill(bud_client_t* client);
 static int bud_client_send(bud_client_t* client, bud_client_side_t* side);
+static void bud_client_send_consumed(bud_client_t* client,
+                                     bud_client_side_t* side,
+                                     size_t size);
+static int bud_client_send_done(bud_client_t* client,
+                                bud_client_side_t* side);
 static void bud_client_send_cb(uv_write_t* req, int status);
+static int bud_client_send_uring(bud_client_t* client,
+                                 bud_client_side_t* side,
+                                 bud_client_write_t* w,
+                                 uv_buf_t* buf,
+                                 size_t count);
+static void bud_client_send_uring_cb(bud_uring_op_t* op, int res);
+static void bud_client_send_started(bud_client_t* client,
+                                    bud_client_side_t* side,
+                                    size_t size);
+#ifdef BUD_CLIENT_ZEROCOPY
+static int bud_client_send_zerocopy(bud_client_t* client,
+                                    bud_client_side_t* side,
+                                    char** out,
+                                    size_t* size,
+                                    size_t count);
+static void bud_client_zerocopy_reap(bud_client_t* client,
+                                     bud_client_side_t* side);
+static void bud_client_zerocopy_done(bud_client_side_t* side,
+                                     uint32_t lo,
+                                     uint32_t hi);
+#endif  /* BUD_CLIENT_ZEROCOPY */
+static void bud_client_zerocopy_watch(bud_client_t* client);
+static void bud_client_zerocopy_cb(uv_timer_t* handle, int status);
+static bud_client_side_t* bud_client_write_side(bud_client_t* client,
+                                                bud_client_write_t* w);
+static void bud_client_send_complete(bud_client_t* client,
+                                     bud_client_side_t* side,
+                                     bud_client_write_t* w,
+                                     size_t written);
+static void bud_client_send_pop(bud_client_t* client,
+                                bud_client_side_t* side);
+static const unsigned char* bud_client_protocol(bud_client_t* client,
+                                               unsigned int* len);
+static bud_backend_list_t* bud_client_backend_list(bud_client_t* client);
+static bud_context_t* bud_client_context(bud_client_t* client);
+static int bud_client_quota_admit(bud_client_t* client);
+static void bud_client_quota_release(bud_client_t* client);
+static const char* bud_client_peer_key(bud_client_t* client, size_t* len);
+static int bud_client_rate_limited(bud_client_t* client);
+static int bud_client_denied(bud_client_t* client);
+static int bud_client_fingerprint_denied(bud_client_t* client);
+static void bud_client_parse_proxy(bud_client_t* client);
+static int bud_client_connect(bud_client_t* client);
+static void bud_client_backend_fastopen(bud_client_t* client,
+                                        bud_backend_t* backend);
+static int bud_client_connect_deferred(bud_client_t* client);
+static int bud_client_race_start(bud_client_t* client,
+                                 bud_backend_t* backend);
+static int bud_client_race_next(bud_client_race_t* race);
+static void bud_client_race_timer_cb(uv_timer_t* timer, int status);
+static void bud_client_race_connect_cb(uv_connect_t* req, int status);
+static int bud_client_race_adopt(bud_client_race_t* race,
+                                 bud_client_attempt_t* attempt);
+static void bud_client_race_finish(bud_client_race_t* race, int status);
+static void bud_client_race_close(bud_client_race_t* race);
+static void bud_client_race_close_cb(uv_handle_t* handle);
+static int bud_client_backend_read(bud_client_t* client);
+static int bud_client_upstream_new(bud_client_t* client,
+                                   bud_backend_t* backend);
+static ringbuffer* bud_client_plain_in(bud_client_t* client);
+static ringbuffer* bud_client_plain_out(bud_client_t* client);
+static int bud_client_side_pending(bud_client_t* client,
+                                   bud_client_side_t* side);
+static int bud_client_upstream_in(bud_client_t* client);
+static int bud_client_upstream_out(bud_client_t* client);
+static int bud_client_upstream_error(bud_client_t* client, int ret);
+static void bud_client_upstream_info_cb(const SSL* ssl, int where, int ret);
 static void bud_client_connect_cb(uv_connect_t* req, int status);
+static void bud_client_connect_done(bud_client_t* client, int status);
+static void bud_client_http_init(bud_client_t* client, int reuse);
+static size_t bud_client_http_feed(bud_client_t* client,
+                                   http_parser* parser,
+                                   const char* data,
+                                   size_t size);
+static int bud_client_http_read(bud_client_t* client,
+                                char* out,
+                                size_t avail);
+static int bud_client_http_begin_cb(http_parser* parser);
+static int bud_client_http_headers_cb(http_parser* parser);
+static int bud_client_http_body_cb(http_parser* parser,
+                                   const char* at,
+                                   size_t length);
+static int bud_client_http_complete_cb(http_parser* parser);
+static int bud_client_http_buffered(bud_client_t* client);
+static int bud_client_http_idle(bud_client_t* client);
+static int bud_client_http_release(bud_client_t* client);
+
+/* Only message boundaries matter, see bud_client_http_idle() */
+static http_parser_settings bud_client_http_settings = {
+  bud_client_http_begin_cb,
+  NULL,
+  NULL,
+  NULL,
+  bud_client_http_headers_cb,
+  bud_client_http_body_cb,
+  bud_client_http_complete_cb
+};
 static int bud_client_shutdown(bud_client_t* client, bud_client_side_t* side);
 static void bud_client_shutdown_cb(uv_shutdown_t* req, int status);
 static int bud_client_prepend_proxyline(bud_client_t* client);
+static int bud_client_encode_proxyline_v2(bud_client_t* client,
+                                          struct sockaddr_storage* storage);
+static void bud_client_proxyline_tlvs(bud_client_t* client);
+static void bud_client_proxyline_tlv(bud_client_t* client,
+                                     int type,
+                                     const void* data,
+                                     size_t len);
 static const char* bud_sslerror_str(int err);
 static void bud_client_ssl_info_cb(const SSL* ssl, int where, int ret);
 
-void bud_client_create(bud_config_t* config, uv_stream_t* stream) {
+void bud_client_create(bud_config_t* config,
+                       bud_config_listener_t* listener,
+                       uv_stream_t* stream) {
+  bud_client_new(config, listener, stream, -1, NULL);
+}
+
+
+void bud_client_create_fd(bud_config_t* config,
+                          bud_config_listener_t* listener,
+                          int fd) {
+  bud_client_new(config, listener, NULL, fd, NULL);
+}
+
+
+void bud_client_create_handoff(bud_config_t* config, bud_handoff_t* handoff) {
+  const unsigned char* data;
+  size_t size;
+  uint32_t index;
+  uint32_t output;
+  int fd;
+
+  /* Same config file, same listeners - but don't trust it blindly */
+  data = (const unsigned char*) handoff->payload;
+  size = handoff->size - BUD_IPC_HEADER_SIZE;
+  if (!config->frontend.passthrough ||
+      handoff->types[0] != UV_TCP ||
+      size < BUD_HANDOFF_HEADER_SIZE) {
+    goto fatal;
+  }
+  index = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+  output = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+  if (index >= (uint32_t) config->listener_count ||
+      output > size - BUD_HANDOFF_HEADER_SIZE) {
+    goto fatal;
+  }
+
+  fd = bud_handoff_dup(handoff, 0);
+  if (fd == -1)
+    goto fatal;
+
+  bud_client_new(config, &config->listeners[index], NULL, fd, handoff);
+  bud_handoff_free(handoff);
+  return;
+
+fatal:
+  bud_log(config, kBudLogWarning, "can't resume relay of the old worker");
+  bud_handoff_free(handoff);
+}
+
+
+void bud_client_new(bud_config_t* config,
+                    bud_config_listener_t* listener,
+                    uv_stream_t* stream,
+                    int fd,
+                    bud_handoff_t* handoff) {
   int r;
   bud_client_t* client;
-  BIO* enc_in;
-  BIO* enc_out;
-#ifdef SSL_MODE_RELEASE_BUFFERS
-  long mode;
-#endif  /* SSL_MODE_RELEASE_BUFFERS */
-
-  client = malloc(sizeof(*client));
+  client = bud_slab_alloc(&config->client_slab);
   if (client == NULL)
-    return;
+    goto failed_alloc;
+  client->hs = bud_slab_alloc(&config->handshake_slab);
+  if (client->hs == NULL)
+    goto failed_hs_alloc;
+  client->hs->client = client;
 
   client->config = config;
+  client->listener = listener;
   client->ssl = NULL;
+  client->ssl_ctx = NULL;
+  client->corked = 0;
   client->last_handshake = 0;
   client->handshakes = 0;
   client->connect = kBudProgressNone;
   client->close = kBudProgressNone;
   client->destroy_waiting = 0;
+  client->race = NULL;
+  client->selected = NULL;
+  client->latency_start = 0;
+  client->proxyline_len = 0;
+  memset(&client->peer, 0, sizeof(client->peer));
+  client->coalesce_init = 0;
+  client->coalesce_flush = 0;
+  client->async_poll_state = kBudProgressNone;
+  client->async_timer_init = 0;
+  client->async_waiting = 0;
+  client->record_sent = 0;
+  client->record_last = 0;
+  client->record_pending = 0;
+  memset(&client->stats, 0, sizeof(client->stats));
+  memset(&client->plain_queue, 0, sizeof(client->plain_queue));
+  client->stats.accept = uv_now(config->loop);
+  client->context_row = NULL;
+  client->backend_row = NULL;
+  client->handshake_parked = 0;
+  client->handoff = 0;
+  client->hs->admit_waiting = 0;
+  client->hs->admit_slot = 0;
+  client->hs->backend_down = 0;
+  client->hs->session_bound = 0;
+  client->flush_queued = 0;
+  client->zerocopy_queued = 0;
+  client->budget_left = 0;
+  client->recent_bytes = 0;
+  client->recent_at = uv_now(config->loop);
+  client->traffic_class = kBudClassDefault;
+  client->class_at = client->recent_at;
+  client->class_bytes = 0;
+  client->class_reads = 0;
+  client->class_throttles = 0;
+  client->budget_tick = 0;
+  client->budget_queued = 0;
+  client->handshake_deadline = 0;
+  client->idle_deadline = 0;
+  bud_timer_entry_init(&client->timeout);
+  client->shape.bucket.tokens = 0;
+  client->shape.bucket.last = 0;
+  bud_timer_entry_init(&client->shape.entry);
+  client->shape.waiting = 0;
+  client->shape.paused = 0;
+
+  /* Balancer in front of us tells the real address first */
+  client->proxy_parse = kBudProgressDone;
+  bud_proxy_parser_init(&client->hs->proxy_parser);
+  if (config->frontend.accept_proxyline)
+    client->proxy_parse = kBudProgressNone;
+
+  client->early_read = kBudProgressDone;
+  client->early_data = 0;
+  client->greeting = 0;
+  client->http.enabled = 0;
+  client->http.reuse = 0;
+  client->http.xforward = 0;
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  if (config->frontend.early_data > 0)
+    client->early_read = kBudProgressNone;
+#endif  /* SSL_READ_EARLY_DATA_SUCCESS */
 
   client->hello_parse = kBudProgressDone;
-  if (config->sni.enabled || config->stapling.enabled)
+  client->hs->hello.servername = NULL;
+  client->hs->hello.servername_len = 0;
+  bud_hello_parser_init(&client->hs->hello_parser);
+  if (config->sni.enabled ||
+      config->stapling.enabled ||
+      config->ocsp_files != 0 ||
+      config->session.enabled ||
+      config->backend.defer) {
+    client->hello_parse = kBudProgressNone;
+  }
+#ifndef SSL_OP_PRIORITIZE_CHACHA
+  if (config->frontend.prioritize_chacha && config->frontend.server_preference)
+    client->hello_parse = kBudProgressNone;
+#endif  /* !SSL_OP_PRIORITIZE_CHACHA */
+
+  /* Tells resumption attempts from full handshakes */
+  if (config->frontend.max_handshakes > 0 || config->frontend.quota.enabled)
+    client->hello_parse = kBudProgressNone;
+
+  /* Plain HTTP is told from the hello */
+  if (config->frontend.http_redirect)
+    client->hello_parse = kBudProgressNone;
+
+  /* Sessions and tickets are bound to the servername, see session-cache.h */
+  if (config->context_count > 0)
     client->hello_parse = kBudProgressNone;
 
   /* SNI */
-  client->sni_req = NULL;
-  client->sni_ctx.ctx = NULL;
+  client->hs->sni_pending = NULL;
+  client->sni_ctx = NULL;
+  client->context = NULL;
+  client->quota_checked = 0;
+  client->quota_slot = 0;
 
   /* Stapling */
-  client->stapling_cache_req = NULL;
-  client->stapling_req = NULL;
-  client->stapling_ocsp_resp = NULL;
+
+  /* External session cache */
+  client->hs->session_req = NULL;
+  client->hs->session = NULL;
 
   /* Initialize buffers */
   bud_client_side_init(&client->frontend, kBudFrontend, client);
   bud_client_side_init(&client->backend, kBudBackend, client);
 
+  /* Plaintext of `backend.tls`, nothing is allocated until it is used */
+  client->upstream = NULL;
+  ringbuffer_init_pool(&client->upstream_in, &config->backend_pool, 1);
+  ringbuffer_init_pool(&client->upstream_out, &config->backend_pool, 1);
+  ringbuffer_set_max_size(&client->upstream_in, client->backend.input.max_size);
+  ringbuffer_set_max_size(&client->upstream_out,
+                          client->backend.output.max_size);
+  client->spill = NULL;
+  client->spill_read = 0;
+  client->spill_paused = 0;
+  client->spill_failed = 0;
+
   /**
    * Accept client on frontend
    */
   r = uv_tcp_init(config->loop, &client->frontend.tcp);
   if (r != 0)
     goto failed_tcp_in_init;
+  client->frontend.init = 1;
 
-  r = uv_accept(stream, (uv_stream_t*) &client->frontend.tcp);
-  if (r != 0)
+  /* Joins `clients` once admitted, until then it can't be picked to close */
+  QUEUE_INIT(&client->member);
+  client->last_active = uv_now(config->loop);
+
+  /* Socket taken from another event loop, see bud_threads_offer() */
+  if (stream == NULL) {
+    r = uv_tcp_open(&client->frontend.tcp, fd);
+    if (r != 0) {
+      close(fd);
+      goto failed_accept;
+    }
+  } else {
+    r = uv_accept(stream, (uv_stream_t*) &client->frontend.tcp);
+    if (r != 0)
+      goto failed_accept;
+
+    /* Busy with handshakes, an idle loop may take it */
+    if (bud_threads_offer(config,
+                          listener,
+                          (uv_stream_t*) &client->frontend.tcp)) {
+      goto failed_accept;
+    }
+  }
+
+  /* Replaced with the one from PROXY header, if `accept_proxyline` */
+  r = sizeof(client->peer);
+  uv_tcp_getpeername(&client->frontend.tcp,
+                     (struct sockaddr*) &client->peer,
+                     &r);
+  BUD_PROBE2(client__accept, client, &client->peer);
+
+  /* Relay of the old worker, nothing to admit or to parse */
+  if (handoff != NULL) {
+    QUEUE_INSERT_TAIL(&config->clients, &client->member);
+    r = bud_client_resume(client, handoff);
+    if (r != 0)
+      goto failed_connect;
+
+    /* Data that it has buffered goes out right away */
+    client->destroy_waiting = 2;
+    DBG_LN(&client->frontend, "resumed");
+    bud_client_cycle(client);
+    return;
+  }
+  bud_metrics_inc(config, kBudMetricAccepts);
+
+  /*
+   * Drop addresses of `frontend.access.deny` and over `frontend.rate_limit`
+   * before any crypto is done
+   */
+  if (client->proxy_parse == kBudProgressDone &&
+      (bud_client_denied(client) || bud_client_rate_limited(client))) {
+    goto failed_accept;
+  }
+
+  if (bud_client_shed(client) != 0)
+    goto failed_accept;
+
+  /* No slot, and no room to wait for one - don't spend anything on it */
+  if (config->frontend.max_handshakes > 0 &&
+      config->handshake_active >= config->frontend.max_handshakes &&
+      config->handshake_waiting_count >= config->frontend.handshake_queue) {
+    bud_metrics_inc(config, kBudMetricAdmitRejected);
+    LOG_LN(kBudLogNotice, &client->frontend, "over max_handshakes, closing");
     goto failed_accept;
+  }
+  QUEUE_INSERT_TAIL(&config->clients, &client->member);
 
   r = uv_read_start((uv_stream_t*) &client->frontend.tcp,
                     bud_client_alloc_cb,
@@ -101,63 +711,54 @@ void bud_client_create(bud_config_t* config, uv_stream_t* stream) {
     goto failed_accept;
   client->frontend.reading = kBudProgressRunning;
 
+  /* Until the handshake is done, or anything is received */
+  if (config->frontend.timeout.handshake > 0) {
+    client->handshake_deadline = uv_now(config->loop) +
+                                 config->frontend.timeout.handshake;
+  }
+  if (config->frontend.timeout.idle > 0) {
+    client->idle_deadline = uv_now(config->loop) +
+                            config->frontend.timeout.idle;
+  }
+  bud_client_timeout_update(client);
+
   /*
    * Connect to backend
-   * NOTE: We won't start reading until some SSL data will be sent.
+   * NOTE: We won't start reading until some SSL data will be sent, or until
+   * the handshake is done for `server_first` backends.
+   *
+   * Backend may depend on servername, connect once the hello is parsed, or
+   * once the handshake is done with `backend.lazy_connect`
    */
-  r = uv_tcp_init(config->loop, &client->backend.tcp);
-  if (r != 0)
-    goto failed_accept;
-
-  r = uv_tcp_connect(&client->connect_req,
-                     &client->backend.tcp,
-                     (struct sockaddr*) &client->config->backend.addr,
-                     bud_client_connect_cb);
-  if (r != 0)
-    goto failed_connect;
-  client->connect = kBudProgressRunning;
+  if (!config->backend.defer &&
+      !config->backend.lazy_connect &&
+      !config->backend.buffer_request.enabled) {
+    r = bud_client_connect(client);
+    if (r != 0)
+      goto failed_connect;
+  }
 
   /* Adjust sockets */
   r = uv_tcp_nodelay(&client->frontend.tcp, 1);
-  if (r == 0)
-    r = uv_tcp_nodelay(&client->backend.tcp, 1);
   if (r == 0 && config->frontend.keepalive > 0)
     r = uv_tcp_keepalive(&client->frontend.tcp, 1, config->frontend.keepalive);
-  if (r == 0 && config->backend.keepalive > 0)
-    r = uv_tcp_keepalive(&client->backend.tcp, 1, config->backend.keepalive);
   if (r != 0)
     goto failed_connect;
+  bud_client_side_tune(client, &client->frontend, &config->frontend.buffer);
+  if (config->frontend.cork_handshake && !config->frontend.passthrough)
+    bud_client_cork(client, 1);
 
-  /* Initialize SSL */
-
-  /* First context is always default */
-  client->ssl = SSL_new(config->contexts[0].ctx);
-  if (client->ssl == NULL)
-    goto failed_connect;
-
-  if (!SSL_set_ex_data(client->ssl, kBudSSLClientIndex, client))
-    goto failed_connect;
-
-  SSL_set_info_callback(client->ssl, bud_client_ssl_info_cb);
-
-  enc_in = bud_bio_new(&client->frontend.input);
-  if (enc_in == NULL)
-    goto failed_connect;
-  enc_out = bud_bio_new(&client->frontend.output);
-  if (enc_out == NULL) {
-    BIO_free_all(enc_in);
-    goto failed_connect;
+  /* Initialize SSL, passthrough relays the TLS as it is */
+  if (!config->frontend.passthrough) {
+    r = bud_client_ssl_new(client);
+    if (r != 0)
+      goto failed_connect;
   }
-  SSL_set_bio(client->ssl, enc_in, enc_out);
 
-#ifdef SSL_MODE_RELEASE_BUFFERS
-  mode = SSL_get_mode(client->ssl);
-  SSL_set_mode(client->ssl, mode | SSL_MODE_RELEASE_BUFFERS);
-#endif  /* SSL_MODE_RELEASE_BUFFERS */
-
-  SSL_set_accept_state(client->ssl);
-
-  if (config->frontend.proxyline) {
+  /* Passthrough prepends it after the hello is parsed */
+  if (config->frontend.proxyline &&
+      !config->frontend.passthrough &&
+      client->proxy_parse == kBudProgressDone) {
     r = bud_client_prepend_proxyline(client);
     if (r != 0)
       goto failed_connect;
@@ -171,607 +772,5691 @@ failed_connect:
   client->connect = kBudProgressDone;
   client->close = kBudProgressDone;
   client->destroy_waiting++;
-  uv_close((uv_handle_t*) &client->backend.tcp, bud_client_close_cb);
+  bud_client_side_close(client, &client->backend);
 
 failed_accept:
+  client->close = kBudProgressDone;
   client->destroy_waiting++;
   uv_close((uv_handle_t*) &client->frontend.tcp, bud_client_close_cb);
   return;
 
 failed_tcp_in_init:
-  free(client);
-}
+  bud_slab_free(&config->handshake_slab, client->hs);
 
+failed_hs_alloc:
+  bud_slab_free(&config->client_slab, client);
 
-void bud_client_side_init(bud_client_side_t* side,
-                          bud_client_side_type_t type,
-                          bud_client_t* client) {
-  side->type = type;
-  side->tcp.data = client;
-  ringbuffer_init(&side->input);
-  ringbuffer_init(&side->output);
-  side->reading = kBudProgressNone;
-  side->shutdown = kBudProgressNone;
-  side->close = kBudProgressNone;
-  side->write = kBudProgressNone;
-  side->write_size = 0;
+failed_alloc:
+  if (stream == NULL)
+    close(fd);
 }
 
 
-void bud_client_side_destroy(bud_client_side_t* side) {
-  ringbuffer_destroy(&side->input);
-  ringbuffer_destroy(&side->output);
-}
+int bud_client_shed(bud_client_t* client) {
+  bud_config_t* config;
+  bud_client_t* victim;
+  QUEUE* q;
 
+  /* Master is balancing around full workers, but its view may be stale */
+  config = client->config;
+  if (config->frontend.max_clients <= 0 ||
+      config->client_slab.used_count <= (size_t) config->frontend.max_clients) {
+    return 0;
+  }
 
-bud_client_side_t* bud_client_side_by_tcp(bud_client_t* client, uv_tcp_t* tcp) {
-  if (tcp == &client->frontend.tcp)
-    return &client->frontend;
-  else
-    return &client->backend;
+  if (!config->frontend.shed_idle) {
+    LOG_LN(kBudLogNotice, &client->frontend, "over max_clients, closing");
+    return -1;
+  }
+
+  /* Make room by closing the one that was quiet for the longest time */
+  QUEUE_FOREACH(q, &config->clients) {
+    victim = QUEUE_DATA(q, bud_client_t, member);
+    if (victim == client || victim->close != kBudProgressNone)
+      continue;
+
+    bud_client_log(victim,
+                   kBudLogNotice,
+                   "client %p on frontend shed, over max_clients",
+                   victim);
+    victim->stats.reason = "shed";
+    bud_client_close(victim, &victim->frontend);
+    return 0;
+  }
+
+  return -1;
 }
 
 
-void bud_client_close(bud_client_t* client, bud_client_side_t* side) {
-  if (client->close == kBudProgressRunning) {
-    /* Force close, even if waiting */
-    if (side->close == kBudProgressRunning) {
-      DBG_LN(side, "force closing");
-      uv_close((uv_handle_t*) &side->tcp, bud_client_close_cb);
-      side->close = kBudProgressDone;
-      client->close = kBudProgressDone;
-    }
-    return;
-  } else if (client->close == kBudProgressDone) {
+void bud_client_touch(bud_client_t* client) {
+  /* Closed ones may be in `teardown_queue` already */
+  if (client->close != kBudProgressNone)
     return;
-  }
 
-  /* Close offending side, and wait for write finish on other side */
-  client->close = kBudProgressRunning;
+  /* Tail is the most recent, so `clients` is ordered by the activity */
+  QUEUE_REMOVE(&client->member);
+  QUEUE_INSERT_TAIL(&client->config->clients, &client->member);
+  client->last_active = uv_now(client->config->loop);
+}
 
-  if (side->type == kBudBackend &&
-      !ringbuffer_is_empty(&client->frontend.output)) {
-    client->frontend.close = kBudProgressRunning;
-  } else {
-    DBG_LN(&client->frontend, "force closing (and waiting for other)");
-    uv_close((uv_handle_t*) &client->frontend.tcp, bud_client_close_cb);
-    client->frontend.close = kBudProgressDone;
-  }
 
-  if (side->type == kBudFrontend &&
-      !ringbuffer_is_empty(&client->backend.output)) {
-    client->backend.close = kBudProgressRunning;
-  } else {
-    DBG_LN(&client->backend, "force closing (and waiting for other)");
-    uv_close((uv_handle_t*) &client->backend.tcp, bud_client_close_cb);
-    client->backend.close = kBudProgressDone;
+int bud_client_close_idle(bud_config_t* config,
+                          uint64_t idle,
+                          const char* reason) {
+  bud_client_t* client;
+  QUEUE* q;
+  uint64_t now;
+  int count;
+
+  /* Closing may take the client out of the queue, step before it */
+  now = uv_now(config->loop);
+  count = 0;
+  q = QUEUE_HEAD(&config->clients);
+  while (q != &config->clients) {
+    client = QUEUE_DATA(q, bud_client_t, member);
+    q = QUEUE_NEXT(q);
+    if (client->last_active + idle > now)
+      break;
+    if (client->close != kBudProgressNone)
+      continue;
+
+    bud_client_log(client,
+                   kBudLogInfo,
+                   "client %p on frontend closed, %s",
+                   client,
+                   reason);
+    client->stats.reason = reason;
+    bud_client_close(client, &client->frontend);
+    count++;
   }
 
-  /* Cycle data if one of backends is not closed */
-  if (client->backend.close != kBudProgressDone ||
-      client->frontend.close != kBudProgressDone) {
-    bud_client_cycle(client);
-  }
+  return count;
 }
 
 
-void bud_client_close_cb(uv_handle_t* handle) {
-  bud_client_t* client;
+int bud_client_ssl_new(bud_client_t* client) {
+  BIO* enc_in;
+  BIO* enc_out;
+  bud_context_t* ctx;
+  bud_error_t err;
+  bud_mem_tag_t prev;
 
-  client = (bud_client_t*) handle->data;
+  /* Listener's context is the default, it may be a lazy one */
+  ctx = bud_client_default_context(client);
+  err = bud_context_use(client->config, ctx);
+  if (!bud_is_ok(err)) {
+    bud_error_log(client->config, kBudLogWarning, err);
+    ctx = &client->config->contexts[0];
+  }
+  client->ssl_ctx = ctx->ctx;
 
-  if (--client->destroy_waiting != 0)
-    return;
+  /*
+   * Mode, read-ahead and callbacks are kept by SSL_clear(), but the reused
+   * one may have been switched to another context by SNI
+   */
+  client->ssl = bud_client_ssl_reuse(client, ctx->ctx);
+  if (client->ssl != NULL) {
+    bud_context_tune_ssl(ctx, client->ssl);
+    return 0;
+  }
 
-  DBG_LN(&client->frontend, "close_cb");
+  prev = bud_mem_scope(kBudMemSSL);
+  client->ssl = SSL_new(ctx->ctx);
+  bud_mem_scope(prev);
+  if (client->ssl == NULL)
+    return -1;
 
-  bud_client_side_destroy(&client->frontend);
-  bud_client_side_destroy(&client->backend);
+  if (!SSL_set_ex_data(client->ssl, kBudSSLClientIndex, client))
+    return -1;
 
-  if (client->ssl != NULL)
-    SSL_free(client->ssl);
-  if (client->sni_ctx.ctx != NULL)
-    bud_context_free(&client->sni_ctx);
-  if (client->sni_req != NULL)
-    bud_http_request_cancel(client->sni_req);
-  if (client->stapling_cache_req != NULL)
-    bud_http_request_cancel(client->stapling_cache_req);
-  if (client->stapling_req != NULL)
-    bud_http_request_cancel(client->stapling_req);
-  if (client->stapling_ocsp_resp != NULL)
-    free(client->stapling_ocsp_resp);
+  SSL_set_info_callback(client->ssl, bud_client_ssl_info_cb);
 
-  client->ssl = NULL;
-  client->sni_req = NULL;
-  client->stapling_cache_req = NULL;
-  client->stapling_req = NULL;
-  client->stapling_ocsp_resp = NULL;
-  free(client);
-}
+  enc_in = bud_bio_new(&client->frontend.input);
+  if (enc_in == NULL)
+    return -1;
+  enc_out = bud_bio_new(&client->frontend.output);
+  if (enc_out == NULL) {
+    BIO_free_all(enc_in);
+    return -1;
+  }
+  SSL_set_bio(client->ssl, enc_in, enc_out);
 
+  /*
+   * OpenSSL encrypts and decrypts in its own record buffers, so one copy
+   * each way is unavoidable. But without read-ahead it pulls every record
+   * in two BIO reads (header, then body). Let it take everything that is
+   * buffered in one go instead.
+   */
+  SSL_set_read_ahead(client->ssl, 1);
 
-void bud_client_alloc_cb(uv_handle_t* handle,
-                         size_t suggested_size,
-                         uv_buf_t* buf) {
-  bud_client_t* client;
-  bud_client_side_t* side;
-  size_t avail;
-  char* ptr;
+  /* SSL_MODE_RELEASE_BUFFERS and max_send_fragment come from the context */
 
-  client = handle->data;
-  side = bud_client_side_by_tcp(client, (uv_tcp_t*) handle);
+  /*
+   * Retried records may be gathered again, see bud_client_coalesce(). BIO
+   * refuses writes once `frontend.output` is full, so the records that
+   * did fit are reported.
+   */
+  SSL_set_mode(client->ssl,
+               SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+               SSL_MODE_ENABLE_PARTIAL_WRITE);
 
-  avail = 0;
-  ptr = ringbuffer_write_ptr(&side->input, &avail);
-  *buf = uv_buf_init(ptr, avail);
+#ifdef SSL_MODE_ASYNC
+  /* Private key operations are paused instead of blocking the worker */
+  if (client->config->engine.async)
+    SSL_set_mode(client->ssl, SSL_MODE_ASYNC);
+#endif  /* SSL_MODE_ASYNC */
+
+  SSL_set_accept_state(client->ssl);
+  return 0;
 }
 
 
-void bud_client_read_cb(uv_stream_t* stream,
-                        ssize_t nread,
-                        const uv_buf_t* buf) {
-  int r;
-  bud_client_t* client;
-  bud_client_side_t* side;
-  bud_client_side_t* opposite;
+SSL* bud_client_ssl_reuse(bud_client_t* client, SSL_CTX* ctx) {
+  bud_config_t* config;
+  SSL* ssl;
 
-  client = stream->data;
-  side = bud_client_side_by_tcp(client, (uv_tcp_t*) stream);
+  /* Only the most recent one, it is likely of the same listener */
+  config = client->config;
+  if (config->ssl_pool_count == 0)
+    return NULL;
+  ssl = config->ssl_pool[config->ssl_pool_count - 1];
+  if (SSL_get_SSL_CTX(ssl) != ctx)
+    return NULL;
+  config->ssl_pool_count--;
+
+  if (!SSL_set_ex_data(ssl, kBudSSLClientIndex, client)) {
+    SSL_free(ssl);
+    return NULL;
+  }
+  bud_bio_set_buffer(SSL_get_rbio(ssl), &client->frontend.input);
+  bud_bio_set_buffer(SSL_get_wbio(ssl), &client->frontend.output);
+  SSL_set_accept_state(ssl);
 
-  /* Commit data if there was no error */
-  r = 0;
-  if (nread >= 0)
-    r = ringbuffer_write_append(&side->input, nread);
+  bud_metrics_inc(config, kBudMetricSSLReused);
+  return ssl;
+}
 
-  DBG(side, "after read_cb() => %d", nread);
 
-  /* Handle EOF */
-  if (nread == UV_EOF) {
-    side->reading = kBudProgressDone;
+int bud_client_ssl_recycle(bud_client_t* client) {
+  bud_config_t* config;
+  SSL* ssl;
 
-    /* Shutdown opposite side */
-    opposite = side == &client->frontend ? &client->backend : &client->frontend;
-    if (bud_client_shutdown(client, opposite) != 0)
-      return;
+  config = client->config;
+  ssl = client->ssl;
+  if (config->ssl_pool == NULL ||
+      config->ssl_pool_count >= config->pool.ssl_objects) {
+    return 0;
   }
 
-  /* Try writing out data anyway */
-  bud_client_cycle(client);
+  /* SNI has switched it to other SSL_CTX, can't be reused for the default */
+  if (SSL_get_SSL_CTX(ssl) != client->ssl_ctx)
+    return 0;
 
-  if ((r != 0 || nread < 0) && nread != UV_EOF) {
-    if (nread < 0)
-      NOTICE(side, "read_cb failed: %d - \"%s\"", nread, uv_strerror(nread));
-    else
-      NOTICE(side, "write_append failed: %d", r);
+#ifdef SSL_MODE_ASYNC
+  /* Job is still paused in the engine */
+  if (SSL_waiting_for_async(ssl))
+    return 0;
+#endif  /* SSL_MODE_ASYNC */
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  /* Not reset by SSL_clear(), and kept by ClientHellos without SNI */
+  OPENSSL_free(ssl->tlsext_hostname);
+  ssl->tlsext_hostname = NULL;
+#elif OPENSSL_VERSION_NUMBER < 0x10101000L
+  if (SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name) != NULL)
+    return 0;
+#endif  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
 
-    /* Unrecoverable socket error, close */
-    return bud_client_close(client, side);
-  }
+  /* Session would otherwise survive SSL_clear() */
+  SSL_set_session(ssl, NULL);
+  if (!SSL_clear(ssl))
+    return 0;
 
-  /* If buffer is full - stop reading */
-  bud_client_throttle(client, side, &side->input);
+  /* bud_client_prefer_chacha() might have cleared some */
+  SSL_set_options(ssl, SSL_CTX_get_options(client->ssl_ctx));
+  SSL_set_ex_data(ssl, kBudSSLClientIndex, NULL);
+  SSL_set_ex_data(ssl, kBudSSLSNIIndex, NULL);
+  bud_bio_set_buffer(SSL_get_rbio(ssl), NULL);
+  bud_bio_set_buffer(SSL_get_wbio(ssl), NULL);
+
+  config->ssl_pool[config->ssl_pool_count++] = ssl;
+  return 1;
 }
 
 
-void bud_client_cycle(bud_client_t* client) {
-  /* Parsing, must wait */
-  if (client->hello_parse != kBudProgressDone) {
-    bud_client_parse_hello(client);
+bud_error_t bud_client_ssl_pool_init(bud_config_t* config) {
+  config->ssl_pool = NULL;
+  config->ssl_pool_count = 0;
+  if (config->pool.ssl_objects <= 0)
+    return bud_ok();
+
+  config->ssl_pool = malloc(sizeof(*config->ssl_pool) *
+                            config->pool.ssl_objects);
+  if (config->ssl_pool == NULL)
+    return bud_error_str(kBudErrNoMem, "ssl_pool");
+
+  return bud_ok();
+}
+
+
+void bud_client_ssl_pool_free(bud_config_t* config) {
+  while (config->ssl_pool_count > 0)
+    SSL_free(config->ssl_pool[--config->ssl_pool_count]);
+  free(config->ssl_pool);
+  config->ssl_pool = NULL;
+}
+
+
+void bud_client_side_init(bud_client_side_t* side,
+                          bud_client_side_type_t type,
+                          bud_client_t* client) {
+  ringbuffer_pool* pool;
+  bud_config_buffer_t* conf;
+  size_t max_size;
+
+  side->type = type;
+  side->init = 0;
+  side->tcp.data = client;
+  memset(&side->output_queue, 0, sizeof(side->output_queue));
+
+  if (type == kBudFrontend) {
+    pool = &client->config->frontend_pool;
+    conf = &client->config->frontend.buffer;
   } else {
-    if (bud_client_backend_in(client) != 0)
-      return;
-    if (bud_client_backend_out(client) != 0)
-      return;
-    if (bud_client_send(client, &client->frontend) != 0)
-      return;
-    if (bud_client_send(client, &client->backend) != 0)
-      return;
+    pool = &client->config->backend_pool;
+    conf = &client->config->backend.buffer;
   }
+  max_size = (size_t) conf->chunk_size * conf->chunk_count;
+
+  /*
+   * Mirrored buffers are contiguous (reads and writes never wrap), but cost
+   * a few syscalls - fall back to pooled chunks if mapping fails.
+   * If lazy - do not allocate anything until the data will arrive.
+   */
+  if (!conf->mirror || ringbuffer_init_mirror(&side->input, max_size) != 0)
+    ringbuffer_init_pool(&side->input, pool, client->config->pool.lazy_buffers);
+  if (!conf->mirror || ringbuffer_init_mirror(&side->output, max_size) != 0) {
+    ringbuffer_init_pool(&side->output,
+                         pool,
+                         client->config->pool.lazy_buffers);
+  }
+  ringbuffer_set_max_size(&side->input, max_size);
+  ringbuffer_set_max_size(&side->output, max_size);
+  side->high_watermark = conf->high_watermark;
+  side->low_watermark = conf->low_watermark;
+  side->reading = kBudProgressNone;
+  side->shutdown = kBudProgressNone;
+  side->close = kBudProgressNone;
+  side->write = kBudProgressNone;
+  side->write_head = 0;
+  side->write_count = 0;
+  side->write_size = 0;
+  side->write_deadline = 0;
+  side->uring_waiting = 0;
+  side->zerocopy = 0;
+  side->zerocopy_count = 0;
+  side->zerocopy_next = 0;
 }
 
 
-void bud_client_parse_hello(bud_client_t* client) {
-  bud_config_t* config;
-  bud_error_t err;
-  char* data;
-  size_t size;
+void bud_client_side_destroy(bud_client_side_t* side) {
+  ringbuffer_destroy(&side->input);
+  ringbuffer_destroy(&side->output);
+}
 
-  /* Already running, ignore */
-  if (client->hello_parse != kBudProgressNone)
-    return;
 
-  if (ringbuffer_is_empty(&client->frontend.input))
+/* Best effort, kernel's defaults are used if any of these fail */
+void bud_client_side_tune(bud_client_t* client,
+                          bud_client_side_t* side,
+                          bud_config_buffer_t* conf) {
+  uv_os_fd_t fd;
+  int sndbuf;
+  int rcvbuf;
+  int lowat;
+  int busy;
+  int zerocopy;
+
+  busy = client->config->busy_poll.sockets;
+  zerocopy = side == &client->frontend && client->config->zerocopy_init;
+  if (conf->sndbuf == 0 &&
+      conf->rcvbuf == 0 &&
+      conf->notsent_lowat == 0 &&
+      busy <= 0 &&
+      !zerocopy) {
+    return;
+  }
+  if (uv_fileno((uv_handle_t*) &side->tcp, &fd) != 0)
     return;
 
-  config = client->config;
-  data = ringbuffer_read_next(&client->frontend.input, &size);
-  err = bud_parse_client_hello(data, (size_t) size, &client->hello);
+  /*
+   * "auto": kernel holds about as much as this side's buffer does before
+   * the other side is throttled, and writes are reported only once the
+   * unsent data is below the low watermark. So the backpressure stays in
+   * the ringbuffers, instead of megabytes queued in the socket
+   */
+  sndbuf = conf->sndbuf;
+  if (sndbuf == BUD_CONFIG_SOCKET_AUTO)
+    sndbuf = conf->high_watermark;
+  rcvbuf = conf->rcvbuf;
+  if (rcvbuf == BUD_CONFIG_SOCKET_AUTO)
+    rcvbuf = conf->high_watermark;
+  lowat = conf->notsent_lowat;
+  if (lowat == BUD_CONFIG_SOCKET_AUTO)
+    lowat = conf->low_watermark;
+
+  if (sndbuf > 0)
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  if (rcvbuf > 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef TCP_NOTSENT_LOWAT
+  if (lowat > 0)
+    setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+#endif  /* TCP_NOTSENT_LOWAT */
+#ifdef SO_BUSY_POLL
+  if (busy > 0)
+    setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy, sizeof(busy));
+#endif  /* SO_BUSY_POLL */
+#ifdef BUD_CLIENT_ZEROCOPY
+  /* Stays off if the kernel doesn't know it */
+  if (zerocopy &&
+      !setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &zerocopy, sizeof(zerocopy))) {
+    side->zerocopy = client->config->frontend.zerocopy;
+  }
+#endif  /* BUD_CLIENT_ZEROCOPY */
+}
 
-  /* Parser need more data, wait for it */
-  if (err.code == kBudErrParserNeedMore)
+
+void bud_client_cork(bud_client_t* client, int on) {
+#ifdef TCP_CORK
+  uv_os_fd_t fd;
+
+  if (uv_fileno((uv_handle_t*) &client->frontend.tcp, &fd) != 0)
+    return;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) != 0)
     return;
+  client->corked = on;
+#endif  /* TCP_CORK */
+}
 
-  if (!bud_is_ok(err)) {
-    NOTICE(&client->frontend,
-           "failed to parse hello: %d - \"%s\"",
-           err.code,
-           err.str);
-    goto fatal;
+
+/*
+ * The whole flight (ServerHello...ServerHelloDone, or the abbreviated one)
+ * is written by a single SSL_read(), and goes out in one writev from
+ * bud_client_flush(). Cork holds partial segments of it while libuv writes
+ * the rest, and is released once it is all in the kernel - and OpenSSL is
+ * waiting for the client
+ */
+void bud_client_uncork(bud_client_t* client) {
+  if (!client->corked)
+    return;
+  if (client->frontend.write_count != 0 ||
+      ringbuffer_size(&client->frontend.output) != 0) {
+    return;
+  }
+  if (client->ssl != NULL &&
+      !SSL_is_init_finished(client->ssl) &&
+      !SSL_want_read(client->ssl)) {
+    return;
   }
 
-  /* Parse success, perform SNI lookup */
-  if (config->sni.enabled && client->hello.servername_len != 0) {
-    client->sni_req = bud_http_get(config->sni.pool,
-                                   config->sni.query_fmt,
-                                   client->hello.servername,
-                                   client->hello.servername_len,
-                                   bud_client_sni_cb,
-                                   &err);
-    client->sni_req->data = client;
-    if (!bud_is_ok(err)) {
-      NOTICE(&client->frontend,
-             "failed to request SNI: %d - \"%s\"",
-             err.code,
-             err.str);
-      goto fatal;
-    }
+  bud_client_cork(client, 0);
+}
 
-    client->hello_parse = kBudProgressRunning;
-  /* Perform OCSP stapling request */
-  } else if (config->stapling.enabled && client->hello.ocsp_request != 0) {
-    err = bud_client_ocsp_stapling(client);
-    if (!bud_is_ok(err))
-      goto fatal;
-  }
 
-  if (client->hello_parse != kBudProgressNone)
-    return;
+int bud_client_backend_init(bud_client_t* client, int is_pipe) {
+  int r;
 
-  client->hello_parse = kBudProgressDone;
-  bud_client_cycle(client);
-  return;
+  if (client->backend.init)
+    return 0;
 
-fatal:
-  client->hello_parse = kBudProgressDone;
-  bud_client_close(client, &client->frontend);
+  if (is_pipe)
+    r = uv_pipe_init(client->config->loop, &client->backend.pipe, 0);
+  else
+    r = uv_tcp_init(client->config->loop, &client->backend.tcp);
+  if (r != 0)
+    return r;
+
+  client->backend.init = 1;
+  client->backend.tcp.data = client;
+  return 0;
 }
 
 
-void bud_client_sni_cb(bud_http_request_t* req, bud_error_t err) {
-  bud_client_t* client;
-  bud_config_t* config;
-  bud_error_t sni_err;
-  bud_error_t stapling_err;
+void bud_client_side_close(bud_client_t* client, bud_client_side_t* side) {
+  int r;
+  int i;
+  bud_client_write_t* w;
+  uv_os_fd_t fd;
+  struct linger linger;
+
+  /* Attempts are abandoned, client's own handle has no socket yet */
+  if (side == &client->backend && client->race != NULL) {
+    bud_client_race_close(client->race);
+    client->race = NULL;
+  }
 
-  client = req->data;
-  config = client->config;
+  /* Never connected, but close_cb is expected anyway */
+  if (!side->init) {
+    r = bud_client_backend_init(client, 0);
+    ASSERT(r == 0, "uv_tcp_init() failed");
+  }
 
-  client->sni_req = NULL;
-  client->hello_parse = kBudProgressDone;
-  if (!bud_is_ok(err)) {
-    WARNING(&client->frontend, "SNI cb failed: %d - \"%s\"", err.code, err.str);
-    goto fatal;
+  /*
+   * Kernel still sends straight from `output`, which is about to be reused.
+   * Reset drops the unsent data at close() instead (graceful closes wait
+   * for `output` to drain, so these are the forced ones)
+   */
+  if (side->zerocopy_count != 0 &&
+      uv_fileno((uv_handle_t*) &side->tcp, &fd) == 0) {
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
   }
 
-  if (req->code == 404) {
-    /* Not found */
-    DBG(&client->frontend,
-        "SNI name not found: \"%.*s\"",
-        client->hello.servername_len,
-        client->hello.servername);
-    goto done;
+  /* Last look at the connection, the socket is gone by close_cb */
+  if (side == &client->frontend &&
+      client->config->metrics.tcp_info.enabled &&
+      client->stats.handshake != 0) {
+    bud_client_tcp_sample(client);
   }
 
-  /* Parse incoming JSON */
-  sni_err = bud_sni_from_json(config, req->response, &client->sni_ctx);
-  if (!bud_is_ok(sni_err)) {
-    WARNING(&client->frontend,
-           "SNI from json failed: %d - \"%s\"",
-           err.code,
-           err.str);
-    goto fatal;
+  uv_close((uv_handle_t*) &side->tcp, bud_client_close_cb);
+
+  /* Kernel may still read from `output`, keep it until the writes are done */
+  if (client->config->uring != NULL && side->write_count != 0) {
+    for (i = 0; i < side->write_count; i++) {
+      w = &side->writes[(side->write_head + i) % BUD_CLIENT_MAX_WRITES];
+      bud_uring_cancel(client->config->uring, &w->op);
+    }
+    side->uring_waiting = side->write_count;
+    client->destroy_waiting += side->write_count;
   }
 
-  /* Success */
-  DBG(&client->frontend,
-      "SNI name found: \"%.*s\"",
-      client->hello.servername_len,
-      client->hello.servername);
-  if (!SSL_set_ex_data(client->ssl, kBudSSLSNIIndex, &client->sni_ctx)) {
-    WARNING(&client->frontend,
-           "Failed to set app data for SNI: \"%.*s\"",
-           client->hello.servername_len,
-           client->hello.servername);
-    goto fatal;
+  /* Nothing to flush anymore */
+  if (side == &client->frontend && client->coalesce_init) {
+    client->coalesce_init = 0;
+    uv_close((uv_handle_t*) &client->coalesce_timer, bud_client_close_cb);
   }
 
-done:
-  /* Request stapling info if needed */
-  if (config->stapling.enabled && client->hello.ocsp_request != 0) {
-    stapling_err = bud_client_ocsp_stapling(client);
-    if (!bud_is_ok(stapling_err))
-      goto fatal;
+  /* Paused job is abandoned with the SSL */
+  if (side == &client->frontend &&
+      client->async_poll_state == kBudProgressRunning) {
+    client->async_poll_state = kBudProgressDone;
+    uv_close((uv_handle_t*) &client->async_poll, bud_client_close_cb);
+  }
+  if (side == &client->frontend && client->async_timer_init) {
+    client->async_timer_init = 0;
+    uv_close((uv_handle_t*) &client->async_timer, bud_client_close_cb);
   }
-  json_value_free(req->response);
+}
 
-  if (client->hello_parse == kBudProgressDone)
-    bud_client_cycle(client);
-  return;
 
-fatal:
-  bud_client_close(client, &client->frontend);
+ringbuffer* bud_client_side_in(bud_client_t* client, bud_client_side_t* side) {
+  if (!client->config->frontend.passthrough)
+    return &side->input;
+
+  /* Passthrough reads straight into the opposite side's output */
+  if (side == &client->backend)
+    return &client->frontend.output;
+
+  /* ...once the hello is parsed */
+  if (client->hello_parse == kBudProgressDone)
+    return &client->backend.output;
+  return &client->frontend.input;
 }
 
 
-int bud_client_backend_in(bud_client_t* client) {
+int bud_client_passthrough_start(bud_client_t* client) {
+  int r;
   char* data;
   size_t size;
-  int written;
-  int err;
 
-  written = 0;
-  while (!ringbuffer_is_empty(&client->backend.input)) {
-    data = ringbuffer_read_next(&client->backend.input, &size);
-    written = SSL_write(client->ssl, data, size);
-    DBG(&client->frontend, "SSL_write() => %d", written);
-    DBG(&client->frontend,
-        "frontend.output => %d",
-        ringbuffer_size(&client->frontend.output));
-    if (written < 0)
-      break;
+  if (client->config->frontend.proxyline) {
+    r = bud_client_prepend_proxyline(client);
+    if (r != 0)
+      return r;
+  }
 
-    ASSERT(written == (int) size, "SSL_write() did unexpected partial write");
-    ringbuffer_read_skip(&client->backend.input, written);
+  /* Handshake is backend's business from now on */
+  client->handshake_deadline = 0;
 
-    /* info_cb() has closed front-end */
-    if (client->frontend.close != kBudProgressNone)
+  /* Hello is buffered for parsing, move it to the backend */
+  while (!ringbuffer_is_empty(&client->frontend.input)) {
+    data = ringbuffer_read_next(&client->frontend.input, &size);
+    if (ringbuffer_write_into(&client->backend.output, data, size) != 0)
       return -1;
+    ringbuffer_read_skip(&client->frontend.input, size);
   }
 
-  if (bud_client_throttle(client,
-                          &client->frontend,
-                          &client->frontend.output) == -1) {
-    /* Throttle error */
-    return -1;
-  }
+  return 0;
+}
 
-  if (written >= 0)
-    return 0;
 
-  err = SSL_get_error(client->ssl, written);
-  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+int bud_client_handoff(bud_client_t* client) {
+  bud_config_t* config;
+  bud_handoff_t* handoff;
+  bud_error_t err;
+  size_t frontend;
+  size_t backend;
+  uint32_t index;
+  unsigned char* data;
+
+  config = client->config;
+  if (client->handoff)
     return 0;
 
-  NOTICE(&client->frontend,
-         "SSL_write failed: %d - \"%s\"",
-         err,
-         bud_sslerror_str(err));
-  bud_client_close(client, &client->frontend);
-  return -1;
-}
+  /* Half-closed or closing ones just finish, as do TLS terminated */
+  if (!config->frontend.passthrough ||
+      client->close != kBudProgressNone ||
+      client->frontend.shutdown != kBudProgressNone ||
+      client->backend.shutdown != kBudProgressNone) {
+    return -1;
+  }
 
+  /* Not a relay yet, or the kernel still has some of `output` */
+  if (client->proxy_parse != kBudProgressDone ||
+      client->hello_parse != kBudProgressDone ||
+      client->connect != kBudProgressDone ||
+      client->frontend.write_count != 0 ||
+      client->backend.write_count != 0 ||
+      client->frontend.zerocopy_count != 0 ||
+      client->flush_queued ||
+      client->budget_queued ||
+      client->zerocopy_queued ||
+      client->shape.waiting) {
+    return 1;
+  }
 
-int bud_client_backend_out(bud_client_t* client) {
-  int read;
-  int err;
-  size_t avail;
-  char* out;
+  frontend = ringbuffer_size(&client->frontend.output);
+  backend = ringbuffer_size(&client->backend.output);
+  if (BUD_HANDOFF_HEADER_SIZE + frontend + backend > BUD_IPC_MAX_SIZE)
+    return 1;
 
-  /* If buffer is full - stop reading */
-  err = bud_client_throttle(client,
-                            &client->backend,
-                            &client->backend.output);
-  if (err < 0) {
-    return err;
-  } else if (err == 1) {
-    return 0;
+  handoff = bud_handoff_new(config,
+                            BUD_HANDOFF_HEADER_SIZE + frontend + backend);
+  if (handoff == NULL)
+    return -1;
+  handoff->data = client;
+
+  index = client->listener - config->listeners;
+  data = (unsigned char*) handoff->payload;
+  data[0] = (index >> 24) & 0xff;
+  data[1] = (index >> 16) & 0xff;
+  data[2] = (index >> 8) & 0xff;
+  data[3] = index & 0xff;
+  data[4] = (frontend >> 24) & 0xff;
+  data[5] = (frontend >> 16) & 0xff;
+  data[6] = (frontend >> 8) & 0xff;
+  data[7] = frontend & 0xff;
+  data += BUD_HANDOFF_HEADER_SIZE;
+  ringbuffer_read_into(&client->frontend.output, (char*) data, frontend);
+  ringbuffer_read_into(&client->backend.output,
+                       (char*) data + frontend,
+                       backend);
+
+  /* Whatever comes next stays in the sockets for the new worker */
+  uv_read_stop((uv_stream_t*) &client->frontend.tcp);
+  uv_read_stop((uv_stream_t*) &client->backend.tcp);
+  client->frontend.reading = kBudProgressNone;
+  client->backend.reading = kBudProgressNone;
+  bud_timer_wheel_cancel(&client->timeout);
+  client->handoff = 1;
+
+  DBG_LN(&client->frontend, "handoff");
+  err = bud_handoff_send(handoff,
+                         (uv_stream_t*) &config->ipc,
+                         (uv_stream_t*) &client->frontend.tcp,
+                         (uv_stream_t*) &client->backend.tcp,
+                         bud_client_handoff_cb);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    bud_handoff_free(handoff);
+    client->stats.reason = "handoff failed";
+    bud_client_handoff_close(client);
   }
+  return 0;
+}
 
-  do {
-    avail = 0;
-    out = ringbuffer_write_ptr(&client->backend.output, &avail);
-    read = SSL_read(client->ssl, out, avail);
-    DBG(&client->frontend, "SSL_read() => %d", read);
-    if (read > 0) {
-      ringbuffer_write_append(&client->backend.output, read);
-      if (bud_client_send(client, &client->backend) != 0)
-        return -1;
-    }
-
-    /* info_cb() has closed front-end */
-    if (client->frontend.close != kBudProgressNone)
-      return -1;
-  } while (read > 0);
 
-  if (read > 0)
-    return 0;
+void bud_client_handoff_cb(bud_handoff_t* handoff, int status) {
+  bud_client_t* client;
 
-  err = SSL_get_error(client->ssl, read);
-  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-    return 0;
+  client = handoff->data;
+  bud_handoff_free(handoff);
 
-  if (err != SSL_ERROR_ZERO_RETURN) {
-    NOTICE(&client->frontend,
-           "SSL_read failed : %d - \"%s\"",
-           err,
-           bud_sslerror_str(err));
+  /* Buffered data is gone already, nothing to resume */
+  if (status != 0) {
+    WARNING(&client->frontend,
+            "handoff failed: %d - \"%s\"",
+            status,
+            uv_strerror(status));
+    client->stats.reason = "handoff failed";
+  } else {
+    client->stats.reason = "handoff";
   }
-  bud_client_close(client, &client->frontend);
-  return -1;
+  bud_client_handoff_close(client);
 }
 
 
-int bud_client_throttle(bud_client_t* client,
-                        bud_client_side_t* side,
-                        ringbuffer* buf) {
-  int err;
-  bud_client_side_t* opposite;
+void bud_client_handoff_close(bud_client_t* client) {
+  /* The other process has the sockets, closing them here ends nothing */
+  client->close = kBudProgressDone;
+  client->frontend.close = kBudProgressDone;
+  client->backend.close = kBudProgressDone;
+  bud_client_side_close(client, &client->frontend);
+  bud_client_side_close(client, &client->backend);
+}
 
-  if (ringbuffer_is_full(buf)) {
-    opposite = side == &client->frontend ? &client->backend : &client->frontend;
-    if (opposite->reading != kBudProgressRunning)
-      return 1;
 
-    DBG(opposite, "throttle, buffer full: %ld", ringbuffer_size(buf));
+int bud_client_resume(bud_client_t* client, bud_handoff_t* handoff) {
+  int r;
+  int fd;
+  int is_pipe;
+  size_t frontend;
+  size_t backend;
+  const unsigned char* data;
+  bud_config_t* config;
 
-    err = uv_read_stop((uv_stream_t*) &opposite->tcp);
-    if (err != 0) {
-      NOTICE(opposite,
-             "uv_read_stop failed: %d - \"%s\"",
-             err,
-             uv_strerror(err));
-      bud_client_close(client, opposite);
-      return -1;
-    }
-    opposite->reading = kBudProgressNone;
+  config = client->config;
+
+  /* Parsed by the old worker, see bud_client_create_handoff() */
+  data = (const unsigned char*) handoff->payload;
+  frontend = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+  backend = handoff->size - BUD_IPC_HEADER_SIZE - BUD_HANDOFF_HEADER_SIZE -
+            frontend;
+  data += BUD_HANDOFF_HEADER_SIZE;
+
+  /* Hello went to the backend long ago */
+  client->proxy_parse = kBudProgressDone;
+  client->hello_parse = kBudProgressDone;
+  client->early_read = kBudProgressDone;
+
+  fd = bud_handoff_dup(handoff, 1);
+  if (fd == -1)
+    return -1;
+  is_pipe = handoff->types[1] == UV_NAMED_PIPE;
+  r = bud_client_backend_init(client, is_pipe);
+  if (r == 0 && is_pipe)
+    r = uv_pipe_open(&client->backend.pipe, fd);
+  else if (r == 0)
+    r = uv_tcp_open(&client->backend.tcp, fd);
+  if (r != 0) {
+    close(fd);
+    return r;
+  }
+  client->connect = kBudProgressDone;
+  client->stats.connect = uv_now(config->loop);
+
+  /* Options are the socket's, but sides keep some of their state too */
+  bud_client_side_tune(client, &client->frontend, &config->frontend.buffer);
+  if (!is_pipe)
+    bud_client_side_tune(client, &client->backend, &config->backend.buffer);
+
+  if (ringbuffer_write_into(&client->frontend.output,
+                            (const char*) data,
+                            frontend) != 0 ||
+      ringbuffer_write_into(&client->backend.output,
+                            (const char*) data + frontend,
+                            backend) != 0) {
+    return -1;
+  }
+
+  /* Throttled as usual, if the buffered data is over the watermarks */
+  r = uv_read_start((uv_stream_t*) &client->frontend.tcp,
+                    bud_client_alloc_cb,
+                    bud_client_read_cb);
+  if (r != 0)
+    return r;
+  client->frontend.reading = kBudProgressRunning;
+  r = uv_read_start((uv_stream_t*) &client->backend.tcp,
+                    bud_client_alloc_cb,
+                    bud_client_read_cb);
+  if (r != 0)
+    return r;
+  client->backend.reading = kBudProgressRunning;
+
+  if (config->frontend.timeout.idle > 0) {
+    client->idle_deadline = uv_now(config->loop) +
+                            config->frontend.timeout.idle;
+  }
+  bud_client_timeout_update(client);
+
+  return 0;
+}
+
+
+bud_client_side_t* bud_client_side_by_tcp(bud_client_t* client, uv_tcp_t* tcp) {
+  if (tcp == &client->frontend.tcp)
+    return &client->frontend;
+  else
+    return &client->backend;
+}
+
+
+void bud_client_close(bud_client_t* client, bud_client_side_t* side) {
+  /* Sockets are on their way out, see bud_client_handoff_cb() */
+  if (client->handoff)
+    return;
+
+  if (client->close == kBudProgressRunning) {
+    /* Force close, even if waiting */
+    if (side->close == kBudProgressRunning) {
+      DBG_LN(side, "force closing");
+      bud_client_side_close(client, side);
+      side->close = kBudProgressDone;
+      client->close = kBudProgressDone;
+    }
+    return;
+  } else if (client->close == kBudProgressDone) {
+    return;
+  }
+
+  /* Close offending side, and wait for write finish on other side */
+  client->close = kBudProgressRunning;
+  if (client->stats.reason == NULL)
+    client->stats.reason = side == &client->frontend ? "frontend error" :
+                                                       "backend error";
+
+  if (side->type == kBudBackend &&
+      !ringbuffer_is_empty(&client->frontend.output)) {
+    client->frontend.close = kBudProgressRunning;
+  } else {
+    DBG_LN(&client->frontend, "force closing (and waiting for other)");
+    bud_client_side_close(client, &client->frontend);
+    client->frontend.close = kBudProgressDone;
+  }
+
+  if (side->type == kBudFrontend &&
+      !ringbuffer_is_empty(&client->backend.output)) {
+    client->backend.close = kBudProgressRunning;
+  } else {
+    /* Client is gone, but its backend may serve the next one */
+    if (side->type == kBudFrontend)
+      bud_client_http_release(client);
+    DBG_LN(&client->backend, "force closing (and waiting for other)");
+    bud_client_side_close(client, &client->backend);
+    client->backend.close = kBudProgressDone;
+  }
+
+  /* Cycle data if one of backends is not closed */
+  if (client->backend.close != kBudProgressDone ||
+      client->frontend.close != kBudProgressDone) {
+    bud_client_cycle(client);
+  }
+}
+
+
+void bud_client_close_cb(uv_handle_t* handle) {
+  bud_client_t* client;
+  bud_config_t* config;
+
+  client = (bud_client_t*) handle->data;
+
+  if (--client->destroy_waiting != 0)
+    return;
+
+  DBG_LN(&client->frontend, "close_cb");
+  BUD_PROBE4(client__close,
+             client,
+             client->stats.reason,
+             client->stats.bytes_in,
+             client->stats.bytes_out);
+  if (client->config->log.access && client->peer.ss_family != 0)
+    bud_client_log_access(client);
+  if (client->ssl != NULL && client->peer.ss_family != 0)
+    bud_client_log_trace(client);
+  bud_capture_client(client);
+  if (client->ssl != NULL && client->stats.handshake == 0)
+    bud_client_count_failure(client);
+  bud_client_count_close(client);
+
+  /* Everything that might call back into the client, or hold others */
+  if (client->selected != NULL)
+    client->selected->active--;
+  bud_client_quota_release(client);
+  if (client->hs != NULL && client->hs->sni_pending != NULL)
+    bud_client_sni_leave(client);
+  if (client->hs != NULL && client->hs->session_req != NULL)
+    bud_http_request_cancel(client->hs->session_req);
+  if (client->handshake_parked)
+    QUEUE_REMOVE(&client->handshake_member);
+  bud_client_handshake_release(client);
+  if (client->flush_queued)
+    QUEUE_REMOVE(&client->flush_member);
+  if (client->zerocopy_queued)
+    QUEUE_REMOVE(&client->zerocopy_member);
+  client->zerocopy_queued = 0;
+  if (client->budget_queued)
+    QUEUE_REMOVE(&client->budget_member);
+  bud_timer_wheel_cancel(&client->timeout);
+  bud_timer_wheel_cancel(&client->shape.entry);
+  QUEUE_REMOVE(&client->member);
+
+  client->selected = NULL;
+  if (client->hs != NULL)
+    client->hs->session_req = NULL;
+
+  /* The rest is freed by teardown_cb(), see `pool.teardown_budget` */
+  config = client->config;
+  if (config->teardown_init) {
+    QUEUE_INSERT_TAIL(&config->teardown_queue, &client->member);
+    uv_idle_start(&config->teardown_idle, bud_client_teardown_cb);
+    return;
+  }
+
+  bud_client_destroy(client);
+
+  /* Accepting might have been stopped by `frontend.max_clients` */
+  bud_server_resume_all(config);
+  if (config->draining)
+    bud_worker_drain_check(config);
+}
+
+
+void bud_client_destroy(bud_client_t* client) {
+  bud_client_side_destroy(&client->frontend);
+  bud_client_side_destroy(&client->backend);
+  ringbuffer_destroy(&client->upstream_in);
+  ringbuffer_destroy(&client->upstream_out);
+  bud_spill_free(client->spill);
+
+  if (client->ssl != NULL && !bud_client_ssl_recycle(client))
+    SSL_free(client->ssl);
+  if (client->upstream != NULL)
+    SSL_free(client->upstream);
+  if (client->sni_ctx != NULL)
+    bud_sni_context_unref(client->sni_ctx);
+  bud_client_handshake_free(client);
+
+  client->ssl = NULL;
+  client->upstream = NULL;
+  client->spill = NULL;
+  client->sni_ctx = NULL;
+  client->context = NULL;
+  bud_slab_free(&client->config->client_slab, client);
+}
+
+
+void bud_client_handshake_free(bud_client_t* client) {
+  bud_client_handshake_t* hs;
+
+  hs = client->hs;
+  if (hs == NULL)
+    return;
+
+  /* Lookups and the slab wait list are left on close, or before done */
+  if (hs->session != NULL)
+    SSL_SESSION_free(hs->session);
+  bud_hello_parser_destroy(&hs->hello_parser);
+  bud_slab_free(&client->config->handshake_slab, hs);
+  client->hs = NULL;
+}
+
+
+bud_error_t bud_client_teardown_init(bud_config_t* config) {
+  int r;
+
+  QUEUE_INIT(&config->teardown_queue);
+  if (config->pool.teardown_budget <= 0)
+    return bud_ok();
+
+  r = uv_idle_init(config->loop, &config->teardown_idle);
+  if (r != 0)
+    return bud_error_num(kBudErrTeardownIdle, r);
+  config->teardown_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_teardown_finalize(bud_config_t* config) {
+  bud_client_t* client;
+  QUEUE* q;
+
+  if (!config->teardown_init)
+    return;
+
+  while (!QUEUE_EMPTY(&config->teardown_queue)) {
+    q = QUEUE_HEAD(&config->teardown_queue);
+    client = QUEUE_DATA(q, bud_client_t, member);
+    QUEUE_REMOVE(q);
+    bud_client_destroy(client);
+  }
+
+  config->teardown_init = 0;
+  uv_close((uv_handle_t*) &config->teardown_idle, NULL);
+}
+
+
+void bud_client_teardown_cb(uv_idle_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE* q;
+  uint64_t deadline;
+
+  config = container_of(handle, bud_config_t, teardown_idle);
+
+  /* At least one client per iteration, however small the budget is */
+  deadline = uv_hrtime() + (uint64_t) config->pool.teardown_budget * 1000;
+  do {
+    q = QUEUE_HEAD(&config->teardown_queue);
+    client = QUEUE_DATA(q, bud_client_t, member);
+    QUEUE_REMOVE(q);
+    bud_client_destroy(client);
+  } while (!QUEUE_EMPTY(&config->teardown_queue) && uv_hrtime() < deadline);
+
+  if (QUEUE_EMPTY(&config->teardown_queue))
+    uv_idle_stop(handle);
+
+  /* Accepting might have been stopped by `frontend.max_clients` */
+  bud_server_resume_all(config);
+  if (config->draining)
+    bud_worker_drain_check(config);
+}
+
+
+void bud_client_alloc_cb(uv_handle_t* handle,
+                         size_t suggested_size,
+                         uv_buf_t* buf) {
+  bud_client_t* client;
+  bud_client_side_t* side;
+  ringbuffer* in;
+  size_t avail;
+  size_t room;
+  char* ptr;
+
+  client = handle->data;
+  side = bud_client_side_by_tcp(client, (uv_tcp_t*) handle);
+  in = bud_client_side_in(client, side);
+
+  /* Comes after the data in `spill`, or there is no room left for it */
+  if (side == &client->backend &&
+      client->spill != NULL &&
+      (client->spill->size != 0 ||
+       ringbuffer_size(in) >= side->high_watermark)) {
+    if (client->config->read_buf == NULL)
+      client->config->read_buf = malloc(BUD_CLIENT_READ_BUF_SIZE);
+    *buf = uv_buf_init(client->config->read_buf,
+                       client->config->read_buf == NULL ?
+                           0 :
+                           BUD_CLIENT_READ_BUF_SIZE);
+    client->spill_read = 1;
+    return;
+  }
+
+  avail = 0;
+  ptr = ringbuffer_write_ptr(in, &avail);
+  *buf = uv_buf_init(ptr, avail);
+
+  /* Most of the chunk is free, or there is no room for more anyway */
+  room = ringbuffer_size(in) < in->max_size ?
+      in->max_size - ringbuffer_size(in) : 0;
+  if (ptr == NULL || avail >= in->chunk_size / 2 || room <= avail)
+    return;
+
+  /*
+   * Just a tail of the chunk is left, read whatever fits into the buffer in
+   * one go and copy it out in bud_client_read_cb(). libuv calls alloc_cb and
+   * read_cb back to back, so one buffer serves all clients.
+   */
+  if (client->config->read_buf == NULL) {
+    client->config->read_buf = malloc(BUD_CLIENT_READ_BUF_SIZE);
+    if (client->config->read_buf == NULL)
+      return;
+  }
+  if (room > BUD_CLIENT_READ_BUF_SIZE)
+    room = BUD_CLIENT_READ_BUF_SIZE;
+  *buf = uv_buf_init(client->config->read_buf, room);
+}
+
+
+void bud_client_read_cb(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf) {
+  int r;
+  bud_client_t* client;
+  bud_client_side_t* side;
+  bud_client_side_t* opposite;
+  ringbuffer* in;
+  uint64_t start;
+
+  client = stream->data;
+  start = bud_metrics_timer(client->config);
+  side = bud_client_side_by_tcp(client, (uv_tcp_t*) stream);
+  in = bud_client_side_in(client, side);
+
+  /* Commit data if there was no error */
+  r = 0;
+  if (nread > 0 && side == &client->backend && client->spill_read)
+    r = bud_client_spill_write(client, buf->base, nread);
+  else if (nread > 0 && buf->base == client->config->read_buf)
+    r = ringbuffer_write_into(in, buf->base, nread) == 0 ? 0 : -1;
+  else if (nread >= 0)
+    r = ringbuffer_write_append(in, nread);
+  if (side == &client->backend)
+    client->spill_read = 0;
+
+  DBG(side, "after read_cb() => %d", nread);
+
+  /* Plaintext responses, TLS backends are not reused */
+  if (nread > 0 && side == &client->backend)
+    bud_client_http_feed(client, &client->http.response, buf->base, nread);
+
+  if (nread > 0 && side == &client->frontend) {
+    if (client->stats.first_byte == 0)
+      client->stats.first_byte = uv_now(client->config->loop);
+    client->stats.bytes_in += nread;
+    bud_metrics_add(client->config, kBudMetricBytesIn, nread);
+  } else if (nread > 0 && client->stats.backend == 0) {
+    client->stats.backend = uv_now(client->config->loop);
+  }
+  if (nread > 0 && side == &client->backend)
+    bud_client_latency_observe(client);
+  if (nread > 0) {
+    bud_client_touch(client);
+    bud_client_class_count(client, nread);
+  }
+  if (nread > 0 && client->config->frontend.timeout.idle > 0) {
+    client->idle_deadline = uv_now(client->config->loop) +
+                            client->config->frontend.timeout.idle;
+    bud_client_timeout_update(client);
+  }
+
+  /* Handle EOF */
+  if (nread == UV_EOF) {
+    side->reading = kBudProgressDone;
+    if (client->stats.reason == NULL)
+      client->stats.reason = side == &client->frontend ? "frontend eof" :
+                                                         "backend eof";
+
+    /* Shutdown opposite side */
+    opposite = side == &client->frontend ? &client->backend : &client->frontend;
+    if (bud_client_shutdown(client, opposite) != 0)
+      return;
+  }
+
+#ifdef BUD_CLIENT_ZEROCOPY
+  /* EPOLLERR of MSG_ZEROCOPY notifications wakes the reads too */
+  if (side->zerocopy_count != 0)
+    bud_client_zerocopy_reap(client, side);
+#endif  /* BUD_CLIENT_ZEROCOPY */
+
+  /* Try writing out data anyway */
+  bud_client_cycle(client);
+  bud_metrics_elapsed(client->config, kBudMetricReadTime, start);
+
+  if ((r != 0 || nread < 0) && nread != UV_EOF) {
+    if (nread < 0)
+      NOTICE(side, "read_cb failed: %d - \"%s\"", nread, uv_strerror(nread));
+    else
+      NOTICE(side, "write_append failed: %d", r);
+
+    /* Unrecoverable socket error, close */
+    return bud_client_close(client, side);
+  }
+
+  /* If buffer is full - stop reading */
+  if (client->config->frontend.passthrough) {
+    opposite = side == &client->frontend ? &client->backend : &client->frontend;
+    r = bud_client_throttle(client, opposite, in);
+  } else {
+    r = bud_client_throttle(client, side, in);
+  }
+
+  /* Over the bandwidth - stop reading too, until the bucket refills */
+  if (r >= 0 && nread > 0 && side == &client->backend)
+    bud_client_shape_spend(client, nread);
+}
+
+
+void bud_client_cycle(bud_client_t* client) {
+  bud_mem_tag_t prev;
+
+  /* SSL buffers and session state are allocated in here */
+  prev = bud_mem_scope(kBudMemSSL);
+  bud_client_cycle_ssl(client);
+  bud_mem_scope(prev);
+
+  /* Whatever is left in the buffers now has waited since this iteration */
+  if (client->config->metrics.timing)
+    bud_client_queue_marks(client);
+}
+
+
+void bud_client_queue_marks(bud_client_t* client) {
+  bud_client_queue_mark(client,
+                        &client->frontend.output_queue,
+                        &client->frontend.output);
+  bud_client_queue_mark(client,
+                        &client->backend.output_queue,
+                        &client->backend.output);
+  bud_client_queue_mark(client,
+                        &client->plain_queue,
+                        bud_client_plain_in(client));
+}
+
+
+void bud_client_queue_mark(bud_client_t* client,
+                           bud_client_queue_t* queue,
+                           ringbuffer* rb) {
+  uint64_t total;
+  uint64_t now;
+  int last;
+
+  total = queue->consumed + ringbuffer_size(rb);
+  if (total <= queue->marked)
+    return;
+  queue->marked = total;
+
+  /* Same iteration, or out of marks - the last one covers them */
+  now = uv_now(client->config->loop);
+  last = (queue->head + queue->count - 1) % BUD_CLIENT_QUEUE_MARKS;
+  if (queue->count != 0 &&
+      (queue->at[last] == now || queue->count == BUD_CLIENT_QUEUE_MARKS)) {
+    queue->end[last] = total;
+    return;
+  }
+
+  last = (queue->head + queue->count) % BUD_CLIENT_QUEUE_MARKS;
+  queue->end[last] = total;
+  queue->at[last] = now;
+  queue->count++;
+}
+
+
+/* Called before `size` bytes are skipped in `rb` */
+void bud_client_queue_consume(bud_client_t* client,
+                              bud_client_queue_t* queue,
+                              ringbuffer* rb,
+                              size_t size,
+                              bud_metric_t hist) {
+  uint64_t now;
+
+  if (!client->config->metrics.timing)
+    return;
+
+  /* Written and taken out in the same iteration, waited for nothing */
+  bud_client_queue_mark(client, queue, rb);
+
+  now = uv_now(client->config->loop);
+  queue->consumed += size;
+  while (queue->count != 0 && queue->end[queue->head] <= queue->consumed) {
+    bud_metrics_observe(client->config, hist, now - queue->at[queue->head]);
+    queue->head = (queue->head + 1) % BUD_CLIENT_QUEUE_MARKS;
+    queue->count--;
+  }
+}
+
+
+void bud_client_cycle_ssl(bud_client_t* client) {
+  /* Parsing, must wait */
+  if (client->proxy_parse != kBudProgressDone)
+    return bud_client_parse_proxy(client);
+  if (client->hello_parse != kBudProgressDone)
+    return bud_client_parse_hello(client);
+
+  /* Before OpenSSL looks up the session, i.e. before the SNI callback */
+  if (client->hs != NULL && !client->hs->session_bound)
+    bud_client_session_bind(client);
+
+  /* Backends are down, don't spend a handshake on the client */
+  if (bud_client_backend_down(client))
+    return bud_client_flush(client);
+
+  /* Servername is known, but nothing is spent on the client yet */
+  if (!bud_client_quota_admit(client))
+    return;
+
+  /* Deferred connect, servername is known now */
+  if (bud_client_connect_deferred(client) != 0)
+    return;
+
+  /* Waiting for external session cache */
+  if (client->hs != NULL && client->hs->session_req != NULL)
+    return;
+
+  /* Too many full handshakes in progress */
+  if (!bud_client_handshake_admit(client))
+    return;
+
+  /* Too many handshakes in this iteration */
+  if (!bud_client_handshake_allowed(client))
+    return;
+
+  /* Engine is still busy with the private key, its callback cycles again */
+  if (client->async_waiting)
+    return;
+
+  /* Passthrough, data is already in the output buffers */
+  if (client->config->frontend.passthrough)
+    return bud_client_flush(client);
+
+  if (bud_client_upstream_in(client) != 0)
+    return;
+  if (bud_client_backend_in(client) != 0)
+    return;
+  if (bud_client_backend_out(client) != 0)
+    return;
+  if (bud_client_upstream_out(client) != 0)
+    return;
+
+  /* Handshake might have just finished */
+  if (bud_client_connect_deferred(client) != 0)
+    return;
+  if (bud_client_backend_read(client) != 0)
+    return;
+  bud_client_flush(client);
+}
+
+
+int bud_client_backend_down(bud_client_t* client) {
+  /* Fatal internal_error alert */
+  static const char alert[] = { 0x15, 0x03, 0x01, 0x00, 0x02, 0x02, 0x50 };
+  bud_config_t* config;
+
+  config = client->config;
+  if (client->hs == NULL)
+    return 0;
+  if (client->hs->backend_down)
+    return 1;
+
+  /*
+   * Only before the first handshake message is processed, the private key
+   * work is spent right after. Connected client has a working backend.
+   */
+  if (!config->backend.health.fail_fast ||
+      client->ssl == NULL ||
+      !SSL_in_before(client->ssl) ||
+      client->connect == kBudProgressDone ||
+      client->close != kBudProgressNone) {
+    return 0;
+  }
+  if (!bud_backend_list_down(config, bud_client_backend_list(client)))
+    return 0;
+
+  DBG_LN(&client->frontend, "backends are down, failing fast");
+  client->hs->backend_down = 1;
+  client->stats.reason = "backend down";
+
+  /* Frontend waits for the alert to be written */
+  ringbuffer_write_into(&client->frontend.output, alert, sizeof(alert));
+  bud_client_close(client, &client->backend);
+  return 1;
+}
+
+
+int bud_client_plaintext(bud_client_t* client) {
+  static const char bad[] = "HTTP/1.1 400 Bad Request\r\n"
+                            "Content-Length: 0\r\n"
+                            "Connection: close\r\n\r\n";
+  char head[BUD_CLIENT_PLAINTEXT_MAX];
+  char reply[BUD_CLIENT_PLAINTEXT_MAX + 128];
+  char* out[RING_BUFFER_COUNT];
+  size_t size[ARRAY_SIZE(out)];
+  size_t count;
+  size_t len;
+  size_t n;
+  size_t i;
+  int r;
+
+  /* Records start with a content type (20-23), requests with a method */
+  count = ARRAY_SIZE(out);
+  ringbuffer_read_nextv(&client->frontend.input, out, size, &count);
+  if (count == 0 || size[0] == 0 || out[0][0] < 'A' || out[0][0] > 'Z')
+    return 0;
+
+  len = 0;
+  for (i = 0; i < count && len < sizeof(head); i++) {
+    n = size[i];
+    if (n > sizeof(head) - len)
+      n = sizeof(head) - len;
+    memcpy(head + len, out[i], n);
+    len += n;
+  }
+
+  /* Wait for the whole head, `frontend.timeout.handshake` bounds it */
+  for (i = 0; i + 4 <= len; i++)
+    if (memcmp(head + i, "\r\n\r\n", 4) == 0)
+      break;
+  if (i + 4 > len && len < sizeof(head))
+    return 1;
+
+  r = -1;
+  if (i + 4 <= len)
+    r = bud_client_plaintext_reply(reply, sizeof(reply), head, i + 2);
+
+  DBG(&client->frontend, "plaintext http, reply %d", r);
+  client->hello_parse = kBudProgressRunning;
+  client->stats.reason = "plaintext http";
+
+  /* Frontend waits for the reply to be written */
+  if (r > 0)
+    ringbuffer_write_into(&client->frontend.output, reply, r);
+  else
+    ringbuffer_write_into(&client->frontend.output, bad, sizeof(bad) - 1);
+  bud_client_close(client, &client->backend);
+  bud_client_flush(client);
+  return 1;
+}
+
+
+int bud_client_plaintext_reply(char* reply,
+                               size_t reply_len,
+                               const char* head,
+                               size_t len) {
+  const char* line;
+  const char* end;
+  const char* target;
+  const char* host;
+  size_t line_len;
+  size_t target_len;
+  size_t host_len;
+  size_t i;
+  int r;
+
+  /* `METHOD /target HTTP/1.x` */
+  end = memchr(head, '\r', len);
+  target = memchr(head, ' ', end - head);
+  if (target == NULL || target + 1 >= end || target[1] != '/')
+    return -1;
+  target++;
+  for (target_len = 0; target + target_len < end; target_len++)
+    if (target[target_len] <= ' ' || target[target_len] >= 0x7f)
+      break;
+  if (target + target_len == end ||
+      end - (target + target_len) < 6 ||
+      memcmp(target + target_len, " HTTP/", 6) != 0) {
+    return -1;
+  }
+
+  /* Host goes into the Location as is, so it is checked strictly */
+  host = NULL;
+  host_len = 0;
+  for (line = end + 2; line < head + len; line = end + 2) {
+    end = memchr(line, '\r', head + len - line);
+    if (end == NULL)
+      end = head + len;
+    line_len = end - line;
+    if (line_len <= 5 || strncasecmp(line, "host:", 5) != 0)
+      continue;
+
+    host = line + 5;
+    while (host < end && (*host == ' ' || *host == '\t'))
+      host++;
+    host_len = end - host;
+    while (host_len > 0 &&
+           (host[host_len - 1] == ' ' || host[host_len - 1] == '\t')) {
+      host_len--;
+    }
+    break;
+  }
+  if (host_len == 0)
+    return -1;
+  for (i = 0; i < host_len; i++) {
+    if ((host[i] >= 'a' && host[i] <= 'z') ||
+        (host[i] >= 'A' && host[i] <= 'Z') ||
+        (host[i] >= '0' && host[i] <= '9') ||
+        host[i] == '.' ||
+        host[i] == '-' ||
+        host[i] == ':' ||
+        host[i] == '[' ||
+        host[i] == ']') {
+      continue;
+    }
+    return -1;
+  }
+
+  r = snprintf(reply,
+               reply_len,
+               "HTTP/1.1 301 Moved Permanently\r\n"
+               "Location: https://%.*s%.*s\r\n"
+               "Content-Length: 0\r\n"
+               "Connection: close\r\n\r\n",
+               (int) host_len,
+               host,
+               (int) target_len,
+               target);
+  if (r < 0 || (size_t) r >= reply_len)
+    return -1;
+  return r;
+}
+
+
+void bud_client_parse_proxy(bud_client_t* client) {
+  bud_config_t* config;
+  bud_error_t err;
+  char* out[RING_BUFFER_COUNT];
+  size_t size[ARRAY_SIZE(out)];
+  size_t count;
+  size_t skip;
+  size_t i;
+  struct sockaddr_storage addr;
+
+  if (ringbuffer_is_empty(&client->frontend.input))
+    return;
+
+  config = client->config;
+
+  /* Same as for the hello, header may be split between reads */
+  count = ARRAY_SIZE(out);
+  ringbuffer_read_nextv(&client->frontend.input, out, size, &count);
+  skip = client->hs->proxy_parser.len;
+  err = bud_error(kBudErrParserNeedMore);
+  for (i = 0; i < count && err.code == kBudErrParserNeedMore; i++) {
+    if (skip >= size[i]) {
+      skip -= size[i];
+      continue;
+    }
+    err = bud_proxy_parser_execute(&client->hs->proxy_parser,
+                                   out[i] + skip,
+                                   size[i] - skip,
+                                   &addr);
+    skip = 0;
+  }
+
+  /* Parser need more data, wait for it */
+  if (err.code == kBudErrParserNeedMore)
+    return;
+
+  client->proxy_parse = kBudProgressDone;
+  if (!bud_is_ok(err)) {
+    NOTICE(&client->frontend,
+           "failed to parse PROXY header: %d - \"%s\"",
+           err.code,
+           err.str);
+    client->stats.reason = "bad proxyline";
+    goto fatal;
+  }
+
+  /* Everything after it is TLS */
+  ringbuffer_read_skip(&client->frontend.input,
+                       client->hs->proxy_parser.consumed);
+  if (addr.ss_family != 0)
+    client->peer = addr;
+
+  if (bud_client_denied(client) || bud_client_rate_limited(client))
+    goto fatal;
+  if (config->frontend.proxyline &&
+      !config->frontend.passthrough &&
+      bud_client_prepend_proxyline(client) != 0) {
+    goto fatal;
+  }
+
+  bud_client_cycle(client);
+  return;
+
+fatal:
+  bud_client_close(client, &client->frontend);
+}
+
+
+void bud_client_parse_hello(bud_client_t* client) {
+  bud_config_t* config;
+  bud_error_t err;
+  char* out[RING_BUFFER_COUNT];
+  size_t size[ARRAY_SIZE(out)];
+  size_t count;
+  size_t skip;
+  size_t i;
+  bud_context_t* sni_ctx;
+  int stale;
+
+  /* Already running, ignore */
+  if (client->hello_parse != kBudProgressNone)
+    return;
+
+  if (ringbuffer_is_empty(&client->frontend.input))
+    return;
+
+  config = client->config;
+
+  /* Plain HTTP on the TLS port, answered without TLS and backend */
+  if (config->frontend.http_redirect &&
+      client->hs->hello_parser.consumed == 0 &&
+      bud_client_plaintext(client)) {
+    return;
+  }
+
+  /* Feed only what parser hasn't seen yet, hello may span several chunks */
+  count = ARRAY_SIZE(out);
+  ringbuffer_read_nextv(&client->frontend.input, out, size, &count);
+  skip = client->hs->hello_parser.consumed;
+  err = bud_error(kBudErrParserNeedMore);
+  for (i = 0; i < count && err.code == kBudErrParserNeedMore; i++) {
+    if (skip >= size[i]) {
+      skip -= size[i];
+      continue;
+    }
+    err = bud_hello_parser_execute(&client->hs->hello_parser,
+                                   out[i] + skip,
+                                   size[i] - skip,
+                                   &client->hs->hello);
+    skip = 0;
+  }
+
+  /* Parser need more data, wait for it */
+  if (err.code == kBudErrParserNeedMore)
+    return;
+
+  if (!bud_is_ok(err)) {
+    NOTICE(&client->frontend,
+           "failed to parse hello: %d - \"%s\"",
+           err.code,
+           err.str);
+    client->stats.reason = "bad hello";
+    goto fatal;
+  }
+  client->stats.hello = uv_now(config->loop);
+  BUD_PROBE3(client__hello,
+             client,
+             client->hs->hello.servername,
+             client->hs->hello.servername_len);
+
+  /* Known bot stacks are dropped before any crypto is done for them */
+  if (bud_client_fingerprint_denied(client)) {
+    client->stats.reason = "fingerprint";
+    goto fatal;
+  }
+
+  /* Servername is all that passthrough needs, TLS is backend's business */
+  if (config->frontend.passthrough) {
+    if (bud_client_passthrough_start(client) != 0)
+      goto fatal;
+    goto done;
+  }
+
+#ifndef SSL_OP_PRIORITIZE_CHACHA
+  if (config->frontend.prioritize_chacha && config->frontend.server_preference)
+    bud_client_prefer_chacha(client);
+#endif  /* !SSL_OP_PRIORITIZE_CHACHA */
+
+  /* Fetch session in parallel with SNI and stapling requests */
+  if (config->session.enabled && client->hs->hello.session_len != 0) {
+    err = bud_client_session_lookup(client);
+    if (!bud_is_ok(err)) {
+      NOTICE(&client->frontend,
+             "failed to request session: %d - \"%s\"",
+             err.code,
+             err.str);
+    }
+  }
+
+  /* Parse success, perform SNI lookup (unless the response is cached) */
+  sni_ctx = NULL;
+  stale = 0;
+  if (config->sni.enabled &&
+      client->hs->hello.servername_len != 0 &&
+      !bud_sni_cache_get(config->sni_cache,
+                         client->hs->hello.servername,
+                         client->hs->hello.servername_len,
+                         &sni_ctx,
+                         &stale) &&
+      !bud_client_sni_restore(client, &sni_ctx, &stale)) {
+    bud_metrics_inc(config, kBudMetricSNIMisses);
+    err = bud_client_sni_lookup(client);
+
+    /* Backend is marked down, don't wait for it */
+    if (err.code == kBudErrHttpDown) {
+      bud_client_sni_done(client, NULL, err);
+      return;
+    }
+    if (!bud_is_ok(err)) {
+      NOTICE(&client->frontend,
+             "failed to request SNI: %d - \"%s\"",
+             err.code,
+             err.str);
+      goto fatal;
+    }
+
+    client->hello_parse = kBudProgressRunning;
+  } else {
+    if (config->sni.enabled && client->hs->hello.servername_len != 0)
+      bud_metrics_inc(config, kBudMetricSNIHits);
+
+    /* Go on with the stale entry, refresh it for the next handshakes */
+    if (stale)
+      bud_client_sni_revalidate(client);
+
+    /* SNI cache hit, NULL - for cached 404 */
+    if (sni_ctx != NULL) {
+      err = bud_client_sni_use(client, sni_ctx);
+      if (!bud_is_ok(err)) {
+        WARNING(&client->frontend,
+                "SNI context failed: %d - \"%s\"",
+                err.code,
+                err.str);
+        goto fatal;
+      }
+    }
+
+    /* Perform OCSP stapling request */
+    if ((config->stapling.enabled || config->ocsp_files != 0) &&
+        client->hs->hello.ocsp_request != 0) {
+      err = bud_client_ocsp_stapling(client);
+      if (!bud_is_ok(err))
+        goto fatal;
+    }
+  }
+
+  if (client->hello_parse != kBudProgressNone)
+    return;
+
+done:
+  client->hello_parse = kBudProgressDone;
+  bud_client_cycle(client);
+  return;
+
+fatal:
+  client->hello_parse = kBudProgressDone;
+  bud_client_close(client, &client->frontend);
+}
+
+
+#ifndef SSL_OP_PRIORITIZE_CHACHA
+void bud_client_prefer_chacha(bud_client_t* client) {
+  STACK_OF(SSL_CIPHER)* ciphers;
+  const SSL_CIPHER* c;
+  uint16_t first;
+  int i;
+
+  if (client->hs->hello.ciphers_len < 2)
+    return;
+
+  /* RFC 7905, TLS 1.3 and pre-standard ids */
+  first = ((uint8_t) client->hs->hello.ciphers[0] << 8) |
+          (uint8_t) client->hs->hello.ciphers[1];
+  if (first != 0xcca8 &&
+      first != 0xcca9 &&
+      first != 0xccaa &&
+      first != 0x1303 &&
+      first != 0xcc13 &&
+      first != 0xcc14) {
+    return;
+  }
+
+  /*
+   * With client's order OpenSSL picks exactly that suite, but only if we
+   * have it - otherwise the order would pick whatever client likes next.
+   */
+  ciphers = SSL_get_ciphers(client->ssl);
+  for (i = 0; i < sk_SSL_CIPHER_num(ciphers); i++) {
+    c = sk_SSL_CIPHER_value(ciphers, i);
+    if ((SSL_CIPHER_get_id(c) & 0xffff) != first)
+      continue;
+
+    SSL_clear_options(client->ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
+    return;
+  }
+}
+#endif  /* !SSL_OP_PRIORITIZE_CHACHA */
+
+
+bud_error_t bud_client_sni_use(bud_client_t* client, bud_context_t* ctx) {
+  /* SSL_CTX will be picked by bud_config_select_sni_context() */
+  if (!SSL_set_ex_data(client->ssl, kBudSSLSNIIndex, ctx))
+    return bud_error(kBudErrSNISetData);
+
+  bud_sni_context_ref(ctx);
+  client->sni_ctx = ctx;
+  return bud_ok();
+}
+
+
+bud_error_t bud_client_sni_lookup(bud_client_t* client) {
+  bud_config_t* config;
+  bud_sni_pending_t* pending;
+  bud_error_t err;
+
+  config = client->config;
+
+  /* Join the request already in flight */
+  pending = bud_sni_cache_pending_get(config->sni_cache,
+                                      client->hs->hello.servername,
+                                      client->hs->hello.servername_len);
+  if (pending != NULL) {
+    DBG(&client->frontend,
+        "SNI lookup is pending: \"%.*s\"",
+        client->hs->hello.servername_len,
+        client->hs->hello.servername);
+    goto done;
+  }
+
+  pending = bud_client_sni_request(client, &err);
+  if (pending == NULL)
+    return err;
+
+done:
+  client->hs->sni_pending = pending;
+  QUEUE_INSERT_TAIL(&pending->waiters, &client->hs->sni_member);
+  return bud_ok();
+}
+
+
+bud_sni_pending_t* bud_client_sni_request(bud_client_t* client,
+                                          bud_error_t* err) {
+  bud_sni_pending_t* pending;
+
+  pending = bud_client_sni_fetch(client->config,
+                                 client->hs->hello.servername,
+                                 client->hs->hello.servername_len,
+                                 err);
+  if (pending == NULL || (pending->req == NULL && pending->lookup == NULL))
+    return pending;
+
+  BUD_PROBE3(sni__start,
+             client,
+             client->hs->hello.servername,
+             client->hs->hello.servername_len);
+  return pending;
+}
+
+
+bud_sni_pending_t* bud_client_sni_fetch(bud_config_t* config,
+                                        const char* servername,
+                                        size_t servername_len,
+                                        bud_error_t* err) {
+  bud_sni_pending_t* pending;
+
+  pending = bud_sni_cache_pending_new(config->sni_cache,
+                                      servername,
+                                      servername_len,
+                                      err);
+  if (pending == NULL)
+    return NULL;
+
+  /* Certificates on local disk, read without blocking the loop */
+  if (config->sni.directory != NULL) {
+    pending->file = bud_sni_file_read(config,
+                                      servername,
+                                      servername_len,
+                                      bud_client_sni_file_cb,
+                                      pending,
+                                      err);
+    if (pending->file == NULL) {
+      bud_sni_cache_pending_free(config->sni_cache, pending);
+      return NULL;
+    }
+    return pending;
+  }
+
+  if (config->sni.lookup != NULL) {
+    pending->lookup = bud_lookup_sni(config->sni.lookup,
+                                     servername,
+                                     servername_len,
+                                     bud_client_sni_lookup_cb,
+                                     err);
+    if (pending->lookup == NULL) {
+      bud_sni_cache_pending_free(config->sni_cache, pending);
+      return NULL;
+    }
+    pending->lookup->data = pending;
+    return pending;
+  }
+
+  pending->req = bud_http_get(config->sni.pool,
+                              config->sni.query_fmt,
+                              servername,
+                              servername_len,
+                              bud_client_sni_cb,
+                              err);
+  if (!bud_is_ok(*err)) {
+    bud_sni_cache_pending_free(config->sni_cache, pending);
+    return NULL;
+  }
+  pending->req->data = pending;
+  return pending;
+}
+
+
+bud_error_t bud_client_sni_prewarm(bud_config_t* config,
+                                   const char* servername,
+                                   size_t servername_len) {
+  bud_context_t* ctx;
+  bud_error_t err;
+  int stale;
+
+  /* Fresh entry or request in flight, nothing to do */
+  stale = 0;
+  if (bud_sni_cache_get(config->sni_cache,
+                        servername,
+                        servername_len,
+                        &ctx,
+                        &stale) &&
+      !stale) {
+    return bud_ok();
+  }
+  if (bud_sni_cache_pending_get(config->sni_cache,
+                                servername,
+                                servername_len) != NULL) {
+    return bud_ok();
+  }
+
+  /* Nobody is waiting, the response just goes into the cache */
+  bud_client_sni_fetch(config, servername, servername_len, &err);
+  return err;
+}
+
+
+int bud_client_sni_restore(bud_client_t* client,
+                           bud_context_t** ctx,
+                           int* stale) {
+  bud_config_t* config;
+  bud_context_t* saved;
+  int ttl;
+  int stale_ttl;
+
+  config = client->config;
+  if (config->shared_cache.cache == NULL && config->disk_cache.cache == NULL)
+    return 0;
+  if (!bud_sni_restore(config,
+                       client->hs->hello.servername,
+                       client->hs->hello.servername_len,
+                       &saved,
+                       &ttl,
+                       &stale_ttl)) {
+    return 0;
+  }
+
+  DBG(&client->frontend,
+      "SNI response restored: \"%.*s\"",
+      client->hs->hello.servername_len,
+      client->hs->hello.servername);
+
+  /* Goes through the cache, which holds the reference from now on */
+  bud_sni_cache_set(config->sni_cache,
+                    client->hs->hello.servername,
+                    client->hs->hello.servername_len,
+                    saved,
+                    ttl,
+                    stale_ttl);
+  if (saved != NULL)
+    bud_sni_context_unref(saved);
+
+  return bud_sni_cache_get(config->sni_cache,
+                           client->hs->hello.servername,
+                           client->hs->hello.servername_len,
+                           ctx,
+                           stale);
+}
+
+
+void bud_client_sni_revalidate(bud_client_t* client) {
+  bud_config_t* config;
+  bud_error_t err;
+
+  config = client->config;
+
+  /* One refresh at a time, nobody waits for it */
+  if (bud_sni_cache_pending_get(config->sni_cache,
+                                client->hs->hello.servername,
+                                client->hs->hello.servername_len) != NULL) {
+    return;
+  }
+
+  DBG(&client->frontend,
+      "SNI entry is stale, revalidating: \"%.*s\"",
+      client->hs->hello.servername_len,
+      client->hs->hello.servername);
+  if (bud_client_sni_request(client, &err) != NULL)
+    return;
+
+  /* Stale entry is used until the refresh succeeds or it is gone */
+  if (err.code != kBudErrHttpDown) {
+    NOTICE(&client->frontend,
+           "failed to revalidate SNI: %d - \"%s\"",
+           err.code,
+           err.str);
+  }
+}
+
+
+void bud_client_sni_leave(bud_client_t* client) {
+  bud_sni_pending_t* pending;
+
+  pending = client->hs->sni_pending;
+  client->hs->sni_pending = NULL;
+  QUEUE_REMOVE(&client->hs->sni_member);
+
+  /* Last waiting client, nobody needs the response */
+  if (!QUEUE_EMPTY(&pending->waiters))
+    return;
+
+  /* Reads can't be cancelled, the result goes into the cache anyway */
+  if (pending->file != NULL)
+    return;
+
+  if (pending->lookup != NULL)
+    bud_lookup_cancel(pending->lookup);
+  else
+    bud_http_request_cancel(pending->req);
+  bud_sni_cache_pending_free(client->config->sni_cache, pending);
+}
+
+
+void bud_client_sni_cb(bud_http_request_t* req, bud_error_t err) {
+  bud_client_sni_response(req->config,
+                          req->data,
+                          err,
+                          req->code,
+                          req->response,
+                          &req->stream,
+                          req->max_age,
+                          req->stale);
+}
+
+
+void bud_client_sni_lookup_cb(bud_lookup_req_t* req, bud_error_t err) {
+  ((bud_sni_pending_t*) req->data)->lookup = NULL;
+  bud_client_sni_response(req->config,
+                          req->data,
+                          err,
+                          req->code,
+                          req->response,
+                          &req->stream,
+                          req->max_age,
+                          req->stale);
+}
+
+
+void bud_client_sni_response(bud_config_t* config,
+                             bud_sni_pending_t* pending,
+                             bud_error_t err,
+                             int code,
+                             JSON_Value* response,
+                             bud_json_stream_t* stream,
+                             int max_age,
+                             int stale) {
+  bud_context_t* ctx;
+  uint64_t start;
+  int ttl;
+  int stale_ttl;
+
+  start = bud_metrics_timer(config);
+
+  /* Build context once for all waiting clients */
+  ctx = NULL;
+  if (bud_is_ok(err)) {
+    if (code != 404)
+      ctx = bud_sni_context_new(config, response, stream, &err);
+    if (response != NULL)
+      json_value_free(response);
+  }
+
+  /* NULL context on 404 - negative entry */
+  if (bud_is_ok(err)) {
+    bud_sni_cache_set(config->sni_cache,
+                      pending->servername,
+                      pending->servername_len,
+                      ctx,
+                      max_age,
+                      stale);
+
+    /* Survive the restart, `stream` is still valid */
+    ttl = max_age;
+    stale_ttl = stale;
+    bud_sni_cache_ttl(config->sni_cache, ctx, &ttl, &stale_ttl);
+    bud_sni_save(config,
+                 pending->servername,
+                 pending->servername_len,
+                 ctx == NULL ? NULL : stream,
+                 ttl,
+                 stale_ttl);
+  }
+
+  bud_client_sni_resume(config, pending, ctx, err);
+  if (ctx != NULL)
+    bud_sni_context_unref(ctx);
+  bud_metrics_elapsed(config, kBudMetricSNITime, start);
+}
+
+
+void bud_client_sni_file_cb(bud_sni_file_t* file,
+                            bud_context_t* ctx,
+                            bud_error_t err) {
+  bud_config_t* config;
+  bud_sni_pending_t* pending;
+
+  pending = file->data;
+  config = file->config;
+
+  /* No file - negative entry, ttls are the configured ones */
+  if (bud_is_ok(err)) {
+    bud_sni_cache_set(config->sni_cache,
+                      pending->servername,
+                      pending->servername_len,
+                      ctx,
+                      -1,
+                      -1);
+  }
+
+  /* The reader holds the only reference to `ctx` */
+  bud_client_sni_resume(config, pending, ctx, err);
+}
+
+
+void bud_client_sni_resume(bud_config_t* config,
+                           bud_sni_pending_t* pending,
+                           bud_context_t* ctx,
+                           bud_error_t err) {
+  bud_client_t* client;
+  QUEUE* q;
+
+  /* Resume every waiting client with the same response */
+  while (!QUEUE_EMPTY(&pending->waiters)) {
+    q = QUEUE_HEAD(&pending->waiters);
+    QUEUE_REMOVE(q);
+    client = QUEUE_DATA(q, bud_client_handshake_t, sni_member)->client;
+    client->hs->sni_pending = NULL;
+
+    bud_client_sni_done(client, ctx, err);
+  }
+
+  bud_sni_cache_pending_free(config->sni_cache, pending);
+}
+
+
+void bud_client_sni_done(bud_client_t* client,
+                         bud_context_t* ctx,
+                         bud_error_t err) {
+  bud_config_t* config;
+  bud_error_t sni_err;
+  bud_error_t stapling_err;
+
+  config = client->config;
+
+  client->hello_parse = kBudProgressDone;
+  client->stats.sni = uv_now(config->loop);
+  BUD_PROBE3(sni__done, client, client->hs->hello.servername, err.code);
+
+  /* Backend is marked down, go on with the default context */
+  if (err.code == kBudErrHttpDown) {
+    DBG(&client->frontend,
+        "SNI backend is down, using default context for: \"%.*s\"",
+        client->hs->hello.servername_len,
+        client->hs->hello.servername);
+    goto done;
+  }
+  if (!bud_is_ok(err)) {
+    WARNING(&client->frontend, "SNI cb failed: %d - \"%s\"", err.code, err.str);
+    goto fatal;
+  }
+
+  if (ctx == NULL) {
+    /* Not found */
+    DBG(&client->frontend,
+        "SNI name not found: \"%.*s\"",
+        client->hs->hello.servername_len,
+        client->hs->hello.servername);
+    goto done;
+  }
+
+  sni_err = bud_client_sni_use(client, ctx);
+  if (!bud_is_ok(sni_err)) {
+    WARNING(&client->frontend,
+           "SNI context failed: %d - \"%s\"",
+           sni_err.code,
+           sni_err.str);
+    goto fatal;
+  }
+
+  /* Success */
+  DBG(&client->frontend,
+      "SNI name found: \"%.*s\"",
+      client->hs->hello.servername_len,
+      client->hs->hello.servername);
+
+done:
+  /* Request stapling info if needed */
+  if ((config->stapling.enabled || config->ocsp_files != 0) &&
+      client->hs->hello.ocsp_request != 0) {
+    stapling_err = bud_client_ocsp_stapling(client);
+    if (!bud_is_ok(stapling_err))
+      goto fatal;
+  }
+
+  if (client->hello_parse == kBudProgressDone)
+    bud_client_cycle(client);
+  return;
+
+fatal:
+  bud_client_close(client, &client->frontend);
+}
+
+
+bud_error_t bud_client_handshakes_init(bud_config_t* config) {
+  int r;
+
+  QUEUE_INIT(&config->handshake_parked);
+  config->handshake_tick = 0;
+  config->handshake_count = 0;
+  QUEUE_INIT(&config->handshake_waiting);
+  config->handshake_active = 0;
+  config->handshake_waiting_count = 0;
+  if (config->frontend.handshake_limit <= 0 &&
+      config->frontend.max_handshakes <= 0) {
+    return bud_ok();
+  }
+
+  /* Resumes parked clients on the next iteration */
+  r = uv_idle_init(config->loop, &config->handshake_idle);
+  if (r != 0)
+    return bud_error_num(kBudErrHandshakeIdle, r);
+  config->handshake_idle_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_handshakes_finalize(bud_config_t* config) {
+  if (!config->handshake_idle_init)
+    return;
+
+  config->handshake_idle_init = 0;
+  uv_close((uv_handle_t*) &config->handshake_idle, NULL);
+}
+
+
+int bud_client_handshake_allowed(bud_client_t* client) {
+  bud_config_t* config;
+  uint64_t now;
+
+  config = client->config;
+  if (config->frontend.handshake_limit <= 0)
+    return 1;
+
+  /* Only handshake steps are expensive (private key operations) */
+  if (client->ssl == NULL || SSL_is_init_finished(client->ssl))
+    return 1;
+  if (ringbuffer_is_empty(&client->frontend.input))
+    return 1;
+
+  if (client->handshake_parked)
+    return 0;
+
+  now = uv_now(config->loop);
+  if (config->handshake_tick != now) {
+    config->handshake_tick = now;
+    config->handshake_count = 0;
+  }
+
+  if (config->handshake_count < config->frontend.handshake_limit) {
+    config->handshake_count++;
+    return 1;
+  }
+
+  /* Let the loop process other events, continue on the next iteration */
+  QUEUE_INSERT_TAIL(&config->handshake_parked, &client->handshake_member);
+  client->handshake_parked = 1;
+  uv_idle_start(&config->handshake_idle, bud_client_handshake_idle_cb);
+
+  return 0;
+}
+
+
+void bud_client_handshake_idle_cb(uv_idle_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE* q;
+
+  config = container_of(handle, bud_config_t, handshake_idle);
+
+  /* New iteration, even if the loop time hasn't changed */
+  config->handshake_count = 0;
+
+  /* Clients parked again are at the tail, and stop the loop */
+  while (!QUEUE_EMPTY(&config->handshake_parked) &&
+         (config->frontend.handshake_limit <= 0 ||
+          config->handshake_count < config->frontend.handshake_limit)) {
+    q = QUEUE_HEAD(&config->handshake_parked);
+    client = QUEUE_DATA(q, bud_client_t, handshake_member);
+    QUEUE_REMOVE(q);
+    client->handshake_parked = 0;
+
+    bud_client_cycle(client);
+  }
+
+  if (!QUEUE_EMPTY(&config->handshake_parked))
+    return;
+  uv_idle_stop(handle);
+
+  /* Caught up, take the sockets that weren't stolen (or others') */
+  bud_threads_steal(config);
+}
+
+
+int bud_client_handshake_admit(bud_client_t* client) {
+  bud_config_t* config;
+
+  config = client->config;
+  if (config->frontend.max_handshakes <= 0 || client->hs == NULL)
+    return 1;
+  if (client->hs->admit_slot)
+    return 1;
+  if (client->hs->admit_waiting)
+    return 0;
+  if (client->ssl == NULL || SSL_is_init_finished(client->ssl))
+    return 1;
+
+  /* Abbreviated handshakes are cheap, and free a full one's slot sooner */
+  if (client->hs->hello.session_len != 0 || client->hs->hello.ticket_len != 0)
+    return 1;
+
+  if (config->handshake_active < config->frontend.max_handshakes) {
+    config->handshake_active++;
+    client->hs->admit_slot = 1;
+    return 1;
+  }
+
+  /* Checked on accept already, but the slots might be taken since */
+  if (config->handshake_waiting_count >= config->frontend.handshake_queue) {
+    bud_metrics_inc(config, kBudMetricAdmitRejected);
+    LOG_LN(kBudLogNotice, &client->frontend, "over max_handshakes, closing");
+    client->stats.reason = "handshake overload";
+    bud_client_close(client, &client->frontend);
+    return 0;
+  }
+
+  bud_metrics_inc(config, kBudMetricAdmitQueued);
+  QUEUE_INSERT_TAIL(&config->handshake_waiting, &client->hs->admit_member);
+  client->hs->admit_waiting = 1;
+  config->handshake_waiting_count++;
+  return 0;
+}
+
+
+void bud_client_handshake_release(bud_client_t* client) {
+  bud_config_t* config;
+  bud_client_t* next;
+  QUEUE* q;
+
+  config = client->config;
+  if (client->hs == NULL)
+    return;
+  if (client->hs->admit_waiting) {
+    QUEUE_REMOVE(&client->hs->admit_member);
+    client->hs->admit_waiting = 0;
+    config->handshake_waiting_count--;
+  }
+  if (!client->hs->admit_slot)
+    return;
+  client->hs->admit_slot = 0;
+  config->handshake_active--;
+
+  /* Oldest waiting one takes the slot */
+  while (!QUEUE_EMPTY(&config->handshake_waiting)) {
+    q = QUEUE_HEAD(&config->handshake_waiting);
+    next = QUEUE_DATA(q, bud_client_handshake_t, admit_member)->client;
+    QUEUE_REMOVE(q);
+    next->hs->admit_waiting = 0;
+    config->handshake_waiting_count--;
+    if (next->close != kBudProgressNone)
+      continue;
+
+    next->hs->admit_slot = 1;
+    config->handshake_active++;
+    bud_client_handshake_continue(next);
+    break;
+  }
+}
+
+
+void bud_client_handshake_continue(bud_client_t* client) {
+  bud_config_t* config;
+
+  /* Called from OpenSSL's callbacks and close_cb, cycle it a bit later */
+  config = client->config;
+  if (client->handshake_parked)
+    return;
+  QUEUE_INSERT_TAIL(&config->handshake_parked, &client->handshake_member);
+  client->handshake_parked = 1;
+  uv_idle_start(&config->handshake_idle, bud_client_handshake_idle_cb);
+}
+
+
+bud_error_t bud_client_spin_init(bud_config_t* config) {
+  int r;
+
+  if (config->busy_poll.spin <= 0)
+    return bud_ok();
+
+  /* Neither of them keeps the loop alive, but idle still makes poll return */
+  r = uv_check_init(config->loop, &config->spin_check);
+  if (r != 0)
+    return bud_error_num(kBudErrSpinInit, r);
+  r = uv_idle_init(config->loop, &config->spin_idle);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &config->spin_check, NULL);
+    return bud_error_num(kBudErrSpinInit, r);
+  }
+  uv_unref((uv_handle_t*) &config->spin_check);
+  uv_unref((uv_handle_t*) &config->spin_idle);
+  config->spin_init = 1;
+
+  uv_check_start(&config->spin_check, bud_client_spin_check_cb);
+  return bud_ok();
+}
+
+
+void bud_client_spin_finalize(bud_config_t* config) {
+  if (!config->spin_init)
+    return;
+
+  config->spin_init = 0;
+  uv_close((uv_handle_t*) &config->spin_check, NULL);
+  uv_close((uv_handle_t*) &config->spin_idle, NULL);
+}
+
+
+void bud_client_spin_check_cb(uv_check_t* handle, int status) {
+  bud_config_t* config;
+
+  config = container_of(handle, bud_config_t, spin_check);
+  if (uv_is_active((uv_handle_t*) &config->spin_idle))
+    return;
+
+  /*
+   * Poll has blocked and was woken up: keep polling with zero timeout for
+   * `spin` microseconds, so that the next events of the interactive
+   * traffic are picked up right away instead of after a wakeup
+   */
+  config->spin_deadline = uv_hrtime() +
+                          (uint64_t) config->busy_poll.spin * 1000;
+  uv_idle_start(&config->spin_idle, bud_client_spin_idle_cb);
+}
+
+
+void bud_client_spin_idle_cb(uv_idle_t* handle, int status) {
+  bud_config_t* config;
+
+  /* Spun for long enough, block in poll on the next iteration */
+  config = container_of(handle, bud_config_t, spin_idle);
+  if (uv_hrtime() >= config->spin_deadline)
+    uv_idle_stop(handle);
+}
+
+
+bud_error_t bud_client_flush_init(bud_config_t* config) {
+  int i;
+  int r;
+
+  for (i = 0; i < BUD_FLUSH_CLASSES; i++)
+    QUEUE_INIT(&config->flush_queues[i]);
+  config->flush_bytes = 0;
+
+  /* Check runs right after polling for I/O, i.e. after all reads */
+  r = uv_check_init(config->loop, &config->flush_check);
+  if (r != 0)
+    return bud_error_num(kBudErrFlushInit, r);
+  r = uv_idle_init(config->loop, &config->flush_idle);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &config->flush_check, NULL);
+    return bud_error_num(kBudErrFlushInit, r);
+  }
+  config->flush_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_flush_finalize(bud_config_t* config) {
+  if (!config->flush_init)
+    return;
+
+  config->flush_init = 0;
+  uv_close((uv_handle_t*) &config->flush_check, NULL);
+  uv_close((uv_handle_t*) &config->flush_idle, NULL);
+}
+
+
+void bud_client_flush(bud_client_t* client) {
+  bud_config_t* config;
+
+  if (client->flush_queued)
+    return;
+
+  config = client->config;
+  QUEUE_INSERT_TAIL(&config->flush_queues[bud_client_flush_class(client)],
+                    &client->flush_member);
+  client->flush_queued = 1;
+  uv_check_start(&config->flush_check, bud_client_flush_cb);
+
+  /* Queued from a timer or idle callback - don't block in poll meanwhile */
+  uv_idle_start(&config->flush_idle, bud_client_flush_idle_cb);
+}
+
+
+void bud_client_flush_cb(uv_check_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE pending[BUD_FLUSH_CLASSES];
+  QUEUE* bulk;
+  QUEUE* q;
+  uint64_t start;
+  int i;
+
+  config = container_of(handle, bud_config_t, flush_check);
+  uv_check_stop(&config->flush_check);
+  uv_idle_stop(&config->flush_idle);
+
+  /* Failed writes close and cycle clients, which may queue them again */
+  for (i = 0; i < BUD_FLUSH_CLASSES; i++) {
+    QUEUE_INIT(&pending[i]);
+    if (!QUEUE_EMPTY(&config->flush_queues[i])) {
+      q = QUEUE_HEAD(&config->flush_queues[i]);
+      QUEUE_SPLIT(&config->flush_queues[i], q, &pending[i]);
+    }
+  }
+
+  /* Handshake flights first, then the small writers, then bulk */
+  start = 0;
+  for (i = 0; i < BUD_FLUSH_CLASSES; i++) {
+    if (i == BUD_FLUSH_CLASSES - 1)
+      start = config->flush_bytes;
+
+    while (!QUEUE_EMPTY(&pending[i])) {
+      if (i == BUD_FLUSH_CLASSES - 1 &&
+          config->frontend.flush_budget > 0 &&
+          config->flush_bytes - start >=
+              (uint64_t) config->frontend.flush_budget) {
+        break;
+      }
+
+      q = QUEUE_HEAD(&pending[i]);
+      client = QUEUE_DATA(q, bud_client_t, flush_member);
+      QUEUE_REMOVE(q);
+      client->flush_queued = 0;
+
+      /* Sides with a write in flight are sent again by send_cb() */
+      if (bud_client_send(client, &client->frontend) != 0)
+        continue;
+      bud_client_send(client, &client->backend);
+    }
+  }
+
+  /* Over `flush_budget`, the rest of bulk goes first on the next iteration */
+  bulk = &pending[BUD_FLUSH_CLASSES - 1];
+  if (QUEUE_EMPTY(bulk))
+    return;
+  if (!QUEUE_EMPTY(&config->flush_queues[BUD_FLUSH_CLASSES - 1]))
+    QUEUE_ADD(bulk, &config->flush_queues[BUD_FLUSH_CLASSES - 1]);
+  QUEUE_INIT(&config->flush_queues[BUD_FLUSH_CLASSES - 1]);
+  QUEUE_ADD(&config->flush_queues[BUD_FLUSH_CLASSES - 1], bulk);
+  uv_check_start(&config->flush_check, bud_client_flush_cb);
+  uv_idle_start(&config->flush_idle, bud_client_flush_idle_cb);
+}
+
+
+/* 0 - handshake, 1 - under `frontend.flush_interactive` recently, 2 - bulk */
+int bud_client_flush_class(bud_client_t* client) {
+  if (client->ssl != NULL && !SSL_is_init_finished(client->ssl))
+    return 0;
+  if (bud_client_recent_bytes(client) <
+      (uint64_t) client->config->frontend.flush_interactive) {
+    return 1;
+  }
+  return 2;
+}
+
+
+uint64_t bud_client_recent_bytes(bud_client_t* client) {
+  uint64_t now;
+  uint64_t halves;
+
+  now = uv_now(client->config->loop);
+  halves = (now - client->recent_at) / BUD_CLIENT_RECENT_HALFLIFE;
+  if (halves == 0)
+    return client->recent_bytes;
+
+  client->recent_bytes = halves >= 64 ? 0 : client->recent_bytes >> halves;
+  client->recent_at += halves * BUD_CLIENT_RECENT_HALFLIFE;
+  return client->recent_bytes;
+}
+
+
+void bud_client_flush_idle_cb(uv_idle_t* handle, int status) {
+  /* Only keeps the loop from blocking, see bud_client_flush() */
+}
+
+
+bud_error_t bud_client_zerocopy_init(bud_config_t* config) {
+  int r;
+
+  QUEUE_INIT(&config->zerocopy_queue);
+  if (config->frontend.zerocopy <= 0 || config->uring != NULL)
+    return bud_ok();
+
+#ifndef BUD_CLIENT_ZEROCOPY
+  bud_log(config,
+          kBudLogWarning,
+          "MSG_ZEROCOPY is not supported, `frontend.zerocopy` is ignored");
+  return bud_ok();
+#endif  /* !BUD_CLIENT_ZEROCOPY */
+
+  /* Notifications for sockets that aren't read, see bud_client_send() */
+  r = uv_timer_init(config->loop, &config->zerocopy_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrZerocopyTimer, r);
+  config->zerocopy_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_zerocopy_finalize(bud_config_t* config) {
+  if (!config->zerocopy_init)
+    return;
+
+  config->zerocopy_init = 0;
+  uv_close((uv_handle_t*) &config->zerocopy_timer, NULL);
+}
+
+
+void bud_client_zerocopy_watch(bud_client_t* client) {
+  bud_config_t* config;
+
+  if (client->zerocopy_queued)
+    return;
+
+  config = client->config;
+  if (QUEUE_EMPTY(&config->zerocopy_queue)) {
+    uv_timer_start(&config->zerocopy_timer,
+                   bud_client_zerocopy_cb,
+                   BUD_CLIENT_ZEROCOPY_POLL,
+                   BUD_CLIENT_ZEROCOPY_POLL);
+  }
+  QUEUE_INSERT_TAIL(&config->zerocopy_queue, &client->zerocopy_member);
+  client->zerocopy_queued = 1;
+}
+
+
+void bud_client_zerocopy_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE pending;
+  QUEUE* q;
+
+  config = container_of(handle, bud_config_t, zerocopy_timer);
+
+  /* Reaping sends more and closes clients, both touch the queue */
+  QUEUE_INIT(&pending);
+  if (!QUEUE_EMPTY(&config->zerocopy_queue)) {
+    q = QUEUE_HEAD(&config->zerocopy_queue);
+    QUEUE_SPLIT(&config->zerocopy_queue, q, &pending);
+  }
+
+  while (!QUEUE_EMPTY(&pending)) {
+    q = QUEUE_HEAD(&pending);
+    client = QUEUE_DATA(q, bud_client_t, zerocopy_member);
+    QUEUE_REMOVE(q);
+    QUEUE_INSERT_TAIL(&config->zerocopy_queue, q);
+
+#ifdef BUD_CLIENT_ZEROCOPY
+    /* Ones that are read are reaped on EPOLLERR by bud_client_read_cb() */
+    if (client->frontend.reading != kBudProgressRunning &&
+        client->frontend.zerocopy_count != 0) {
+      bud_client_zerocopy_reap(client, &client->frontend);
+    }
+#endif  /* BUD_CLIENT_ZEROCOPY */
+
+    /* Might be closed and removed already */
+    if (client->zerocopy_queued && client->frontend.zerocopy_count == 0) {
+      QUEUE_REMOVE(q);
+      client->zerocopy_queued = 0;
+    }
+  }
+
+  if (QUEUE_EMPTY(&config->zerocopy_queue))
+    uv_timer_stop(handle);
+}
+
+
+bud_error_t bud_client_budget_init(bud_config_t* config) {
+  int r;
+
+  QUEUE_INIT(&config->budget_queue);
+  if (config->frontend.cycle_budget <= 0)
+    return bud_ok();
+
+  /* Continues clients out of budget on the next iteration */
+  r = uv_idle_init(config->loop, &config->budget_idle);
+  if (r != 0)
+    return bud_error_num(kBudErrBudgetIdle, r);
+  config->budget_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_budget_finalize(bud_config_t* config) {
+  if (!config->budget_init)
+    return;
+
+  config->budget_init = 0;
+  uv_close((uv_handle_t*) &config->budget_idle, NULL);
+}
+
+
+int bud_client_budget_spend(bud_client_t* client, size_t size) {
+  bud_config_t* config;
+  uint64_t now;
+
+  config = client->config;
+  if (config->frontend.cycle_budget <= 0)
+    return 0;
+
+  /* Waiting in the run queue, budget_idle_cb() refills it */
+  if (client->budget_queued)
+    return 1;
+
+  /* Fresh budget for each loop iteration */
+  now = uv_now(config->loop);
+  if (client->budget_tick != now) {
+    client->budget_tick = now;
+    client->budget_left = config->frontend.cycle_budget;
+  }
+
+  if (size < client->budget_left) {
+    client->budget_left -= size;
+    return 0;
+  }
+
+  client->budget_left = 0;
+  QUEUE_INSERT_TAIL(&config->budget_queue, &client->budget_member);
+  client->budget_queued = 1;
+  uv_idle_start(&config->budget_idle, bud_client_budget_idle_cb);
+  return 1;
+}
+
+
+void bud_client_budget_idle_cb(uv_idle_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE pending;
+  QUEUE* q;
+
+  config = container_of(handle, bud_config_t, budget_idle);
+
+  /* Clients out of budget again are queued for the next iteration */
+  QUEUE_INIT(&pending);
+  if (!QUEUE_EMPTY(&config->budget_queue)) {
+    q = QUEUE_HEAD(&config->budget_queue);
+    QUEUE_SPLIT(&config->budget_queue, q, &pending);
+  }
+
+  while (!QUEUE_EMPTY(&pending)) {
+    q = QUEUE_HEAD(&pending);
+    client = QUEUE_DATA(q, bud_client_t, budget_member);
+    QUEUE_REMOVE(q);
+    client->budget_queued = 0;
+    client->budget_tick = uv_now(config->loop);
+    client->budget_left = config->frontend.cycle_budget;
+
+    bud_client_cycle(client);
+  }
+
+  if (QUEUE_EMPTY(&config->budget_queue))
+    uv_idle_stop(handle);
+}
+
+
+bud_error_t bud_client_reclaim_init(bud_config_t* config) {
+  int r;
+
+  if (config->pool.budget <= 0)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &config->reclaim_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrReclaimTimer, r);
+  config->reclaim_init = 1;
+
+  r = uv_timer_start(&config->reclaim_timer,
+                     bud_client_reclaim_cb,
+                     BUD_CLIENT_RECLAIM_INTERVAL,
+                     BUD_CLIENT_RECLAIM_INTERVAL);
+  if (r != 0)
+    return bud_error_num(kBudErrReclaimTimer, r);
+  uv_unref((uv_handle_t*) &config->reclaim_timer);
+
+  return bud_ok();
+}
+
+
+void bud_client_reclaim_finalize(bud_config_t* config) {
+  if (!config->reclaim_init)
+    return;
+
+  config->reclaim_init = 0;
+  uv_close((uv_handle_t*) &config->reclaim_timer, NULL);
+}
+
+
+uint64_t bud_client_buffer_usage(bud_config_t* config) {
+  ringbuffer_pool* pools[3];
+  uint64_t usage;
+  int i;
+
+  /* Chunks in use, and cached ones that still hold their pages */
+  pools[0] = &config->buffer_pool;
+  pools[1] = &config->frontend_pool;
+  pools[2] = &config->backend_pool;
+  usage = 0;
+  for (i = 0; i < (int) ARRAY_SIZE(pools); i++) {
+    usage += (uint64_t) (pools[i]->used_count + pools[i]->dirty_count) *
+             pools[i]->chunk_size;
+  }
+
+  return usage;
+}
+
+
+uint64_t bud_client_side_trim(bud_client_side_t* side) {
+  uint64_t trimmed;
+
+  /* Only empty buffers, nothing is pointing into those */
+  trimmed = (uint64_t) ringbuffer_trim(&side->input) * side->input.chunk_size;
+  trimmed += (uint64_t) ringbuffer_trim(&side->output) *
+             side->output.chunk_size;
+  return trimmed;
+}
+
+
+void bud_client_class_count(bud_client_t* client, size_t size) {
+  bud_config_t* config;
+  uint64_t now;
+
+  config = client->config;
+  if (config->frontend.buffer.bulk_count == 0 &&
+      config->backend.buffer.bulk_count == 0) {
+    return;
+  }
+
+  client->class_bytes += size;
+  client->class_reads++;
+  now = uv_now(config->loop);
+  if (now - client->class_at >= BUD_CLIENT_CLASS_WINDOW)
+    bud_client_classify(client, now);
+}
+
+
+void bud_client_classify(bud_client_t* client, uint64_t now) {
+  bud_config_t* config;
+  bud_client_class_t cls;
+  uint64_t rate;
+
+  /* Per window, quiet time before the read counts too */
+  config = client->config;
+  rate = client->class_bytes * BUD_CLIENT_CLASS_WINDOW /
+         (now - client->class_at);
+  if (client->class_throttles != 0 || rate >= BUD_CLIENT_CLASS_BULK_RATE) {
+    cls = kBudClassBulk;
+  } else if (rate < BUD_CLIENT_CLASS_SMALL_RATE &&
+             client->class_bytes <
+                 (uint64_t) client->class_reads *
+                     BUD_CLIENT_CLASS_SMALL_READ) {
+    cls = kBudClassInteractive;
+  } else {
+    cls = kBudClassDefault;
+  }
+
+  /* Workers over `pool.budget` don't grow anyone, and take growth back */
+  if (cls == kBudClassBulk &&
+      config->pool.budget > 0 &&
+      bud_client_buffer_usage(config) >= (uint64_t) config->pool.budget) {
+    cls = kBudClassDefault;
+  }
+
+  client->class_at = now;
+  client->class_bytes = 0;
+  client->class_reads = 0;
+  client->class_throttles = 0;
+  if (cls == client->traffic_class)
+    return;
+
+  DBG(&client->frontend, "traffic class %d => %d", client->traffic_class, cls);
+  client->traffic_class = cls;
+  if (cls == kBudClassBulk)
+    bud_metrics_inc(config, kBudMetricClassBulk);
+  else if (cls == kBudClassInteractive)
+    bud_metrics_inc(config, kBudMetricClassInteractive);
+
+  bud_client_side_resize(client, &client->frontend, &config->frontend.buffer);
+  bud_client_side_resize(client, &client->backend, &config->backend.buffer);
+}
+
+
+void bud_client_side_resize(bud_client_t* client,
+                            bud_client_side_t* side,
+                            bud_config_buffer_t* conf) {
+  uint64_t count;
+
+  if (conf->bulk_count == 0)
+    return;
+
+  if (client->traffic_class == kBudClassBulk)
+    count = conf->bulk_count;
+  else if (client->traffic_class == kBudClassInteractive)
+    count = 1;
+  else
+    count = conf->chunk_count;
+
+  /*
+   * Only the limits change, chunks come and go with the data. Buffers over
+   * the new size are full until they drain, mirrored ones can't grow.
+   */
+  ringbuffer_set_max_size(&side->input, count * conf->chunk_size);
+  ringbuffer_set_max_size(&side->output, count * conf->chunk_size);
+  side->high_watermark = conf->high_watermark * count / conf->chunk_count;
+  side->low_watermark = conf->low_watermark * count / conf->chunk_count;
+}
+
+
+void bud_client_reclaim_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE* q;
+  uint64_t usage;
+  uint64_t now;
+  uint64_t trimmed;
+  uint64_t purged;
+
+  config = container_of(handle, bud_config_t, reclaim_timer);
+  usage = bud_client_buffer_usage(config);
+  if (usage <= (uint64_t) config->pool.budget)
+    return;
+
+  bud_metrics_inc(config, kBudMetricReclaimRuns);
+
+  /* Least recently active first, stop at the first one that wasn't quiet */
+  now = uv_now(config->loop);
+  trimmed = 0;
+  QUEUE_FOREACH(q, &config->clients) {
+    client = QUEUE_DATA(q, bud_client_t, member);
+    if (client->last_active + config->pool.trim_idle > now)
+      break;
+    if (client->close != kBudProgressNone)
+      continue;
+
+    trimmed += bud_client_side_trim(&client->frontend);
+    trimmed += bud_client_side_trim(&client->backend);
+    if (usage - trimmed <= (uint64_t) config->pool.budget)
+      break;
+  }
+
+  /* Trimmed chunks are cached by the pools, let the kernel have the pages */
+  purged = ringbuffer_pool_purge(&config->buffer_pool);
+  purged += ringbuffer_pool_purge(&config->frontend_pool);
+  purged += ringbuffer_pool_purge(&config->backend_pool);
+
+  bud_metrics_add(config, kBudMetricReclaimTrimmed, trimmed);
+  bud_metrics_add(config, kBudMetricReclaimPurged, purged);
+  bud_log(config,
+          kBudLogDebug,
+          "pool over budget (%llu bytes), trimmed: %llu purged: %llu",
+          (unsigned long long) usage,
+          (unsigned long long) trimmed,
+          (unsigned long long) purged);
+}
+
+
+bud_error_t bud_client_tcp_info_init(bud_config_t* config) {
+  int r;
+
+  if (!config->metrics.tcp_info.enabled ||
+      config->metrics.tcp_info.interval <= 0) {
+    return bud_ok();
+  }
+
+  r = uv_timer_init(config->loop, &config->tcp_info_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrTCPInfoTimer, r);
+  config->tcp_info_init = 1;
+
+  r = uv_timer_start(&config->tcp_info_timer,
+                     bud_client_tcp_info_cb,
+                     config->metrics.tcp_info.interval,
+                     config->metrics.tcp_info.interval);
+  if (r != 0)
+    return bud_error_num(kBudErrTCPInfoTimer, r);
+  uv_unref((uv_handle_t*) &config->tcp_info_timer);
+
+  return bud_ok();
+}
+
+
+void bud_client_tcp_info_finalize(bud_config_t* config) {
+  if (!config->tcp_info_init)
+    return;
+
+  config->tcp_info_init = 0;
+  uv_close((uv_handle_t*) &config->tcp_info_timer, NULL);
+}
+
+
+void bud_client_tcp_info_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_client_t* client;
+  QUEUE* q;
+  uint64_t now;
+
+  config = container_of(handle, bud_config_t, tcp_info_timer);
+  now = uv_now(config->loop);
+
+  /* One getsockopt() per established client and interval */
+  QUEUE_FOREACH(q, &config->clients) {
+    client = QUEUE_DATA(q, bud_client_t, member);
+    if (client->close != kBudProgressNone || client->stats.handshake == 0)
+      continue;
+    if (client->stats.tcp_sampled + config->metrics.tcp_info.interval > now)
+      continue;
+
+    bud_client_tcp_sample(client);
+  }
+}
+
+
+/* RTT and delivery rate go into the histograms on every sample */
+void bud_client_tcp_sample(bud_client_t* client) {
+  bud_config_t* config;
+  bud_tcp_info_t* info;
+  uint64_t rtt;
+  uint64_t rate;
+
+  config = client->config;
+  info = &client->stats.tcp;
+  if (bud_tcp_info_sample(&client->frontend.tcp, info) != 0)
+    return;
+  if (client->stats.tcp_sampled == 0)
+    client->stats.tcp_handshake = *info;
+  client->stats.tcp_sampled = uv_now(config->loop);
+
+  rtt = info->rtt / 1000;
+  rate = info->delivery_rate * 8 / 1000000;
+  bud_metrics_observe(config, kBudMetricTCPRTT, rtt);
+  if (info->delivery_rate != 0)
+    bud_metrics_observe(config, kBudMetricTCPRate, rate);
+
+  /* Not counted per context until the handshake picks the row */
+  if (client->context_row == NULL)
+    return;
+  bud_metrics_row_observe(client->context_row, kBudRowTCPRTT, rtt);
+  if (info->delivery_rate != 0)
+    bud_metrics_row_observe(client->context_row, kBudRowTCPRate, rate);
+}
+
+
+bud_error_t bud_client_timeouts_init(bud_config_t* config) {
+  bud_error_t err;
+
+  if (config->frontend.timeout.handshake <= 0 &&
+      config->frontend.timeout.idle <= 0 &&
+      config->frontend.timeout.write <= 0) {
+    return bud_ok();
+  }
+
+  err = bud_timer_wheel_init(&config->client_wheel,
+                             config->loop,
+                             BUD_CLIENT_WHEEL_RESOLUTION,
+                             bud_client_timeout_cb);
+  if (!bud_is_ok(err))
+    return err;
+  config->client_wheel_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_timeouts_finalize(bud_config_t* config) {
+  if (!config->client_wheel_init)
+    return;
+
+  config->client_wheel_init = 0;
+  bud_timer_wheel_close(&config->client_wheel);
+}
+
+
+void bud_client_timeout_update(bud_client_t* client) {
+  uint64_t deadlines[4];
+  uint64_t expire;
+  size_t i;
+
+  if (!client->config->client_wheel_init)
+    return;
+
+  deadlines[0] = client->handshake_deadline;
+  deadlines[1] = client->idle_deadline;
+  deadlines[2] = client->frontend.write_deadline;
+  deadlines[3] = client->backend.write_deadline;
+
+  expire = 0;
+  for (i = 0; i < ARRAY_SIZE(deadlines); i++)
+    if (deadlines[i] != 0 && (expire == 0 || deadlines[i] < expire))
+      expire = deadlines[i];
+
+  if (expire == 0)
+    return bud_timer_wheel_cancel(&client->timeout);
+  bud_timer_wheel_schedule(&client->config->client_wheel,
+                           &client->timeout,
+                           expire);
+}
+
+
+bud_error_t bud_client_shape_init(bud_config_t* config) {
+  int i;
+  int needed;
+  bud_error_t err;
+
+  needed = config->frontend.bandwidth.connection > 0 ||
+           config->frontend.bandwidth.context > 0;
+  for (i = 0; !needed && i < config->context_count + 1; i++)
+    needed = config->contexts[i].bandwidth > 0;
+  if (!needed)
+    return bud_ok();
+
+  err = bud_timer_wheel_init(&config->shape_wheel,
+                             config->loop,
+                             BUD_CLIENT_SHAPE_RESOLUTION,
+                             bud_client_shape_cb);
+  if (!bud_is_ok(err))
+    return err;
+  config->shape_wheel_init = 1;
+
+  return bud_ok();
+}
+
+
+void bud_client_shape_finalize(bud_config_t* config) {
+  if (!config->shape_wheel_init)
+    return;
+
+  config->shape_wheel_init = 0;
+  bud_timer_wheel_close(&config->shape_wheel);
+}
+
+
+void bud_client_shape_spend(bud_client_t* client, size_t size) {
+  bud_config_t* config;
+  bud_context_t* ctx;
+  uint64_t now;
+  uint64_t wait;
+  uint64_t ctx_wait;
+  int r;
+
+  config = client->config;
+  if (!config->shape_wheel_init || client->close != kBudProgressNone)
+    return;
+
+  now = uv_now(config->loop);
+  wait = 0;
+  if (config->frontend.bandwidth.connection > 0) {
+    wait = bud_shape_spend(&client->shape.bucket,
+                           config->frontend.bandwidth.connection,
+                           config->frontend.bandwidth.burst,
+                           size,
+                           now);
+  }
+
+  /* Tenant's connections share the bucket, the longest pause wins */
+  ctx = bud_client_context(client);
+  if (ctx->bandwidth > 0) {
+    ctx_wait = bud_shape_spend(&ctx->shape,
+                               ctx->bandwidth,
+                               config->frontend.bandwidth.burst,
+                               size,
+                               now);
+    if (ctx_wait > wait)
+      wait = ctx_wait;
+  }
+  if (wait == 0)
+    return;
+
+  /* Kernel buffers the rest, so the backend slows down too */
+  if (client->backend.reading == kBudProgressRunning) {
+    DBG(&client->backend, "bandwidth pause: %d ms", (int) wait);
+    r = uv_read_stop((uv_stream_t*) &client->backend.tcp);
+    if (r != 0) {
+      NOTICE(&client->backend,
+             "uv_read_stop failed: %d - \"%s\"",
+             r,
+             uv_strerror(r));
+      bud_client_close(client, &client->backend);
+      return;
+    }
+    client->backend.reading = kBudProgressNone;
+    client->shape.paused = 1;
+  }
+
+  bud_metrics_inc(config, kBudMetricBandwidthPauses);
+  client->shape.waiting = 1;
+  bud_timer_wheel_schedule(&config->shape_wheel,
+                           &client->shape.entry,
+                           now + wait);
+}
+
+
+void bud_client_shape_cb(bud_timer_entry_t* entry) {
+  bud_client_t* client;
+  int r;
+
+  client = container_of(entry, bud_client_t, shape.entry);
+  client->shape.waiting = 0;
+  if (!client->shape.paused)
+    return;
+
+  /* Same as in bud_client_send_done(), it resumes reading otherwise */
+  if (client->close != kBudProgressNone ||
+      client->connect != kBudProgressDone ||
+      client->backend.reading != kBudProgressNone ||
+      client->frontend.shutdown != kBudProgressNone ||
+      ringbuffer_size(&client->frontend.output) >
+          client->frontend.low_watermark) {
+    return;
+  }
+  client->shape.paused = 0;
+
+  DBG_LN(&client->backend, "read_start, bandwidth pause is over");
+  r = uv_read_start((uv_stream_t*) &client->backend.tcp,
+                    bud_client_alloc_cb,
+                    bud_client_read_cb);
+  if (r != 0) {
+    NOTICE(&client->backend,
+           "uv_read_start() failed: %d - \"%s\"",
+           r,
+           uv_strerror(r));
+    bud_client_close(client, &client->backend);
+    return;
+  }
+  client->backend.reading = kBudProgressRunning;
+}
+
+
+void bud_client_timeout_cb(bud_timer_entry_t* entry) {
+  bud_client_t* client;
+  bud_client_side_t* side;
+  uint64_t now;
+
+  client = container_of(entry, bud_client_t, timeout);
+  if (client->close == kBudProgressDone)
+    return;
+
+  /* Every deadline fires once, closing may take a while */
+  now = uv_now(client->config->loop);
+  side = NULL;
+  if (client->handshake_deadline != 0 && client->handshake_deadline <= now) {
+    client->handshake_deadline = 0;
+    side = &client->frontend;
+    client->stats.reason = "handshake timeout";
+    LOG_LN(kBudLogNotice, side, "handshake timeout");
+  } else if (client->frontend.write_deadline != 0 &&
+             client->frontend.write_deadline <= now) {
+    client->frontend.write_deadline = 0;
+    side = &client->frontend;
+    client->stats.reason = "write timeout";
+    LOG_LN(kBudLogNotice, side, "write timeout");
+  } else if (client->backend.write_deadline != 0 &&
+             client->backend.write_deadline <= now) {
+    client->backend.write_deadline = 0;
+    side = &client->backend;
+    client->stats.reason = "backend write timeout";
+    LOG_LN(kBudLogNotice, side, "write timeout");
+  } else if (client->idle_deadline != 0 && client->idle_deadline <= now) {
+    client->idle_deadline = 0;
+    side = &client->frontend;
+    client->stats.reason = "idle timeout";
+    LOG_LN(kBudLogNotice, side, "idle timeout");
+  }
+
+  bud_client_timeout_update(client);
+  if (side != NULL)
+    bud_client_close(client, side);
+}
+
+
+/*
+ * `metrics.timing`: the loop is single-threaded, so the time in the SSL
+ * calls is the CPU spent on this client's crypto. Call started before the
+ * handshake is done is counted towards it.
+ */
+uint64_t bud_client_cpu_start(bud_client_t* client,
+                              SSL* ssl,
+                              int* handshake) {
+  uint64_t start;
+
+  start = bud_metrics_timer(client->config);
+  *handshake = start != 0 && !SSL_is_init_finished(ssl);
+  return start;
+}
+
+
+void bud_client_cpu_stop(bud_client_t* client,
+                         uint64_t start,
+                         int handshake) {
+  uint64_t elapsed;
+
+  if (start == 0)
+    return;
+
+  elapsed = uv_hrtime() - start;
+  if (handshake)
+    client->stats.cpu_handshake += elapsed;
+  else
+    client->stats.cpu_crypto += elapsed;
+}
+
+
+int bud_client_backend_in(bud_client_t* client) {
+  char* data;
+  size_t size;
+  size_t limit;
+  uint64_t start;
+  int handshake;
+  int written;
+  int err;
+
+  /* Oldest data of the backend first */
+  if (client->spill != NULL &&
+      client->spill->size != 0 &&
+      bud_client_spill_refill(client) != 0) {
+    return -1;
+  }
+
+  written = 0;
+  while (!ringbuffer_is_empty(bud_client_plain_in(client))) {
+    limit = bud_client_record_limit(client);
+
+    /* OpenSSL rejects a retry that is shorter than the pending record */
+    if (limit < client->record_pending)
+      limit = client->record_pending;
+
+    /* Wait for more data to fill the record */
+    if (client->record_pending == 0 &&
+        bud_client_coalesce_wait(client, limit)) {
+      break;
+    }
+
+    size = bud_client_coalesce(client, limit, &data);
+    start = bud_client_cpu_start(client, client->ssl, &handshake);
+    written = SSL_write(client->ssl, data, size);
+    bud_client_cpu_stop(client, start, handshake);
+    DBG(&client->frontend, "SSL_write() => %d", written);
+    DBG(&client->frontend,
+        "frontend.output => %d",
+        ringbuffer_size(&client->frontend.output));
+    if (written < 0) {
+      /* `frontend.output` is full, retried after the next write_cb */
+      client->record_pending = size;
+      break;
+    }
+
+    /* Partial write, the rest goes in the next record */
+    client->record_pending = 0;
+    bud_client_queue_consume(client,
+                             &client->plain_queue,
+                             bud_client_plain_in(client),
+                             written,
+                             kBudMetricQueueEncrypt);
+    ringbuffer_read_skip(bud_client_plain_in(client), written);
+    client->record_sent += written;
+    client->greeting = 0;
+
+    /* info_cb() has closed front-end */
+    if (client->frontend.close != kBudProgressNone)
+      return -1;
+
+    /* Let the others run, the rest is encrypted on the next iteration */
+    if (bud_client_budget_spend(client, written))
+      break;
+  }
+
+  if (bud_client_throttle(client,
+                          &client->frontend,
+                          &client->frontend.output) == -1) {
+    /* Throttle error */
+    return -1;
+  }
+
+  if (written >= 0)
+    return 0;
+
+  err = SSL_get_error(client->ssl, written);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    return 0;
+#ifdef SSL_MODE_ASYNC
+  if (err == SSL_ERROR_WANT_ASYNC || err == SSL_ERROR_WANT_ASYNC_JOB)
+    return bud_client_async_wait(client, err);
+#endif  /* SSL_MODE_ASYNC */
+
+  NOTICE(&client->frontend,
+         "SSL_write failed: %d - \"%s\"",
+         err,
+         bud_sslerror_str(err));
+  client->stats.reason = "ssl error";
+  bud_client_close(client, &client->frontend);
+  return -1;
+}
+
+
+int bud_client_backend_out(bud_client_t* client) {
+  int read;
+  int err;
+  size_t total;
+  size_t avail;
+  char* out;
+  uint64_t start;
+  int handshake;
+
+  /* SSL_write() has just paused, the same job would be resumed */
+  if (client->async_waiting)
+    return 0;
+
+  /* If buffer is full - stop reading */
+  err = bud_client_throttle(client,
+                            &client->backend,
+                            bud_client_plain_out(client));
+  if (err < 0) {
+    return err;
+  } else if (err == 1) {
+    return 0;
+  }
+
+  /* Spent on encryption already */
+  if (bud_client_budget_spend(client, 0))
+    return 0;
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  /* 0-RTT data goes to backend without waiting for client's Finished */
+  if (client->early_read != kBudProgressDone) {
+    err = bud_client_early_data_out(client);
+    if (err != 1)
+      return err;
+  }
+#endif  /* SSL_READ_EARLY_DATA_SUCCESS */
+
+  do {
+    start = bud_client_cpu_start(client, client->ssl, &handshake);
+    if (client->http.xforward) {
+      avail = 0;
+      out = ringbuffer_write_ptr(bud_client_plain_out(client), &avail);
+      read = bud_client_http_read(client, out, avail);
+      total = read > 0 ? read : 0;
+    } else {
+      /* Sent by bud_client_flush(), all records in one write */
+      total = bud_client_ssl_readv(client, &read);
+    }
+    bud_client_cpu_stop(client, start, handshake);
+    DBG(&client->frontend, "SSL_read() => %d, %d total", read, (int) total);
+
+    /* info_cb() has closed front-end */
+    if (client->frontend.close != kBudProgressNone)
+      return -1;
+
+    if (total > 0 && bud_client_budget_spend(client, total))
+      break;
+  } while (read > 0);
+
+  if (read > 0)
+    return 0;
+
+  err = SSL_get_error(client->ssl, read);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    return 0;
+#ifdef SSL_MODE_ASYNC
+  if (err == SSL_ERROR_WANT_ASYNC || err == SSL_ERROR_WANT_ASYNC_JOB)
+    return bud_client_async_wait(client, err);
+#endif  /* SSL_MODE_ASYNC */
+
+  if (err != SSL_ERROR_ZERO_RETURN) {
+    NOTICE(&client->frontend,
+           "SSL_read failed : %d - \"%s\"",
+           err,
+           bud_sslerror_str(err));
+    client->stats.reason = "ssl error";
+  }
+  bud_client_close(client, &client->frontend);
+  return -1;
+}
+
+
+/*
+ * SSL_read() into several free chunks of `plain_out`, and one append for
+ * all of them. Enough chunks for the ciphertext that is queued in
+ * `frontend.input`, plus one for the record that read-ahead may have taken
+ * already. Each SSL_read() still returns at most one record. Returns bytes
+ * read, `last` is the result of the last SSL_read().
+ */
+size_t bud_client_ssl_readv(bud_client_t* client, int* last) {
+  ringbuffer* rb;
+  char* out[BUD_CLIENT_READ_REGIONS];
+  size_t size[BUD_CLIENT_READ_REGIONS];
+  size_t count;
+  size_t total;
+  size_t off;
+  size_t i;
+  int read;
+
+  rb = bud_client_plain_out(client);
+  count = 2 + BIO_ctrl_pending(SSL_get_rbio(client->ssl)) / rb->chunk_size;
+  if (count > ARRAY_SIZE(out))
+    count = ARRAY_SIZE(out);
+  ringbuffer_write_ptrv(rb, out, size, &count);
+
+  total = 0;
+  read = 0;
+  for (i = 0; i < count; i++) {
+    for (off = 0; off < size[i]; off += read) {
+      read = SSL_read(client->ssl, out[i] + off, size[i] - off);
+      if (read <= 0)
+        goto done;
+      bud_client_http_feed(client, &client->http.request, out[i] + off, read);
+      total += read;
+
+      /* info_cb() has closed front-end */
+      if (client->frontend.close != kBudProgressNone)
+        goto done;
+    }
+  }
+
+done:
+  if (total != 0)
+    ringbuffer_write_append(rb, total);
+  *last = read;
+  return total;
+}
+
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+int bud_client_early_data_out(bud_client_t* client) {
+  int r;
+  int err;
+  size_t read;
+  size_t avail;
+  char* out;
+  uint64_t start;
+  int handshake;
+
+  /* Client may send it only in the first flight, after that - SSL_read() */
+  client->early_read = kBudProgressRunning;
+  do {
+    avail = 0;
+    out = ringbuffer_write_ptr(bud_client_plain_out(client), &avail);
+    read = 0;
+    start = bud_client_cpu_start(client, client->ssl, &handshake);
+    r = SSL_read_early_data(client->ssl, out, avail, &read);
+    bud_client_cpu_stop(client, start, handshake);
+    DBG(&client->frontend, "SSL_read_early_data() => %d", (int) read);
+    if (read > 0) {
+      bud_client_http_feed(client, &client->http.request, out, read);
+      ringbuffer_write_append(bud_client_plain_out(client), read);
+      client->early_data = 1;
+    }
+
+    /* info_cb() has closed front-end */
+    if (client->frontend.close != kBudProgressNone)
+      return -1;
+  } while (r == SSL_READ_EARLY_DATA_SUCCESS);
+
+  if (r == SSL_READ_EARLY_DATA_FINISH) {
+    client->early_read = kBudProgressDone;
+    return 1;
+  }
+
+  err = SSL_get_error(client->ssl, 0);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    return 0;
+#ifdef SSL_MODE_ASYNC
+  if (err == SSL_ERROR_WANT_ASYNC || err == SSL_ERROR_WANT_ASYNC_JOB)
+    return bud_client_async_wait(client, err);
+#endif  /* SSL_MODE_ASYNC */
+
+  NOTICE(&client->frontend,
+         "SSL_read_early_data failed : %d - \"%s\"",
+         err,
+         bud_sslerror_str(err));
+  client->stats.reason = "ssl error";
+  bud_client_close(client, &client->frontend);
+  return -1;
+}
+#endif  /* SSL_READ_EARLY_DATA_SUCCESS */
+
+
+size_t bud_client_record_limit(bud_client_t* client) {
+  bud_config_t* config;
+  size_t limit;
+  uint64_t now;
+  uint64_t idle;
+
+  config = client->config;
+  limit = sizeof(config->record);
+  if (config->frontend.coalesce.size > 0 &&
+      (size_t) config->frontend.coalesce.size < limit) {
+    limit = config->frontend.coalesce.size;
+  }
+
+  if (config->frontend.record.initial <= 0)
+    return limit;
+
+  /* Congestion window has probably collapsed, start over */
+  now = uv_now(config->loop);
+  idle = now - client->record_last;
+  if (config->frontend.record.idle_reset > 0 &&
+      idle >= (uint64_t) config->frontend.record.idle_reset) {
+    client->record_sent = 0;
+  }
+  client->record_last = now;
+
+  if (client->record_sent >= (uint64_t) config->frontend.record.boost_after)
+    return limit;
+  if ((size_t) config->frontend.record.initial < limit)
+    limit = config->frontend.record.initial;
+  return limit;
+}
+
+
+int bud_client_coalesce_wait(bud_client_t* client, size_t limit) {
+  int r;
+  bud_config_t* config;
+
+  config = client->config;
+  if (config->frontend.coalesce.delay <= 0 || client->coalesce_flush)
+    return 0;
+
+  /* Client is waiting for the greeting, don't hold it back */
+  if (client->greeting)
+    return 0;
+
+  /* Enough for the full record */
+  if (ringbuffer_size(bud_client_plain_in(client)) >= limit)
+    return 0;
+
+  /* No more data is coming (or won't be read until this is sent) */
+  if (client->backend.reading != kBudProgressRunning)
+    return 0;
+
+  if (!client->coalesce_init) {
+    r = uv_timer_init(config->loop, &client->coalesce_timer);
+    if (r != 0)
+      return 0;
+    client->coalesce_timer.data = client;
+    client->coalesce_init = 1;
+    client->destroy_waiting++;
+  }
+
+  /* Already waiting, the delay is counted from the oldest pending data */
+  if (uv_is_active((uv_handle_t*) &client->coalesce_timer))
+    return 1;
+
+  r = uv_timer_start(&client->coalesce_timer,
+                     bud_client_coalesce_cb,
+                     config->frontend.coalesce.delay,
+                     0);
+  return r == 0;
+}
+
+
+size_t bud_client_coalesce(bud_client_t* client,
+                           size_t limit,
+                           char** data) {
+  char* out[RING_BUFFER_COUNT];
+  size_t size[ARRAY_SIZE(out)];
+  size_t count;
+  size_t total;
+  size_t piece;
+  size_t i;
+
+  *data = ringbuffer_read_next(bud_client_plain_in(client), &total);
+
+  /* Whole record is contiguous */
+  if (total >= limit)
+    return limit;
+
+  /* Nothing to gather */
+  if (total == ringbuffer_size(bud_client_plain_in(client)))
+    return total;
+
+  /*
+   * Record crosses the chunk boundary, gather it. Data is not consumed, so
+   * SSL_write() may be retried with the same payload (the moving buffer is
+   * fine, see SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER)
+   */
+  count = ARRAY_SIZE(out);
+  ringbuffer_read_nextv(bud_client_plain_in(client), out, size, &count);
+  total = 0;
+  for (i = 0; i < count && total < limit; i++) {
+    piece = size[i];
+    if (piece > limit - total)
+      piece = limit - total;
+    memcpy(client->config->record + total, out[i], piece);
+    total += piece;
+  }
+
+  *data = client->config->record;
+  return total;
+}
+
+
+void bud_client_coalesce_cb(uv_timer_t* timer, int status) {
+  bud_client_t* client;
+
+  client = timer->data;
+  client->coalesce_flush = 1;
+  bud_client_cycle(client);
+  client->coalesce_flush = 0;
+}
+
+
+#ifdef SSL_MODE_ASYNC
+int bud_client_async_wait(bud_client_t* client, int err) {
+  bud_config_t* config;
+  OSSL_ASYNC_FD fd;
+  size_t count;
+  int r;
+
+  /*
+   * The engine signals its fd once the operation is done. Each wait gets
+   * a fresh poll handle: the fd belongs to the job, and the job may go to
+   * another client once this one is finished with it.
+   */
+  config = client->config;
+  count = 0;
+  if (err == SSL_ERROR_WANT_ASYNC &&
+      client->async_poll_state == kBudProgressNone &&
+      SSL_get_all_async_fds(client->ssl, NULL, &count) &&
+      count == 1 &&
+      SSL_get_all_async_fds(client->ssl, &fd, &count)) {
+    r = uv_poll_init(config->loop, &client->async_poll, fd);
+    if (r != 0)
+      goto fatal;
+    client->async_poll.data = client;
+    client->async_poll_state = kBudProgressRunning;
+    client->destroy_waiting++;
+
+    r = uv_poll_start(&client->async_poll,
+                      UV_READABLE,
+                      bud_client_async_poll_cb);
+    if (r != 0)
+      goto fatal;
+    client->async_waiting = 1;
+    return 0;
+  }
+
+  /* Out of async jobs, or nothing to poll on: try again a bit later */
+  if (!client->async_timer_init) {
+    r = uv_timer_init(config->loop, &client->async_timer);
+    if (r != 0)
+      goto fatal;
+    client->async_timer.data = client;
+    client->async_timer_init = 1;
+    client->destroy_waiting++;
+  }
+  r = uv_timer_start(&client->async_timer, bud_client_async_timer_cb, 1, 0);
+  if (r != 0)
+    goto fatal;
+  client->async_waiting = 1;
+  return 0;
+
+fatal:
+  NOTICE(&client->frontend,
+         "failed to wait for async job: %d - \"%s\"",
+         r,
+         uv_strerror(r));
+  client->stats.reason = "engine error";
+  bud_client_close(client, &client->frontend);
+  return -1;
+}
+
+
+void bud_client_async_poll_cb(uv_poll_t* handle, int status, int events) {
+  bud_client_t* client;
+
+  /* Resumed job reports its own errors */
+  client = handle->data;
+  client->async_waiting = 0;
+  client->async_poll_state = kBudProgressDone;
+  uv_close((uv_handle_t*) handle, bud_client_async_close_cb);
+  bud_client_cycle(client);
+}
+
+
+void bud_client_async_timer_cb(uv_timer_t* timer, int status) {
+  bud_client_t* client;
+
+  client = timer->data;
+  client->async_waiting = 0;
+  bud_client_cycle(client);
+}
+
+
+void bud_client_async_close_cb(uv_handle_t* handle) {
+  bud_client_t* client;
+
+  client = handle->data;
+  client->async_poll_state = kBudProgressNone;
+  bud_client_close_cb(handle);
+}
+#endif  /* SSL_MODE_ASYNC */
+
+
+int bud_client_throttle(bud_client_t* client,
+                        bud_client_side_t* side,
+                        ringbuffer* buf) {
+  int err;
+  bud_client_side_t* opposite;
+
+  /* Reading resumes only once it drains below `low_watermark` */
+  if (ringbuffer_size(buf) >= side->high_watermark ||
+      ringbuffer_is_full(buf)) {
+    /* ...but backend goes on into `backend.spill` */
+    if (buf == &client->frontend.output && bud_client_spill_start(client))
+      return 0;
+
+    opposite = side == &client->frontend ? &client->backend : &client->frontend;
+    if (opposite->reading != kBudProgressRunning)
+      return 1;
+
+    DBG(opposite, "throttle, buffer full: %ld", ringbuffer_size(buf));
+    BUD_PROBE3(throttle__on, client, opposite->type, ringbuffer_size(buf));
+    bud_metrics_inc(client->config,
+                    opposite == &client->frontend ?
+                        kBudMetricThrottledFrontend :
+                        kBudMetricThrottledBackend);
+    client->class_throttles++;
+
+    err = uv_read_stop((uv_stream_t*) &opposite->tcp);
+    if (err != 0) {
+      NOTICE(opposite,
+             "uv_read_stop failed: %d - \"%s\"",
+             err,
+             uv_strerror(err));
+      bud_client_close(client, opposite);
+      return -1;
+    }
+    opposite->reading = kBudProgressNone;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/* Returns 1 if reads of the backend may go on into `spill` */
+int bud_client_spill_start(bud_client_t* client) {
+  bud_config_t* config;
+
+  config = client->config;
+  if (config->backend.spill.dir == NULL ||
+      config->frontend.passthrough ||
+      client->upstream != NULL ||
+      client->spill_failed ||
+      client->spill_paused) {
+    return 0;
+  }
+  if (client->spill != NULL)
+    return 1;
+
+  /* Room for one more read when it is just short of `max` */
+  client->spill = bud_spill_new(
+      config->backend.spill.dir,
+      (uint64_t) config->backend.spill.max + BUD_CLIENT_READ_BUF_SIZE);
+  if (client->spill == NULL) {
+    NOTICE(&client->backend,
+           "can't spill to \"%s\": %d - \"%s\"",
+           config->backend.spill.dir,
+           errno,
+           strerror(errno));
+    client->spill_failed = 1;
+    return 0;
+  }
+
+  DBG_LN(&client->backend, "spilling");
+  return 1;
+}
+
+
+int bud_client_spill_write(bud_client_t* client,
+                           const char* data,
+                           size_t size) {
+  int r;
+
+  if (bud_spill_write(client->spill, data, size) != 0) {
+    NOTICE(&client->backend,
+           "spill write failed: %d - \"%s\"",
+           errno,
+           strerror(errno));
+    client->stats.reason = "spill error";
+    return -1;
+  }
+  bud_metrics_add(client->config, kBudMetricSpilled, size);
+  if (client->spill->size < (uint64_t) client->config->backend.spill.max)
+    return 0;
+
+  /* Full, resumed by bud_client_spill_refill() */
+  DBG_LN(&client->backend, "spill is full");
+  r = uv_read_stop((uv_stream_t*) &client->backend.tcp);
+  client->backend.reading = kBudProgressNone;
+  client->spill_paused = 1;
+  return r;
+}
+
+
+int bud_client_spill_refill(bud_client_t* client) {
+  ringbuffer* in;
+  size_t avail;
+  char* ptr;
+  int r;
+
+  in = &client->backend.input;
+  while (client->spill->size != 0 &&
+         ringbuffer_size(in) < client->backend.high_watermark) {
+    avail = 0;
+    ptr = ringbuffer_write_ptr(in, &avail);
+    if (ptr == NULL)
+      break;
+
+    r = bud_spill_read(client->spill, ptr, avail);
+    if (r < 0) {
+      NOTICE(&client->backend,
+             "spill read failed: %d - \"%s\"",
+             errno,
+             strerror(errno));
+      client->stats.reason = "spill error";
+      bud_client_close(client, &client->frontend);
+      return -1;
+    }
+    ringbuffer_write_append(in, r);
+  }
+
+  /* Half of it is drained, backend may go on */
+  if (!client->spill_paused ||
+      client->spill->size > (uint64_t) client->config->backend.spill.max / 2) {
+    return 0;
+  }
+  client->spill_paused = 0;
+  if (client->backend.reading != kBudProgressNone ||
+      client->backend.close != kBudProgressNone) {
+    return 0;
+  }
+
+  /* ...once the `frontend.bandwidth` pause is over */
+  if (client->shape.waiting) {
+    client->shape.paused = 1;
+    return 0;
+  }
+
+  DBG_LN(&client->backend, "read_start after spill");
+  r = uv_read_start((uv_stream_t*) &client->backend.tcp,
+                    bud_client_alloc_cb,
+                    bud_client_read_cb);
+  if (r != 0) {
+    NOTICE(&client->backend,
+           "uv_read_start() failed: %d - \"%s\"",
+           r,
+           uv_strerror(r));
+    bud_client_close(client, &client->backend);
+    return -1;
+  }
+  client->backend.reading = kBudProgressRunning;
+  return 0;
+}
+
+
+int bud_client_send(bud_client_t* client, bud_client_side_t* side) {
+  char* out[RING_BUFFER_COUNT];
+  uv_buf_t buf[RING_BUFFER_COUNT + 1];
+  size_t size[ARRAY_SIZE(out)];
+  size_t count;
+  size_t total;
+  size_t n;
+  size_t i;
+  bud_client_write_t* w;
+  int r;
+
+  /* Failed, or all write slots are taken */
+  if (side->write == kBudProgressDone ||
+      side->write_count == BUD_CLIENT_MAX_WRITES) {
+    return 0;
+  }
+
+  /* io_uring writes may be short, the rest must go right after them */
+  if (client->config->uring != NULL && side->write_count != 0)
+    return 0;
+
+  /* If client is closed - stop sending */
+  if (client->close == kBudProgressDone)
+    return 0;
+
+  /* Backend still connecting */
+  if (side == &client->backend && client->connect != kBudProgressDone)
+    return 0;
+
+  /* Whatever is not in flight yet */
+  count = ARRAY_SIZE(out);
+  total = ringbuffer_read_nextv_at(&side->output,
+                                   side->write_size,
+                                   out,
+                                   size,
+                                   &count);
+  if (total == 0)
+    return 0;
+
+  /* For the flush classes, see bud_client_flush_class() */
+  if (side == &client->frontend) {
+    client->recent_bytes = bud_client_recent_bytes(client) + total;
+    client->config->flush_bytes += total;
+  }
+
+  /* Response time, from the first request byte to the first response one */
+  if (side == &client->backend &&
+      client->latency_start == 0 &&
+      client->selected != NULL &&
+      client->config->backend.balance_type == kBudBalancePeakEWMA) {
+    client->latency_start = uv_hrtime();
+  }
+
+#ifdef BUD_CLIENT_ZEROCOPY
+  /*
+   * Large write, let the kernel send it from `output`. Only if libuv has
+   * nothing queued (it would be sent before that), and while the side is
+   * read: EPOLLERR of the notification wakes bud_client_read_cb() then
+   */
+  if (side->zerocopy != 0 &&
+      total >= side->zerocopy &&
+      side->reading == kBudProgressRunning &&
+      side->tcp.write_queue_size == 0) {
+    r = bud_client_send_zerocopy(client, side, out, size, count);
+    if (r < 0)
+      return -1;
+
+    /* Socket is full, the rest is queued in libuv */
+    if (r > 0) {
+      if (side->write_count == BUD_CLIENT_MAX_WRITES)
+        return 0;
+      count = ARRAY_SIZE(out);
+      total = ringbuffer_read_nextv_at(&side->output,
+                                       side->write_size,
+                                       out,
+                                       size,
+                                       &count);
+      if (total == 0)
+        return 0;
+    }
+  }
+#endif  /* BUD_CLIENT_ZEROCOPY */
+
+  /*
+   * Nothing in flight (nor a PROXY header), socket most likely has room.
+   * With io_uring the write is batched with the others instead
+   */
+  if (side->write_count == 0 &&
+      client->config->uring == NULL &&
+      !(side == &client->backend && client->proxyline_len != 0)) {
+    for (i = 0; i < count; i++)
+      buf[i] = uv_buf_init(out[i], size[i]);
+    r = uv_try_write((uv_stream_t*) &side->tcp, buf, count);
+    if (r < 0 && r != UV_EAGAIN && r != UV_ENOSYS) {
+      side->write = kBudProgressDone;
+      NOTICE(side,
+             "uv_try_write() failed: %d - \"%s\"",
+             r,
+             uv_strerror(r));
+      bud_client_close(client, side);
+      return -1;
+    }
+
+    /* Queue only the remainder */
+    if (r > 0) {
+      DBG(side, "uv_try_write(%ld) => %d", total, r);
+      bud_client_send_consumed(client, side, r);
+      count = ARRAY_SIZE(out);
+      total = ringbuffer_read_nextv(&side->output, out, size, &count);
+      if (total == 0)
+        return bud_client_send_done(client, side);
+    }
+  }
+
+  DBG(side,
+      "uv_write(%ld) iovcnt: %ld in flight: %d",
+      total,
+      count,
+      side->write_count);
+
+  /* PROXY v2 header rides in the same segment as the first bytes */
+  n = 0;
+  if (side == &client->backend && client->proxyline_len != 0) {
+    /* Handshake is done by then, unless it's 0-RTT data */
+    bud_client_proxyline_tlvs(client);
+    buf[n++] = uv_buf_init(client->proxyline, client->proxyline_len);
+  }
+  for (i = 0; i < count; i++)
+    buf[n + i] = uv_buf_init(out[i], size[i]);
+
+  w = &side->writes[(side->write_head + side->write_count) %
+                    BUD_CLIENT_MAX_WRITES];
+  w->req.data = client;
+  w->size = total;
+  w->done = 0;
+  w->zerocopy = 0;
+
+  /* PROXY header isn't in `output`, short writes of it are up to libuv */
+  if (client->config->uring != NULL && n == 0) {
+    r = bud_client_send_uring(client, side, w, buf, count);
+  } else {
+    r = uv_write(&w->req,
+                 (uv_stream_t*) &side->tcp,
+                 buf,
+                 n + count,
+                 bud_client_send_cb);
+  }
+  if (r == 0) {
+    /* Stays in `client` until the write is done */
+    if (n != 0)
+      client->proxyline_len = 0;
+    bud_client_send_started(client, side, total);
+    return 0;
+  }
+
+  side->write = kBudProgressDone;
+  NOTICE(side,
+         "uv_write() failed: %d - \"%s\"",
+         r,
+         uv_strerror(r));
+  bud_client_close(client, side);
+  return -1;
+}
+
+
+void bud_client_send_started(bud_client_t* client,
+                             bud_client_side_t* side,
+                             size_t size) {
+  side->write = kBudProgressRunning;
+  side->write_count++;
+  side->write_size += size;
+
+  /* Deadline is for the oldest write, don't push it further */
+  if (side->write_count == 1 && client->config->frontend.timeout.write > 0) {
+    side->write_deadline = uv_now(client->config->loop) +
+                           client->config->frontend.timeout.write;
+    bud_client_timeout_update(client);
+  }
+}
+
+
+void bud_client_send_cb(uv_write_t* req, int status) {
+  bud_client_t* client;
+  bud_client_side_t* side;
+  bud_client_write_t* w;
+
+  /* Closing, ignore */
+  if (status == UV_ECANCELED)
+    return;
+
+  client = req->data;
+  w = container_of(req, bud_client_write_t, req);
+  side = bud_client_write_side(client, w);
+
+  if (status != 0) {
+    NOTICE(side,
+           "uv_write() cb failed: %d - \"%s\"",
+           status,
+           uv_strerror(status));
+    side->write = kBudProgressDone;
+    return bud_client_close(client, side);
+  }
+
+  bud_client_send_complete(client, side, w, w->size);
+}
+
+
+int bud_client_send_uring(bud_client_t* client,
+                          bud_client_side_t* side,
+                          bud_client_write_t* w,
+                          uv_buf_t* buf,
+                          size_t count) {
+  uv_os_fd_t fd;
+  size_t i;
+  int r;
+
+  r = uv_fileno((uv_handle_t*) &side->tcp, &fd);
+  if (r != 0)
+    return r;
+
+  /* `buf` is on the stack, iovecs must outlive the submission */
+  for (i = 0; i < count; i++) {
+    w->iov[i].iov_base = buf[i].base;
+    w->iov[i].iov_len = buf[i].len;
+  }
+  w->op.cb = bud_client_send_uring_cb;
+  w->op.data = client;
+
+  return bud_uring_writev(client->config->uring, fd, w->iov, count, &w->op);
+}
+
+
+void bud_client_send_uring_cb(bud_uring_op_t* op, int res) {
+  bud_client_t* client;
+  bud_client_side_t* side;
+  bud_client_write_t* w;
+
+  client = op->data;
+  w = container_of(op, bud_client_write_t, op);
+  side = bud_client_write_side(client, w);
+
+  /* Closed while in flight, now `output` may go */
+  if (side->uring_waiting != 0) {
+    side->uring_waiting--;
+    return bud_client_close_cb((uv_handle_t*) &side->tcp);
+  }
+
+  if (res < 0) {
+    NOTICE(side,
+           "io_uring writev() failed: %d - \"%s\"",
+           res,
+           uv_strerror(res));
+    side->write = kBudProgressDone;
+    return bud_client_close(client, side);
+  }
+
+  /* Short write, the rest is still in `output` and goes next */
+  bud_client_send_complete(client, side, w, res);
+}
+
+
+#ifdef BUD_CLIENT_ZEROCOPY
+int bud_client_send_zerocopy(bud_client_t* client,
+                             bud_client_side_t* side,
+                             char** out,
+                             size_t* size,
+                             size_t count) {
+  struct iovec iov[RING_BUFFER_COUNT];
+  struct msghdr msg;
+  uv_os_fd_t fd;
+  bud_client_write_t* w;
+  ssize_t r;
+  size_t i;
+
+  if (uv_fileno((uv_handle_t*) &side->tcp, &fd) != 0)
+    return 0;
+
+  for (i = 0; i < count; i++) {
+    iov[i].iov_base = out[i];
+    iov[i].iov_len = size[i];
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+
+  do
+    r = sendmsg(fd, &msg, MSG_ZEROCOPY | MSG_NOSIGNAL);
+  while (r == -1 && errno == EINTR);
+
+  /* Full, or out of `optmem_max` for pinning - a copying write will do */
+  if (r == -1 &&
+      (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+    return 0;
+  }
+  if (r == -1) {
+    r = -errno;
+    side->write = kBudProgressDone;
+    NOTICE(side,
+           "sendmsg(MSG_ZEROCOPY) failed: %d - \"%s\"",
+           (int) r,
+           uv_strerror(r));
+    bud_client_close(client, side);
+    return -1;
+  }
+
+  /* Sent, but `output` is kernel's until the notification with this id */
+  DBG(side, "sendmsg(MSG_ZEROCOPY, %ld) => %ld", (long) count, (long) r);
+  w = &side->writes[(side->write_head + side->write_count) %
+                    BUD_CLIENT_MAX_WRITES];
+  w->size = r;
+  w->done = 0;
+  w->zerocopy = 1;
+  w->zerocopy_id = side->zerocopy_next++;
+  side->zerocopy_count++;
+  bud_client_send_started(client, side, r);
+  bud_client_zerocopy_watch(client);
+
+  return r;
+}
+
+
+void bud_client_zerocopy_reap(bud_client_t* client, bud_client_side_t* side) {
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr* cm;
+  struct sock_extended_err* serr;
+  uv_os_fd_t fd;
+  int count;
+
+  if (uv_fileno((uv_handle_t*) &side->tcp, &fd) != 0)
+    return;
+
+  count = side->zerocopy_count;
+  while (side->zerocopy_count != 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      break;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+        continue;
+      }
+      serr = (struct sock_extended_err*) CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      /* Kernel had to copy it anyway (loopback, no scatter-gather) */
+      if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0 &&
+          side->zerocopy != 0) {
+        DBG_LN(side, "zerocopy writes are copied, turning them off");
+        side->zerocopy = 0;
+      }
+      bud_client_zerocopy_done(side, serr->ee_info, serr->ee_data);
+    }
+  }
+
+  if (side->zerocopy_count != count)
+    bud_client_send_pop(client, side);
+}
+
+
+void bud_client_zerocopy_done(bud_client_side_t* side,
+                              uint32_t lo,
+                              uint32_t hi) {
+  bud_client_write_t* w;
+  int i;
+
+  /* Inclusive range of ids, may wrap around */
+  for (i = 0; i < side->write_count; i++) {
+    w = &side->writes[(side->write_head + i) % BUD_CLIENT_MAX_WRITES];
+    if (!w->zerocopy || w->done || w->zerocopy_id - lo > hi - lo)
+      continue;
+
+    w->done = 1;
+    w->written = w->size;
+    side->zerocopy_count--;
+  }
+}
+#endif  /* BUD_CLIENT_ZEROCOPY */
+
+
+bud_client_side_t* bud_client_write_side(bud_client_t* client,
+                                         bud_client_write_t* w) {
+  if (w >= client->frontend.writes &&
+      w < client->frontend.writes + BUD_CLIENT_MAX_WRITES) {
+    return &client->frontend;
+  }
+  return &client->backend;
+}
+
+
+void bud_client_send_complete(bud_client_t* client,
+                              bud_client_side_t* side,
+                              bud_client_write_t* w,
+                              size_t written) {
+  /* Plain writes complete in order, but MSG_ZEROCOPY ones before may not */
+  ASSERT(!w->done, "Write completed twice");
+  w->done = 1;
+  w->written = written;
+  bud_client_touch(client);
+  bud_client_send_pop(client, side);
+}
+
+
+void bud_client_send_pop(bud_client_t* client, bud_client_side_t* side) {
+  bud_client_write_t* w;
+  int popped;
+
+  /* `output` is consumed in order, up to the oldest write in flight */
+  popped = 0;
+  while (side->write_count != 0) {
+    w = &side->writes[side->write_head];
+    if (!w->done)
+      break;
+
+    side->write_head = (side->write_head + 1) % BUD_CLIENT_MAX_WRITES;
+    side->write_count--;
+    side->write_size -= w->size;
+    popped = 1;
+
+    DBG(side, "write_cb => %ld", w->written);
+    bud_client_send_consumed(client, side, w->written);
+  }
+  if (!popped)
+    return;
+
+  if (side->write_count == 0) {
+    side->write = kBudProgressNone;
+    side->write_deadline = 0;
+  } else if (client->config->frontend.timeout.write > 0) {
+    /* The next one has made it to the head of the queue */
+    side->write_deadline = uv_now(client->config->loop) +
+                           client->config->frontend.timeout.write;
+    bud_client_timeout_update(client);
+  }
+
+  bud_client_send_done(client, side);
+}
+
+
+void bud_client_send_consumed(bud_client_t* client,
+                              bud_client_side_t* side,
+                              size_t size) {
+  if (side == &client->frontend) {
+    if (client->stats.flight == 0 && size != 0)
+      client->stats.flight = uv_now(client->config->loop);
+    client->stats.bytes_out += size;
+    bud_metrics_add(client->config, kBudMetricBytesOut, size);
+  }
+  bud_client_queue_consume(client,
+                           &side->output_queue,
+                           &side->output,
+                           size,
+                           side == &client->frontend ?
+                               kBudMetricQueueFrontend :
+                               kBudMetricQueueBackend);
+  ringbuffer_read_skip(&side->output, size);
+}
+
+
+int bud_client_send_done(bud_client_t* client, bud_client_side_t* side) {
+  int r;
+  bud_client_side_t* opposite;
+
+  opposite = side == &client->frontend ? &client->backend : &client->frontend;
+
+  if (side == &client->frontend)
+    bud_client_uncork(client);
+
+  /* Start reading, if stopped and not closing */
+  if (opposite == &client->backend && client->shape.waiting) {
+    /* ...backend is resumed by bud_client_shape_cb() after the pause */
+    client->shape.paused = 1;
+  } else if (opposite->close != kBudProgressDone &&
+             opposite->reading == kBudProgressNone &&
+             !(opposite == &client->backend && client->spill_paused) &&
+             side->close != kBudProgressDone &&
+             side->shutdown != kBudProgressDone &&
+             ringbuffer_size(&side->output) <= side->low_watermark) {
+    DBG_LN(opposite, "read_start");
+    BUD_PROBE3(throttle__off,
+               client,
+               opposite->type,
+               ringbuffer_size(&side->output));
+    r = uv_read_start((uv_stream_t*) &opposite->tcp,
+                      bud_client_alloc_cb,
+                      bud_client_read_cb);
+    if (r != 0) {
+      NOTICE(opposite,
+             "uv_read_start() failed: %d - \"%s\"",
+             r,
+             uv_strerror(r));
+      bud_client_close(client, opposite);
+      return -1;
+    }
+    opposite->reading = kBudProgressRunning;
+  }
+
+  /* Cycle again */
+  bud_client_cycle(client);
+
+  if (side->close == kBudProgressRunning ||
+      side->shutdown == kBudProgressRunning) {
+    if (bud_client_side_pending(client, side))
+      return 0;
+
+    /* No new data, destroy or shutdown */
+    if (side->shutdown == kBudProgressRunning)
+      return bud_client_shutdown(client, side);
+    bud_client_close(client, side);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+const char* bud_client_servername(bud_client_t* client, size_t* len) {
+#ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
+  const char* servername;
+
+  /* Hello is in the buffer that was consumed by the handshake */
+  if (client->ssl != NULL && SSL_is_init_finished(client->ssl)) {
+    servername = SSL_get_servername(client->ssl, TLSEXT_NAMETYPE_host_name);
+    *len = servername == NULL ? 0 : strlen(servername);
+    return servername;
+  }
+#endif  /* SSL_CTRL_SET_TLSEXT_SERVERNAME_CB */
+
+  if (client->hs == NULL) {
+    *len = 0;
+    return NULL;
+  }
+  *len = client->hs->hello.servername_len;
+  return client->hs->hello.servername;
+}
+
+
+/* NPN or ALPN protocol, known once the handshake is done (or in 0-RTT) */
+const unsigned char* bud_client_protocol(bud_client_t* client,
+                                         unsigned int* len) {
+  const unsigned char* proto;
+
+  proto = NULL;
+  *len = 0;
+#ifdef OPENSSL_NPN_NEGOTIATED
+  if (client->ssl == NULL)
+    return NULL;
+
+  SSL_get0_next_proto_negotiated(client->ssl, &proto, len);
+# ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+  if (*len == 0)
+    SSL_get0_alpn_selected(client->ssl, &proto, len);
+# endif  /* TLSEXT_TYPE_application_layer_protocol_negotiation */
+#endif  /* OPENSSL_NPN_NEGOTIATED */
+
+  return proto;
+}
+
+
+bud_backend_list_t* bud_client_backend_list(bud_client_t* client) {
+  bud_config_t* config;
+  bud_context_t* ctx;
+  const char* servername;
+  size_t servername_len;
+  const unsigned char* proto;
+  unsigned int proto_len;
+
+  config = client->config;
+
+  /* HTTP/2 is multiplexed by a server that speaks it, not by the app */
+  if (config->h2_backends.count != 0) {
+    proto = bud_client_protocol(client, &proto_len);
+    if (proto_len == 2 && memcmp(proto, "h2", 2) == 0)
+      return &config->h2_backends;
+  }
+
+  /* Backends from the SNI response */
+  if (client->sni_ctx != NULL && client->sni_ctx->backends.count != 0)
+    return &client->sni_ctx->backends;
+
+  /* Backends of the static context with the same servername */
+  servername = bud_client_servername(client, &servername_len);
+  if (servername_len != 0) {
+    ctx = bud_config_select_context(config, servername, servername_len);
+    if (ctx != NULL && ctx->backends.count != 0)
+      return &ctx->backends;
+  }
+
+  /* Backends of the listener's context */
+  ctx = bud_client_default_context(client);
+  if (ctx->backends.count != 0)
+    return &ctx->backends;
+
+  return &config->backends;
+}
+
+
+bud_context_t* bud_client_default_context(bud_client_t* client) {
+  return client->listener->context;
+}
+
+
+void bud_client_session_bind(bud_client_t* client) {
+  unsigned char sid_ctx[SHA256_DIGEST_LENGTH];
+
+  client->hs->session_bound = 1;
+  if (client->ssl == NULL)
+    return;
+
+  /* SSL_set_SSL_CTX() keeps the listener's one, and it is too late anyway */
+  bud_context_sid_ctx(bud_client_context(client), sid_ctx);
+  SSL_set_session_id_context(client->ssl, sid_ctx, sizeof(sid_ctx));
+}
+
+
+/* Same as for the backends: SNI response, servername, listener */
+bud_context_t* bud_client_context(bud_client_t* client) {
+  bud_context_t* ctx;
+  const char* servername;
+  size_t servername_len;
+
+  if (client->context != NULL)
+    return client->context;
+
+  ctx = client->sni_ctx;
+  if (ctx == NULL) {
+    servername = bud_client_servername(client, &servername_len);
+    if (servername_len != 0) {
+      ctx = bud_config_select_context(client->config,
+                                      servername,
+                                      servername_len);
+    }
+  }
+  if (ctx == NULL)
+    ctx = bud_client_default_context(client);
+
+  client->context = ctx;
+  return ctx;
+}
+
+
+int bud_client_quota_admit(bud_client_t* client) {
+  bud_config_t* config;
+  bud_context_t* ctx;
+
+  config = client->config;
+  if (!config->frontend.quota.enabled || client->quota_checked)
+    return 1;
+  client->quota_checked = 1;
+
+  ctx = bud_client_context(client);
+  if (ctx->quota.connections > 0 &&
+      ctx->quota.active >= ctx->quota.connections) {
+    bud_metrics_inc(config, kBudMetricQuotaConnections);
+    client->stats.reason = "connection quota";
+    goto reject;
+  }
+
+  /* Abbreviated handshakes are cheap, only full ones take a token */
+  if (ctx->quota.handshakes > 0 &&
+      client->ssl != NULL &&
+      client->hs != NULL &&
+      client->hs->hello.session_len == 0 &&
+      client->hs->hello.ticket_len == 0 &&
+      !bud_shape_take(&ctx->quota.bucket,
+                      ctx->quota.handshakes,
+                      ctx->quota.handshakes,
+                      uv_now(config->loop))) {
+    bud_metrics_inc(config, kBudMetricQuotaHandshakes);
+    client->stats.reason = "handshake quota";
+    goto reject;
+  }
+
+  ctx->quota.active++;
+  client->quota_slot = 1;
+  return 1;
+
+reject:
+  LOG_LN(kBudLogNotice, &client->frontend, "over context quota, closing");
+  bud_client_close(client, &client->frontend);
+  return 0;
+}
+
+
+void bud_client_quota_release(bud_client_t* client) {
+  if (!client->quota_slot)
+    return;
+
+  client->context->quota.active--;
+  client->quota_slot = 0;
+}
+
+
+const char* bud_client_peer_key(bud_client_t* client, size_t* len) {
+  struct sockaddr_storage* peer;
+
+  peer = &client->peer;
+  if (peer->ss_family == AF_INET) {
+    *len = sizeof(struct in_addr);
+    return (const char*) &((struct sockaddr_in*) peer)->sin_addr;
+  } else if (peer->ss_family == AF_INET6) {
+    *len = sizeof(struct in6_addr);
+    return (const char*) &((struct sockaddr_in6*) peer)->sin6_addr;
+  }
+
+  *len = 0;
+  return NULL;
+}
+
+
+int bud_client_rate_limited(bud_client_t* client) {
+  const char* key;
+  size_t key_len;
+
+  if (client->config->ratelimit == NULL)
+    return 0;
+
+  key = bud_client_peer_key(client, &key_len);
+  if (bud_ratelimit_allow(client->config->ratelimit,
+                          key,
+                          key_len,
+                          uv_now(client->config->loop))) {
+    return 0;
+  }
+
+  DBG_LN(&client->frontend, "rate limited");
+  return 1;
+}
+
+
+int bud_client_denied(bud_client_t* client) {
+  if (client->config->access == NULL)
+    return 0;
+  if (bud_access_allowed(client->config->access, &client->peer))
+    return 0;
+
+  DBG_LN(&client->frontend, "denied by access list");
+  return 1;
+}
+
+
+int bud_client_fingerprint_denied(bud_client_t* client) {
+  bud_config_t* config;
+
+  config = client->config;
+  if (config->fingerprint == NULL)
+    return 0;
+  if (bud_fingerprint_allowed(config->fingerprint,
+                              client->hs->hello.fingerprint,
+                              uv_now(config->loop))) {
+    return 0;
+  }
+
+  bud_metrics_inc(config, kBudMetricFingerprintDenied);
+  DBG_LN(&client->frontend, "denied by fingerprint");
+  return 1;
+}
+
+
+int bud_client_connect(bud_client_t* client) {
+  int r;
+  int reuse;
+  const char* key;
+  size_t key_len;
+  bud_config_t* config;
+  bud_backend_t* backend;
+
+  config = client->config;
+
+  /* Key for the hash-based balancing */
+  key = NULL;
+  key_len = 0;
+  if (config->backend.balance_type == kBudBalanceSNIHash) {
+    key = bud_client_servername(client, &key_len);
+  } else if (config->backend.balance_type == kBudBalanceIPHash) {
+    key = bud_client_peer_key(client, &key_len);
+  }
+
+  backend = bud_backend_select(config,
+                               bud_client_backend_list(client),
+                               key,
+                               key_len);
+
+  /* ClientHello is queued right away, and goes out once connected */
+  if (backend->tls) {
+    r = bud_client_upstream_new(client, backend);
+    if (r != 0)
+      return r;
+  }
+
+  r = bud_client_backend_init(client, backend->is_pipe);
+  if (r != 0)
+    return r;
+
+  client->stats.connect = uv_now(config->loop);
+  client->backend_row = bud_client_backend_row(config, backend);
+
+  /* Warm connection, no need to wait for connect_cb */
+  if (bud_backend_pool_take(backend, &client->backend.tcp) == 0) {
+    DBG_LN(&client->backend, "using pooled connection");
+    client->connect = kBudProgressDone;
+  } else if (backend->is_pipe) {
+    /* Errors are reported to connect_cb */
+    uv_pipe_connect(&client->connect_req,
+                    &client->backend.pipe,
+                    backend->host,
+                    bud_client_connect_cb);
+    client->connect = kBudProgressRunning;
+  } else {
+    if (config->backend.happy_eyeballs > 0 && backend->addr_count > 1) {
+      r = bud_client_race_start(client, backend);
+    } else {
+      if (config->backend.fastopen)
+        bud_client_backend_fastopen(client, backend);
+      r = uv_tcp_connect(&client->connect_req,
+                         &client->backend.tcp,
+                         (struct sockaddr*) &backend->addr,
+                         bud_client_connect_cb);
+    }
+    if (r != 0) {
+      if (client->backend_row != NULL)
+        client->backend_row->values[kBudRowConnectErrors]++;
+      client->backend_row = NULL;
+      bud_backend_failed(backend);
+      return r;
+    }
+    client->connect = kBudProgressRunning;
+  }
+  client->selected = backend;
+  backend->active++;
+  if (client->connect == kBudProgressRunning &&
+      config->backend.balance_type == kBudBalancePeakEWMA) {
+    client->latency_start = uv_hrtime();
+  }
+  if (client->backend_row != NULL)
+    client->backend_row->values[kBudRowBackendClients]++;
+
+  /* PROXY header and TLS state belong to this client only */
+  reuse = config->backend.http_reuse &&
+          !config->frontend.passthrough &&
+          !config->frontend.proxyline &&
+          !backend->tls &&
+          backend->pool.enabled;
+  if (client->http.enabled) {
+    /* Parsed since the handshake for `buffer_request`, state is kept */
+    client->http.reuse = reuse;
+    client->http.enabled = reuse || client->http.xforward;
+  } else if (reuse || config->backend.xforward) {
+    bud_client_http_init(client, reuse);
+  }
+
+  if (backend->is_pipe)
+    return 0;
+
+  r = uv_tcp_nodelay(&client->backend.tcp, 1);
+  if (r == 0 && backend->keepalive > 0)
+    r = uv_tcp_keepalive(&client->backend.tcp, 1, backend->keepalive);
+  if (r == 0)
+    bud_client_side_tune(client, &client->backend, &config->backend.buffer);
+
+  return r;
+}
+
+
+void bud_client_backend_fastopen(bud_client_t* client,
+                                 bud_backend_t* backend) {
+#ifdef TCP_FASTOPEN_CONNECT
+  int fd;
+  int on;
+
+  /*
+   * connect() returns right away, and SYN goes out with the first write
+   * (proxyline or the client's data). Anything failing here - libuv creates
+   * an ordinary socket in uv_tcp_connect()
+   */
+  fd = socket(backend->addr.ss_family,
+              SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+              0);
+  if (fd == -1)
+    return;
+
+  on = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on, sizeof(on)) != 0 ||
+      uv_tcp_open(&client->backend.tcp, fd) != 0) {
+    close(fd);
+  }
+#endif  /* TCP_FASTOPEN_CONNECT */
+}
+
+
+int bud_client_connect_deferred(bud_client_t* client) {
+  int r;
+
+  if (client->connect != kBudProgressNone ||
+      client->close != kBudProgressNone) {
+    return 0;
+  }
+
+  /*
+   * Handshake floods should not reach backends, passthrough can't tell.
+   * 0-RTT data comes only with a resumed session, so it's not a flood.
+   * `h2_backends` are picked by the protocol, negotiated in the handshake.
+   */
+  if ((client->config->backend.lazy_connect ||
+       client->config->h2_backends.count != 0) &&
+      client->ssl != NULL &&
+      !client->early_data &&
+      !SSL_is_init_finished(client->ssl)) {
+    return 0;
+  }
+
+  /* Slow uploads don't hold a backend connection */
+  if (!bud_client_http_buffered(client))
+    return 0;
+
+  r = bud_client_connect(client);
+  if (r == 0)
+    return 0;
+
+  WARNING(&client->backend,
+          "uv_connect() failed: %d - \"%s\"",
+          r,
+          uv_strerror(r));
+  client->connect = kBudProgressDone;
+  bud_client_close(client, &client->backend);
+  return -1;
+}
+
+
+int bud_client_race_start(bud_client_t* client, bud_backend_t* backend) {
+  bud_client_race_t* race;
+  int delay;
+  int r;
+
+  race = malloc(sizeof(*race));
+  if (race == NULL)
+    return UV_ENOMEM;
+
+  race->client = client;
+  race->backend = backend;
+  race->count = bud_backend_addrs(backend,
+                                  race->addrs,
+                                  ARRAY_SIZE(race->addrs));
+  race->next = 0;
+  race->pending = 0;
+  race->last_err = 0;
+  r = uv_timer_init(client->config->loop, &race->timer);
+  if (r != 0) {
+    free(race);
+    return r;
+  }
+  race->timer.data = race;
+  race->refs = 1;
+
+  delay = client->config->backend.happy_eyeballs;
+  r = bud_client_race_next(race);
+  if (r == 0) {
+    r = uv_timer_start(&race->timer,
+                       bud_client_race_timer_cb,
+                       delay,
+                       delay);
+  }
+  if (r != 0) {
+    bud_client_race_close(race);
+    return r;
+  }
+
+  client->race = race;
+  return 0;
+}
+
+
+int bud_client_race_next(bud_client_race_t* race) {
+  bud_client_attempt_t* attempt;
+  int r;
+
+  /* Address that fails right away is skipped without waiting */
+  while (race->next < race->count) {
+    attempt = &race->attempts[race->next];
+    attempt->race = race;
+    attempt->index = race->next++;
+    r = uv_tcp_init(race->backend->config->loop, &attempt->tcp);
+    if (r != 0) {
+      race->last_err = r;
+      return r;
+    }
+    attempt->tcp.data = race;
+    attempt->open = 1;
+    race->refs++;
+
+    r = uv_tcp_connect(&attempt->req,
+                       &attempt->tcp,
+                       (struct sockaddr*) &race->addrs[attempt->index],
+                       bud_client_race_connect_cb);
+    if (r == 0) {
+      race->pending++;
+      return 0;
+    }
+
+    race->last_err = r;
+    bud_backend_addr_failed(race->backend, &race->addrs[attempt->index]);
+    attempt->open = 0;
+    uv_close((uv_handle_t*) &attempt->tcp, bud_client_race_close_cb);
+  }
+
+  return race->last_err;
+}
+
+
+void bud_client_race_timer_cb(uv_timer_t* timer, int status) {
+  bud_client_race_t* race;
+  int r;
+
+  race = timer->data;
+
+  /* Previous ones are still connecting, give the next one a chance too */
+  if (race->next < race->count) {
+    r = bud_client_race_next(race);
+    if (r != 0 && race->pending == 0)
+      return bud_client_race_finish(race, r);
+  }
+  if (race->next == race->count)
+    uv_timer_stop(&race->timer);
+}
+
+
+void bud_client_race_connect_cb(uv_connect_t* req, int status) {
+  bud_client_attempt_t* attempt;
+  bud_client_race_t* race;
+  bud_client_t* client;
+
+  attempt = container_of(req, bud_client_attempt_t, req);
+  race = attempt->race;
+  client = race->client;
+  race->pending--;
+
+  /* Lost the race, or the client is gone */
+  if (status == UV_ECANCELED || client == NULL)
+    return;
+
+  if (status == 0) {
+    bud_backend_addr_succeeded(race->backend, &race->addrs[attempt->index]);
+    return bud_client_race_finish(race, bud_client_race_adopt(race, attempt));
+  }
+
+  DBG(&client->backend,
+      "connect attempt %d failed: %d",
+      attempt->index,
+      status);
+  race->last_err = status;
+  bud_backend_addr_failed(race->backend, &race->addrs[attempt->index]);
+  attempt->open = 0;
+  uv_close((uv_handle_t*) &attempt->tcp, bud_client_race_close_cb);
+
+  /* Don't wait for the timer, the next one gets its full delay */
+  if (race->next < race->count && bud_client_race_next(race) == 0)
+    uv_timer_again(&race->timer);
+  if (race->pending == 0)
+    bud_client_race_finish(race, race->last_err);
+}
+
+
+int bud_client_race_adopt(bud_client_race_t* race,
+                          bud_client_attempt_t* attempt) {
+  bud_client_t* client;
+  uv_os_fd_t fd;
+  int copy;
+  int r;
+
+  /*
+   * Client's handle has no socket yet, it gets a duplicate of the winner's
+   * one. Attempt's handle is closed with the rest
+   */
+  client = race->client;
+  r = uv_fileno((uv_handle_t*) &attempt->tcp, &fd);
+  if (r != 0)
+    return r;
+  copy = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  if (copy == -1)
+    return -errno;
+  r = uv_tcp_open(&client->backend.tcp, copy);
+  if (r != 0) {
+    close(copy);
+    return r;
+  }
+
+  r = uv_tcp_nodelay(&client->backend.tcp, 1);
+  if (r == 0 && race->backend->keepalive > 0) {
+    r = uv_tcp_keepalive(&client->backend.tcp,
+                         1,
+                         race->backend->keepalive);
+  }
+  if (r == 0) {
+    bud_client_side_tune(client,
+                         &client->backend,
+                         &client->config->backend.buffer);
+  }
+  return r;
+}
+
+
+void bud_client_race_finish(bud_client_race_t* race, int status) {
+  bud_client_t* client;
+
+  client = race->client;
+  client->race = NULL;
+  bud_client_race_close(race);
+  bud_client_connect_done(client, status);
+}
+
+
+void bud_client_race_close(bud_client_race_t* race) {
+  bud_client_attempt_t* attempt;
+  int i;
+
+  /* Connects in flight are cancelled */
+  race->client = NULL;
+  for (i = 0; i < race->next; i++) {
+    attempt = &race->attempts[i];
+    if (!attempt->open)
+      continue;
+    attempt->open = 0;
+    uv_close((uv_handle_t*) &attempt->tcp, bud_client_race_close_cb);
+  }
+  uv_close((uv_handle_t*) &race->timer, bud_client_race_close_cb);
+}
+
+
+void bud_client_race_close_cb(uv_handle_t* handle) {
+  bud_client_race_t* race;
+
+  race = handle->data;
+  if (--race->refs == 0)
+    free(race);
+}
+
+
+void bud_client_connect_cb(uv_connect_t* req, int status) {
+  bud_client_t* client;
+
+  client = container_of(req, bud_client_t, connect_req);
+
+  /* Next connect goes to the other address of the name, if there is one */
+  if (status == 0)
+    bud_backend_addr_succeeded(client->selected, &client->selected->addr);
+  else if (status != UV_ECANCELED)
+    bud_backend_addr_failed(client->selected, &client->selected->addr);
+  bud_client_connect_done(client, status);
+}
+
+
+void bud_client_connect_done(bud_client_t* client, int status) {
+  DBG(&client->backend, "connect %d", status);
+
+  client->connect = kBudProgressDone;
+  if (status != 0 && status != UV_ECANCELED) {
+    WARNING(&client->backend,
+           "uv_connect() failed: %d - \"%s\"",
+           status,
+           uv_strerror(status));
+    if (client->backend_row != NULL)
+      client->backend_row->values[kBudRowConnectErrors]++;
+
+    /* Eject backend after `backend.health_check.max_fails` failures */
+    bud_backend_failed(client->selected);
+    return bud_client_close(client, &client->backend);
+  }
+  if (status != 0)
+    return;
+  bud_backend_succeeded(client->selected);
+  bud_client_latency_observe(client);
+  if (client->backend_row != NULL) {
+    client->backend_row->values[kBudRowConnects]++;
+    client->backend_row->values[kBudRowConnectSum] +=
+        uv_now(client->config->loop) - client->stats.connect;
+  }
+
+  /*
+   * We will start reading once handshake will be performed, but data might
+   * be already waiting if the connect was deferred. `server_first` backends
+   * are read right away if the handshake is already done, TLS ones - to
+   * get the ServerHello.
+   */
+  if (!ringbuffer_is_empty(&client->backend.output) ||
+      client->selected->server_first ||
+      client->upstream != NULL) {
+    bud_client_cycle(client);
+  }
+}
+
+
+void bud_client_latency_observe(bud_client_t* client) {
+  uint64_t now;
+
+  if (client->latency_start == 0 || client->selected == NULL)
+    return;
+
+  now = uv_hrtime();
+  bud_backend_observe(client->selected, (now - client->latency_start) / 1000);
+  client->latency_start = 0;
+}
+
+
+void bud_client_http_init(bud_client_t* client, int reuse) {
+  const char* key;
+  size_t key_len;
+  char addr[INET6_ADDRSTRLEN];
+  int r;
+
+  http_parser_init(&client->http.request, HTTP_REQUEST);
+  http_parser_init(&client->http.response, HTTP_RESPONSE);
+  client->http.request.data = client;
+  client->http.response.data = client;
+  client->http.enabled = 1;
+  client->http.reuse = reuse;
+  client->http.xforward = client->config->backend.xforward;
+  client->http.broken = 0;
+  client->http.line = 1;
+  client->http.body = 0;
+  client->http.requests = 0;
+  client->http.responses = 0;
+  client->http.heads = 0;
+  client->http.in_request = 0;
+  client->http.in_response = 0;
+  client->http.keepalive = 1;
+  client->http.head = 0;
+  client->http.buffered = 0;
+  client->http.xff_len = 0;
+  if (!client->http.xforward)
+    return;
+
+  /* Real address, see `frontend.accept_proxyline` */
+  key = bud_client_peer_key(client, &key_len);
+  if (key == NULL ||
+      inet_ntop(client->peer.ss_family, key, addr, sizeof(addr)) == NULL) {
+    snprintf(addr, sizeof(addr), "unknown");
+  }
+  r = snprintf(client->http.xff,
+               sizeof(client->http.xff),
+               "X-Forwarded-For: %s\r\nX-Forwarded-Proto: https\r\n",
+               addr);
+  ASSERT(r > 0 && r < (int) sizeof(client->http.xff), "xff overflow");
+  client->http.xff_len = r;
+}
+
+
+/* Returns the number of bytes parsed, less than `size` at a request end */
+size_t bud_client_http_feed(bud_client_t* client,
+                            http_parser* parser,
+                            const char* data,
+                            size_t size) {
+  size_t parsed;
+
+  if (!client->http.enabled || client->http.broken)
+    return size;
+
+  parsed = http_parser_execute(parser, &bud_client_http_settings, data, size);
+
+  /* Paused by bud_client_http_complete_cb() for `xforward` */
+  if (HTTP_PARSER_ERRNO(parser) == HPE_PAUSED) {
+    http_parser_pause(parser, 0);
+    return parsed;
+  }
+
+  /* Upgrades (i.e. WebSocket) and garbage make connection not reusable */
+  if (parsed != size || parser->upgrade) {
+    DBG_LN(&client->backend, "not an HTTP/1.1 keepalive connection");
+    client->http.broken = 1;
+  }
+  return size;
+}
+
+
+/*
+ * SSL_read() for `backend.xforward`. Request line and headers are peeked
+ * first, and read only up to the end of the line (to insert `xff` right
+ * after it) or of the request. Bodies with Content-Length are read as
+ * usual, up to their size. Appends to `plain_out`, returns as SSL_read().
+ */
+int bud_client_http_read(bud_client_t* client, char* out, size_t avail) {
+  http_parser* parser;
+  ringbuffer* rb;
+  const char* lf;
+  size_t skip;
+  size_t len;
+  int line_end;
+  int r;
+
+  parser = &client->http.request;
+  rb = bud_client_plain_out(client);
+  if (client->http.broken || client->http.body) {
+    if (client->http.body && avail > parser->content_length)
+      avail = parser->content_length;
+    r = SSL_read(client->ssl, out, avail);
+    if (r > 0) {
+      bud_client_http_feed(client, parser, out, r);
+      ringbuffer_write_append(rb, r);
+    }
+    return r;
+  }
+
+  r = SSL_peek(client->ssl, out, avail);
+  if (r <= 0)
+    return r;
+  len = r;
+
+  /* Empty lines before the request are allowed */
+  line_end = 0;
+  if (client->http.line) {
+    skip = 0;
+    while (!client->http.in_request &&
+           skip < len &&
+           (out[skip] == '\r' || out[skip] == '\n')) {
+      skip++;
+    }
+    lf = memchr(out + skip, '\n', len - skip);
+    if (lf != NULL) {
+      len = lf - out + 1;
+      line_end = 1;
+    }
+  }
+  len = bud_client_http_feed(client, parser, out, len);
+
+  /* Same bytes again, from the record that was peeked */
+  r = SSL_read(client->ssl, out, len);
+  ASSERT(r == (int) len, "SSL_read() is shorter than SSL_peek()");
+  ringbuffer_write_append(rb, r);
+
+  if (!line_end || client->http.broken)
+    return r;
+
+  client->http.line = 0;
+  if (ringbuffer_write_into(rb, client->http.xff, client->http.xff_len) != 0) {
+    NOTICE(&client->backend,
+           "failed to insert X-Forwarded-For: %d",
+           (int) client->http.xff_len);
+    client->stats.reason = "xforward error";
+    bud_client_close(client, &client->frontend);
+  }
+  return r;
+}
+
+
+int bud_client_http_begin_cb(http_parser* parser) {
+  bud_client_t* client;
+
+  client = parser->data;
+  if (parser == &client->http.request)
+    client->http.in_request = 1;
+  else
+    client->http.in_response = 1;
+  return 0;
+}
+
+
+int bud_client_http_headers_cb(http_parser* parser) {
+  bud_client_t* client;
+  uint32_t bit;
+
+  client = parser->data;
+  if (parser == &client->http.request) {
+    /* Responses to HEAD have no body, whatever the headers say */
+    if (client->http.requests - client->http.responses >= 32) {
+      client->http.broken = 1;
+      return 0;
+    }
+    bit = 1U << (client->http.requests % 32);
+    if (parser->method == HTTP_HEAD)
+      client->http.heads |= bit;
+    else
+      client->http.heads &= ~bit;
+
+    /* Body of known size is read without peeking */
+    client->http.body = !(parser->flags & F_CHUNKED) &&
+                        parser->content_length != 0 &&
+                        parser->content_length != (uint64_t) -1;
+    client->http.head = 1;
+    return 0;
+  }
+
+  bit = 1U << (client->http.responses % 32);
+  return (client->http.heads & bit) != 0 ? 1 : 0;
+}
+
+
+int bud_client_http_body_cb(http_parser* parser,
+                            const char* at,
+                            size_t length) {
+  bud_client_t* client;
+
+  client = parser->data;
+  if (parser == &client->http.request && client->http.requests == 0)
+    client->http.buffered += length;
+  return 0;
+}
+
+
+int bud_client_http_complete_cb(http_parser* parser) {
+  bud_client_t* client;
+
+  client = parser->data;
+  if (parser == &client->http.request) {
+    client->http.in_request = 0;
+    client->http.requests++;
+
+    /* Stop at the end of request, next one gets `xff` too */
+    if (client->http.xforward) {
+      client->http.line = 1;
+      client->http.body = 0;
+      http_parser_pause(parser, 1);
+    }
+  } else {
+    client->http.in_response = 0;
+
+    /* 100 Continue and the like precede the real response */
+    if (parser->status_code < 200)
+      return 0;
+    client->http.responses++;
+    if (client->http.responses > client->http.requests)
+      client->http.broken = 1;
+  }
+
+  if (!http_should_keep_alive(parser))
+    client->http.keepalive = 0;
+  return 0;
+}
+
+
+/*
+ * `backend.buffer_request`: the first request is far enough along to
+ * connect. Anything that isn't HTTP/1.x, and requests that don't fit into
+ * the buffer, are connected to as they are.
+ */
+int bud_client_http_buffered(bud_client_t* client) {
+  bud_config_t* config;
+  ringbuffer* rb;
+
+  config = client->config;
+  if (!config->backend.buffer_request.enabled || client->ssl == NULL)
+    return 1;
+
+  /* Proxyline and hello are parsed by now, `xff` has the real address */
+  if (!client->http.enabled) {
+    bud_client_http_init(client, 0);
+    return 0;
+  }
+
+  rb = bud_client_plain_out(client);
+  if (client->http.broken ||
+      client->http.requests != 0 ||
+      ringbuffer_size(rb) >= client->backend.high_watermark ||
+      ringbuffer_is_full(rb)) {
+    return 1;
+  }
+  if (!client->http.head)
+    return 0;
+
+  return client->http.buffered >=
+         (uint64_t) config->backend.buffer_request.body;
+}
+
+
+/* Every request got its complete response, and both sides keep it alive */
+int bud_client_http_idle(bud_client_t* client) {
+  return client->http.reuse &&
+         !client->http.broken &&
+         client->http.keepalive &&
+         !client->http.in_request &&
+         !client->http.in_response &&
+         client->http.requests == client->http.responses &&
+         client->connect == kBudProgressDone &&
+         client->backend.reading != kBudProgressDone &&
+         client->backend.shutdown == kBudProgressNone &&
+         client->backend.write_count == 0 &&
+         ringbuffer_is_empty(&client->backend.output) &&
+         ringbuffer_is_empty(&client->backend.input);
+}
+
+
+/* Idle backend connection outlives the client, returns 0 if it did */
+int bud_client_http_release(bud_client_t* client) {
+  if (!bud_client_http_idle(client))
+    return -1;
+  if (bud_backend_pool_put(client->selected, &client->backend.tcp) != 0)
+    return -1;
+
+  DBG(&client->backend,
+      "returned to the pool after %u requests",
+      client->http.requests);
+  client->http.enabled = 0;
+  bud_metrics_inc(client->config, kBudMetricBackendReused);
+  return 0;
+}
+
+
+int bud_client_backend_read(bud_client_t* client) {
+  int r;
+
+  if (client->selected == NULL ||
+      (!client->selected->server_first && client->upstream == NULL)) {
+    return 0;
+  }
+
+  /* Same as in bud_client_send_done(), throttled reads resume below it */
+  if (client->connect != kBudProgressDone ||
+      client->backend.reading != kBudProgressNone ||
+      client->backend.close != kBudProgressNone ||
+      client->frontend.close != kBudProgressNone ||
+      client->frontend.shutdown != kBudProgressNone ||
+      ringbuffer_size(&client->frontend.output) >
+          client->frontend.low_watermark) {
+    return 0;
+  }
+
+  /* Resumed by bud_client_shape_cb() */
+  if (client->shape.waiting) {
+    client->shape.paused = 1;
+    return 0;
+  }
+
+  /* Greeting must not leak before the client is authenticated */
+  if (client->selected->server_first &&
+      client->ssl != NULL &&
+      !SSL_is_init_finished(client->ssl)) {
+    return 0;
+  }
+
+  DBG_LN(&client->backend, "read_start, backend speaks first");
+  r = uv_read_start((uv_stream_t*) &client->backend.tcp,
+                    bud_client_alloc_cb,
+                    bud_client_read_cb);
+  if (r != 0) {
+    NOTICE(&client->backend,
+           "uv_read_start() failed: %d - \"%s\"",
+           r,
+           uv_strerror(r));
+    bud_client_close(client, &client->backend);
+    return -1;
+  }
+  client->backend.reading = kBudProgressRunning;
+  client->greeting = client->selected->server_first;
+  return 0;
+}
 
-    return 1;
+
+int bud_client_upstream_new(bud_client_t* client, bud_backend_t* backend) {
+  BIO* enc_in;
+  BIO* enc_out;
+  const char* servername;
+
+  client->upstream = SSL_new(client->config->backend.tls.ctx);
+  if (client->upstream == NULL)
+    return UV_ENOMEM;
+
+  if (!SSL_set_ex_data(client->upstream, kBudSSLClientIndex, client))
+    return UV_ENOMEM;
+
+  SSL_set_info_callback(client->upstream, bud_client_upstream_info_cb);
+
+  /* Ciphertext goes through the backend's socket buffers */
+  enc_in = bud_bio_new(&client->backend.input);
+  if (enc_in == NULL)
+    return UV_ENOMEM;
+  enc_out = bud_bio_new(&client->backend.output);
+  if (enc_out == NULL) {
+    BIO_free_all(enc_in);
+    return UV_ENOMEM;
+  }
+  SSL_set_bio(client->upstream, enc_in, enc_out);
+  SSL_set_read_ahead(client->upstream, 1);
+
+  servername = client->config->backend.tls.servername;
+  if (servername != NULL) {
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    SSL_set_tlsext_host_name(client->upstream, servername);
+#endif  /* SSL_CTRL_SET_TLSEXT_HOSTNAME */
+#ifdef X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS
+    if (client->config->backend.tls.ca != NULL) {
+      X509_VERIFY_PARAM_set1_host(SSL_get0_param(client->upstream),
+                                  servername,
+                                  0);
+    }
+#endif  /* X509_CHECK_FLAG_NO_PARTIAL_WILDCARDS */
   }
 
+  /* Abbreviated handshake, if the backend has given us a session before */
+  if (backend->tls_session != NULL)
+    SSL_set_session(client->upstream, backend->tls_session);
+
+  SSL_set_connect_state(client->upstream);
   return 0;
 }
 
 
-int bud_client_send(bud_client_t* client, bud_client_side_t* side) {
-  char* out[RING_BUFFER_COUNT];
-  uv_buf_t buf[RING_BUFFER_COUNT];
-  size_t size[ARRAY_SIZE(out)];
-  size_t count;
-  size_t i;
-  int r;
+int bud_client_upstream_session_cb(SSL* ssl, SSL_SESSION* sess) {
+  bud_client_t* client;
+  bud_backend_t* backend;
 
-  /* Already writing */
-  if (side->write != kBudProgressNone)
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+  backend = client->selected;
+  if (backend == NULL)
     return 0;
 
-  /* If client is closed - stop sending */
-  if (client->close == kBudProgressDone)
-    return 0;
+  /* Keep the reference, newer tickets replace older ones */
+  if (backend->tls_session != NULL)
+    SSL_SESSION_free(backend->tls_session);
+  backend->tls_session = sess;
+  return 1;
+}
 
-  /* Backend still connecting */
-  if (side == &client->backend && client->connect != kBudProgressDone)
-    return 0;
 
-  count = ARRAY_SIZE(out);
-  side->write_size = ringbuffer_read_nextv(&side->output, out, size, &count);
-  if (side->write_size == 0)
-    return 0;
+void bud_client_upstream_info_cb(const SSL* ssl, int where, int ret) {
+  bud_client_t* client;
 
-  DBG(side, "uv_write(%ld) iovcnt: %ld", side->write_size, count);
+  if ((where & SSL_CB_HANDSHAKE_DONE) == 0)
+    return;
 
-  for (i = 0; i < count; i++)
-    buf[i] = uv_buf_init(out[i], size[i]);
-  side->write_req.data = client;
-
-  r = uv_write(&side->write_req,
-               (uv_stream_t*) &side->tcp,
-               buf,
-               count,
-               bud_client_send_cb);
-  if (r == 0) {
-    side->write = kBudProgressRunning;
-    return 0;
-  }
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+  DBG(&client->backend,
+      "upstream handshake done, resumed: %d",
+      SSL_session_reused((SSL*) ssl));
+  if (SSL_session_reused((SSL*) ssl))
+    bud_metrics_inc(client->config, kBudMetricUpstreamResumed);
+  else
+    bud_metrics_inc(client->config, kBudMetricUpstreamFull);
+}
 
-  side->write = kBudProgressDone;
-  NOTICE(side,
-         "uv_write() failed: %d - \"%s\"",
-         r,
-         uv_strerror(r));
-  bud_client_close(client, side);
-  return -1;
+
+ringbuffer* bud_client_plain_in(bud_client_t* client) {
+  if (client->upstream != NULL)
+    return &client->upstream_in;
+  return &client->backend.input;
 }
 
 
-void bud_client_send_cb(uv_write_t* req, int status) {
-  int r;
-  bud_client_t* client;
-  bud_client_side_t* side;
-  bud_client_side_t* opposite;
+ringbuffer* bud_client_plain_out(bud_client_t* client) {
+  if (client->upstream != NULL)
+    return &client->upstream_out;
+  return &client->backend.output;
+}
 
-  /* Closing, ignore */
-  if (status == UV_ECANCELED)
-    return;
 
-  client = req->data;
+int bud_client_side_pending(bud_client_t* client, bud_client_side_t* side) {
+  if (!ringbuffer_is_empty(&side->output))
+    return 1;
 
-  if (req == &client->frontend.write_req) {
-    side = &client->frontend;
-    opposite = &client->backend;
-  } else {
-    side = &client->backend;
-    opposite = &client->frontend;
+  /* Backend's data is still in the file */
+  if (side == &client->frontend &&
+      client->spill != NULL &&
+      client->spill->size != 0) {
+    return 1;
   }
 
-  if (status != 0) {
-    NOTICE(side,
-           "uv_write() cb failed: %d - \"%s\"",
-           status,
-           uv_strerror(status));
-    side->write = kBudProgressDone;
-    return bud_client_close(client, side);
-  }
+  /* Not encrypted yet */
+  return side == &client->backend &&
+         !ringbuffer_is_empty(&client->upstream_out);
+}
 
-  /* Consume written data */
-  DBG(side, "write_cb => %d", side->write_size);
-  ringbuffer_read_skip(&side->output, side->write_size);
 
-  side->write = kBudProgressNone;
-  side->write_size = 0;
+int bud_client_upstream_in(bud_client_t* client) {
+  int read;
+  size_t avail;
+  char* out;
+  uint64_t start;
+  int handshake;
 
-  /* Start reading, if stopped and not closing */
-  if (opposite->close != kBudProgressDone &&
-      opposite->reading == kBudProgressNone &&
-      side->close != kBudProgressDone &&
-      side->shutdown != kBudProgressDone &&
-      !ringbuffer_is_full(&side->output)) {
-    DBG_LN(opposite, "read_start");
-    r = uv_read_start((uv_stream_t*) &opposite->tcp,
-                      bud_client_alloc_cb,
-                      bud_client_read_cb);
-    if (r != 0) {
-      NOTICE(opposite,
-             "uv_read_start() failed: %d - \"%s\"",
-             r,
-             uv_strerror(r));
-      return bud_client_close(client, opposite);
+  if (client->upstream == NULL)
+    return 0;
+
+  for (;;) {
+    /* The rest stays encrypted until frontend catches up */
+    if (ringbuffer_size(&client->upstream_in) >=
+        client->backend.high_watermark) {
+      return 0;
     }
-    opposite->reading = kBudProgressRunning;
+
+    avail = 0;
+    out = ringbuffer_write_ptr(&client->upstream_in, &avail);
+    start = bud_client_cpu_start(client, client->upstream, &handshake);
+    read = SSL_read(client->upstream, out, avail);
+    bud_client_cpu_stop(client, start, handshake);
+    DBG(&client->backend, "SSL_read() => %d", read);
+    if (read <= 0)
+      break;
+    ringbuffer_write_append(&client->upstream_in, read);
   }
 
-  /* Cycle again */
-  bud_client_cycle(client);
+  return bud_client_upstream_error(client, read);
+}
 
-  if (side->close == kBudProgressRunning ||
-      side->shutdown == kBudProgressRunning) {
-    if (!ringbuffer_is_empty(&side->output))
-      return;
 
-    /* No new data, destroy or shutdown */
-    if (side->shutdown == kBudProgressRunning)
-      bud_client_shutdown(client, side);
-    else
-      bud_client_close(client, side);
+int bud_client_upstream_out(bud_client_t* client) {
+  int written;
+  char* data;
+  size_t size;
+  uint64_t start;
+  int handshake;
+
+  if (client->upstream == NULL)
+    return 0;
+
+  /* Nothing to send yet, but the handshake may start */
+  if (!SSL_is_init_finished(client->upstream)) {
+    start = bud_client_cpu_start(client, client->upstream, &handshake);
+    written = SSL_do_handshake(client->upstream);
+    bud_client_cpu_stop(client, start, handshake);
+    if (written <= 0)
+      return bud_client_upstream_error(client, written);
+  }
+
+  written = 0;
+  while (!ringbuffer_is_empty(&client->upstream_out)) {
+    /* Slow backend, keep the rest in plaintext */
+    if (ringbuffer_size(&client->backend.output) >=
+        client->backend.high_watermark) {
+      break;
+    }
+
+    /* Retry is never shorter, the head chunk can only grow */
+    data = ringbuffer_read_next(&client->upstream_out, &size);
+    start = bud_client_cpu_start(client, client->upstream, &handshake);
+    written = SSL_write(client->upstream, data, size);
+    bud_client_cpu_stop(client, start, handshake);
+    DBG(&client->backend, "SSL_write() => %d", written);
+    if (written <= 0)
+      return bud_client_upstream_error(client, written);
+
+    /* Partial write (the chunk may span records), the rest goes next */
+    ringbuffer_read_skip(&client->upstream_out, written);
   }
+
+  return 0;
 }
 
 
-void bud_client_connect_cb(uv_connect_t* req, int status) {
-  bud_client_t* client;
+int bud_client_upstream_error(bud_client_t* client, int ret) {
+  int err;
 
-  client = container_of(req, bud_client_t, connect_req);
-  DBG(&client->backend, "connect %d", status);
+  err = SSL_get_error(client->upstream, ret);
+  if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    return 0;
 
-  client->connect = kBudProgressDone;
-  if (status != 0 && status != UV_ECANCELED) {
-    WARNING(&client->backend,
-           "uv_connect() failed: %d - \"%s\"",
-           status,
-           uv_strerror(status));
-    return bud_client_close(client, &client->backend);
-  }
+  /* close_notify, EOF on the socket follows */
+  if (err == SSL_ERROR_ZERO_RETURN)
+    return 0;
 
-  /* Do nothing, we will start reading once handshake will be performed */
+  NOTICE(&client->backend,
+         "upstream SSL failed : %d - \"%s\"",
+         err,
+         bud_sslerror_str(err));
+  client->stats.reason = "backend ssl error";
+  bud_client_close(client, &client->backend);
+  return -1;
 }
 
 
@@ -782,20 +6467,32 @@ int bud_client_shutdown(bud_client_t* client, bud_client_side_t* side) {
   if (side->shutdown || client->close == kBudProgressDone)
     return 0;
 
+  /* Backend was never connected, nothing to shutdown */
+  if (side == &client->backend && client->connect == kBudProgressNone) {
+    bud_client_close(client, side);
+    return -1;
+  }
+
   side->shutdown = kBudProgressNone;
 
   /* Try cycling data to figure out if there is still something to send */
   bud_client_cycle(client);
 
   /* Not empty, send everything first */
-  if (!ringbuffer_is_empty(&side->output)) {
+  if (bud_client_side_pending(client, side)) {
     side->shutdown = kBudProgressRunning;
     return 0;
   }
 
+  /* No FIN for the idle backend, it goes back to the pool */
+  if (side == &client->backend && bud_client_http_release(client) == 0) {
+    bud_client_close(client, side);
+    return -1;
+  }
+
   DBG_LN(side, "shutdown");
 
-  if (side == &client->frontend) {
+  if (side == &client->frontend && client->ssl != NULL) {
     if (SSL_shutdown(client->ssl) == 0)
       SSL_shutdown(client->ssl);
 
@@ -803,6 +6500,13 @@ int bud_client_shutdown(bud_client_t* client, bud_client_side_t* side) {
     if (bud_client_send(client, &client->frontend) != 0)
       goto fatal;
   }
+  if (side == &client->backend &&
+      client->upstream != NULL &&
+      SSL_is_init_finished(client->upstream)) {
+    SSL_shutdown(client->upstream);
+    if (bud_client_send(client, &client->backend) != 0)
+      goto fatal;
+  }
 
   side->shutdown_req.data = client;
   r = uv_shutdown(&side->shutdown_req,
@@ -852,8 +6556,7 @@ void bud_client_shutdown_cb(uv_shutdown_t* req, int status) {
 
 int bud_client_prepend_proxyline(bud_client_t* client) {
   int r;
-  struct sockaddr_storage storage;
-  int storage_size;
+  struct sockaddr_storage* storage;
   struct sockaddr_in* addr;
   struct sockaddr_in6* addr6;
   const char* family;
@@ -861,20 +6564,18 @@ int bud_client_prepend_proxyline(bud_client_t* client) {
   int16_t port;
   char proxyline[256];
 
-  storage_size = sizeof(storage);
-  r = uv_tcp_getpeername(&client->frontend.tcp,
-                         (struct sockaddr*) &storage,
-                         &storage_size);
-  if (r != 0)
-    return r;
+  /* Real one, if it came in PROXY header */
+  storage = &client->peer;
+  if (client->config->frontend.proxyline == BUD_PROXYLINE_V2)
+    return bud_client_encode_proxyline_v2(client, storage);
 
-  addr = (struct sockaddr_in*) &storage;
-  addr6 = (struct sockaddr_in6*) &storage;
-  if (storage.ss_family == AF_INET) {
+  addr = (struct sockaddr_in*) storage;
+  addr6 = (struct sockaddr_in6*) storage;
+  if (storage->ss_family == AF_INET) {
     family = "TCP4";
     port = addr->sin_port;
     r = uv_inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host));
-  } else if (storage.ss_family == AF_INET6) {
+  } else if (storage->ss_family == AF_INET6) {
     family = "TCP6";
     port = addr6->sin6_port;
     r = uv_inet_ntop(AF_INET6, &addr6->sin6_addr, host, sizeof(host));
@@ -887,13 +6588,189 @@ int bud_client_prepend_proxyline(bud_client_t* client) {
 
   r = snprintf(proxyline,
                sizeof(proxyline),
-               client->config->proxyline_fmt,
+               client->listener->proxyline_fmt,
                family,
                host,
                ntohs(port));
   ASSERT(r < (int) sizeof(proxyline), "Client proxyline overflow");
 
-  return (int) ringbuffer_write_into(&client->backend.input, proxyline, r);
+  return (int) ringbuffer_write_into(&client->backend.output, proxyline, r);
+}
+
+
+int bud_client_encode_proxyline_v2(bud_client_t* client,
+                                   struct sockaddr_storage* storage) {
+  static const char mapped[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, -1, -1 };
+  bud_config_listener_t* listener;
+  struct sockaddr_in* addr;
+  struct sockaddr_in6* addr6;
+  char* p;
+  uint16_t port;
+
+  listener = client->listener;
+  addr = (struct sockaddr_in*) storage;
+  addr6 = (struct sockaddr_in6*) storage;
+  memcpy(client->proxyline,
+         listener->proxyline_v2,
+         listener->proxyline_v2_len);
+  client->proxyline_len = listener->proxyline_v2_len;
+  p = client->proxyline + 16;
+
+  /* Already in network order, no formatting needed */
+  if (listener->addr.ss_family == AF_INET &&
+      storage->ss_family == AF_INET) {
+    memcpy(p, &addr->sin_addr, 4);
+    port = addr->sin_port;
+    memcpy(p + 8, &port, sizeof(port));
+  } else if (listener->addr.ss_family == AF_INET6 &&
+             storage->ss_family == AF_INET6) {
+    memcpy(p, &addr6->sin6_addr, 16);
+    port = addr6->sin6_port;
+    memcpy(p + 32, &port, sizeof(port));
+  } else if (listener->addr.ss_family == AF_INET6 &&
+             storage->ss_family == AF_INET) {
+    /* IPv4 client from PROXY header on IPv6 listener, as `::ffff:a.b.c.d` */
+    memcpy(p, mapped, sizeof(mapped));
+    memcpy(p + sizeof(mapped), &addr->sin_addr, 4);
+    port = addr->sin_port;
+    memcpy(p + 32, &port, sizeof(port));
+  } else {
+    /* Can't tell, backend should use the connection's address */
+    client->proxyline[13] = 0x00;
+    client->proxyline_len = 16;
+  }
+  return 0;
+}
+
+
+void bud_client_proxyline_tlvs(bud_client_t* client) {
+  const char* servername;
+  size_t servername_len;
+  const char* str;
+  char ssl_head[5];
+  char resumed;
+  char cn[256];
+  X509* peer;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned int digest_len;
+  uint32_t verify;
+  size_t ssl_start;
+  size_t len;
+  int r;
+  const unsigned char* proto;
+  unsigned int proto_len;
+
+  /* Passthrough has only what the hello had */
+  servername = bud_client_servername(client, &servername_len);
+  if (servername_len != 0) {
+    bud_client_proxyline_tlv(client,
+                             BUD_PP2_TYPE_AUTHORITY,
+                             servername,
+                             servername_len);
+  }
+
+  /* Backend should refuse non-idempotent requests that came in it */
+  if (client->early_data) {
+    resumed = 1;
+    bud_client_proxyline_tlv(client,
+                             BUD_PP2_TYPE_EARLY_DATA,
+                             &resumed,
+                             sizeof(resumed));
+  }
+  if (client->ssl == NULL || !SSL_is_init_finished(client->ssl))
+    goto done;
+
+  proto = bud_client_protocol(client, &proto_len);
+  if (proto_len != 0)
+    bud_client_proxyline_tlv(client, BUD_PP2_TYPE_ALPN, proto, proto_len);
+
+  resumed = SSL_session_reused(client->ssl) ? 1 : 0;
+  bud_client_proxyline_tlv(client,
+                           BUD_PP2_TYPE_RESUMED,
+                           &resumed,
+                           sizeof(resumed));
+
+  /* `verify` is zero only for the verified client certificate */
+  peer = SSL_get_peer_certificate(client->ssl);
+  ssl_head[0] = BUD_PP2_CLIENT_SSL;
+  verify = 1;
+  if (peer != NULL) {
+    ssl_head[0] |= resumed ? BUD_PP2_CLIENT_CERT_SESS :
+                             BUD_PP2_CLIENT_CERT_CONN;
+    verify = SSL_get_verify_result(client->ssl);
+  }
+  verify = htonl(verify);
+  memcpy(ssl_head + 1, &verify, sizeof(verify));
+
+  ssl_start = client->proxyline_len;
+  bud_client_proxyline_tlv(client, BUD_PP2_TYPE_SSL, ssl_head, 5);
+  if (client->proxyline_len == ssl_start)
+    goto done_peer;
+
+  str = SSL_get_version(client->ssl);
+  bud_client_proxyline_tlv(client,
+                           BUD_PP2_SUBTYPE_SSL_VERSION,
+                           str,
+                           strlen(str));
+  str = SSL_get_cipher_name(client->ssl);
+  if (str != NULL) {
+    bud_client_proxyline_tlv(client,
+                             BUD_PP2_SUBTYPE_SSL_CIPHER,
+                             str,
+                             strlen(str));
+  }
+  if (peer != NULL) {
+    r = X509_NAME_get_text_by_NID(X509_get_subject_name(peer),
+                                  NID_commonName,
+                                  cn,
+                                  sizeof(cn));
+    if (r > 0)
+      bud_client_proxyline_tlv(client, BUD_PP2_SUBTYPE_SSL_CN, cn, r);
+  }
+
+  /* Sub-TLVs are counted in the SSL one */
+  len = client->proxyline_len - ssl_start - 3;
+  client->proxyline[ssl_start + 1] = (len >> 8) & 0xff;
+  client->proxyline[ssl_start + 2] = len & 0xff;
+
+  /* Identity for backend's own authorization, CN alone may be reused */
+  if (peer != NULL &&
+      SSL_get_verify_result(client->ssl) == X509_V_OK &&
+      X509_digest(peer, EVP_sha256(), digest, &digest_len)) {
+    bud_client_proxyline_tlv(client,
+                             BUD_PP2_TYPE_CLIENT_CERT,
+                             digest,
+                             digest_len);
+  }
+
+done_peer:
+  if (peer != NULL)
+    X509_free(peer);
+
+done:
+  /* Everything after the first 16 bytes */
+  len = client->proxyline_len - 16;
+  client->proxyline[14] = (len >> 8) & 0xff;
+  client->proxyline[15] = len & 0xff;
+}
+
+
+void bud_client_proxyline_tlv(bud_client_t* client,
+                              int type,
+                              const void* data,
+                              size_t len) {
+  char* p;
+
+  /* Doesn't fit, the header is still valid without it */
+  if (client->proxyline_len + 3 + len > sizeof(client->proxyline))
+    return;
+
+  p = client->proxyline + client->proxyline_len;
+  p[0] = type;
+  p[1] = (len >> 8) & 0xff;
+  p[2] = len & 0xff;
+  memcpy(p + 3, data, len);
+  client->proxyline_len += 3 + len;
 }
 
 
@@ -902,10 +6779,49 @@ void bud_client_ssl_info_cb(const SSL* ssl, int where, int ret) {
   uint64_t now;
   uint64_t limit;
 
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+
+  /* Entry will notice it once it fires */
+  if ((where & SSL_CB_HANDSHAKE_DONE) != 0) {
+    BUD_PROBE3(handshake__done,
+               client,
+               SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name),
+               SSL_session_reused((SSL*) ssl));
+    client->handshake_deadline = 0;
+    bud_client_handshake_release(client);
+    if (client->stats.handshake == 0) {
+      client->stats.handshake = uv_now(client->config->loop);
+      client->stats.handshake_in = client->stats.bytes_in;
+      client->stats.handshake_out = client->stats.bytes_out;
+      client->context_row = bud_client_context_row(client);
+      if (SSL_session_reused((SSL*) ssl))
+        bud_metrics_inc(client->config, kBudMetricHandshakesResumed);
+      else
+        bud_metrics_inc(client->config, kBudMetricHandshakesFull);
+      if (client->context_row != NULL) {
+        client->context_row->values[SSL_session_reused((SSL*) ssl) ?
+            kBudRowHandshakesResumed : kBudRowHandshakesFull]++;
+        client->context_row->values[kBudRowClients]++;
+      }
+      bud_metrics_observe(client->config,
+                          kBudMetricHandshakeTime,
+                          client->stats.handshake - client->stats.accept);
+      if (client->config->metrics.tcp_info.enabled)
+        bud_client_tcp_sample(client);
+    }
+
+    /* Nothing looks at the hello anymore, unless it is captured on close */
+    if (client->config->capture_fd == -1)
+      bud_client_handshake_free(client);
+  }
+
   if ((where & SSL_CB_HANDSHAKE_START) == 0)
     return;
+  BUD_PROBE3(handshake__start,
+             client,
+             client->hs == NULL ? NULL : client->hs->hello.servername,
+             client->stats.bytes_in);
 
-  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
   now = uv_now(client->config->loop);
 
   /* NOTE: config's limit is in ms */
@@ -921,6 +6837,7 @@ void bud_client_ssl_info_cb(const SSL* ssl, int where, int ret) {
   /* Too many renegotiations in a small time window */
   if (++client->handshakes > client->config->frontend.reneg_limit) {
     WARNING_LN(&client->frontend, "TLS renegotiation attack mitigated");
+    client->stats.reason = "renegotiation";
     bud_client_close(client, &client->frontend);
   }
 
@@ -929,6 +6846,299 @@ end:
 }
 
 
+/* Milliseconds since accept, -1 if it never happened */
+long long bud_client_since_accept(bud_client_t* client, uint64_t t) {
+  if (t == 0)
+    return -1;
+  return (long long) (t - client->stats.accept);
+}
+
+
+void bud_client_log_names(bud_client_t* client,
+                          char* host,
+                          size_t host_size,
+                          uint16_t* port,
+                          char* servername,
+                          size_t servername_size) {
+  const char* sname;
+  size_t sname_len;
+  struct sockaddr_in* addr;
+  struct sockaddr_in6* addr6;
+  int r;
+  size_t i;
+
+  addr = (struct sockaddr_in*) &client->peer;
+  addr6 = (struct sockaddr_in6*) &client->peer;
+  if (client->peer.ss_family == AF_INET) {
+    *port = ntohs(addr->sin_port);
+    r = uv_inet_ntop(AF_INET, &addr->sin_addr, host, host_size);
+  } else {
+    *port = ntohs(addr6->sin6_port);
+    r = uv_inet_ntop(AF_INET6, &addr6->sin6_addr, host, host_size);
+  }
+  if (r != 0)
+    host[0] = '\0';
+
+  /* Servername comes from the client, keep the JSON valid */
+  sname = bud_client_servername(client, &sname_len);
+  if (sname_len >= servername_size)
+    sname_len = servername_size - 1;
+  for (i = 0; i < sname_len; i++) {
+    if (sname[i] < 0x20 || sname[i] > 0x7e || sname[i] == '"' ||
+        sname[i] == '\\') {
+      servername[i] = '?';
+    } else {
+      servername[i] = sname[i];
+    }
+  }
+  servername[sname_len] = '\0';
+}
+
+
+void bud_client_log_access(bud_client_t* client) {
+  char host[INET6_ADDRSTRLEN];
+  char servername[256];
+  uint16_t port;
+  const char* protocol;
+  const char* cipher;
+  int resumed;
+
+  bud_client_log_names(client,
+                       host,
+                       sizeof(host),
+                       &port,
+                       servername,
+                       sizeof(servername));
+
+  protocol = "";
+  cipher = "";
+  resumed = 0;
+  if (client->ssl != NULL && SSL_is_init_finished(client->ssl)) {
+    protocol = SSL_get_version(client->ssl);
+    cipher = SSL_get_cipher_name(client->ssl);
+    resumed = SSL_session_reused(client->ssl);
+  }
+
+  bud_log(client->config,
+          kBudLogInfo,
+          "{\"peer\":\"%s\",\"port\":%d,\"servername\":\"%s\","
+          "\"protocol\":\"%s\",\"cipher\":\"%s\",\"resumed\":%s,"
+          "\"stapled\":%s,\"hello\":%lld,\"sni\":%lld,\"handshake\":%lld,"
+          "\"backend\":%lld,\"duration\":%lld,\"in\":%llu,\"out\":%llu,"
+          "\"cpu_handshake\":%llu,\"cpu_crypto\":%llu,\"rtt_handshake\":%u,"
+          "\"rtt\":%u,\"rttvar\":%u,\"retrans\":%u,\"cwnd\":%u,"
+          "\"delivery_rate\":%llu,\"reason\":\"%s\"}",
+          host,
+          port,
+          servername,
+          protocol,
+          cipher,
+          resumed ? "true" : "false",
+          client->stats.stapled ? "true" : "false",
+          bud_client_since_accept(client, client->stats.hello),
+          bud_client_since_accept(client, client->stats.sni),
+          bud_client_since_accept(client, client->stats.handshake),
+          bud_client_since_accept(client, client->stats.backend),
+          bud_client_since_accept(client, uv_now(client->config->loop)),
+          (unsigned long long) client->stats.bytes_in,
+          (unsigned long long) client->stats.bytes_out,
+          (unsigned long long) client->stats.cpu_handshake / 1000,
+          (unsigned long long) client->stats.cpu_crypto / 1000,
+          client->stats.tcp_handshake.rtt,
+          client->stats.tcp.rtt,
+          client->stats.tcp.rttvar,
+          client->stats.tcp.retrans,
+          client->stats.tcp.cwnd,
+          (unsigned long long) client->stats.tcp.delivery_rate,
+          client->stats.reason == NULL ? "" : client->stats.reason);
+}
+
+
+void bud_client_log_trace(bud_client_t* client) {
+  bud_config_t* config;
+  char host[INET6_ADDRSTRLEN];
+  char servername[256];
+  uint16_t port;
+  uint64_t took;
+  const char* kind;
+
+  config = client->config;
+  if (config->log.trace.sample <= 0 && config->log.trace.slow <= 0)
+    return;
+
+  /* Abandoned handshake took as long as the client stayed */
+  took = client->stats.handshake != 0 ? client->stats.handshake :
+                                        uv_now(config->loop);
+  took -= client->stats.accept;
+  if (config->log.trace.slow > 0 && took >= (uint64_t) config->log.trace.slow)
+    kind = "slow";
+  else if (config->log.trace.sample > 0 &&
+           ++config->trace_seq % config->log.trace.sample == 0)
+    kind = "sample";
+  else
+    return;
+
+  bud_client_log_names(client,
+                       host,
+                       sizeof(host),
+                       &port,
+                       servername,
+                       sizeof(servername));
+
+  bud_log(config,
+          kBudLogInfo,
+          "{\"trace\":\"%s\",\"peer\":\"%s\",\"port\":%d,"
+          "\"servername\":\"%s\",\"resumed\":%s,\"first_byte\":%lld,"
+          "\"hello\":%lld,\"sni\":%lld,\"staple\":%lld,\"flight\":%lld,"
+          "\"finished\":%lld,\"backend\":%lld,\"close\":%lld,"
+          "\"state\":\"%s\",\"reason\":\"%s\"}",
+          kind,
+          host,
+          port,
+          servername,
+          client->stats.handshake != 0 && SSL_session_reused(client->ssl) ?
+              "true" : "false",
+          bud_client_since_accept(client, client->stats.first_byte),
+          bud_client_since_accept(client, client->stats.hello),
+          bud_client_since_accept(client, client->stats.sni),
+          bud_client_since_accept(client, client->stats.staple),
+          bud_client_since_accept(client, client->stats.flight),
+          bud_client_since_accept(client, client->stats.handshake),
+          bud_client_since_accept(client, client->stats.backend),
+          bud_client_since_accept(client, uv_now(config->loop)),
+          SSL_state_string_long(client->ssl),
+          client->stats.reason == NULL ? "" : client->stats.reason);
+}
+
+
+void bud_client_count_failure(bud_client_t* client) {
+  const char* reason;
+  bud_metric_t metric;
+  bud_metrics_row_t* row;
+
+  /* See `stats.reason` assignments above */
+  reason = client->stats.reason == NULL ? "" : client->stats.reason;
+  if (strcmp(reason, "bad hello") == 0)
+    metric = kBudMetricErrHello;
+  else if (strcmp(reason, "ssl error") == 0)
+    metric = kBudMetricErrSSL;
+  else if (strcmp(reason, "handshake timeout") == 0)
+    metric = kBudMetricErrTimeout;
+  else
+    metric = kBudMetricErrAborted;
+  bud_metrics_inc(client->config, metric);
+
+  /* Not counted on close, the handshake hasn't picked the row */
+  row = bud_client_context_row(client);
+  if (row != NULL) {
+    row->values[kBudRowHandshakeErrors]++;
+    row->values[kBudRowCPUHandshake] += client->stats.cpu_handshake / 1000;
+  }
+}
+
+
+/* Row of `metrics.breakdown`, cached in the context */
+bud_metrics_row_t* bud_client_context_row(bud_client_t* client) {
+  bud_context_t* ctx;
+  const char* name;
+  size_t name_len;
+
+  if (client->config->metrics.tables[kBudMetricsContexts] == NULL)
+    return NULL;
+
+  ctx = bud_client_context(client);
+  if (ctx->metrics_row != NULL)
+    return ctx->metrics_row;
+
+  /* Contexts of SNI responses are known only by the requested name */
+  if (ctx->servername != NULL) {
+    name = ctx->servername;
+    name_len = ctx->servername_len;
+  } else if (ctx == client->sni_ctx) {
+    name = bud_client_servername(client, &name_len);
+  } else {
+    name = "default";
+    name_len = 7;
+  }
+
+  ctx->metrics_row = bud_metrics_row(client->config,
+                                     kBudMetricsContexts,
+                                     name,
+                                     name_len);
+  return ctx->metrics_row;
+}
+
+
+/* Row of `metrics.breakdown`, cached in the backend */
+bud_metrics_row_t* bud_client_backend_row(bud_config_t* config,
+                                          bud_backend_t* backend) {
+  char name[BUD_METRICS_NAME_SIZE];
+  int r;
+
+  if (config->metrics.tables[kBudMetricsBackends] == NULL)
+    return NULL;
+  if (backend->metrics_row != NULL)
+    return backend->metrics_row;
+
+  if (backend->is_pipe)
+    r = snprintf(name, sizeof(name), "%s", backend->host);
+  else
+    r = snprintf(name, sizeof(name), "%s:%d", backend->host, backend->port);
+  if (r < 0)
+    return NULL;
+  if ((size_t) r >= sizeof(name))
+    r = sizeof(name) - 1;
+
+  backend->metrics_row = bud_metrics_row(config,
+                                         kBudMetricsBackends,
+                                         name,
+                                         r);
+  return backend->metrics_row;
+}
+
+
+void bud_client_count_close(bud_client_t* client) {
+  bud_metrics_row_t* row;
+  uint64_t cpu_handshake;
+  uint64_t cpu_crypto;
+
+  cpu_handshake = client->stats.cpu_handshake / 1000;
+  cpu_crypto = client->stats.cpu_crypto / 1000;
+  bud_metrics_add(client->config, kBudMetricCPUHandshake, cpu_handshake);
+  bud_metrics_add(client->config, kBudMetricCPUCrypto, cpu_crypto);
+  bud_metrics_add(client->config,
+                  kBudMetricTCPRetrans,
+                  client->stats.tcp.retrans);
+
+  row = client->context_row;
+  if (row != NULL) {
+    row->values[kBudRowClients]--;
+    row->values[kBudRowBytesIn] += client->stats.bytes_in;
+    row->values[kBudRowBytesOut] += client->stats.bytes_out;
+    row->values[kBudRowCPUHandshake] += cpu_handshake;
+    row->values[kBudRowCPUCrypto] += cpu_crypto;
+    row->values[kBudRowTCPRetrans] += client->stats.tcp.retrans;
+    if (client->stats.hello != 0 && client->stats.sni != 0) {
+      row->values[kBudRowSNISum] += client->stats.sni - client->stats.hello;
+      row->values[kBudRowSNICount]++;
+    }
+  }
+
+  row = client->backend_row;
+  if (row != NULL) {
+    row->values[kBudRowBackendClients]--;
+    if (client->stats.backend >= client->stats.connect &&
+        client->stats.backend != 0) {
+      row->values[kBudRowFirstByteSum] += client->stats.backend -
+                                          client->stats.connect;
+      row->values[kBudRowFirstByteCount]++;
+    }
+  }
+  client->context_row = NULL;
+  client->backend_row = NULL;
+}
+
+
 const char* bud_side_str(bud_client_side_type_t side) {
   if (side == kBudFrontend)
     return "frontend";
@@ -955,6 +7165,12 @@ const char* bud_sslerror_str(int err) {
       return "WANT_CONNECT";
     case SSL_ERROR_WANT_ACCEPT:
       return "WANT_ACCEPT";
+#ifdef SSL_MODE_ASYNC
+    case SSL_ERROR_WANT_ASYNC:
+      return "WANT_ASYNC";
+    case SSL_ERROR_WANT_ASYNC_JOB:
+      return "WANT_ASYNC_JOB";
+#endif  /* SSL_MODE_ASYNC */
     default:
       return "UKNOWN";
   }
@@ -2,20 +2,79 @@
 #define SRC_CLIENT_H_
 
 #include "uv.h"
+#include "http_parser.h"
 #include "ringbuffer.h"
 #include "openssl/ssl.h"
 
 #include "hello-parser.h"
+#include "proxy-parser.h"
+#include "timer-wheel.h"
 #include "server.h"
 #include "http-pool.h"
+#include "queue.h"
+#include "tcp-info.h"
+#include "uring.h"
 
 /* Forward declaration */
+struct bud_backend_s;
+struct bud_client_race_s;
 struct bud_config_s;
+struct bud_handoff_s;
+struct bud_metrics_row_s;
+struct bud_sni_pending_s;
+struct bud_spill_s;
 
 typedef struct bud_client_s bud_client_t;
+typedef struct bud_client_handshake_s bud_client_handshake_t;
 typedef struct bud_client_side_s bud_client_side_t;
 typedef enum bud_client_side_type_e bud_client_side_type_t;
 typedef enum bud_client_progress_e bud_client_progress_t;
+typedef enum bud_client_class_e bud_client_class_t;
+
+/* Writes in flight on one side, they complete in order */
+#define BUD_CLIENT_MAX_WRITES 4
+
+/* X-Forwarded-For with IPv6 address, and X-Forwarded-Proto */
+#define BUD_CLIENT_XFF_MAX 128
+
+/* Enqueue times kept per relay buffer, see bud_client_queue_t */
+#define BUD_CLIENT_QUEUE_MARKS 4
+
+typedef struct bud_client_write_s bud_client_write_t;
+typedef struct bud_client_queue_s bud_client_queue_t;
+
+struct bud_client_write_s {
+  uv_write_t req;
+  size_t size;
+
+  /*
+   * `frontend.zerocopy` writes are reported after the plain ones that follow
+   * them, `done` ones wait for those before them (`written` - their result)
+   */
+  int done;
+  size_t written;
+  int zerocopy;
+  uint32_t zerocopy_id;
+
+  /* Same write through `config->uring`, PROXY header and output chunks */
+  bud_uring_op_t op;
+  struct iovec iov[RING_BUFFER_COUNT + 1];
+};
+
+/*
+ * `metrics.timing`: bytes that went in (`marked`) and out (`consumed`) of
+ * a relay buffer so far, and ring of `uv_now()` at which the bytes up to
+ * `end` were first seen there. Bytes written in one loop iteration share
+ * a mark, once all marks are taken the last one covers the newer bytes.
+ */
+struct bud_client_queue_s {
+  uint64_t marked;
+  uint64_t consumed;
+  uint64_t end[BUD_CLIENT_QUEUE_MARKS];
+  uint64_t at[BUD_CLIENT_QUEUE_MARKS];
+  int head;
+  int count;
+};
 
 enum bud_client_side_type_e {
   kBudFrontend,
@@ -28,13 +87,30 @@ enum bud_client_progress_e {
   kBudProgressDone
 };
 
+/* Traffic of the client, sizes its buffers, see `buffer.bulk_count` */
+enum bud_client_class_e {
+  kBudClassDefault,
+  kBudClassInteractive,
+  kBudClassBulk
+};
+
 struct bud_client_side_s {
   bud_client_side_type_t type;
-  uv_tcp_t tcp;
+
+  /* Backend may be a Unix socket, and is initialized only on connect */
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  int init;
   ringbuffer input;
   ringbuffer output;
+  bud_client_queue_t output_queue;
+
+  /* `buffer.high_watermark` and `buffer.low_watermark` of this side */
+  size_t high_watermark;
+  size_t low_watermark;
 
-  uv_write_t write_req;
   uv_shutdown_t shutdown_req;
 
   bud_client_progress_t reading;
@@ -42,14 +118,77 @@ struct bud_client_side_s {
   bud_client_progress_t close;
   bud_client_progress_t write;
 
+  /* Ring of writes in flight, `write_size` - bytes in all of them */
+  bud_client_write_t writes[BUD_CLIENT_MAX_WRITES];
+  int write_head;
+  int write_count;
   size_t write_size;
+
+  /* `frontend.timeout.write` of the oldest write, 0 - none in progress */
+  uint64_t write_deadline;
+
+  /* io_uring writes that were in flight on close, `output` is still used */
+  int uring_waiting;
+
+  /*
+   * `frontend.zerocopy` (0 - off), MSG_ZEROCOPY writes waiting for the
+   * kernel's notification and the id of the next one
+   */
+  size_t zerocopy;
+  int zerocopy_count;
+  uint32_t zerocopy_next;
+};
+
+/*
+ * State that is used only until the handshake is done, allocated from
+ * config's `handshake_slab` and freed at SSL_CB_HANDSHAKE_DONE (or on close
+ * with `log.capture`, it needs the hello). Keeps the parsers' buffers out of
+ * the client that is walked on every relay cycle.
+ */
+struct bud_client_handshake_s {
+  bud_client_t* client;
+
+  /* PROXY header of the balancer, precedes the hello */
+  bud_proxy_parser_t proxy_parser;
+
+  /* Client hello parser */
+  bud_client_hello_t hello;
+  bud_hello_parser_t hello_parser;
+
+  /* SNI, lookups for the same servername are shared */
+  struct bud_sni_pending_s* sni_pending;
+  QUEUE sni_member;
+
+  /* Holds or waits for one of `frontend.max_handshakes` */
+  QUEUE admit_member;
+  int admit_waiting;
+  int admit_slot;
+
+  /* Closed by `backend.health_check.fail_fast`, only the alert is sent */
+  int backend_down;
+
+  /* External session cache */
+  bud_http_request_t* session_req;
+  SSL_SESSION* session;
+
+  /* SSL has the session id context of the servername's context */
+  int session_bound;
 };
 
 struct bud_client_s {
   struct bud_config_s* config;
 
+  /* Accepted on it, gives the default context and backends */
+  bud_config_listener_t* listener;
+
   SSL* ssl;
 
+  /* Listener's SSL_CTX it was created for, see `pool.ssl_objects` */
+  SSL_CTX* ssl_ctx;
+
+  /* Frontend is under TCP_CORK, see `frontend.cork_handshake` */
+  int corked;
+
   /* Renegotiation attack prevention */
   uint64_t last_handshake;
   int handshakes;
@@ -60,25 +199,300 @@ struct bud_client_s {
 
   /* State */
   uv_connect_t connect_req;
+
+  /* Addresses raced to connect, see `backend.happy_eyeballs` */
+  struct bud_client_race_s* race;
   bud_client_progress_t connect;
   bud_client_progress_t close;
   int destroy_waiting;
 
-  /* Client hello parser */
+  /* Backend picked by the balancer */
+  struct bud_backend_s* selected;
+
+  /* uv_hrtime() of the connect, or of data sent to backend (`peak-ewma`) */
+  uint64_t latency_start;
+
+  /* Real address of the client, see `frontend.accept_proxyline` */
+  struct sockaddr_storage peer;
+
+  /* PROXY v2 header, written together with the first bytes for backend */
+  char proxyline[BUD_PROXYLINE_V2_TLV_MAX];
+  size_t proxyline_len;
+
+  /* Plaintext waiting for SSL_write(), see bud_client_plain_in() */
+  bud_client_queue_t plain_queue;
+
+  /* Partial record is waiting for more backend data */
+  uv_timer_t coalesce_timer;
+  int coalesce_init;
+  int coalesce_flush;
+
+  /* Private key operation is paused in the engine, see `engine.async` */
+  uv_poll_t async_poll;
+  bud_client_progress_t async_poll_state;
+  uv_timer_t async_timer;
+  int async_timer_init;
+  int async_waiting;
+
+  /* Waiting for the next loop iteration to continue the handshake */
+  QUEUE handshake_member;
+  int handshake_parked;
+
+  /* Sockets are being sent to the master, see bud_client_handoff() */
+  int handoff;
+
+  /* Waiting for the end of loop iteration to write both sides */
+  QUEUE flush_member;
+  int flush_queued;
+
+  /* Frontend bytes written, halved every second, see bud_client_flush() */
+  uint64_t recent_bytes;
+  uint64_t recent_at;
+
+  /* Reads of both sides and throttles since `class_at`, and their verdict */
+  bud_client_class_t traffic_class;
+  uint64_t class_at;
+  uint64_t class_bytes;
+  uint32_t class_reads;
+  uint32_t class_throttles;
+
+  /* Has MSG_ZEROCOPY writes that are not reported yet */
+  QUEUE zerocopy_member;
+  int zerocopy_queued;
+
+  /* `frontend.cycle_budget` left in this cycle, and the run queue */
+  size_t budget_left;
+  uint64_t budget_tick;
+  QUEUE budget_member;
+  int budget_queued;
+
+  /*
+   * In config's `clients`, moved to the tail on every read and completed
+   * write, see bud_client_touch(). `last_active` is the `uv_now()` of it.
+   */
+  QUEUE member;
+  uint64_t last_active;
+
+  /* `frontend.timeout`, entry is armed for the earliest deadline (0 - off) */
+  bud_timer_entry_t timeout;
+  uint64_t handshake_deadline;
+  uint64_t idle_deadline;
+
+  /*
+   * `log.access` and `log.trace`: moments (`uv_now()`, 0 - never happened),
+   * traffic on the frontend, and why the client was closed. `flight` - first
+   * write to the frontend (ServerHello), `staple` - stapling callback,
+   * `connect` - start of the backend connect. `handshake_in/out` - traffic
+   * at the handshake done, for `log.capture`. `cpu_*` - ns in SSL calls
+   * before and after the handshake is done (`metrics.timing`). `tcp_*` -
+   * TCP_INFO at the handshake and the latest one (`metrics.tcp_info`).
+   */
+  struct {
+    uint64_t accept;
+    uint64_t first_byte;
+    uint64_t hello;
+    uint64_t sni;
+    uint64_t staple;
+    uint64_t flight;
+    uint64_t handshake;
+    uint64_t connect;
+    uint64_t backend;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t handshake_in;
+    uint64_t handshake_out;
+    uint64_t cpu_handshake;
+    uint64_t cpu_crypto;
+    bud_tcp_info_t tcp_handshake;
+    bud_tcp_info_t tcp;
+    uint64_t tcp_sampled;
+    int stapled;
+    const char* reason;
+  } stats;
+
+  /* `metrics.breakdown`: rows the client is counted in, NULL - not yet */
+  struct bud_metrics_row_s* context_row;
+  struct bud_metrics_row_s* backend_row;
+
+  /* Dynamic record sizing */
+  uint64_t record_sent;
+  uint64_t record_last;
+
+  /* Size of the record SSL_write() is to be retried with, 0 - none */
+  size_t record_pending;
+
+  /* Handshake-only state, NULL once it is done */
+  bud_client_handshake_t* hs;
+
+  /* PROXY header of the balancer, precedes the hello */
+  bud_client_progress_t proxy_parse;
+
+  /* TLS 1.3 0-RTT data, `early_data` - some was forwarded to backend */
+  bud_client_progress_t early_read;
+  int early_data;
+
+  /* `server_first` backend, its greeting is sent without coalescing */
+  int greeting;
+
+  /*
+   * `backend.http_reuse`: requests to the backend and its responses, backend
+   * goes back to the pool if it is idle between them when the client is done.
+   * `backend.xforward`: `xff` goes after the request line (`line` - not seen
+   * yet), `body` - rest of the request has Content-Length.
+   * `backend.buffer_request`: `head` - headers of the first request are in,
+   * followed by `buffered` bytes of its body.
+   */
+  struct {
+    int enabled;
+    int reuse;
+    int xforward;
+    int broken;
+    int line;
+    int body;
+    char xff[BUD_CLIENT_XFF_MAX];
+    size_t xff_len;
+    http_parser request;
+    http_parser response;
+    unsigned int requests;
+    unsigned int responses;
+    uint32_t heads;
+    int in_request;
+    int in_response;
+    int keepalive;
+    int head;
+    uint64_t buffered;
+  } http;
+
+  /*
+   * `frontend.bandwidth`: bucket of the connection (context has the shared
+   * one), and the pause of backend reads (`paused` - reading should be
+   * started again once the pause is over)
+   */
+  struct {
+    bud_shape_t bucket;
+    bud_timer_entry_t entry;
+    int waiting;
+    int paused;
+  } shape;
+
+  /* TLS to backend, `upstream_in` and `upstream_out` hold the plaintext */
+  SSL* upstream;
+  ringbuffer upstream_in;
+  ringbuffer upstream_out;
+
+  /*
+   * `backend.spill`: data of the backend that comes after `backend.input`,
+   * created when the frontend falls behind. `spill_read` - the read in
+   * progress goes to it, `spill_paused` - it is full, backend waits for it
+   * to drain to half, `spill_failed` - file can't be created.
+   */
+  struct bud_spill_s* spill;
+  int spill_read;
+  int spill_paused;
+  int spill_failed;
+
+  /* Client hello parser, see `hs` */
   bud_client_progress_t hello_parse;
-  bud_client_hello_t hello;
 
-  /* SNI */
-  bud_http_request_t* sni_req;
-  bud_context_t sni_ctx;
+  /* SNI context of the servername, if it was looked up */
+  bud_context_t* sni_ctx;
 
-  /* Stapling */
-  bud_http_request_t* stapling_cache_req;
-  bud_http_request_t* stapling_req;
-  char* stapling_ocsp_resp;
-  size_t stapling_ocsp_resp_len;
+  /*
+   * Context of the servername, once it is known (see bud_client_context()).
+   * `quota_slot` - counted in its `quota.active`
+   */
+  bud_context_t* context;
+  int quota_checked;
+  int quota_slot;
 };
 
-void bud_client_create(bud_config_t* config, uv_stream_t* stream);
+void bud_client_create(bud_config_t* config,
+                       bud_config_listener_t* listener,
+                       uv_stream_t* stream);
+
+/* Same, but for an accepted socket, takes the ownership of `fd` */
+void bud_client_create_fd(bud_config_t* config,
+                          bud_config_listener_t* listener,
+                          int fd);
+
+/* Relay of a draining worker, `handoff` is freed (see `drain_handoff`) */
+void bud_client_create_handoff(bud_config_t* config,
+                               struct bud_handoff_s* handoff);
+
+/*
+ * Send the sockets and buffered data of passthrough relay to the master,
+ * `drain_handoff`. Returns 0 if it is sent (or is being sent), 1 if it is
+ * busy and should be tried again later, -1 if it has to finish here.
+ */
+int bud_client_handoff(bud_client_t* client);
+
+/* Context of the listener, used if no other one matches the servername */
+bud_context_t* bud_client_default_context(bud_client_t* client);
+
+/* Servername of the client, from the hello or the SSL once it is done */
+const char* bud_client_servername(bud_client_t* client, size_t* len);
+
+/*
+ * Close clients of the loop that were quiet for at least `idle` ms, the
+ * least recently active first. Returns how many are closing now.
+ */
+int bud_client_close_idle(struct bud_config_s* config,
+                          uint64_t idle,
+                          const char* reason);
+
+/* State of `frontend.handshake_limit`, per worker */
+bud_error_t bud_client_handshakes_init(struct bud_config_s* config);
+void bud_client_handshakes_finalize(struct bud_config_s* config);
+
+/* Spinning of `busy_poll.spin`, per event loop */
+bud_error_t bud_client_spin_init(struct bud_config_s* config);
+void bud_client_spin_finalize(struct bud_config_s* config);
+
+/* Sends deferred to the end of loop iteration, per worker */
+bud_error_t bud_client_flush_init(struct bud_config_s* config);
+void bud_client_flush_finalize(struct bud_config_s* config);
+
+/* Error queue poll of `frontend.zerocopy` writes, per worker */
+bud_error_t bud_client_zerocopy_init(struct bud_config_s* config);
+void bud_client_zerocopy_finalize(struct bud_config_s* config);
+
+/* State of `frontend.cycle_budget`, per worker */
+bud_error_t bud_client_budget_init(struct bud_config_s* config);
+void bud_client_budget_finalize(struct bud_config_s* config);
+
+/* Recycled SSL objects of `pool.ssl_objects`, per worker */
+bud_error_t bud_client_ssl_pool_init(struct bud_config_s* config);
+void bud_client_ssl_pool_free(struct bud_config_s* config);
+
+/* Closed clients freed in the idle phase, see `pool.teardown_budget` */
+bud_error_t bud_client_teardown_init(struct bud_config_s* config);
+void bud_client_teardown_finalize(struct bud_config_s* config);
+
+/* Memory governor of `pool.budget`, per worker */
+bud_error_t bud_client_reclaim_init(struct bud_config_s* config);
+void bud_client_reclaim_finalize(struct bud_config_s* config);
+
+/* Periodic TCP_INFO of `metrics.tcp_info.interval`, per worker */
+bud_error_t bud_client_tcp_info_init(struct bud_config_s* config);
+void bud_client_tcp_info_finalize(struct bud_config_s* config);
+
+/* Timer wheel of `frontend.timeout`, per worker */
+bud_error_t bud_client_timeouts_init(struct bud_config_s* config);
+void bud_client_timeouts_finalize(struct bud_config_s* config);
+
+/* Timer wheel of `frontend.bandwidth` pauses, per worker */
+bud_error_t bud_client_shape_init(struct bud_config_s* config);
+void bud_client_shape_finalize(struct bud_config_s* config);
+
+/*
+ * Fetch the servername's context into the SNI cache ahead of handshakes,
+ * no-op if it is fresh or already in flight. SNI should be enabled.
+ */
+bud_error_t bud_client_sni_prewarm(struct bud_config_s* config,
+                                   const char* servername,
+                                   size_t servername_len);
+
+/* New session callback of `backend.tls`, keeps it in the selected backend */
+int bud_client_upstream_session_cb(SSL* ssl, SSL_SESSION* sess);
 
 #endif  /* SRC_CLIENT_H_ */
@@ -1,6 +1,10 @@
+#include <ctype.h>  /* tolower */
 #include <stdint.h>
+#include <stdlib.h>  /* malloc */
+#include <string.h>  /* strlen */
 
 #include "common.h"
+#include "base64-simd.h"
 
 /**
  * NOTE:
@@ -39,11 +43,16 @@ size_t bud_base64_decode(char *buf,
   char* dstEnd;
   const char* srcEnd;
   int remaining;
+  size_t consumed;
 
   dst = buf;
   dstEnd = buf + len;
   srcEnd = src + srcLen;
 
+  /* Bulk of the input, stops at the first padding or whitespace */
+  dst += bud_base64_decode_simd(dst, len, src, srcLen, &consumed);
+  src += consumed;
+
   while (src < srcEnd && dst < dstEnd) {
     remaining = srcEnd - src;
 
@@ -118,9 +127,9 @@ size_t bud_base64_encode(const char* src,
                               "abcdefghijklmnopqrstuvwxyz"
                               "0123456789+/";
 
-  i = 0;
-  k = 0;
   n = slen / 3 * 3;
+  i = bud_base64_encode_simd(src, n, dst);
+  k = i / 3 * 4;
 
   while (i < n) {
     a = src[i + 0] & 0xff;
@@ -159,3 +168,81 @@ size_t bud_base64_encode(const char* src,
 
   return dlen;
 }
+
+
+uint32_t bud_hash_lower(uint32_t hash, const char* str, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len; i++)
+    hash = (hash ^ (uint8_t) tolower((unsigned char) str[i])) * 16777619u;
+
+  return hash;
+}
+
+
+char* bud_escape_url(const char* fmt,
+                     const char* arg,
+                     size_t arg_len,
+                     size_t* size) {
+  char* url;
+  size_t fmt_len;
+  size_t i;
+  size_t j;
+  size_t k;
+  size_t escaped_arg_len;
+  char c;
+
+  /* Escape arg */
+  fmt_len = strlen(fmt);
+
+  /* Count characters in escaped arg */
+  escaped_arg_len = 0;
+  for (i = 0; i < arg_len; i++) {
+    c = arg[i];
+
+    if (c == '!' || c == '#' || c == '$' || c == '&' || c == '\'' ||
+        c == '(' || c == ')' || c == '*' || c == '+' || c == ',' ||
+        c == '/' || c == ':' || c == ';' || c == '=' || c == '?' ||
+        c == '@' || c == '[' || c == ']') {
+      escaped_arg_len += 3;
+    } else {
+      escaped_arg_len++;
+    }
+  }
+
+  url = malloc(fmt_len + escaped_arg_len + 1);
+  if (url == NULL)
+    return NULL;
+
+  k = 0;
+  for (i = 0, j = 0; i < fmt_len; i++) {
+    /* Replace '%s' with escaped arg */
+    if (k == 0 && i + 1 < fmt_len && fmt[i] == '%' && fmt[i + 1] == 's') {
+      for (k = 0; k < arg_len; k++) {
+        c = arg[k];
+        if (c == '!' || c == '#' || c == '$' || c == '&' || c == '\'' ||
+            c == '(' || c == ')' || c == '*' || c == '+' || c == ',' ||
+            c == '/' || c == ':' || c == ';' || c == '=' || c == '?' ||
+            c == '@' || c == '[' || c == ']') {
+          url[j++] = '%';
+          url[j++] = '0' + (c >> 4);
+          c = c & 15;
+          if (c > 9)
+            c = 'a' + c - 10;
+          else
+            c = '0' + c;
+        }
+        url[j++] = c;
+      }
+      /* Skip second part of '%s' */
+      i++;
+    } else {
+      url[j++] = fmt[i];
+    }
+  }
+  url[j] = '\0';
+  ASSERT(j < fmt_len + escaped_arg_len + 1, "escaped url OOB");
+
+  *size = j;
+  return url;
+}
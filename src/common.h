@@ -1,6 +1,7 @@
 #ifndef SRC_COMMON_H_
 #define SRC_COMMON_H_
 
+#include <stdint.h>  /* uint32_t */
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -44,4 +45,20 @@ size_t bud_base64_encode(const char* src,
                          char* dst,
                          size_t dlen);
 
+/*
+ * Replace the first `%s` in `fmt` with URL-escaped `arg`, returns malloc()-ed
+ * string of `*size` bytes or NULL
+ */
+char* bud_escape_url(const char* fmt,
+                     const char* arg,
+                     size_t arg_len,
+                     size_t* size);
+
+/* Hosts starting with `/` are paths of Unix domain sockets */
+#define BUD_HOST_IS_PIPE(host) ((host) != NULL && (host)[0] == '/')
+
+/* Case-insensitive FNV-1a, pass previous result as `hash` to continue */
+#define BUD_HASH_INIT 2166136261u
+uint32_t bud_hash_lower(uint32_t hash, const char* str, size_t len);
+
 #endif  /* SRC_COMMON_H_ */
@@ -1,53 +1,199 @@
 #include <getopt.h>  /* getopt */
-#include <stdio.h>  /* fprintf */
+#include <stdio.h>  /* fprintf, snprintf */
 #include <stdlib.h>  /* NULL */
-#include <string.h>  /* memset, strlen, strncmp */
+#include <string.h>  /* memset, strcmp, strlen, strncmp */
 #include <strings.h>  /* strcasecmp */
+#include <unistd.h>  /* dup */
 
 #include "uv.h"
 #include "openssl/bio.h"
 #include "openssl/err.h"
 #include "openssl/ocsp.h"
+#include "openssl/pem.h"
+#include "openssl/sha.h"
 #include "openssl/ssl.h"
 #include "openssl/x509.h"
 #include "openssl/x509v3.h"
 #include "parson.h"
 
 #include "config.h"
+#include "access.h"
+#include "affinity.h"
+#include "capture.h"
+#include "cert-cache.h"
+#include "client.h"  /* bud_client_t */
 #include "common.h"
+#include "disk-cache.h"
+#include "engine.h"
+#include "fingerprint.h"
 #include "ocsp.h"
 #include "http-pool.h"
+#include "preload.h"
 #include "logger.h"
+#include "lookup.h"
 #include "master.h"  /* bud_worker_t */
+#include "session-cache.h"
+#include "shared-cache.h"
+#include "sni.h"
+#include "sni-cache.h"
+#include "snapshot.h"
+#include "ratelimit.h"
+#include "uring.h"
+#include "ticket.h"
+#include "verify.h"
 #include "version.h"
 
-static bud_error_t bud_config_init(bud_config_t* config);
 static void bud_config_set_defaults(bud_config_t* config);
 static void bud_print_help(int argc, char** argv);
 static void bud_print_version();
 static void bud_config_print_default();
 static void bud_config_finalize(bud_config_t* config);
-static void bud_config_read_pool_conf(JSON_Object* obj,
+static void bud_config_read_pool_conf(bud_config_t* config,
+                                      JSON_Object* obj,
                                       const char* key,
                                       bud_config_http_pool_t* pool);
+static bud_error_t bud_config_read_backends(bud_config_t* config,
+                                            const JSON_Array* arr,
+                                            const bud_backend_confs_t** out);
+static bud_error_t bud_config_read_access(bud_config_t* config,
+                                          JSON_Object* obj,
+                                          const char* name,
+                                          const bud_config_strs_t** list,
+                                          const char** file);
+static void bud_config_read_affinity(bud_config_t* config,
+                                     const JSON_Value* val);
+static void bud_config_init_pool_limits(bud_config_http_pool_t* pool);
+static void bud_config_print_pool_limits(bud_config_http_pool_t* pool,
+                                         const char* end);
+static void bud_config_set_pool_defaults(bud_config_http_pool_t* pool);
+static bud_http_pool_t* bud_config_new_pool(bud_config_t* config,
+                                            bud_config_http_pool_t* conf,
+                                            bud_error_t* err);
+static int bud_config_read_socket_size(JSON_Object* obj, const char* key);
+static void bud_config_read_buffer_conf(JSON_Object* obj,
+                                        bud_config_buffer_t* buffer);
+static int bud_config_buffer_marks_ok(bud_config_buffer_t* buffer);
+static int bud_config_buffer_bulk_ok(bud_config_buffer_t* buffer);
+static void bud_config_reserve_buffers(bud_config_t* config,
+                                       ringbuffer_pool* pool,
+                                       const char* name);
+static bud_error_t bud_config_read_listeners(bud_config_t* config,
+                                             JSON_Array* frontends);
+static bud_error_t bud_config_init_listeners(bud_config_t* config);
 #ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
 static int bud_config_select_sni_context(SSL* s, int* ad, void* arg);
+static bud_error_t bud_config_index_contexts(bud_config_t* config);
+static bud_error_t bud_config_load_context(bud_config_t* config,
+                                          bud_context_t* ctx,
+                                          int index,
+                                          bud_preload_t* preload);
+static void bud_context_swap(bud_context_t* dst, bud_context_t* src);
+static bud_error_t bud_config_lazy_init(bud_config_t* config);
+static void bud_config_lazy_timer_cb(uv_timer_t* handle, int status);
+static bud_context_t* bud_config_find_context(bud_config_t* config,
+                                              uint32_t hash,
+                                              const char* prefix,
+                                              size_t prefix_len,
+                                              const char* name,
+                                              size_t name_len);
 #endif  /* SSL_CTRL_SET_TLSEXT_SERVERNAME_CB */
 #ifdef OPENSSL_NPN_NEGOTIATED
-static char* bud_config_encode_npn(bud_config_t* config,
-                                   const JSON_Array* npn,
-                                   size_t* len,
-                                   bud_error_t* err);
+static bud_npn_line_t* bud_config_encode_npn(bud_config_t* config,
+                                             const bud_config_strs_t* npn,
+                                             bud_error_t* err);
 static int bud_config_advertise_next_proto(SSL* s,
                                            const unsigned char** data,
                                            unsigned int* len,
                                            void* arg);
+static void bud_config_set_npn_cb(bud_context_t* context);
+# ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+static int bud_config_select_alpn(SSL* s,
+                                  const unsigned char** out,
+                                  unsigned char* outlen,
+                                  const unsigned char* in,
+                                  unsigned int inlen,
+                                  void* arg);
+# endif  /* TLSEXT_TYPE_application_layer_protocol_negotiation */
 #endif  /* OPENSSL_NPN_NEGOTIATED */
-static bud_error_t bud_config_verify_npn(const JSON_Array* npn);
+static bud_error_t bud_config_verify_npn(const bud_config_strs_t* npn);
+static int bud_context_has_extra_cert(bud_context_t* ctx, X509* cert);
+static bud_error_t bud_config_set_curves(SSL_CTX* ctx, const char* curves);
+#ifndef SSL_CTRL_SET_CURVES_LIST
+/* `ecdh` list for OpenSSL without SSL_CTX_set1_curves_list() */
+typedef struct bud_config_curves_s bud_config_curves_t;
+
+struct bud_config_curves_s {
+  int refcount;
+  int count;
+  EC_KEY* keys[8];
+  uint16_t ids[8];
+};
+
+static bud_error_t bud_config_parse_curves(const char* curves,
+                                           bud_config_curves_t** out);
+static bud_error_t bud_config_attach_curves(SSL_CTX* ctx,
+                                            bud_config_curves_t* list);
+static void bud_config_curves_unref(bud_config_curves_t* list);
+static void bud_config_curves_ex_free(void* parent,
+                                      void* ptr,
+                                      CRYPTO_EX_DATA* ad,
+                                      int idx,
+                                      long argl,
+                                      void* argp);
+static uint16_t bud_config_curve_id(int nid);
+static EC_KEY* bud_config_tmp_ecdh_cb(SSL* s, int is_export, int keylength);
+
+static int kBudSSLCurvesIndex = -1;
+#endif  /* !SSL_CTRL_SET_CURVES_LIST */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/*
+ * Parsed `ciphers` and `ecdh` of the contexts, shared by every SSL_CTX with
+ * the same strings. SNI responses usually differ only in cert and key, so
+ * the rest is done once instead of on each of them.
+ */
+typedef struct bud_config_template_s bud_config_template_t;
+
+struct bud_config_template_s {
+  QUEUE member;
+  int refcount;
+  const char* ciphers;
+  const char* ecdh;
+
+  /* NULL - library default, SSL_CTX_new() has it already */
+  STACK_OF(SSL_CIPHER)* cipher_list;
+  STACK_OF(SSL_CIPHER)* cipher_list_by_id;
+# ifndef SSL_CTRL_SET_CURVES_LIST
+  bud_config_curves_t* curves;
+# endif  /* !SSL_CTRL_SET_CURVES_LIST */
+};
+
+static bud_error_t bud_config_use_template(bud_config_t* config,
+                                           SSL_CTX* ctx,
+                                           const char* ciphers,
+                                           const char* curves);
+static bud_config_template_t* bud_config_template_new(bud_config_t* config,
+                                                      SSL_CTX* ctx,
+                                                      const char* ciphers,
+                                                      const char* curves,
+                                                      bud_error_t* err);
+static bud_error_t bud_config_template_apply(bud_config_template_t* tmpl,
+                                             SSL_CTX* ctx);
+static int bud_config_template_eq(const char* a, const char* b);
+static void bud_config_template_unref(bud_config_template_t* tmpl);
+static void bud_config_template_ex_free(void* parent,
+                                        void* ptr,
+                                        CRYPTO_EX_DATA* ad,
+                                        int idx,
+                                        long argl,
+                                        void* argp);
+
+static int kBudSSLTemplateIndex = -1;
+#endif  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
 
 
 int kBudSSLClientIndex = -1;
 int kBudSSLSNIIndex = -1;
+int kBudSSLConfigIndex = -1;
 
 
 bud_config_t* bud_config_cli_load(uv_loop_t* loop,
@@ -59,6 +205,7 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
   int index;
   int is_daemon;
   int is_worker;
+  int is_spare;
   size_t path_len;
   bud_config_t* config;
 
@@ -70,6 +217,7 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
 #endif  /* !_WIN32 */
     { "worker", 0, NULL, 1000 },
     { "default-config", 0, NULL, 1001 },
+    { "spare", 0, NULL, 1002 },
     { NULL, 0, NULL, 0 }
   };
 
@@ -77,6 +225,7 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
   config = NULL;
   is_daemon = 0;
   is_worker = 0;
+  is_spare = 0;
   do {
     index = 0;
     c = getopt_long(argc, argv, "vc:d", long_options, &index);
@@ -95,6 +244,8 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
           config->is_daemon = 1;
         if (is_worker)
           config->is_worker = 1;
+        if (is_spare)
+          config->is_spare = 1;
         break;
 #ifndef _WIN32
       case 'd':
@@ -112,6 +263,11 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
         bud_config_print_default();
         c = -1;
         break;
+      case 1002:
+        is_spare = 1;
+        if (config != NULL)
+          config->is_spare = 1;
+        break;
       default:
         if (config == NULL)
           bud_print_help(argc, argv);
@@ -149,19 +305,15 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
 }
 
 
-bud_error_t bud_config_verify_npn(const JSON_Array* npn) {
+bud_error_t bud_config_verify_npn(const bud_config_strs_t* npn) {
   int i;
-  int npn_count;
 
   if (npn == NULL)
     return bud_ok();
 
-  npn_count = json_array_get_count(npn);
-  for (i = 0; i < npn_count; i++) {
-    if (json_value_get_type(json_array_get_value(npn, i)) == JSONString)
-      continue;
-    return bud_error(kBudErrNPNNonString);
-  }
+  for (i = 0; i < npn->count; i++)
+    if (npn->items[i] == NULL)
+      return bud_error(kBudErrNPNNonString);
 
   return bud_ok();
 }
@@ -176,9 +328,38 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
   JSON_Value* val;
   JSON_Object* obj;
   JSON_Object* log;
+  JSON_Object* trace;
+  JSON_Object* capture;
+  JSON_Object* tcp_info;
+  JSON_Object* metrics;
+  JSON_Object* admin;
+  JSON_Object* pool;
+  JSON_Object* session_cache;
+  JSON_Object* busy_poll;
+  JSON_Object* autoscale;
+  JSON_Object* watchdog;
+  JSON_Object* verify_cache;
+  JSON_Object* lazy_contexts;
+  JSON_Object* shared_cache;
+  JSON_Object* disk_cache;
   JSON_Object* frontend;
   JSON_Object* backend;
+  JSON_Object* health;
+  JSON_Object* tls;
+  JSON_Object* buffer_request;
+  JSON_Object* spill;
+  JSON_Object* engine;
+  JSON_Object* coalesce;
+  JSON_Object* record;
+  JSON_Object* rate_limit;
+  JSON_Object* access;
+  JSON_Object* fingerprint;
+  JSON_Object* bandwidth;
+  JSON_Object* quota;
+  JSON_Object* timeout;
   JSON_Array* contexts;
+  JSON_Array* frontends;
+  const char* str;
   bud_config_t* config;
   bud_context_t* ctx;
 
@@ -195,6 +376,7 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
   }
   contexts = json_object_get_array(obj, "contexts");
   context_count = contexts == NULL ? 0 : json_array_get_count(contexts);
+  frontends = json_object_get_array(obj, "frontends");
 
   config = calloc(1,
                   sizeof(*config) +
@@ -205,7 +387,14 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
   }
 
   config->loop = loop;
-  config->json = json;
+  config->path = path;
+  bud_arena_init(&config->arena);
+  QUEUE_INIT(&config->npn_lines);
+  QUEUE_INIT(&config->ssl_templates);
+  QUEUE_INIT(&config->clients);
+  QUEUE_INIT(&config->admin.waiting);
+  config->capture_fd = -1;
+  config->worker_id = -1;
 
   /* Workers configuration */
   config->worker_count = -1;
@@ -216,14 +405,97 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
   val = json_object_get_value(obj, "restart_timeout");
   if (val != NULL)
     config->restart_timeout = json_value_get_number(val);
+  config->drain_timeout = -1;
+  val = json_object_get_value(obj, "drain_timeout");
+  if (val != NULL)
+    config->drain_timeout = json_value_get_number(val);
+  config->drain_handoff = -1;
+  val = json_object_get_value(obj, "drain_handoff");
+  if (val != NULL)
+    config->drain_handoff = json_value_get_boolean(val);
+  config->load_threads = -1;
+  val = json_object_get_value(obj, "load_threads");
+  if (val != NULL)
+    config->load_threads = json_value_get_number(val);
+  config->snapshot_enabled = -1;
+  val = json_object_get_value(obj, "snapshot");
+  if (val != NULL)
+    config->snapshot_enabled = json_value_get_boolean(val);
+  config->thread_count = -1;
+  val = json_object_get_value(obj, "threads");
+  if (val != NULL)
+    config->thread_count = json_value_get_number(val);
+  bud_config_read_affinity(config,
+                           json_object_get_value(obj, "workers_affinity"));
+  config->workers_membind = -1;
+  val = json_object_get_value(obj, "workers_membind");
+  if (val != NULL)
+    config->workers_membind = json_value_get_boolean(val);
+  busy_poll = json_object_get_object(obj, "busy_poll");
+  config->busy_poll.spin = -1;
+  config->busy_poll.sockets = -1;
+  if (busy_poll != NULL) {
+    val = json_object_get_value(busy_poll, "spin");
+    if (val != NULL)
+      config->busy_poll.spin = json_value_get_number(val);
+    val = json_object_get_value(busy_poll, "sockets");
+    if (val != NULL)
+      config->busy_poll.sockets = json_value_get_number(val);
+  }
+  config->workers_balance = bud_config_get_str(config, obj, "workers_balance");
+  config->spare_count = -1;
+  val = json_object_get_value(obj, "workers_spare");
+  if (val != NULL)
+    config->spare_count = json_value_get_number(val);
+  autoscale = json_object_get_object(obj, "workers_autoscale");
+  config->autoscale.max = -1;
+  config->autoscale.lag = -1;
+  config->autoscale.cpu = -1;
+  config->autoscale.interval = -1;
+  config->autoscale.warmup = -1;
+  if (autoscale != NULL) {
+    val = json_object_get_value(autoscale, "max");
+    if (val != NULL)
+      config->autoscale.max = json_value_get_number(val);
+    val = json_object_get_value(autoscale, "lag");
+    if (val != NULL)
+      config->autoscale.lag = json_value_get_number(val);
+    val = json_object_get_value(autoscale, "cpu");
+    if (val != NULL)
+      config->autoscale.cpu = json_value_get_number(val);
+    val = json_object_get_value(autoscale, "interval");
+    if (val != NULL)
+      config->autoscale.interval = json_value_get_number(val);
+    val = json_object_get_value(autoscale, "warmup");
+    if (val != NULL)
+      config->autoscale.warmup = json_value_get_number(val);
+  }
+  watchdog = json_object_get_object(obj, "workers_watchdog");
+  config->watchdog.misses = -1;
+  config->watchdog.grace = -1;
+  if (watchdog != NULL) {
+    val = json_object_get_value(watchdog, "misses");
+    if (val != NULL)
+      config->watchdog.misses = json_value_get_number(val);
+    val = json_object_get_value(watchdog, "grace");
+    if (val != NULL)
+      config->watchdog.grace = json_value_get_number(val);
+  }
 
   /* Logger configuration */
   log = json_object_get_object(obj, "log");
   config->log.stdio = -1;
   config->log.syslog = -1;
+  config->log.async = -1;
+  config->log.queue = -1;
+  config->log.limit = -1;
+  config->log.access = -1;
+  config->log.trace.sample = -1;
+  config->log.trace.slow = -1;
+  config->log.capture.sample = -1;
   if (log != NULL) {
-    config->log.level = json_object_get_string(log, "level");
-    config->log.facility = json_object_get_string(log, "facility");
+    config->log.level = bud_config_get_str(config, log, "level");
+    config->log.facility = bud_config_get_str(config, log, "facility");
 
     val = json_object_get_value(log, "stdio");
     if (val != NULL)
@@ -231,24 +503,201 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
     val = json_object_get_value(log, "syslog");
     if (val != NULL)
       config->log.syslog = json_value_get_boolean(val);
+    val = json_object_get_value(log, "async");
+    if (val != NULL)
+      config->log.async = json_value_get_boolean(val);
+    val = json_object_get_value(log, "queue");
+    if (val != NULL)
+      config->log.queue = json_value_get_number(val);
+    val = json_object_get_value(log, "limit");
+    if (val != NULL)
+      config->log.limit = json_value_get_number(val);
+    val = json_object_get_value(log, "access");
+    if (val != NULL)
+      config->log.access = json_value_get_boolean(val);
+
+    trace = json_object_get_object(log, "trace");
+    if (trace != NULL) {
+      val = json_object_get_value(trace, "sample");
+      if (val != NULL)
+        config->log.trace.sample = json_value_get_number(val);
+      val = json_object_get_value(trace, "slow");
+      if (val != NULL)
+        config->log.trace.slow = json_value_get_number(val);
+    }
+
+    capture = json_object_get_object(log, "capture");
+    if (capture != NULL) {
+      config->log.capture.path = bud_config_get_str(config, capture, "path");
+      val = json_object_get_value(capture, "sample");
+      if (val != NULL)
+        config->log.capture.sample = json_value_get_number(val);
+    }
+  }
+
+  /* Metrics endpoint configuration */
+  metrics = json_object_get_object(obj, "metrics");
+  config->metrics.timing = -1;
+  config->metrics.breakdown = -1;
+  config->metrics.tcp_info.enabled = -1;
+  config->metrics.tcp_info.interval = -1;
+  if (metrics != NULL) {
+    config->metrics.port = json_object_get_number(metrics, "port");
+    config->metrics.host = bud_config_get_str(config, metrics, "host");
+
+    val = json_object_get_value(metrics, "timing");
+    if (val != NULL)
+      config->metrics.timing = json_value_get_boolean(val);
+    val = json_object_get_value(metrics, "breakdown");
+    if (val != NULL)
+      config->metrics.breakdown = json_value_get_number(val);
+
+    tcp_info = json_object_get_object(metrics, "tcp_info");
+    if (tcp_info != NULL) {
+      val = json_object_get_value(tcp_info, "enabled");
+      if (val != NULL)
+        config->metrics.tcp_info.enabled = json_value_get_boolean(val);
+      val = json_object_get_value(tcp_info, "interval");
+      if (val != NULL)
+        config->metrics.tcp_info.interval = json_value_get_number(val);
+    }
+  }
+
+  /* Admin socket configuration */
+  admin = json_object_get_object(obj, "admin");
+  if (admin != NULL)
+    config->admin.path = bud_config_get_str(config, admin, "path");
+
+  /* Buffer pool configuration */
+  pool = json_object_get_object(obj, "pool");
+  config->pool.lazy_buffers = -1;
+  config->pool.low_watermark = -1;
+  config->pool.high_watermark = -1;
+  config->pool.budget = -1;
+  config->pool.trim_idle = -1;
+  config->pool.teardown_budget = -1;
+  config->pool.ssl_objects = -1;
+  config->pool.reserve = -1;
+  config->pool.huge_pages = -1;
+  if (pool != NULL) {
+    val = json_object_get_value(pool, "lazy_buffers");
+    if (val != NULL)
+      config->pool.lazy_buffers = json_value_get_boolean(val);
+    val = json_object_get_value(pool, "low_watermark");
+    if (val != NULL)
+      config->pool.low_watermark = json_value_get_number(val);
+    val = json_object_get_value(pool, "high_watermark");
+    if (val != NULL)
+      config->pool.high_watermark = json_value_get_number(val);
+    val = json_object_get_value(pool, "budget");
+    if (val != NULL)
+      config->pool.budget = json_value_get_number(val);
+    val = json_object_get_value(pool, "trim_idle");
+    if (val != NULL)
+      config->pool.trim_idle = json_value_get_number(val);
+    val = json_object_get_value(pool, "teardown_budget");
+    if (val != NULL)
+      config->pool.teardown_budget = json_value_get_number(val);
+    val = json_object_get_value(pool, "ssl_objects");
+    if (val != NULL)
+      config->pool.ssl_objects = json_value_get_number(val);
+    val = json_object_get_value(pool, "reserve");
+    if (val != NULL)
+      config->pool.reserve = json_value_get_number(val);
+    val = json_object_get_value(pool, "huge_pages");
+    if (val != NULL)
+      config->pool.huge_pages = json_value_get_boolean(val);
   }
 
   /* Frontend configuration */
 
   frontend = json_object_get_object(obj, "frontend");
+  config->frontend.ipv6only = -1;
   config->frontend.proxyline = -1;
+  config->frontend.accept_proxyline = -1;
+  config->frontend.passthrough = -1;
   config->frontend.keepalive = -1;
+  config->frontend.reuseport = -1;
+  config->frontend.shared_listen = -1;
+  config->frontend.backlog = -1;
+  config->frontend.defer_accept = -1;
+  config->frontend.fastopen = -1;
+  config->frontend.accept_limit = -1;
+  config->frontend.handshake_limit = -1;
+  config->frontend.max_handshakes = -1;
+  config->frontend.handshake_queue = -1;
+  config->frontend.cycle_budget = -1;
+  config->frontend.flush_interactive = -1;
+  config->frontend.flush_budget = -1;
+  config->frontend.io_uring = -1;
+  config->frontend.max_clients = -1;
+  config->frontend.max_lag = -1;
+  config->frontend.shed_idle = -1;
   config->frontend.server_preference = -1;
+  config->frontend.prioritize_chacha = -1;
+  config->frontend.cork_handshake = -1;
+  config->frontend.release_buffers = -1;
+  config->frontend.max_send_fragment = -1;
+  config->frontend.strict_sni = -1;
+  config->frontend.http_redirect = -1;
+  config->frontend.cert_compression = -1;
+  config->frontend.zerocopy = -1;
   config->frontend.ssl3 = -1;
+  config->frontend.early_data = -1;
+  config->frontend.ticket_rotate = -1;
+  config->frontend.ticket_previous = -1;
+  config->frontend.coalesce.size = -1;
+  config->frontend.coalesce.delay = -1;
+  config->frontend.record.initial = -1;
+  config->frontend.record.boost_after = -1;
+  config->frontend.record.idle_reset = -1;
+  config->frontend.rate_limit.rate = -1;
+  config->frontend.rate_limit.burst = -1;
+  config->frontend.rate_limit.size = -1;
+  config->frontend.fingerprint.flood = -1;
+  config->frontend.fingerprint.share = -1;
+  config->frontend.fingerprint.ttl = -1;
+  config->frontend.bandwidth.connection = -1;
+  config->frontend.bandwidth.context = -1;
+  config->frontend.bandwidth.burst = -1;
+  config->frontend.quota.connections = -1;
+  config->frontend.quota.handshakes = -1;
+  config->frontend.timeout.handshake = -1;
+  config->frontend.timeout.idle = -1;
+  config->frontend.timeout.write = -1;
   if (frontend != NULL) {
     config->frontend.port = (uint16_t) json_object_get_number(frontend, "port");
-    config->frontend.host = json_object_get_string(frontend, "host");
-    config->frontend.security = json_object_get_string(frontend, "security");
-    config->frontend.npn = json_object_get_array(frontend, "npn");
-    config->frontend.ciphers = json_object_get_string(frontend, "ciphers");
-    config->frontend.ecdh = json_object_get_string(frontend, "ecdh");
-    config->frontend.cert_file = json_object_get_string(frontend, "cert");
-    config->frontend.key_file = json_object_get_string(frontend, "key");
+    config->frontend.host = bud_config_get_str(config, frontend, "host");
+    config->frontend.security = bud_config_get_str(config,
+                                                   frontend,
+                                                   "security");
+    config->frontend.npn =
+        bud_config_read_strs(&config->arena,
+                             json_object_get_array(frontend, "npn"));
+    config->frontend.ciphers = bud_config_get_str(config, frontend, "ciphers");
+    config->frontend.ecdh = bud_config_get_str(config, frontend, "ecdh");
+    config->frontend.verify_client = bud_config_get_str(config,
+                                                        frontend,
+                                                        "verify_client");
+    config->frontend.client_ca = bud_config_get_str(config,
+                                                    frontend,
+                                                    "client_ca");
+    bud_config_read_str_list(config,
+                             frontend,
+                             "cert",
+                             &config->frontend.cert_file,
+                             &config->frontend.cert_files);
+    bud_config_read_str_list(config,
+                             frontend,
+                             "key",
+                             &config->frontend.key_file,
+                             &config->frontend.key_files);
+    config->frontend.ticket_key = bud_config_get_str(config,
+                                                     frontend,
+                                                     "ticket_key");
+    config->frontend.ticket_key_file = bud_config_get_str(config,
+                                                          frontend,
+                                                          "ticket_key_file");
     config->frontend.reneg_window = json_object_get_number(frontend,
                                                            "reneg_window");
     config->frontend.reneg_limit = json_object_get_number(frontend,
@@ -258,40 +707,454 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
     if (!bud_is_ok(*err))
       goto failed_get_index;
 
+    /* `true` is the text v1 line */
     val = json_object_get_value(frontend, "proxyline");
+    if (val != NULL && json_value_get_type(val) == JSONString) {
+      str = json_value_get_string(val);
+      if (strcmp(str, "v1") == 0) {
+        config->frontend.proxyline = BUD_PROXYLINE_V1;
+      } else if (strcmp(str, "v2") == 0) {
+        config->frontend.proxyline = BUD_PROXYLINE_V2;
+      } else {
+        *err = bud_error_str(kBudErrProxyline, "frontend.proxyline");
+        goto failed_get_index;
+      }
+    } else if (val != NULL) {
+      config->frontend.proxyline = json_value_get_boolean(val) ?
+          BUD_PROXYLINE_V1 :
+          0;
+    }
+    val = json_object_get_value(frontend, "accept_proxyline");
+    if (val != NULL)
+      config->frontend.accept_proxyline = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "ipv6only");
+    if (val != NULL)
+      config->frontend.ipv6only = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "passthrough");
     if (val != NULL)
-      config->frontend.proxyline = json_value_get_boolean(val);
+      config->frontend.passthrough = json_value_get_boolean(val);
     val = json_object_get_value(frontend, "keepalive");
     if (val != NULL)
       config->frontend.keepalive = json_value_get_number(val);
+    val = json_object_get_value(frontend, "reuseport");
+    if (val != NULL)
+      config->frontend.reuseport = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "shared_listen");
+    if (val != NULL)
+      config->frontend.shared_listen = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "backlog");
+    if (val != NULL)
+      config->frontend.backlog = json_value_get_number(val);
+    val = json_object_get_value(frontend, "defer_accept");
+    if (val != NULL)
+      config->frontend.defer_accept = json_value_get_number(val);
+    val = json_object_get_value(frontend, "fastopen");
+    if (val != NULL)
+      config->frontend.fastopen = json_value_get_number(val);
+    val = json_object_get_value(frontend, "accept_limit");
+    if (val != NULL)
+      config->frontend.accept_limit = json_value_get_number(val);
+    val = json_object_get_value(frontend, "handshake_limit");
+    if (val != NULL)
+      config->frontend.handshake_limit = json_value_get_number(val);
+    val = json_object_get_value(frontend, "max_handshakes");
+    if (val != NULL)
+      config->frontend.max_handshakes = json_value_get_number(val);
+    val = json_object_get_value(frontend, "handshake_queue");
+    if (val != NULL)
+      config->frontend.handshake_queue = json_value_get_number(val);
+    val = json_object_get_value(frontend, "cycle_budget");
+    if (val != NULL)
+      config->frontend.cycle_budget = json_value_get_number(val);
+    val = json_object_get_value(frontend, "flush_interactive");
+    if (val != NULL)
+      config->frontend.flush_interactive = json_value_get_number(val);
+    val = json_object_get_value(frontend, "flush_budget");
+    if (val != NULL)
+      config->frontend.flush_budget = json_value_get_number(val);
+    val = json_object_get_value(frontend, "io_uring");
+    if (val != NULL)
+      config->frontend.io_uring = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "max_clients");
+    if (val != NULL)
+      config->frontend.max_clients = json_value_get_number(val);
+    val = json_object_get_value(frontend, "max_lag");
+    if (val != NULL)
+      config->frontend.max_lag = json_value_get_number(val);
+    val = json_object_get_value(frontend, "shed_idle");
+    if (val != NULL)
+      config->frontend.shed_idle = json_value_get_boolean(val);
     val = json_object_get_value(frontend, "server_preference");
     if (val != NULL)
       config->frontend.server_preference = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "prioritize_chacha");
+    if (val != NULL)
+      config->frontend.prioritize_chacha = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "cork_handshake");
+    if (val != NULL)
+      config->frontend.cork_handshake = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "release_buffers");
+    if (val != NULL)
+      config->frontend.release_buffers = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "max_send_fragment");
+    if (val != NULL)
+      config->frontend.max_send_fragment = json_value_get_number(val);
+    val = json_object_get_value(frontend, "strict_sni");
+    if (val != NULL)
+      config->frontend.strict_sni = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "http_redirect");
+    if (val != NULL)
+      config->frontend.http_redirect = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "cert_compression");
+    if (val != NULL)
+      config->frontend.cert_compression = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "zerocopy");
+    if (val != NULL)
+      config->frontend.zerocopy = json_value_get_number(val);
     val = json_object_get_value(frontend, "ssl3");
     if (val != NULL)
       config->frontend.ssl3 = json_value_get_boolean(val);
+    val = json_object_get_value(frontend, "early_data");
+    if (val != NULL)
+      config->frontend.early_data = json_value_get_number(val);
+    val = json_object_get_value(frontend, "ticket_rotate");
+    if (val != NULL)
+      config->frontend.ticket_rotate = json_value_get_number(val);
+    val = json_object_get_value(frontend, "ticket_previous");
+    if (val != NULL)
+      config->frontend.ticket_previous = json_value_get_number(val);
+    bud_config_read_buffer_conf(frontend, &config->frontend.buffer);
+
+    coalesce = json_object_get_object(frontend, "coalesce");
+    if (coalesce != NULL) {
+      val = json_object_get_value(coalesce, "size");
+      if (val != NULL)
+        config->frontend.coalesce.size = json_value_get_number(val);
+      val = json_object_get_value(coalesce, "delay");
+      if (val != NULL)
+        config->frontend.coalesce.delay = json_value_get_number(val);
+    }
+
+    record = json_object_get_object(frontend, "record");
+    if (record != NULL) {
+      val = json_object_get_value(record, "initial");
+      if (val != NULL)
+        config->frontend.record.initial = json_value_get_number(val);
+      val = json_object_get_value(record, "boost_after");
+      if (val != NULL)
+        config->frontend.record.boost_after = json_value_get_number(val);
+      val = json_object_get_value(record, "idle_reset");
+      if (val != NULL)
+        config->frontend.record.idle_reset = json_value_get_number(val);
+    }
+
+    rate_limit = json_object_get_object(frontend, "rate_limit");
+    if (rate_limit != NULL) {
+      val = json_object_get_value(rate_limit, "rate");
+      if (val != NULL)
+        config->frontend.rate_limit.rate = json_value_get_number(val);
+      val = json_object_get_value(rate_limit, "burst");
+      if (val != NULL)
+        config->frontend.rate_limit.burst = json_value_get_number(val);
+      val = json_object_get_value(rate_limit, "size");
+      if (val != NULL)
+        config->frontend.rate_limit.size = json_value_get_number(val);
+      config->frontend.rate_limit.shared =
+          bud_config_get_str(config, rate_limit, "shared");
+    }
+
+    access = json_object_get_object(frontend, "access");
+    if (access != NULL) {
+      *err = bud_config_read_access(config,
+                                    access,
+                                    "allow",
+                                    &config->frontend.access.allow,
+                                    &config->frontend.access.allow_file);
+      if (!bud_is_ok(*err))
+        goto failed_get_index;
+      *err = bud_config_read_access(config,
+                                    access,
+                                    "deny",
+                                    &config->frontend.access.deny,
+                                    &config->frontend.access.deny_file);
+      if (!bud_is_ok(*err))
+        goto failed_get_index;
+    }
+
+    fingerprint = json_object_get_object(frontend, "fingerprint");
+    if (fingerprint != NULL) {
+      *err = bud_config_read_access(config,
+                                    fingerprint,
+                                    "deny",
+                                    &config->frontend.fingerprint.deny,
+                                    &config->frontend.fingerprint.deny_file);
+      if (!bud_is_ok(*err))
+        goto failed_get_index;
+      val = json_object_get_value(fingerprint, "flood");
+      if (val != NULL)
+        config->frontend.fingerprint.flood = json_value_get_number(val);
+      val = json_object_get_value(fingerprint, "share");
+      if (val != NULL)
+        config->frontend.fingerprint.share = json_value_get_number(val);
+      val = json_object_get_value(fingerprint, "ttl");
+      if (val != NULL)
+        config->frontend.fingerprint.ttl = json_value_get_number(val);
+    }
+
+    bandwidth = json_object_get_object(frontend, "bandwidth");
+    if (bandwidth != NULL) {
+      val = json_object_get_value(bandwidth, "connection");
+      if (val != NULL)
+        config->frontend.bandwidth.connection = json_value_get_number(val);
+      val = json_object_get_value(bandwidth, "context");
+      if (val != NULL)
+        config->frontend.bandwidth.context = json_value_get_number(val);
+      val = json_object_get_value(bandwidth, "burst");
+      if (val != NULL)
+        config->frontend.bandwidth.burst = json_value_get_number(val);
+    }
+
+    quota = json_object_get_object(frontend, "quota");
+    if (quota != NULL) {
+      val = json_object_get_value(quota, "connections");
+      if (val != NULL)
+        config->frontend.quota.connections = json_value_get_number(val);
+      val = json_object_get_value(quota, "handshakes");
+      if (val != NULL)
+        config->frontend.quota.handshakes = json_value_get_number(val);
+    }
+
+    timeout = json_object_get_object(frontend, "timeout");
+    if (timeout != NULL) {
+      val = json_object_get_value(timeout, "handshake");
+      if (val != NULL)
+        config->frontend.timeout.handshake = json_value_get_number(val);
+      val = json_object_get_value(timeout, "idle");
+      if (val != NULL)
+        config->frontend.timeout.idle = json_value_get_number(val);
+      val = json_object_get_value(timeout, "write");
+      if (val != NULL)
+        config->frontend.timeout.write = json_value_get_number(val);
+    }
   }
 
   /* Backend configuration */
   backend = json_object_get_object(obj, "backend");
+  *err = bud_config_read_backends(config,
+                                  json_object_get_array(obj, "backends"),
+                                  &config->backend.list);
+  if (!bud_is_ok(*err))
+    goto failed_get_index;
+  *err = bud_config_read_backends(config,
+                                  json_object_get_array(obj, "h2_backends"),
+                                  &config->backend.h2_list);
+  if (!bud_is_ok(*err))
+    goto failed_get_index;
   config->backend.keepalive = -1;
+  config->backend.health.interval = -1;
+  config->backend.health.max_fails = -1;
+  config->backend.health.fail_timeout = -1;
+  config->backend.pool.idle_timeout = -1;
+  config->backend.tls.enabled = -1;
+  config->backend.tls.session_reuse = -1;
+  config->backend.ewma_decay = -1;
+  config->backend.lazy_connect = -1;
+  config->backend.fastopen = -1;
+  config->backend.resolve_interval = -1;
+  config->backend.happy_eyeballs = -1;
+  config->backend.server_first = -1;
+  config->backend.http_reuse = -1;
+  config->backend.xforward = -1;
+  config->backend.buffer_request.enabled = -1;
+  config->backend.buffer_request.body = -1;
+  config->backend.spill.max = -1;
   if (backend != NULL) {
     config->backend.port = (uint16_t) json_object_get_number(backend, "port");
-    config->backend.host = json_object_get_string(backend, "host");
+    config->backend.host = bud_config_get_str(config, backend, "host");
     val = json_object_get_value(backend, "keepalive");
     if (val != NULL)
       config->backend.keepalive = json_value_get_number(val);
+    config->backend.balance = bud_config_get_str(config, backend, "balance");
+    val = json_object_get_value(backend, "ewma_decay");
+    if (val != NULL)
+      config->backend.ewma_decay = json_value_get_number(val);
+    val = json_object_get_value(backend, "lazy_connect");
+    if (val != NULL)
+      config->backend.lazy_connect = json_value_get_boolean(val);
+    val = json_object_get_value(backend, "fastopen");
+    if (val != NULL)
+      config->backend.fastopen = json_value_get_boolean(val);
+    val = json_object_get_value(backend, "resolve_interval");
+    if (val != NULL)
+      config->backend.resolve_interval = json_value_get_number(val);
+    val = json_object_get_value(backend, "happy_eyeballs");
+    if (val != NULL)
+      config->backend.happy_eyeballs = json_value_get_number(val);
+    val = json_object_get_value(backend, "server_first");
+    if (val != NULL)
+      config->backend.server_first = json_value_get_boolean(val);
+    val = json_object_get_value(backend, "http_reuse");
+    if (val != NULL)
+      config->backend.http_reuse = json_value_get_boolean(val);
+    val = json_object_get_value(backend, "xforward");
+    if (val != NULL)
+      config->backend.xforward = json_value_get_boolean(val);
+    bud_config_read_buffer_conf(backend, &config->backend.buffer);
+
+    buffer_request = json_object_get_object(backend, "buffer_request");
+    if (buffer_request != NULL) {
+      val = json_object_get_value(buffer_request, "enabled");
+      if (val != NULL)
+        config->backend.buffer_request.enabled = json_value_get_boolean(val);
+      val = json_object_get_value(buffer_request, "body");
+      if (val != NULL)
+        config->backend.buffer_request.body = json_value_get_number(val);
+    }
+
+    spill = json_object_get_object(backend, "spill");
+    if (spill != NULL) {
+      config->backend.spill.dir = bud_config_get_str(config, spill, "dir");
+      val = json_object_get_value(spill, "max");
+      if (val != NULL)
+        config->backend.spill.max = json_value_get_number(val);
+    }
+
+    health = json_object_get_object(backend, "health_check");
+    if (health != NULL) {
+      val = json_object_get_value(health, "interval");
+      if (val != NULL)
+        config->backend.health.interval = json_value_get_number(val);
+      val = json_object_get_value(health, "max_fails");
+      if (val != NULL)
+        config->backend.health.max_fails = json_value_get_number(val);
+      val = json_object_get_value(health, "fail_timeout");
+      if (val != NULL)
+        config->backend.health.fail_timeout = json_value_get_number(val);
+      val = json_object_get_value(health, "fail_fast");
+      if (val != NULL)
+        config->backend.health.fail_fast = json_value_get_boolean(val);
+    }
+
+    pool = json_object_get_object(backend, "pool");
+    if (pool != NULL) {
+      config->backend.pool.min_idle = json_object_get_number(pool,
+                                                             "min_idle");
+      config->backend.pool.max_idle = json_object_get_number(pool,
+                                                             "max_idle");
+      val = json_object_get_value(pool, "idle_timeout");
+      if (val != NULL)
+        config->backend.pool.idle_timeout = json_value_get_number(val);
+    }
+
+    tls = json_object_get_object(backend, "tls");
+    if (tls != NULL) {
+      val = json_object_get_value(tls, "enabled");
+      if (val != NULL)
+        config->backend.tls.enabled = json_value_get_boolean(val);
+      config->backend.tls.servername = bud_config_get_str(config,
+                                                          tls,
+                                                          "servername");
+      config->backend.tls.ciphers = bud_config_get_str(config, tls, "ciphers");
+      config->backend.tls.ca = bud_config_get_str(config, tls, "ca");
+      val = json_object_get_value(tls, "session_reuse");
+      if (val != NULL)
+        config->backend.tls.session_reuse = json_value_get_boolean(val);
+    }
+  }
+
+  /* Crypto engine configuration */
+  engine = json_object_get_object(obj, "engine");
+  if (engine != NULL) {
+    config->engine.id = bud_config_get_str(config, engine, "id");
+    config->engine.path = bud_config_get_str(config, engine, "path");
+    config->engine.defaults = bud_config_get_str(config, engine, "default");
+    val = json_object_get_value(engine, "async");
+    if (val != NULL)
+      config->engine.async = json_value_get_boolean(val);
   }
 
   /* SNI configuration */
-  bud_config_read_pool_conf(obj, "sni", &config->sni);
+  bud_config_read_pool_conf(config, obj, "sni", &config->sni);
 
   /* OCSP Stapling configuration */
-  bud_config_read_pool_conf(obj, "stapling", &config->stapling);
+  bud_config_read_pool_conf(config, obj, "stapling", &config->stapling);
+
+  /* External TLS session cache configuration */
+  bud_config_read_pool_conf(config, obj, "session", &config->session);
+
+  /* Client certificate CRLs configuration */
+  bud_config_read_pool_conf(config, obj, "crl", &config->crl);
+
+  /* Shared TLS session cache configuration */
+  session_cache = json_object_get_object(obj, "session_cache");
+  config->session_cache.enabled = -1;
+  if (session_cache != NULL) {
+    val = json_object_get_value(session_cache, "enabled");
+    if (val != NULL)
+      config->session_cache.enabled = json_value_get_boolean(val);
+    config->session_cache.size = json_object_get_number(session_cache,
+                                                        "size");
+    config->session_cache.timeout = json_object_get_number(session_cache,
+                                                           "timeout");
+  }
+
+  /* Client certificate verification cache */
+  verify_cache = json_object_get_object(obj, "verify_cache");
+  config->verify_cache.size = -1;
+  config->verify_cache.ttl = -1;
+  config->verify_cache.crl_refresh = -1;
+  if (verify_cache != NULL) {
+    val = json_object_get_value(verify_cache, "size");
+    if (val != NULL)
+      config->verify_cache.size = json_value_get_number(val);
+    val = json_object_get_value(verify_cache, "ttl");
+    if (val != NULL)
+      config->verify_cache.ttl = json_value_get_number(val);
+    val = json_object_get_value(verify_cache, "crl_refresh");
+    if (val != NULL)
+      config->verify_cache.crl_refresh = json_value_get_number(val);
+  }
+
+  /* On-demand SSL_CTX configuration */
+  lazy_contexts = json_object_get_object(obj, "lazy_contexts");
+  config->lazy_contexts.enabled = -1;
+  if (lazy_contexts != NULL) {
+    val = json_object_get_value(lazy_contexts, "enabled");
+    if (val != NULL)
+      config->lazy_contexts.enabled = json_value_get_boolean(val);
+    config->lazy_contexts.idle_timeout =
+        json_object_get_number(lazy_contexts, "idle_timeout");
+  }
+
+  /* Shared SNI and stapling cache configuration */
+  shared_cache = json_object_get_object(obj, "shared_cache");
+  config->shared_cache.enabled = -1;
+  if (shared_cache != NULL) {
+    val = json_object_get_value(shared_cache, "enabled");
+    if (val != NULL)
+      config->shared_cache.enabled = json_value_get_boolean(val);
+    config->shared_cache.size = json_object_get_number(shared_cache, "size");
+  }
+
+  /* Persistent SNI and stapling cache configuration */
+  disk_cache = json_object_get_object(obj, "disk_cache");
+  config->disk_cache.enabled = -1;
+  if (disk_cache != NULL) {
+    val = json_object_get_value(disk_cache, "enabled");
+    if (val != NULL)
+      config->disk_cache.enabled = json_value_get_boolean(val);
+    config->disk_cache.path = bud_config_get_str(config, disk_cache, "path");
+    config->disk_cache.size = json_object_get_number(disk_cache, "size");
+  }
 
   /* SSL Contexts */
 
   /* TODO(indutny): sort them and do binary search */
+  config->contexts[0].bandwidth = -1;
+  config->contexts[0].release_buffers = -1;
+  config->contexts[0].max_send_fragment = -1;
+  config->contexts[0].quota.connections = -1;
+  config->contexts[0].quota.handshakes = -1;
   for (i = 0; i < context_count; i++) {
     /* NOTE: contexts[0] - is a default context */
     ctx = &config->contexts[i + 1];
@@ -301,13 +1164,56 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
       goto failed_get_index;
     }
 
-    ctx->servername = json_object_get_string(obj, "servername");
+    ctx->servername = bud_config_get_str(config, obj, "servername");
     ctx->servername_len = ctx->servername == NULL ? 0 : strlen(ctx->servername);
-    ctx->cert_file = json_object_get_string(obj, "cert");
-    ctx->key_file = json_object_get_string(obj, "key");
-    ctx->npn = json_object_get_array(obj, "npn");
-    ctx->ciphers = json_object_get_string(obj, "ciphers");
-    ctx->ecdh = json_object_get_string(obj, "ecdh");
+    bud_config_read_str_list(config,
+                             obj,
+                             "cert",
+                             &ctx->cert_file,
+                             &ctx->cert_files);
+    bud_config_read_str_list(config,
+                             obj,
+                             "key",
+                             &ctx->key_file,
+                             &ctx->key_files);
+    ctx->npn = bud_config_read_strs(&config->arena,
+                                    json_object_get_array(obj, "npn"));
+    ctx->ciphers = bud_config_get_str(config, obj, "ciphers");
+    ctx->ecdh = bud_config_get_str(config, obj, "ecdh");
+    *err = bud_config_read_backends(config,
+                                    json_object_get_array(obj, "backends"),
+                                    &ctx->backend_list);
+    if (!bud_is_ok(*err))
+      goto failed_get_index;
+    ctx->engine_id = bud_config_get_str(config, obj, "engine");
+    ctx->verify_client = bud_config_get_str(config, obj, "verify_client");
+    ctx->client_ca = bud_config_get_str(config, obj, "client_ca");
+    ctx->ocsp_file = bud_config_get_str(config, obj, "ocsp_file");
+    if (ctx->ocsp_file != NULL)
+      config->ocsp_files++;
+    val = json_object_get_value(obj, "bandwidth");
+    ctx->bandwidth = -1;
+    if (val != NULL && json_value_get_type(val) == JSONNumber)
+      ctx->bandwidth = json_value_get_number(val);
+    val = json_object_get_value(obj, "release_buffers");
+    ctx->release_buffers = -1;
+    if (val != NULL && json_value_get_type(val) == JSONBoolean)
+      ctx->release_buffers = json_value_get_boolean(val);
+    val = json_object_get_value(obj, "max_send_fragment");
+    ctx->max_send_fragment = -1;
+    if (val != NULL && json_value_get_type(val) == JSONNumber)
+      ctx->max_send_fragment = json_value_get_number(val);
+    ctx->quota.connections = -1;
+    ctx->quota.handshakes = -1;
+    quota = json_object_get_object(obj, "quota");
+    if (quota != NULL) {
+      val = json_object_get_value(quota, "connections");
+      if (val != NULL && json_value_get_type(val) == JSONNumber)
+        ctx->quota.connections = json_value_get_number(val);
+      val = json_object_get_value(quota, "handshakes");
+      if (val != NULL && json_value_get_type(val) == JSONNumber)
+        ctx->quota.handshakes = json_value_get_number(val);
+    }
 
     *err = bud_config_verify_npn(ctx->npn);
     if (!bud_is_ok(*err))
@@ -315,12 +1221,25 @@ bud_config_t* bud_config_load(uv_loop_t* loop,
   }
   config->context_count = context_count;
 
+  *err = bud_config_read_listeners(config, frontends);
+  if (!bud_is_ok(*err))
+    goto failed_get_index;
+
+  /* Everything is copied out of the JSON by now */
+  if (config->arena.failed) {
+    *err = bud_error_str(kBudErrNoMem, "config arena");
+    goto failed_get_index;
+  }
+  json_value_free(json);
+
   bud_config_set_defaults(config);
 
   *err = bud_ok();
   return config;
 
 failed_get_index:
+  free(config->listeners);
+  bud_arena_destroy(&config->arena);
   free(config);
 
 failed_get_object:
@@ -331,132 +1250,939 @@ end:
 }
 
 
-void bud_config_read_pool_conf(JSON_Object* obj,
+void bud_config_read_pool_conf(bud_config_t* config,
+                               JSON_Object* obj,
                                const char* key,
                                bud_config_http_pool_t* pool) {
   JSON_Object* p;
+  JSON_Object* cache;
+  JSON_Value* val;
+
+  pool->hosts = NULL;
+  pool->cache.size = -1;
+  pool->cache.ttl = -1;
+  pool->cache.negative_ttl = -1;
+  pool->cache.stale_ttl = -1;
+  pool->cache.certs = -1;
+  pool->direct = -1;
+  pool->directory = NULL;
+  pool->binary = -1;
+  bud_config_init_pool_limits(pool);
 
   p = json_object_get_object(obj, key);
   if (p != NULL) {
     pool->enabled = json_object_get_boolean(p, "enabled");
     pool->port = (uint16_t) json_object_get_number(p, "port");
-    pool->host = json_object_get_string(p, "host");
-    pool->query_fmt = json_object_get_string(p, "query");
+    bud_config_read_str_list(config, p, "host", &pool->host, &pool->hosts);
+    pool->query_fmt = bud_config_get_str(config, p, "query");
+    pool->direct = json_object_get_boolean(p, "direct");
+    pool->directory = bud_config_get_str(config, p, "directory");
+    val = json_object_get_value(p, "binary");
+    if (val != NULL)
+      pool->binary = json_value_get_boolean(val);
+    val = json_object_get_value(p, "max_connections");
+    if (val != NULL)
+      pool->max_connections = json_value_get_number(val);
+    val = json_object_get_value(p, "timeout");
+    if (val != NULL)
+      pool->timeout = json_value_get_number(val);
+    val = json_object_get_value(p, "pipeline");
+    if (val != NULL)
+      pool->pipeline = json_value_get_number(val);
+    val = json_object_get_value(p, "idle_timeout");
+    if (val != NULL)
+      pool->idle_timeout = json_value_get_number(val);
+    val = json_object_get_value(p, "max_fails");
+    if (val != NULL)
+      pool->max_fails = json_value_get_number(val);
+    val = json_object_get_value(p, "backoff");
+    if (val != NULL)
+      pool->backoff = json_value_get_number(val);
+    val = json_object_get_value(p, "max_backoff");
+    if (val != NULL)
+      pool->max_backoff = json_value_get_number(val);
+    val = json_object_get_value(p, "resolve_interval");
+    if (val != NULL)
+      pool->resolve_interval = json_value_get_number(val);
+    val = json_object_get_value(p, "hedge");
+    if (val != NULL)
+      pool->hedge = json_value_get_number(val);
+
+    cache = json_object_get_object(p, "cache");
+    if (cache != NULL) {
+      val = json_object_get_value(cache, "size");
+      if (val != NULL)
+        pool->cache.size = json_value_get_number(val);
+      val = json_object_get_value(cache, "ttl");
+      if (val != NULL)
+        pool->cache.ttl = json_value_get_number(val);
+      val = json_object_get_value(cache, "negative_ttl");
+      if (val != NULL)
+        pool->cache.negative_ttl = json_value_get_number(val);
+      val = json_object_get_value(cache, "stale_ttl");
+      if (val != NULL)
+        pool->cache.stale_ttl = json_value_get_number(val);
+      val = json_object_get_value(cache, "certs");
+      if (val != NULL)
+        pool->cache.certs = json_value_get_number(val);
+    }
   }
 }
 
 
-void bud_config_finalize(bud_config_t* config) {
-  if (config->sni.pool != NULL)
-    bud_http_pool_free(config->sni.pool);
-  config->sni.pool = NULL;
-  if (config->stapling.pool != NULL)
-    bud_http_pool_free(config->stapling.pool);
-  config->stapling.pool = NULL;
+void bud_config_init_pool_limits(bud_config_http_pool_t* pool) {
+  pool->max_connections = -1;
+  pool->timeout = -1;
+  pool->pipeline = -1;
+  pool->idle_timeout = -1;
+  pool->max_fails = -1;
+  pool->backoff = -1;
+  pool->max_backoff = -1;
+  pool->resolve_interval = -1;
+  pool->hedge = -1;
 }
 
 
-void bud_config_free(bud_config_t* config) {
-  int i;
+void bud_config_print_pool_limits(bud_config_http_pool_t* pool,
+                                  const char* end) {
+  fprintf(stdout, "    \"max_connections\": %d,\n", pool->max_connections);
+  fprintf(stdout, "    \"timeout\": %d,\n", pool->timeout);
+  fprintf(stdout, "    \"pipeline\": %d,\n", pool->pipeline);
+  fprintf(stdout, "    \"idle_timeout\": %d,\n", pool->idle_timeout);
+  fprintf(stdout, "    \"max_fails\": %d,\n", pool->max_fails);
+  fprintf(stdout, "    \"backoff\": %d,\n", pool->backoff);
+  fprintf(stdout, "    \"max_backoff\": %d,\n", pool->max_backoff);
+  fprintf(stdout,
+          "    \"resolve_interval\": %d,\n",
+          pool->resolve_interval);
+  fprintf(stdout, "    \"hedge\": %d%s\n", pool->hedge, end);
+}
 
-  bud_config_finalize(config);
-  uv_run(config->loop, UV_RUN_ONCE);
 
-  for (i = 0; i < config->context_count + 1; i++)
-    bud_context_free(&config->contexts[i]);
-  free(config->workers);
-  config->workers = NULL;
+void bud_config_read_str_list(bud_config_t* config,
+                              JSON_Object* obj,
+                              const char* name,
+                              const char** first,
+                              const bud_config_strs_t** list) {
+  JSON_Value* val;
 
-  if (config->logger != NULL)
-    bud_logger_free(config);
-  config->logger = NULL;
+  *first = NULL;
+  *list = NULL;
+  val = json_object_get_value(obj, name);
+  if (val == NULL)
+    return;
 
-  json_value_free(config->json);
-  config->json = NULL;
-  free(config);
+  if (json_value_get_type(val) == JSONArray) {
+    *list = bud_config_read_strs(&config->arena, json_value_get_array(val));
+    if (*list != NULL && (*list)->count != 0)
+      *first = (*list)->items[0];
+  } else {
+    *first = bud_arena_intern(&config->arena, json_value_get_string(val));
+  }
 }
 
 
-void bud_context_free(bud_context_t* context) {
-  SSL_CTX_free(context->ctx);
-  if (context->cert != NULL)
-    X509_free(context->cert);
-  if (context->issuer != NULL)
-    X509_free(context->issuer);
-  if (context->ocsp_id != NULL)
-    OCSP_CERTID_free(context->ocsp_id);
-  if (context->ocsp_der_id != NULL)
-    free(context->ocsp_der_id);
-  free(context->npn_line);
-  context->ctx = NULL;
-  context->cert = NULL;
-  context->issuer = NULL;
-  context->npn_line = NULL;
-  context->ocsp_id = NULL;
-  context->ocsp_der_id = NULL;
+const char* bud_config_get_str(bud_config_t* config,
+                               const JSON_Object* obj,
+                               const char* name) {
+  return bud_arena_intern(&config->arena, json_object_get_string(obj, name));
 }
 
 
-void bud_print_help(int argc, char** argv) {
-  ASSERT(argc >= 1, "Not enough arguments");
-  fprintf(stdout, "Usage: %s [options]\n\n", argv[0]);
-  fprintf(stdout, "options:\n");
-  fprintf(stdout, "  --version, -v              Print bud version\n");
-  fprintf(stdout, "  --config PATH, -c PATH     Load JSON configuration\n");
-  fprintf(stdout, "  --default-config           Print default JSON config\n");
-#ifndef _WIN32
-  fprintf(stdout, "  --daemon, -d               Daemonize process\n");
-#endif  /* !_WIN32 */
-  fprintf(stdout, "\n");
+const bud_config_strs_t* bud_config_read_strs(bud_arena_t* arena,
+                                              const JSON_Array* arr) {
+  bud_config_strs_t* strs;
+  int i;
+  int count;
+
+  if (arr == NULL)
+    return NULL;
+
+  count = json_array_get_count(arr);
+  strs = bud_arena_alloc(arena,
+                         sizeof(*strs) + count * sizeof(*strs->items));
+  if (strs == NULL)
+    return NULL;
+
+  /* Non-strings stay NULL, for the checks of the callers */
+  strs->count = count;
+  for (i = 0; i < count; i++)
+    strs->items[i] = bud_arena_intern(arena, json_array_get_string(arr, i));
+
+  return strs;
 }
 
 
-void bud_print_version() {
-  fprintf(stdout, "v%d.%d\n", BUD_VERSION_MAJOR, BUD_VERSION_MINOR);
+bud_error_t bud_config_read_backends(bud_config_t* config,
+                                     const JSON_Array* arr,
+                                     const bud_backend_confs_t** out) {
+  bud_backend_confs_t* confs;
+  bud_backend_conf_t* conf;
+  int i;
+  int count;
+  bud_error_t err;
+
+  *out = NULL;
+  if (arr == NULL)
+    return bud_ok();
+
+  count = json_array_get_count(arr);
+  confs = bud_arena_alloc(&config->arena,
+                          sizeof(*confs) + count * sizeof(*confs->items));
+  if (confs == NULL)
+    return bud_error_str(kBudErrNoMem, "backends");
+
+  confs->count = count;
+  for (i = 0; i < count; i++) {
+    conf = &confs->items[i];
+    err = bud_backend_conf_read(json_array_get_object(arr, i), conf);
+    if (!bud_is_ok(err))
+      return err;
+    conf->host = bud_arena_intern(&config->arena, conf->host);
+  }
+
+  *out = confs;
+  return bud_ok();
 }
 
 
-void bud_config_print_default() {
-  bud_config_t config;
+bud_error_t bud_config_read_access(bud_config_t* config,
+                                   JSON_Object* obj,
+                                   const char* name,
+                                   const bud_config_strs_t** list,
+                                   const char** file) {
+  JSON_Value* val;
 
-  memset(&config, 0, sizeof(config));
+  *list = NULL;
+  *file = NULL;
+  val = json_object_get_value(obj, name);
+  if (val == NULL || json_value_get_type(val) == JSONNull)
+    return bud_ok();
 
-  /* Set zero-y values */
-  config.worker_count = -1;
-  config.log.stdio = -1;
-  config.log.syslog = -1;
-  config.frontend.keepalive = -1;
-  config.frontend.ssl3 = -1;
-  config.backend.keepalive = -1;
-  config.restart_timeout = -1;
+  /* Path of the file with the entries, read anew on `reload access` */
+  if (json_value_get_type(val) == JSONString) {
+    *file = bud_arena_intern(&config->arena, json_value_get_string(val));
+    return bud_ok();
+  }
 
-  bud_config_set_defaults(&config);
+  if (json_value_get_type(val) != JSONArray)
+    return bud_error_str(kBudErrAccessEntry, "(not an array or a path)");
 
-  fprintf(stdout, "{\n");
-  fprintf(stdout, "  \"daemon\": false,\n");
-  fprintf(stdout, "  \"workers\": %d,\n", config.worker_count);
-  fprintf(stdout, "  \"restart_timeout\": %d,\n", config.restart_timeout);
-  fprintf(stdout, "  \"log\": {\n");
-  fprintf(stdout, "    \"level\": \"%s\",\n", config.log.level);
-  fprintf(stdout, "    \"facility\": \"%s\",\n", config.log.facility);
-  fprintf(stdout,
-          "    \"stdio\": %s,\n",
-          config.log.stdio ? "true" : "false");
-  fprintf(stdout,
-          "    \"syslog\": %s\n",
-          config.log.syslog ? "true" : "false");
-  fprintf(stdout, "  },\n");
-  fprintf(stdout, "  \"frontend\": {\n");
-  fprintf(stdout, "    \"port\": %d,\n", config.frontend.port);
-  fprintf(stdout, "    \"host\": \"%s\",\n", config.frontend.host);
-  fprintf(stdout, "    \"keepalive\": %d,\n", config.frontend.keepalive);
+  *list = bud_config_read_strs(&config->arena, json_value_get_array(val));
+  return bud_ok();
+}
+
+
+void bud_config_read_affinity(bud_config_t* config, const JSON_Value* val) {
+  const JSON_Array* arr;
+  const JSON_Value* cpu;
+  int* cpus;
+  int i;
+  int count;
+
+  config->workers_affinity = NULL;
+  config->affinity_cpus = NULL;
+  config->affinity_cpu_count = 0;
+  if (val == NULL || json_value_get_type(val) == JSONNull)
+    return;
+
+  if (json_value_get_type(val) != JSONArray) {
+    /* Anything but "auto" is rejected by bud_affinity_init() */
+    config->workers_affinity = json_value_get_string(val);
+    if (config->workers_affinity == NULL)
+      config->workers_affinity = "";
+    config->workers_affinity = bud_arena_intern(&config->arena,
+                                                config->workers_affinity);
+    return;
+  }
+
+  arr = json_value_get_array(val);
+  count = json_array_get_count(arr);
+  cpus = bud_arena_alloc(&config->arena, (count + 1) * sizeof(*cpus));
+  if (cpus == NULL)
+    return;
+
+  /* Non-numbers are out of range, and rejected too */
+  for (i = 0; i < count; i++) {
+    cpu = json_array_get_value(arr, i);
+    cpus[i] = -1;
+    if (json_value_get_type(cpu) == JSONNumber)
+      cpus[i] = (int) json_value_get_number(cpu);
+  }
+  config->affinity_cpus = cpus;
+  config->affinity_cpu_count = count;
+}
+
+
+void bud_config_read_buffer_conf(JSON_Object* obj,
+                                 bud_config_buffer_t* buffer) {
+  JSON_Object* b;
+  JSON_Value* val;
+
+  b = json_object_get_object(obj, "buffer");
+  if (b != NULL) {
+    buffer->chunk_size = json_object_get_number(b, "chunk_size");
+    buffer->chunk_count = json_object_get_number(b, "chunk_count");
+    buffer->bulk_count = json_object_get_number(b, "bulk_count");
+    buffer->high_watermark = json_object_get_number(b, "high_watermark");
+    buffer->low_watermark = json_object_get_number(b, "low_watermark");
+    val = json_object_get_value(b, "mirror");
+    if (val != NULL)
+      buffer->mirror = json_value_get_boolean(val) == 1;
+    buffer->sndbuf = bud_config_read_socket_size(b, "sndbuf");
+    buffer->rcvbuf = bud_config_read_socket_size(b, "rcvbuf");
+    buffer->notsent_lowat = bud_config_read_socket_size(b, "notsent_lowat");
+  }
+}
+
+
+int bud_config_read_socket_size(JSON_Object* obj, const char* key) {
+  JSON_Value* val;
+  const char* str;
+
+  val = json_object_get_value(obj, key);
+  if (val == NULL)
+    return 0;
+  if (json_value_get_type(val) == JSONString) {
+    str = json_value_get_string(val);
+    return strcmp(str, "auto") == 0 ? BUD_CONFIG_SOCKET_AUTO : 0;
+  }
+  if (json_value_get_number(val) < 0)
+    return 0;
+  return json_value_get_number(val);
+}
+
+
+int bud_config_buffer_marks_ok(bud_config_buffer_t* buffer) {
+  /* Buffer is full anyway at `chunk_size * chunk_count` */
+  return buffer->low_watermark >= 0 &&
+         buffer->low_watermark <= buffer->high_watermark &&
+         buffer->high_watermark <=
+             buffer->chunk_size * buffer->chunk_count;
+}
+
+
+int bud_config_buffer_bulk_ok(bud_config_buffer_t* buffer) {
+  /* Bulk connections may only grow */
+  return buffer->bulk_count == 0 ||
+         buffer->bulk_count >= buffer->chunk_count;
+}
+
+
+void bud_config_reserve_buffers(bud_config_t* config,
+                                ringbuffer_pool* pool,
+                                const char* name) {
+  static const char* pages[] = { "normal", "transparent huge", "huge" };
+
+  if (config->pool.reserve <= 0)
+    return;
+
+  /* Pool still works without it, chunks are just malloc()-ed */
+  if (ringbuffer_pool_reserve(pool,
+                              config->pool.reserve,
+                              config->pool.huge_pages) != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "failed to reserve %d %s buffer chunks",
+            config->pool.reserve,
+            name);
+    return;
+  }
+
+  if (config->pool.huge_pages &&
+      pool->reserve_pages == kRingbufferPagesNormal) {
+    bud_log(config,
+            kBudLogWarning,
+            "huge pages are not available for %s buffers",
+            name);
+  }
+  bud_log(config,
+          kBudLogDebug,
+          "reserved %d %s buffer chunks (%lu bytes) on %s pages",
+          config->pool.reserve,
+          name,
+          (unsigned long) pool->reserve_size,
+          pages[pool->reserve_pages]);
+}
+
+
+bud_error_t bud_config_read_listeners(bud_config_t* config,
+                                      JSON_Array* frontends) {
+  int i;
+  int count;
+  JSON_Object* obj;
+  JSON_Value* val;
+  bud_config_listener_t* listener;
+
+  count = frontends == NULL ? 0 : json_array_get_count(frontends);
+  config->listeners = calloc(count + 1, sizeof(*config->listeners));
+  if (config->listeners == NULL)
+    return bud_error_str(kBudErrNoMem, "listeners");
+  config->listener_count = count + 1;
+
+  /* NOTE: listeners[0] - is `frontend`, see bud_config_set_defaults() */
+  for (i = 0; i < count; i++) {
+    listener = &config->listeners[i + 1];
+    obj = json_array_get_object(frontends, i);
+    if (obj == NULL)
+      return bud_error(kBudErrJSONNonObjectFrontend);
+
+    listener->port = (uint16_t) json_object_get_number(obj, "port");
+    listener->host = bud_config_get_str(config, obj, "host");
+    listener->context_name = bud_config_get_str(config, obj, "context");
+    listener->ipv6only = -1;
+    val = json_object_get_value(obj, "ipv6only");
+    if (val != NULL)
+      listener->ipv6only = json_value_get_boolean(val);
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_config_init_listeners(bud_config_t* config) {
+  int i;
+  int j;
+  int r;
+  bud_config_listener_t* listener;
+  bud_context_t* ctx;
+
+  for (i = 0; i < config->listener_count; i++) {
+    listener = &config->listeners[i];
+    r = bud_config_str_to_addr(listener->host,
+                               listener->port,
+                               &listener->addr);
+    if (r != 0)
+      return bud_error_num(kBudErrPton, r);
+
+    listener->context = &config->contexts[0];
+    if (listener->context_name == NULL)
+      continue;
+
+    /* Happens once, no need for the index */
+    for (j = 1; j < config->context_count + 1; j++) {
+      ctx = &config->contexts[j];
+      if (ctx->servername != NULL &&
+          strcasecmp(ctx->servername, listener->context_name) == 0) {
+        break;
+      }
+    }
+    if (j == config->context_count + 1)
+      return bud_error_str(kBudErrListenerContext, listener->context_name);
+    listener->context = &config->contexts[j];
+  }
+
+  return bud_ok();
+}
+
+
+void bud_config_finalize(bud_config_t* config) {
+  int i;
+
+  /* Queued clients still hold SNI contexts and sessions */
+  bud_client_teardown_finalize(config);
+  bud_client_ssl_pool_free(config);
+
+  if (config->sni.pool != NULL)
+    bud_http_pool_free(config->sni.pool);
+  config->sni.pool = NULL;
+  /* Lookup will cancel staple lookups of static contexts, may be shared */
+  for (i = 0; i < config->context_count + 1; i++)
+    config->contexts[i].staple_lookup = NULL;
+  if (config->stapling.lookup != NULL &&
+      config->stapling.lookup != config->sni.lookup) {
+    bud_lookup_free(config->stapling.lookup);
+  }
+  config->stapling.lookup = NULL;
+  if (config->sni.lookup != NULL)
+    bud_lookup_free(config->sni.lookup);
+  config->sni.lookup = NULL;
+  if (config->sni_cache != NULL)
+    bud_sni_cache_free(config->sni_cache);
+  config->sni_cache = NULL;
+  if (config->cert_cache != NULL)
+    bud_cert_cache_free(config->cert_cache);
+  config->cert_cache = NULL;
+  /* Pool will cancel staple requests of static contexts */
+  for (i = 0; i < config->context_count + 1; i++)
+    config->contexts[i].staple_req = NULL;
+  bud_ocsp_responders_free(config);
+  bud_ocsp_files_free(config);
+  if (config->stapling.pool != NULL)
+    bud_http_pool_free(config->stapling.pool);
+  config->stapling.pool = NULL;
+  if (config->session.pool != NULL)
+    bud_http_pool_free(config->session.pool);
+  config->session.pool = NULL;
+  /* Same for CRL requests */
+  for (i = 0; i < config->context_count + 1; i++)
+    config->contexts[i].crl_req = NULL;
+  if (config->crl.pool != NULL)
+    bud_http_pool_free(config->crl.pool);
+  config->crl.pool = NULL;
+  bud_verify_free(config);
+  bud_backends_finalize(config);
+  bud_client_handshakes_finalize(config);
+  bud_client_flush_finalize(config);
+  bud_client_spin_finalize(config);
+  bud_client_budget_finalize(config);
+  bud_client_reclaim_finalize(config);
+  bud_client_tcp_info_finalize(config);
+  bud_client_timeouts_finalize(config);
+  bud_client_shape_finalize(config);
+  bud_client_zerocopy_finalize(config);
+  free(config->read_buf);
+  config->read_buf = NULL;
+  if (config->lazy_timer_init) {
+    config->lazy_timer_init = 0;
+    uv_close((uv_handle_t*) &config->lazy_timer, NULL);
+  }
+}
+
+
+void bud_config_free(bud_config_t* config) {
+  int i;
+
+  bud_config_finalize(config);
+  uv_run(config->loop, UV_RUN_ONCE);
+
+  for (i = 0; i < config->context_count + 1; i++)
+    bud_context_free(&config->contexts[i]);
+  free(config->context_buckets);
+  config->context_buckets = NULL;
+
+  bud_engines_log_stats(config);
+  bud_engines_free(config);
+  bud_ratelimit_free(config->ratelimit);
+  config->ratelimit = NULL;
+  bud_access_free(config->access);
+  config->access = NULL;
+  bud_fingerprint_free(config->fingerprint);
+  config->fingerprint = NULL;
+  bud_metrics_tables_free(config);
+  bud_capture_free(config);
+  bud_uring_free(config->uring);
+  config->uring = NULL;
+  bud_slab_log_stats(config, &config->client_slab);
+  bud_slab_log_stats(config, &config->handshake_slab);
+  bud_slab_log_stats(config, &config->http_req_slab);
+  bud_slab_log_stats(config, &config->http_conn_slab);
+  if (!config->is_worker)
+    bud_slab_log_stats(config, &config->master_msg_slab);
+  bud_log(config,
+          kBudLogDebug,
+          "buffer pool used: %lu free: %lu hits: %llu misses: %llu",
+          (unsigned long) config->buffer_pool.used_count,
+          (unsigned long) config->buffer_pool.free_count,
+          config->buffer_pool.hits,
+          config->buffer_pool.misses);
+  bud_slab_destroy(&config->client_slab);
+  bud_slab_destroy(&config->handshake_slab);
+  bud_slab_destroy(&config->http_req_slab);
+  bud_slab_destroy(&config->http_conn_slab);
+  bud_slab_destroy(&config->master_msg_slab);
+  ringbuffer_pool_destroy(&config->buffer_pool);
+  ringbuffer_pool_destroy(&config->frontend_pool);
+  ringbuffer_pool_destroy(&config->backend_pool);
+  bud_session_cache_free(config);
+  bud_shared_cache_free(config);
+  bud_snapshot_free(config);
+  bud_disk_cache_free(config);
+  bud_ticket_free(config);
+  bud_affinity_free(config);
+  bud_backends_free(config);
+  free(config->workers);
+  config->workers = NULL;
+  free(config->listeners);
+  config->listeners = NULL;
+
+  if (config->logger != NULL)
+    bud_logger_free(config);
+  config->logger = NULL;
+
+  bud_arena_destroy(&config->arena);
+  free(config);
+}
+
+
+void bud_context_free(bud_context_t* context) {
+  SSL_CTX_free(context->ctx);
+  if (context->cert != NULL)
+    X509_free(context->cert);
+  if (context->issuer != NULL)
+    X509_free(context->issuer);
+  if (context->ocsp_id != NULL)
+    OCSP_CERTID_free(context->ocsp_id);
+  if (context->ocsp_der_id != NULL)
+    free(context->ocsp_der_id);
+  bud_http_body_unref(context->ocsp_req);
+  bud_http_body_unref(context->ocsp_body);
+  if (context->npn_line != NULL && --context->npn_line->refcount == 0) {
+    QUEUE_REMOVE(&context->npn_line->member);
+    free(context->npn_line);
+  }
+  if (context->staple_req != NULL)
+    bud_http_request_cancel(context->staple_req);
+  if (context->staple_lookup != NULL)
+    bud_lookup_cancel(context->staple_lookup);
+  free(context->staple);
+  bud_verify_context_free(context);
+  context->ctx = NULL;
+  context->cert = NULL;
+  context->issuer = NULL;
+  context->npn_line = NULL;
+  context->ocsp_id = NULL;
+  context->ocsp_der_id = NULL;
+  context->ocsp_req = NULL;
+  context->ocsp_body = NULL;
+  context->staple_req = NULL;
+  context->staple_lookup = NULL;
+  context->staple = NULL;
+}
+
+
+void bud_print_help(int argc, char** argv) {
+  ASSERT(argc >= 1, "Not enough arguments");
+  fprintf(stdout, "Usage: %s [options]\n\n", argv[0]);
+  fprintf(stdout, "options:\n");
+  fprintf(stdout, "  --version, -v              Print bud version\n");
+  fprintf(stdout, "  --config PATH, -c PATH     Load JSON configuration\n");
+  fprintf(stdout, "  --default-config           Print default JSON config\n");
+#ifndef _WIN32
+  fprintf(stdout, "  --daemon, -d               Daemonize process\n");
+#endif  /* !_WIN32 */
+  fprintf(stdout, "\n");
+}
+
+
+void bud_print_version() {
+  fprintf(stdout, "v%d.%d\n", BUD_VERSION_MAJOR, BUD_VERSION_MINOR);
+}
+
+
+void bud_config_print_default() {
+  bud_config_t config;
+
+  memset(&config, 0, sizeof(config));
+
+  /* Set zero-y values */
+  config.worker_count = -1;
+  config.workers_membind = -1;
+  config.busy_poll.spin = -1;
+  config.busy_poll.sockets = -1;
+  config.spare_count = -1;
+  config.autoscale.max = -1;
+  config.autoscale.lag = -1;
+  config.autoscale.cpu = -1;
+  config.autoscale.interval = -1;
+  config.autoscale.warmup = -1;
+  config.watchdog.misses = -1;
+  config.watchdog.grace = -1;
+  config.log.stdio = -1;
+  config.log.syslog = -1;
+  config.log.async = -1;
+  config.log.queue = -1;
+  config.log.limit = -1;
+  config.log.access = -1;
+  config.log.trace.sample = -1;
+  config.log.trace.slow = -1;
+  config.log.capture.sample = -1;
+  config.metrics.timing = -1;
+  config.metrics.breakdown = -1;
+  config.metrics.tcp_info.enabled = -1;
+  config.metrics.tcp_info.interval = -1;
+  config.pool.lazy_buffers = -1;
+  config.pool.low_watermark = -1;
+  config.pool.high_watermark = -1;
+  config.pool.budget = -1;
+  config.pool.trim_idle = -1;
+  config.pool.teardown_budget = -1;
+  config.pool.ssl_objects = -1;
+  config.pool.reserve = -1;
+  config.pool.huge_pages = -1;
+  config.frontend.ipv6only = -1;
+  config.frontend.accept_proxyline = -1;
+  config.frontend.passthrough = -1;
+  config.frontend.keepalive = -1;
+  config.frontend.reuseport = -1;
+  config.frontend.shared_listen = -1;
+  config.frontend.backlog = -1;
+  config.frontend.defer_accept = -1;
+  config.frontend.fastopen = -1;
+  config.frontend.accept_limit = -1;
+  config.frontend.handshake_limit = -1;
+  config.frontend.max_handshakes = -1;
+  config.frontend.handshake_queue = -1;
+  config.frontend.cycle_budget = -1;
+  config.frontend.flush_interactive = -1;
+  config.frontend.flush_budget = -1;
+  config.frontend.io_uring = -1;
+  config.frontend.max_clients = -1;
+  config.frontend.max_lag = -1;
+  config.frontend.shed_idle = -1;
+  config.frontend.ssl3 = -1;
+  config.frontend.prioritize_chacha = -1;
+  config.frontend.cork_handshake = -1;
+  config.frontend.release_buffers = -1;
+  config.frontend.max_send_fragment = -1;
+  config.frontend.strict_sni = -1;
+  config.frontend.http_redirect = -1;
+  config.frontend.cert_compression = -1;
+  config.frontend.zerocopy = -1;
+  config.frontend.early_data = -1;
+  config.frontend.ticket_rotate = -1;
+  config.frontend.ticket_previous = -1;
+  config.frontend.coalesce.size = -1;
+  config.frontend.coalesce.delay = -1;
+  config.frontend.record.initial = -1;
+  config.frontend.record.boost_after = -1;
+  config.frontend.record.idle_reset = -1;
+  config.frontend.rate_limit.rate = -1;
+  config.frontend.rate_limit.burst = -1;
+  config.frontend.rate_limit.size = -1;
+  config.frontend.fingerprint.flood = -1;
+  config.frontend.fingerprint.share = -1;
+  config.frontend.fingerprint.ttl = -1;
+  config.frontend.bandwidth.connection = -1;
+  config.frontend.bandwidth.context = -1;
+  config.frontend.bandwidth.burst = -1;
+  config.frontend.quota.connections = -1;
+  config.frontend.quota.handshakes = -1;
+  config.frontend.timeout.handshake = -1;
+  config.frontend.timeout.idle = -1;
+  config.frontend.timeout.write = -1;
+  config.backend.keepalive = -1;
+  config.backend.health.interval = -1;
+  config.backend.health.max_fails = -1;
+  config.backend.health.fail_timeout = -1;
+  config.backend.pool.idle_timeout = -1;
+  config.backend.tls.enabled = -1;
+  config.backend.tls.session_reuse = -1;
+  config.backend.ewma_decay = -1;
+  config.backend.lazy_connect = -1;
+  config.backend.fastopen = -1;
+  config.backend.resolve_interval = -1;
+  config.backend.happy_eyeballs = -1;
+  config.backend.server_first = -1;
+  config.backend.http_reuse = -1;
+  config.backend.xforward = -1;
+  config.backend.buffer_request.enabled = -1;
+  config.backend.buffer_request.body = -1;
+  config.backend.spill.max = -1;
+  config.restart_timeout = -1;
+  config.drain_timeout = -1;
+  config.drain_handoff = -1;
+  config.load_threads = -1;
+  config.snapshot_enabled = -1;
+  config.thread_count = -1;
+  config.session_cache.enabled = -1;
+  config.lazy_contexts.enabled = -1;
+  config.shared_cache.enabled = -1;
+  config.disk_cache.enabled = -1;
+  config.sni.cache.size = -1;
+  config.sni.cache.ttl = -1;
+  config.sni.cache.negative_ttl = -1;
+  config.sni.cache.stale_ttl = -1;
+  config.sni.cache.certs = -1;
+  bud_config_init_pool_limits(&config.sni);
+  bud_config_init_pool_limits(&config.stapling);
+  bud_config_init_pool_limits(&config.session);
+  bud_config_init_pool_limits(&config.crl);
+  config.verify_cache.size = -1;
+  config.verify_cache.ttl = -1;
+  config.verify_cache.crl_refresh = -1;
+
+  bud_config_set_defaults(&config);
+
+  fprintf(stdout, "{\n");
+  fprintf(stdout, "  \"daemon\": false,\n");
+  fprintf(stdout, "  \"workers\": %d,\n", config.worker_count);
+  fprintf(stdout, "  \"workers_affinity\": null,\n");
+  fprintf(stdout,
+          "  \"workers_membind\": %s,\n",
+          config.workers_membind ? "true" : "false");
+  fprintf(stdout, "  \"busy_poll\": {\n");
+  fprintf(stdout, "    \"spin\": %d,\n", config.busy_poll.spin);
+  fprintf(stdout, "    \"sockets\": %d\n", config.busy_poll.sockets);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout,
+          "  \"workers_balance\": \"%s\",\n",
+          config.workers_balance);
+  fprintf(stdout, "  \"workers_spare\": %d,\n", config.spare_count);
+  fprintf(stdout, "  \"workers_autoscale\": {\n");
+  fprintf(stdout, "    \"max\": %d,\n", config.autoscale.max);
+  fprintf(stdout, "    \"lag\": %d,\n", config.autoscale.lag);
+  fprintf(stdout, "    \"cpu\": %d,\n", config.autoscale.cpu);
+  fprintf(stdout, "    \"interval\": %d,\n", config.autoscale.interval);
+  fprintf(stdout, "    \"warmup\": %d\n", config.autoscale.warmup);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"workers_watchdog\": {\n");
+  fprintf(stdout, "    \"misses\": %d,\n", config.watchdog.misses);
+  fprintf(stdout, "    \"grace\": %d\n", config.watchdog.grace);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"restart_timeout\": %d,\n", config.restart_timeout);
+  fprintf(stdout, "  \"drain_timeout\": %d,\n", config.drain_timeout);
+  fprintf(stdout,
+          "  \"drain_handoff\": %s,\n",
+          config.drain_handoff ? "true" : "false");
+  fprintf(stdout, "  \"load_threads\": %d,\n", config.load_threads);
+  fprintf(stdout,
+          "  \"snapshot\": %s,\n",
+          config.snapshot_enabled ? "true" : "false");
+  fprintf(stdout, "  \"threads\": %d,\n", config.thread_count);
+  fprintf(stdout, "  \"log\": {\n");
+  fprintf(stdout, "    \"level\": \"%s\",\n", config.log.level);
+  fprintf(stdout, "    \"facility\": \"%s\",\n", config.log.facility);
+  fprintf(stdout,
+          "    \"stdio\": %s,\n",
+          config.log.stdio ? "true" : "false");
+  fprintf(stdout,
+          "    \"syslog\": %s,\n",
+          config.log.syslog ? "true" : "false");
+  fprintf(stdout,
+          "    \"async\": %s,\n",
+          config.log.async ? "true" : "false");
+  fprintf(stdout, "    \"queue\": %d,\n", config.log.queue);
+  fprintf(stdout, "    \"limit\": %d,\n", config.log.limit);
+  fprintf(stdout,
+          "    \"access\": %s,\n",
+          config.log.access ? "true" : "false");
+  fprintf(stdout, "    \"trace\": {\n");
+  fprintf(stdout, "      \"sample\": %d,\n", config.log.trace.sample);
+  fprintf(stdout, "      \"slow\": %d\n", config.log.trace.slow);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"capture\": {\n");
+  fprintf(stdout, "      \"path\": null,\n");
+  fprintf(stdout, "      \"sample\": %d\n", config.log.capture.sample);
+  fprintf(stdout, "    }\n");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"metrics\": {\n");
+  fprintf(stdout, "    \"port\": %d,\n", config.metrics.port);
+  fprintf(stdout, "    \"host\": \"%s\",\n", config.metrics.host);
+  fprintf(stdout,
+          "    \"timing\": %s,\n",
+          config.metrics.timing ? "true" : "false");
+  fprintf(stdout, "    \"breakdown\": %d,\n", config.metrics.breakdown);
+  fprintf(stdout, "    \"tcp_info\": {\n");
+  fprintf(stdout,
+          "      \"enabled\": %s,\n",
+          config.metrics.tcp_info.enabled ? "true" : "false");
+  fprintf(stdout,
+          "      \"interval\": %d\n",
+          config.metrics.tcp_info.interval);
+  fprintf(stdout, "    }\n");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"admin\": {\n");
+  fprintf(stdout, "    \"path\": null\n");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"pool\": {\n");
+  fprintf(stdout,
+          "    \"lazy_buffers\": %s,\n",
+          config.pool.lazy_buffers ? "true" : "false");
+  fprintf(stdout,
+          "    \"low_watermark\": %d,\n",
+          config.pool.low_watermark);
+  fprintf(stdout,
+          "    \"high_watermark\": %d,\n",
+          config.pool.high_watermark);
+  fprintf(stdout, "    \"budget\": %d,\n", config.pool.budget);
+  fprintf(stdout, "    \"trim_idle\": %d,\n", config.pool.trim_idle);
+  fprintf(stdout,
+          "    \"teardown_budget\": %d,\n",
+          config.pool.teardown_budget);
+  fprintf(stdout, "    \"ssl_objects\": %d,\n", config.pool.ssl_objects);
+  fprintf(stdout, "    \"reserve\": %d,\n", config.pool.reserve);
+  fprintf(stdout,
+          "    \"huge_pages\": %s\n",
+          config.pool.huge_pages ? "true" : "false");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"frontend\": {\n");
+  fprintf(stdout, "    \"port\": %d,\n", config.frontend.port);
+  fprintf(stdout, "    \"host\": \"%s\",\n", config.frontend.host);
+  fprintf(stdout,
+          "    \"ipv6only\": %s,\n",
+          config.frontend.ipv6only ? "true" : "false");
+  fprintf(stdout, "    \"keepalive\": %d,\n", config.frontend.keepalive);
   fprintf(stdout, "    \"proxyline\": false,\n");
+  fprintf(stdout,
+          "    \"accept_proxyline\": %s,\n",
+          config.frontend.accept_proxyline ? "true" : "false");
+  fprintf(stdout,
+          "    \"passthrough\": %s,\n",
+          config.frontend.passthrough ? "true" : "false");
+  fprintf(stdout,
+          "    \"reuseport\": %s,\n",
+          config.frontend.reuseport ? "true" : "false");
+  fprintf(stdout,
+          "    \"shared_listen\": %s,\n",
+          config.frontend.shared_listen ? "true" : "false");
+  fprintf(stdout, "    \"backlog\": %d,\n", config.frontend.backlog);
+  fprintf(stdout,
+          "    \"defer_accept\": %d,\n",
+          config.frontend.defer_accept);
+  fprintf(stdout, "    \"fastopen\": %d,\n", config.frontend.fastopen);
+  fprintf(stdout,
+          "    \"accept_limit\": %d,\n",
+          config.frontend.accept_limit);
+  fprintf(stdout,
+          "    \"handshake_limit\": %d,\n",
+          config.frontend.handshake_limit);
+  fprintf(stdout,
+          "    \"max_handshakes\": %d,\n",
+          config.frontend.max_handshakes);
+  fprintf(stdout,
+          "    \"handshake_queue\": %d,\n",
+          config.frontend.handshake_queue);
+  fprintf(stdout,
+          "    \"cycle_budget\": %d,\n",
+          config.frontend.cycle_budget);
+  fprintf(stdout,
+          "    \"flush_interactive\": %d,\n",
+          config.frontend.flush_interactive);
+  fprintf(stdout,
+          "    \"flush_budget\": %d,\n",
+          config.frontend.flush_budget);
+  fprintf(stdout,
+          "    \"io_uring\": %s,\n",
+          config.frontend.io_uring ? "true" : "false");
+  fprintf(stdout,
+          "    \"max_clients\": %d,\n",
+          config.frontend.max_clients);
+  fprintf(stdout,
+          "    \"shed_idle\": %s,\n",
+          config.frontend.shed_idle ? "true" : "false");
+  fprintf(stdout, "    \"max_lag\": %d,\n", config.frontend.max_lag);
   fprintf(stdout, "    \"security\": \"%s\",\n", config.frontend.security);
   fprintf(stdout, "    \"server_preference\": true,\n");
+  fprintf(stdout,
+          "    \"prioritize_chacha\": %s,\n",
+          config.frontend.prioritize_chacha ? "true" : "false");
+  fprintf(stdout,
+          "    \"cork_handshake\": %s,\n",
+          config.frontend.cork_handshake ? "true" : "false");
+  fprintf(stdout,
+          "    \"release_buffers\": %s,\n",
+          config.frontend.release_buffers ? "true" : "false");
+  fprintf(stdout,
+          "    \"max_send_fragment\": %d,\n",
+          config.frontend.max_send_fragment);
+  fprintf(stdout,
+          "    \"strict_sni\": %s,\n",
+          config.frontend.strict_sni ? "true" : "false");
+  fprintf(stdout,
+          "    \"http_redirect\": %s,\n",
+          config.frontend.http_redirect ? "true" : "false");
+  fprintf(stdout,
+          "    \"cert_compression\": %s,\n",
+          config.frontend.cert_compression ? "true" : "false");
+  fprintf(stdout, "    \"zerocopy\": %d,\n", config.frontend.zerocopy);
   if (config.frontend.ssl3)
     fprintf(stdout, "    \"ssl3\": true,\n");
   else
     fprintf(stdout, "    \"ssl3\": false,\n");
+  fprintf(stdout,
+          "    \"early_data\": %d,\n",
+          config.frontend.early_data);
 #ifdef OPENSSL_NPN_NEGOTIATED
   /* Sorry, hard-coded */
   fprintf(stdout, "    \"npn\": [\"http/1.1\", \"http/1.0\"],\n");
@@ -469,31 +2195,295 @@ void bud_config_print_default() {
     fprintf(stdout, "    \"ecdh\": \"%s\",\n", config.frontend.ecdh);
   else
     fprintf(stdout, "    \"ecdh\": null,\n");
+  fprintf(stdout,
+          "    \"verify_client\": \"%s\",\n",
+          config.frontend.verify_client);
+  fprintf(stdout, "    \"client_ca\": null,\n");
   fprintf(stdout, "    \"cert\": \"%s\",\n", config.frontend.cert_file);
   fprintf(stdout, "    \"key\": \"%s\",\n", config.frontend.key_file);
   fprintf(stdout, "    \"reneg_window\": %d,\n", config.frontend.reneg_window);
-  fprintf(stdout, "    \"reneg_limit\": %d\n", config.frontend.reneg_limit);
+  fprintf(stdout, "    \"reneg_limit\": %d,\n", config.frontend.reneg_limit);
+  fprintf(stdout, "    \"ticket_key\": null,\n");
+  fprintf(stdout, "    \"ticket_key_file\": null,\n");
+  fprintf(stdout,
+          "    \"ticket_rotate\": %d,\n",
+          config.frontend.ticket_rotate);
+  fprintf(stdout,
+          "    \"ticket_previous\": %d,\n",
+          config.frontend.ticket_previous);
+  fprintf(stdout, "    \"buffer\": {\n");
+  fprintf(stdout,
+          "      \"chunk_size\": %d,\n",
+          config.frontend.buffer.chunk_size);
+  fprintf(stdout,
+          "      \"chunk_count\": %d,\n",
+          config.frontend.buffer.chunk_count);
+  fprintf(stdout,
+          "      \"bulk_count\": %d,\n",
+          config.frontend.buffer.bulk_count);
+  fprintf(stdout,
+          "      \"high_watermark\": %d,\n",
+          config.frontend.buffer.high_watermark);
+  fprintf(stdout,
+          "      \"low_watermark\": %d,\n",
+          config.frontend.buffer.low_watermark);
+  fprintf(stdout,
+          "      \"mirror\": %s,\n",
+          config.frontend.buffer.mirror ? "true" : "false");
+  fprintf(stdout, "      \"sndbuf\": 0,\n");
+  fprintf(stdout, "      \"rcvbuf\": 0,\n");
+  fprintf(stdout, "      \"notsent_lowat\": 0\n");
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"coalesce\": {\n");
+  fprintf(stdout,
+          "      \"size\": %d,\n",
+          config.frontend.coalesce.size);
+  fprintf(stdout,
+          "      \"delay\": %d\n",
+          config.frontend.coalesce.delay);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"record\": {\n");
+  fprintf(stdout,
+          "      \"initial\": %d,\n",
+          config.frontend.record.initial);
+  fprintf(stdout,
+          "      \"boost_after\": %d,\n",
+          config.frontend.record.boost_after);
+  fprintf(stdout,
+          "      \"idle_reset\": %d\n",
+          config.frontend.record.idle_reset);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"rate_limit\": {\n");
+  fprintf(stdout,
+          "      \"rate\": %d,\n",
+          config.frontend.rate_limit.rate);
+  fprintf(stdout,
+          "      \"burst\": %d,\n",
+          config.frontend.rate_limit.burst);
+  fprintf(stdout,
+          "      \"size\": %d,\n",
+          config.frontend.rate_limit.size);
+  fprintf(stdout, "      \"shared\": null\n");
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"access\": {\n");
+  fprintf(stdout, "      \"allow\": null,\n");
+  fprintf(stdout, "      \"deny\": null\n");
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"fingerprint\": {\n");
+  fprintf(stdout, "      \"deny\": null,\n");
+  fprintf(stdout,
+          "      \"flood\": %d,\n",
+          config.frontend.fingerprint.flood);
+  fprintf(stdout,
+          "      \"share\": %d,\n",
+          config.frontend.fingerprint.share);
+  fprintf(stdout,
+          "      \"ttl\": %d\n",
+          config.frontend.fingerprint.ttl);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"bandwidth\": {\n");
+  fprintf(stdout,
+          "      \"connection\": %d,\n",
+          config.frontend.bandwidth.connection);
+  fprintf(stdout,
+          "      \"context\": %d,\n",
+          config.frontend.bandwidth.context);
+  fprintf(stdout,
+          "      \"burst\": %d\n",
+          config.frontend.bandwidth.burst);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"quota\": {\n");
+  fprintf(stdout,
+          "      \"connections\": %d,\n",
+          config.frontend.quota.connections);
+  fprintf(stdout,
+          "      \"handshakes\": %d\n",
+          config.frontend.quota.handshakes);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"timeout\": {\n");
+  fprintf(stdout,
+          "      \"handshake\": %d,\n",
+          config.frontend.timeout.handshake);
+  fprintf(stdout,
+          "      \"idle\": %d,\n",
+          config.frontend.timeout.idle);
+  fprintf(stdout,
+          "      \"write\": %d\n",
+          config.frontend.timeout.write);
+  fprintf(stdout, "    }\n");
   fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"frontends\": [],\n");
   fprintf(stdout, "  \"backend\": {\n");
   fprintf(stdout, "    \"port\": %d,\n", config.backend.port);
   fprintf(stdout, "    \"host\": \"%s\",\n", config.backend.host);
-  fprintf(stdout, "    \"keepalive\": %d\n", config.backend.keepalive);
-  fprintf(stdout, "  },\n");
-  fprintf(stdout, "  \"sni\": {\n");
-  fprintf(stdout, "    \"enabled\": false,\n");
-  fprintf(stdout, "    \"port\": %d,\n", config.sni.port);
-  fprintf(stdout, "    \"host\": \"%s\",\n", config.sni.host);
-  fprintf(stdout, "    \"query\": \"%s\"\n", config.sni.query_fmt);
-  fprintf(stdout, "  },\n");
-  fprintf(stdout, "  \"stapling\": {\n");
-  fprintf(stdout, "    \"enabled\": false,\n");
-  fprintf(stdout, "    \"port\": %d,\n", config.stapling.port);
-  fprintf(stdout, "    \"host\": \"%s\",\n", config.stapling.host);
-  fprintf(stdout, "    \"query\": \"%s\"\n", config.stapling.query_fmt);
-  fprintf(stdout, "  },\n");
-  fprintf(stdout, "  \"contexts\": []\n");
-  fprintf(stdout, "}\n");
-}
+  fprintf(stdout, "    \"keepalive\": %d,\n", config.backend.keepalive);
+  fprintf(stdout, "    \"balance\": \"%s\",\n", config.backend.balance);
+  fprintf(stdout, "    \"ewma_decay\": %d,\n", config.backend.ewma_decay);
+  fprintf(stdout,
+          "    \"lazy_connect\": %s,\n",
+          config.backend.lazy_connect ? "true" : "false");
+  fprintf(stdout,
+          "    \"fastopen\": %s,\n",
+          config.backend.fastopen ? "true" : "false");
+  fprintf(stdout,
+          "    \"resolve_interval\": %d,\n",
+          config.backend.resolve_interval);
+  fprintf(stdout,
+          "    \"happy_eyeballs\": %d,\n",
+          config.backend.happy_eyeballs);
+  fprintf(stdout,
+          "    \"server_first\": %s,\n",
+          config.backend.server_first ? "true" : "false");
+  fprintf(stdout,
+          "    \"http_reuse\": %s,\n",
+          config.backend.http_reuse ? "true" : "false");
+  fprintf(stdout,
+          "    \"xforward\": %s,\n",
+          config.backend.xforward ? "true" : "false");
+  fprintf(stdout, "    \"buffer_request\": {\n");
+  fprintf(stdout,
+          "      \"enabled\": %s,\n",
+          config.backend.buffer_request.enabled ? "true" : "false");
+  fprintf(stdout,
+          "      \"body\": %d\n",
+          config.backend.buffer_request.body);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"spill\": {\n");
+  fprintf(stdout, "      \"dir\": null,\n");
+  fprintf(stdout, "      \"max\": %d\n", config.backend.spill.max);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"health_check\": {\n");
+  fprintf(stdout,
+          "      \"interval\": %d,\n",
+          config.backend.health.interval);
+  fprintf(stdout,
+          "      \"max_fails\": %d,\n",
+          config.backend.health.max_fails);
+  fprintf(stdout,
+          "      \"fail_timeout\": %d,\n",
+          config.backend.health.fail_timeout);
+  fprintf(stdout, "      \"fail_fast\": false\n");
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"pool\": {\n");
+  fprintf(stdout, "      \"min_idle\": %d,\n", config.backend.pool.min_idle);
+  fprintf(stdout, "      \"max_idle\": %d,\n", config.backend.pool.max_idle);
+  fprintf(stdout,
+          "      \"idle_timeout\": %d\n",
+          config.backend.pool.idle_timeout);
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"tls\": {\n");
+  fprintf(stdout,
+          "      \"enabled\": %s,\n",
+          config.backend.tls.enabled ? "true" : "false");
+  fprintf(stdout, "      \"servername\": null,\n");
+  fprintf(stdout, "      \"ciphers\": null,\n");
+  fprintf(stdout, "      \"ca\": null,\n");
+  fprintf(stdout,
+          "      \"session_reuse\": %s\n",
+          config.backend.tls.session_reuse ? "true" : "false");
+  fprintf(stdout, "    },\n");
+  fprintf(stdout, "    \"buffer\": {\n");
+  fprintf(stdout,
+          "      \"chunk_size\": %d,\n",
+          config.backend.buffer.chunk_size);
+  fprintf(stdout,
+          "      \"chunk_count\": %d,\n",
+          config.backend.buffer.chunk_count);
+  fprintf(stdout,
+          "      \"bulk_count\": %d,\n",
+          config.backend.buffer.bulk_count);
+  fprintf(stdout,
+          "      \"high_watermark\": %d,\n",
+          config.backend.buffer.high_watermark);
+  fprintf(stdout,
+          "      \"low_watermark\": %d,\n",
+          config.backend.buffer.low_watermark);
+  fprintf(stdout,
+          "      \"mirror\": %s,\n",
+          config.backend.buffer.mirror ? "true" : "false");
+  fprintf(stdout, "      \"sndbuf\": 0,\n");
+  fprintf(stdout, "      \"rcvbuf\": 0,\n");
+  fprintf(stdout, "      \"notsent_lowat\": 0\n");
+  fprintf(stdout, "    }\n");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"backends\": [],\n");
+  fprintf(stdout, "  \"h2_backends\": [],\n");
+  fprintf(stdout, "  \"sni\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout, "    \"port\": %d,\n", config.sni.port);
+  fprintf(stdout, "    \"host\": \"%s\",\n", config.sni.host);
+  fprintf(stdout, "    \"query\": \"%s\",\n", config.sni.query_fmt);
+  fprintf(stdout, "    \"directory\": null,\n");
+  fprintf(stdout, "    \"binary\": false,\n");
+  bud_config_print_pool_limits(&config.sni, ",");
+  fprintf(stdout, "    \"cache\": {\n");
+  fprintf(stdout, "      \"size\": %d,\n", config.sni.cache.size);
+  fprintf(stdout, "      \"ttl\": %d,\n", config.sni.cache.ttl);
+  fprintf(stdout,
+          "      \"negative_ttl\": %d,\n",
+          config.sni.cache.negative_ttl);
+  fprintf(stdout,
+          "      \"stale_ttl\": %d,\n",
+          config.sni.cache.stale_ttl);
+  fprintf(stdout, "      \"certs\": %d\n", config.sni.cache.certs);
+  fprintf(stdout, "    }\n");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"stapling\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout, "    \"port\": %d,\n", config.stapling.port);
+  fprintf(stdout, "    \"host\": \"%s\",\n", config.stapling.host);
+  fprintf(stdout, "    \"query\": \"%s\",\n", config.stapling.query_fmt);
+  fprintf(stdout, "    \"binary\": false,\n");
+  bud_config_print_pool_limits(&config.stapling, ",");
+  fprintf(stdout, "    \"direct\": false\n");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"session\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout, "    \"port\": %d,\n", config.session.port);
+  fprintf(stdout, "    \"host\": \"%s\",\n", config.session.host);
+  fprintf(stdout, "    \"query\": \"%s\",\n", config.session.query_fmt);
+  bud_config_print_pool_limits(&config.session, "");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"crl\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout, "    \"port\": %d,\n", config.crl.port);
+  fprintf(stdout, "    \"host\": \"%s\",\n", config.crl.host);
+  fprintf(stdout, "    \"query\": \"%s\",\n", config.crl.query_fmt);
+  bud_config_print_pool_limits(&config.crl, "");
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"session_cache\": {\n");
+  fprintf(stdout,
+          "    \"enabled\": %s,\n",
+          config.session_cache.enabled ? "true" : "false");
+  fprintf(stdout, "    \"size\": %d,\n", config.session_cache.size);
+  fprintf(stdout, "    \"timeout\": %d\n", config.session_cache.timeout);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"verify_cache\": {\n");
+  fprintf(stdout, "    \"size\": %d,\n", config.verify_cache.size);
+  fprintf(stdout, "    \"ttl\": %d,\n", config.verify_cache.ttl);
+  fprintf(stdout,
+          "    \"crl_refresh\": %d\n",
+          config.verify_cache.crl_refresh);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"lazy_contexts\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout,
+          "    \"idle_timeout\": %d\n",
+          config.lazy_contexts.idle_timeout);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"shared_cache\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout, "    \"size\": %d\n", config.shared_cache.size);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"disk_cache\": {\n");
+  fprintf(stdout, "    \"enabled\": false,\n");
+  fprintf(stdout, "    \"path\": null,\n");
+  fprintf(stdout, "    \"size\": %d\n", config.disk_cache.size);
+  fprintf(stdout, "  },\n");
+  fprintf(stdout, "  \"engine\": null,\n");
+  fprintf(stdout, "  \"contexts\": []\n");
+  fprintf(stdout, "}\n");
+}
 
 
 #define DEFAULT(param, null, value)                                           \
@@ -503,459 +2493,1960 @@ void bud_config_print_default() {
     } while (0)
 
 void bud_config_set_defaults(bud_config_t* config) {
+  int i;
+  bud_config_listener_t* listener;
+
   DEFAULT(config->worker_count, -1, 1);
+  DEFAULT(config->workers_membind, -1, 0);
+  DEFAULT(config->busy_poll.spin, -1, 0);
+  DEFAULT(config->busy_poll.sockets, -1, 0);
+  DEFAULT(config->workers_balance, NULL, "leastload");
+  DEFAULT(config->spare_count, -1, 0);
+  DEFAULT(config->autoscale.max, -1, 0);
+  DEFAULT(config->autoscale.lag, -1, 50);
+  DEFAULT(config->autoscale.cpu, -1, 0);
+  DEFAULT(config->autoscale.interval, -1, 10000);
+  DEFAULT(config->autoscale.warmup, -1, 30000);
+  DEFAULT(config->watchdog.misses, -1, 5);
+  DEFAULT(config->watchdog.grace, -1, 30000);
   DEFAULT(config->restart_timeout, -1, 250);
+  DEFAULT(config->drain_timeout, -1, 60000);
+  DEFAULT(config->drain_handoff, -1, 0);
+  DEFAULT(config->load_threads, -1, 0);
+  DEFAULT(config->snapshot_enabled, -1, 0);
+  DEFAULT(config->thread_count, -1, 1);
   DEFAULT(config->log.level, NULL, "info");
   DEFAULT(config->log.facility, NULL, "user");
   DEFAULT(config->log.stdio, -1, 1);
   DEFAULT(config->log.syslog, -1, 0);
+  DEFAULT(config->log.async, -1, 0);
+  DEFAULT(config->log.queue, -1, 256);
+  DEFAULT(config->log.limit, -1, 0);
+  DEFAULT(config->log.access, -1, 0);
+  DEFAULT(config->log.trace.sample, -1, 0);
+  DEFAULT(config->log.trace.slow, -1, 0);
+  DEFAULT(config->log.capture.sample, -1, 1);
+  DEFAULT(config->metrics.host, NULL, "127.0.0.1");
+  DEFAULT(config->metrics.timing, -1, 0);
+  DEFAULT(config->metrics.breakdown, -1, 0);
+  DEFAULT(config->metrics.tcp_info.enabled, -1, 0);
+  DEFAULT(config->metrics.tcp_info.interval, -1, 60000);
+  DEFAULT(config->pool.lazy_buffers, -1, 0);
+  DEFAULT(config->pool.low_watermark, -1, 256);
+  DEFAULT(config->pool.high_watermark, -1, 1024);
+  DEFAULT(config->pool.budget, -1, 0);
+  DEFAULT(config->pool.trim_idle, -1, 10000);
+  DEFAULT(config->pool.teardown_budget, -1, 0);
+  DEFAULT(config->pool.ssl_objects, -1, 0);
+  DEFAULT(config->pool.reserve, -1, 0);
+  DEFAULT(config->pool.huge_pages, -1, 0);
   DEFAULT(config->frontend.port, 0, 1443);
   DEFAULT(config->frontend.host, NULL, "0.0.0.0");
+  DEFAULT(config->frontend.ipv6only, -1, 0);
   DEFAULT(config->frontend.proxyline, -1, 0);
+  DEFAULT(config->frontend.accept_proxyline, -1, 0);
+  DEFAULT(config->frontend.passthrough, -1, 0);
   DEFAULT(config->frontend.security, NULL, "ssl23");
   DEFAULT(config->frontend.ecdh, NULL, "prime256v1");
+  DEFAULT(config->frontend.verify_client, NULL, "none");
   DEFAULT(config->frontend.keepalive, -1, 3600);
+  DEFAULT(config->frontend.reuseport, -1, 0);
+  DEFAULT(config->frontend.shared_listen, -1, 0);
+  DEFAULT(config->frontend.backlog, -1, 256);
+  DEFAULT(config->frontend.defer_accept, -1, 0);
+  DEFAULT(config->frontend.fastopen, -1, 0);
+  DEFAULT(config->frontend.accept_limit, -1, 64);
+  DEFAULT(config->frontend.handshake_limit, -1, 0);
+  DEFAULT(config->frontend.max_handshakes, -1, 0);
+  DEFAULT(config->frontend.handshake_queue, -1, 256);
+  DEFAULT(config->frontend.cycle_budget, -1, 0);
+  DEFAULT(config->frontend.flush_interactive, -1, 65536);
+  DEFAULT(config->frontend.flush_budget, -1, 0);
+  DEFAULT(config->frontend.io_uring, -1, 0);
+  DEFAULT(config->frontend.max_clients, -1, 0);
+  DEFAULT(config->frontend.max_lag, -1, 0);
+  DEFAULT(config->frontend.shed_idle, -1, 0);
   DEFAULT(config->frontend.server_preference, -1, 1);
+  DEFAULT(config->frontend.prioritize_chacha, -1, 0);
+  DEFAULT(config->frontend.cork_handshake, -1, 0);
+  DEFAULT(config->frontend.release_buffers, -1, 1);
+  DEFAULT(config->frontend.max_send_fragment, -1, 0);
+  for (i = 0; i < config->context_count + 1; i++) {
+    DEFAULT(config->contexts[i].release_buffers,
+            -1,
+            config->frontend.release_buffers);
+    DEFAULT(config->contexts[i].max_send_fragment,
+            -1,
+            config->frontend.max_send_fragment);
+  }
+  DEFAULT(config->frontend.strict_sni, -1, 0);
+  DEFAULT(config->frontend.http_redirect, -1, 0);
+  DEFAULT(config->frontend.cert_compression, -1, 0);
+  DEFAULT(config->frontend.zerocopy, -1, 0);
   DEFAULT(config->frontend.ssl3, -1, 0);
+  DEFAULT(config->frontend.early_data, -1, 0);
   DEFAULT(config->frontend.cert_file, NULL, "keys/cert.pem");
   DEFAULT(config->frontend.key_file, NULL, "keys/key.pem");
   DEFAULT(config->frontend.reneg_window, 0, 600);
   DEFAULT(config->frontend.reneg_limit, 0, 3);
+  DEFAULT(config->frontend.ticket_rotate, -1, 43200);
+  DEFAULT(config->frontend.ticket_previous, -1, 2);
+  DEFAULT(config->frontend.buffer.chunk_size, 0, RING_BUFFER_LEN);
+  DEFAULT(config->frontend.buffer.chunk_count, 0, RING_BUFFER_COUNT);
+  DEFAULT(config->frontend.buffer.high_watermark,
+          0,
+          config->frontend.buffer.chunk_size *
+              config->frontend.buffer.chunk_count);
+  DEFAULT(config->frontend.buffer.low_watermark,
+          0,
+          config->frontend.buffer.high_watermark / 2);
+  DEFAULT(config->frontend.coalesce.size, -1, 16384);
+  DEFAULT(config->frontend.coalesce.delay, -1, 0);
+  DEFAULT(config->frontend.record.initial, -1, 0);
+  DEFAULT(config->frontend.record.boost_after, -1, 1048576);
+  DEFAULT(config->frontend.record.idle_reset, -1, 1000);
+  DEFAULT(config->frontend.rate_limit.rate, -1, 0);
+  DEFAULT(config->frontend.rate_limit.burst, -1, 20);
+  DEFAULT(config->frontend.rate_limit.size, -1, 65536);
+  DEFAULT(config->frontend.fingerprint.flood, -1, 0);
+  DEFAULT(config->frontend.fingerprint.share, -1, 50);
+  DEFAULT(config->frontend.fingerprint.ttl, -1, 60);
+  DEFAULT(config->frontend.bandwidth.connection, -1, 0);
+  DEFAULT(config->frontend.bandwidth.context, -1, 0);
+  DEFAULT(config->frontend.bandwidth.burst, -1, 262144);
+  for (i = 0; i < config->context_count + 1; i++) {
+    DEFAULT(config->contexts[i].bandwidth,
+            -1,
+            config->frontend.bandwidth.context);
+  }
+  DEFAULT(config->frontend.quota.connections, -1, 0);
+  DEFAULT(config->frontend.quota.handshakes, -1, 0);
+  config->frontend.quota.enabled = config->frontend.quota.connections > 0 ||
+                                   config->frontend.quota.handshakes > 0;
+  for (i = 0; i < config->context_count + 1; i++) {
+    DEFAULT(config->contexts[i].quota.connections,
+            -1,
+            config->frontend.quota.connections);
+    DEFAULT(config->contexts[i].quota.handshakes,
+            -1,
+            config->frontend.quota.handshakes);
+    if (config->contexts[i].quota.connections > 0 ||
+        config->contexts[i].quota.handshakes > 0) {
+      config->frontend.quota.enabled = 1;
+    }
+  }
+  DEFAULT(config->frontend.timeout.handshake, -1, 30000);
+  DEFAULT(config->frontend.timeout.idle, -1, 0);
+  DEFAULT(config->frontend.timeout.write, -1, 60000);
   DEFAULT(config->backend.port, 0, 8000);
   DEFAULT(config->backend.host, NULL, "127.0.0.1");
   DEFAULT(config->backend.keepalive, -1, 3600);
+  DEFAULT(config->backend.balance, NULL, "roundrobin");
+  DEFAULT(config->backend.ewma_decay, -1, 10000);
+  DEFAULT(config->backend.lazy_connect, -1, 0);
+  DEFAULT(config->backend.fastopen, -1, 0);
+  DEFAULT(config->backend.resolve_interval, -1, 30000);
+  DEFAULT(config->backend.happy_eyeballs, -1, 250);
+  DEFAULT(config->backend.server_first, -1, 0);
+  DEFAULT(config->backend.http_reuse, -1, 0);
+  DEFAULT(config->backend.xforward, -1, 0);
+  DEFAULT(config->backend.buffer_request.enabled, -1, 0);
+  DEFAULT(config->backend.buffer_request.body, -1, 0);
+  DEFAULT(config->backend.spill.max, -1, 16777216);
+  DEFAULT(config->backend.health.interval, -1, 0);
+  DEFAULT(config->backend.health.max_fails, -1, 3);
+  DEFAULT(config->backend.health.fail_timeout, -1, 10000);
+  DEFAULT(config->backend.pool.idle_timeout, -1, 30000);
+  DEFAULT(config->backend.tls.enabled, -1, 0);
+  DEFAULT(config->backend.tls.session_reuse, -1, 1);
+  DEFAULT(config->backend.buffer.chunk_size, 0, RING_BUFFER_LEN);
+  DEFAULT(config->backend.buffer.chunk_count, 0, RING_BUFFER_COUNT);
+  DEFAULT(config->backend.buffer.high_watermark,
+          0,
+          config->backend.buffer.chunk_size *
+              config->backend.buffer.chunk_count);
+  DEFAULT(config->backend.buffer.low_watermark,
+          0,
+          config->backend.buffer.high_watermark / 2);
+
+  DEFAULT(config->sni.port, 0, 9000);
+  DEFAULT(config->sni.host, NULL, "127.0.0.1");
+  DEFAULT(config->sni.query_fmt, NULL, "/bud/sni/%s");
+  DEFAULT(config->sni.cache.size, -1, 1024);
+  DEFAULT(config->sni.cache.ttl, -1, 300);
+  DEFAULT(config->sni.cache.negative_ttl, -1, 30);
+  DEFAULT(config->sni.cache.stale_ttl, -1, 60);
+  DEFAULT(config->sni.cache.certs, -1, 4096);
+  DEFAULT(config->sni.binary, -1, 0);
+  bud_config_set_pool_defaults(&config->sni);
+  DEFAULT(config->stapling.port, 0, 9000);
+  DEFAULT(config->stapling.host, NULL, "127.0.0.1");
+  DEFAULT(config->stapling.query_fmt, NULL, "/bud/stapling/%s");
+  DEFAULT(config->stapling.direct, -1, 0);
+  DEFAULT(config->stapling.binary, -1, 0);
+  bud_config_set_pool_defaults(&config->stapling);
+  DEFAULT(config->session.port, 0, 9000);
+  DEFAULT(config->session.host, NULL, "127.0.0.1");
+  DEFAULT(config->session.query_fmt, NULL, "/bud/session/%s");
+  bud_config_set_pool_defaults(&config->session);
+  DEFAULT(config->crl.port, 0, 9000);
+  DEFAULT(config->crl.host, NULL, "127.0.0.1");
+  DEFAULT(config->crl.query_fmt, NULL, "/bud/crl/%s");
+  bud_config_set_pool_defaults(&config->crl);
+  DEFAULT(config->session_cache.enabled, -1, 0);
+  DEFAULT(config->session_cache.size, 0, 4096);
+  DEFAULT(config->session_cache.timeout, 0, 300);
+  DEFAULT(config->verify_cache.size, -1, 4096);
+  DEFAULT(config->verify_cache.ttl, -1, 300);
+  DEFAULT(config->verify_cache.crl_refresh, -1, 3600);
+  DEFAULT(config->lazy_contexts.enabled, -1, 0);
+  DEFAULT(config->lazy_contexts.idle_timeout, 0, 3600);
+  DEFAULT(config->shared_cache.enabled, -1, 0);
+  DEFAULT(config->shared_cache.size, 0, 1024);
+  DEFAULT(config->disk_cache.enabled, -1, 0);
+  DEFAULT(config->disk_cache.size, 0, 64 * 1024 * 1024);
+
+  /* `frontend` is the first listener, and the defaults for the rest */
+  for (i = 0; i < config->listener_count; i++) {
+    listener = &config->listeners[i];
+    if (i == 0) {
+      listener->port = config->frontend.port;
+      listener->host = config->frontend.host;
+      listener->ipv6only = config->frontend.ipv6only;
+    }
+    DEFAULT(listener->port, 0, config->frontend.port);
+    DEFAULT(listener->host, NULL, config->frontend.host);
+    DEFAULT(listener->ipv6only, -1, config->frontend.ipv6only);
+  }
+}
+
+
+void bud_config_set_pool_defaults(bud_config_http_pool_t* pool) {
+  DEFAULT(pool->max_connections, -1, 64);
+  DEFAULT(pool->timeout, -1, 0);
+  DEFAULT(pool->pipeline, -1, 1);
+  DEFAULT(pool->idle_timeout, -1, 30000);
+  DEFAULT(pool->max_fails, -1, 5);
+  DEFAULT(pool->backoff, -1, 1000);
+  DEFAULT(pool->max_backoff, -1, 30000);
+  DEFAULT(pool->resolve_interval, -1, 60000);
+  DEFAULT(pool->hedge, -1, 0);
+}
+
+
+bud_http_pool_t* bud_config_new_pool(bud_config_t* config,
+                                     bud_config_http_pool_t* conf,
+                                     bud_error_t* err) {
+  bud_http_pool_t* pool;
+  const char* host;
+  int i;
+  int count;
+
+  pool = bud_http_pool_new(config, conf->host, conf->port, err);
+  if (pool == NULL)
+    return NULL;
+
+  /* The rest of upstreams, first one is in `host` */
+  count = conf->hosts == NULL ? 0 : conf->hosts->count;
+  for (i = 1; i < count; i++) {
+    host = conf->hosts->items[i];
+    if (host == NULL)
+      *err = bud_error_str(kBudErrHttpHost, "(not a string)");
+    else
+      *err = bud_http_pool_add_host(pool, host);
+    if (!bud_is_ok(*err)) {
+      bud_http_pool_free(pool);
+      return NULL;
+    }
+  }
+
+  bud_http_pool_configure(pool, conf);
+  return pool;
+}
+
+#undef DEFAULT
+
+
+#ifdef OPENSSL_NPN_NEGOTIATED
+bud_npn_line_t* bud_config_encode_npn(bud_config_t* config,
+                                      const bud_config_strs_t* npn,
+                                      bud_error_t* err) {
+  int i;
+  bud_npn_line_t* npn_line;
+  bud_npn_line_t* existing;
+  size_t npn_line_len;
+  unsigned int offset;
+  int npn_count;
+  const char* npn_item;
+  int npn_item_len;
+  QUEUE* q;
+
+  *err = bud_ok();
+
+  /* Try global defaults */
+  if (npn == NULL)
+    npn = config->frontend.npn;
+  if (npn == NULL)
+    return NULL;
+
+  /* Calculate storage requirements */
+  npn_count = npn->count;
+  npn_line_len = 0;
+  for (i = 0; i < npn_count; i++)
+    npn_line_len += 1 + strlen(npn->items[i]);
+  if (npn_line_len == 0)
+    return NULL;
+
+  npn_line = malloc(sizeof(*npn_line) + npn_line_len);
+  if (npn_line == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "NPN copy");
+    return NULL;
+  }
+
+  /* Fill npn line */
+  for (i = 0, offset = 0; i < npn_count; i++) {
+    npn_item = npn->items[i];
+    npn_item_len = strlen(npn_item);
+
+    npn_line->data[offset++] = npn_item_len;
+    memcpy(npn_line->data + offset, npn_item, npn_item_len);
+    offset += npn_item_len;
+  }
+  ASSERT(offset == npn_line_len, "NPN Line overflow");
+  npn_line->len = npn_line_len;
+
+  /* Same list is usually shared by all contexts and SNI responses */
+  QUEUE_FOREACH(q, &config->npn_lines) {
+    existing = QUEUE_DATA(q, bud_npn_line_t, member);
+    if (existing->len != npn_line->len ||
+        memcmp(existing->data, npn_line->data, npn_line->len) != 0) {
+      continue;
+    }
+
+    free(npn_line);
+    existing->refcount++;
+    return existing;
+  }
+
+  npn_line->refcount = 1;
+  QUEUE_INSERT_TAIL(&config->npn_lines, &npn_line->member);
+  return npn_line;
+}
+#endif  /* OPENSSL_NPN_NEGOTIATED */
+
+
+bud_error_t bud_config_new_ssl_ctx(bud_config_t* config,
+                                   bud_context_t* context) {
+  SSL_CTX* ctx;
+  unsigned char sid_ctx[SHA256_DIGEST_LENGTH];
+  const char* ciphers;
+  const char* curves;
+  bud_error_t err;
+  int options;
+
+  /* Choose method, tlsv1_2 by default */
+  if (config->frontend.method == NULL) {
+    if (strcmp(config->frontend.security, "tls1.1") == 0)
+      config->frontend.method = TLSv1_1_server_method();
+    else if (strcmp(config->frontend.security, "tls1.0") == 0)
+      config->frontend.method = TLSv1_server_method();
+    else if (strcmp(config->frontend.security, "tls1.2") == 0)
+      config->frontend.method = TLSv1_2_server_method();
+    else if (strcmp(config->frontend.security, "ssl3") == 0)
+      config->frontend.method = SSLv3_server_method();
+#ifdef TLS1_3_VERSION
+    else if (strcmp(config->frontend.security, "tls1.3") == 0)
+      config->frontend.method = TLS_server_method();
+#else  /* !TLS1_3_VERSION */
+    else if (strcmp(config->frontend.security, "tls1.3") == 0)
+      return bud_error_str(kBudErrNoTLS13, config->frontend.security);
+#endif  /* TLS1_3_VERSION */
+    else
+      config->frontend.method = SSLv23_server_method();
+  }
+
+  ctx = SSL_CTX_new(config->frontend.method);
+  if (ctx == NULL)
+    return bud_error_str(kBudErrNoMem, "SSL_CTX");
+
+#ifdef TLS1_3_VERSION
+  /* Flexible method, limited to 1.3 only (1-RTT full handshakes) */
+  if (strcmp(config->frontend.security, "tls1.3") == 0)
+    SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+#endif  /* TLS1_3_VERSION */
+
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  /* Resumed TLS 1.3 clients may send this much before the handshake ends */
+  if (config->frontend.early_data > 0)
+    SSL_CTX_set_max_early_data(ctx, config->frontend.early_data);
+#endif  /* SSL_READ_EARLY_DATA_SUCCESS */
+
+  /* Sessions work only with cache shared between workers */
+  if (config->session_cache.enabled || config->session.enabled) {
+    SSL_CTX_set_ex_data(ctx, kBudSSLConfigIndex, config);
+    SSL_CTX_set_session_cache_mode(ctx,
+                                   SSL_SESS_CACHE_SERVER |
+                                   SSL_SESS_CACHE_NO_INTERNAL |
+                                   SSL_SESS_CACHE_NO_AUTO_CLEAR);
+    bud_context_sid_ctx(context, sid_ctx);
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx));
+    SSL_CTX_set_timeout(ctx, config->session_cache.timeout);
+    SSL_CTX_sess_set_new_cb(ctx, bud_session_cache_new_cb);
+    SSL_CTX_sess_set_get_cb(ctx, bud_session_cache_get_cb);
+    SSL_CTX_sess_set_remove_cb(ctx, bud_session_cache_remove_cb);
+  } else {
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+  }
+
+  /* Copied by SSL_new(), bud_context_tune_ssl() does it on the switch */
+#ifdef SSL_MODE_RELEASE_BUFFERS
+  if (context->release_buffers)
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+#endif  /* SSL_MODE_RELEASE_BUFFERS */
+  if (context->max_send_fragment != 0 &&
+      !SSL_CTX_set_max_send_fragment(ctx, context->max_send_fragment)) {
+    err = bud_error_num(kBudErrMaxSendFragment, context->max_send_fragment);
+    goto fatal;
+  }
+
+#ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
+  /* Tickets encrypted with keys shared by all workers */
+  if (config->frontend.ticket_ring != NULL)
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, bud_ticket_key_cb);
+#endif  /* SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB */
+
+  /* Session ids tell the master which worker has the session */
+  if (config->workers_session_hash)
+    SSL_CTX_set_generate_session_id(ctx, bud_session_generate_id);
+
+  /* ECDH curve selection and cipher suites */
+  curves = context->ecdh != NULL ? context->ecdh : config->frontend.ecdh;
+  ciphers = context->ciphers != NULL ? context->ciphers :
+                                       config->frontend.ciphers;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  err = bud_config_use_template(config, ctx, ciphers, curves);
+  if (!bud_is_ok(err))
+    goto fatal;
+#else  /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+  if (curves != NULL) {
+    err = bud_config_set_curves(ctx, curves);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+  if (ciphers != NULL)
+    SSL_CTX_set_cipher_list(ctx, ciphers);
+#endif  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+
+  /* Disable SSL2 */
+  options = SSL_OP_NO_SSLv2 | SSL_OP_ALL;
+  if (!config->frontend.ssl3)
+    options |= SSL_OP_NO_SSLv3;
+
+  if (config->frontend.server_preference)
+    options |= SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_PRIORITIZE_CHACHA
+  /* Otherwise done per client, see bud_client_prefer_chacha() */
+  if (config->frontend.prioritize_chacha)
+    options |= SSL_OP_PRIORITIZE_CHACHA;
+#endif  /* SSL_OP_PRIORITIZE_CHACHA */
+#ifdef SSL_READ_EARLY_DATA_SUCCESS
+  /* Stateful TLS 1.3 tickets, sessions come from the (single-use) cache */
+  if (config->frontend.early_data > 0)
+    options |= SSL_OP_NO_TICKET;
+#endif  /* SSL_READ_EARLY_DATA_SUCCESS */
+  SSL_CTX_set_options(ctx, options);
+
+#ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
+  if (config->context_count != 0) {
+    SSL_CTX_set_tlsext_servername_callback(ctx,
+                                           bud_config_select_sni_context);
+    SSL_CTX_set_tlsext_servername_arg(ctx, config);
+  }
+#endif  /* SSL_CTRL_SET_TLSEXT_SERVERNAME_CB */
+
+#ifdef OPENSSL_NPN_NEGOTIATED
+  context->npn_line = bud_config_encode_npn(config, context->npn, &err);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  bud_config_set_npn_cb(context);
+#else  /* !OPENSSL_NPN_NEGOTIATED */
+  err = bud_error(kBudErrNPNNotSupported);
+  goto fatal;
+#endif  /* OPENSSL_NPN_NEGOTIATED */
+
+  SSL_CTX_set_tlsext_status_cb(ctx, bud_client_stapling_cb);
+
+  /* Client certificates, results are cached by verify.c */
+  err = bud_verify_setup(config, context, ctx);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  context->ctx = ctx;
+  return bud_ok();
+
+fatal:
+  SSL_CTX_free(ctx);
+  return err;
+}
+
+
+bud_error_t bud_config_set_curves(SSL_CTX* ctx, const char* curves) {
+#ifdef SSL_CTRL_SET_CURVES_LIST
+  /* OpenSSL picks the first of ours that client's supported_groups has */
+  if (!SSL_CTX_set1_curves_list(ctx, curves))
+    return bud_error_str(kBudErrECDHNotFound, curves);
+# ifdef SSL_CTRL_SET_ECDH_AUTO
+  SSL_CTX_set_ecdh_auto(ctx, 1);
+# endif  /* SSL_CTRL_SET_ECDH_AUTO */
+  SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
+  return bud_ok();
+#else  /* !SSL_CTRL_SET_CURVES_LIST */
+  bud_config_curves_t* list;
+  bud_error_t err;
+
+  err = bud_config_parse_curves(curves, &list);
+  if (!bud_is_ok(err))
+    return err;
+
+  err = bud_config_attach_curves(ctx, list);
+  bud_config_curves_unref(list);
+  return err;
+#endif  /* SSL_CTRL_SET_CURVES_LIST */
+}
+
+
+#ifndef SSL_CTRL_SET_CURVES_LIST
+bud_error_t bud_config_parse_curves(const char* curves,
+                                    bud_config_curves_t** out) {
+  bud_config_curves_t* list;
+  const char* p;
+  const char* end;
+  char name[64];
+  size_t len;
+  int nid;
+
+  list = calloc(1, sizeof(*list));
+  if (list == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_config_curves_t");
+  list->refcount = 1;
+
+  for (p = curves; *p != '\0'; p = *end == '\0' ? end : end + 1) {
+    end = strchr(p, ':');
+    if (end == NULL)
+      end = p + strlen(p);
+    len = end - p;
+    if (len == 0)
+      continue;
+    if (len >= sizeof(name))
+      goto not_found;
+    memcpy(name, p, len);
+    name[len] = '\0';
+
+    /* Allowed in the list for newer OpenSSL, there is no EC_KEY for it */
+    if (strcmp(name, "X25519") == 0)
+      continue;
+
+    nid = OBJ_sn2nid(name);
+    if (nid == NID_undef)
+      goto not_found;
+    if (list->count == ARRAY_SIZE(list->keys))
+      continue;
+
+    list->keys[list->count] = EC_KEY_new_by_curve_name(nid);
+    if (list->keys[list->count] == NULL)
+      goto not_found;
+    list->ids[list->count++] = bud_config_curve_id(nid);
+  }
+  if (list->count == 0)
+    goto not_found;
+
+  *out = list;
+  return bud_ok();
+
+not_found:
+  bud_config_curves_unref(list);
+  return bud_error_str(kBudErrECDHNotFound, curves);
+}
+
+
+bud_error_t bud_config_attach_curves(SSL_CTX* ctx,
+                                     bud_config_curves_t* list) {
+  SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
+
+  /* One curve - no need to choose, SSL_CTX gets a copy of the key */
+  if (list->count == 1) {
+    SSL_CTX_set_tmp_ecdh(ctx, list->keys[0]);
+    return bud_ok();
+  }
+
+  /* Released with SSL_CTX */
+  if (!SSL_CTX_set_ex_data(ctx, kBudSSLCurvesIndex, list))
+    return bud_error_str(kBudErrNoMem, "SSL_CTX curves");
+  list->refcount++;
+  SSL_CTX_set_tmp_ecdh_callback(ctx, bud_config_tmp_ecdh_cb);
+  return bud_ok();
+}
+
+
+void bud_config_curves_unref(bud_config_curves_t* list) {
+  int i;
+
+  if (--list->refcount != 0)
+    return;
+
+  for (i = 0; i < list->count; i++)
+    EC_KEY_free(list->keys[i]);
+  free(list);
+}
+
+
+void bud_config_curves_ex_free(void* parent,
+                               void* ptr,
+                               CRYPTO_EX_DATA* ad,
+                               int idx,
+                               long argl,
+                               void* argp) {
+  if (ptr != NULL)
+    bud_config_curves_unref(ptr);
+}
+
+
+uint16_t bud_config_curve_id(int nid) {
+  /* RFC 4492 and RFC 7027 ids of the curves a client may support */
+  switch (nid) {
+    case NID_secp224r1: return 21;
+    case NID_secp256k1: return 22;
+    case NID_X9_62_prime256v1: return 23;
+    case NID_secp384r1: return 24;
+    case NID_secp521r1: return 25;
+# ifdef NID_brainpoolP256r1
+    case NID_brainpoolP256r1: return 26;
+    case NID_brainpoolP384r1: return 27;
+    case NID_brainpoolP512r1: return 28;
+# endif  /* NID_brainpoolP256r1 */
+    default: return 0;
+  }
+}
+
+
+EC_KEY* bud_config_tmp_ecdh_cb(SSL* s, int is_export, int keylength) {
+  bud_config_curves_t* list;
+  SSL_SESSION* sess;
+  const unsigned char* groups;
+  size_t groups_len;
+  size_t j;
+  int i;
+
+  /* Context selected by SNI, if any */
+  list = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(s), kBudSSLCurvesIndex);
+  if (list == NULL)
+    return NULL;
+
+  /* No extension - client supports any curve (RFC 4492 4) */
+  sess = SSL_get_session(s);
+  if (sess == NULL || sess->tlsext_ellipticcurvelist == NULL)
+    return list->keys[0];
+  groups = sess->tlsext_ellipticcurvelist;
+  groups_len = sess->tlsext_ellipticcurvelist_length;
+
+  /* Our order, client's list only filters it */
+  for (i = 0; i < list->count; i++) {
+    for (j = 0; j + 1 < groups_len; j += 2) {
+      if (((groups[j] << 8) | groups[j + 1]) == list->ids[i])
+        return list->keys[i];
+    }
+  }
+
+  /* Hopefully never happens, cipher choice should have excluded ECDHE */
+  return list->keys[0];
+}
+#endif  /* !SSL_CTRL_SET_CURVES_LIST */
+
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+bud_error_t bud_config_use_template(bud_config_t* config,
+                                    SSL_CTX* ctx,
+                                    const char* ciphers,
+                                    const char* curves) {
+  QUEUE* q;
+  bud_config_template_t* tmpl;
+  bud_error_t err;
+
+  tmpl = NULL;
+  QUEUE_FOREACH(q, &config->ssl_templates) {
+    tmpl = QUEUE_DATA(q, bud_config_template_t, member);
+    if (bud_config_template_eq(tmpl->ciphers, ciphers) &&
+        bud_config_template_eq(tmpl->ecdh, curves)) {
+      break;
+    }
+    tmpl = NULL;
+  }
+
+  /* First context with these strings does the parsing */
+  if (tmpl == NULL) {
+    tmpl = bud_config_template_new(config, ctx, ciphers, curves, &err);
+    if (tmpl == NULL)
+      return err;
+  } else {
+    err = bud_config_template_apply(tmpl, ctx);
+    if (!bud_is_ok(err))
+      return err;
+    tmpl->refcount++;
+  }
+
+  /* Released with SSL_CTX */
+  if (!SSL_CTX_set_ex_data(ctx, kBudSSLTemplateIndex, tmpl)) {
+    bud_config_template_unref(tmpl);
+    return bud_error_str(kBudErrNoMem, "SSL_CTX template");
+  }
+  return bud_ok();
+}
+
+
+bud_config_template_t* bud_config_template_new(bud_config_t* config,
+                                               SSL_CTX* ctx,
+                                               const char* ciphers,
+                                               const char* curves,
+                                               bud_error_t* err) {
+  bud_config_template_t* tmpl;
+  size_t ciphers_len;
+  size_t curves_len;
+  char* p;
+
+  /* Strings of SNI responses are gone after the context is created */
+  ciphers_len = ciphers == NULL ? 0 : strlen(ciphers) + 1;
+  curves_len = curves == NULL ? 0 : strlen(curves) + 1;
+  tmpl = calloc(1, sizeof(*tmpl) + ciphers_len + curves_len);
+  if (tmpl == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_config_template_t");
+    return NULL;
+  }
+  tmpl->refcount = 1;
+  p = (char*) (tmpl + 1);
+  if (ciphers != NULL) {
+    memcpy(p, ciphers, ciphers_len);
+    tmpl->ciphers = p;
+    p += ciphers_len;
+  }
+  if (curves != NULL) {
+    memcpy(p, curves, curves_len);
+    tmpl->ecdh = p;
+  }
+
+# ifdef SSL_CTRL_SET_CURVES_LIST
+  /* Just the names, nothing to keep */
+  if (curves != NULL) {
+    *err = bud_config_set_curves(ctx, curves);
+    if (!bud_is_ok(*err))
+      goto fatal;
+  }
+# else  /* !SSL_CTRL_SET_CURVES_LIST */
+  if (curves != NULL) {
+    *err = bud_config_parse_curves(curves, &tmpl->curves);
+    if (!bud_is_ok(*err))
+      goto fatal;
+  }
+# endif  /* SSL_CTRL_SET_CURVES_LIST */
+
+  /* Copies of the sorted lists, SSL_CTX_set_cipher_list() builds both */
+  if (ciphers != NULL) {
+    SSL_CTX_set_cipher_list(ctx, ciphers);
+    tmpl->cipher_list = sk_SSL_CIPHER_dup(ctx->cipher_list);
+    tmpl->cipher_list_by_id = sk_SSL_CIPHER_dup(ctx->cipher_list_by_id);
+    if (tmpl->cipher_list == NULL || tmpl->cipher_list_by_id == NULL) {
+      *err = bud_error_str(kBudErrNoMem, "template cipher list");
+      goto fatal;
+    }
+  }
+
+# ifndef SSL_CTRL_SET_CURVES_LIST
+  if (tmpl->curves != NULL) {
+    *err = bud_config_attach_curves(ctx, tmpl->curves);
+    if (!bud_is_ok(*err))
+      goto fatal;
+  }
+# endif  /* !SSL_CTRL_SET_CURVES_LIST */
+
+  QUEUE_INSERT_TAIL(&config->ssl_templates, &tmpl->member);
+  return tmpl;
+
+fatal:
+  QUEUE_INIT(&tmpl->member);
+  bud_config_template_unref(tmpl);
+  return NULL;
+}
+
+
+bud_error_t bud_config_template_apply(bud_config_template_t* tmpl,
+                                      SSL_CTX* ctx) {
+  STACK_OF(SSL_CIPHER)* list;
+  STACK_OF(SSL_CIPHER)* by_id;
+
+  if (tmpl->cipher_list != NULL) {
+    list = sk_SSL_CIPHER_dup(tmpl->cipher_list);
+    by_id = sk_SSL_CIPHER_dup(tmpl->cipher_list_by_id);
+    if (list == NULL || by_id == NULL) {
+      sk_SSL_CIPHER_free(list);
+      sk_SSL_CIPHER_free(by_id);
+      return bud_error_str(kBudErrNoMem, "SSL_CTX cipher list");
+    }
+
+    /* Replace the default ones of SSL_CTX_new() */
+    sk_SSL_CIPHER_free(ctx->cipher_list);
+    sk_SSL_CIPHER_free(ctx->cipher_list_by_id);
+    ctx->cipher_list = list;
+    ctx->cipher_list_by_id = by_id;
+  }
+
+# ifdef SSL_CTRL_SET_CURVES_LIST
+  if (tmpl->ecdh != NULL)
+    return bud_config_set_curves(ctx, tmpl->ecdh);
+# else  /* !SSL_CTRL_SET_CURVES_LIST */
+  if (tmpl->curves != NULL)
+    return bud_config_attach_curves(ctx, tmpl->curves);
+# endif  /* SSL_CTRL_SET_CURVES_LIST */
+  return bud_ok();
+}
+
+
+int bud_config_template_eq(const char* a, const char* b) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp(a, b) == 0;
+}
+
+
+void bud_config_template_unref(bud_config_template_t* tmpl) {
+  if (--tmpl->refcount != 0)
+    return;
+
+  QUEUE_REMOVE(&tmpl->member);
+  if (tmpl->cipher_list != NULL)
+    sk_SSL_CIPHER_free(tmpl->cipher_list);
+  if (tmpl->cipher_list_by_id != NULL)
+    sk_SSL_CIPHER_free(tmpl->cipher_list_by_id);
+# ifndef SSL_CTRL_SET_CURVES_LIST
+  if (tmpl->curves != NULL)
+    bud_config_curves_unref(tmpl->curves);
+# endif  /* !SSL_CTRL_SET_CURVES_LIST */
+  free(tmpl);
+}
+
+
+void bud_config_template_ex_free(void* parent,
+                                 void* ptr,
+                                 CRYPTO_EX_DATA* ad,
+                                 int idx,
+                                 long argl,
+                                 void* argp) {
+  if (ptr != NULL)
+    bud_config_template_unref(ptr);
+}
+#endif  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+
+
+const char* bud_context_get_ocsp_id(bud_context_t* context,
+                                    size_t* size) {
+  char* encoded;
+  unsigned char* pencoded;
+  size_t encoded_len;
+  char* base64;
+  size_t base64_len;
+
+  if (context->ocsp_id == NULL)
+    return NULL;
+
+  base64 = NULL;
+  encoded = NULL;
+  /* Return cached id */
+  if (context->ocsp_der_id != NULL)
+    goto done;
+
+  encoded_len = i2d_OCSP_CERTID(context->ocsp_id, NULL);
+  base64_len = bud_base64_encoded_size(encoded_len);
+  encoded = malloc(encoded_len);
+  base64 = malloc(base64_len);
+  if (encoded == NULL || base64 == NULL)
+    goto done;
+
+  pencoded = (unsigned char*) encoded;
+  i2d_OCSP_CERTID(context->ocsp_id, &pencoded);
+
+  bud_base64_encode(encoded, encoded_len, base64, base64_len);
+  context->ocsp_der_id = base64;
+  context->ocsp_der_id_len = base64_len;
+  base64 = NULL;
+
+done:
+  free(encoded);
+  free(base64);
+  *size = context->ocsp_der_id_len;
+  return context->ocsp_der_id;
+}
+
+
+const char* bud_context_get_ocsp_req(bud_context_t* context,
+                                     size_t* size,
+                                     bud_http_body_t** ocsp_request) {
+  STACK_OF(OPENSSL_STRING)* urls;
+  OCSP_REQUEST* req;
+  OCSP_CERTID* id;
+  bud_http_body_t* encoded;
+  unsigned char* pencoded;
+  size_t encoded_len;
+
+  urls = NULL;
+  req = NULL;
+  id = NULL;
+  encoded = NULL;
+  *ocsp_request = NULL;
+
+  /* Cached url */
+  if (context->ocsp_url != NULL)
+    goto has_url;
+
+  urls = X509_get1_ocsp(context->cert);
+  if (urls == NULL)
+    goto done;
+
+  context->ocsp_url = sk_OPENSSL_STRING_pop(urls);
+  context->ocsp_url_len = strlen(context->ocsp_url);
+
+has_url:
+  if (context->ocsp_url == NULL)
+    goto done;
+
+  /* Cached request */
+  if (context->ocsp_req != NULL)
+    goto has_req;
+
+  id = OCSP_CERTID_dup(context->ocsp_id);
+  if (id == NULL)
+    goto done;
+
+  /* Create request */
+  req = OCSP_REQUEST_new();
+  if (req == NULL)
+    goto done;
+  if (!OCSP_request_add0_id(req, id))
+    goto done;
+  id = NULL;
+
+  encoded_len = i2d_OCSP_REQUEST(req, NULL);
+  encoded = bud_http_body_new(encoded_len);
+  if (encoded == NULL)
+    goto done;
+
+  pencoded = (unsigned char*) encoded->data;
+  i2d_OCSP_REQUEST(req, &pencoded);
+  context->ocsp_req = encoded;
+
+has_req:
+  *ocsp_request = context->ocsp_req;
+
+done:
+  if (req != NULL)
+    OCSP_REQUEST_free(req);
+  if (id != NULL)
+    OCSP_CERTID_free(id);
+  if (urls != NULL)
+    X509_email_free(urls);
+
+  *size = context->ocsp_url_len;
+  return context->ocsp_url;
+}
+
+
+bud_http_body_t* bud_context_get_ocsp_body(bud_context_t* context) {
+  const char* url;
+  size_t url_size;
+  bud_http_body_t* ocsp;
+  bud_http_body_t* body;
+  size_t json_size;
+  size_t offset;
+
+  /* Cached body */
+  if (context->ocsp_body != NULL)
+    return context->ocsp_body;
+
+  url = bud_context_get_ocsp_req(context, &url_size, &ocsp);
+  if (url == NULL || ocsp == NULL)
+    return NULL;
+
+  /* {"url":"...","ocsp":"..."} */
+  json_size = 2 + bud_base64_encoded_size(ocsp->len) + 2 + url_size;
+  json_size += /* "ocsp": */ 7 + /* "url": */ 6 + /* {,}\0 */ 4;
+  body = bud_http_body_new(json_size - 1);
+  if (body == NULL)
+    return NULL;
+
+  offset = snprintf(body->data,
+                    json_size,
+                    "{\"url\":\"%.*s\",\"ocsp\":\"",
+                    (int) url_size,
+                    url);
+  bud_base64_encode(ocsp->data,
+                    ocsp->len,
+                    body->data + offset,
+                    json_size - offset);
+  offset += bud_base64_encoded_size(ocsp->len);
+  snprintf(body->data + offset, json_size - offset, "\"}");
+
+  context->ocsp_body = body;
+  return body;
+}
+
+
+bud_error_t bud_config_init(bud_config_t* config) {
+  int i;
+  bud_preload_t* preload;
+  bud_error_t err;
+
+  i = 0;
+
+  if (config->frontend.buffer.chunk_size < 0 ||
+      config->frontend.buffer.chunk_count < 0 ||
+      config->backend.buffer.chunk_size < 0 ||
+      config->backend.buffer.chunk_count < 0 ||
+      !bud_config_buffer_bulk_ok(&config->frontend.buffer) ||
+      !bud_config_buffer_bulk_ok(&config->backend.buffer)) {
+    err = bud_error(kBudErrInvalidBuffer);
+    goto fatal;
+  }
+  if (!bud_config_buffer_marks_ok(&config->frontend.buffer) ||
+      !bud_config_buffer_marks_ok(&config->backend.buffer)) {
+    err = bud_error(kBudErrInvalidBufferMarks);
+    goto fatal;
+  }
+
+  /* Extra loops can't get handles from master, they accept on their own */
+  if (config->thread_count > 1 && !config->frontend.reuseport) {
+    err = bud_error(kBudErrThreadsReusePort);
+    goto fatal;
+  }
+  if (config->frontend.shared_listen && config->frontend.reuseport) {
+    err = bud_error(kBudErrSharedListenReusePort);
+    goto fatal;
+  }
+
+  if (strcmp(config->workers_balance, "ip-hash") == 0) {
+    config->workers_ip_hash = 1;
+  } else if (strcmp(config->workers_balance, "sni") == 0) {
+    config->workers_sni_hash = 1;
+    if (config->frontend.accept_proxyline) {
+      bud_log(config,
+              kBudLogWarning,
+              "`workers_balance: \"sni\"` can't see the hello behind the "
+              "PROXY header, clients go to the least loaded worker");
+    }
+  } else if (strcmp(config->workers_balance, "session") == 0) {
+    config->workers_session_hash = 1;
+    if (config->frontend.accept_proxyline) {
+      bud_log(config,
+              kBudLogWarning,
+              "`workers_balance: \"session\"` can't see the hello behind "
+              "the PROXY header, clients go to the least loaded worker");
+    }
+  } else if (strcmp(config->workers_balance, "leastload") != 0) {
+    err = bud_error_str(kBudErrWorkersBalance, config->workers_balance);
+    goto fatal;
+  }
+
+  /* Options that this OpenSSL can't do, don't ignore them silently */
+#ifndef SSL_READ_EARLY_DATA_SUCCESS
+  if (config->frontend.early_data > 0) {
+    err = bud_error_str(kBudErrOpenSSLFeature, "frontend.early_data");
+    goto fatal;
+  }
+#endif  /* !SSL_READ_EARLY_DATA_SUCCESS */
+#ifndef SSL_MODE_ASYNC
+  if (config->engine.async) {
+    err = bud_error_str(kBudErrOpenSSLFeature, "engine.async");
+    goto fatal;
+  }
+#endif  /* !SSL_MODE_ASYNC */
+#ifndef SSL_OP_NO_TX_CERTIFICATE_COMPRESSION
+  if (config->frontend.cert_compression) {
+    err = bud_error_str(kBudErrOpenSSLFeature, "frontend.cert_compression");
+    goto fatal;
+  }
+#endif  /* !SSL_OP_NO_TX_CERTIFICATE_COMPRESSION */
+
+  /*
+   * 0-RTT data can be replayed, OpenSSL prevents it only by using every
+   * session once - i.e. with sessions in a cache shared by the workers.
+   */
+  if (config->frontend.early_data > 0 &&
+      !config->session_cache.enabled &&
+      !config->session.enabled) {
+    bud_log(config,
+            kBudLogWarning,
+            "frontend.early_data requires session_cache or session, "
+            "disabling it");
+    config->frontend.early_data = 0;
+  }
+
+  /* Headers are inserted into the decrypted requests, 0-RTT is not peeked */
+  if (config->backend.xforward && config->frontend.passthrough) {
+    bud_log(config,
+            kBudLogWarning,
+            "backend.xforward does not work with passthrough, disabling it");
+    config->backend.xforward = 0;
+  }
+  if (config->backend.xforward && config->frontend.early_data > 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "frontend.early_data is not supported with backend.xforward, "
+            "disabling it");
+    config->frontend.early_data = 0;
+  }
 
-  DEFAULT(config->sni.port, 0, 9000);
-  DEFAULT(config->sni.host, NULL, "127.0.0.1");
-  DEFAULT(config->sni.query_fmt, NULL, "/bud/sni/%s");
-  DEFAULT(config->stapling.port, 0, 9000);
-  DEFAULT(config->stapling.host, NULL, "127.0.0.1");
-  DEFAULT(config->stapling.query_fmt, NULL, "/bud/stapling/%s");
-}
+  /* Per-process free-lists of ringbuffer chunks, clients and requests */
+  ringbuffer_pool_init(&config->buffer_pool,
+                       RING_BUFFER_LEN,
+                       config->pool.low_watermark,
+                       config->pool.high_watermark);
+  ringbuffer_pool_init(&config->frontend_pool,
+                       config->frontend.buffer.chunk_size,
+                       config->pool.low_watermark,
+                       config->pool.high_watermark);
+  ringbuffer_pool_init(&config->backend_pool,
+                       config->backend.buffer.chunk_size,
+                       config->pool.low_watermark,
+                       config->pool.high_watermark);
+  bud_slab_init(&config->client_slab,
+                "client",
+                kBudMemClients,
+                sizeof(bud_client_t),
+                config->pool.low_watermark,
+                config->pool.high_watermark);
+  bud_slab_init(&config->handshake_slab,
+                "client handshake",
+                kBudMemClients,
+                sizeof(bud_client_handshake_t),
+                config->pool.low_watermark,
+                config->pool.high_watermark);
+  bud_slab_init(&config->http_req_slab,
+                "http request",
+                kBudMemHttp,
+                sizeof(bud_http_request_t),
+                config->pool.low_watermark,
+                config->pool.high_watermark);
+  bud_slab_init(&config->http_conn_slab,
+                "http connection",
+                kBudMemHttp,
+                sizeof(bud_http_conn_t),
+                config->pool.low_watermark,
+                config->pool.high_watermark);
+
+  /* Get addresses of frontends and backends */
+  err = bud_config_init_listeners(config);
+  if (!bud_is_ok(err))
+    goto fatal;
 
-#undef DEFAULT
+  err = bud_backends_init(config);
+  if (!bud_is_ok(err))
+    goto fatal;
 
+  /* Get indexes for SSL_set_ex_data()/SSL_get_ex_data() */
+  if (kBudSSLClientIndex == -1) {
+    kBudSSLClientIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    kBudSSLSNIIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    kBudSSLConfigIndex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    if (kBudSSLClientIndex == -1 ||
+        kBudSSLSNIIndex == -1 ||
+        kBudSSLConfigIndex == -1) {
+      goto fatal;
+    }
+  }
+#ifndef SSL_CTRL_SET_CURVES_LIST
+  if (kBudSSLCurvesIndex == -1) {
+    kBudSSLCurvesIndex = SSL_CTX_get_ex_new_index(0,
+                                                  NULL,
+                                                  NULL,
+                                                  NULL,
+                                                  bud_config_curves_ex_free);
+    if (kBudSSLCurvesIndex == -1)
+      goto fatal;
+  }
+#endif  /* !SSL_CTRL_SET_CURVES_LIST */
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+  if (kBudSSLTemplateIndex == -1) {
+    kBudSSLTemplateIndex = SSL_CTX_get_ex_new_index(
+        0,
+        NULL,
+        NULL,
+        NULL,
+        bud_config_template_ex_free);
+    if (kBudSSLTemplateIndex == -1)
+      goto fatal;
+  }
+#endif  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
 
-#ifdef OPENSSL_NPN_NEGOTIATED
-char* bud_config_encode_npn(bud_config_t* config,
-                            const JSON_Array* npn,
-                            size_t* len,
-                            bud_error_t* err) {
-  int i;
-  char* npn_line;
-  size_t npn_line_len;
-  unsigned int offset;
-  int npn_count;
-  const char* npn_item;
-  int npn_item_len;
+#ifndef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
+  if (config->context_count != 0) {
+    err = bud_error(kBudErrSNINotSupported);
+    goto fatal;
+  }
+#endif  /* !SSL_CTRL_SET_TLSEXT_SERVERNAME_CB */
 
-  /* Try global defaults */
-  if (npn == NULL)
-    npn = config->frontend.npn;
-  if (npn == NULL) {
-    *err = bud_ok();
-    *len = 0;
-    return NULL;
+  /* Allocate workers */
+  if (!config->is_worker) {
+    config->worker_slots = config->worker_count;
+    if (config->worker_count != 0 && config->spare_count > 0)
+      config->worker_slots += config->spare_count;
+
+    /* Room for the autoscaled ones, they are spawned on demand */
+    if (config->worker_count != 0 &&
+        config->autoscale.max > config->worker_count) {
+      config->worker_slots += config->autoscale.max - config->worker_count;
+    }
+    config->workers = calloc(config->worker_slots * 2,
+                             sizeof(*config->workers));
+    if (config->workers == NULL) {
+      err = bud_error_str(kBudErrNoMem, "workers");
+      goto fatal;
+    }
   }
 
-  /* Calculate storage requirements */
-  npn_count = json_array_get_count(npn);
-  npn_line_len = 0;
-  for (i = 0; i < npn_count; i++)
-    npn_line_len += 1 + strlen(json_array_get_string(npn, i));
+  /* Initialize logger */
+  err = bud_logger_new(config);
+  if (!bud_is_ok(err))
+    goto fatal;
 
-  if (npn_line_len != 0) {
-    npn_line = malloc(npn_line_len);
-    if (npn_line == NULL) {
-      *err = bud_error_str(kBudErrNoMem, "NPN copy");
-      return NULL;
+  /* Map workers to CPUs */
+  err = bud_affinity_init(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  /* TLS session ticket keys, master's replace workers' ones */
+  if (config->frontend.ticket_previous < 0)
+    config->frontend.ticket_previous = 0;
+  err = bud_ticket_load(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  /* Master creates shared session cache, workers and threads inherit it */
+  if (config->session_cache.enabled) {
+    if (config->thread_parent != NULL &&
+        config->thread_parent->session_cache.cache != NULL) {
+      err = bud_session_cache_open(
+          config,
+          dup(config->thread_parent->session_cache.cache->fd));
+    } else if (config->is_worker) {
+      err = bud_session_cache_open(config, BUD_SESSION_CACHE_FD);
+    } else {
+      err = bud_session_cache_new(config);
     }
+    if (!bud_is_ok(err))
+      goto fatal;
   }
 
-  /* Fill npn line */
-  for (i = 0, offset = 0; i < npn_count; i++) {
-    npn_item = json_array_get_string(npn, i);
-    npn_item_len = strlen(npn_item);
+  /* Same for SNI responses and staples */
+  if (config->shared_cache.enabled) {
+    if (config->thread_parent != NULL &&
+        config->thread_parent->shared_cache.cache != NULL) {
+      err = bud_shared_cache_open(
+          config,
+          dup(config->thread_parent->shared_cache.cache->fd));
+    } else if (config->is_worker) {
+      err = bud_shared_cache_open(config, BUD_SHARED_CACHE_FD);
+    } else {
+      err = bud_shared_cache_new(config);
+    }
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
 
-    npn_line[offset++] = npn_item_len;
-    memcpy(npn_line + offset, npn_item, npn_item_len);
-    offset += npn_item_len;
+  /* Before the contexts and pools, they look up saved entries right away */
+  if (config->disk_cache.enabled) {
+    err = bud_disk_cache_new(config);
+    if (!bud_is_ok(err))
+      goto fatal;
   }
-  ASSERT(offset == npn_line_len, "NPN Line overflow");
 
-  *len = npn_line_len;
-  *err = bud_ok();
+  if (config->is_worker || config->worker_count == 0) {
+    /* `pool.reserve`, before any client takes a chunk */
+    bud_config_reserve_buffers(config, &config->frontend_pool, "frontend");
+    bud_config_reserve_buffers(config, &config->backend_pool, "backend");
 
-  return npn_line;
-}
-#endif  /* OPENSSL_NPN_NEGOTIATED */
+    /* Probe and pre-connect backends, every worker does it on its own */
+    err = bud_backends_start(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
+    err = bud_client_handshakes_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-bud_error_t bud_config_new_ssl_ctx(bud_config_t* config,
-                                   bud_context_t* context) {
-  SSL_CTX* ctx;
-  int ecdh_nid;
-  EC_KEY* ecdh;
-  bud_error_t err;
-  int options;
+    err = bud_client_flush_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  /* Choose method, tlsv1_2 by default */
-  if (config->frontend.method == NULL) {
-    if (strcmp(config->frontend.security, "tls1.1") == 0)
-      config->frontend.method = TLSv1_1_server_method();
-    else if (strcmp(config->frontend.security, "tls1.0") == 0)
-      config->frontend.method = TLSv1_server_method();
-    else if (strcmp(config->frontend.security, "tls1.2") == 0)
-      config->frontend.method = TLSv1_2_server_method();
-    else if (strcmp(config->frontend.security, "ssl3") == 0)
-      config->frontend.method = SSLv3_server_method();
-    else
-      config->frontend.method = SSLv23_server_method();
-  }
+    err = bud_client_spin_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  ctx = SSL_CTX_new(config->frontend.method);
-  if (ctx == NULL)
-    return bud_error_str(kBudErrNoMem, "SSL_CTX");
+    err = bud_client_budget_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  /* Disable sessions, they won't work with cluster anyway */
-  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    err = bud_client_ssl_pool_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  /* ECDH curve selection */
-  if (context->ecdh != NULL || config->frontend.ecdh != NULL) {
-    if (context->ecdh != NULL)
-      ecdh_nid = OBJ_sn2nid(context->ecdh);
-    else
-      ecdh_nid = OBJ_sn2nid(config->frontend.ecdh);
+    err = bud_client_teardown_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-    if (ecdh_nid == NID_undef) {
-      ecdh = NULL;
-      err = bud_error_str(kBudErrECDHNotFound,
-                          context->ecdh == NULL ? config->frontend.ecdh :
-                                                  context->ecdh);
+    err = bud_client_reclaim_init(config);
+    if (!bud_is_ok(err))
       goto fatal;
-    }
 
-    ecdh = EC_KEY_new_by_curve_name(ecdh_nid);
-    if (ecdh == NULL) {
-      err = bud_error_str(kBudErrNoMem, "EC_KEY");
+    err = bud_client_tcp_info_init(config);
+    if (!bud_is_ok(err))
       goto fatal;
-    }
 
-    SSL_CTX_set_options(ctx, SSL_OP_SINGLE_ECDH_USE);
-    SSL_CTX_set_tmp_ecdh(ctx, ecdh);
-    EC_KEY_free(ecdh);
-  }
-  ecdh = NULL;
+    err = bud_ratelimit_new(config, &config->ratelimit);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  /* Cipher suites */
-  if (context->ciphers != NULL)
-    SSL_CTX_set_cipher_list(ctx, context->ciphers);
-  else if (config->frontend.ciphers != NULL)
-    SSL_CTX_set_cipher_list(ctx, config->frontend.ciphers);
+    err = bud_access_new(config, &config->access);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  /* Disable SSL2 */
-  options = SSL_OP_NO_SSLv2 | SSL_OP_ALL;
-  if (!config->frontend.ssl3)
-    options |= SSL_OP_NO_SSLv3;
+    err = bud_fingerprint_new(config, NULL, &config->fingerprint);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-  if (config->frontend.server_preference)
-    options |= SSL_OP_CIPHER_SERVER_PREFERENCE;
-  SSL_CTX_set_options(ctx, options);
+    err = bud_metrics_tables_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
 
-#ifdef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
-  if (config->context_count != 0) {
-    SSL_CTX_set_tlsext_servername_callback(ctx,
-                                           bud_config_select_sni_context);
-    SSL_CTX_set_tlsext_servername_arg(ctx, config);
+    err = bud_capture_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    err = bud_uring_new(config, &config->uring);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    err = bud_client_timeouts_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    err = bud_client_shape_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    /* After io_uring, its writes are never zero-copy */
+    err = bud_client_zerocopy_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    err = bud_config_lazy_init(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+
+    /* Before the contexts, keys are bound to the engine on load */
+    bud_engines_init(config);
+
+    /* Connect to SNI server, unless the certs are on disk */
+    if (config->sni.enabled) {
+      if (config->sni.directory == NULL && config->sni.binary) {
+        config->sni.lookup = bud_lookup_new(config, &config->sni, &err);
+        if (config->sni.lookup == NULL)
+          goto fatal;
+      } else if (config->sni.directory == NULL) {
+        config->sni.pool = bud_config_new_pool(config, &config->sni, &err);
+        if (config->sni.pool == NULL)
+          goto fatal;
+        config->sni.pool->extract = bud_sni_extract;
+      }
+
+      /* Also tracks requests in flight, even if `size` is 0 */
+      config->sni_cache = bud_sni_cache_new(config, &err);
+      if (config->sni_cache == NULL)
+        goto fatal;
+    }
+
+    /* Connect to external session cache */
+    if (config->session.enabled) {
+      config->session.pool = bud_config_new_pool(config,
+                                                 &config->session,
+                                                 &err);
+      if (config->session.pool == NULL)
+        goto fatal;
+    }
   }
-#endif  /* SSL_CTRL_SET_TLSEXT_SERVERNAME_CB */
 
-#ifdef OPENSSL_NPN_NEGOTIATED
-  context->npn_line = bud_config_encode_npn(config,
-                                            context->npn,
-                                            &context->npn_line_len,
-                                            &err);
+  /* Connect to OCSP Stapling server, master pre-warms staples for workers */
+  if (config->stapling.enabled &&
+      !config->stapling.direct &&
+      config->stapling.binary) {
+    /* Same backend as SNI, one connection is enough for both */
+    if (config->sni.lookup != NULL &&
+        config->sni.port == config->stapling.port &&
+        strcmp(config->sni.host, config->stapling.host) == 0) {
+      config->stapling.lookup = config->sni.lookup;
+    } else {
+      config->stapling.lookup = bud_lookup_new(config,
+                                               &config->stapling,
+                                               &err);
+      if (config->stapling.lookup == NULL)
+        goto fatal;
+    }
+  } else if (config->stapling.enabled && !config->stapling.direct) {
+    config->stapling.pool = bud_config_new_pool(config,
+                                                &config->stapling,
+                                                &err);
+    if (config->stapling.pool == NULL)
+      goto fatal;
+    config->stapling.pool->extract = bud_ocsp_extract;
+  }
+
+  /* CRLs of the contexts that verify clients, fetched on handshakes */
+  if (config->crl.enabled) {
+    config->crl.pool = bud_config_new_pool(config, &config->crl, &err);
+    if (config->crl.pool == NULL)
+      goto fatal;
+    config->crl.pool->extract = bud_verify_extract;
+  }
+  err = bud_verify_init(config);
   if (!bud_is_ok(err))
     goto fatal;
 
-  if (context->npn_line != NULL) {
-    SSL_CTX_set_next_protos_advertised_cb(ctx,
-                                          bud_config_advertise_next_proto,
-                                          context);
+  /* Intermediates of contexts and SNI responses are stored once */
+  config->cert_cache = bud_cert_cache_new(config, &err);
+  if (config->cert_cache == NULL)
+    goto fatal;
+
+  /* Master records what it loads, workers decode it instead of PEM */
+  bud_snapshot_new(config);
+  preload = NULL;
+  if (config->is_worker && config->snapshot_enabled) {
+    preload = bud_snapshot_preload(config,
+                                   BUD_SNAPSHOT_FD,
+                                   config->context_count + 1);
   }
-#else  /* !OPENSSL_NPN_NEGOTIATED */
-  err = bud_error(kBudErrNPNNotSupported);
-  goto fatal;
-#endif  /* OPENSSL_NPN_NEGOTIATED */
 
-  SSL_CTX_set_tlsext_status_cb(ctx, bud_client_stapling_cb);
+  /* Files are read and parsed in parallel, SSL_CTXs built here */
+  if (preload == NULL) {
+    preload = bud_preload_contexts(config,
+                                   config->contexts,
+                                   config->context_count + 1,
+                                   &err);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+
+  /* Load all contexts, lazy ones are only indexed */
+  for (i = 0; i < config->context_count + 1; i++) {
+    if (i != 0 && config->lazy_contexts.enabled)
+      continue;
+    err = bud_config_load_context(config,
+                                  &config->contexts[i],
+                                  i,
+                                  preload == NULL ? NULL : &preload[i]);
+    if (!bud_is_ok(err)) {
+      bud_preload_free(preload, config->context_count + 1);
+      goto fatal;
+    }
+  }
+  bud_preload_free(preload, config->context_count + 1);
+  bud_snapshot_finish(config);
+
+  err = bud_config_index_contexts(config);
+  if (!bud_is_ok(err)) {
+    i = config->context_count;
+    goto fatal;
+  }
+
+  /* Staples of `ocsp_file` contexts, every process reads them on its own */
+  if (config->is_worker || config->worker_count == 0) {
+    err = bud_ocsp_files_init(config);
+    if (!bud_is_ok(err)) {
+      i = config->context_count;
+      goto fatal;
+    }
+  }
 
-  context->ctx = ctx;
   return bud_ok();
 
 fatal:
-  if (ecdh != NULL)
-    EC_KEY_free(ecdh);
+  /* Free all allocated contexts */
+  do
+    bud_context_free(&config->contexts[i--]);
+  while (i >= 0);
 
-  SSL_CTX_free(ctx);
   return err;
 }
 
 
-const char* bud_context_get_ocsp_id(bud_context_t* context,
-                                    size_t* size) {
-  char* encoded;
-  unsigned char* pencoded;
-  size_t encoded_len;
-  char* base64;
-  size_t base64_len;
+void bud_config_context_files(bud_config_t* config,
+                              bud_context_t* ctx,
+                              int index,
+                              const char** cert_file,
+                              const char** key_file,
+                              const bud_config_strs_t** cert_files,
+                              const bud_config_strs_t** key_files) {
+  /* Default context */
+  if (index == 0) {
+    *cert_file = config->frontend.cert_file;
+    *key_file = config->frontend.key_file;
+    *cert_files = config->frontend.cert_files;
+    *key_files = config->frontend.key_files;
+  } else {
+    *cert_file = ctx->cert_file;
+    *key_file = ctx->key_file;
+    *cert_files = ctx->cert_files;
+    *key_files = ctx->key_files;
+  }
+}
 
-  if (context->ocsp_id == NULL)
-    return NULL;
 
-  base64 = NULL;
-  encoded = NULL;
-  /* Return cached id */
-  if (context->ocsp_der_id != NULL)
-    goto done;
+bud_error_t bud_config_load_context(bud_config_t* config,
+                                    bud_context_t* ctx,
+                                    int index,
+                                    bud_preload_t* preload) {
+  int r;
+  int i;
+  int count;
+  bud_error_t err;
+  const char* cert_file;
+  const char* key_file;
+  const bud_config_strs_t* cert_files;
+  const bud_config_strs_t* key_files;
+  BIO* cert_bio;
+  BIO* key_bio;
+  EVP_PKEY* key;
+  STACK_OF(X509)* chain;
 
-  encoded_len = i2d_OCSP_CERTID(context->ocsp_id, NULL);
-  base64_len = bud_base64_encoded_size(encoded_len);
-  encoded = malloc(encoded_len);
-  base64 = malloc(base64_len);
-  if (encoded == NULL || base64 == NULL)
-    goto done;
+  err = bud_config_new_ssl_ctx(config, ctx);
+  if (!bud_is_ok(err))
+    return err;
 
-  pencoded = (unsigned char*) encoded;
-  i2d_OCSP_CERTID(context->ocsp_id, &pencoded);
+  /* No handshakes here, contexts are only for routing */
+  if (config->frontend.passthrough)
+    return bud_ok();
 
-  bud_base64_encode(encoded, encoded_len, base64, base64_len);
-  context->ocsp_der_id = base64;
-  context->ocsp_der_id_len = base64_len;
-  base64 = NULL;
+  bud_config_context_files(config,
+                           ctx,
+                           index,
+                           &cert_file,
+                           &key_file,
+                           &cert_files,
+                           &key_files);
+
+  /* SSL_CTX has a slot per key type, cipher suite picks one of them */
+  count = cert_files == NULL ? 1 : cert_files->count;
+  for (i = 0; i < count; i++) {
+    if (cert_files != NULL)
+      cert_file = cert_files->items[i];
+    if (cert_file == NULL)
+      return bud_error_str(kBudErrLoadCert, "<null>");
+
+    /* Read and parsed by one of `load_threads` already */
+    chain = NULL;
+    if (preload != NULL && i < BUD_PRELOAD_MAX_PAIRS) {
+      chain = preload->certs[i];
+      preload->certs[i] = NULL;
+    }
+    if (chain == NULL) {
+      cert_bio = BIO_new_file(cert_file, "r");
+      if (cert_bio == NULL)
+        return bud_error_str(kBudErrLoadCert, cert_file);
+
+      chain = bud_config_read_pem_chain(cert_bio);
+      BIO_free_all(cert_bio);
+      if (chain == NULL)
+        return bud_error_str(kBudErrParseCert, cert_file);
+    }
+
+    /* Workers get it in DER from master, no need to parse PEM again */
+    bud_snapshot_add_chain(config->snapshot, index, i, cert_file, chain);
+
+    r = bud_context_use_x509_chain(config,
+                                   ctx,
+                                   sk_X509_shift(chain),
+                                   chain,
+                                   i == 0);
+    if (!r)
+      return bud_error_str(kBudErrParseCert, cert_file);
+  }
+
+  count = key_files == NULL ? 1 : key_files->count;
+  for (i = 0; i < count; i++) {
+    if (key_files != NULL)
+      key_file = key_files->items[i];
+    if (key_file == NULL)
+      return bud_error_str(kBudErrParseKey, "<null>");
+
+    key = NULL;
+    if (preload != NULL && i < BUD_PRELOAD_MAX_PAIRS) {
+      key = preload->keys[i];
+      preload->keys[i] = NULL;
+    }
+    if (key == NULL) {
+      key_bio = BIO_new_file(key_file, "r");
+      if (key_bio == NULL)
+        return bud_error_str(kBudErrParseKey, key_file);
+      key = PEM_read_bio_PrivateKey(key_bio, NULL, NULL, NULL);
+      BIO_free_all(key_bio);
+      if (key == NULL)
+        return bud_error_str(kBudErrParseKey, key_file);
+    }
 
-done:
-  free(encoded);
-  free(base64);
-  *size = context->ocsp_der_id_len;
-  return context->ocsp_der_id;
+    bud_snapshot_add_key(config->snapshot, index, i, key_file, key);
+    bud_engine_use_key(bud_engine_get(config, ctx->engine_id), key);
+    r = SSL_CTX_use_PrivateKey(ctx->ctx, key);
+    EVP_PKEY_free(key);
+    if (!r)
+      return bud_error_str(kBudErrParseKey, key_file);
+  }
+
+  bud_context_compress_certs(config, ctx);
+  return bud_ok();
 }
 
 
-const char* bud_context_get_ocsp_req(bud_context_t* context,
-                                     size_t* size,
-                                     char** ocsp_request,
-                                     size_t* ocsp_request_len) {
-  STACK_OF(OPENSSL_STRING)* urls;
-  OCSP_REQUEST* req;
-  OCSP_CERTID* id;
-  char* encoded;
-  unsigned char* pencoded;
-  size_t encoded_len;
+bud_error_t bud_context_use(bud_config_t* config, bud_context_t* ctx) {
+  bud_error_t err;
 
-  urls = NULL;
-  id = NULL;
-  encoded = NULL;
+  ctx->last_used = time(NULL);
+  if (ctx->ctx != NULL)
+    return bud_ok();
 
-  /* Cached url */
-  if (context->ocsp_url != NULL)
-    goto has_url;
+  err = bud_config_load_context(config, ctx, ctx - config->contexts, NULL);
+  if (!bud_is_ok(err)) {
+    /* Partially built, try again on the next handshake */
+    bud_context_free(ctx);
+    return err;
+  }
 
-  urls = X509_get1_ocsp(context->cert);
-  if (urls == NULL)
-    goto done;
+  bud_log(config,
+          kBudLogDebug,
+          "built context \"%.*s\"",
+          (int) ctx->servername_len,
+          ctx->servername);
+  return bud_ok();
+}
 
-  context->ocsp_url = sk_OPENSSL_STRING_pop(urls);
-  context->ocsp_url_len = strlen(context->ocsp_url);
 
-has_url:
-  if (context->ocsp_url == NULL)
-    goto done;
+bud_error_t bud_config_lazy_init(bud_config_t* config) {
+  uint64_t interval;
+  int r;
 
-  id = OCSP_CERTID_dup(context->ocsp_id);
-  if (id == NULL)
-    goto done;
+  if (!config->lazy_contexts.enabled)
+    return bud_ok();
 
-  /* Create request */
-  req = OCSP_REQUEST_new();
-  if (req == NULL)
-    goto done;
-  if (!OCSP_request_add0_id(req, id))
-    goto done;
-  id = NULL;
+  r = uv_timer_init(config->loop, &config->lazy_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrLazyTimer, r);
+  config->lazy_timer_init = 1;
+
+  /* Evicted within 1.5 of `idle_timeout` */
+  interval = (uint64_t) config->lazy_contexts.idle_timeout * 500;
+  if (interval < 1000)
+    interval = 1000;
+  uv_timer_start(&config->lazy_timer,
+                 bud_config_lazy_timer_cb,
+                 interval,
+                 interval);
+  uv_unref((uv_handle_t*) &config->lazy_timer);
 
-  encoded_len = i2d_OCSP_REQUEST(req, NULL);
-  encoded = malloc(encoded_len);
-  if (encoded == NULL)
-    goto done;
+  return bud_ok();
+}
 
-  pencoded = (unsigned char*) encoded;
-  i2d_OCSP_REQUEST(req, &pencoded);
-  OCSP_REQUEST_free(req);
 
-  *ocsp_request = encoded;
-  *ocsp_request_len = encoded_len;
-  encoded = NULL;
+void bud_config_lazy_timer_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_context_t* ctx;
+  time_t deadline;
+  int evicted;
+  int i;
 
-done:
-  if (id != NULL)
-    OCSP_CERTID_free(id);
-  if (urls != NULL)
-    X509_email_free(urls);
-  if (encoded != NULL)
-    free(encoded);
+  config = container_of(handle, bud_config_t, lazy_timer);
+  deadline = time(NULL) - config->lazy_contexts.idle_timeout;
 
-  *size = context->ocsp_url_len;
-  return context->ocsp_url;
+  /* SSL objects hold references to their SSL_CTX, so it is safe */
+  evicted = 0;
+  for (i = 1; i < config->context_count + 1; i++) {
+    ctx = &config->contexts[i];
+    if (ctx->ctx == NULL || ctx->last_used > deadline)
+      continue;
+    bud_context_free(ctx);
+
+    /* Fetch the staple as soon as it is built again */
+    ctx->staple_len = 0;
+    ctx->staple_expire = 0;
+    ctx->staple_refresh = 0;
+    evicted++;
+  }
+
+  if (evicted != 0)
+    bud_log(config, kBudLogDebug, "freed %d idle contexts", evicted);
 }
 
 
-bud_error_t bud_config_init(bud_config_t* config) {
+bud_error_t bud_config_reload_contexts(bud_config_t* config) {
   int i;
-  int r;
-  bud_context_t* ctx;
+  int count;
+  bud_context_t* fresh;
+  bud_preload_t* preload;
   bud_error_t err;
-  const char* cert_file;
-  const char* key_file;
-  BIO* cert_bio;
-
-  i = 0;
 
-  /* Get addresses of frontend and backend */
-  r = bud_config_str_to_addr(config->frontend.host,
-                             config->frontend.port,
-                             &config->frontend.addr);
-  if (r != 0) {
-    err = bud_error_num(kBudErrPton, r);
-    goto fatal;
+  count = config->context_count + 1;
+  fresh = calloc(count, sizeof(*fresh));
+  if (fresh == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_context_t");
+
+  /* Load everything first, old contexts keep working on failure */
+  for (i = 0; i < count; i++) {
+    fresh[i].servername = config->contexts[i].servername;
+    fresh[i].servername_len = config->contexts[i].servername_len;
+    fresh[i].cert_file = config->contexts[i].cert_file;
+    fresh[i].key_file = config->contexts[i].key_file;
+    fresh[i].cert_files = config->contexts[i].cert_files;
+    fresh[i].key_files = config->contexts[i].key_files;
+    fresh[i].npn = config->contexts[i].npn;
+    fresh[i].ciphers = config->contexts[i].ciphers;
+    fresh[i].ecdh = config->contexts[i].ecdh;
+    fresh[i].engine_id = config->contexts[i].engine_id;
+    fresh[i].verify_client = config->contexts[i].verify_client;
+    fresh[i].client_ca = config->contexts[i].client_ca;
   }
 
-  r = bud_config_str_to_addr(config->backend.host,
-                             config->backend.port,
-                             &config->backend.addr);
-  if (r != 0) {
-    err = bud_error_num(kBudErrPton, r);
-    goto fatal;
+  preload = bud_preload_contexts(config, fresh, count, &err);
+  if (!bud_is_ok(err)) {
+    free(fresh);
+    return err;
   }
 
-  /* Get indexes for SSL_set_ex_data()/SSL_get_ex_data() */
-  if (kBudSSLClientIndex == -1) {
-    kBudSSLClientIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
-    kBudSSLSNIIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
-    if (kBudSSLClientIndex == -1 || kBudSSLSNIIndex == -1)
+  for (i = 0; i < count; i++) {
+    /* Loaded ones go away, and are built from the files on next use */
+    if (i != 0 && config->lazy_contexts.enabled)
+      continue;
+    err = bud_config_load_context(config,
+                                  &fresh[i],
+                                  i,
+                                  preload == NULL ? NULL : &preload[i]);
+    if (!bud_is_ok(err))
       goto fatal;
   }
 
-#ifndef SSL_CTRL_SET_TLSEXT_SERVERNAME_CB
-  if (config->context_count != 0) {
-    err = bud_error(kBudErrSNINotSupported);
-    goto fatal;
-  }
-#endif  /* !SSL_CTRL_SET_TLSEXT_SERVERNAME_CB */
+  /* Swap all at once, `fresh` receives old SSL_CTXs and certs */
+  for (i = 0; i < count; i++)
+    bud_context_swap(&config->contexts[i], &fresh[i]);
+  err = bud_ok();
+  i = count - 1;
 
-  /* Allocate workers */
-  if (!config->is_worker) {
-    config->workers = calloc(config->worker_count, sizeof(*config->workers));
-    if (config->workers == NULL) {
-      err = bud_error_str(kBudErrNoMem, "workers");
-      goto fatal;
-    }
-  }
+  bud_log(config, kBudLogInfo, "reloaded %d contexts", count);
 
-  /* Initialize logger */
-  err = bud_logger_new(config);
-  if (!bud_is_ok(err))
-    goto fatal;
+fatal:
+  bud_preload_free(preload, count);
 
-  if (config->is_worker || config->worker_count == 0) {
-    /* Connect to SNI server */
-    if (config->sni.enabled) {
-      config->sni.pool = bud_http_pool_new(config,
-                                           config->sni.host,
-                                           config->sni.port,
-                                           &err);
-      if (config->sni.pool == NULL)
-        goto fatal;
-    }
+  /* SSL objects hold references to their SSL_CTX, so it is safe */
+  for (; i >= 0; i--)
+    bud_context_free(&fresh[i]);
+  free(fresh);
 
-    /* Connect to OCSP Stapling server */
-    if (config->stapling.enabled) {
-      config->stapling.pool = bud_http_pool_new(config,
-                                                config->stapling.host,
-                                                config->stapling.port,
-                                                &err);
-      if (config->stapling.pool == NULL)
-        goto fatal;
-    }
+  return err;
+}
+
+
+void bud_context_swap(bud_context_t* dst, bud_context_t* src) {
+  SSL_CTX* ctx;
+  X509* cert;
+  X509* issuer;
+  bud_npn_line_t* npn_line;
+  OCSP_CERTID* ocsp_id;
+  char* ocsp_der_id;
+  size_t ocsp_der_id_len;
+  const char* ocsp_url;
+  size_t ocsp_url_len;
+  bud_http_body_t* ocsp_req;
+  bud_http_body_t* ocsp_body;
+
+  ctx = dst->ctx;
+  cert = dst->cert;
+  issuer = dst->issuer;
+  npn_line = dst->npn_line;
+  ocsp_id = dst->ocsp_id;
+  ocsp_der_id = dst->ocsp_der_id;
+  ocsp_der_id_len = dst->ocsp_der_id_len;
+  ocsp_url = dst->ocsp_url;
+  ocsp_url_len = dst->ocsp_url_len;
+  ocsp_req = dst->ocsp_req;
+  ocsp_body = dst->ocsp_body;
+
+  dst->ctx = src->ctx;
+  dst->cert = src->cert;
+  dst->issuer = src->issuer;
+  dst->npn_line = src->npn_line;
+  dst->ocsp_id = src->ocsp_id;
+  dst->ocsp_der_id = src->ocsp_der_id;
+  dst->ocsp_der_id_len = src->ocsp_der_id_len;
+  dst->ocsp_url = src->ocsp_url;
+  dst->ocsp_url_len = src->ocsp_url_len;
+  dst->ocsp_req = src->ocsp_req;
+  dst->ocsp_body = src->ocsp_body;
+
+  src->ctx = ctx;
+  src->cert = cert;
+  src->issuer = issuer;
+  src->npn_line = npn_line;
+  src->ocsp_id = ocsp_id;
+  src->ocsp_der_id = ocsp_der_id;
+  src->ocsp_der_id_len = ocsp_der_id_len;
+  src->ocsp_url = ocsp_url;
+  src->ocsp_url_len = ocsp_url_len;
+  src->ocsp_req = ocsp_req;
+  src->ocsp_body = ocsp_body;
+
+#ifdef OPENSSL_NPN_NEGOTIATED
+  /* Callback's argument should outlive the temporary context */
+  bud_config_set_npn_cb(dst);
+#endif  /* OPENSSL_NPN_NEGOTIATED */
+  bud_verify_swap(dst);
+
+  /* Staple is still good for the same certificate */
+  if (src->cert != NULL &&
+      dst->cert != NULL &&
+      X509_cmp(src->cert, dst->cert) == 0) {
+    return;
   }
 
-  /* Load all contexts */
-  for (i = 0; i < config->context_count + 1; i++) {
+  /* Let bud_context_free() cancel the request and free the staple */
+  src->staple = dst->staple;
+  src->staple_len = dst->staple_len;
+  src->staple_req = dst->staple_req;
+  src->staple_lookup = dst->staple_lookup;
+  dst->staple = NULL;
+  dst->staple_len = 0;
+  dst->staple_expire = 0;
+  dst->staple_refresh = 0;
+  dst->staple_req = NULL;
+  dst->staple_lookup = NULL;
+}
+
+
+bud_error_t bud_config_index_contexts(bud_config_t* config) {
+  int i;
+  bud_context_t* ctx;
+  bud_context_t** bucket;
+
+  /* Power of two, at least twice the context count */
+  config->context_bucket_count = 16;
+  while (config->context_bucket_count < 2 * (uint32_t) config->context_count)
+    config->context_bucket_count <<= 1;
+  config->context_buckets = calloc(config->context_bucket_count,
+                                   sizeof(*config->context_buckets));
+  if (config->context_buckets == NULL)
+    return bud_error_str(kBudErrNoMem, "context index");
+
+  /* Insert in reverse order, so that the first matching context wins */
+  for (i = config->context_count; i >= 1; i--) {
     ctx = &config->contexts[i];
+    if (ctx->servername == NULL)
+      continue;
 
-    err = bud_config_new_ssl_ctx(config, ctx);
-    if (!bud_is_ok(err))
-      goto fatal;
+    ctx->hash = bud_hash_lower(BUD_HASH_INIT,
+                               ctx->servername,
+                               ctx->servername_len);
+    bucket = &config->context_buckets[ctx->hash &
+                                      (config->context_bucket_count - 1)];
+    ctx->hash_next = *bucket;
+    *bucket = ctx;
+  }
 
-    /* Default context */
-    if (i == 0) {
-      cert_file = config->frontend.cert_file;
-      key_file = config->frontend.key_file;
-    } else {
-      cert_file = ctx->cert_file;
-      key_file = ctx->key_file;
-    }
+  return bud_ok();
+}
 
-    cert_bio = BIO_new_file(cert_file, "r");
-    if (cert_bio == NULL) {
-      err = bud_error_str(kBudErrLoadCert, cert_file);
-      goto fatal;
-    }
 
-    r = bud_context_use_certificate_chain(ctx, cert_bio);
-    BIO_free_all(cert_bio);
-    if (!r) {
-      err = bud_error_str(kBudErrParseCert, cert_file);
-      goto fatal;
-    }
+bud_context_t* bud_config_find_context(bud_config_t* config,
+                                       uint32_t hash,
+                                       const char* prefix,
+                                       size_t prefix_len,
+                                       const char* name,
+                                       size_t name_len) {
+  bud_context_t* ctx;
 
-    if (!SSL_CTX_use_PrivateKey_file(ctx->ctx,
-                                     key_file,
-                                     SSL_FILETYPE_PEM)) {
-      err = bud_error_str(kBudErrParseKey, key_file);
-      goto fatal;
-    }
+  ctx = config->context_buckets[hash & (config->context_bucket_count - 1)];
+  for (; ctx != NULL; ctx = ctx->hash_next) {
+    if (ctx->hash != hash || ctx->servername_len != prefix_len + name_len)
+      continue;
+    if (strncasecmp(ctx->servername, prefix, prefix_len) != 0)
+      continue;
+    if (strncasecmp(ctx->servername + prefix_len, name, name_len) != 0)
+      continue;
+    return ctx;
   }
 
-  return bud_ok();
+  return NULL;
+}
 
-fatal:
-  /* Free all allocated contexts */
-  do
-    bud_context_free(&config->contexts[i--]);
-  while (i >= 0);
 
-  return err;
+void bud_context_tune_ssl(bud_context_t* ctx, SSL* ssl) {
+#ifdef SSL_MODE_RELEASE_BUFFERS
+  if (ctx->release_buffers)
+    SSL_set_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+  else
+    SSL_clear_mode(ssl, SSL_MODE_RELEASE_BUFFERS);
+#endif  /* SSL_MODE_RELEASE_BUFFERS */
+
+  SSL_set_max_send_fragment(ssl,
+                            ctx->max_send_fragment > 0 ?
+                                ctx->max_send_fragment :
+                                SSL3_RT_MAX_PLAIN_LENGTH);
+}
+
+
+void bud_context_sid_ctx(bud_context_t* ctx, unsigned char* out) {
+  SHA256_CTX sha;
+
+  /* Same in every worker, the sessions are shared between them */
+  SHA256_Init(&sha);
+  SHA256_Update(&sha, "bud", 3);
+  if (ctx->servername != NULL)
+    SHA256_Update(&sha, ctx->servername, ctx->servername_len);
+  SHA256_Final(out, &sha);
 }
 
 
 bud_context_t* bud_config_select_context(bud_config_t* config,
                                          const char* servername,
                                          size_t servername_len) {
-  int i;
   bud_context_t* ctx;
-
-  /* TODO(indutny): Binary search */
-  for (i = 0; i < config->context_count; i++) {
-    ctx = &config->contexts[i + 1];
-
-    if (servername_len != ctx->servername_len)
-      continue;
-
-    if (strncasecmp(servername, ctx->servername, ctx->servername_len) != 0)
-      break;
-
+  const char* dot;
+  size_t suffix_len;
+  uint32_t hash;
+
+  if (config->context_buckets == NULL)
+    return &config->contexts[0];
+
+  /* Exact match */
+  hash = bud_hash_lower(BUD_HASH_INIT, servername, servername_len);
+  ctx = bud_config_find_context(config,
+                                hash,
+                                "",
+                                0,
+                                servername,
+                                servername_len);
+  if (ctx != NULL)
     return ctx;
+
+  /* `*.example.com` matches exactly one label before `.example.com` */
+  dot = memchr(servername, '.', servername_len);
+  if (dot != NULL && dot != servername) {
+    suffix_len = servername_len - (dot - servername);
+    hash = bud_hash_lower(bud_hash_lower(BUD_HASH_INIT, "*", 1),
+                          dot,
+                          suffix_len);
+    ctx = bud_config_find_context(config, hash, "*", 1, dot, suffix_len);
+    if (ctx != NULL)
+      return ctx;
   }
 
   return &config->contexts[0];
@@ -967,6 +4458,7 @@ int bud_config_select_sni_context(SSL* s, int* ad, void* arg) {
   bud_config_t* config;
   bud_context_t* ctx;
   const char* servername;
+  bud_error_t err;
 
   config = arg;
   servername = SSL_get_servername(s, TLSEXT_NAMETYPE_host_name);
@@ -982,8 +4474,38 @@ int bud_config_select_sni_context(SSL* s, int* ad, void* arg) {
   if (ctx == NULL)
     ctx = bud_config_select_context(config, servername, strlen(servername));
 
-  if (ctx != NULL)
-    SSL_set_SSL_CTX(s, ctx->ctx);
+  /* No match, stay on the listener's default context */
+  if (ctx == NULL || ctx == &config->contexts[0]) {
+    if (!config->frontend.strict_sni)
+      return SSL_TLSEXT_ERR_OK;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+    /* Unless the default certificate is for this name too */
+    if (X509_check_host(SSL_get_certificate(s),
+                        servername,
+                        strlen(servername),
+                        0,
+                        NULL) == 1) {
+      return SSL_TLSEXT_ERR_OK;
+    }
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10002000L */
+
+    /* Still in the ClientHello, nothing is signed yet */
+    *ad = SSL_AD_UNRECOGNIZED_NAME;
+    return SSL_TLSEXT_ERR_ALERT_FATAL;
+  }
+
+  /* Lazy context that fails to build, stay on the default one */
+  err = bud_context_use(config, ctx);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    return SSL_TLSEXT_ERR_OK;
+  }
+  SSL_set_SSL_CTX(s, ctx->ctx);
+
+  /* Verify mode was copied from the listener's context by SSL_new() */
+  SSL_set_verify(s, SSL_CTX_get_verify_mode(ctx->ctx), NULL);
+  bud_context_tune_ssl(ctx, s);
 
   return SSL_TLSEXT_ERR_OK;
 }
@@ -999,11 +4521,55 @@ int bud_config_advertise_next_proto(SSL* s,
 
   context = arg;
 
-  *data = (const unsigned char*) context->npn_line;
-  *len = context->npn_line_len;
+  *data = (const unsigned char*) context->npn_line->data;
+  *len = context->npn_line->len;
+
+  return SSL_TLSEXT_ERR_OK;
+}
+
+
+void bud_config_set_npn_cb(bud_context_t* context) {
+  if (context->npn_line == NULL)
+    return;
+
+  /*
+   * Browsers False Start (send the request before server's Finished) only
+   * if a protocol was negotiated, ALPN is preferred over NPN by them.
+   */
+  SSL_CTX_set_next_protos_advertised_cb(context->ctx,
+                                        bud_config_advertise_next_proto,
+                                        context);
+# ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+  SSL_CTX_set_alpn_select_cb(context->ctx, bud_config_select_alpn, context);
+# endif  /* TLSEXT_TYPE_application_layer_protocol_negotiation */
+}
+
+
+# ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+int bud_config_select_alpn(SSL* s,
+                           const unsigned char** out,
+                           unsigned char* outlen,
+                           const unsigned char* in,
+                           unsigned int inlen,
+                           void* arg) {
+  bud_context_t* context;
+  int r;
+
+  context = arg;
+
+  /* Our order wins, same as for NPN */
+  r = SSL_select_next_proto((unsigned char**) out,
+                            outlen,
+                            (const unsigned char*) context->npn_line->data,
+                            context->npn_line->len,
+                            in,
+                            inlen);
+  if (r != OPENSSL_NPN_NEGOTIATED)
+    return SSL_TLSEXT_ERR_NOACK;
 
   return SSL_TLSEXT_ERR_OK;
 }
+# endif  /* TLSEXT_TYPE_application_layer_protocol_negotiation */
 #endif  /* OPENSSL_NPN_NEGOTIATED */
 
 
@@ -1041,28 +4607,124 @@ int bud_config_str_to_addr(const char* host,
  *
  * Taken from OpenSSL - editted for style.
  */
-int bud_context_use_certificate_chain(bud_context_t* ctx, BIO *in) {
-  int ret;
+int bud_context_has_extra_cert(bud_context_t* ctx, X509* cert) {
+  int i;
+  STACK_OF(X509)* certs;
+
+  certs = ctx->ctx->extra_certs;
+  if (certs == NULL)
+    return 0;
+
+  for (i = 0; i < sk_X509_num(certs); i++)
+    if (X509_cmp(sk_X509_value(certs, i), cert) == 0)
+      return 1;
+  return 0;
+}
+
+
+int bud_context_use_certificate_chain(bud_config_t* config,
+                                      bud_context_t* ctx,
+                                      BIO *in,
+                                      int primary) {
+  STACK_OF(X509)* chain;
+
+  chain = bud_config_read_pem_chain(in);
+  if (chain == NULL)
+    return 0;
+
+  return bud_context_use_x509_chain(config,
+                                    ctx,
+                                    sk_X509_shift(chain),
+                                    chain,
+                                    primary);
+}
+
+
+void bud_context_compress_certs(bud_config_t* config, bud_context_t* ctx) {
+#ifdef SSL_OP_NO_TX_CERTIFICATE_COMPRESSION
+  if (!config->frontend.cert_compression)
+    return;
+
+  /*
+   * TLS 1.3 clients that offer zlib/brotli/zstd get the smaller chain, so
+   * the first flight fits into the initial window. 0 - every algorithm
+   * OpenSSL is built with, none of them is an error.
+   */
+  if (!SSL_CTX_compress_certs(ctx->ctx, 0)) {
+    bud_log(config,
+            kBudLogDebug,
+            "failed to compress certificates of \"%.*s\"",
+            (int) ctx->servername_len,
+            ctx->servername);
+    ERR_clear_error();
+  }
+#endif  /* SSL_OP_NO_TX_CERTIFICATE_COMPRESSION */
+}
+
+
+STACK_OF(X509)* bud_config_read_pem_chain(BIO* in) {
   X509* x;
   X509* ca;
-  X509_STORE* store;
-  X509_STORE_CTX store_ctx;
-  int r;
+  STACK_OF(X509)* chain;
   unsigned long err;
 
   ERR_clear_error();
 
-  ret = 0;
   x = PEM_read_bio_X509_AUX(in, NULL, NULL, NULL);
-
   if (x == NULL) {
     SSLerr(SSL_F_SSL_CTX_USE_CERTIFICATE_CHAIN_FILE, ERR_R_PEM_LIB);
-    goto end;
+    return NULL;
+  }
+
+  chain = sk_X509_new_null();
+  if (chain == NULL || !sk_X509_push(chain, x)) {
+    X509_free(x);
+    goto fatal;
+  }
+
+  while ((ca = PEM_read_bio_X509(in, NULL, NULL, NULL)) != NULL) {
+    if (!sk_X509_push(chain, ca)) {
+      X509_free(ca);
+      goto fatal;
+    }
   }
 
+  /* When the while loop ends, it's usually just EOF. */
+  err = ERR_peek_last_error();
+  if (ERR_GET_LIB(err) != ERR_LIB_PEM ||
+      ERR_GET_REASON(err) != PEM_R_NO_START_LINE) {
+    /* some real error */
+    goto fatal;
+  }
+  ERR_clear_error();
+
+  return chain;
+
+fatal:
+  if (chain != NULL)
+    sk_X509_pop_free(chain, X509_free);
+  return NULL;
+}
+
+
+int bud_context_use_x509_chain(bud_config_t* config,
+                               bud_context_t* ctx,
+                               X509* x,
+                               STACK_OF(X509)* chain,
+                               int primary) {
+  int ret;
+  X509* ca;
+  X509_STORE* store;
+  X509_STORE_CTX store_ctx;
+  int r;
+
+  ERR_clear_error();
+
   ret = SSL_CTX_use_certificate(ctx->ctx, x);
-  ctx->cert = x;
-  ctx->issuer = NULL;
+  if (primary) {
+    ctx->cert = x;
+    ctx->issuer = NULL;
+  }
 
   if (ERR_peek_error() != 0) {
     /* Key/certificate mismatch doesn't imply ret==0 ... */
@@ -1074,12 +4736,27 @@ int bud_context_use_certificate_chain(bud_context_t* ctx, BIO *in) {
      * If we could set up our certificate, now proceed to
      * the CA certificates.
      */
-    if (ctx->ctx->extra_certs != NULL) {
+    if (primary && ctx->ctx->extra_certs != NULL) {
       sk_X509_pop_free(ctx->ctx->extra_certs, X509_free);
       ctx->ctx->extra_certs = NULL;
     }
 
-    while ((ca = PEM_read_bio_X509(in, NULL, NULL, NULL))) {
+    while (sk_X509_num(chain) > 0) {
+      ca = sk_X509_shift(chain);
+
+      /* Contexts chaining to the same intermediate share one copy */
+      if (config->cert_cache != NULL)
+        ca = bud_cert_cache_intern(config->cert_cache, ca);
+
+      /*
+       * NOTE: OpenSSL 1.0.1 has one chain per SSL_CTX, all pairs send it.
+       * Don't send intermediates shared by them twice.
+       */
+      if (!primary && bud_context_has_extra_cert(ctx, ca)) {
+        X509_free(ca);
+        continue;
+      }
+
       r = SSL_CTX_add_extra_chain_cert(ctx->ctx, ca);
 
       if (!r) {
@@ -1095,24 +4772,17 @@ int bud_context_use_certificate_chain(bud_context_t* ctx, BIO *in) {
        */
 
       /* Find issuer */
-      if (ctx->issuer != NULL || X509_check_issued(ca, x) != X509_V_OK)
+      if (!primary ||
+          ctx->issuer != NULL ||
+          X509_check_issued(ca, x) != X509_V_OK) {
         continue;
+      }
       ctx->issuer = ca;
     }
-
-    /* When the while loop ends, it's usually just EOF. */
-    err = ERR_peek_last_error();
-    if (ERR_GET_LIB(err) == ERR_LIB_PEM &&
-        ERR_GET_REASON(err) == PEM_R_NO_START_LINE) {
-      ERR_clear_error();
-    } else  {
-      /* some real error */
-      ret = 0;
-    }
   }
 
 end:
-  if (ret) {
+  if (ret && primary) {
     /* Try getting issuer from cert store */
     if (ctx->issuer == NULL) {
       store = SSL_CTX_get_cert_store(ctx->ctx);
@@ -1132,20 +4802,27 @@ end:
 
     if (ctx->issuer != NULL) {
       /* Get ocsp_id */
-      ctx->ocsp_id = OCSP_cert_to_id(NULL, ctx->cert, ctx->issuer);
+      if (config->cert_cache != NULL) {
+        ctx->ocsp_id = bud_cert_cache_ocsp_id(config->cert_cache,
+                                              ctx->cert,
+                                              ctx->issuer);
+      } else {
+        ctx->ocsp_id = OCSP_cert_to_id(NULL, ctx->cert, ctx->issuer);
+      }
       if (ctx->ocsp_id == NULL) {
         ctx->issuer = NULL;
         goto fatal;
       }
     }
-  } else {
+  } else if (!ret && primary) {
     if (ctx->issuer != NULL)
       X509_free(ctx->issuer);
   }
 
 fatal:
-  if (ctx->cert != x && x != NULL)
+  if (ctx->cert != x)
     X509_free(x);
+  sk_X509_pop_free(chain, X509_free);
 
   return ret;
 }
@@ -2,29 +2,88 @@
 #define SRC_CONFIG_H_
 
 #include <stdint.h>
+#include <time.h>  /* time_t */
 
 #include "uv.h"
+#include "ringbuffer.h"
 #include "openssl/bio.h"
 #include "openssl/ocsp.h"
 #include "openssl/ssl.h"
 #include "openssl/x509.h"
 #include "parson.h"
 
+#include "arena.h"
+#include "backend.h"
 #include "common.h"
 #include "error.h"
+#include "ipc.h"
+#include "metrics.h"
+#include "queue.h"
+#include "ratelimit.h"
+#include "slab.h"
+#include "timer-wheel.h"
 
 /* Forward declarations */
 struct bud_server_s;
 struct bud_worker_s;
 struct bud_logger_s;
+struct bud_access_s;
+struct bud_fingerprint_s;
 struct bud_http_pool_s;
+struct bud_lookup_s;
+struct bud_lookup_req_s;
+struct bud_session_cache_s;
+struct bud_shared_cache_s;
+struct bud_snapshot_s;
+struct bud_ticket_ring_s;
+struct bud_sni_cache_s;
+struct bud_cert_cache_s;
+struct bud_http_request_s;
+struct bud_http_body_s;
+struct bud_ocsp_responder_s;
+struct bud_ocsp_watch_s;
+struct bud_engine_s;
+struct bud_ratelimit_s;
+struct bud_handoff_s;
+
+/* Flush queues: handshakes, then interactive clients, then bulk ones */
+#define BUD_FLUSH_CLASSES 3
+
+/* `frontend.proxyline` versions */
+#define BUD_PROXYLINE_V1 1
+#define BUD_PROXYLINE_V2 2
+
+/* PROXY protocol v2 header with IPv6 addresses, see server.c */
+#define BUD_PROXYLINE_V2_MAX 52
+
+/* ...and with TLVs of the TLS connection, the rest of them is left out */
+#define BUD_PROXYLINE_V2_TLV_MAX 768
 
 typedef struct bud_context_s bud_context_t;
+typedef struct bud_npn_line_s bud_npn_line_t;
 typedef struct bud_config_http_pool_s bud_config_http_pool_t;
+typedef struct bud_config_buffer_s bud_config_buffer_t;
+typedef struct bud_config_listener_s bud_config_listener_t;
+typedef struct bud_config_strs_s bud_config_strs_t;
 typedef struct bud_config_s bud_config_t;
 
 int kBudSSLClientIndex;
 int kBudSSLSNIIndex;
+int kBudSSLConfigIndex;
+
+/* Array of strings from the config file, non-strings in it are NULL */
+struct bud_config_strs_s {
+  int count;
+  const char* items[1];
+};
+
+/* Wire encoding of the NPN list, shared by contexts with the same list */
+struct bud_npn_line_s {
+  QUEUE member;
+  int refcount;
+  size_t len;
+  char data[1];
+};
 
 struct bud_context_s {
   /* From config file */
@@ -33,21 +92,87 @@ struct bud_context_s {
 
   const char* cert_file;
   const char* key_file;
-  const JSON_Array* npn;
+
+  /* Both `cert` and `key` may be arrays, i.e. RSA and ECDSA pairs */
+  const bud_config_strs_t* cert_files;
+  const bud_config_strs_t* key_files;
+  const bud_config_strs_t* npn;
   const char* ciphers;
   const char* ecdh;
+  const bud_backend_confs_t* backend_list;
+
+  /* OpenSSL ENGINE for the private key, NULL - global `engine` */
+  const char* engine_id;
+
+  /* Client certificates: "none", "optional" or "require", NULL - frontend's */
+  const char* verify_client;
+  const char* client_ca;
+
+  /* DER OCSP response kept fresh by someone else, stapled instead of fetched */
+  const char* ocsp_file;
+
+  /* CRLs from the `crl` backend, refreshed in background (see verify.c) */
+  STACK_OF(X509_CRL)* crls;
+  uint32_t crl_gen;
+  time_t crl_refresh;
+  struct bud_http_request_s* crl_req;
 
   /* Various */
   SSL_CTX* ctx;
   X509* cert;
   X509* issuer;
-  char* npn_line;
-  size_t npn_line_len;
+  bud_npn_line_t* npn_line;
   OCSP_CERTID* ocsp_id;
   char* ocsp_der_id;
   size_t ocsp_der_id_len;
   const char* ocsp_url;
   size_t ocsp_url_len;
+
+  /* Built once per certificate: DER OCSP request and stapling backend's body */
+  struct bud_http_body_s* ocsp_req;
+  struct bud_http_body_s* ocsp_body;
+
+  /* DER OCSP response, refreshed in background (see ocsp.c) */
+  char* staple;
+  size_t staple_len;
+  time_t staple_expire;
+  time_t staple_refresh;
+
+  /* `lazy_contexts`: last handshake, SSL_CTX is freed when it gets old */
+  time_t last_used;
+  struct bud_http_request_s* staple_req;
+  struct bud_lookup_req_s* staple_lookup;
+
+  /* Servername's own `backends`, empty - use the global ones */
+  bud_backend_list_t backends;
+
+  /* Shared by context's connections, see `frontend.bandwidth.context` */
+  int bandwidth;
+  bud_shape_t shape;
+
+  /* See `frontend.release_buffers`, applied to the SSLs that switch to it */
+  int release_buffers;
+  int max_send_fragment;
+
+  /* Tenant isolation, see `frontend.quota` */
+  struct {
+    int connections;
+    int handshakes;
+
+    /* internal */
+    int active;
+    bud_shape_t bucket;
+  } quota;
+
+  /* Only for shared SNI contexts, see bud_sni_context_new() */
+  int refcount;
+
+  /* Row of `metrics.breakdown`, looked up on the first handshake */
+  bud_metrics_row_t* metrics_row;
+
+  /* Next context in the servername index bucket */
+  bud_context_t* hash_next;
+  uint32_t hash;
 };
 
 struct bud_config_http_pool_s {
@@ -57,81 +182,811 @@ struct bud_config_http_pool_s {
   const char* host;
   const char* query_fmt;
 
+  /* `host` may be an array of upstreams, `host` is its first item then */
+  const bud_config_strs_t* hosts;
+
+  /* Response cache, currently used only by SNI */
+  struct {
+    int size;
+    int ttl;
+    int negative_ttl;
+    int stale_ttl;
+
+    /* Parsed DER certificates and keys, see cert-cache.h */
+    int certs;
+  } cache;
+
+  /* Skip the backend, talk to the OCSP responders (used only by stapling) */
+  int direct;
+
+  /* Read `<servername>.pem` files from here instead (used only by SNI) */
+  const char* directory;
+
+  /* Open connections cap and per-request deadline in ms, 0 - unbounded */
+  int max_connections;
+  int timeout;
+
+  /* GETs in flight on one connection, 1 - no pipelining */
+  int pipeline;
+
+  /*
+   * Idle connection expiry, and circuit breaker: after `max_fails` failed
+   * connections in a row requests fail fast for `backoff` ms, doubled on
+   * each failed probe up to `max_backoff`. 0 - disabled
+   */
+  int idle_timeout;
+  int max_fails;
+  int backoff;
+  int max_backoff;
+
+  /* Hostnames in `host` are looked up again this often in ms, 0 - once */
+  int resolve_interval;
+
+  /*
+   * GET that isn't answered in p95 of recent response times (but not
+   * sooner than `hedge` ms) is sent to another address too, 0 - disabled
+   */
+  int hedge;
+
+  /*
+   * Talk the binary lookup protocol over one persistent connection to the
+   * first `host` instead of HTTP (used only by SNI and stapling)
+   */
+  int binary;
+
   /* internal */
   struct bud_http_pool_s* pool;
+  struct bud_lookup_s* lookup;
+};
+
+struct bud_config_buffer_s {
+  int chunk_size;
+  int chunk_count;
+
+  /*
+   * Chunks of bulk connections (0 - fixed size), interactive ones get one.
+   * Watermarks are scaled with the count
+   */
+  int bulk_count;
+
+  /* Bytes, the other side is throttled at high and resumed at low mark */
+  int high_watermark;
+  int low_watermark;
+
+  /* Map each buffer twice back-to-back, so that data never wraps */
+  int mirror;
+
+  /*
+   * Socket's SO_SNDBUF, SO_RCVBUF and TCP_NOTSENT_LOWAT, 0 - kernel's
+   * default, BUD_CONFIG_SOCKET_AUTO ("auto") - from the watermarks above
+   */
+  int sndbuf;
+  int rcvbuf;
+  int notsent_lowat;
+};
+
+#define BUD_CONFIG_SOCKET_AUTO -1
+
+/*
+ * Address to accept clients on: `frontend` itself is the first one, items
+ * of `frontends` follow. Everything else is shared with `frontend`.
+ */
+struct bud_config_listener_s {
+  uint16_t port;
+  const char* host;
+
+  /* IPv6 address accepts IPv4 clients too, unless this is set */
+  int ipv6only;
+
+  /* `servername` of one of `contexts`, NULL - the `frontend`'s one */
+  const char* context_name;
+
+  /* internal */
+  struct sockaddr_storage addr;
+  bud_context_t* context;
+  struct bud_server_s* server;
+
+  /* Used by client.c, v2 template has only the source address missing */
+  char proxyline_fmt[256];
+  char proxyline_v2[BUD_PROXYLINE_V2_MAX];
+  size_t proxyline_v2_len;
 };
 
 struct bud_config_s {
-  /* Internal, just to keep stuff allocated */
-  JSON_Value* json;
+  /*
+   * Strings and lists of the config file, copied out of the parsed JSON
+   * (which is freed right after bud_config_load())
+   */
+  bud_arena_t arena;
 
   /* Just internal things */
   uv_loop_t* loop;
+  const char* path;
   int argc;
   char** argv;
   char exepath[1024];
-  struct bud_server_s* server;
   struct bud_logger_s* logger;
 
   /* Master state */
   struct {
     uv_signal_t sigterm;
     uv_signal_t sigint;
+    uv_signal_t sighup;
+    uv_signal_t sigusr1;
+    uv_signal_t sigusr2;
   } signal;
+
+  /*
+   * Binary upgrade, see bud_master_upgrade(). Old master: the new one, and
+   * the pipe it reports readiness on, then `retiring` - draining workers.
+   * New master: `inherited` listening sockets, `adopted` - bitmask of the
+   * ones that were matched to listeners.
+   */
+  struct {
+    uv_process_t proc;
+    uv_pipe_t pipe;
+    uv_timer_t timer;
+    int spawned;
+    int waiting;
+    int retiring;
+    int child;
+    int inherited;
+    uint64_t adopted;
+  } upgrade;
+
+  /*
+   * Two generations of `worker_slots` workers (`workers_spare` of which are
+   * standby), see bud_master_reload()
+   */
   struct bud_worker_s* workers;
+  int worker_slots;
+  int worker_base;
   int last_worker;
   int pending_accept;
+  uv_timer_t stapling_timer;
+  uv_timer_t ticket_timer;
+  bud_slab_t master_msg_slab;
+
+  /* `workers_autoscale` checks, and how many in a row were quiet */
+  uv_timer_t autoscale_timer;
+  int autoscale_quiet;
+
+  /* Checks heartbeats of the workers, see `workers_watchdog` */
+  uv_timer_t watchdog_timer;
+  int* worker_cpus;
 
   /* Worker state */
   uv_pipe_t ipc;
+  bud_ipc_t ipc_parser;
 
-  /* Used by client.c */
-  char proxyline_fmt[256];
+  /* Tag of the issued sessions, from kBudIPCIdentity (-1 - none yet) */
+  int worker_id;
+
+  /*
+   * Listener of the next handle, from kBudIPCBalance (or kBudIPCListen -
+   * `ipc_listen` is set then, the handle is the listening socket)
+   */
+  int ipc_listener;
+  int ipc_listen;
+
+  /* Relay that waits for its sockets, and retries of busy ones on drain */
+  struct bud_handoff_s* handoff;
+  uv_timer_t handoff_timer;
+  int handoff_timer_init;
+  uv_timer_t load_timer;
+  uint64_t load_last;
+
+  /* Samples loop lag for `frontend.max_lag`, see worker.c */
+  uv_timer_t lag_timer;
+  uint64_t lag_last;
+  int shedding;
+  ringbuffer_pool buffer_pool;
+  ringbuffer_pool frontend_pool;
+  ringbuffer_pool backend_pool;
+  bud_slab_t client_slab;
+  bud_slab_t handshake_slab;
+  bud_slab_t http_req_slab;
+  bud_slab_t http_conn_slab;
+  struct bud_sni_cache_s* sni_cache;
+  struct bud_cert_cache_s* cert_cache;
+  struct bud_ocsp_responder_s* ocsp_responders;
+
+  /* Contexts with `ocsp_file`, and their directories' watchers (ocsp.c) */
+  int ocsp_files;
+  struct bud_ocsp_watch_s* ocsp_watches;
+  int draining;
+
+  /* Clients over `frontend.handshake_limit`, see client.c */
+  uv_idle_t handshake_idle;
+  int handshake_idle_init;
+
+  /* Non-blocking loop iterations after a wakeup, see `busy_poll.spin` */
+  uv_check_t spin_check;
+  uv_idle_t spin_idle;
+  int spin_init;
+  uint64_t spin_deadline;
+
+  /*
+   * Clients with pending writes, flushed once per loop iteration in order
+   * of the classes. `flush_bytes` - frontend bytes handed to the kernel
+   */
+  uv_check_t flush_check;
+  uv_idle_t flush_idle;
+  int flush_init;
+  QUEUE flush_queues[BUD_FLUSH_CLASSES];
+  uint64_t flush_bytes;
+
+  /* Clients with unreported `frontend.zerocopy` writes, see client.c */
+  uv_timer_t zerocopy_timer;
+  int zerocopy_init;
+  QUEUE zerocopy_queue;
+
+  /* Clients over `frontend.cycle_budget`, continued on the next iteration */
+  uv_idle_t budget_idle;
+  int budget_init;
+  QUEUE budget_queue;
+
+  /* Cleared SSL objects, see `pool.ssl_objects` */
+  SSL** ssl_pool;
+  int ssl_pool_count;
+
+  /* Closed clients, freed within `pool.teardown_budget` per iteration */
+  uv_idle_t teardown_idle;
+  int teardown_init;
+  QUEUE teardown_queue;
+
+  /* Trims buffers of quiet clients over `pool.budget` */
+  uv_timer_t reclaim_timer;
+  int reclaim_init;
+
+  /* Samples TCP_INFO of long-lived clients, `metrics.tcp_info.interval` */
+  uv_timer_t tcp_info_timer;
+  int tcp_info_init;
+
+  /* Reads that won't fit into the chunk's tail, see bud_client_alloc_cb() */
+  char* read_buf;
+
+  /* Records gathered across chunks, see bud_client_coalesce() */
+  char record[SSL3_RT_MAX_PLAIN_LENGTH];
+
+  /* Extra event loops of `threads`, see threads.c */
+  struct bud_thread_s* threads;
+  int thread_started;
+  struct bud_config_s* thread_parent;
+
+  /* Sockets over `frontend.handshake_limit`, see bud_threads_offer() */
+  struct bud_steal_s* steals;
+  struct bud_steal_s* steal;
+  uv_async_t steal_async;
+
+  /* Frees idle lazy contexts */
+  uv_timer_t lazy_timer;
+  int lazy_timer_init;
+  QUEUE handshake_parked;
+  uint64_t handshake_tick;
+  int handshake_count;
+
+  /* Full handshakes in progress and waiting, `frontend.max_handshakes` */
+  QUEUE handshake_waiting;
+  int handshake_active;
+  int handshake_waiting_count;
+
+  /* Worker's clients, least recently active first */
+  QUEUE clients;
+
+  /* Closed clients, for `log.trace.sample` */
+  uint64_t trace_seq;
+
+  /* File of `log.capture`, -1 if disabled, and its sampled clients */
+  int capture_fd;
+  uint64_t capture_seq;
+
+  /* Timeouts of `frontend.timeout`, see client.c */
+  bud_timer_wheel_t client_wheel;
+  int client_wheel_init;
+
+  /* `frontend.rate_limit` buckets, NULL if disabled */
+  struct bud_ratelimit_s* ratelimit;
+
+  /* `frontend.access` lists, NULL if both are empty */
+  struct bud_access_s* access;
+
+  /* `frontend.fingerprint` checks of hellos, NULL if disabled */
+  struct bud_fingerprint_s* fingerprint;
+
+  /* Pauses of `frontend.bandwidth`, see client.c */
+  bud_timer_wheel_t shape_wheel;
+  int shape_wheel_init;
+
+  /* `frontend.io_uring` writes, NULL if disabled or not supported */
+  struct bud_uring_s* uring;
+
+  /* Interned NPN lines, see bud_config_encode_npn() */
+  QUEUE npn_lines;
+
+  /* Parsed `ciphers` and `ecdh` of the contexts, see config.c */
+  QUEUE ssl_templates;
+
+  /* `workers_balance` is "ip-hash", "sni" or "session" */
+  int workers_ip_hash;
+  int workers_sni_hash;
+  int workers_session_hash;
 
   /* Options from config file */
   int worker_count;
+  /* `workers_affinity`: "auto", or the CPUs (`affinity_cpu_count` of them) */
+  const char* workers_affinity;
+  const int* affinity_cpus;
+  int affinity_cpu_count;
+  int workers_membind;
+
+  /* Low-latency mode for dedicated cores, microseconds */
+  struct {
+    int spin;
+    int sockets;
+  } busy_poll;
+  const char* workers_balance;
+  int spare_count;
+
+  /* `workers_autoscale`: up to `max` serving workers, 0 - fixed count */
+  struct {
+    int max;
+    int lag;
+    int cpu;
+    int interval;
+    int warmup;
+  } autoscale;
+
+  /*
+   * `workers_watchdog`: worker that sent nothing for `misses` load reports
+   * gets no clients, and is restarted after `grace` ms more (0 - off)
+   */
+  struct {
+    int misses;
+    int grace;
+  } watchdog;
   int restart_timeout;
+  int drain_timeout;
+  int drain_handoff;
+  int load_threads;
+  int snapshot_enabled;
+  int thread_count;
   int is_daemon;
   int is_worker;
+
+  /* Standby worker, waiting for kBudIPCPromote before serving */
+  int is_spare;
   struct {
     const char* level;
     const char* facility;
     int stdio;
     int syslog;
+
+    /* Write from a thread, queueing up to `queue` lines */
+    int async;
+    int queue;
+
+    /* Notice and warning lines per second from one place, 0 - no limit */
+    int limit;
+
+    /* Line per connection, with the timings */
+    int access;
+
+    /*
+     * Handshake phases of one in `sample` connections, and of every one
+     * that took at least `slow` ms. 0 - disabled
+     */
+    struct {
+      int sample;
+      int slow;
+    } trace;
+
+    /* Record one in `sample` connections for bud-bench-replay */
+    struct {
+      const char* path;
+      int sample;
+    } capture;
   } log;
 
+  /* Prometheus endpoint of the master, disabled if `port` is 0 */
   struct {
     uint16_t port;
     const char* host;
+
+    /* Loop and callback timings, costs a clock read on every callback */
+    int timing;
+
+    /* Rows per table of per-context and per-backend values, 0 - disabled */
+    int breakdown;
+
+    /*
+     * Kernel's TCP_INFO of the clients at the handshake, at close and every
+     * `interval` ms in between (0 - never), Linux only
+     */
+    struct {
+      int enabled;
+      int interval;
+    } tcp_info;
+
+    /* internal */
+    uint64_t values[kBudMetricCount];
+    bud_metrics_table_t* tables[kBudMetricsTableCount];
+    uv_tcp_t server;
+    int server_init;
+    uv_prepare_t prepare;
+    uv_check_t check;
+    int loop_init;
+    uint64_t poll_end;
+  } metrics;
+
+  /* Control socket of the master, disabled if `path` is NULL */
+  struct {
+    const char* path;
+
+    /* internal */
+    uv_pipe_t server;
+    int server_init;
+    uint32_t last_id;
+    QUEUE waiting;
+  } admin;
+
+  struct {
+    int lazy_buffers;
+    int low_watermark;
+    int high_watermark;
+
+    /* Bytes of client buffers, and quiet time (ms) before trimming */
+    int budget;
+    int trim_idle;
+
+    /* Microseconds of closed clients' teardown per loop iteration */
+    int teardown_budget;
+
+    /* SSL objects of closed clients kept for reuse */
+    int ssl_objects;
+
+    /* Chunks preallocated for each of frontend and backend buffers */
+    int reserve;
+    int huge_pages;
+  } pool;
+
+  struct {
+    uint16_t port;
+    const char* host;
+    int ipv6only;
     int proxyline;
+    int accept_proxyline;
+    int passthrough;
     int keepalive;
+    int reuseport;
+    int shared_listen;
+    int backlog;
+
+    /*
+     * Linux: clients that sent nothing for `defer_accept` seconds are not
+     * accepted, `fastopen` - queue of TFO requests. 0 - disabled
+     */
+    int defer_accept;
+    int fastopen;
+    int accept_limit;
+    int handshake_limit;
+    int max_handshakes;
+    int handshake_queue;
+    int cycle_budget;
+    int flush_interactive;
+    int flush_budget;
+    int io_uring;
+    int max_clients;
+    int max_lag;
+    int shed_idle;
     const char* security;
     int server_preference;
-    const JSON_Array* npn;
+    int prioritize_chacha;
+
+    /* TCP_CORK the frontend until the first server flight is written */
+    int cork_handshake;
+
+    /*
+     * Defaults of contexts: free OpenSSL's record buffers of idle clients,
+     * and the largest plaintext of a record (0 - OpenSSL's 16384)
+     */
+    int release_buffers;
+    int max_send_fragment;
+
+    /* Servernames that match no context are refused with an alert */
+    int strict_sni;
+
+    /* Plain HTTP requests get a redirect to https:// instead of TLS */
+    int http_redirect;
+
+    /* RFC 8879 certificate compression, precomputed per context */
+    int cert_compression;
+
+    /* Writes of at least this many bytes use MSG_ZEROCOPY, 0 - never */
+    int zerocopy;
+    const bud_config_strs_t* npn;
     const char* ciphers;
     const char* ecdh;
+    const char* verify_client;
+    const char* client_ca;
     const char* cert_file;
     const char* key_file;
+    const bud_config_strs_t* cert_files;
+    const bud_config_strs_t* key_files;
     int reneg_window;
     int reneg_limit;
     int ssl3;
+    int early_data;
+    bud_config_buffer_t buffer;
+    const char* ticket_key;
+    const char* ticket_key_file;
+    int ticket_rotate;
+    int ticket_previous;
+
+    /* Gather backend data into records of `size`, waiting up to `delay` */
+    struct {
+      int size;
+      int delay;
+    } coalesce;
+
+    /*
+     * Records of `initial` size until `boost_after` bytes are sent, and
+     * again after `idle_reset` ms of silence. 0 - always full-size records
+     */
+    struct {
+      int initial;
+      int boost_after;
+      int idle_reset;
+    } record;
+
+    /*
+     * Token bucket per peer address: `rate` connections per second, up to
+     * `burst` at once. `shared` - file to share buckets between workers
+     */
+    struct {
+      int rate;
+      int burst;
+      int size;
+      const char* shared;
+    } rate_limit;
+
+    /*
+     * CIDRs to allow and to deny, each is an array or a path of the file
+     * with one per line (`*_file`). Checked before anything is done on
+     * accept
+     */
+    struct {
+      const bud_config_strs_t* allow;
+      const bud_config_strs_t* deny;
+      const char* allow_file;
+      const char* deny_file;
+    } access;
+
+    /*
+     * JA3 hashes of ClientHellos to deny (array or file). Once more than
+     * `flood` hellos come in a second (per worker), the fingerprint with
+     * `share` percent of them is denied for `ttl` seconds. 0 - no detector
+     */
+    struct {
+      const bud_config_strs_t* deny;
+      const char* deny_file;
+      int flood;
+      int share;
+      int ttl;
+    } fingerprint;
+
+    /*
+     * Bytes per second from backends: to every `connection`, and to all
+     * connections of a `context` (per worker). Reads from the backend are
+     * paused once the bucket of `burst` bytes is empty. 0 - no limit
+     */
+    struct {
+      int connection;
+      int context;
+      int burst;
+    } bandwidth;
+
+    /*
+     * Defaults for contexts' `quota`: concurrent `connections`, and full
+     * `handshakes` per second (per worker). 0 - no limit
+     */
+    struct {
+      int connections;
+      int handshakes;
+
+      /* internal */
+      int enabled;
+    } quota;
+
+    /*
+     * Close connections without finished handshake, without any data read,
+     * or with a write pending for that long (in ms). 0 - no timeout
+     */
+    struct {
+      int handshake;
+      int idle;
+      int write;
+    } timeout;
 
     /* internal */
-    struct sockaddr_storage addr;
     const SSL_METHOD* method;
+    struct bud_ticket_ring_s* ticket_ring;
+
+    /* Key is derived from `ticket_key`, not rotated */
+    int ticket_fixed;
   } frontend;
 
   struct {
     uint16_t port;
     const char* host;
     int keepalive;
+    bud_config_buffer_t buffer;
+    const char* balance;
+
+    /* "peak-ewma": weight of the old latency halves in that many ms */
+    int ewma_decay;
+
+    /* Connect only after successful handshake */
+    int lazy_connect;
+
+    /* Linux: TCP Fast Open, first write goes out in the SYN */
+    int fastopen;
+
+    /*
+     * Hostnames of `backends` are looked up again every `resolve_interval`
+     * ms (0 - only on start). Addresses are raced, the next one is tried if
+     * the connect hasn't finished in `happy_eyeballs` ms (0 - one at a time)
+     */
+    int resolve_interval;
+    int happy_eyeballs;
+
+    /* Default for backends: read right after the handshake */
+    int server_first;
+
+    /* Return idle HTTP/1.1 keepalive connections to `pool` on client close */
+    int http_reuse;
+
+    /* Insert X-Forwarded-For and X-Forwarded-Proto into the requests */
+    int xforward;
+
+    /*
+     * Connect only once the headers of the first request are read, and
+     * `body` bytes of its body (or all of a shorter one)
+     */
+    struct {
+      int enabled;
+      int body;
+    } buffer_request;
+
+    /*
+     * Slow clients: the backend is read on, and up to `max` bytes over
+     * `frontend.buffer` go to a file of `dir` (NULL - off), tmpfs is best
+     */
+    struct {
+      const char* dir;
+      int max;
+    } spill;
+
+    /* Passive ejection, and active checks if `interval` is not zero */
+    struct {
+      int interval;
+      int max_fails;
+      int fail_timeout;
+      int fail_fast;
+    } health;
+
+    /* Warm connections, `max_idle: 0` disables the pool */
+    struct {
+      int min_idle;
+      int max_idle;
+      int idle_timeout;
+    } pool;
+
+    /*
+     * TLS to backends (`enabled` may be overridden in `backends`). PROXY
+     * header precedes the TLS. `ca` - verify backends' certificates, last
+     * session of each backend is kept by every worker for resumption
+     */
+    struct {
+      int enabled;
+      const char* servername;
+      const char* ciphers;
+      const char* ca;
+      int session_reuse;
+
+      /* internal */
+      SSL_CTX* ctx;
+    } tls;
 
     /* internal */
-    struct sockaddr_storage addr;
+    const bud_backend_confs_t* list;
+    const bud_backend_confs_t* h2_list;
+    bud_backend_balance_t balance_type;
+    int defer;
+    uv_timer_t resolve_timer;
+    int resolve_init;
   } backend;
 
+  /* OpenSSL ENGINE, `defaults` - methods to route to it ("ALL", "RSA,EC") */
+  struct {
+    const char* id;
+    const char* path;
+    const char* defaults;
+    int async;
+
+    /* internal */
+    int ready;
+    struct bud_engine_s* global;
+    struct bud_engine_s* list;
+  } engine;
+
+  /* `frontend` and `frontends`, each with its own server */
+  int listener_count;
+  bud_config_listener_t* listeners;
+
+  /* `backends`, or just a `backend` if there is no list */
+  bud_backend_list_t backends;
+
+  /* `h2_backends`, for clients that negotiated "h2" */
+  bud_backend_list_t h2_backends;
+
   bud_config_http_pool_t sni;
   bud_config_http_pool_t stapling;
+  bud_config_http_pool_t session;
+
+  /* CRLs for the contexts that verify client certificates */
+  bud_config_http_pool_t crl;
+
+  struct {
+    int enabled;
+    int size;
+    int timeout;
+
+    /* internal */
+    struct bud_session_cache_s* cache;
+  } session_cache;
+
+  /* Client chain verification results, ttl and CRL refresh are in seconds */
+  struct {
+    int size;
+    int ttl;
+    int crl_refresh;
+
+    /* internal */
+    struct bud_verify_cache_s* cache;
+  } verify_cache;
+
+  /* SSL_CTXs of `contexts` are built on first use, see bud_context_use() */
+  struct {
+    int enabled;
+    int idle_timeout;
+  } lazy_contexts;
+
+  /* SNI responses and staples shared by workers, see shared-cache.h */
+  struct {
+    int enabled;
+    int size;
+
+    /* internal */
+    struct bud_shared_cache_s* cache;
+  } shared_cache;
+
+  /* SNI responses and staples kept across restarts, see disk-cache.h */
+  struct {
+    int enabled;
+    const char* path;
+    int size;
+
+    /* internal */
+    struct bud_disk_cache_s* cache;
+  } disk_cache;
+
+  /* Parsed certificates and keys handed to workers, see snapshot.h */
+  struct bud_snapshot_s* snapshot;
+
+  /* Servername index, exact names and `*.domain` wildcards */
+  uint32_t context_bucket_count;
+  bud_context_t** context_buckets;
 
   int context_count;
   bud_context_t contexts[1];
@@ -144,9 +999,18 @@ bud_config_t* bud_config_cli_load(uv_loop_t* loop,
 bud_config_t* bud_config_load(uv_loop_t* loop,
                               const char* path,
                               bud_error_t* err);
+
+/* Second stage of loading, bud_config_cli_load() does it on its own */
+bud_error_t bud_config_init(bud_config_t* config);
 void bud_config_free(bud_config_t* config);
 void bud_context_free(bud_context_t* context);
 
+/*
+ * Load certificates and keys of static contexts again. New handshakes use
+ * the new SSL_CTXs, existing ones keep the old until they are closed.
+ */
+bud_error_t bud_config_reload_contexts(bud_config_t* config);
+
 /* Helper for loading SNI */
 bud_error_t bud_config_new_ssl_ctx(bud_config_t* config,
                                    bud_context_t* context);
@@ -159,15 +1023,86 @@ const char* bud_context_get_ocsp_id(bud_context_t* context,
                                     size_t* size);
 const char* bud_context_get_ocsp_req(bud_context_t* context,
                                      size_t* size,
-                                     char** ocsp_request,
-                                     size_t* ocsp_request_len);
+                                     struct bud_http_body_s** ocsp_request);
+struct bud_http_body_s* bud_context_get_ocsp_body(bud_context_t* context);
+
+/*
+ * SSL_set_SSL_CTX() keeps the mode and the fragment size of the listener's
+ * context, apply the ones of `ctx` to `ssl`
+ */
+void bud_context_tune_ssl(bud_context_t* ctx, SSL* ssl);
+
+/*
+ * Session id context of `ctx` (SHA-256 of its servername), sessions issued
+ * for one context don't resume on another
+ */
+void bud_context_sid_ctx(bud_context_t* ctx, unsigned char* out);
 
 /* Helper for http-pool.c */
 int bud_config_str_to_addr(const char* host,
                            uint16_t port,
                            struct sockaddr_storage* addr);
 
-/* Helper for SNI and stapling */
-int bud_context_use_certificate_chain(bud_context_t* ctx, BIO *in);
+/*
+ * Helper for SNI and stapling. Only the `primary` certificate is used for
+ * OCSP stapling, others (one per key type) just add their chain
+ */
+int bud_context_use_certificate_chain(bud_config_t* config,
+                                      bud_context_t* ctx,
+                                      BIO *in,
+                                      int primary);
+
+/*
+ * Builds SSL_CTX of a lazy context (see `lazy_contexts`) if it isn't there
+ * yet, and marks the context as used now.
+ */
+bud_error_t bud_context_use(bud_config_t* config, bud_context_t* ctx);
+
+/* Certificate chain from PEM, leaf first, NULL - no certificate or error */
+STACK_OF(X509)* bud_config_read_pem_chain(BIO* in);
+
+/* Files of `index`-th context, the default one uses `frontend`'s */
+void bud_config_context_files(bud_config_t* config,
+                              bud_context_t* ctx,
+                              int index,
+                              const char** cert_file,
+                              const char** key_file,
+                              const bud_config_strs_t** cert_files,
+                              const bud_config_strs_t** key_files);
+
+/*
+ * Same for parsed certificates, takes ownership of `x` and `chain`.
+ * Intermediates are interned in `config->cert_cache`.
+ */
+int bud_context_use_x509_chain(bud_config_t* config,
+                               bud_context_t* ctx,
+                               X509* x,
+                               STACK_OF(X509)* chain,
+                               int primary);
+
+/*
+ * Compresses certificate chains of the loaded context once, handshakes
+ * send the cached result (see `frontend.cert_compression`)
+ */
+void bud_context_compress_certs(bud_config_t* config, bud_context_t* ctx);
+
+/*
+ * `name` is either a string, or an array of strings, both are copied into
+ * the config's arena
+ */
+void bud_config_read_str_list(bud_config_t* config,
+                              JSON_Object* obj,
+                              const char* name,
+                              const char** first,
+                              const bud_config_strs_t** list);
+
+/* String of `obj`, or NULL, copied into the config's arena */
+const char* bud_config_get_str(bud_config_t* config,
+                               const JSON_Object* obj,
+                               const char* name);
+
+/* Flat copy of the array in `arena`, non-strings are NULL. NULL for NULL */
+const bud_config_strs_t* bud_config_read_strs(bud_arena_t* arena,
+                                              const JSON_Array* arr);
 
 #endif  /* SRC_CONFIG_H_ */
@@ -0,0 +1,495 @@
+#include <errno.h>  /* errno */
+#include <fcntl.h>  /* open */
+#include <libgen.h>  /* dirname */
+#include <stddef.h>  /* offsetof */
+#include <stdio.h>  /* rename, snprintf */
+#include <stdlib.h>  /* calloc, malloc, free, mkstemp */
+#include <string.h>  /* memcmp, memset, strdup, strlen */
+#include <sys/mman.h>  /* mmap, munmap */
+#include <sys/stat.h>  /* fstat */
+#include <sys/uio.h>  /* writev */
+#include <time.h>  /* time */
+#include <unistd.h>  /* close, geteuid, write */
+
+#include "uv.h"
+
+#include "disk-cache.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+#define BUD_DISK_FNV_INIT 2166136261u
+#define BUD_DISK_ALIGN(size) (((size) + 7) & ~((size_t) 7))
+
+static uint32_t bud_disk_cache_hash(uint32_t hash,
+                                    const void* data,
+                                    size_t len);
+static bud_error_t bud_disk_cache_check_dir(bud_config_t* config);
+static bud_error_t bud_disk_cache_check(bud_config_t* config, int fd);
+static bud_error_t bud_disk_cache_compact(bud_config_t* config);
+static bud_error_t bud_disk_cache_map(bud_disk_cache_t* cache, int fd);
+static int bud_disk_cache_valid(const bud_disk_record_t* rec);
+static void bud_disk_cache_index(bud_disk_cache_t* cache);
+static const bud_disk_record_t** bud_disk_cache_slot(
+    bud_disk_cache_t* cache,
+    uint32_t kind,
+    const char* key,
+    size_t key_len);
+static void bud_disk_cache_unmap(bud_disk_cache_t* cache);
+
+
+bud_error_t bud_disk_cache_new(bud_config_t* config) {
+  bud_disk_cache_t* cache;
+  bud_disk_header_t header;
+  struct stat st;
+  bud_error_t err;
+  int fd;
+
+  if (config->disk_cache.path == NULL)
+    return bud_error(kBudErrDiskCachePath);
+  err = bud_disk_cache_check_dir(config);
+  if (!bud_is_ok(err))
+    return err;
+
+  /* Nothing is written to it before workers are spawned */
+  if (!config->is_worker) {
+    err = bud_disk_cache_compact(config);
+    if (!bud_is_ok(err))
+      return err;
+  }
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_disk_cache_t");
+  cache->config = config;
+  cache->fd = -1;
+  cache->max = config->disk_cache.size;
+
+  fd = open(config->disk_cache.path,
+            O_RDWR | O_APPEND | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+            0600);
+  if (fd == -1) {
+    err = bud_error_num(kBudErrDiskCacheOpen, errno);
+    goto fatal;
+  }
+  err = bud_disk_cache_check(config, fd);
+  if (!bud_is_ok(err)) {
+    close(fd);
+    goto fatal;
+  }
+
+  /* Fresh file, start it */
+  if (fstat(fd, &st) == 0 && st.st_size == 0) {
+    memset(&header, 0, sizeof(header));
+    header.magic = BUD_DISK_CACHE_MAGIC;
+    header.version = BUD_DISK_CACHE_VERSION;
+    if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+      err = bud_error_num(kBudErrDiskCacheOpen, errno);
+      close(fd);
+      goto fatal;
+    }
+  }
+
+  err = bud_disk_cache_map(cache, fd);
+  if (!bud_is_ok(err)) {
+    close(fd);
+    goto fatal;
+  }
+
+  /* Someone else's file, keep away from it */
+  if (cache->map == NULL) {
+    close(fd);
+    bud_log(config,
+            kBudLogWarning,
+            "disk cache %s has unknown format, not using it",
+            config->disk_cache.path);
+    free(cache);
+    return bud_ok();
+  }
+
+  cache->fd = fd;
+  config->disk_cache.cache = cache;
+  bud_log(config,
+          kBudLogDebug,
+          "disk cache %s: %d bytes",
+          config->disk_cache.path,
+          (int) cache->map_size);
+  return bud_ok();
+
+fatal:
+  free(cache);
+  return err;
+}
+
+
+void bud_disk_cache_free(bud_config_t* config) {
+  bud_disk_cache_t* cache;
+
+  cache = config->disk_cache.cache;
+  if (cache == NULL)
+    return;
+
+  bud_disk_cache_unmap(cache);
+  if (cache->fd != -1)
+    close(cache->fd);
+  free(cache);
+  config->disk_cache.cache = NULL;
+}
+
+
+/*
+ * Records carry the private keys of SNI contexts in plain DER, nobody
+ * but bud's user may read them or swap the file under it
+ */
+bud_error_t bud_disk_cache_check_dir(bud_config_t* config) {
+  struct stat st;
+  char* path;
+  int r;
+
+  path = strdup(config->disk_cache.path);
+  if (path == NULL)
+    return bud_error_str(kBudErrNoMem, "disk cache path");
+  r = stat(dirname(path), &st);
+  free(path);
+  if (r != 0)
+    return bud_error_num(kBudErrDiskCacheOpen, errno);
+
+  if (st.st_uid != geteuid() || (st.st_mode & 077) != 0)
+    return bud_error_str(kBudErrDiskCacheUnsafe, config->disk_cache.path);
+  return bud_ok();
+}
+
+
+bud_error_t bud_disk_cache_check(bud_config_t* config, int fd) {
+  struct stat st;
+
+  if (fstat(fd, &st) != 0)
+    return bud_error_num(kBudErrDiskCacheOpen, errno);
+
+  if (!S_ISREG(st.st_mode) ||
+      st.st_uid != geteuid() ||
+      (st.st_mode & 077) != 0) {
+    return bud_error_str(kBudErrDiskCacheUnsafe, config->disk_cache.path);
+  }
+  return bud_ok();
+}
+
+
+uint32_t bud_disk_cache_hash(uint32_t hash, const void* data, size_t len) {
+  const unsigned char* p;
+  size_t i;
+
+  p = data;
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+
+bud_error_t bud_disk_cache_compact(bud_config_t* config) {
+  bud_disk_cache_t old;
+  bud_disk_header_t header;
+  const bud_disk_record_t* rec;
+  bud_error_t err;
+  char* tmp;
+  size_t tmp_len;
+  size_t written;
+  int64_t now;
+  uint32_t i;
+  int fd;
+
+  memset(&old, 0, sizeof(old));
+  old.config = config;
+
+  /* Nothing to compact */
+  fd = open(config->disk_cache.path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT)
+    return bud_ok();
+  if (fd == -1)
+    return bud_error_num(kBudErrDiskCacheOpen, errno);
+  err = bud_disk_cache_check(config, fd);
+  if (bud_is_ok(err))
+    err = bud_disk_cache_map(&old, fd);
+  close(fd);
+  if (!bud_is_ok(err))
+    return err;
+
+  /* Same directory, so that rename() replaces the file atomically */
+  tmp_len = strlen(config->disk_cache.path) + sizeof(".XXXXXX");
+  tmp = malloc(tmp_len);
+  if (tmp == NULL) {
+    err = bud_error_str(kBudErrNoMem, "disk cache path");
+    goto done;
+  }
+  snprintf(tmp, tmp_len, "%s.XXXXXX", config->disk_cache.path);
+
+  /* O_EXCL, 0600 */
+  fd = mkstemp(tmp);
+  if (fd == -1) {
+    err = bud_error_num(kBudErrDiskCacheOpen, errno);
+    goto done;
+  }
+
+  memset(&header, 0, sizeof(header));
+  header.magic = BUD_DISK_CACHE_MAGIC;
+  header.version = BUD_DISK_CACHE_VERSION;
+  written = sizeof(header);
+  if (write(fd, &header, sizeof(header)) != sizeof(header))
+    goto write_failed;
+
+  /* Bad or outdated file is simply replaced with an empty one */
+  now = time(NULL);
+  for (i = 0; i < old.slot_count; i++) {
+    rec = old.slots[i];
+    if (rec == NULL || rec->stale <= now)
+      continue;
+    if (written + rec->size > (size_t) config->disk_cache.size)
+      continue;
+    if (write(fd, rec, rec->size) != (ssize_t) rec->size)
+      goto write_failed;
+    written += rec->size;
+  }
+
+  if (close(fd) != 0 || rename(tmp, config->disk_cache.path) != 0) {
+    err = bud_error_num(kBudErrDiskCacheWrite, errno);
+    unlink(tmp);
+    goto done;
+  }
+  err = bud_ok();
+  goto done;
+
+write_failed:
+  err = bud_error_num(kBudErrDiskCacheWrite, errno);
+  close(fd);
+  unlink(tmp);
+
+done:
+  free(tmp);
+  bud_disk_cache_unmap(&old);
+  return err;
+}
+
+
+bud_error_t bud_disk_cache_map(bud_disk_cache_t* cache, int fd) {
+  struct stat st;
+  const bud_disk_header_t* header;
+  void* map;
+
+  if (fstat(fd, &st) != 0)
+    return bud_error_num(kBudErrDiskCacheMap, errno);
+
+  /* `map` stays NULL if the file isn't ours */
+  if ((size_t) st.st_size < sizeof(*header))
+    return bud_ok();
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return bud_error_num(kBudErrDiskCacheMap, errno);
+
+  header = map;
+  if (header->magic != BUD_DISK_CACHE_MAGIC ||
+      header->version != BUD_DISK_CACHE_VERSION) {
+    munmap(map, st.st_size);
+    return bud_ok();
+  }
+
+  cache->map = map;
+  cache->map_size = st.st_size;
+  bud_disk_cache_index(cache);
+  return bud_ok();
+}
+
+
+int bud_disk_cache_valid(const bud_disk_record_t* rec) {
+  uint32_t checksum;
+
+  if (sizeof(*rec) + (size_t) rec->key_len + rec->data_len > rec->size)
+    return 0;
+
+  checksum = bud_disk_cache_hash(BUD_DISK_FNV_INIT,
+                                 &rec->kind,
+                                 rec->size - offsetof(bud_disk_record_t, kind));
+  return checksum == rec->checksum;
+}
+
+
+void bud_disk_cache_index(bud_disk_cache_t* cache) {
+  const bud_disk_record_t* rec;
+  const bud_disk_record_t** slot;
+  size_t off;
+  uint32_t count;
+  int pass;
+
+  /* Count first, then fill the table */
+  count = 0;
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      cache->slot_count = 16;
+      while (cache->slot_count < count * 2)
+        cache->slot_count <<= 1;
+      cache->slots = calloc(cache->slot_count, sizeof(*cache->slots));
+      if (cache->slots == NULL) {
+        cache->slot_count = 0;
+        return;
+      }
+    }
+
+    off = sizeof(bud_disk_header_t);
+    while (off + sizeof(*rec) <= cache->map_size) {
+      rec = (const bud_disk_record_t*) (cache->map + off);
+
+      /* Torn tail */
+      if (rec->size < sizeof(*rec) ||
+          rec->size % 8 != 0 ||
+          rec->size > cache->map_size - off) {
+        break;
+      }
+      off += rec->size;
+      if (!bud_disk_cache_valid(rec))
+        continue;
+
+      if (pass == 0) {
+        count++;
+        continue;
+      }
+
+      /* Later records replace earlier ones */
+      slot = bud_disk_cache_slot(cache,
+                                 rec->kind,
+                                 (const char*) (rec + 1),
+                                 rec->key_len);
+      *slot = rec;
+    }
+  }
+}
+
+
+const bud_disk_record_t** bud_disk_cache_slot(bud_disk_cache_t* cache,
+                                              uint32_t kind,
+                                              const char* key,
+                                              size_t key_len) {
+  const bud_disk_record_t** slot;
+  uint32_t hash;
+  uint32_t mask;
+
+  hash = bud_disk_cache_hash(BUD_DISK_FNV_INIT, &kind, sizeof(kind));
+  hash = bud_disk_cache_hash(hash, key, key_len);
+  mask = cache->slot_count - 1;
+  for (;; hash++) {
+    slot = &cache->slots[hash & mask];
+    if (*slot == NULL)
+      return slot;
+    if ((*slot)->kind == kind &&
+        (*slot)->key_len == key_len &&
+        memcmp(*slot + 1, key, key_len) == 0) {
+      return slot;
+    }
+  }
+}
+
+
+void bud_disk_cache_unmap(bud_disk_cache_t* cache) {
+  free(cache->slots);
+  cache->slots = NULL;
+  cache->slot_count = 0;
+  if (cache->map != NULL)
+    munmap(cache->map, cache->map_size);
+  cache->map = NULL;
+  cache->map_size = 0;
+}
+
+
+const bud_disk_record_t* bud_disk_cache_get(bud_disk_cache_t* cache,
+                                            bud_disk_kind_t kind,
+                                            const char* key,
+                                            size_t key_len) {
+  const bud_disk_record_t* rec;
+
+  if (cache == NULL || cache->slot_count == 0)
+    return NULL;
+
+  rec = *bud_disk_cache_slot(cache, kind, key, key_len);
+  if (rec == NULL || rec->stale <= time(NULL))
+    return NULL;
+  return rec;
+}
+
+
+const char* bud_disk_record_data(const bud_disk_record_t* rec) {
+  return (const char*) (rec + 1) + rec->key_len;
+}
+
+
+void bud_disk_cache_put(bud_disk_cache_t* cache,
+                        bud_disk_kind_t kind,
+                        const char* key,
+                        size_t key_len,
+                        int64_t expire,
+                        int64_t stale,
+                        const uv_buf_t* bufs,
+                        int count) {
+  bud_disk_record_t rec;
+  struct iovec iov[BUD_DISK_CACHE_MAX_BUFS + 3];
+  static const char pad[8];
+  struct stat st;
+  size_t size;
+  size_t data_len;
+  uint32_t checksum;
+  ssize_t r;
+  int i;
+
+  if (cache == NULL || cache->fd == -1 || count > BUD_DISK_CACHE_MAX_BUFS)
+    return;
+
+  data_len = 0;
+  for (i = 0; i < count; i++)
+    data_len += bufs[i].len;
+  size = BUD_DISK_ALIGN(sizeof(rec) + key_len + data_len);
+
+  /* Bounded, compacted on the next start */
+  if (fstat(cache->fd, &st) != 0 || (size_t) st.st_size + size > cache->max)
+    return;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.size = size;
+  rec.kind = kind;
+  rec.key_len = key_len;
+  rec.data_len = data_len;
+  rec.expire = expire;
+  rec.stale = stale;
+
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = (char*) key;
+  iov[1].iov_len = key_len;
+  for (i = 0; i < count; i++) {
+    iov[i + 2].iov_base = bufs[i].base;
+    iov[i + 2].iov_len = bufs[i].len;
+  }
+  iov[count + 2].iov_base = (char*) pad;
+  iov[count + 2].iov_len = size - sizeof(rec) - key_len - data_len;
+
+  checksum = bud_disk_cache_hash(BUD_DISK_FNV_INIT,
+                                 &rec.kind,
+                                 sizeof(rec) - offsetof(bud_disk_record_t,
+                                                        kind));
+  for (i = 1; i < count + 3; i++)
+    checksum = bud_disk_cache_hash(checksum, iov[i].iov_base, iov[i].iov_len);
+  rec.checksum = checksum;
+
+  /* Page cache write, cheap enough to do on the loop */
+  r = writev(cache->fd, iov, count + 3);
+  if (r == (ssize_t) size)
+    return;
+
+  /* Out of space or so, the rest of the file would be misaligned */
+  bud_log(cache->config,
+          kBudLogWarning,
+          "disk cache write failed, errno: %d",
+          r == -1 ? errno : 0);
+  close(cache->fd);
+  cache->fd = -1;
+}
@@ -0,0 +1,101 @@
+#ifndef SRC_DISK_CACHE_H_
+#define SRC_DISK_CACHE_H_
+
+#include <stdint.h>  /* uint32_t, int64_t */
+#include <stdlib.h>  /* size_t */
+
+#include "uv.h"
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+
+/* "BUDC", bumped version makes the file start over */
+#define BUD_DISK_CACHE_MAGIC 0x43445542
+#define BUD_DISK_CACHE_VERSION 3
+
+/* Most data chunks in one record */
+#define BUD_DISK_CACHE_MAX_BUFS 16
+
+typedef struct bud_disk_cache_s bud_disk_cache_t;
+typedef struct bud_disk_header_s bud_disk_header_t;
+typedef struct bud_disk_record_s bud_disk_record_t;
+typedef enum bud_disk_kind_e bud_disk_kind_t;
+
+enum bud_disk_kind_e {
+  /* Servername => SNI response, see bud_sni_save() */
+  kBudDiskSNI = 1,
+
+  /* OCSP id => DER staple */
+  kBudDiskStaple = 2
+};
+
+struct bud_disk_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t reserved;
+};
+
+/* Followed by the key and the data, padded to 8 bytes */
+struct bud_disk_record_s {
+  uint32_t size;
+
+  /* FNV-1a of the rest of the record, torn and damaged ones are skipped */
+  uint32_t checksum;
+  uint32_t kind;
+  uint32_t key_len;
+  uint32_t data_len;
+  uint32_t reserved;
+
+  /* Wall clock in s: fresh until `expire`, usable until `stale` */
+  int64_t expire;
+  int64_t stale;
+};
+
+/*
+ * Append-only file of SNI responses and staples that survives restarts.
+ * Every process appends to it as entries are fetched, and looks up in a
+ * read-only snapshot mapped on start. Newest record of a key wins.
+ */
+struct bud_disk_cache_s {
+  struct bud_config_s* config;
+  int fd;
+  size_t max;
+
+  char* map;
+  size_t map_size;
+
+  /* Open addressing, newest record per kind and key */
+  uint32_t slot_count;
+  const bud_disk_record_t** slots;
+};
+
+/*
+ * Master drops expired and replaced records and rewrites the file before
+ * spawning workers, workers open it as it is.
+ */
+bud_error_t bud_disk_cache_new(struct bud_config_s* config);
+void bud_disk_cache_free(struct bud_config_s* config);
+
+/* Record that is still usable (`stale` is in the future), NULL - none */
+const bud_disk_record_t* bud_disk_cache_get(bud_disk_cache_t* cache,
+                                            bud_disk_kind_t kind,
+                                            const char* key,
+                                            size_t key_len);
+const char* bud_disk_record_data(const bud_disk_record_t* rec);
+
+/*
+ * Appends `bufs` as one record with a single write, so workers don't mix
+ * up theirs. Dropped once the file reaches `disk_cache.size`.
+ */
+void bud_disk_cache_put(bud_disk_cache_t* cache,
+                        bud_disk_kind_t kind,
+                        const char* key,
+                        size_t key_len,
+                        int64_t expire,
+                        int64_t stale,
+                        const uv_buf_t* bufs,
+                        int count);
+
+#endif  /* SRC_DISK_CACHE_H_ */
@@ -0,0 +1,218 @@
+#include <stdlib.h>  /* calloc, free */
+#include <string.h>  /* strcmp */
+
+#include "openssl/engine.h"
+#include "openssl/err.h"
+#include "openssl/evp.h"
+#include "openssl/rsa.h"
+
+#include "engine.h"
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+
+static bud_engine_t* bud_engine_load(bud_config_t* config,
+                                     const char* id,
+                                     const char* path);
+static int bud_engine_rsa_priv_enc(int flen,
+                                   const unsigned char* from,
+                                   unsigned char* to,
+                                   RSA* rsa,
+                                   int padding);
+static int bud_engine_rsa_priv_dec(int flen,
+                                   const unsigned char* from,
+                                   unsigned char* to,
+                                   RSA* rsa,
+                                   int padding);
+static int bud_engine_rsa_sign(int type,
+                               const unsigned char* m,
+                               unsigned int m_length,
+                               unsigned char* sigret,
+                               unsigned int* siglen,
+                               const RSA* rsa);
+
+
+void bud_engines_init(bud_config_t* config) {
+  bud_engine_t* engine;
+
+  /* Hardware state does not survive fork(), only workers load engines */
+  config->engine.ready = 1;
+  if (config->engine.id == NULL)
+    return;
+
+  engine = bud_engine_load(config, config->engine.id, config->engine.path);
+  if (engine == NULL)
+    return;
+  config->engine.global = engine;
+
+  if (config->engine.defaults != NULL &&
+      !ENGINE_set_default_string(engine->engine, config->engine.defaults)) {
+    bud_log(config,
+            kBudLogWarning,
+            "engine \"%s\" can't be default for \"%s\": %s",
+            engine->id,
+            config->engine.defaults,
+            ERR_error_string(ERR_get_error(), NULL));
+  }
+}
+
+
+void bud_engines_free(bud_config_t* config) {
+  bud_engine_t* engine;
+  bud_engine_t* next;
+
+  for (engine = config->engine.list; engine != NULL; engine = next) {
+    next = engine->next;
+    ENGINE_finish(engine->engine);
+    ENGINE_free(engine->engine);
+    free(engine);
+  }
+  config->engine.list = NULL;
+  config->engine.global = NULL;
+  config->engine.ready = 0;
+}
+
+
+void bud_engines_log_stats(bud_config_t* config) {
+  bud_engine_t* engine;
+
+  for (engine = config->engine.list; engine != NULL; engine = engine->next) {
+    bud_log(config,
+            kBudLogInfo,
+            "engine \"%s\" rsa private ops: %llu",
+            engine->id,
+            (unsigned long long) engine->rsa_ops);
+  }
+}
+
+
+bud_engine_t* bud_engine_get(bud_config_t* config, const char* id) {
+  bud_engine_t* engine;
+
+  if (!config->engine.ready)
+    return NULL;
+  if (id == NULL)
+    return config->engine.global;
+
+  for (engine = config->engine.list; engine != NULL; engine = engine->next)
+    if (strcmp(engine->id, id) == 0)
+      return engine;
+
+  return bud_engine_load(config, id, NULL);
+}
+
+
+void bud_engine_use_key(bud_engine_t* engine, EVP_PKEY* key) {
+  RSA* rsa;
+
+  /* Others (ECDSA) go to the engine only if it is the default one */
+  if (engine == NULL || engine->rsa_orig == NULL)
+    return;
+  if (EVP_PKEY_type(key->type) != EVP_PKEY_RSA)
+    return;
+
+  rsa = EVP_PKEY_get1_RSA(key);
+  if (rsa == NULL)
+    return;
+  RSA_set_method(rsa, &engine->rsa);
+  RSA_free(rsa);
+}
+
+
+bud_engine_t* bud_engine_load(bud_config_t* config,
+                              const char* id,
+                              const char* path) {
+  ENGINE* e;
+  bud_engine_t* engine;
+
+  e = ENGINE_by_id(id);
+
+  /* Not built-in, load the shared object */
+  if (e == NULL && path != NULL) {
+    e = ENGINE_by_id("dynamic");
+    if (e != NULL &&
+        (!ENGINE_ctrl_cmd_string(e, "SO_PATH", path, 0) ||
+         !ENGINE_ctrl_cmd_string(e, "ID", id, 0) ||
+         !ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0))) {
+      ENGINE_free(e);
+      e = NULL;
+    }
+  }
+  if (e == NULL)
+    goto fatal;
+
+  if (!ENGINE_init(e)) {
+    ENGINE_free(e);
+    goto fatal;
+  }
+
+  engine = calloc(1, sizeof(*engine));
+  if (engine == NULL) {
+    ENGINE_finish(e);
+    ENGINE_free(e);
+    return NULL;
+  }
+  engine->id = id;
+  engine->engine = e;
+  engine->rsa_orig = ENGINE_get_RSA(e);
+  if (engine->rsa_orig != NULL) {
+    engine->rsa = *engine->rsa_orig;
+    engine->rsa.rsa_priv_enc = bud_engine_rsa_priv_enc;
+    engine->rsa.rsa_priv_dec = bud_engine_rsa_priv_dec;
+    if (engine->rsa_orig->rsa_sign != NULL)
+      engine->rsa.rsa_sign = bud_engine_rsa_sign;
+  }
+
+  engine->next = config->engine.list;
+  config->engine.list = engine;
+  bud_log(config, kBudLogInfo, "engine \"%s\" loaded", id);
+  return engine;
+
+fatal:
+  bud_log(config,
+          kBudLogWarning,
+          "engine \"%s\" failed to load, using software: %s",
+          id,
+          ERR_error_string(ERR_get_error(), NULL));
+  return NULL;
+}
+
+
+int bud_engine_rsa_priv_enc(int flen,
+                            const unsigned char* from,
+                            unsigned char* to,
+                            RSA* rsa,
+                            int padding) {
+  bud_engine_t* engine;
+
+  engine = container_of(rsa->meth, bud_engine_t, rsa);
+  engine->rsa_ops++;
+  return engine->rsa_orig->rsa_priv_enc(flen, from, to, rsa, padding);
+}
+
+
+int bud_engine_rsa_priv_dec(int flen,
+                            const unsigned char* from,
+                            unsigned char* to,
+                            RSA* rsa,
+                            int padding) {
+  bud_engine_t* engine;
+
+  engine = container_of(rsa->meth, bud_engine_t, rsa);
+  engine->rsa_ops++;
+  return engine->rsa_orig->rsa_priv_dec(flen, from, to, rsa, padding);
+}
+
+
+int bud_engine_rsa_sign(int type,
+                        const unsigned char* m,
+                        unsigned int m_length,
+                        unsigned char* sigret,
+                        unsigned int* siglen,
+                        const RSA* rsa) {
+  bud_engine_t* engine;
+
+  engine = container_of(rsa->meth, bud_engine_t, rsa);
+  engine->rsa_ops++;
+  return engine->rsa_orig->rsa_sign(type, m, m_length, sigret, siglen, rsa);
+}
@@ -0,0 +1,44 @@
+#ifndef SRC_ENGINE_H_
+#define SRC_ENGINE_H_
+
+#include <stdint.h>  /* uint64_t */
+
+#include "openssl/engine.h"
+#include "openssl/evp.h"
+#include "openssl/rsa.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+typedef struct bud_engine_s bud_engine_t;
+
+struct bud_engine_s {
+  const char* id;
+  ENGINE* engine;
+
+  /* Engine's RSA method, wrapped to count private key operations */
+  RSA_METHOD rsa;
+  const RSA_METHOD* rsa_orig;
+  uint64_t rsa_ops;
+
+  bud_engine_t* next;
+};
+
+/*
+ * Load and initialize global `engine`, if configured. Engine that failed to
+ * load is reported, and the software implementation is used instead.
+ */
+void bud_engines_init(struct bud_config_s* config);
+void bud_engines_free(struct bud_config_s* config);
+void bud_engines_log_stats(struct bud_config_s* config);
+
+/*
+ * Engine for context's private key: `id` (loaded on the first use), or the
+ * global one if `id` is NULL. NULL - software
+ */
+bud_engine_t* bud_engine_get(struct bud_config_s* config, const char* id);
+
+/* Route key's private operations through the engine */
+void bud_engine_use_key(bud_engine_t* engine, EVP_PKEY* key);
+
+#endif  /* SRC_ENGINE_H_ */
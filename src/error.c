@@ -77,6 +77,52 @@ bud_error_t bud_error_num(bud_error_code_t code, int ret) {
       BUD_UV_ERROR("uv_exe_path()", err)                                      \
     case kBudErrECDHNotFound:                                                 \
       BUD_ERROR("ECDH curve \"%s\" not found", err.str)                       \
+    case kBudErrInvalidBuffer:                                                \
+      BUD_ERROR("invalid buffer config: negative chunk size or count")        \
+    case kBudErrTicketKey:                                                    \
+      BUD_ERROR("failed to load ticket key: %s", err.str)                     \
+    case kBudErrAffinity:                                                     \
+      BUD_ERROR("workers_affinity should be \"auto\" or an array of CPUs")    \
+    case kBudErrAffinityNotSupported:                                         \
+      BUD_ERROR("workers_affinity is not supported on this platform")         \
+    case kBudErrProxyline:                                                    \
+      BUD_ERROR("%s should be a boolean, \"v1\" or \"v2\"", err.str)          \
+    case kBudErrBalance:                                                      \
+      BUD_ERROR("Unknown backend.balance: %s", err.str)                       \
+    case kBudErrJSONNonObjectBackend:                                         \
+      BUD_ERROR("Invalid json, each backend should be an object")             \
+    case kBudErrJSONNonObjectFrontend:                                        \
+      BUD_ERROR("Invalid json, each of frontends should be an object")        \
+    case kBudErrListenerContext:                                              \
+      BUD_ERROR("frontends: no context with servername \"%s\"", err.str)      \
+    case kBudErrInvalidBufferMarks:                                           \
+      BUD_ERROR("invalid buffer config: need low <= high <= buffer size")     \
+    case kBudErrThreadsReusePort:                                             \
+      BUD_ERROR("threads: more than one requires frontend.reuseport")         \
+    case kBudErrWorkersBalance:                                               \
+      BUD_ERROR("Unknown workers_balance: %s", err.str)                       \
+    case kBudErrNoTLS13:                                                      \
+      BUD_ERROR("OpenSSL has no TLS 1.3 support, security: %s", err.str)      \
+    case kBudErrBackendTLS:                                                   \
+      BUD_ERROR("Failed to create backend TLS context: %s", err.str)          \
+    case kBudErrCaptureOpen:                                                  \
+      BUD_ERROR("failed to open capture file, errno: %d", err.ret)            \
+    case kBudErrAccessEntry:                                                  \
+      BUD_ERROR("invalid access list entry: %s", err.str)                     \
+    case kBudErrAccessFile:                                                   \
+      BUD_ERROR("failed to read access list file: %s", err.str)               \
+    case kBudErrMaxSendFragment:                                              \
+      BUD_ERROR("max_send_fragment %d is out of 512..16384", err.ret)         \
+    case kBudErrBackendResolve:                                               \
+      BUD_ERROR("failed to resolve backend host %s", err.str)                 \
+    case kBudErrSharedListenReusePort:                                        \
+      BUD_ERROR("frontend: shared_listen and reuseport are exclusive")        \
+    case kBudErrFingerprintEntry:                                             \
+      BUD_ERROR("invalid fingerprint: %s", err.str)                           \
+    case kBudErrFingerprintFile:                                              \
+      BUD_ERROR("failed to read fingerprint file: %s", err.str)               \
+    case kBudErrOpenSSLFeature:                                               \
+      BUD_ERROR("%s is not supported by bud's OpenSSL", err.str)              \
     case kBudErrForkFailed:                                                   \
       BUD_ERROR("fork() failed, errno: %d\n", err.ret)                        \
     case kBudErrSetsidFailed:                                                 \
@@ -97,6 +143,86 @@ bud_error_t bud_error_num(bud_error_code_t code, int ret) {
       BUD_UV_ERROR("uv_signal_init()", err)                                   \
     case kBudErrSignalStart:                                                  \
       BUD_UV_ERROR("uv_signal_start()", err)                                  \
+    case kBudErrIPCMsgSize:                                                   \
+      BUD_ERROR("ipc message is too big: %d", err.ret)                        \
+    case kBudErrIPCSend:                                                      \
+      BUD_UV_ERROR("uv_write(ipc)", err)                                      \
+    case kBudErrStaplingTimer:                                                \
+      BUD_UV_ERROR("uv_timer_init(stapling)", err)                            \
+    case kBudErrLoadTimer:                                                    \
+      BUD_UV_ERROR("uv_timer_init(load)", err)                                \
+    case kBudErrMasterIPCRead:                                                \
+      BUD_UV_ERROR("uv_read_start(master ipc)", err)                          \
+    case kBudErrHealthTimer:                                                  \
+      BUD_UV_ERROR("uv_timer_init(health_check)", err)                        \
+    case kBudErrBackendPoolTimer:                                             \
+      BUD_UV_ERROR("uv_timer_init(backend pool)", err)                        \
+    case kBudErrHandshakeIdle:                                                \
+      BUD_UV_ERROR("uv_idle_init(handshake limit)", err)                      \
+    case kBudErrRateLimitShared:                                              \
+      BUD_ERROR("Failed to map rate limit table, errno: %d", err.ret)         \
+    case kBudErrTimerWheel:                                                   \
+      BUD_UV_ERROR("uv_timer_init(timer wheel)", err)                         \
+    case kBudErrLoggerThread:                                                 \
+      BUD_UV_ERROR("uv_thread_create(logger)", err)                           \
+    case kBudErrMetricsInit:                                                  \
+      BUD_UV_ERROR("uv_tcp_init(metrics)", err)                               \
+    case kBudErrMetricsBind:                                                  \
+      BUD_UV_ERROR("uv_tcp_bind(metrics)", err)                               \
+    case kBudErrMetricsListen:                                                \
+      BUD_UV_ERROR("uv_listen(metrics)", err)                                 \
+    case kBudErrMetricsLoop:                                                  \
+      BUD_UV_ERROR("uv_prepare_init(metrics)", err)                           \
+    case kBudErrPreloadThread:                                                \
+      BUD_UV_ERROR("uv_thread_create(preload)", err)                          \
+    case kBudErrLazyTimer:                                                    \
+      BUD_UV_ERROR("uv_timer_init(lazy contexts)", err)                       \
+    case kBudErrFlushInit:                                                    \
+      BUD_UV_ERROR("uv_check_init(flush)", err)                               \
+    case kBudErrBudgetIdle:                                                   \
+      BUD_UV_ERROR("uv_idle_init(cycle budget)", err)                         \
+    case kBudErrThreadCreate:                                                 \
+      BUD_UV_ERROR("uv_thread_create(threads)", err)                          \
+    case kBudErrThreadAsync:                                                  \
+      BUD_UV_ERROR("uv_async_init(threads drain)", err)                       \
+    case kBudErrUringSetup:                                                   \
+      BUD_UV_ERROR("io_uring_setup()", err)                                   \
+    case kBudErrUringLoop:                                                    \
+      BUD_UV_ERROR("uv_poll_init(io_uring)", err)                             \
+    case kBudErrReclaimTimer:                                                 \
+      BUD_UV_ERROR("uv_timer_init(pool budget)", err)                         \
+    case kBudErrSnapshot:                                                     \
+      BUD_ERROR("context snapshot failed, errno: %d\n", err.ret)              \
+    case kBudErrTeardownIdle:                                                 \
+      BUD_UV_ERROR("uv_idle_init(teardown)", err)                             \
+    case kBudErrSpinInit:                                                     \
+      BUD_UV_ERROR("uv_check_init(busy_poll)", err)                           \
+    case kBudErrAdminInit:                                                    \
+      BUD_UV_ERROR("uv_pipe_init(admin)", err)                                \
+    case kBudErrAdminBind:                                                    \
+      BUD_UV_ERROR("uv_pipe_bind(admin)", err)                                \
+    case kBudErrAdminListen:                                                  \
+      BUD_UV_ERROR("uv_listen(admin)", err)                                   \
+    case kBudErrAutoscaleTimer:                                               \
+      BUD_UV_ERROR("uv_timer_init(autoscale)", err)                           \
+    case kBudErrZerocopyTimer:                                                \
+      BUD_UV_ERROR("uv_timer_init(zerocopy)", err)                            \
+    case kBudErrUpgradeSpawn:                                                 \
+      BUD_UV_ERROR("uv_spawn(upgrade)", err)                                  \
+    case kBudErrUpgradeOpen:                                                  \
+      BUD_UV_ERROR("uv_tcp_open(upgrade)", err)                               \
+    case kBudErrHandoffAccept:                                                \
+      BUD_UV_ERROR("uv_accept(handoff)", err)                                 \
+    case kBudErrHandoffSend:                                                  \
+      BUD_UV_ERROR("uv_write2(handoff)", err)                                 \
+    case kBudErrWatchdogTimer:                                                \
+      BUD_UV_ERROR("uv_timer_init(watchdog)", err)                            \
+    case kBudErrResolveTimer:                                                 \
+      BUD_UV_ERROR("uv_timer_init(resolve_timer)", err)                       \
+    case kBudErrTCPInfoTimer:                                                 \
+      BUD_UV_ERROR("uv_timer_init(tcp_info_timer)", err)                      \
+    case kBudErrTicketTimer:                                                  \
+      BUD_UV_ERROR("uv_timer_init(ticket_timer)", err)                        \
     case kBudErrTcpServerInit:                                                \
       BUD_UV_ERROR("uv_tcp_init(server)", err)                                \
     case kBudErrPton:                                                         \
@@ -111,6 +237,24 @@ bud_error_t bud_error_num(bud_error_code_t code, int ret) {
       BUD_UV_ERROR("uv_accept(ipc)", err)                                     \
     case kBudErrServerSimAccept:                                              \
       BUD_UV_ERROR("uv_tcp_simultaneous_accepts(server, 0)", err)             \
+    case kBudErrServerSocket:                                                 \
+      BUD_UV_ERROR("socket(server)", err)                                     \
+    case kBudErrServerReusePort:                                              \
+      BUD_UV_ERROR("setsockopt(server, SO_REUSEPORT)", err)                   \
+    case kBudErrServerNoReusePort:                                            \
+      BUD_ERROR("SO_REUSEPORT is not supported on this platform")             \
+    case kBudErrServerIdleInit:                                               \
+      BUD_UV_ERROR("uv_idle_init(server)", err)                               \
+    case kBudErrServerV6Only:                                                 \
+      BUD_UV_ERROR("setsockopt(server, IPV6_V6ONLY)", err)                    \
+    case kBudErrServerDeferAccept:                                            \
+      BUD_UV_ERROR("setsockopt(server, TCP_DEFER_ACCEPT)", err)               \
+    case kBudErrServerFastOpen:                                               \
+      BUD_UV_ERROR("setsockopt(server, TCP_FASTOPEN)", err)                   \
+    case kBudErrServerEpoll:                                                  \
+      BUD_UV_ERROR("epoll_ctl(server, EPOLLEXCLUSIVE)", err)                  \
+    case kBudErrServerPollInit:                                               \
+      BUD_UV_ERROR("uv_poll_start(server)", err)                              \
     case kBudErrParserNeedMore:                                               \
       BUD_ERROR("client hello parser needs more data")                        \
     case kBudErrParserErr:                                                    \
@@ -133,8 +277,62 @@ bud_error_t bud_error_num(bud_error_code_t code, int ret) {
       BUD_ERROR("http_req's body parse failed %s", err.str)                   \
     case kBudErrHttpEof:                                                      \
       BUD_ERROR("http_req's unexpected eof", NULL)                            \
+    case kBudErrHttpResolve:                                                  \
+      BUD_ERROR("failed to resolve http pool host %s", err.str)               \
+    case kBudErrHttpTimeout:                                                  \
+      BUD_ERROR("http_req to %s timed out", err.str)                          \
+    case kBudErrHttpTimer:                                                    \
+      BUD_UV_ERROR("uv_timer_init(http_pool)", err)                           \
+    case kBudErrHttpDown:                                                     \
+      BUD_ERROR("http pool %s is marked down", err.str)                       \
+    case kBudErrHttpHost:                                                     \
+      BUD_ERROR("can't add http pool host %s", err.str)                       \
     case kBudErrStaplingSetData:                                              \
       BUD_ERROR("SSL_set_ex_data(stapling ctx) failed", NULL)                 \
+    case kBudErrSNISetData:                                                   \
+      BUD_ERROR("SSL_set_ex_data(SNI ctx) failed")                            \
+    case kBudErrStaplingUrl:                                                  \
+      BUD_ERROR("unsupported OCSP responder url %s", err.str)                 \
+    case kBudErrSNIFile:                                                      \
+      BUD_UV_ERROR("SNI file read", err)                                      \
+    case kBudErrOCSPWatch:                                                    \
+      BUD_UV_ERROR("uv_fs_event_start(ocsp_file)", err)                       \
+    case kBudErrSessionCacheShm:                                              \
+      BUD_ERROR("session cache shared memory failure, errno: %d", err.ret)    \
+    case kBudErrSessionCacheLock:                                             \
+      BUD_ERROR("session cache lock init failed, errno: %d", err.ret)         \
+    case kBudErrSessionCacheNotSupported:                                     \
+      BUD_ERROR("session cache is not supported on this platform")            \
+    case kBudErrDiskCacheOpen:                                                \
+      BUD_ERROR("failed to open disk cache, errno: %d", err.ret)              \
+    case kBudErrDiskCacheMap:                                                 \
+      BUD_ERROR("failed to map disk cache, errno: %d", err.ret)               \
+    case kBudErrDiskCacheWrite:                                               \
+      BUD_ERROR("failed to compact disk cache, errno: %d", err.ret)           \
+    case kBudErrDiskCachePath:                                                \
+      BUD_ERROR("disk_cache.path is required")                                \
+    case kBudErrDiskCacheUnsafe:                                              \
+      BUD_ERROR("disk cache %s must be private to bud's user", err.str)       \
+    case kBudErrSharedCacheShm:                                               \
+      BUD_ERROR("shared cache memory failure, errno: %d", err.ret)            \
+    case kBudErrSharedCacheLock:                                              \
+      BUD_ERROR("shared cache lock init failed, errno: %d", err.ret)          \
+    case kBudErrSharedCacheNotSupported:                                      \
+      BUD_ERROR("shared cache is not supported on this platform")             \
+    case kBudErrVerifyMode:                                                   \
+      BUD_ERROR("Unknown verify_client: %s", err.str)                         \
+    case kBudErrClientCA:                                                     \
+      BUD_ERROR("Failed to load client_ca: %s", err.str)                      \
+    case kBudErrLookupConnect:                                                \
+      BUD_UV_ERROR("uv_tcp_connect(lookup)", err)                             \
+    case kBudErrLookupWrite:                                                  \
+      BUD_UV_ERROR("uv_write(lookup)", err)                                   \
+    case kBudErrLookupRead:                                                   \
+      BUD_UV_ERROR("lookup's read_cb", err)                                   \
+    case kBudErrLookupFrame:                                                  \
+      BUD_ERROR("malformed lookup frame from %s", err.str)                    \
+    case kBudErrLookupTimer:                                                  \
+      BUD_UV_ERROR("uv_timer_init(lookup)", err)                              \
     default:                                                                  \
       UNEXPECTED;                                                             \
   }
@@ -27,6 +27,29 @@ enum bud_error_code_e {
   kBudErrNPNNotSupported = 0x108,
   kBudErrExePath = 0x109,
   kBudErrECDHNotFound = 0x10a,
+  kBudErrInvalidBuffer = 0x10b,
+  kBudErrTicketKey = 0x10c,
+  kBudErrAffinity = 0x10d,
+  kBudErrAffinityNotSupported = 0x10e,
+  kBudErrBalance = 0x10f,
+  kBudErrJSONNonObjectBackend = 0x110,
+  kBudErrProxyline = 0x111,
+  kBudErrJSONNonObjectFrontend = 0x112,
+  kBudErrListenerContext = 0x113,
+  kBudErrInvalidBufferMarks = 0x114,
+  kBudErrThreadsReusePort = 0x115,
+  kBudErrWorkersBalance = 0x116,
+  kBudErrNoTLS13 = 0x117,
+  kBudErrBackendTLS = 0x118,
+  kBudErrCaptureOpen = 0x119,
+  kBudErrAccessEntry = 0x11a,
+  kBudErrAccessFile = 0x11b,
+  kBudErrMaxSendFragment = 0x11c,
+  kBudErrBackendResolve = 0x11d,
+  kBudErrSharedListenReusePort = 0x11e,
+  kBudErrFingerprintEntry = 0x120,
+  kBudErrFingerprintFile = 0x121,
+  kBudErrOpenSSLFeature = 0x122,
 
   /* Master/Worker errors */
   kBudErrForkFailed = 0x200,
@@ -39,6 +62,46 @@ enum bud_error_code_e {
   kBudErrSpawn = 0x207,
   kBudErrSignalInit = 0x208,
   kBudErrSignalStart = 0x209,
+  kBudErrIPCMsgSize = 0x20a,
+  kBudErrIPCSend = 0x20b,
+  kBudErrStaplingTimer = 0x20c,
+  kBudErrLoadTimer = 0x20d,
+  kBudErrMasterIPCRead = 0x20e,
+  kBudErrHealthTimer = 0x20f,
+  kBudErrBackendPoolTimer = 0x210,
+  kBudErrHandshakeIdle = 0x211,
+  kBudErrRateLimitShared = 0x212,
+  kBudErrTimerWheel = 0x213,
+  kBudErrLoggerThread = 0x214,
+  kBudErrMetricsInit = 0x215,
+  kBudErrMetricsBind = 0x216,
+  kBudErrMetricsListen = 0x217,
+  kBudErrMetricsLoop = 0x218,
+  kBudErrPreloadThread = 0x219,
+  kBudErrLazyTimer = 0x21a,
+  kBudErrFlushInit = 0x21b,
+  kBudErrBudgetIdle = 0x21c,
+  kBudErrThreadCreate = 0x21d,
+  kBudErrThreadAsync = 0x21e,
+  kBudErrUringSetup = 0x21f,
+  kBudErrUringLoop = 0x220,
+  kBudErrReclaimTimer = 0x221,
+  kBudErrSnapshot = 0x222,
+  kBudErrTeardownIdle = 0x223,
+  kBudErrSpinInit = 0x224,
+  kBudErrAdminInit = 0x225,
+  kBudErrAdminBind = 0x226,
+  kBudErrAdminListen = 0x227,
+  kBudErrAutoscaleTimer = 0x228,
+  kBudErrZerocopyTimer = 0x229,
+  kBudErrUpgradeSpawn = 0x22a,
+  kBudErrUpgradeOpen = 0x22b,
+  kBudErrHandoffAccept = 0x22c,
+  kBudErrHandoffSend = 0x22d,
+  kBudErrWatchdogTimer = 0x22e,
+  kBudErrResolveTimer = 0x22f,
+  kBudErrTCPInfoTimer = 0x230,
+  kBudErrTicketTimer = 0x232,
 
   /* Server errors */
   kBudErrTcpServerInit = 0x300,
@@ -48,6 +111,15 @@ enum bud_error_code_e {
   kBudErrServerListen = 0x304,
   kBudErrServerIPCAccept = 0x305,
   kBudErrServerSimAccept = 0x306,
+  kBudErrServerSocket = 0x307,
+  kBudErrServerReusePort = 0x308,
+  kBudErrServerNoReusePort = 0x309,
+  kBudErrServerIdleInit = 0x30a,
+  kBudErrServerV6Only = 0x30b,
+  kBudErrServerDeferAccept = 0x30c,
+  kBudErrServerFastOpen = 0x30d,
+  kBudErrServerEpoll = 0x30e,
+  kBudErrServerPollInit = 0x30f,
 
   /* Client hello parser errors */
   kBudErrParserNeedMore = 0x400,
@@ -63,9 +135,46 @@ enum bud_error_code_e {
   kBudErrHttpReadCb = 0x506,
   kBudErrHttpParse = 0x507,
   kBudErrHttpEof = 0x508,
+  kBudErrHttpResolve = 0x509,
+  kBudErrHttpTimeout = 0x50a,
+  kBudErrHttpTimer = 0x50b,
+  kBudErrHttpDown = 0x50c,
+  kBudErrHttpHost = 0x50d,
 
   /* Stapling */
-  kBudErrStaplingSetData = 0x600
+  kBudErrStaplingSetData = 0x600,
+  kBudErrSNISetData = 0x601,
+  kBudErrStaplingUrl = 0x602,
+  kBudErrSNIFile = 0x603,
+  kBudErrOCSPWatch = 0x604,
+
+  /* Session cache */
+  kBudErrSessionCacheShm = 0x700,
+  kBudErrSessionCacheLock = 0x701,
+  kBudErrSessionCacheNotSupported = 0x702,
+
+  /* Disk cache */
+  kBudErrDiskCacheOpen = 0x800,
+  kBudErrDiskCacheMap = 0x801,
+  kBudErrDiskCacheWrite = 0x802,
+  kBudErrDiskCachePath = 0x803,
+  kBudErrDiskCacheUnsafe = 0x804,
+
+  /* Shared cache */
+  kBudErrSharedCacheShm = 0x900,
+  kBudErrSharedCacheLock = 0x901,
+  kBudErrSharedCacheNotSupported = 0x902,
+
+  /* Client certificates */
+  kBudErrVerifyMode = 0xa00,
+  kBudErrClientCA = 0xa01,
+
+  /* Binary lookups */
+  kBudErrLookupConnect = 0xb00,
+  kBudErrLookupWrite = 0xb01,
+  kBudErrLookupRead = 0xb02,
+  kBudErrLookupFrame = 0xb03,
+  kBudErrLookupTimer = 0xb04
 };
 
 struct bud_error_s {
@@ -0,0 +1,322 @@
+#include <stdio.h>  /* FILE, fopen, fgets, fclose */
+#include <stdlib.h>  /* calloc, realloc, free, qsort, bsearch */
+#include <string.h>  /* memcpy, memcmp, strcspn, strspn */
+
+#include "fingerprint.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+static bud_error_t bud_fingerprint_load(bud_fingerprint_t* fp);
+static bud_error_t bud_fingerprint_load_file(bud_fingerprint_t* fp,
+                                             const char* path);
+static int bud_fingerprint_parse(const char* str,
+                                 size_t len,
+                                 uint8_t* hash);
+static int bud_fingerprint_insert(bud_fingerprint_t* fp,
+                                  const uint8_t* hash);
+static int bud_fingerprint_cmp(const void* a, const void* b);
+static void bud_fingerprint_count(bud_fingerprint_t* fp,
+                                  const uint8_t* hash);
+static void bud_fingerprint_detect(bud_fingerprint_t* fp, uint64_t now);
+static int bud_fingerprint_is_blocked(bud_fingerprint_t* fp,
+                                      const uint8_t* hash,
+                                      uint64_t now);
+
+
+bud_error_t bud_fingerprint_new(bud_config_t* config,
+                                const bud_fingerprint_t* old,
+                                bud_fingerprint_t** out) {
+  bud_fingerprint_t* fp;
+  bud_error_t err;
+
+  *out = NULL;
+  if (config->frontend.fingerprint.deny == NULL &&
+      config->frontend.fingerprint.deny_file == NULL &&
+      config->frontend.fingerprint.flood == 0) {
+    return bud_ok();
+  }
+
+  fp = calloc(1, sizeof(*fp));
+  if (fp == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_fingerprint_t");
+  fp->config = config;
+
+  err = bud_fingerprint_load(fp);
+  if (!bud_is_ok(err)) {
+    bud_fingerprint_free(fp);
+    return err;
+  }
+  qsort(fp->deny, fp->deny_count, sizeof(*fp->deny), bud_fingerprint_cmp);
+
+  /* Reload shouldn't let the flood back in */
+  if (old != NULL)
+    memcpy(fp->blocked, old->blocked, sizeof(fp->blocked));
+
+  *out = fp;
+  return bud_ok();
+}
+
+
+void bud_fingerprint_free(bud_fingerprint_t* fp) {
+  if (fp == NULL)
+    return;
+
+  free(fp->deny);
+  free(fp);
+}
+
+
+int bud_fingerprint_allowed(bud_fingerprint_t* fp,
+                            const uint8_t* hash,
+                            uint64_t now) {
+  /* Denied ones are counted too, so that the blocks are kept up */
+  if (fp->config->frontend.fingerprint.flood != 0) {
+    if (now - fp->window >= 1000)
+      bud_fingerprint_detect(fp, now);
+    bud_fingerprint_count(fp, hash);
+  }
+
+  if (fp->deny_count != 0 &&
+      bsearch(hash,
+              fp->deny,
+              fp->deny_count,
+              sizeof(*fp->deny),
+              bud_fingerprint_cmp) != NULL) {
+    return 0;
+  }
+
+  return !bud_fingerprint_is_blocked(fp, hash, now);
+}
+
+
+int bud_fingerprint_blocked_count(const bud_fingerprint_t* fp, uint64_t now) {
+  int i;
+  int count;
+
+  count = 0;
+  for (i = 0; i < BUD_FINGERPRINT_BLOCKED; i++)
+    if (fp->blocked[i].until > now)
+      count++;
+  return count;
+}
+
+
+bud_error_t bud_fingerprint_load(bud_fingerprint_t* fp) {
+  const bud_config_strs_t* list;
+  const char* entry;
+  uint8_t hash[BUD_FINGERPRINT_LEN];
+  int i;
+
+  /* Path of the file with the hashes */
+  if (fp->config->frontend.fingerprint.deny_file != NULL) {
+    return bud_fingerprint_load_file(
+        fp,
+        fp->config->frontend.fingerprint.deny_file);
+  }
+  list = fp->config->frontend.fingerprint.deny;
+  if (list == NULL)
+    return bud_ok();
+
+  for (i = 0; i < list->count; i++) {
+    entry = list->items[i];
+    if (entry == NULL)
+      return bud_error_str(kBudErrFingerprintEntry, "(not a string)");
+    if (bud_fingerprint_parse(entry, strlen(entry), hash) != 0)
+      return bud_error_str(kBudErrFingerprintEntry, entry);
+    if (bud_fingerprint_insert(fp, hash) != 0)
+      return bud_error_str(kBudErrNoMem, "fingerprint deny list");
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_fingerprint_load_file(bud_fingerprint_t* fp,
+                                      const char* path) {
+  FILE* file;
+  char line[BUD_FINGERPRINT_LINE_MAX];
+  const char* entry;
+  size_t len;
+  uint8_t hash[BUD_FINGERPRINT_LEN];
+  int lineno;
+  bud_error_t err;
+
+  file = fopen(path, "r");
+  if (file == NULL)
+    return bud_error_str(kBudErrFingerprintFile, path);
+
+  err = bud_ok();
+  lineno = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    lineno++;
+
+    /* One hash per line, `#` starts a comment */
+    entry = line + strspn(line, " \t");
+    len = strcspn(entry, " \t\r\n#");
+    if (len == 0)
+      continue;
+
+    if (bud_fingerprint_parse(entry, len, hash) != 0) {
+      bud_log(fp->config,
+              kBudLogWarning,
+              "invalid fingerprint on line %d of %s: \"%.*s\"",
+              lineno,
+              path,
+              (int) len,
+              entry);
+      err = bud_error_str(kBudErrFingerprintFile, path);
+      break;
+    }
+    if (bud_fingerprint_insert(fp, hash) != 0) {
+      err = bud_error_str(kBudErrNoMem, "fingerprint deny list");
+      break;
+    }
+  }
+  fclose(file);
+
+  return err;
+}
+
+
+int bud_fingerprint_parse(const char* str, size_t len, uint8_t* hash) {
+  size_t i;
+  int c;
+  int nibble;
+
+  /* Hex MD5, as JA3 tools print it */
+  if (len != BUD_FINGERPRINT_LEN * 2)
+    return -1;
+
+  for (i = 0; i < len; i++) {
+    c = str[i];
+    if (c >= '0' && c <= '9')
+      nibble = c - '0';
+    else if (c >= 'a' && c <= 'f')
+      nibble = c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      nibble = c - 'A' + 10;
+    else
+      return -1;
+
+    if ((i & 1) == 0)
+      hash[i >> 1] = nibble << 4;
+    else
+      hash[i >> 1] |= nibble;
+  }
+
+  return 0;
+}
+
+
+int bud_fingerprint_insert(bud_fingerprint_t* fp, const uint8_t* hash) {
+  uint8_t (*deny)[BUD_FINGERPRINT_LEN];
+
+  /* Power of two sizes */
+  if ((fp->deny_count & (fp->deny_count - 1)) == 0) {
+    deny = realloc(fp->deny,
+                   (fp->deny_count == 0 ? 1 : fp->deny_count * 2) *
+                       sizeof(*deny));
+    if (deny == NULL)
+      return -1;
+    fp->deny = deny;
+  }
+
+  memcpy(fp->deny[fp->deny_count++], hash, BUD_FINGERPRINT_LEN);
+  return 0;
+}
+
+
+int bud_fingerprint_cmp(const void* a, const void* b) {
+  return memcmp(a, b, BUD_FINGERPRINT_LEN);
+}
+
+
+void bud_fingerprint_count(bud_fingerprint_t* fp, const uint8_t* hash) {
+  bud_fingerprint_slot_t* slot;
+  bud_fingerprint_slot_t* min;
+  int i;
+
+  fp->total++;
+  min = &fp->slots[0];
+  for (i = 0; i < BUD_FINGERPRINT_SLOTS; i++) {
+    slot = &fp->slots[i];
+    if (slot->count != 0 &&
+        memcmp(slot->hash, hash, BUD_FINGERPRINT_LEN) == 0) {
+      slot->count++;
+      return;
+    }
+    if (slot->count < min->count)
+      min = slot;
+  }
+
+  /* Newcomer inherits the count, so the estimate is never below the real */
+  memcpy(min->hash, hash, BUD_FINGERPRINT_LEN);
+  min->count++;
+}
+
+
+void bud_fingerprint_detect(bud_fingerprint_t* fp, uint64_t now) {
+  bud_config_t* config;
+  bud_fingerprint_slot_t* top;
+  bud_fingerprint_slot_t* block;
+  char hex[BUD_FINGERPRINT_LEN * 2 + 1];
+  int i;
+
+  config = fp->config;
+  top = &fp->slots[0];
+  for (i = 1; i < BUD_FINGERPRINT_SLOTS; i++)
+    if (fp->slots[i].count > top->count)
+      top = &fp->slots[i];
+
+  /* Not a flood, or nobody stands out in it */
+  if (fp->total < (uint32_t) config->frontend.fingerprint.flood ||
+      (uint64_t) top->count * 100 <
+          (uint64_t) fp->total * config->frontend.fingerprint.share) {
+    goto done;
+  }
+
+  /* Same one again - just extend it, otherwise take the earliest to expire */
+  block = &fp->blocked[0];
+  for (i = 0; i < BUD_FINGERPRINT_BLOCKED; i++) {
+    if (memcmp(fp->blocked[i].hash, top->hash, BUD_FINGERPRINT_LEN) == 0) {
+      block = &fp->blocked[i];
+      break;
+    }
+    if (fp->blocked[i].until < block->until)
+      block = &fp->blocked[i];
+  }
+  if (block->until <= now) {
+    for (i = 0; i < BUD_FINGERPRINT_LEN; i++)
+      snprintf(hex + i * 2, 3, "%02x", top->hash[i]);
+    bud_log(config,
+            kBudLogWarning,
+            "blocking fingerprint %s for %ds: %u of %u hellos",
+            hex,
+            config->frontend.fingerprint.ttl,
+            top->count,
+            fp->total);
+  }
+  memcpy(block->hash, top->hash, BUD_FINGERPRINT_LEN);
+  block->until = now + (uint64_t) config->frontend.fingerprint.ttl * 1000;
+
+done:
+  memset(fp->slots, 0, sizeof(fp->slots));
+  fp->total = 0;
+  fp->window = now;
+}
+
+
+int bud_fingerprint_is_blocked(bud_fingerprint_t* fp,
+                               const uint8_t* hash,
+                               uint64_t now) {
+  int i;
+
+  for (i = 0; i < BUD_FINGERPRINT_BLOCKED; i++) {
+    if (fp->blocked[i].until > now &&
+        memcmp(fp->blocked[i].hash, hash, BUD_FINGERPRINT_LEN) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
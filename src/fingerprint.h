@@ -0,0 +1,65 @@
+#ifndef SRC_FINGERPRINT_H_
+#define SRC_FINGERPRINT_H_
+
+#include <stdint.h>  /* uint8_t, uint32_t, uint64_t */
+
+#include "error.h"
+#include "hello-parser.h"  /* BUD_FINGERPRINT_LEN */
+
+/* Forward declaration */
+struct bud_config_s;
+
+/* Candidates of the detector, and fingerprints it may block at once */
+#define BUD_FINGERPRINT_SLOTS 16
+#define BUD_FINGERPRINT_BLOCKED 8
+
+/* Longest line of the `frontend.fingerprint.deny` file */
+#define BUD_FINGERPRINT_LINE_MAX 256
+
+typedef struct bud_fingerprint_s bud_fingerprint_t;
+typedef struct bud_fingerprint_slot_s bud_fingerprint_slot_t;
+
+/* `count` is hellos of the window for candidates, `until` for the blocked */
+struct bud_fingerprint_slot_s {
+  uint8_t hash[BUD_FINGERPRINT_LEN];
+  uint32_t count;
+  uint64_t until;
+};
+
+struct bud_fingerprint_s {
+  struct bud_config_s* config;
+
+  /* Sorted `frontend.fingerprint.deny`, looked up with bsearch() */
+  uint8_t (*deny)[BUD_FINGERPRINT_LEN];
+  int deny_count;
+
+  /*
+   * Heavy hitters of the current second (Space-Saving: the rarest candidate
+   * is replaced by the new one). Under a flood the top one is blocked if it
+   * has `share` percent of all hellos.
+   */
+  uint64_t window;
+  uint32_t total;
+  bud_fingerprint_slot_t slots[BUD_FINGERPRINT_SLOTS];
+  bud_fingerprint_slot_t blocked[BUD_FINGERPRINT_BLOCKED];
+};
+
+/*
+ * `frontend.fingerprint`, NULL if there is neither `deny` nor `flood`.
+ * Called again on `reload fingerprint` of the admin socket, the detector
+ * keeps the blocks of `old` (may be NULL).
+ */
+bud_error_t bud_fingerprint_new(struct bud_config_s* config,
+                                const bud_fingerprint_t* old,
+                                bud_fingerprint_t** out);
+void bud_fingerprint_free(bud_fingerprint_t* fp);
+
+/* Count the hello's fingerprint, returns zero if it is denied or blocked */
+int bud_fingerprint_allowed(bud_fingerprint_t* fp,
+                            const uint8_t* hash,
+                            uint64_t now);
+
+/* Blocks of the detector that have not expired yet */
+int bud_fingerprint_blocked_count(const bud_fingerprint_t* fp, uint64_t now);
+
+#endif  /* SRC_FINGERPRINT_H_ */
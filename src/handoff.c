@@ -0,0 +1,156 @@
+#include <fcntl.h>  /* fcntl, F_DUPFD_CLOEXEC */
+#include <stdlib.h>  /* malloc, free */
+
+#include "uv.h"
+
+#include "handoff.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "ipc.h"
+
+static void bud_handoff_send_cb(uv_write_t* req, int status);
+static void bud_handoff_close_cb(uv_handle_t* handle);
+
+
+bud_handoff_t* bud_handoff_new(bud_config_t* config, size_t size) {
+  bud_handoff_t* handoff;
+
+  handoff = malloc(sizeof(*handoff) + BUD_IPC_HEADER_SIZE + size);
+  if (handoff == NULL)
+    return NULL;
+
+  handoff->config = config;
+  handoff->data = NULL;
+  handoff->count = 0;
+  handoff->waiting = 0;
+  handoff->status = 0;
+  handoff->cb = NULL;
+  handoff->size = BUD_IPC_HEADER_SIZE + size;
+  handoff->payload = handoff->msg + BUD_IPC_HEADER_SIZE;
+  bud_ipc_write_header(handoff->msg, kBudIPCHandoff, size);
+  bud_ipc_write_header(handoff->fd_msg, kBudIPCHandoffFd, 0);
+
+  return handoff;
+}
+
+
+int bud_handoff_accept(bud_handoff_t* handoff,
+                       uv_stream_t* ipc,
+                       uv_handle_type pending,
+                       bud_error_t* err) {
+  int r;
+  uv_stream_t* handle;
+
+  ASSERT(handoff->count < 2, "Extra handoff socket");
+  handle = (uv_stream_t*) &handoff->handles[handoff->count];
+
+  /* Backend might be a Unix socket */
+  if (pending == UV_NAMED_PIPE)
+    r = uv_pipe_init(handoff->config->loop, (uv_pipe_t*) handle, 0);
+  else
+    r = uv_tcp_init(handoff->config->loop, (uv_tcp_t*) handle);
+  if (r != 0)
+    goto fatal;
+  handle->data = handoff;
+  handoff->types[handoff->count++] = pending;
+
+  /* Closed by bud_handoff_free() on failure, as the initialized ones are */
+  r = uv_accept(ipc, handle);
+  if (r != 0)
+    goto fatal;
+
+  return handoff->count == 2;
+
+fatal:
+  *err = bud_error_num(kBudErrHandoffAccept, r);
+  return -1;
+}
+
+
+bud_error_t bud_handoff_send(bud_handoff_t* handoff,
+                             uv_stream_t* ipc,
+                             uv_stream_t* frontend,
+                             uv_stream_t* backend,
+                             bud_handoff_cb cb) {
+  int i;
+  int r;
+  uv_buf_t buf;
+  uv_stream_t* sockets[2];
+
+  handoff->cb = cb;
+  handoff->status = 0;
+  for (i = 0; i < 3; i++)
+    handoff->reqs[i].data = handoff;
+
+  buf = uv_buf_init(handoff->msg, handoff->size);
+  r = uv_write(&handoff->reqs[0], ipc, &buf, 1, bud_handoff_send_cb);
+  if (r != 0)
+    return bud_error_num(kBudErrIPCSend, r);
+  handoff->waiting = 1;
+
+  /* Queued already, failure is reported to the `cb` */
+  sockets[0] = frontend;
+  sockets[1] = backend;
+  for (i = 0; i < 2; i++) {
+    buf = uv_buf_init(handoff->fd_msg, sizeof(handoff->fd_msg));
+    r = uv_write2(&handoff->reqs[i + 1],
+                  ipc,
+                  &buf,
+                  1,
+                  sockets[i],
+                  bud_handoff_send_cb);
+    if (r != 0) {
+      handoff->status = r;
+      break;
+    }
+    handoff->waiting++;
+  }
+
+  return bud_ok();
+}
+
+
+void bud_handoff_send_cb(uv_write_t* req, int status) {
+  bud_handoff_t* handoff;
+
+  handoff = req->data;
+  if (status != 0 && handoff->status == 0)
+    handoff->status = status;
+  if (--handoff->waiting == 0)
+    handoff->cb(handoff, handoff->status);
+}
+
+
+int bud_handoff_dup(bud_handoff_t* handoff, int index) {
+  uv_os_fd_t fd;
+
+  if (index >= handoff->count)
+    return -1;
+  if (uv_fileno((uv_handle_t*) &handoff->handles[index], &fd) != 0)
+    return -1;
+
+  return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+
+void bud_handoff_free(bud_handoff_t* handoff) {
+  int i;
+
+  if (handoff->count == 0)
+    return free(handoff);
+
+  handoff->waiting = handoff->count;
+  for (i = 0; i < handoff->count; i++)
+    uv_close((uv_handle_t*) &handoff->handles[i], bud_handoff_close_cb);
+  handoff->count = 0;
+}
+
+
+void bud_handoff_close_cb(uv_handle_t* handle) {
+  bud_handoff_t* handoff;
+
+  handoff = handle->data;
+  if (--handoff->waiting == 0)
+    free(handoff);
+}
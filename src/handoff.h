@@ -0,0 +1,80 @@
+#ifndef SRC_HANDOFF_H_
+#define SRC_HANDOFF_H_
+
+#include <stdlib.h>  /* size_t */
+
+#include "uv.h"
+
+#include "error.h"
+#include "ipc.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+/* Listener index + size of the frontend's output, see kBudIPCHandoff */
+#define BUD_HANDOFF_HEADER_SIZE 8
+
+typedef struct bud_handoff_s bud_handoff_t;
+typedef void (*bud_handoff_cb)(bud_handoff_t* handoff, int status);
+
+/*
+ * Passthrough relay that moves out of a draining worker (`drain_handoff`).
+ * It carries no TLS state of its own, so the sockets and the data that was
+ * read but not yet written are all there is to it. Worker sends them to the
+ * master, master gathers them and sends the same to the new generation.
+ */
+struct bud_handoff_s {
+  struct bud_config_s* config;
+  void* data;
+
+  /* Received sockets: frontend's, and then backend's one */
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  } handles[2];
+  uv_handle_type types[2];
+  int count;
+
+  /* Writes in flight (or handles being closed), first error of them */
+  uv_write_t reqs[3];
+  int waiting;
+  int status;
+  bud_handoff_cb cb;
+
+  char fd_msg[BUD_IPC_HEADER_SIZE];
+
+  /* kBudIPCHandoff message, `payload` is right after the header */
+  char* payload;
+  size_t size;
+  char msg[1];
+};
+
+/* `size` bytes of payload are filled by the caller */
+bud_handoff_t* bud_handoff_new(struct bud_config_s* config, size_t size);
+
+/*
+ * Take the socket that came with kBudIPCHandoffFd, returns 1 once both of
+ * them are there, 0 if the backend's one is still expected and -1 on error.
+ */
+int bud_handoff_accept(bud_handoff_t* handoff,
+                       uv_stream_t* ipc,
+                       uv_handle_type pending,
+                       bud_error_t* err);
+
+/*
+ * Send the message and sockets over `ipc`, `cb` is called once all of
+ * them are written. Sockets must stay open until then.
+ */
+bud_error_t bud_handoff_send(bud_handoff_t* handoff,
+                             uv_stream_t* ipc,
+                             uv_stream_t* frontend,
+                             uv_stream_t* backend,
+                             bud_handoff_cb cb);
+
+/* Duplicate of the received socket, -1 on failure */
+int bud_handoff_dup(bud_handoff_t* handoff, int index);
+
+/* Close the received sockets, and free it once they are closed */
+void bud_handoff_free(bud_handoff_t* handoff);
+
+#endif  /* SRC_HANDOFF_H_ */
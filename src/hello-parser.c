@@ -1,6 +1,9 @@
 #include <stdint.h>  /* uint8_t */
-#include <stdlib.h>  /* NULL */
-#include <string.h>  /* memset */
+#include <stdio.h>  /* snprintf */
+#include <stdlib.h>  /* NULL, malloc, free */
+#include <string.h>  /* memset, memcpy */
+
+#include "openssl/md5.h"
 
 #include "hello-parser.h"
 #include "error.h"
@@ -16,6 +19,11 @@ struct bud_parser_state_s {
   size_t extension_offset;
 
   bud_client_hello_t* hello;
+
+  /* JA3 of the hello, and `ec_point_formats` that only it needs */
+  MD5_CTX ja3;
+  const uint8_t* formats;
+  size_t formats_len;
 };
 
 enum frame_type_e {
@@ -33,18 +41,27 @@ enum handshake_type_e {
 enum extension_type_e {
   kServername = 0,
   kStatusRequest = 5,
+  kSupportedGroups = 10,
+  kECPointFormats = 11,
+  kSignatureAlgorithms = 13,
+  kALPN = 16,
   kTLSSessionTicket = 35,
+  kSupportedVersions = 43,
 
   kMaxExtension = 0xffff
 };
 
 static const size_t kMaxTLSFrameLen = 16 * 1024 + 5;
+static const size_t kMaxHelloLen = 64 * 1024;
 static const uint8_t kServernameHostname = 0;
 static const uint8_t kStatusRequestOCSP = 1;
 
 static bud_error_t bud_parse_record_header(const uint8_t* data,
                                            size_t size,
                                            bud_parser_state_t* state);
+static bud_error_t bud_parse_message(bud_hello_parser_t* parser,
+                                     const uint8_t* data,
+                                     size_t size);
 static bud_error_t bud_parse_header(const uint8_t* data,
                                     size_t size,
                                     bud_parser_state_t* state);
@@ -55,20 +72,148 @@ static bud_error_t bud_parse_extension(extension_type_t type,
                                        const uint8_t* data,
                                        size_t size,
                                        bud_parser_state_t* state);
+static int bud_parse_list(const uint8_t* data,
+                          size_t size,
+                          size_t prefix,
+                          const char** list,
+                          size_t* list_len);
+static void bud_parse_ja3_value(bud_parser_state_t* state,
+                                unsigned int value,
+                                int* first);
+static void bud_parse_ja3_list(bud_parser_state_t* state,
+                               const uint8_t* data,
+                               size_t size,
+                               size_t width);
+static void bud_parse_ja3_done(bud_parser_state_t* state);
+
+void bud_hello_parser_init(bud_hello_parser_t* parser) {
+  memset(parser, 0, sizeof(*parser));
+}
+
+
+void bud_hello_parser_destroy(bud_hello_parser_t* parser) {
+  free(parser->msg);
+  parser->msg = NULL;
+}
+
 
-bud_error_t bud_parse_client_hello(const char* data,
-                                   size_t size,
-                                   bud_client_hello_t* hello) {
+bud_error_t bud_hello_parser_execute(bud_hello_parser_t* parser,
+                                     const char* data,
+                                     size_t size,
+                                     bud_client_hello_t* hello) {
   bud_parser_state_t state;
   bud_error_t err;
+  const uint8_t* in;
+  size_t n;
+
+  if (parser->done)
+    return bud_ok();
+
+  in = (const uint8_t*) data;
+  while (size > 0) {
+    /* Collect record header */
+    if (parser->record_len < sizeof(parser->record)) {
+      n = sizeof(parser->record) - parser->record_len;
+      if (n > size)
+        n = size;
+      memcpy(parser->record + parser->record_len, in, n);
+      parser->record_len += n;
+      parser->consumed += n;
+      in += n;
+      size -= n;
+      if (parser->record_len < sizeof(parser->record))
+        break;
+
+      err = bud_parse_record_header(parser->record,
+                                    parser->record_len,
+                                    &state);
+      if (!bud_is_ok(err))
+        return err;
+      if (parser->record[0] != kHandshake)
+        return bud_error_str(kBudErrParserErr, "Unexpected first record");
+      parser->frame_left = state.frame_len;
+      continue;
+    }
+
+    /* Next record */
+    if (parser->frame_left == 0) {
+      parser->record_len = 0;
+      continue;
+    }
+
+    n = parser->frame_left;
+    if (n > size)
+      n = size;
+    err = bud_parse_message(parser, in, n);
+    if (!bud_is_ok(err) && err.code != kBudErrParserNeedMore)
+      return err;
+    parser->frame_left -= n;
+    parser->consumed += n;
+    in += n;
+    size -= n;
+
+    /* Message is complete */
+    if (bud_is_ok(err)) {
+      state.body_offset = 0;
+      state.hello = hello;
+      err = bud_parse_header((const uint8_t*) parser->msg,
+                             parser->msg_len,
+                             &state);
+      if (!bud_is_ok(err))
+        return err;
+      parser->done = 1;
+      return bud_ok();
+    }
+  }
+
+  return bud_error(kBudErrParserNeedMore);
+}
 
-  state.hello = hello;
 
-  err = bud_parse_record_header((const uint8_t*) data, size, &state);
-  if (!bud_is_ok(err))
-    return err;
+bud_error_t bud_parse_message(bud_hello_parser_t* parser,
+                              const uint8_t* data,
+                              size_t size) {
+  size_t n;
+
+  /* Collect handshake header to learn the message length */
+  if (parser->msg == NULL) {
+    n = sizeof(parser->header) - parser->header_len;
+    if (n > size)
+      n = size;
+    memcpy(parser->header + parser->header_len, data, n);
+    parser->header_len += n;
+    data += n;
+    size -= n;
+    if (parser->header_len < sizeof(parser->header))
+      return bud_error(kBudErrParserNeedMore);
+
+    if (parser->header[0] != kClientHello)
+      return bud_error_str(kBudErrParserErr, "Unexpected first record");
+
+    parser->msg_len = (parser->header[1] << 16) +
+                      (parser->header[2] << 8) +
+                      parser->header[3] +
+                      sizeof(parser->header);
+    if (parser->msg_len > kMaxHelloLen)
+      return bud_error_str(kBudErrParserErr, "Hello length OOB");
+
+    parser->msg = malloc(parser->msg_len);
+    if (parser->msg == NULL)
+      return bud_error_str(kBudErrNoMem, "hello message");
+    memcpy(parser->msg, parser->header, sizeof(parser->header));
+    parser->msg_off = sizeof(parser->header);
+  }
+
+  /* Anything past the hello is not ours to look at */
+  n = parser->msg_len - parser->msg_off;
+  if (n > size)
+    n = size;
+  memcpy(parser->msg + parser->msg_off, data, n);
+  parser->msg_off += n;
 
-  return bud_parse_header((const uint8_t*) data, size, &state);
+  if (parser->msg_off < parser->msg_len)
+    return bud_error(kBudErrParserNeedMore);
+  return bud_ok();
 }
 
 
@@ -105,10 +250,7 @@ bud_error_t bud_parse_header(const uint8_t* data,
                              bud_parser_state_t* state) {
   bud_error_t err;
 
-  /* >= 5 + frame size bytes for frame parsing */
-  if (state->body_offset + state->frame_len > size)
-    return bud_error(kBudErrParserNeedMore);
-
+  /* Whole handshake message is in `data` */
   if (data[state->body_offset] == kClientHello) {
     /* Clear hello, just in case if we will return bud_ok() ;) */
     memset(state->hello, 0, sizeof(*state->hello));
@@ -146,11 +288,14 @@ bud_error_t bud_parse_tls_client_hello(const uint8_t* data,
   size_t ext_off;
   uint16_t ext_type;
   uint16_t ext_len;
+  int first;
 
-  /* Skip frame header, hello header, protocol version and random data */
+  /* Skip hello header, protocol version and random data */
   session_offset = state->body_offset + 4 + 2 + 32;
   if (session_offset + 1 >= size)
     return bud_error_str(kBudErrParserErr, "Header OOB");
+  state->hello->version = (data[state->body_offset + 4] << 8) +
+                          data[state->body_offset + 5];
 
   body = data + session_offset;
   state->hello->session_len = *body;
@@ -162,8 +307,24 @@ bud_error_t bud_parse_tls_client_hello(const uint8_t* data,
 
   cipher_len = (data[cipher_offset] << 8) + data[cipher_offset + 1];
   comp_offset = cipher_offset + 2 + cipher_len;
-  if (comp_offset > size)
+  if (comp_offset >= size)
     return bud_error_str(kBudErrParserErr, "Cipher suite OOB");
+  state->hello->ciphers = (const char*) data + cipher_offset + 2;
+  state->hello->ciphers_len = cipher_len;
+
+  /* Extension types are hashed in their order, as they are visited */
+  MD5_Init(&state->ja3);
+  state->formats = NULL;
+  state->formats_len = 0;
+  first = 1;
+  bud_parse_ja3_value(state, state->hello->version, &first);
+  MD5_Update(&state->ja3, ",", 1);
+  bud_parse_ja3_list(state,
+                     (const uint8_t*) state->hello->ciphers,
+                     state->hello->ciphers_len,
+                     2);
+  MD5_Update(&state->ja3, ",", 1);
+  first = 1;
 
   comp_len = data[comp_offset];
   extension_offset = comp_offset + 1 + comp_len;
@@ -171,8 +332,10 @@ bud_error_t bud_parse_tls_client_hello(const uint8_t* data,
     return bud_error_str(kBudErrParserErr, "Compression methods OOB");
 
   /* No extensions present */
-  if (extension_offset == size)
+  if (extension_offset == size) {
+    bud_parse_ja3_done(state);
     return bud_ok();
+  }
 
   ext_off = extension_offset + 2;
 
@@ -190,6 +353,8 @@ bud_error_t bud_parse_tls_client_hello(const uint8_t* data,
     if (ext_off + ext_len > size)
       return bud_error_str(kBudErrParserErr, "Extension body OOB");
 
+    bud_parse_ja3_value(state, ext_type, &first);
+
     err = bud_parse_extension((extension_type_t) ext_type,
                               data + ext_off,
                               ext_len,
@@ -204,6 +369,7 @@ bud_error_t bud_parse_tls_client_hello(const uint8_t* data,
   if (ext_off > size)
     return bud_error_str(kBudErrParserErr, "Extensions OOB");
 
+  bud_parse_ja3_done(state);
   return bud_ok();
 }
 
@@ -256,9 +422,51 @@ bud_error_t bud_parse_extension(extension_type_t type,
       /* Ignore extensions, they won't work with caching on backend anyway */
       state->hello->ocsp_request = 1;
       break;
+    case kSupportedGroups:
+      if (bud_parse_list(data,
+                         size,
+                         2,
+                         &state->hello->groups,
+                         &state->hello->groups_len) != 0) {
+        return bud_error_str(kBudErrParserErr, "Supported groups OOB");
+      }
+      break;
+    case kSignatureAlgorithms:
+      if (bud_parse_list(data,
+                         size,
+                         2,
+                         &state->hello->sig_algs,
+                         &state->hello->sig_algs_len) != 0) {
+        return bud_error_str(kBudErrParserErr, "Signature algorithms OOB");
+      }
+      break;
+    case kALPN:
+      if (bud_parse_list(data,
+                         size,
+                         2,
+                         &state->hello->alpn,
+                         &state->hello->alpn_len) != 0) {
+        return bud_error_str(kBudErrParserErr, "ALPN OOB");
+      }
+      break;
+    case kSupportedVersions:
+      if (bud_parse_list(data,
+                         size,
+                         1,
+                         &state->hello->versions,
+                         &state->hello->versions_len) != 0) {
+        return bud_error_str(kBudErrParserErr, "Supported versions OOB");
+      }
+      break;
+    case kECPointFormats:
+      if (size < 1 || (size_t) data[0] + 1 > size)
+        return bud_error_str(kBudErrParserErr, "EC point formats OOB");
+      state->formats = data + 1;
+      state->formats_len = data[0];
+      break;
     case kTLSSessionTicket:
       state->hello->ticket_len = size;
-      state->hello->ticket = (const char*) data + size;
+      state->hello->ticket = (const char*) data;
       break;
     default:
       /* Ignore */
@@ -267,3 +475,73 @@ bud_error_t bud_parse_extension(extension_type_t type,
 
   return bud_ok();
 }
+
+
+/* Vector with `prefix`-byte length, returns non-zero if it doesn't fit */
+int bud_parse_list(const uint8_t* data,
+                   size_t size,
+                   size_t prefix,
+                   const char** list,
+                   size_t* list_len) {
+  size_t len;
+
+  if (size < prefix)
+    return -1;
+
+  len = data[0];
+  if (prefix == 2)
+    len = (len << 8) + data[1];
+  if (len + prefix > size)
+    return -1;
+
+  *list = (const char*) data + prefix;
+  *list_len = len;
+  return 0;
+}
+
+
+/* Decimal `value` after a dash, unless it is the `first` one or GREASE */
+void bud_parse_ja3_value(bud_parser_state_t* state,
+                         unsigned int value,
+                         int* first) {
+  char num[8];
+  int len;
+
+  /* RFC 8701: 0x0a0a, 0x1a1a, ... 0xfafa */
+  if ((value & 0x0f0f) == 0x0a0a && (value >> 8) == (value & 0xff))
+    return;
+
+  len = snprintf(num, sizeof(num), *first ? "%u" : "-%u", value);
+  MD5_Update(&state->ja3, num, len);
+  *first = 0;
+}
+
+
+void bud_parse_ja3_list(bud_parser_state_t* state,
+                        const uint8_t* data,
+                        size_t size,
+                        size_t width) {
+  unsigned int value;
+  size_t i;
+  int first;
+
+  first = 1;
+  for (i = 0; i + width <= size; i += width) {
+    value = data[i];
+    if (width == 2)
+      value = (value << 8) | data[i + 1];
+    bud_parse_ja3_value(state, value, &first);
+  }
+}
+
+
+void bud_parse_ja3_done(bud_parser_state_t* state) {
+  MD5_Update(&state->ja3, ",", 1);
+  bud_parse_ja3_list(state,
+                     (const uint8_t*) state->hello->groups,
+                     state->hello->groups_len,
+                     2);
+  MD5_Update(&state->ja3, ",", 1);
+  bud_parse_ja3_list(state, state->formats, state->formats_len, 1);
+  MD5_Final(state->hello->fingerprint, &state->ja3);
+}
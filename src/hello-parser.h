@@ -1,11 +1,34 @@
 #ifndef SRC_HELLO_PARSER_H_
 #define SRC_HELLO_PARSER_H_
 
+#include <stdint.h>  /* uint8_t */
+#include <stdlib.h>  /* size_t */
+
 #include "error.h"
 
+/* MD5 of the JA3 string of ClientHello */
+#define BUD_FINGERPRINT_LEN 16
+
 typedef struct bud_client_hello_s bud_client_hello_t;
+typedef struct bud_hello_parser_s bud_hello_parser_t;
 
+/*
+ * Lists are raw wire encoding, without the length prefix: big-endian 16-bit
+ * entries for `ciphers`, `groups`, `sig_algs` and `versions`, and
+ * 8-bit length-prefixed protocol names for `alpn`. `*_len` is in bytes.
+ */
 struct bud_client_hello_s {
+  uint16_t version;
+  const char* ciphers;
+  size_t ciphers_len;
+  const char* groups;
+  size_t groups_len;
+  const char* sig_algs;
+  size_t sig_algs_len;
+  const char* alpn;
+  size_t alpn_len;
+  const char* versions;
+  size_t versions_len;
   const char* session;
   size_t session_len;
   const char* servername;
@@ -13,10 +36,48 @@ struct bud_client_hello_s {
   const char* ticket;
   size_t ticket_len;
   int ocsp_request;
+
+  /*
+   * JA3: version, ciphers, extension types, groups and point formats, GREASE
+   * values left out. Hashed while parsing, nothing is allocated for it
+   */
+  uint8_t fingerprint[BUD_FINGERPRINT_LEN];
+};
+
+/*
+ * Resumable parser, ClientHello may come in any number of pieces and span
+ * several TLS records. Every input byte is looked at once, handshake message
+ * is reassembled into `msg` and `hello`'s fields point into it.
+ */
+struct bud_hello_parser_s {
+  /* Current record header, and bytes of its body left */
+  uint8_t record[5];
+  size_t record_len;
+  size_t frame_left;
+
+  /* Handshake message header, and the whole message once it is known */
+  uint8_t header[4];
+  size_t header_len;
+  char* msg;
+  size_t msg_len;
+  size_t msg_off;
+
+  /* Total input bytes consumed */
+  size_t consumed;
+  int done;
 };
 
-bud_error_t bud_parse_client_hello(const char* data,
-                                   size_t size,
-                                   bud_client_hello_t* hello);
+void bud_hello_parser_init(bud_hello_parser_t* parser);
+void bud_hello_parser_destroy(bud_hello_parser_t* parser);
+
+/*
+ * Feed bytes that follow the previously consumed ones (see `consumed`).
+ * Returns `kBudErrParserNeedMore` until the whole ClientHello is here, `hello`
+ * is valid until `bud_hello_parser_destroy()` after `bud_ok()`.
+ */
+bud_error_t bud_hello_parser_execute(bud_hello_parser_t* parser,
+                                     const char* data,
+                                     size_t size,
+                                     bud_client_hello_t* hello);
 
 #endif  /* SRC_HELLO_PARSER_H_ */
@@ -1,5 +1,7 @@
+#include <netdb.h>  /* struct addrinfo */
 #include <stdlib.h>  /* malloc */
 #include <string.h>  /* strlen */
+#include <strings.h>  /* strncasecmp */
 
 #include "uv.h"
 #include "http_parser.h"
@@ -9,49 +11,120 @@
 #include "http-pool.h"
 #include "common.h"
 #include "config.h"
+#include "logger.h"
+#include "metrics.h"
 #include "queue.h"
 
+static int bud_http_host_lookup(bud_http_host_t* host);
+static int bud_http_host_set_addrs(bud_http_host_t* host,
+                                   struct addrinfo* res);
+static void bud_http_pool_close_cb(uv_handle_t* handle);
+static void bud_http_pool_unref(bud_http_pool_t* pool);
+static void bud_http_pool_destroy(bud_http_pool_t* pool);
+static int bud_http_pool_lookup(bud_http_pool_t* pool);
+static int bud_http_pool_resolving(bud_http_pool_t* pool);
+static int bud_http_pool_ready(bud_http_pool_t* pool);
+static void bud_http_pool_resolve_timer_cb(uv_timer_t* timer, int status);
+static void bud_http_pool_resolve_cb(uv_getaddrinfo_t* req,
+                                     int status,
+                                     struct addrinfo* res);
+static void bud_http_pool_pick(bud_http_pool_t* pool,
+                               bud_http_conn_t* conn,
+                               bud_http_conn_t* avoid);
+static int bud_http_pool_can_failover(bud_http_pool_t* pool);
+static bud_http_conn_t* bud_http_pool_find_conn(bud_http_pool_t* pool,
+                                                bud_http_request_t* req);
+static bud_error_t bud_http_pool_schedule(bud_http_pool_t* pool,
+                                          bud_http_request_t* req);
+static void bud_http_pool_next(bud_http_pool_t* pool);
+static int bud_http_pool_can_connect(bud_http_pool_t* pool);
+static int bud_http_pool_is_down(bud_http_pool_t* pool);
+static void bud_http_pool_failed(bud_http_pool_t* pool);
+static void bud_http_pool_arm(bud_http_pool_t* pool);
+static void bud_http_pool_timer_cb(uv_timer_t* timer, int status);
+static void bud_http_pool_hedge(bud_http_pool_t* pool,
+                                bud_http_request_t* req);
+static void bud_http_pool_observe(bud_http_pool_t* pool, uint64_t duration);
+static int bud_http_sample_cmp(const void* a, const void* b);
+static int bud_http_is_io_error(bud_error_t err);
 static bud_http_request_t* bud_http_request(bud_http_pool_t* pool,
                                             bud_http_method_t method,
                                             const char* fmt,
                                             const char* arg,
                                             size_t arg_len,
-                                            const char* body,
-                                            size_t body_len,
+                                            bud_http_body_t* body,
+                                            const char* content_type,
+                                            int raw,
                                             bud_http_cb cb,
                                             bud_error_t* err);
-static bud_http_request_t* bud_http_request_new(bud_http_pool_t* pool,
-                                                bud_error_t* err);
-static bud_error_t bud_http_request_send(bud_http_request_t* req);
-static void bud_http_request_write_cb(uv_write_t* req, int status);
-static void bud_http_request_connect_cb(uv_connect_t* connect, int status);
-static void bud_http_request_alloc_cb(uv_handle_t* handle,
-                                      size_t suggested_size,
-                                      uv_buf_t* buf);
-static void bud_http_request_read_cb(uv_stream_t* stream,
-                                     ssize_t nread,
-                                     const uv_buf_t* buf);
-static int bud_http_request_body_cb(http_parser* parser,
-                                    const char *at,
-                                    size_t length);
-static int bud_http_request_message_complete_cb(http_parser* parser);
-static void bud_http_request_close_cb(uv_handle_t* handle);
-static void bud_http_request_error(bud_http_request_t* request,
-                                   bud_error_t err);
-static void bud_http_request_done(bud_http_request_t* request);
-static char* bud_http_request_escape_url(const char* fmt,
-                                         const char* arg,
-                                         size_t arg_len,
-                                         size_t* size);
+static bud_http_request_t* bud_http_request_alloc(bud_http_pool_t* pool,
+                                                  bud_http_method_t method,
+                                                  char* url,
+                                                  size_t url_len,
+                                                  bud_http_body_t* body,
+                                                  const char* content_type,
+                                                  int raw,
+                                                  bud_http_cb cb,
+                                                  bud_error_t* err);
+static void bud_http_request_hedge_cb(bud_http_request_t* req,
+                                      bud_error_t err);
+static void bud_http_request_unhedge(bud_http_request_t* req, int cancel);
+static void bud_http_request_fail(bud_http_request_t* req, bud_error_t err);
+static void bud_http_request_free(bud_http_request_t* req);
+static size_t bud_http_request_bufs(bud_http_request_t* req, uv_buf_t* bufs);
+static bud_http_conn_t* bud_http_conn_new(bud_http_pool_t* pool,
+                                          bud_http_conn_t* avoid,
+                                          bud_error_t* err);
+static void bud_http_conn_buf_init(bud_http_conn_t* conn);
+static bud_http_request_t* bud_http_conn_head(bud_http_conn_t* conn);
+static bud_error_t bud_http_conn_attach(bud_http_conn_t* conn,
+                                        bud_http_request_t* req);
+static void bud_http_conn_detach(bud_http_conn_t* conn,
+                                 bud_http_request_t* req);
+static void bud_http_conn_idle(bud_http_conn_t* conn);
+static void bud_http_conn_mark_addr(bud_http_conn_t* conn, int failed);
+static void bud_http_conn_requeue(bud_http_conn_t* conn, int retry);
+static int bud_http_conn_expired(bud_http_conn_t* conn, uint64_t now);
+static bud_error_t bud_http_conn_flush(bud_http_conn_t* conn);
+static void bud_http_conn_write_cb(uv_write_t* req, int status);
+static void bud_http_conn_connect_cb(uv_connect_t* connect, int status);
+static void bud_http_conn_alloc_cb(uv_handle_t* handle,
+                                   size_t suggested_size,
+                                   uv_buf_t* buf);
+static void bud_http_conn_read_cb(uv_stream_t* stream,
+                                  ssize_t nread,
+                                  const uv_buf_t* buf);
+static void bud_http_conn_parse(bud_http_conn_t* conn,
+                                const char* data,
+                                size_t size);
+static void bud_http_conn_response(bud_http_conn_t* conn);
+static void bud_http_parse_cache_control(const char* value,
+                                         size_t len,
+                                         int* max_age,
+                                         int* stale);
+static int bud_http_conn_message_begin_cb(http_parser* parser);
+static int bud_http_conn_header_field_cb(http_parser* parser,
+                                         const char* at,
+                                         size_t length);
+static int bud_http_conn_header_value_cb(http_parser* parser,
+                                         const char* at,
+                                         size_t length);
+static int bud_http_conn_body_cb(http_parser* parser,
+                                 const char *at,
+                                 size_t length);
+static int bud_http_conn_message_complete_cb(http_parser* parser);
+static void bud_http_conn_close_cb(uv_handle_t* handle);
+static void bud_http_conn_close(bud_http_conn_t* conn, bud_error_t err);
+static void bud_http_conn_done(bud_http_conn_t* conn);
 
 static http_parser_settings bud_parser_settings = {
+  bud_http_conn_message_begin_cb,
   NULL,
+  bud_http_conn_header_field_cb,
+  bud_http_conn_header_value_cb,
   NULL,
-  NULL,
-  NULL,
-  NULL,
-  bud_http_request_body_cb,
-  bud_http_request_message_complete_cb
+  bud_http_conn_body_cb,
+  bud_http_conn_message_complete_cb
 };
 
 bud_http_pool_t* bud_http_pool_new(bud_config_t* config,
@@ -67,8 +140,9 @@ bud_http_pool_t* bud_http_pool_new(bud_config_t* config,
     goto fatal;
   }
 
-  QUEUE_INIT(&pool->pool);
-  QUEUE_INIT(&pool->reqs);
+  QUEUE_INIT(&pool->idle);
+  QUEUE_INIT(&pool->busy);
+  QUEUE_INIT(&pool->pending);
 
   pool->host_len = strlen(host);
   pool->host = malloc(pool->host_len + 1);
@@ -79,19 +153,69 @@ bud_http_pool_t* bud_http_pool_new(bud_config_t* config,
   }
 
   pool->config = config;
+  pool->host_count = 0;
+  pool->next_addr = 0;
+  pool->extract = NULL;
+  pool->max_connections = 0;
+  pool->timeout = 0;
+  pool->pipeline = 1;
+  pool->idle_timeout = 0;
+  pool->max_fails = 0;
+  pool->backoff = 0;
+  pool->max_backoff = 0;
+  pool->resolve_interval = 0;
+  pool->hedge = 0;
+  pool->hedge_delay = 0;
+  pool->sample_count = 0;
+  pool->connections = 0;
+  pool->fails = 0;
+  pool->down_until = 0;
+  pool->down_backoff = 0;
+  pool->closing = 0;
+  pool->refs = 0;
   memcpy(pool->host, host, pool->host_len + 1);
+  pool->is_pipe = BUD_HOST_IS_PIPE(pool->host);
+
+  /* Deadlines, started on first request if `timeout` is set */
+  r = uv_timer_init(config->loop, &pool->timer);
+  if (r != 0) {
+    *err = bud_error_num(kBudErrHttpTimer, r);
+    goto failed_timer_init;
+  }
+  pool->timer.data = pool;
+  uv_unref((uv_handle_t*) &pool->timer);
 
-  r = bud_config_str_to_addr(pool->host, pool->port, &pool->addr);
+  /* Lookups, started by `bud_http_pool_configure()` */
+  r = uv_timer_init(config->loop, &pool->resolve_timer);
   if (r != 0) {
-    *err = bud_error_num(kBudErrPton, r);
-    goto failed_str_to_addr;
+    *err = bud_error_num(kBudErrHttpTimer, r);
+    goto failed_resolve_timer_init;
+  }
+  pool->resolve_timer.data = pool;
+  uv_unref((uv_handle_t*) &pool->resolve_timer);
+
+  /* Unix socket path is used as is */
+  if (!pool->is_pipe) {
+    *err = bud_http_pool_add_host(pool, pool->host);
+    if (!bud_is_ok(*err)) {
+      bud_http_pool_free(pool);
+      return NULL;
+    }
   }
 
   *err = bud_ok();
   return pool;
 
-failed_str_to_addr:
-  free(pool->host);
+failed_resolve_timer_init:
+  /* Freed in close_cb */
+  pool->closing = 1;
+  pool->refs = 1;
+  uv_close((uv_handle_t*) &pool->timer, bud_http_pool_close_cb);
+  return NULL;
+
+failed_timer_init:
+  bud_http_pool_destroy(pool);
+  return NULL;
 
 failed_allocate_host:
   free(pool);
@@ -101,512 +225,1825 @@ fatal:
 }
 
 
-void bud_http_pool_free(bud_http_pool_t* pool) {
-  QUEUE* q;
-  bud_http_request_t* req;
+bud_error_t bud_http_pool_add_host(bud_http_pool_t* pool, const char* host) {
+  bud_http_host_t* h;
+  bud_error_t err;
 
-  /* Cancel requests */
-  while (!QUEUE_EMPTY(&pool->pool)) {
-    q = QUEUE_HEAD(&pool->pool);
-    req = QUEUE_DATA(q, bud_http_request_t, member);
-    bud_http_request_cancel(req);
-    req->pool = NULL;
+  /* Unix sockets aren't balanced */
+  if (pool->is_pipe ||
+      BUD_HOST_IS_PIPE(host) ||
+      pool->host_count == (int) ARRAY_SIZE(pool->hosts)) {
+    return bud_error_str(kBudErrHttpHost, host);
   }
 
-  while (!QUEUE_EMPTY(&pool->reqs)) {
-    q = QUEUE_HEAD(&pool->reqs);
-    req = QUEUE_DATA(q, bud_http_request_t, member);
-    bud_http_request_cancel(req);
-    req->pool = NULL;
+  h = &pool->hosts[pool->host_count];
+  h->pool = pool;
+  h->resolving = 0;
+  h->addr_count = 0;
+  h->name = strdup(host);
+  if (h->name == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_http_host_t name");
+
+  memset(&h->addrs[0], 0, sizeof(h->addrs[0]));
+  h->retry_at[0] = 0;
+  h->is_name = bud_config_str_to_addr(h->name, pool->port, &h->addrs[0]) != 0;
+  if (h->is_name) {
+    /*
+     * Pools are created lazily too (e.g. for OCSP responders), so the
+     * lookup shouldn't block the loop. Requests wait in `pending` for it.
+     */
+    if (bud_http_host_lookup(h) != 0) {
+      err = bud_error_str(kBudErrHttpResolve, h->name);
+      free(h->name);
+      h->name = NULL;
+      return err;
+    }
+  } else {
+    h->addr_count = 1;
   }
 
-  /* Free pool */
-  free(pool->host);
-  pool->host = NULL;
-  free(pool);
+  pool->host_count++;
+  return bud_ok();
 }
 
 
-bud_http_request_t* bud_http_request(bud_http_pool_t* pool,
-                                     bud_http_method_t method,
-                                     const char* fmt,
-                                     const char* arg,
-                                     size_t arg_len,
-                                     const char* body,
-                                     size_t body_len,
-                                     bud_http_cb cb,
-                                     bud_error_t* err) {
-  bud_http_request_t* req;
-  char* body_copy;
-  char* url;
-  size_t url_len;
-  QUEUE* q;
+int bud_http_host_lookup(bud_http_host_t* host) {
+  struct addrinfo hints;
+  int r;
 
-  /* Clone body */
-  if (body_len != 0) {
-    body_copy = malloc(body_len);
-    if (body_copy == NULL) {
-      *err = bud_error_str(kBudErrNoMem, "body_copy");
-      goto fatal;
-    }
-    memcpy(body_copy, body, body_len);
-  } else {
-    body_copy = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  r = uv_getaddrinfo(host->pool->config->loop,
+                     &host->resolver,
+                     bud_http_pool_resolve_cb,
+                     host->name,
+                     NULL,
+                     &hints);
+  if (r != 0) {
+    bud_log(host->pool->config,
+            kBudLogWarning,
+            "http pool failed to resolve %s: \"%s\"",
+            host->name,
+            uv_strerror(r));
+    return r;
   }
 
-  /* Format url */
-  url = bud_http_request_escape_url(fmt, arg, arg_len, &url_len);
-  if (url == NULL) {
-    *err = bud_error_str(kBudErrNoMem, "bud_http_request_t url");
-    goto failed_escape_url;
+  host->resolving = 1;
+  return 0;
+}
+
+
+int bud_http_host_set_addrs(bud_http_host_t* host, struct addrinfo* res) {
+  struct sockaddr_storage addrs[BUD_HTTP_HOST_MAX_ADDRS];
+  uint64_t retry_at[BUD_HTTP_HOST_MAX_ADDRS];
+  struct sockaddr_storage* addr;
+  uint16_t port;
+  int count;
+  int i;
+
+  port = htons(host->pool->port);
+  count = 0;
+  for (; res != NULL && count < (int) ARRAY_SIZE(addrs); res = res->ai_next) {
+    if (res->ai_family != AF_INET && res->ai_family != AF_INET6)
+      continue;
+
+    addr = &addrs[count];
+    memset(addr, 0, sizeof(*addr));
+    memcpy(addr, res->ai_addr, res->ai_addrlen);
+    if (res->ai_family == AF_INET)
+      ((struct sockaddr_in*) addr)->sin_port = port;
+    else
+      ((struct sockaddr_in6*) addr)->sin6_port = port;
+
+    /* Address that has just failed to connect stays out of rotation */
+    retry_at[count] = 0;
+    for (i = 0; i < host->addr_count; i++)
+      if (memcmp(&host->addrs[i], addr, sizeof(*addr)) == 0)
+        retry_at[count] = host->retry_at[i];
+    count++;
   }
 
-  /* Obtain request */
-  if (QUEUE_EMPTY(&pool->pool)) {
-    /* Create new request */
-    req = bud_http_request_new(pool, err);
-    if (!bud_is_ok(*err))
-      goto failed_http_request;
-  } else {
-    /* Reuse existing connection */
-    q = QUEUE_HEAD(&pool->pool);
-    QUEUE_REMOVE(q);
+  /* Keep the old ones */
+  if (count == 0)
+    return 0;
+
+  memcpy(host->addrs, addrs, sizeof(addrs[0]) * count);
+  memcpy(host->retry_at, retry_at, sizeof(retry_at[0]) * count);
+  host->addr_count = count;
+  return count;
+}
+
+
+void bud_http_pool_free(bud_http_pool_t* pool) {
+  QUEUE* q;
+  bud_http_request_t* req;
+  bud_http_conn_t* conn;
+  int i;
+
+  /* Drop queued requests, then the ones in flight */
+  while (!QUEUE_EMPTY(&pool->pending)) {
+    q = QUEUE_HEAD(&pool->pending);
     req = QUEUE_DATA(q, bud_http_request_t, member);
+    bud_http_request_cancel(req);
   }
 
-  req->method = method;
-  req->url = url;
-  req->url_len = url_len;
-  req->body = body_copy;
-  req->body_len = body_len;
-  req->cb = cb;
-  req->response = NULL;
-  req->code = 0;
-
-  /* If reused socket - send request immediately */
-  if (req->state == kBudHttpConnected) {
-    *err = bud_http_request_send(req);
-    if (!bud_is_ok(*err))
-      goto failed_send;
+  while (!QUEUE_EMPTY(&pool->busy)) {
+    q = QUEUE_HEAD(&pool->busy);
+    conn = QUEUE_DATA(q, bud_http_conn_t, member);
+    bud_http_conn_close(conn, bud_ok());
   }
 
-  return req;
+  while (!QUEUE_EMPTY(&pool->idle)) {
+    q = QUEUE_HEAD(&pool->idle);
+    conn = QUEUE_DATA(q, bud_http_conn_t, member);
+    bud_http_conn_close(conn, bud_ok());
+  }
 
-failed_send:
-  /* Fail without calling cb */
-  bud_http_request_error(req, bud_ok());
-  return NULL;
+  /* Pool is freed once both timers are closed and lookups are back */
+  pool->closing = 1;
+  pool->refs = 2;
+  for (i = 0; i < pool->host_count; i++) {
+    if (!pool->hosts[i].resolving)
+      continue;
+    pool->refs++;
+    uv_cancel((uv_req_t*) &pool->hosts[i].resolver);
+  }
 
-failed_http_request:
-  free(url);
+  uv_timer_stop(&pool->timer);
+  uv_timer_stop(&pool->resolve_timer);
+  uv_close((uv_handle_t*) &pool->timer, bud_http_pool_close_cb);
+  uv_close((uv_handle_t*) &pool->resolve_timer, bud_http_pool_close_cb);
+}
 
-failed_escape_url:
-  free(body_copy);
 
-fatal:
-  return NULL;
+void bud_http_pool_close_cb(uv_handle_t* handle) {
+  bud_http_pool_unref(handle->data);
 }
 
 
-bud_http_request_t* bud_http_get(bud_http_pool_t* pool,
-                                 const char* fmt,
-                                 const char* arg,
-                                 size_t arg_len,
-                                 bud_http_cb cb,
-                                 bud_error_t* err) {
-  return bud_http_request(pool,
-                          kBudHttpGet,
-                          fmt,
-                          arg,
-                          arg_len,
-                          NULL,
-                          0,
-                          cb,
-                          err);
+void bud_http_pool_unref(bud_http_pool_t* pool) {
+  if (--pool->refs != 0)
+    return;
+  bud_http_pool_destroy(pool);
 }
 
 
-bud_http_request_t* bud_http_post(bud_http_pool_t* pool,
-                                  const char* fmt,
-                                  const char* arg,
-                                  size_t arg_len,
-                                  const char* data,
-                                  size_t data_len,
-                                  bud_http_cb cb,
-                                  bud_error_t* err) {
-  return bud_http_request(pool,
-                          kBudHttpPost,
-                          fmt,
-                          arg,
-                          arg_len,
-                          data,
-                          data_len,
-                          cb,
-                          err);
+void bud_http_pool_destroy(bud_http_pool_t* pool) {
+  int i;
+
+  for (i = 0; i < pool->host_count; i++)
+    free(pool->hosts[i].name);
+  pool->host_count = 0;
+  free(pool->host);
+  pool->host = NULL;
+  free(pool);
 }
 
 
-void bud_http_request_error(bud_http_request_t* request, bud_error_t err) {
-  if (request->state == kBudHttpDisconnected)
+void bud_http_pool_configure(bud_http_pool_t* pool,
+                             bud_config_http_pool_t* conf) {
+  int i;
+
+  pool->max_connections = conf->max_connections;
+  pool->timeout = conf->timeout;
+  pool->pipeline = conf->pipeline;
+  pool->idle_timeout = conf->idle_timeout;
+  pool->max_fails = conf->max_fails;
+  pool->backoff = conf->backoff;
+  pool->max_backoff = conf->max_backoff;
+  pool->resolve_interval = conf->resolve_interval;
+  pool->hedge = conf->hedge;
+  if (pool->hedge_delay < pool->hedge)
+    pool->hedge_delay = pool->hedge;
+
+  /* Literal addresses don't change */
+  uv_timer_stop(&pool->resolve_timer);
+  for (i = 0; i < pool->host_count; i++)
+    if (pool->hosts[i].is_name)
+      break;
+  if (i == pool->host_count || pool->resolve_interval == 0)
     return;
 
-  request->state = kBudHttpDisconnected;
-  if (!bud_is_ok(err) && request->cb != NULL)
-    request->cb(request, err);
-  request->cb = NULL;
+  uv_timer_start(&pool->resolve_timer,
+                 bud_http_pool_resolve_timer_cb,
+                 pool->resolve_interval,
+                 pool->resolve_interval);
+}
+
 
-  uv_close((uv_handle_t*) &request->tcp, bud_http_request_close_cb);
-  if (!QUEUE_EMPTY(&request->member))
-    QUEUE_REMOVE(&request->member);
+void bud_http_pool_resolve_timer_cb(uv_timer_t* timer, int status) {
+  bud_http_pool_lookup(timer->data);
 }
 
 
-void bud_http_request_done(bud_http_request_t* request) {
-  ASSERT(request->state == kBudHttpRunning, "Done on not running request");
-  request->state = kBudHttpConnected;
-  request->cb(request, bud_ok());
-  request->cb = NULL;
+int bud_http_pool_lookup(bud_http_pool_t* pool) {
+  bud_http_host_t* host;
+  int started;
+  int i;
 
-  /* Remove from reqs */
-  ASSERT(!QUEUE_EMPTY(&request->member), "Request should be in queue");
-  QUEUE_REMOVE(&request->member);
+  started = 0;
+  for (i = 0; i < pool->host_count; i++) {
+    host = &pool->hosts[i];
+    if (!host->is_name || host->resolving)
+      continue;
+    if (bud_http_host_lookup(host) == 0)
+      started++;
+  }
+  return started;
+}
 
-  /* Add to pool */
-  QUEUE_INSERT_TAIL(&request->pool->pool, &request->member);
 
-  /* Clear buffer */
-  ringbuffer_destroy(&request->response_buf);
-  ringbuffer_init(&request->response_buf);
-  request->complete = 0;
+int bud_http_pool_resolving(bud_http_pool_t* pool) {
+  int i;
+
+  for (i = 0; i < pool->host_count; i++)
+    if (pool->hosts[i].resolving)
+      return 1;
+  return 0;
 }
 
 
-void bud_http_request_cancel(bud_http_request_t* request) {
-  bud_http_request_error(request, bud_ok());
+int bud_http_pool_ready(bud_http_pool_t* pool) {
+  int i;
+
+  if (pool->is_pipe)
+    return 1;
+  for (i = 0; i < pool->host_count; i++)
+    if (pool->hosts[i].addr_count != 0)
+      return 1;
+  return 0;
 }
 
 
-bud_http_request_t* bud_http_request_new(bud_http_pool_t* pool,
-                                         bud_error_t* err) {
-  bud_http_request_t* req;
-  int r;
+void bud_http_pool_resolve_cb(uv_getaddrinfo_t* req,
+                              int status,
+                              struct addrinfo* res) {
+  bud_http_host_t* host;
+  bud_http_pool_t* pool;
+  QUEUE* q;
+  bud_http_request_t* hreq;
 
-  req = malloc(sizeof(*req));
-  if (req == NULL) {
-    *err = bud_error_str(kBudErrNoMem, "bud_http_request_t");
-    goto fatal;
+  host = container_of(req, bud_http_host_t, resolver);
+  pool = host->pool;
+  host->resolving = 0;
+
+  if (pool->closing) {
+    uv_freeaddrinfo(res);
+    bud_http_pool_unref(pool);
+    return;
   }
 
-  req->pool = pool;
-  http_parser_init(&req->parser, HTTP_RESPONSE);
-  ringbuffer_init(&req->response_buf);
-  req->complete = 0;
+  /* Keep using the old addresses until DNS is back */
+  if (status != 0) {
+    bud_log(pool->config,
+            kBudLogWarning,
+            "http pool failed to resolve %s: \"%s\"",
+            host->name,
+            uv_strerror(status));
+  } else if (bud_http_host_set_addrs(host, res) == 0) {
+    bud_log(pool->config,
+            kBudLogWarning,
+            "http pool host %s has no addresses",
+            host->name);
+  }
+  uv_freeaddrinfo(res);
 
-  r = uv_tcp_init(pool->config->loop, &req->tcp);
-  if (r != 0) {
-    *err = bud_error_num(kBudErrHttpTcpInit, r);
-    goto failed_tcp_init;
+  /* Requests waiting for the first addresses */
+  if (bud_http_pool_ready(pool)) {
+    bud_http_pool_next(pool);
+    return;
   }
+  if (bud_http_pool_resolving(pool))
+    return;
 
-  r = uv_tcp_connect(&req->connect,
-                     &req->tcp,
-                     (struct sockaddr*) &pool->addr,
-                     bud_http_request_connect_cb);
-  if (r != 0) {
-    *err = bud_error_num(kBudErrHttpTcpConnect, r);
-    goto failed_tcp_connect;
+  while (!QUEUE_EMPTY(&pool->pending)) {
+    q = QUEUE_HEAD(&pool->pending);
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
+    hreq = QUEUE_DATA(q, bud_http_request_t, member);
+    bud_http_request_fail(hreq,
+                          bud_error_str(kBudErrHttpResolve, pool->host));
   }
+}
 
-  req->state = kBudHttpConnecting;
-  QUEUE_INSERT_TAIL(&pool->reqs, &req->member);
 
-  *err = bud_ok();
-  return req;
+void bud_http_pool_pick(bud_http_pool_t* pool,
+                        bud_http_conn_t* conn,
+                        bud_http_conn_t* avoid) {
+  bud_http_host_t* host;
+  uint64_t now;
+  uint64_t best;
+  int found;
+  int total;
+  int start;
+  int n;
+  int i;
+  int j;
+
+  total = 0;
+  for (i = 0; i < pool->host_count; i++)
+    total += pool->hosts[i].addr_count;
+  ASSERT(total != 0, "http pool without addresses");
+
+  now = uv_now(pool->config->loop);
+  best = 0;
+  found = 0;
+  start = (int) (pool->next_addr++ % (unsigned int) total);
+  for (n = 0; n < total; n++) {
+    /* `start + n`-th address in all hosts */
+    j = (start + n) % total;
+    for (i = 0; j >= pool->hosts[i].addr_count; i++)
+      j -= pool->hosts[i].addr_count;
+    host = &pool->hosts[i];
+
+    /* Duplicate of a hedged request goes elsewhere */
+    if (avoid != NULL && avoid->host == i && avoid->addr == j)
+      continue;
+
+    /* All have failed recently - take the one that is due first */
+    if (!found || host->retry_at[j] < best) {
+      found = 1;
+      best = host->retry_at[j];
+      conn->host = i;
+      conn->addr = j;
+    }
+    if (best <= now)
+      break;
+  }
+}
 
-failed_tcp_connect:
-  uv_close((uv_handle_t*) &req->tcp, bud_http_request_close_cb);
-  return NULL;
 
-failed_tcp_init:
-  free(req);
+int bud_http_pool_can_failover(bud_http_pool_t* pool) {
+  int total;
+  int i;
 
-fatal:
-  return NULL;
+  total = 0;
+  for (i = 0; i < pool->host_count; i++)
+    total += pool->hosts[i].addr_count;
+  return total > 1;
 }
 
-#define UV_STR_BUF(str) uv_buf_init((str), sizeof(str) - 1)
-
-bud_error_t bud_http_request_send(bud_http_request_t* req) {
-  int r;
-  uv_buf_t get_buf[3];
-  uv_buf_t post_buf[6];
-  char body_length[128];
+bud_http_conn_t* bud_http_pool_find_conn(bud_http_pool_t* pool,
+                                         bud_http_request_t* req) {
+  QUEUE* q;
+  bud_http_conn_t* conn;
 
-  ASSERT(req->state == kBudHttpConnected, "Writing to not connected socket");
+  /* Reuse the most recent connection, let the older ones expire */
+  if (!QUEUE_EMPTY(&pool->idle)) {
+    q = QUEUE_PREV(&pool->idle);
+    return QUEUE_DATA(q, bud_http_conn_t, member);
+  }
 
-  req->state = kBudHttpRunning;
+  /* Only GETs are pipelined, POSTs aren't idempotent */
+  if (pool->pipeline <= 1 || req->method != kBudHttpGet)
+    return NULL;
 
-  if (req->method == kBudHttpGet) {
-    get_buf[0] = UV_STR_BUF("GET ");
-    get_buf[1] = uv_buf_init(req->url, req->url_len);
-    get_buf[2] = UV_STR_BUF(" HTTP/1.1\r\n\r\n");
-
-    r = uv_write(&req->write,
-                 (uv_stream_t*) &req->tcp,
-                 get_buf,
-                 ARRAY_SIZE(get_buf),
-                 bud_http_request_write_cb);
-  } else {
-    post_buf[0] = UV_STR_BUF("POST ");
-    post_buf[1] = uv_buf_init(req->url, req->url_len);
-    post_buf[2] = UV_STR_BUF(" HTTP/1.1\r\n"
-                             "Transfer-Encoding: chunked\r\n"
-                             "Content-Type: application/json\r\n"
-                             "Content-Length: ");
-    post_buf[3] = uv_buf_init(body_length,
-                              snprintf(body_length,
-                                       sizeof(body_length),
-                                       "%d\r\n\r\n%x\r\n",
-                                       (int) req->body_len,
-                                       (int) req->body_len));
-    post_buf[4] = uv_buf_init(req->body, req->body_len);
-    post_buf[5] = UV_STR_BUF("\r\n0\r\n\r\n");
-
-    r = uv_write(&req->write,
-                 (uv_stream_t*) &req->tcp,
-                 post_buf,
-                 ARRAY_SIZE(post_buf),
-                 bud_http_request_write_cb);
+  QUEUE_FOREACH(q, &pool->busy) {
+    conn = QUEUE_DATA(q, bud_http_conn_t, member);
+    if (conn->exclusive ||
+        conn->inflight >= pool->pipeline ||
+        conn->inflight >= BUD_HTTP_PIPELINE_MAX) {
+      continue;
+    }
+    return conn;
   }
-  if (r != 0)
-    return bud_error_num(kBudErrHttpWrite, r);
 
-  return bud_ok();
+  return NULL;
 }
 
-#undef UV_STR_BUF
 
-void bud_http_request_write_cb(uv_write_t* write, int status) {
-  bud_http_request_t* req;
+bud_error_t bud_http_pool_schedule(bud_http_pool_t* pool,
+                                   bud_http_request_t* req) {
+  bud_http_conn_t* conn;
+  bud_error_t err;
 
-  if (status == 0 || status == UV_ECANCELED)
-    return;
+  /* Fail fast, but still let one request probe the backend */
+  if (bud_http_pool_is_down(pool))
+    return bud_error_str(kBudErrHttpDown, pool->host);
 
-  /* Write failure */
-  req = container_of(write, bud_http_request_t, write);
-  bud_http_request_error(req, bud_error_num(kBudErrHttpWriteCb, status));
+  /* No addresses yet, or the last lookup has failed - try it again */
+  if (!bud_http_pool_ready(pool)) {
+    if (!bud_http_pool_resolving(pool) && bud_http_pool_lookup(pool) == 0)
+      return bud_error_str(kBudErrHttpResolve, pool->host);
+    QUEUE_INSERT_TAIL(&pool->pending, &req->member);
+    return bud_ok();
+  }
+
+  conn = bud_http_pool_find_conn(pool, req);
+  if (conn != NULL)
+    return bud_http_conn_attach(conn, req);
+
+  /* Wait for one to be released */
+  if (!bud_http_pool_can_connect(pool)) {
+    QUEUE_INSERT_TAIL(&pool->pending, &req->member);
+    return bud_ok();
+  }
+
+  conn = bud_http_conn_new(pool, NULL, &err);
+  if (conn == NULL)
+    return err;
+
+  return bud_http_conn_attach(conn, req);
 }
 
 
-void bud_http_request_connect_cb(uv_connect_t* connect, int status) {
+void bud_http_pool_next(bud_http_pool_t* pool) {
+  QUEUE* q;
   bud_http_request_t* req;
   bud_error_t err;
-  int r;
 
-  /* Already handled */
-  if (status == UV_ECANCELED)
+  /* Still resolving, bud_http_pool_resolve_cb() comes back here */
+  if (!bud_http_pool_ready(pool))
     return;
 
-  req = container_of(connect, bud_http_request_t, connect);
+  while (!QUEUE_EMPTY(&pool->pending)) {
+    q = QUEUE_HEAD(&pool->pending);
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    if (!bud_http_pool_is_down(pool) &&
+        bud_http_pool_find_conn(pool, req) == NULL &&
+        !bud_http_pool_can_connect(pool)) {
+      break;
+    }
 
-  req->state = kBudHttpConnected;
-  if (status != 0) {
-    err = bud_error_num(kBudErrHttpConnectCb, status);
-    goto fatal;
-  }
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
 
-  /* Start reading */
-  r = uv_read_start((uv_stream_t*) &req->tcp,
-                    bud_http_request_alloc_cb,
-                    bud_http_request_read_cb);
-  if (r != 0) {
-    err = bud_error_num(kBudErrHttpReadStart, r);
-    goto fatal;
+    err = bud_http_pool_schedule(pool, req);
+    if (!bud_is_ok(err))
+      bud_http_request_fail(req, err);
   }
-
-  /* Send request */
-  err = bud_http_request_send(req);
-  if (!bud_is_ok(err))
-    goto fatal;
-  return;
-
-fatal:
-  bud_http_request_error(req, err);
-  return;
 }
 
 
-void bud_http_request_alloc_cb(uv_handle_t* handle,
-                               size_t suggested_size,
-                               uv_buf_t* buf) {
-  bud_http_request_t* req;
+int bud_http_pool_can_connect(bud_http_pool_t* pool) {
+  /* Backoff is over, a single connection probes the backend */
+  if (pool->max_fails != 0 && pool->fails >= pool->max_fails)
+    return pool->connections == 0;
+
+  return pool->max_connections == 0 ||
+         pool->connections < pool->max_connections;
+}
 
-  req = container_of(handle, bud_http_request_t, tcp);
 
-  *buf = uv_buf_init(req->buf, sizeof(req->buf));
+int bud_http_pool_is_down(bud_http_pool_t* pool) {
+  return pool->max_fails != 0 &&
+         pool->fails >= pool->max_fails &&
+         uv_now(pool->config->loop) < pool->down_until;
 }
 
 
-void bud_http_request_read_cb(uv_stream_t* stream,
-                              ssize_t nread,
-                              const uv_buf_t* buf) {
+void bud_http_pool_failed(bud_http_pool_t* pool) {
+  QUEUE* q;
   bud_http_request_t* req;
-  size_t parsed;
-  char* out;
-  size_t len;
 
-  req = container_of(stream, bud_http_request_t, tcp);
-  if (nread < 0 && nread != UV_EOF) {
-    bud_http_request_error(req, bud_error_num(kBudErrHttpReadCb, nread));
+  if (pool->max_fails == 0)
     return;
-  }
-
-  if (nread == UV_EOF) {
-    bud_http_request_error(req, bud_error(kBudErrHttpEof));
+  if (++pool->fails < pool->max_fails)
     return;
-  }
 
-  /* Parse all read data */
-  parsed = http_parser_execute(&req->parser,
-                               &bud_parser_settings,
-                               req->buf,
-                               (size_t) nread);
-  if (parsed != (size_t) nread) {
-    bud_http_request_error(
-        req,
-        bud_error_str(kBudErrHttpParse,
-                      http_errno_description(HTTP_PARSER_ERRNO(&req->parser))));
-    return;
+  /* First time, or the probe has failed too */
+  if (pool->down_backoff == 0)
+    pool->down_backoff = pool->backoff;
+  else
+    pool->down_backoff *= 2;
+  if (pool->max_backoff != 0 && pool->down_backoff > pool->max_backoff)
+    pool->down_backoff = pool->max_backoff;
+  pool->down_until = uv_now(pool->config->loop) + pool->down_backoff;
+
+  bud_log(pool->config,
+          kBudLogWarning,
+          "http pool %s:%d is down, next try in %d ms",
+          pool->host,
+          (int) pool->port,
+          (int) pool->down_backoff);
+
+  /* Don't keep the queued ones waiting */
+  while (!QUEUE_EMPTY(&pool->pending)) {
+    q = QUEUE_HEAD(&pool->pending);
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    bud_http_request_fail(req, bud_error_str(kBudErrHttpDown, pool->host));
   }
+}
 
-  if (req->complete) {
-    len = ringbuffer_size(&req->response_buf);
-    out = malloc(len + 1);
-    if (out == NULL) {
-      bud_http_request_error(req, bud_error_str(kBudErrNoMem, "http response"));
-      return;
-    }
 
-    ringbuffer_read_into(&req->response_buf, out, len);
-    out[len] = 0;
-    req->code = req->parser.status_code;
-    req->response = json_parse_string(out);
-    free(out);
-    if (req->response == NULL) {
-      bud_http_request_error(req,
-                             bud_error_str(kBudErrJSONParse, "http response"));
-    } else {
-      bud_http_request_done(req);
-    }
+void bud_http_pool_arm(bud_http_pool_t* pool) {
+  uint64_t interval;
+
+  if (uv_is_active((uv_handle_t*) &pool->timer))
+    return;
+
+  /* Check a few times per the shortest of the timeouts */
+  interval = pool->timeout;
+  if (pool->idle_timeout != 0 &&
+      (interval == 0 || pool->idle_timeout < interval)) {
+    interval = pool->idle_timeout;
   }
+  if (pool->hedge_delay != 0 &&
+      (interval == 0 || pool->hedge_delay < interval)) {
+    interval = pool->hedge_delay;
+  }
+  if (interval == 0)
+    return;
 
-  if (!http_should_keep_alive(&req->parser))
-    bud_http_request_error(req, bud_ok());
+  interval /= 4;
+  if (interval < BUD_HTTP_POOL_TIMER_MIN)
+    interval = BUD_HTTP_POOL_TIMER_MIN;
+  uv_timer_start(&pool->timer, bud_http_pool_timer_cb, interval, interval);
 }
 
 
-int bud_http_request_body_cb(http_parser* parser,
-                             const char *at,
-                             size_t length) {
-  size_t r;
+void bud_http_pool_timer_cb(uv_timer_t* timer, int status) {
+  bud_http_pool_t* pool;
+  QUEUE* q;
+  QUEUE* r;
   bud_http_request_t* req;
+  bud_http_conn_t* conn;
+  uint64_t now;
 
-  req = container_of(parser, bud_http_request_t, parser);
-  r = ringbuffer_write_into(&req->response_buf, at, length);
+  pool = container_of(timer, bud_http_pool_t, timer);
+  now = uv_now(pool->config->loop);
 
-  if (r != 0)
-    return -1;
+  /* All requests share the timeout, so the oldest ones are at the head */
+  while (!QUEUE_EMPTY(&pool->pending)) {
+    q = QUEUE_HEAD(&pool->pending);
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    if (req->deadline > now)
+      break;
 
-  return 0;
-}
+    QUEUE_REMOVE(q);
+    QUEUE_INIT(q);
+    bud_http_request_fail(req, bud_error_str(kBudErrHttpTimeout, pool->host));
+  }
 
+  /* Closing connection changes the queue, walk it again */
+restart:
+  QUEUE_FOREACH(q, &pool->busy) {
+    conn = QUEUE_DATA(q, bud_http_conn_t, member);
+    if (!bud_http_conn_expired(conn, now))
+      continue;
 
-static int bud_http_request_message_complete_cb(http_parser* parser) {
-  bud_http_request_t* req;
+    bud_http_conn_close(conn, bud_error_str(kBudErrHttpTimeout, pool->host));
+    goto restart;
+  }
 
-  req = container_of(parser, bud_http_request_t, parser);
-  req->complete = 1;
+  /* Duplicating may open a connection or fail one, walk it again too */
+hedge:
+  QUEUE_FOREACH(q, &pool->busy) {
+    if (pool->hedge == 0)
+      break;
+
+    conn = QUEUE_DATA(q, bud_http_conn_t, member);
+    QUEUE_FOREACH(r, &conn->reqs) {
+      req = QUEUE_DATA(r, bud_http_request_t, member);
+      if (req->cb == NULL ||
+          req->hedged ||
+          req->duplicate ||
+          req->method != kBudHttpGet ||
+          !req->sent ||
+          req->started + pool->hedge_delay > now) {
+        continue;
+      }
 
-  return 0;
-}
+      req->hedged = 1;
+      bud_http_pool_hedge(pool, req);
+      goto hedge;
+    }
+  }
 
+  /* Oldest idle connections are at the head */
+  while (pool->idle_timeout != 0 && !QUEUE_EMPTY(&pool->idle)) {
+    q = QUEUE_HEAD(&pool->idle);
+    conn = QUEUE_DATA(q, bud_http_conn_t, member);
+    if (conn->idle_since + pool->idle_timeout > now)
+      break;
 
-void bud_http_request_close_cb(uv_handle_t* handle) {
-  bud_http_request_t* req;
+    bud_http_conn_close(conn, bud_ok());
+  }
 
-  req = container_of(handle, bud_http_request_t, tcp);
-  ringbuffer_destroy(&req->response_buf);
-  free(req->url);
-  free(req->body);
-  req->url = NULL;
-  req->body = NULL;
-  free(req);
+  if (QUEUE_EMPTY(&pool->pending) &&
+      QUEUE_EMPTY(&pool->busy) &&
+      (pool->idle_timeout == 0 || QUEUE_EMPTY(&pool->idle))) {
+    uv_timer_stop(&pool->timer);
+  }
 }
 
 
-char* bud_http_request_escape_url(const char* fmt,
-                                  const char* arg,
-                                  size_t arg_len,
-                                  size_t* size) {
+void bud_http_pool_hedge(bud_http_pool_t* pool, bud_http_request_t* req) {
+  QUEUE* q;
+  bud_http_conn_t* conn;
+  bud_http_conn_t* c;
+  bud_http_request_t* dup;
   char* url;
-  size_t fmt_len;
-  size_t i;
-  size_t j;
-  size_t k;
-  size_t escaped_arg_len;
-  char c;
-
-  /* Escape arg */
-  fmt_len = strlen(fmt);
-
-  /* Count characters in escaped arg */
-  escaped_arg_len = 0;
-  for (i = 0; i < arg_len; i++) {
-    c = arg[i];
-
-    if (c == '!' || c == '#' || c == '$' || c == '&' || c == '\'' ||
-        c == '(' || c == ')' || c == '*' || c == '+' || c == ',' ||
-        c == '/' || c == ':' || c == ';' || c == '=' || c == '?' ||
-        c == '@' || c == '[' || c == ']') {
-      escaped_arg_len += 3;
-    } else {
-      escaped_arg_len++;
+  bud_error_t err;
+
+  /* Nowhere else to send it */
+  if (pool->is_pipe ||
+      !bud_http_pool_can_failover(pool) ||
+      bud_http_pool_is_down(pool)) {
+    return;
+  }
+
+  /* Idle or pipelined connection to another address, or a new one */
+  conn = NULL;
+  QUEUE_FOREACH(q, &pool->idle) {
+    c = QUEUE_DATA(q, bud_http_conn_t, member);
+    if (c->host != req->conn->host || c->addr != req->conn->addr)
+      conn = c;
+  }
+  QUEUE_FOREACH(q, &pool->busy) {
+    if (conn != NULL || pool->pipeline <= 1)
+      break;
+
+    c = QUEUE_DATA(q, bud_http_conn_t, member);
+    if ((c->host == req->conn->host && c->addr == req->conn->addr) ||
+        c->exclusive ||
+        c->inflight >= pool->pipeline ||
+        c->inflight >= BUD_HTTP_PIPELINE_MAX) {
+      continue;
     }
+    conn = c;
   }
+  if (conn == NULL && bud_http_pool_can_connect(pool))
+    conn = bud_http_conn_new(pool, req->conn, &err);
+  if (conn == NULL)
+    return;
 
-  url = malloc(fmt_len + escaped_arg_len + 1);
+  url = malloc(req->url_len + 1);
   if (url == NULL)
-    return NULL;
-
-  k = 0;
-  for (i = 0, j = 0; i < fmt_len; i++) {
-    /* Replace '%s' with escaped arg */
-    if (k == 0 && i + 1 < fmt_len && fmt[i] == '%' && fmt[i + 1] == 's') {
-      for (k = 0; k < arg_len; k++) {
-        c = arg[k];
-        if (c == '!' || c == '#' || c == '$' || c == '&' || c == '\'' ||
-            c == '(' || c == ')' || c == '*' || c == '+' || c == ',' ||
-            c == '/' || c == ':' || c == ';' || c == '=' || c == '?' ||
-            c == '@' || c == '[' || c == ']') {
-          url[j++] = '%';
-          url[j++] = '0' + (c >> 4);
-          c = c & 15;
-          if (c > 9)
-            c = 'a' + c - 10;
-          else
-            c = '0' + c;
-        }
-        url[j++] = c;
-      }
-      /* Skip second part of '%s' */
-      i++;
+    goto failed_malloc;
+  memcpy(url, req->url, req->url_len + 1);
+
+  dup = bud_http_request_alloc(pool,
+                               req->method,
+                               url,
+                               req->url_len,
+                               NULL,
+                               NULL,
+                               req->raw,
+                               bud_http_request_hedge_cb,
+                               &err);
+  if (dup == NULL)
+    goto failed_alloc;
+
+  /* Same deadline, and it isn't resent if its connection drops */
+  dup->deadline = req->deadline;
+  dup->retried = 1;
+  dup->duplicate = 1;
+  dup->peer = req;
+  req->peer = dup;
+
+  err = bud_http_conn_attach(conn, dup);
+  if (!bud_is_ok(err)) {
+    bud_http_request_unhedge(dup, 0);
+    bud_http_conn_detach(conn, dup);
+    bud_http_conn_close(conn, err);
+    bud_http_request_free(dup);
+  }
+  return;
+
+failed_alloc:
+  free(url);
+
+failed_malloc:
+  /* Fresh connection would stay idle */
+  if (conn->inflight == 0 && conn->state == kBudHttpConnecting)
+    bud_http_conn_close(conn, bud_ok());
+}
+
+
+void bud_http_pool_observe(bud_http_pool_t* pool, uint64_t duration) {
+  uint32_t sorted[BUD_HTTP_HEDGE_SAMPLES];
+  unsigned int count;
+
+  pool->samples[pool->sample_count++ % BUD_HTTP_HEDGE_SAMPLES] =
+      (uint32_t) duration;
+  if (pool->hedge == 0 || pool->sample_count % BUD_HTTP_HEDGE_UPDATE != 0)
+    return;
+
+  /* Recomputed once in a while, it is just a few dozens of them */
+  count = pool->sample_count;
+  if (count > BUD_HTTP_HEDGE_SAMPLES)
+    count = BUD_HTTP_HEDGE_SAMPLES;
+  memcpy(sorted, pool->samples, sizeof(sorted[0]) * count);
+  qsort(sorted, count, sizeof(sorted[0]), bud_http_sample_cmp);
+
+  pool->hedge_delay = sorted[count * 95 / 100];
+  if (pool->hedge_delay < pool->hedge)
+    pool->hedge_delay = pool->hedge;
+}
+
+
+int bud_http_sample_cmp(const void* a, const void* b) {
+  uint32_t x;
+  uint32_t y;
+
+  x = *(const uint32_t*) a;
+  y = *(const uint32_t*) b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+int bud_http_is_io_error(bud_error_t err) {
+  switch (err.code) {
+    case kBudErrHttpTcpConnect:
+    case kBudErrHttpConnectCb:
+    case kBudErrHttpReadStart:
+    case kBudErrHttpWrite:
+    case kBudErrHttpWriteCb:
+    case kBudErrHttpReadCb:
+    case kBudErrHttpEof:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+
+bud_http_request_t* bud_http_request(bud_http_pool_t* pool,
+                                     bud_http_method_t method,
+                                     const char* fmt,
+                                     const char* arg,
+                                     size_t arg_len,
+                                     bud_http_body_t* body,
+                                     const char* content_type,
+                                     int raw,
+                                     bud_http_cb cb,
+                                     bud_error_t* err) {
+  bud_http_request_t* req;
+  bud_http_conn_t* conn;
+  char* url;
+  size_t url_len;
+
+  /* Format url */
+  url = bud_escape_url(fmt, arg, arg_len, &url_len);
+  if (url == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_http_request_t url");
+    goto failed_escape_url;
+  }
+
+  req = bud_http_request_alloc(pool,
+                               method,
+                               url,
+                               url_len,
+                               body,
+                               content_type,
+                               raw,
+                               cb,
+                               err);
+  if (req == NULL)
+    goto failed_http_request;
+
+  *err = bud_http_pool_schedule(pool, req);
+  if (!bud_is_ok(*err))
+    goto failed_schedule;
+
+  if (req->deadline != 0 || (pool->hedge != 0 && method == kBudHttpGet))
+    bud_http_pool_arm(pool);
+
+  return req;
+
+failed_schedule:
+  /* Fail without calling cb, but do report to the pipelined ones */
+  conn = req->conn;
+  if (conn != NULL) {
+    bud_http_conn_detach(conn, req);
+    bud_http_conn_close(conn, *err);
+  }
+  bud_http_request_free(req);
+  return NULL;
+
+failed_http_request:
+  free(url);
+
+failed_escape_url:
+  return NULL;
+}
+
+
+bud_http_request_t* bud_http_request_alloc(bud_http_pool_t* pool,
+                                           bud_http_method_t method,
+                                           char* url,
+                                           size_t url_len,
+                                           bud_http_body_t* body,
+                                           const char* content_type,
+                                           int raw,
+                                           bud_http_cb cb,
+                                           bud_error_t* err) {
+  bud_http_request_t* req;
+
+  /* `url` is owned by the request on success */
+  req = bud_slab_alloc(&pool->config->http_req_slab);
+  if (req == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_http_request_t");
+    return NULL;
+  }
+
+  QUEUE_INIT(&req->member);
+  req->config = pool->config;
+  req->pool = pool;
+  req->conn = NULL;
+  req->method = method;
+  req->url = url;
+  req->url_len = url_len;
+  /* Shared with the caller, not copied */
+  req->body = body;
+  if (body != NULL)
+    body->refcount++;
+  req->content_type = content_type;
+  req->sent = 0;
+  req->written = 0;
+  req->retried = 0;
+  req->peer = NULL;
+  req->hedged = 0;
+  req->duplicate = 0;
+  req->cb = cb;
+  req->data = NULL;
+  req->response = NULL;
+  req->code = 0;
+  req->max_age = -1;
+  req->stale = -1;
+  req->raw = raw;
+  req->raw_response = NULL;
+  req->raw_response_len = 0;
+  req->started = uv_now(pool->config->loop);
+  req->deadline = 0;
+  if (pool->timeout != 0)
+    req->deadline = req->started + pool->timeout;
+  req->extract = !raw && pool->extract != NULL;
+  req->extract_err = bud_ok();
+  if (req->extract)
+    bud_json_stream_init(&req->stream, pool->extract);
+
+  return req;
+}
+
+
+bud_http_request_t* bud_http_get(bud_http_pool_t* pool,
+                                 const char* fmt,
+                                 const char* arg,
+                                 size_t arg_len,
+                                 bud_http_cb cb,
+                                 bud_error_t* err) {
+  return bud_http_request(pool,
+                          kBudHttpGet,
+                          fmt,
+                          arg,
+                          arg_len,
+                          NULL,
+                          NULL,
+                          0,
+                          cb,
+                          err);
+}
+
+
+bud_http_request_t* bud_http_post(bud_http_pool_t* pool,
+                                  const char* fmt,
+                                  const char* arg,
+                                  size_t arg_len,
+                                  bud_http_body_t* body,
+                                  bud_http_cb cb,
+                                  bud_error_t* err) {
+  return bud_http_request(pool,
+                          kBudHttpPost,
+                          fmt,
+                          arg,
+                          arg_len,
+                          body,
+                          "application/json",
+                          0,
+                          cb,
+                          err);
+}
+
+
+bud_http_request_t* bud_http_post_raw(bud_http_pool_t* pool,
+                                      const char* path,
+                                      const char* content_type,
+                                      bud_http_body_t* body,
+                                      bud_http_cb cb,
+                                      bud_error_t* err) {
+  /* No `%s` substitution, path is used as is */
+  return bud_http_request(pool,
+                          kBudHttpPost,
+                          path,
+                          NULL,
+                          0,
+                          body,
+                          content_type,
+                          1,
+                          cb,
+                          err);
+}
+
+
+bud_http_body_t* bud_http_body_new(size_t len) {
+  bud_http_body_t* body;
+
+  /* `data[1]` has room for the trailing NUL */
+  body = malloc(sizeof(*body) + len);
+  if (body == NULL)
+    return NULL;
+
+  body->refcount = 1;
+  body->len = len;
+  body->data[len] = '\0';
+  return body;
+}
+
+
+void bud_http_body_unref(bud_http_body_t* body) {
+  if (body == NULL || --body->refcount != 0)
+    return;
+  free(body);
+}
+
+
+void bud_http_request_cancel(bud_http_request_t* request) {
+  bud_http_conn_t* conn;
+
+  bud_http_request_unhedge(request, 0);
+  conn = request->conn;
+
+  /* Waiting for connection */
+  if (conn == NULL) {
+    if (!QUEUE_EMPTY(&request->member))
+      QUEUE_REMOVE(&request->member);
+    bud_http_request_free(request);
+    return;
+  }
+
+  /* Not written yet, connection stays for the next request */
+  if (!request->sent) {
+    bud_http_conn_detach(conn, request);
+    bud_http_request_free(request);
+    if (conn->inflight == 0 && conn->state != kBudHttpConnecting)
+      bud_http_conn_idle(conn);
+    return;
+  }
+
+  /* Keep the other pipelined requests, its response will be skipped */
+  if (conn->inflight > 1) {
+    request->cb = NULL;
+    return;
+  }
+
+  /* Response would be out of order, close the connection */
+  bud_http_conn_close(conn, bud_ok());
+}
+
+
+void bud_http_request_hedge_cb(bud_http_request_t* req, bud_error_t err) {
+  bud_http_request_t* orig;
+  bud_http_cb cb;
+
+  /* Failed duplicate, the original one may still make it */
+  orig = req->peer;
+  if (!bud_is_ok(err) || orig == NULL) {
+    bud_http_request_unhedge(req, 0);
+    return;
+  }
+
+  /* Won the race: answer in place of the original, and cancel it */
+  cb = orig->cb;
+  req->data = orig->data;
+  bud_http_request_unhedge(req, 1);
+  req->cb = cb;
+  cb(req, err);
+}
+
+
+void bud_http_request_unhedge(bud_http_request_t* req, int cancel) {
+  bud_http_request_t* peer;
+
+  peer = req->peer;
+  if (peer == NULL)
+    return;
+  req->peer = NULL;
+  peer->peer = NULL;
+
+  if (cancel) {
+    bud_http_request_cancel(peer);
+    return;
+  }
+
+  /* Original one is owned by the caller, it goes on as if never hedged */
+  if (req->duplicate)
+    return;
+
+  /*
+   * Called from the places that walk the connection's requests, so don't
+   * touch the connection: response of the duplicate is skipped when it
+   * comes.
+   */
+  if (peer->conn != NULL) {
+    peer->cb = NULL;
+    return;
+  }
+  if (!QUEUE_EMPTY(&peer->member))
+    QUEUE_REMOVE(&peer->member);
+  bud_http_request_free(peer);
+}
+
+
+void bud_http_request_fail(bud_http_request_t* req, bud_error_t err) {
+  if (req->conn != NULL) {
+    bud_http_conn_close(req->conn, err);
+    return;
+  }
+
+  if (!bud_is_ok(err) && req->cb != NULL)
+    req->cb(req, err);
+  bud_http_request_free(req);
+}
+
+
+void bud_http_request_free(bud_http_request_t* req) {
+  bud_http_request_unhedge(req, 0);
+  if (req->extract)
+    bud_json_stream_destroy(&req->stream);
+  req->extract = 0;
+  free(req->url);
+  bud_http_body_unref(req->body);
+  req->url = NULL;
+  req->body = NULL;
+  bud_slab_free(&req->config->http_req_slab, req);
+}
+
+
+#define UV_STR_BUF(str) uv_buf_init((str), sizeof(str) - 1)
+
+size_t bud_http_request_bufs(bud_http_request_t* req, uv_buf_t* bufs) {
+  uv_buf_t host;
+
+  /* Path is not a valid `Host` */
+  if (req->pool->is_pipe)
+    host = UV_STR_BUF("localhost");
+  else
+    host = uv_buf_init(req->pool->host, req->pool->host_len);
+
+  if (req->method == kBudHttpGet) {
+    bufs[0] = UV_STR_BUF("GET ");
+    bufs[1] = uv_buf_init(req->url, req->url_len);
+    bufs[2] = UV_STR_BUF(" HTTP/1.1\r\nHost: ");
+    bufs[3] = host;
+    bufs[4] = UV_STR_BUF("\r\n\r\n");
+    return 5;
+  }
+
+  bufs[0] = UV_STR_BUF("POST ");
+  bufs[1] = uv_buf_init(req->url, req->url_len);
+  bufs[2] = UV_STR_BUF(" HTTP/1.1\r\nHost: ");
+  bufs[3] = host;
+  bufs[4] = UV_STR_BUF("\r\nContent-Type: ");
+  bufs[5] = uv_buf_init((char*) req->content_type,
+                        strlen(req->content_type));
+  bufs[6] = UV_STR_BUF("\r\nContent-Length: ");
+  bufs[7] = uv_buf_init(req->body_length,
+                        snprintf(req->body_length,
+                                 sizeof(req->body_length),
+                                 "%d\r\n\r\n",
+                                 (int) req->body->len));
+  bufs[8] = uv_buf_init(req->body->data, req->body->len);
+  return 9;
+}
+
+#undef UV_STR_BUF
+
+bud_http_conn_t* bud_http_conn_new(bud_http_pool_t* pool,
+                                   bud_http_conn_t* avoid,
+                                   bud_error_t* err) {
+  bud_http_conn_t* conn;
+  struct sockaddr* addr;
+  int r;
+
+  conn = bud_slab_alloc(&pool->config->http_conn_slab);
+  if (conn == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_http_conn_t");
+    goto fatal;
+  }
+
+  conn->config = pool->config;
+  conn->pool = pool;
+  QUEUE_INIT(&conn->reqs);
+  conn->inflight = 0;
+  conn->exclusive = 0;
+  conn->writing = 0;
+  conn->served = 0;
+  conn->partial = 0;
+  conn->idle_since = 0;
+  conn->host = 0;
+  conn->addr = 0;
+  conn->header_len = 0;
+  conn->in_value = 0;
+  conn->cache_control_len = 0;
+  http_parser_init(&conn->parser, HTTP_RESPONSE);
+  bud_http_conn_buf_init(conn);
+  conn->complete = 0;
+
+  if (pool->is_pipe)
+    r = uv_pipe_init(pool->config->loop, &conn->pipe, 0);
+  else
+    r = uv_tcp_init(pool->config->loop, &conn->tcp);
+  if (r != 0) {
+    *err = bud_error_num(kBudErrHttpTcpInit, r);
+    goto failed_tcp_init;
+  }
+
+  if (pool->is_pipe) {
+    /* Errors are reported to the callback */
+    uv_pipe_connect(&conn->connect,
+                    &conn->pipe,
+                    pool->host,
+                    bud_http_conn_connect_cb);
+  } else {
+    bud_http_pool_pick(pool, conn, avoid);
+    addr = (struct sockaddr*) &pool->hosts[conn->host].addrs[conn->addr];
+    r = uv_tcp_connect(&conn->connect,
+                       &conn->tcp,
+                       addr,
+                       bud_http_conn_connect_cb);
+    if (r != 0) {
+      *err = bud_error_num(kBudErrHttpTcpConnect, r);
+      goto failed_tcp_connect;
+    }
+  }
+
+  conn->state = kBudHttpConnecting;
+  QUEUE_INSERT_TAIL(&pool->busy, &conn->member);
+  pool->connections++;
+
+  *err = bud_ok();
+  return conn;
+
+failed_tcp_connect:
+  uv_close((uv_handle_t*) &conn->tcp, bud_http_conn_close_cb);
+  bud_http_conn_mark_addr(conn, 1);
+  bud_http_pool_failed(pool);
+  return NULL;
+
+failed_tcp_init:
+  ringbuffer_destroy(&conn->read_buf);
+  ringbuffer_destroy(&conn->response_buf);
+  bud_slab_free(&pool->config->http_conn_slab, conn);
+
+fatal:
+  return NULL;
+}
+
+
+void bud_http_conn_buf_init(bud_http_conn_t* conn) {
+  ringbuffer_init_pool(&conn->read_buf, &conn->config->buffer_pool, 1);
+  ringbuffer_init_pool(&conn->response_buf, &conn->config->buffer_pool, 1);
+}
+
+
+bud_http_request_t* bud_http_conn_head(bud_http_conn_t* conn) {
+  if (QUEUE_EMPTY(&conn->reqs))
+    return NULL;
+  return QUEUE_DATA(QUEUE_HEAD(&conn->reqs), bud_http_request_t, member);
+}
+
+
+bud_error_t bud_http_conn_attach(bud_http_conn_t* conn,
+                                 bud_http_request_t* req) {
+  /* idle => busy */
+  if (conn->inflight == 0) {
+    QUEUE_REMOVE(&conn->member);
+    QUEUE_INSERT_TAIL(&conn->pool->busy, &conn->member);
+  }
+
+  QUEUE_INSERT_TAIL(&conn->reqs, &req->member);
+  conn->inflight++;
+  req->conn = conn;
+  if (req->method != kBudHttpGet)
+    conn->exclusive = 1;
+
+  /* Written from connect_cb */
+  if (conn->state == kBudHttpConnecting)
+    return bud_ok();
+
+  conn->state = kBudHttpRunning;
+  return bud_http_conn_flush(conn);
+}
+
+
+void bud_http_conn_detach(bud_http_conn_t* conn, bud_http_request_t* req) {
+  QUEUE_REMOVE(&req->member);
+  QUEUE_INIT(&req->member);
+  conn->inflight--;
+  req->conn = NULL;
+}
+
+
+void bud_http_conn_idle(bud_http_conn_t* conn) {
+  /* busy => idle */
+  conn->state = kBudHttpConnected;
+  conn->exclusive = 0;
+  conn->idle_since = uv_now(conn->config->loop);
+  QUEUE_REMOVE(&conn->member);
+  QUEUE_INSERT_TAIL(&conn->pool->idle, &conn->member);
+
+  if (conn->pool->idle_timeout != 0)
+    bud_http_pool_arm(conn->pool);
+}
+
+
+void bud_http_conn_mark_addr(bud_http_conn_t* conn, int failed) {
+  bud_http_pool_t* pool;
+  bud_http_host_t* host;
+  uint64_t backoff;
+
+  pool = conn->pool;
+  host = &pool->hosts[conn->host];
+
+  /* Lookup could have replaced the addresses meanwhile */
+  if (pool->is_pipe || conn->addr >= host->addr_count)
+    return;
+
+  if (!failed) {
+    host->retry_at[conn->addr] = 0;
+    return;
+  }
+
+  backoff = pool->backoff != 0 ? pool->backoff : BUD_HTTP_ADDR_RETRY;
+  host->retry_at[conn->addr] = uv_now(conn->config->loop) + backoff;
+}
+
+
+void bud_http_conn_requeue(bud_http_conn_t* conn, int retry) {
+  QUEUE* q;
+  bud_http_request_t* head;
+  bud_http_request_t* req;
+
+  head = bud_http_conn_head(conn);
+
+  /* Won't be answered here, retry them first and in the same order */
+  q = QUEUE_PREV(&conn->reqs);
+  while (q != &conn->reqs) {
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    q = QUEUE_PREV(q);
+
+    /* Cancelled, nobody needs it */
+    if (req->cb == NULL) {
+      bud_http_conn_detach(conn, req);
+      bud_http_request_free(req);
+      continue;
+    }
+
+    /*
+     * Connection was dropped or never made: resend GETs and requests that
+     * weren't written, just once, and not the one that has already got a
+     * part of its response.
+     */
+    if (retry &&
+        ((req->method != kBudHttpGet && req->sent) ||
+         req->retried ||
+         (req == head && conn->partial))) {
+      continue;
+    }
+
+    bud_http_conn_detach(conn, req);
+    if (retry)
+      req->retried = 1;
+    req->sent = 0;
+    req->written = 0;
+    QUEUE_INSERT_HEAD(&conn->pool->pending, &req->member);
+  }
+}
+
+
+int bud_http_conn_expired(bud_http_conn_t* conn, uint64_t now) {
+  QUEUE* q;
+  bud_http_request_t* req;
+
+  QUEUE_FOREACH(q, &conn->reqs) {
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    if (req->cb != NULL && req->deadline != 0 && req->deadline <= now)
+      return 1;
+  }
+  return 0;
+}
+
+
+void bud_http_conn_close(bud_http_conn_t* conn, bud_error_t err) {
+  bud_http_pool_t* pool;
+  bud_http_request_t* req;
+
+  if (conn->state == kBudHttpDisconnected)
+    return;
+
+  pool = conn->pool;
+  conn->state = kBudHttpDisconnected;
+  QUEUE_REMOVE(&conn->member);
+  pool->connections--;
+  uv_close((uv_handle_t*) &conn->tcp, bud_http_conn_close_cb);
+
+  /*
+   * Reused connection is likely dropped by the server after being idle,
+   * resend the requests. Fresh one - the address is in trouble, try the
+   * others if there are any.
+   */
+  if (!bud_is_ok(err) && bud_http_is_io_error(err)) {
+    if (conn->served != 0) {
+      bud_http_conn_requeue(conn, 1);
     } else {
-      url[j++] = fmt[i];
+      bud_http_conn_mark_addr(conn, 1);
+      if (bud_http_pool_can_failover(pool))
+        bud_http_conn_requeue(conn, 1);
+      bud_http_pool_failed(pool);
     }
   }
-  url[j] = '\0';
-  ASSERT(j < fmt_len + escaped_arg_len + 1, "http request url OOB");
 
-  *size = j;
-  return url;
+  while ((req = bud_http_conn_head(conn)) != NULL) {
+    bud_http_conn_detach(conn, req);
+    if (!bud_is_ok(err) && req->cb != NULL)
+      req->cb(req, err);
+    bud_http_request_free(req);
+  }
+
+  /* Slot is free */
+  bud_http_pool_next(pool);
+}
+
+
+void bud_http_conn_done(bud_http_conn_t* conn) {
+  bud_http_pool_t* pool;
+  bud_http_request_t* req;
+  uint64_t duration;
+  int keep_alive;
+
+  ASSERT(conn->state == kBudHttpRunning, "Done on not running connection");
+
+  req = bud_http_conn_head(conn);
+  bud_http_conn_detach(conn, req);
+  conn->served++;
+  conn->partial = 0;
+
+  /* Backend is fine */
+  pool = conn->pool;
+  if (pool->max_fails != 0 && pool->fails >= pool->max_fails) {
+    bud_log(conn->config,
+            kBudLogInfo,
+            "http pool %s:%d is up again",
+            pool->host,
+            (int) pool->port);
+  }
+  pool->fails = 0;
+  pool->down_backoff = 0;
+
+  /* Body was consumed, so `response_buf` has already released its chunks */
+  conn->complete = 0;
+
+  /*
+   * Settle the connection before the callback, it may send new requests.
+   * Early response - buffers of the write are still in use, close to free
+   * them.
+   */
+  keep_alive = req->written && http_should_keep_alive(&conn->parser);
+  if (!keep_alive) {
+    bud_http_conn_requeue(conn, 0);
+    bud_http_conn_close(conn, bud_ok());
+  } else if (conn->inflight == 0) {
+    bud_http_conn_idle(conn);
+  }
+
+  if (req->cb != NULL) {
+    duration = uv_now(conn->config->loop) - req->started;
+    bud_metrics_observe(conn->config, kBudMetricHttpTime, duration);
+    bud_http_pool_observe(pool, duration);
+
+    /* Original one was first, duplicate isn't needed */
+    if (!req->duplicate)
+      bud_http_request_unhedge(req, 1);
+    req->cb(req, bud_ok());
+  }
+  bud_http_request_free(req);
+
+  /* Closed above or by the callback */
+  if (conn->state == kBudHttpDisconnected)
+    return;
+
+  bud_http_pool_next(conn->pool);
+}
+
+
+bud_error_t bud_http_conn_flush(bud_http_conn_t* conn) {
+  QUEUE* q;
+  bud_http_request_t* req;
+  uv_buf_t bufs[BUD_HTTP_PIPELINE_MAX * 9];
+  size_t count;
+  int r;
+
+  /* The rest goes from write_cb, one write at a time */
+  if (conn->writing)
+    return bud_ok();
+
+  count = 0;
+  QUEUE_FOREACH(q, &conn->reqs) {
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    if (req->sent)
+      continue;
+    if (count + 9 > ARRAY_SIZE(bufs))
+      break;
+
+    count += bud_http_request_bufs(req, bufs + count);
+    req->sent = 1;
+  }
+  if (count == 0)
+    return bud_ok();
+
+  r = uv_write(&conn->write,
+               (uv_stream_t*) &conn->tcp,
+               bufs,
+               count,
+               bud_http_conn_write_cb);
+  if (r != 0)
+    return bud_error_num(kBudErrHttpWrite, r);
+  conn->writing = 1;
+
+  return bud_ok();
+}
+
+
+void bud_http_conn_write_cb(uv_write_t* write, int status) {
+  bud_http_conn_t* conn;
+  QUEUE* q;
+  bud_http_request_t* req;
+  bud_error_t err;
+
+  if (status == UV_ECANCELED)
+    return;
+
+  conn = container_of(write, bud_http_conn_t, write);
+  conn->writing = 0;
+
+  /* Write failure */
+  if (status != 0) {
+    bud_http_conn_close(conn, bud_error_num(kBudErrHttpWriteCb, status));
+    return;
+  }
+
+  QUEUE_FOREACH(q, &conn->reqs) {
+    req = QUEUE_DATA(q, bud_http_request_t, member);
+    if (req->sent)
+      req->written = 1;
+  }
+
+  /* Requests attached while writing */
+  err = bud_http_conn_flush(conn);
+  if (!bud_is_ok(err))
+    bud_http_conn_close(conn, err);
+}
+
+
+void bud_http_conn_connect_cb(uv_connect_t* connect, int status) {
+  bud_http_conn_t* conn;
+  bud_error_t err;
+  int r;
+
+  /* Already handled */
+  if (status == UV_ECANCELED)
+    return;
+
+  conn = container_of(connect, bud_http_conn_t, connect);
+
+  conn->state = kBudHttpConnected;
+  if (status != 0) {
+    err = bud_error_num(kBudErrHttpConnectCb, status);
+    goto fatal;
+  }
+  bud_http_conn_mark_addr(conn, 0);
+
+  /* Start reading */
+  r = uv_read_start((uv_stream_t*) &conn->tcp,
+                    bud_http_conn_alloc_cb,
+                    bud_http_conn_read_cb);
+  if (r != 0) {
+    err = bud_error_num(kBudErrHttpReadStart, r);
+    goto fatal;
+  }
+
+  /* Requests were cancelled while connecting */
+  if (conn->inflight == 0) {
+    bud_http_conn_idle(conn);
+    bud_http_pool_next(conn->pool);
+    return;
+  }
+
+  /* Send requests */
+  conn->state = kBudHttpRunning;
+  err = bud_http_conn_flush(conn);
+  if (!bud_is_ok(err))
+    goto fatal;
+  return;
+
+fatal:
+  bud_http_conn_close(conn, err);
+  return;
+}
+
+
+void bud_http_conn_alloc_cb(uv_handle_t* handle,
+                            size_t suggested_size,
+                            uv_buf_t* buf) {
+  bud_http_conn_t* conn;
+  size_t avail;
+  char* ptr;
+
+  conn = container_of(handle, bud_http_conn_t, tcp);
+
+  /* NULL on OOM, `read_cb` is called with `UV_ENOBUFS` then */
+  avail = 0;
+  ptr = ringbuffer_write_ptr(&conn->read_buf, &avail);
+  *buf = uv_buf_init(ptr, avail);
+}
+
+
+void bud_http_conn_read_cb(uv_stream_t* stream,
+                           ssize_t nread,
+                           const uv_buf_t* buf) {
+  bud_http_conn_t* conn;
+
+  conn = container_of(stream, bud_http_conn_t, tcp);
+
+  /* Return unused chunk to the pool */
+  if (nread <= 0)
+    ringbuffer_write_append(&conn->read_buf, 0);
+
+  if (nread < 0 && nread != UV_EOF) {
+    bud_http_conn_close(conn, bud_error_num(kBudErrHttpReadCb, nread));
+    return;
+  }
+
+  /* Idle connections are closed by the server silently */
+  if (nread == UV_EOF) {
+    bud_http_conn_close(conn, bud_error(kBudErrHttpEof));
+    return;
+  }
+
+  /*
+   * Keep the chunk until everything is parsed, callbacks may allocate from
+   * the same pool.
+   */
+  ringbuffer_write_append(&conn->read_buf, nread);
+  bud_http_conn_parse(conn, buf->base, nread);
+  ringbuffer_read_skip(&conn->read_buf, nread);
+}
+
+
+void bud_http_conn_parse(bud_http_conn_t* conn,
+                         const char* data,
+                         size_t size) {
+  bud_http_request_t* req;
+  size_t left;
+  size_t parsed;
+  bud_error_t err;
+
+  /* One response at a time */
+  left = size;
+  while (left > 0) {
+    conn->partial = 1;
+    parsed = http_parser_execute(&conn->parser,
+                                 &bud_parser_settings,
+                                 data,
+                                 left);
+
+    /* Paused by message_complete_cb */
+    if (HTTP_PARSER_ERRNO(&conn->parser) == HPE_PAUSED) {
+      http_parser_pause(&conn->parser, 0);
+    } else if (parsed != left) {
+      req = bud_http_conn_head(conn);
+      if (req != NULL && !bud_is_ok(req->extract_err)) {
+        err = req->extract_err;
+      } else {
+        err = bud_error_str(
+            kBudErrHttpParse,
+            http_errno_description(HTTP_PARSER_ERRNO(&conn->parser)));
+      }
+      bud_http_conn_close(conn, err);
+      return;
+    }
+    data += parsed;
+    left -= parsed;
+
+    if (!conn->complete)
+      continue;
+
+    bud_http_conn_response(conn);
+    if (conn->state == kBudHttpDisconnected)
+      return;
+  }
+}
+
+
+void bud_http_conn_response(bud_http_conn_t* conn) {
+  bud_http_request_t* req;
+  char* out;
+  size_t len;
+  const char* rest;
+  bud_error_t err;
+
+  req = bud_http_conn_head(conn);
+  req->code = conn->parser.status_code;
+  bud_http_parse_cache_control(conn->cache_control,
+                               conn->cache_control_len,
+                               &req->max_age,
+                               &req->stale);
+  if (req->extract) {
+    err = bud_json_stream_end(&req->stream, &rest);
+    if (bud_is_ok(err)) {
+      req->response = json_parse_string(rest);
+      if (req->response == NULL)
+        err = bud_error_str(kBudErrJSONParse, "http response");
+    }
+    if (bud_is_ok(err))
+      bud_http_conn_done(conn);
+    else
+      bud_http_conn_close(conn, err);
+    return;
+  }
+
+  len = ringbuffer_size(&conn->response_buf);
+  out = malloc(len + 1);
+  if (out == NULL) {
+    bud_http_conn_close(conn, bud_error_str(kBudErrNoMem, "http response"));
+    return;
+  }
+
+  ringbuffer_read_into(&conn->response_buf, out, len);
+  out[len] = 0;
+
+  /* Binary response, callback takes ownership */
+  if (req->raw) {
+    req->raw_response = out;
+    req->raw_response_len = len;
+    bud_http_conn_done(conn);
+    return;
+  }
+
+  req->response = json_parse_string(out);
+  free(out);
+  if (req->response == NULL)
+    bud_http_conn_close(conn, bud_error_str(kBudErrJSONParse, "http response"));
+  else
+    bud_http_conn_done(conn);
+}
+
+
+void bud_http_parse_cache_control(const char* value,
+                                  size_t len,
+                                  int* max_age,
+                                  int* stale) {
+  const char* end;
+  const char* next;
+  size_t dlen;
+
+  *max_age = -1;
+  *stale = -1;
+
+  /* Comma-separated directives, the rest of them are of no use here */
+  end = value + len;
+  for (; value < end; value = next + 1) {
+    while (value < end && (*value == ' ' || *value == '\t'))
+      value++;
+    next = memchr(value, ',', end - value);
+    if (next == NULL)
+      next = end;
+    dlen = next - value;
+
+#define DIRECTIVE(name)                                                       \
+    (dlen > sizeof(name) - 1 &&                                               \
+     strncasecmp(value, name, sizeof(name) - 1) == 0)
+
+    if (DIRECTIVE("max-age="))
+      *max_age = atoi(value + sizeof("max-age=") - 1);
+    else if (DIRECTIVE("stale-while-revalidate="))
+      *stale = atoi(value + sizeof("stale-while-revalidate=") - 1);
+    else if (dlen >= 8 && strncasecmp(value, "no-cache", 8) == 0)
+      *max_age = 0;
+
+#undef DIRECTIVE
+
+    if (next == end)
+      break;
+  }
+}
+
+
+int bud_http_conn_message_begin_cb(http_parser* parser) {
+  bud_http_conn_t* conn;
+
+  conn = container_of(parser, bud_http_conn_t, parser);
+  conn->header_len = 0;
+  conn->in_value = 0;
+  conn->cache_control_len = 0;
+  return 0;
+}
+
+
+int bud_http_conn_header_field_cb(http_parser* parser,
+                                  const char* at,
+                                  size_t length) {
+  bud_http_conn_t* conn;
+
+  conn = container_of(parser, bud_http_conn_t, parser);
+
+  /* Name may come in several chunks */
+  if (conn->in_value) {
+    conn->header_len = 0;
+    conn->in_value = 0;
+  }
+  if (conn->header_len + length > sizeof(conn->header)) {
+    conn->header_len = sizeof(conn->header);
+    return 0;
+  }
+  memcpy(conn->header + conn->header_len, at, length);
+  conn->header_len += length;
+  return 0;
+}
+
+
+int bud_http_conn_header_value_cb(http_parser* parser,
+                                  const char* at,
+                                  size_t length) {
+  bud_http_conn_t* conn;
+  size_t avail;
+  int first;
+
+  conn = container_of(parser, bud_http_conn_t, parser);
+  first = !conn->in_value;
+  conn->in_value = 1;
+
+  if (conn->header_len != sizeof("Cache-Control") - 1 ||
+      strncasecmp(conn->header, "Cache-Control", conn->header_len) != 0) {
+    return 0;
+  }
+
+  /* Repeated header is the same as a comma-separated list, excess is cut */
+  avail = sizeof(conn->cache_control) - conn->cache_control_len;
+  if (first && conn->cache_control_len != 0 && avail != 0) {
+    conn->cache_control[conn->cache_control_len++] = ',';
+    avail--;
+  }
+  if (length > avail)
+    length = avail;
+  memcpy(conn->cache_control + conn->cache_control_len, at, length);
+  conn->cache_control_len += length;
+  return 0;
+}
+
+
+int bud_http_conn_body_cb(http_parser* parser, const char *at, size_t length) {
+  size_t r;
+  bud_http_conn_t* conn;
+  bud_http_request_t* req;
+
+  conn = container_of(parser, bud_http_conn_t, parser);
+  req = bud_http_conn_head(conn);
+
+  /* Response without a request */
+  if (req == NULL)
+    return -1;
+
+  /* Pull fields out right away, only the rest of the body is buffered */
+  if (req->extract) {
+    req->extract_err = bud_json_stream_write(&req->stream, at, length);
+    return bud_is_ok(req->extract_err) ? 0 : -1;
+  }
+
+  r = ringbuffer_write_into(&conn->response_buf, at, length);
+
+  if (r != 0)
+    return -1;
+
+  return 0;
+}
+
+
+static int bud_http_conn_message_complete_cb(http_parser* parser) {
+  bud_http_conn_t* conn;
+
+  conn = container_of(parser, bud_http_conn_t, parser);
+  if (bud_http_conn_head(conn) == NULL)
+    return -1;
+  conn->complete = 1;
+
+  /* Next pipelined response is for another request */
+  http_parser_pause(parser, 1);
+
+  return 0;
+}
+
+
+void bud_http_conn_close_cb(uv_handle_t* handle) {
+  bud_http_conn_t* conn;
+
+  conn = container_of(handle, bud_http_conn_t, tcp);
+  ringbuffer_destroy(&conn->read_buf);
+  ringbuffer_destroy(&conn->response_buf);
+  bud_slab_free(&conn->config->http_conn_slab, conn);
 }
@@ -9,16 +9,39 @@
 #include "config.h"
 #include "queue.h"
 #include "error.h"
+#include "json-stream.h"
 
-#define BUD_HTTP_REQUEST_BUF_SIZE 8096
+/* Shortest interval of deadline checks, see `bud_http_pool_t.timeout` */
+#define BUD_HTTP_POOL_TIMER_MIN 10
+
+/* Upper bound of `bud_http_pool_t.pipeline` */
+#define BUD_HTTP_PIPELINE_MAX 16
+
+/* Upstreams of one pool, and addresses kept per resolved name */
+#define BUD_HTTP_POOL_MAX_HOSTS 8
+#define BUD_HTTP_HOST_MAX_ADDRS 4
+
+/* Address isn't tried for this long after a failed connect, if no `backoff` */
+#define BUD_HTTP_ADDR_RETRY 1000
+
+/* Response times kept for the `hedge` delay, and the update interval */
+#define BUD_HTTP_HEDGE_SAMPLES 64
+#define BUD_HTTP_HEDGE_UPDATE 16
+
+/* Longest header name matched, and kept `Cache-Control` value */
+#define BUD_HTTP_HEADER_MAX 16
+#define BUD_HTTP_CACHE_CONTROL_MAX 128
 
 typedef struct bud_http_pool_s bud_http_pool_t;
+typedef struct bud_http_host_s bud_http_host_t;
+typedef struct bud_http_conn_s bud_http_conn_t;
 typedef struct bud_http_request_s bud_http_request_t;
-typedef enum bud_http_request_state_e bud_http_request_state_t;
+typedef struct bud_http_body_s bud_http_body_t;
+typedef enum bud_http_conn_state_e bud_http_conn_state_t;
 typedef enum bud_http_method_e bud_http_method_t;
 typedef void (*bud_http_cb)(bud_http_request_t* req, bud_error_t err);
 
-enum bud_http_request_state_e {
+enum bud_http_conn_state_e {
   kBudHttpConnecting,
   kBudHttpConnected,
   kBudHttpRunning,
@@ -30,43 +53,228 @@ enum bud_http_method_e {
   kBudHttpPost
 };
 
+/*
+ * POST body, refcounted so that the same bytes can be sent by many requests
+ * without a copy. Requests hold a reference until they are freed.
+ */
+struct bud_http_body_s {
+  int refcount;
+  size_t len;
+  char data[1];
+};
+
+struct bud_http_host_s {
+  bud_http_pool_t* pool;
+  char* name;
+
+  /* Not an IP address, looked up again every `resolve_interval` ms */
+  int is_name;
+  uv_getaddrinfo_t resolver;
+  int resolving;
+
+  /* Connect to address isn't attempted before its `retry_at`, 0 - healthy */
+  struct sockaddr_storage addrs[BUD_HTTP_HOST_MAX_ADDRS];
+  uint64_t retry_at[BUD_HTTP_HOST_MAX_ADDRS];
+  int addr_count;
+};
+
 struct bud_http_pool_s {
-  QUEUE pool;
-  QUEUE reqs;
+  /* Connections without a request, and the ones connecting or busy */
+  QUEUE idle;
+  QUEUE busy;
+
+  /* Requests waiting for a connection, oldest first */
+  QUEUE pending;
 
   bud_config_t* config;
+
+  /* First of the hosts, sent in `Host:` header */
   char* host;
   size_t host_len;
-  struct sockaddr_storage addr;
   uint16_t port;
+  int is_pipe;
+
+  /* Connections are spread round-robin across addresses of all hosts */
+  bud_http_host_t hosts[BUD_HTTP_POOL_MAX_HOSTS];
+  int host_count;
+  unsigned int next_addr;
+
+  /*
+   * NULL-terminated list of big top-level string members, extracted from
+   * JSON responses while they are read (see json-stream.h). Set by the owner
+   * after `bud_http_pool_new()`, NULL - whole body goes to parson.
+   */
+  const char* const* extract;
+
+  /*
+   * Also set by the owner. At most `max_connections` are open at once, the
+   * rest of requests wait in `pending`. Requests that aren't done in
+   * `timeout` ms (including the wait) fail with `kBudErrHttpTimeout`.
+   * 0 - no limit.
+   */
+  int max_connections;
+  uint64_t timeout;
+
+  /*
+   * Number of GETs written to one connection before the first response
+   * comes back. Connections are filled up before opening new ones,
+   * responses are matched in order. 1 - no pipelining.
+   */
+  int pipeline;
+
+  /*
+   * Idle connections are closed after `idle_timeout` ms. After `max_fails`
+   * failed connections in a row the pool is marked down for `backoff` ms,
+   * doubled on each failed probe up to `max_backoff`. Requests fail right
+   * away with `kBudErrHttpDown` then. 0 - disabled.
+   */
+  uint64_t idle_timeout;
+  int max_fails;
+  uint64_t backoff;
+  uint64_t max_backoff;
+
+  /* Hostnames are re-resolved this often, 0 - only once on start */
+  uint64_t resolve_interval;
+
+  /*
+   * GET in flight for `hedge_delay` ms is duplicated to a connection to
+   * another address, whichever answers first wins and the other one is
+   * cancelled. Delay is the 95th percentile of the last `samples`, but no
+   * less than `hedge`. 0 - disabled.
+   */
+  uint64_t hedge;
+  uint64_t hedge_delay;
+  uint32_t samples[BUD_HTTP_HEDGE_SAMPLES];
+  unsigned int sample_count;
+
+  /* internal */
+  int connections;
+  int fails;
+  uint64_t down_until;
+  uint64_t down_backoff;
+  uv_timer_t timer;
+  uv_timer_t resolve_timer;
+
+  /* Handles and lookups to wait for in `bud_http_pool_free()` */
+  int closing;
+  int refs;
 };
 
-struct bud_http_request_s {
+struct bud_http_conn_s {
+  /* In pool's `idle` or `busy` */
   QUEUE member;
 
-  /* Pool state */
+  bud_config_t* config;
   bud_http_pool_t* pool;
-  bud_http_request_state_t state;
+  bud_http_conn_state_t state;
   int complete;
 
-  /* Connection */
-  uv_tcp_t tcp;
+  /* `pipe` - if pool's host is a Unix socket path */
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
   uv_connect_t connect;
   uv_write_t write;
-  char buf[BUD_HTTP_REQUEST_BUF_SIZE];
+  int writing;
+
+  /* Address connected to, indices into pool's `hosts` */
+  int host;
+  int addr;
+
+  /*
+   * Both are lazy: chunks are taken from the shared pool when data arrives
+   * and given back once it is consumed, idle connections hold none.
+   */
+  ringbuffer read_buf;
   ringbuffer response_buf;
   http_parser parser;
 
+  /*
+   * Name of the header being read (longer ones are cut to MAX and never
+   * match), and `Cache-Control` of the response.
+   */
+  char header[BUD_HTTP_HEADER_MAX];
+  size_t header_len;
+  int in_value;
+  char cache_control[BUD_HTTP_CACHE_CONTROL_MAX];
+  size_t cache_control_len;
+
+  /* Requests in flight in order of responses, head is being read */
+  QUEUE reqs;
+  int inflight;
+
+  /* Has a POST in flight, not pipelined */
+  int exclusive;
+
+  /* Responses received, and whether a part of the next one is in */
+  int served;
+  int partial;
+
+  /* For `idle_timeout`, connections in `idle` are oldest first */
+  uint64_t idle_since;
+};
+
+struct bud_http_request_s {
+  /* In pool's `pending`, or in connection's `reqs` */
+  QUEUE member;
+
+  bud_config_t* config;
+  bud_http_pool_t* pool;
+  bud_http_conn_t* conn;
+
   /* Request */
   bud_http_method_t method;
   char* url;
   size_t url_len;
-  char* body;
-  size_t body_len;
+  bud_http_body_t* body;
+  const char* content_type;
+  char body_length[32];
+
+  /* Handed to `uv_write()`, and the write has completed */
+  int sent;
+  int written;
+
+  /* Already resent once after its connection was dropped or failed */
+  int retried;
+
+  /*
+   * The other one of a hedged pair: the original request that was returned
+   * to the caller has `hedged` set, the one sent to another address has
+   * `duplicate`. Neither is duplicated again.
+   */
+  bud_http_request_t* peer;
+  int hedged;
+  int duplicate;
+
+  /* NULL - cancelled, but its response is still due on the connection */
   bud_http_cb cb;
   void* data;
   int code;
   JSON_Value* response;
+
+  /* `Cache-Control` max-age and stale-while-revalidate in s, -1 - absent */
+  int max_age;
+  int stale;
+
+  /*
+   * If pool has `extract` fields: their values, valid during the callback.
+   * `response` is the rest of the body then, with `null` in their place.
+   */
+  int extract;
+  bud_json_stream_t stream;
+  bud_error_t extract_err;
+
+  /* Not parsed as JSON if `raw` is set, owned by the callback */
+  int raw;
+  char* raw_response;
+  size_t raw_response_len;
+
+  /* For `bud_http_request_duration_ms` metric */
+  uint64_t started;
+
+  /* `started + pool->timeout`, 0 - none */
+  uint64_t deadline;
 };
 
 bud_http_pool_t* bud_http_pool_new(bud_config_t* config,
@@ -75,6 +283,13 @@ bud_http_pool_t* bud_http_pool_new(bud_config_t* config,
                                    bud_error_t* err);
 void bud_http_pool_free(bud_http_pool_t* pool);
 
+/* Another upstream on the same port, an IP address or a hostname */
+bud_error_t bud_http_pool_add_host(bud_http_pool_t* pool, const char* host);
+
+/* Copy limits from sni/stapling/session config section */
+void bud_http_pool_configure(bud_http_pool_t* pool,
+                             bud_config_http_pool_t* conf);
+
 bud_http_request_t* bud_http_get(bud_http_pool_t* pool,
                                  const char* fmt,
                                  const char* arg,
@@ -85,10 +300,23 @@ bud_http_request_t* bud_http_post(bud_http_pool_t* pool,
                                   const char* fmt,
                                   const char* arg,
                                   size_t arg_len,
-                                  const char* data,
-                                  size_t data_len,
+                                  bud_http_body_t* body,
                                   bud_http_cb cb,
                                   bud_error_t* err);
+
+/* POST `body` to `path` as is, response is put into `req->raw_response` */
+bud_http_request_t* bud_http_post_raw(bud_http_pool_t* pool,
+                                      const char* path,
+                                      const char* content_type,
+                                      bud_http_body_t* body,
+                                      bud_http_cb cb,
+                                      bud_error_t* err);
+
+/* `len` bytes to be filled by the caller, plus a trailing NUL, refcount 1 */
+bud_http_body_t* bud_http_body_new(size_t len);
+void bud_http_body_unref(bud_http_body_t* body);
+
+/* Callback is not called, `request` is freed */
 void bud_http_request_cancel(bud_http_request_t* request);
 
 #endif  /* SRC_HTTP_POOL_H_ */
@@ -0,0 +1,194 @@
+#include <stdlib.h>  /* malloc, realloc, free */
+#include <string.h>  /* memcpy, memmove */
+
+#include "uv.h"
+
+#include "ipc.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+typedef struct bud_ipc_write_s bud_ipc_write_t;
+
+struct bud_ipc_write_s {
+  struct bud_config_s* config;
+  uv_write_t req;
+  char data[1];
+};
+
+static bud_error_t bud_ipc_queue(bud_config_t* config,
+                                 uv_stream_t* stream,
+                                 bud_ipc_type_t type,
+                                 const char* header,
+                                 size_t header_size,
+                                 const char* data,
+                                 size_t size,
+                                 uv_stream_t* handle);
+static void bud_ipc_send_cb(uv_write_t* req, int status);
+
+
+void bud_ipc_init(bud_ipc_t* ipc, bud_config_t* config, bud_ipc_msg_cb cb) {
+  ipc->config = config;
+  ipc->cb = cb;
+  ipc->buf = NULL;
+  ipc->len = 0;
+  ipc->cap = 0;
+}
+
+
+void bud_ipc_destroy(bud_ipc_t* ipc) {
+  free(ipc->buf);
+  ipc->buf = NULL;
+  ipc->len = 0;
+  ipc->cap = 0;
+}
+
+
+bud_error_t bud_ipc_parse(bud_ipc_t* ipc, const char* data, size_t size) {
+  bud_ipc_msg_t msg;
+  unsigned char* header;
+  size_t cap;
+  size_t offset;
+  char* tmp;
+
+  /* Accumulate */
+  if (ipc->len + size > ipc->cap) {
+    cap = ipc->cap == 0 ? 1024 : ipc->cap;
+    while (cap < ipc->len + size)
+      cap <<= 1;
+    tmp = realloc(ipc->buf, cap);
+    if (tmp == NULL) {
+      ipc->len = 0;
+      return bud_error_str(kBudErrNoMem, "ipc buffer");
+    }
+    ipc->buf = tmp;
+    ipc->cap = cap;
+  }
+  memcpy(ipc->buf + ipc->len, data, size);
+  ipc->len += size;
+
+  /* Dispatch all complete messages */
+  offset = 0;
+  while (ipc->len - offset >= BUD_IPC_HEADER_SIZE) {
+    header = (unsigned char*) ipc->buf + offset;
+    msg.type = header[0];
+    msg.size = (header[1] << 24) | (header[2] << 16) |
+               (header[3] << 8) | header[4];
+    /* Don't parse the same header again */
+    if (msg.size > BUD_IPC_MAX_SIZE) {
+      ipc->len = 0;
+      return bud_error_num(kBudErrIPCMsgSize, (int) msg.size);
+    }
+
+    if (ipc->len - offset < BUD_IPC_HEADER_SIZE + msg.size)
+      break;
+
+    msg.data = ipc->buf + offset + BUD_IPC_HEADER_SIZE;
+    ipc->cb(ipc, &msg);
+    offset += BUD_IPC_HEADER_SIZE + msg.size;
+  }
+
+  /* Keep the partial message */
+  memmove(ipc->buf, ipc->buf + offset, ipc->len - offset);
+  ipc->len -= offset;
+
+  return bud_ok();
+}
+
+
+void bud_ipc_write_header(char* out, bud_ipc_type_t type, uint32_t size) {
+  out[0] = (char) type;
+  out[1] = (size >> 24) & 0xff;
+  out[2] = (size >> 16) & 0xff;
+  out[3] = (size >> 8) & 0xff;
+  out[4] = size & 0xff;
+}
+
+
+bud_error_t bud_ipc_send(bud_config_t* config,
+                         uv_stream_t* stream,
+                         bud_ipc_type_t type,
+                         const char* header,
+                         size_t header_size,
+                         const char* data,
+                         size_t size) {
+  return bud_ipc_queue(config,
+                       stream,
+                       type,
+                       header,
+                       header_size,
+                       data,
+                       size,
+                       NULL);
+}
+
+
+bud_error_t bud_ipc_send_handle(bud_config_t* config,
+                                uv_stream_t* stream,
+                                bud_ipc_type_t type,
+                                const char* header,
+                                size_t header_size,
+                                uv_stream_t* handle) {
+  return bud_ipc_queue(config,
+                       stream,
+                       type,
+                       header,
+                       header_size,
+                       NULL,
+                       0,
+                       handle);
+}
+
+
+bud_error_t bud_ipc_queue(bud_config_t* config,
+                          uv_stream_t* stream,
+                          bud_ipc_type_t type,
+                          const char* header,
+                          size_t header_size,
+                          const char* data,
+                          size_t size,
+                          uv_stream_t* handle) {
+  bud_ipc_write_t* w;
+  uv_buf_t buf;
+  size_t total;
+  int r;
+
+  total = BUD_IPC_HEADER_SIZE + header_size + size;
+  w = malloc(sizeof(*w) + total);
+  if (w == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_ipc_write_t");
+
+  w->config = config;
+  bud_ipc_write_header(w->data, type, header_size + size);
+  memcpy(w->data + BUD_IPC_HEADER_SIZE, header, header_size);
+  if (size != 0)
+    memcpy(w->data + BUD_IPC_HEADER_SIZE + header_size, data, size);
+
+  buf = uv_buf_init(w->data, total);
+  if (handle == NULL)
+    r = uv_write(&w->req, stream, &buf, 1, bud_ipc_send_cb);
+  else
+    r = uv_write2(&w->req, stream, &buf, 1, handle, bud_ipc_send_cb);
+  if (r != 0) {
+    free(w);
+    return bud_error_num(kBudErrIPCSend, r);
+  }
+
+  return bud_ok();
+}
+
+
+void bud_ipc_send_cb(uv_write_t* req, int status) {
+  bud_ipc_write_t* w;
+
+  w = container_of(req, bud_ipc_write_t, req);
+  if (status != 0 && status != UV_ECANCELED) {
+    bud_log(w->config,
+            kBudLogWarning,
+            "ipc write_cb() failed with (%d) \"%s\"",
+            status,
+            uv_strerror(status));
+  }
+  free(w);
+}
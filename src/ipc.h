@@ -0,0 +1,146 @@
+#ifndef SRC_IPC_H_
+#define SRC_IPC_H_
+
+#include <stdint.h>  /* uint8_t, uint32_t */
+
+#include "uv.h"
+
+#include "error.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+/* type (1 byte) + payload size (4 bytes, big-endian) */
+#define BUD_IPC_HEADER_SIZE 5
+
+/* Sanity limit for incoming messages */
+#define BUD_IPC_MAX_SIZE (1024 * 1024)
+
+typedef enum bud_ipc_type_e bud_ipc_type_t;
+typedef struct bud_ipc_msg_s bud_ipc_msg_t;
+typedef struct bud_ipc_s bud_ipc_t;
+typedef void (*bud_ipc_msg_cb)(bud_ipc_t* ipc, bud_ipc_msg_t* msg);
+
+enum bud_ipc_type_e {
+  /* uint32_t listener index, accompanies client's tcp handle */
+  kBudIPCBalance = 0x1,
+
+  /* uint32_t context index (big-endian) + DER OCSP response */
+  kBudIPCStaple = 0x2,
+
+  /*
+   * Worker -> master: uint32_t client count + uint32_t loop lag in ms +
+   * uint32_t flags (BUD_IPC_LOAD_SHEDDING)
+   */
+  kBudIPCLoad = 0x3,
+
+  /*
+   * uint8_t flags (BUD_IPC_DRAIN_HANDOFF), worker should stop accepting and
+   * exit after last client
+   */
+  kBudIPCDrain = 0x4,
+
+  /* Empty, worker should reload certificates of static contexts */
+  kBudIPCReload = 0x5,
+
+  /* Worker -> master: uint64_t value (big-endian) of every bud_metric_t */
+  kBudIPCMetrics = 0x6,
+
+  /* Empty, spare worker takes the place of a dead one and starts serving */
+  kBudIPCPromote = 0x7,
+
+  /*
+   * uint32_t request id (big-endian) + command line of the admin socket,
+   * worker answers with the same id + text of the reply
+   */
+  kBudIPCAdmin = 0x8,
+
+  /*
+   * Worker -> master: uint8_t bud_metrics_table_type_t + rows of the table,
+   * each is uint8_t name length + name + BUD_METRICS_ROW_SIZE uint64_t values
+   */
+  kBudIPCMetricRows = 0x9,
+
+  /*
+   * Passthrough relay of a draining worker (`drain_handoff`), worker ->
+   * master -> worker of the new generation: uint32_t listener index +
+   * uint32_t size of the frontend's output + its data + backend's output.
+   * Followed by two kBudIPCHandoffFd, see handoff.h
+   */
+  kBudIPCHandoff = 0xa,
+
+  /* Empty, accompanies the frontend's, and then the backend's socket */
+  kBudIPCHandoffFd = 0xb,
+
+  /*
+   * uint32_t id (big-endian) of the worker among the serving ones, on spawn
+   * and on promotion. Tags its sessions for `workers_balance: "session"`
+   */
+  kBudIPCIdentity = 0xc,
+
+  /*
+   * uint32_t listener index, accompanies master's listening tcp handle. Sent
+   * once on spawn in `frontend.shared_listen` mode, see server.h
+   */
+  kBudIPCListen = 0xd,
+
+  /*
+   * Session ticket keys (bud_ticket_key_t each), current first. Sent on
+   * spawn and on every rotation, see ticket.h
+   */
+  kBudIPCTicketKeys = 0xe
+};
+
+/* Worker reports load that often (ms), it is the heartbeat for master */
+#define BUD_IPC_LOAD_INTERVAL 1000
+
+/* Worker is over `frontend.max_lag`, and doesn't take new clients */
+#define BUD_IPC_LOAD_SHEDDING 0x1
+
+/* Some other worker takes relays, see `drain_handoff` */
+#define BUD_IPC_DRAIN_HANDOFF 0x1
+
+struct bud_ipc_msg_s {
+  bud_ipc_type_t type;
+  uint32_t size;
+  const char* data;
+};
+
+/* Reassembles messages from the pipe's byte stream */
+struct bud_ipc_s {
+  struct bud_config_s* config;
+  bud_ipc_msg_cb cb;
+
+  char* buf;
+  size_t len;
+  size_t cap;
+};
+
+void bud_ipc_init(bud_ipc_t* ipc,
+                  struct bud_config_s* config,
+                  bud_ipc_msg_cb cb);
+void bud_ipc_destroy(bud_ipc_t* ipc);
+/* On error the buffered bytes are dropped and the framing is lost, the
+ * caller should close the channel */
+bud_error_t bud_ipc_parse(bud_ipc_t* ipc, const char* data, size_t size);
+
+void bud_ipc_write_header(char* out, bud_ipc_type_t type, uint32_t size);
+
+/* Queue message, `data` is copied */
+bud_error_t bud_ipc_send(struct bud_config_s* config,
+                         uv_stream_t* stream,
+                         bud_ipc_type_t type,
+                         const char* header,
+                         size_t header_size,
+                         const char* data,
+                         size_t size);
+
+/* Same, but with `handle` (`uv_write2()`), which must outlive the write */
+bud_error_t bud_ipc_send_handle(struct bud_config_s* config,
+                                uv_stream_t* stream,
+                                bud_ipc_type_t type,
+                                const char* header,
+                                size_t header_size,
+                                uv_stream_t* handle);
+
+#endif  /* SRC_IPC_H_ */
@@ -0,0 +1,497 @@
+#include <stdlib.h>  /* NULL, realloc, free */
+#include <string.h>  /* memcpy, memset, strlen */
+
+#include "json-stream.h"
+#include "common.h"
+#include "error.h"
+
+static int bud_json_stream_grow(char** buf,
+                                size_t* cap,
+                                size_t size,
+                                size_t extra);
+static int bud_json_stream_rest(bud_json_stream_t* stream,
+                                const char* data,
+                                size_t size);
+static int bud_json_stream_append(bud_json_stream_t* stream,
+                                  const char* data,
+                                  size_t size);
+static int bud_json_stream_unit(bud_json_stream_t* stream, unsigned int u);
+static int bud_json_stream_utf8(bud_json_stream_t* stream, unsigned int cp);
+static int bud_json_stream_flush_high(bud_json_stream_t* stream);
+static int bud_json_stream_hex(char c);
+static bud_json_field_t* bud_json_stream_lookup(bud_json_stream_t* stream);
+static bud_json_field_t* bud_json_stream_field(bud_json_stream_t* stream,
+                                               const char* name);
+static int bud_json_stream_value_start(bud_json_stream_t* stream);
+static int bud_json_stream_value_end(bud_json_stream_t* stream);
+
+#define BUD_JSON_IS_SPACE(c)                                                  \
+    ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+
+void bud_json_stream_init(bud_json_stream_t* stream,
+                          const char* const* fields) {
+  int i;
+
+  memset(stream, 0, sizeof(*stream));
+  stream->state = kBudJsonText;
+  for (i = 0; i < BUD_JSON_STREAM_MAX_FIELDS && fields[i] != NULL; i++)
+    stream->fields[i].name = fields[i];
+  stream->field_count = i;
+}
+
+
+void bud_json_stream_destroy(bud_json_stream_t* stream) {
+  int i;
+
+  for (i = 0; i < stream->field_count; i++) {
+    free(stream->fields[i].data);
+    stream->fields[i].data = NULL;
+    stream->fields[i].size = 0;
+    stream->fields[i].cap = 0;
+    stream->fields[i].count = 0;
+  }
+  free(stream->rest);
+  stream->rest = NULL;
+  stream->rest_size = 0;
+  stream->rest_cap = 0;
+}
+
+
+bud_error_t bud_json_stream_write(bud_json_stream_t* stream,
+                                  const char* data,
+                                  size_t size) {
+  size_t i;
+  size_t j;
+  size_t run;
+  char c;
+  int v;
+
+  /* Start of bytes that go to `rest` as they are */
+  run = 0;
+  for (i = 0; i < size; i++) {
+    c = data[i];
+    switch (stream->state) {
+      case kBudJsonText:
+        if (c == '"') {
+          stream->state = kBudJsonString;
+          stream->in_key = stream->depth == 1 && stream->expect_key;
+          stream->key_len = 0;
+        } else if (c == '{' || c == '[') {
+          if (++stream->depth == 1)
+            stream->expect_key = c == '{';
+        } else if (c == '}' || c == ']') {
+          stream->depth--;
+        } else if (stream->depth == 1 && c == ':') {
+          stream->expect_key = 0;
+          if (stream->match != NULL)
+            stream->state = kBudJsonValue;
+        } else if (stream->depth == 1 && c == ',') {
+          stream->expect_key = 1;
+          stream->match = NULL;
+        }
+        break;
+      case kBudJsonString:
+        if (stream->escape) {
+          /* Escaped keys are not ours */
+          stream->escape = 0;
+          stream->key_len = BUD_JSON_STREAM_MAX_KEY + 1;
+        } else if (c == '\\') {
+          stream->escape = 1;
+        } else if (c == '"') {
+          stream->state = kBudJsonText;
+          if (stream->in_key)
+            stream->match = bud_json_stream_lookup(stream);
+          stream->in_key = 0;
+        } else if (stream->in_key &&
+                   stream->key_len <= BUD_JSON_STREAM_MAX_KEY) {
+          if (stream->key_len < BUD_JSON_STREAM_MAX_KEY)
+            stream->key[stream->key_len] = c;
+          stream->key_len++;
+        }
+        break;
+      case kBudJsonValue:
+        if (BUD_JSON_IS_SPACE(c))
+          break;
+
+        stream->capture = stream->match;
+        stream->match = NULL;
+
+        /* Not a string or an array of them, leave it to the parser */
+        if (c != '"' && c != '[') {
+          stream->capture = NULL;
+          stream->state = kBudJsonText;
+          i--;
+          break;
+        }
+
+        /* Same key twice */
+        if (stream->capture->count != 0)
+          goto invalid;
+
+        if (bud_json_stream_rest(stream, data + run, i - run) != 0 ||
+            bud_json_stream_rest(stream, "null", 4) != 0) {
+          goto nomem;
+        }
+
+        stream->capture_array = c == '[';
+        if (stream->capture_array) {
+          stream->state = kBudJsonCaptureArray;
+        } else {
+          if (bud_json_stream_value_start(stream) != 0)
+            goto invalid;
+          stream->state = kBudJsonCapture;
+        }
+        break;
+      case kBudJsonCapture:
+        if (stream->hex_left > 0) {
+          v = bud_json_stream_hex(c);
+          if (v < 0)
+            goto invalid;
+          stream->hex = (stream->hex << 4) | v;
+          if (--stream->hex_left == 0 &&
+              bud_json_stream_unit(stream, stream->hex) != 0) {
+            goto nomem;
+          }
+          break;
+        }
+
+        if (stream->escape) {
+          stream->escape = 0;
+          switch (c) {
+            case 'u':
+              stream->hex_left = 4;
+              stream->hex = 0;
+              continue;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case '"':
+            case '\\':
+            case '/':
+              break;
+            default:
+              goto invalid;
+          }
+          if (bud_json_stream_append(stream, &c, 1) != 0)
+            goto nomem;
+          break;
+        }
+
+        if (c == '\\') {
+          stream->escape = 1;
+          break;
+        }
+
+        if (c == '"') {
+          if (bud_json_stream_value_end(stream) != 0)
+            goto nomem;
+          if (stream->capture_array) {
+            stream->state = kBudJsonCaptureArray;
+          } else {
+            stream->capture = NULL;
+            stream->state = kBudJsonText;
+            run = i + 1;
+          }
+          break;
+        }
+
+        /* Copy everything up to the next quote or escape at once */
+        for (j = i + 1; j < size && data[j] != '"' && data[j] != '\\'; j++)
+          ;
+        if (bud_json_stream_append(stream, data + i, j - i) != 0)
+          goto nomem;
+        i = j - 1;
+        break;
+      case kBudJsonCaptureArray:
+        if (BUD_JSON_IS_SPACE(c) || c == ',')
+          break;
+
+        if (c == '"') {
+          if (bud_json_stream_value_start(stream) != 0)
+            goto invalid;
+          stream->state = kBudJsonCapture;
+        } else if (c == ']') {
+          stream->capture = NULL;
+          stream->state = kBudJsonText;
+          run = i + 1;
+        } else {
+          goto invalid;
+        }
+        break;
+    }
+  }
+
+  /* Leftover of the chunk, if not in the middle of captured value */
+  if (stream->state != kBudJsonCapture &&
+      stream->state != kBudJsonCaptureArray &&
+      bud_json_stream_rest(stream, data + run, size - run) != 0) {
+    goto nomem;
+  }
+
+  return bud_ok();
+
+nomem:
+  return bud_error_str(kBudErrNoMem, "json stream");
+
+invalid:
+  return bud_error_str(kBudErrJSONParse, "http response");
+}
+
+
+bud_error_t bud_json_stream_end(bud_json_stream_t* stream, const char** rest) {
+  if (stream->state != kBudJsonText || stream->depth != 0)
+    return bud_error_str(kBudErrJSONParse, "http response");
+
+  /* Terminate `rest`, not counting NUL in the size */
+  if (bud_json_stream_rest(stream, "", 1) != 0)
+    return bud_error_str(kBudErrNoMem, "json stream");
+  stream->rest_size--;
+
+  *rest = stream->rest;
+  return bud_ok();
+}
+
+
+int bud_json_stream_count(bud_json_stream_t* stream, const char* name) {
+  bud_json_field_t* field;
+
+  field = bud_json_stream_field(stream, name);
+  return field == NULL ? 0 : field->count;
+}
+
+
+bud_error_t bud_json_stream_add(bud_json_stream_t* stream,
+                                const char* name,
+                                const char* value,
+                                size_t len) {
+  bud_json_field_t* field;
+
+  field = bud_json_stream_field(stream, name);
+  if (field == NULL || field->count == BUD_JSON_STREAM_MAX_VALUES)
+    return bud_error_str(kBudErrJSONParse, name);
+  if (bud_json_stream_grow(&field->data,
+                           &field->cap,
+                           field->size,
+                           len + 1) != 0) {
+    return bud_error_str(kBudErrNoMem, "json stream");
+  }
+
+  field->off[field->count] = field->size;
+  field->len[field->count] = len;
+  memcpy(field->data + field->size, value, len);
+  field->data[field->size + len] = '\0';
+  field->size += len + 1;
+  field->count++;
+  return bud_ok();
+}
+
+
+const char* bud_json_stream_value(bud_json_stream_t* stream,
+                                  const char* name,
+                                  int index,
+                                  size_t* len) {
+  bud_json_field_t* field;
+
+  field = bud_json_stream_field(stream, name);
+  if (field == NULL || index >= field->count)
+    return NULL;
+
+  *len = field->len[index];
+  return field->data + field->off[index];
+}
+
+
+int bud_json_stream_grow(char** buf, size_t* cap, size_t size, size_t extra) {
+  size_t new_cap;
+  char* tmp;
+
+  if (size + extra <= *cap)
+    return 0;
+
+  new_cap = *cap == 0 ? 1024 : *cap;
+  while (new_cap < size + extra)
+    new_cap *= 2;
+
+  tmp = realloc(*buf, new_cap);
+  if (tmp == NULL)
+    return -1;
+
+  *buf = tmp;
+  *cap = new_cap;
+  return 0;
+}
+
+
+int bud_json_stream_rest(bud_json_stream_t* stream,
+                         const char* data,
+                         size_t size) {
+  if (size == 0)
+    return 0;
+
+  if (bud_json_stream_grow(&stream->rest,
+                           &stream->rest_cap,
+                           stream->rest_size,
+                           size) != 0) {
+    return -1;
+  }
+
+  memcpy(stream->rest + stream->rest_size, data, size);
+  stream->rest_size += size;
+  return 0;
+}
+
+
+int bud_json_stream_append(bud_json_stream_t* stream,
+                           const char* data,
+                           size_t size) {
+  bud_json_field_t* field;
+
+  if (bud_json_stream_flush_high(stream) != 0)
+    return -1;
+
+  field = stream->capture;
+  if (bud_json_stream_grow(&field->data,
+                           &field->cap,
+                           field->size,
+                           size) != 0) {
+    return -1;
+  }
+
+  memcpy(field->data + field->size, data, size);
+  field->size += size;
+  return 0;
+}
+
+
+/* UTF-16 code unit from `\uXXXX`, pairs surrogates when they are escaped */
+int bud_json_stream_unit(bud_json_stream_t* stream, unsigned int u) {
+  unsigned int cp;
+
+  if (u >= 0xd800 && u <= 0xdbff) {
+    if (bud_json_stream_flush_high(stream) != 0)
+      return -1;
+    stream->high = u;
+    return 0;
+  }
+
+  if (u >= 0xdc00 && u <= 0xdfff) {
+    if (stream->high == 0)
+      return bud_json_stream_utf8(stream, 0xfffd);
+
+    cp = 0x10000 + ((stream->high - 0xd800) << 10) + (u - 0xdc00);
+    stream->high = 0;
+    return bud_json_stream_utf8(stream, cp);
+  }
+
+  return bud_json_stream_utf8(stream, u);
+}
+
+
+int bud_json_stream_utf8(bud_json_stream_t* stream, unsigned int cp) {
+  char out[4];
+  size_t len;
+
+  if (cp < 0x80) {
+    out[0] = cp;
+    len = 1;
+  } else if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    len = 2;
+  } else if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    len = 3;
+  } else {
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    len = 4;
+  }
+
+  return bud_json_stream_append(stream, out, len);
+}
+
+
+/* High surrogate without a low one, replace it */
+int bud_json_stream_flush_high(bud_json_stream_t* stream) {
+  if (stream->high == 0)
+    return 0;
+
+  stream->high = 0;
+  return bud_json_stream_utf8(stream, 0xfffd);
+}
+
+
+int bud_json_stream_hex(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+
+bud_json_field_t* bud_json_stream_lookup(bud_json_stream_t* stream) {
+  int i;
+  bud_json_field_t* field;
+
+  if (stream->key_len > BUD_JSON_STREAM_MAX_KEY)
+    return NULL;
+
+  for (i = 0; i < stream->field_count; i++) {
+    field = &stream->fields[i];
+    if (strlen(field->name) == stream->key_len &&
+        memcmp(field->name, stream->key, stream->key_len) == 0) {
+      return field;
+    }
+  }
+  return NULL;
+}
+
+
+bud_json_field_t* bud_json_stream_field(bud_json_stream_t* stream,
+                                        const char* name) {
+  int i;
+
+  for (i = 0; i < stream->field_count; i++)
+    if (strcmp(stream->fields[i].name, name) == 0)
+      return &stream->fields[i];
+  return NULL;
+}
+
+
+int bud_json_stream_value_start(bud_json_stream_t* stream) {
+  bud_json_field_t* field;
+
+  field = stream->capture;
+  if (field->count == BUD_JSON_STREAM_MAX_VALUES)
+    return -1;
+
+  field->off[field->count] = field->size;
+  return 0;
+}
+
+
+int bud_json_stream_value_end(bud_json_stream_t* stream) {
+  bud_json_field_t* field;
+  char nul;
+
+  nul = '\0';
+  if (bud_json_stream_append(stream, &nul, 1) != 0)
+    return -1;
+
+  field = stream->capture;
+  field->len[field->count] = field->size - field->off[field->count] - 1;
+  field->count++;
+  return 0;
+}
+
+#undef BUD_JSON_IS_SPACE
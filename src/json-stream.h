@@ -0,0 +1,99 @@
+#ifndef SRC_JSON_STREAM_H_
+#define SRC_JSON_STREAM_H_
+
+#include <stdlib.h>  /* size_t */
+
+#include "error.h"
+
+/* RSA+ECDSA pairs and a spare, per field */
+#define BUD_JSON_STREAM_MAX_VALUES 4
+#define BUD_JSON_STREAM_MAX_FIELDS 4
+#define BUD_JSON_STREAM_MAX_KEY 32
+
+typedef struct bud_json_stream_s bud_json_stream_t;
+typedef struct bud_json_field_s bud_json_field_t;
+typedef enum bud_json_stream_state_e bud_json_stream_state_t;
+
+enum bud_json_stream_state_e {
+  kBudJsonText,
+  kBudJsonString,
+  kBudJsonValue,
+  kBudJsonCapture,
+  kBudJsonCaptureArray
+};
+
+struct bud_json_field_s {
+  const char* name;
+
+  /* Unescaped values back to back, each one is NUL-terminated */
+  char* data;
+  size_t size;
+  size_t cap;
+  size_t off[BUD_JSON_STREAM_MAX_VALUES];
+  size_t len[BUD_JSON_STREAM_MAX_VALUES];
+  int count;
+};
+
+/*
+ * Incremental extractor of big top-level string members (certs, keys,
+ * base64 staples) from a JSON object body, fed chunk by chunk as it comes
+ * from the socket. Captured members are either a string or an array of
+ * strings, they are unescaped straight into their field and replaced by
+ * `null` in `rest` - the remaining small document for `json_parse_string()`.
+ */
+struct bud_json_stream_s {
+  bud_json_stream_state_t state;
+  int depth;
+  int expect_key;
+  int escape;
+
+  /* Key of the current top-level member, `key_len` > MAX_KEY - not ours */
+  char key[BUD_JSON_STREAM_MAX_KEY];
+  size_t key_len;
+  int in_key;
+  bud_json_field_t* match;
+  bud_json_field_t* capture;
+  int capture_array;
+
+  /* `\uXXXX` escape: digits left, code unit and pending high surrogate */
+  int hex_left;
+  unsigned int hex;
+  unsigned int high;
+
+  bud_json_field_t fields[BUD_JSON_STREAM_MAX_FIELDS];
+  int field_count;
+  char* rest;
+  size_t rest_size;
+  size_t rest_cap;
+
+  /* Values are raw DER, not base64 or PEM (see lookup.h) */
+  int der;
+};
+
+/* `fields` is a NULL-terminated list, should outlive the stream */
+void bud_json_stream_init(bud_json_stream_t* stream,
+                          const char* const* fields);
+void bud_json_stream_destroy(bud_json_stream_t* stream);
+bud_error_t bud_json_stream_write(bud_json_stream_t* stream,
+                                  const char* data,
+                                  size_t size);
+
+/* Whole value is in, returns NUL-terminated `rest` (owned by the stream) */
+bud_error_t bud_json_stream_end(bud_json_stream_t* stream, const char** rest);
+
+/* Number of captured values of `name`, 0 - missing or not a string(s) */
+int bud_json_stream_count(bud_json_stream_t* stream, const char* name);
+
+/* Adds a value to `name` as if it came in the body (e.g. from disk cache) */
+bud_error_t bud_json_stream_add(bud_json_stream_t* stream,
+                                const char* name,
+                                const char* value,
+                                size_t len);
+
+/* `index`-th value of `name`, NUL-terminated */
+const char* bud_json_stream_value(bud_json_stream_t* stream,
+                                  const char* name,
+                                  int index,
+                                  size_t* len);
+
+#endif  /* SRC_JSON_STREAM_H_ */
@@ -1,16 +1,40 @@
+#include <stdio.h>  /* fprintf, snprintf, vsnprintf */
 #include <stdlib.h>  /* calloc, free */
 #include <string.h>  /* strcmp */
+#include <time.h>  /* time */
 #ifndef _WIN32
 #include <syslog.h>
 #endif  /* !_WIN32 */
 #include <unistd.h>  /* getpid */
 
+#include "uv.h"
+
 #include "error.h"
 #include "common.h"
 #include "config.h"
 #include "logger.h"
 
 static const char* bud_log_level_str(bud_log_level_t level);
+static void bud_logger_enqueue(bud_logger_t* logger,
+                               bud_log_level_t level,
+                               const char* fmt,
+                               va_list ap);
+static void bud_logger_writer(void* arg);
+static void bud_logger_write(bud_logger_t* logger,
+                             bud_log_level_t level,
+                             const char* text);
+static void bud_logger_emit(bud_logger_t* logger,
+                            bud_log_level_t level,
+                            const char* fmt,
+                            va_list ap);
+static void bud_logger_emitf(bud_logger_t* logger,
+                             bud_log_level_t level,
+                             const char* fmt,
+                             ...);
+static int bud_logger_limited(bud_logger_t* logger,
+                              bud_log_level_t level,
+                              const char* fmt);
+static void bud_logger_site_flush(bud_logger_t* logger, bud_log_site_t* site);
 
 
 bud_error_t bud_logger_new(bud_config_t* config) {
@@ -19,18 +43,11 @@ bud_error_t bud_logger_new(bud_config_t* config) {
 #endif  /* !_WIN32 */
 
   config->logger = calloc(1, sizeof(*config->logger));
-  if (strcmp(config->log.level, "debug") == 0)
-    config->logger->level = kBudLogDebug;
-  else if (strcmp(config->log.level, "notice") == 0)
-    config->logger->level = kBudLogNotice;
-  else if (strcmp(config->log.level, "fatal") == 0)
-    config->logger->level = kBudLogFatal;
-  else if (strcmp(config->log.level, "warning") == 0)
-    config->logger->level = kBudLogWarning;
-  else
+  if (bud_logger_set_level(config->logger, config->log.level) != 0)
     config->logger->level = kBudLogInfo;
   config->logger->stdio_enabled = config->log.stdio;
   config->logger->syslog_enabled = config->log.syslog;
+  config->logger->limit = config->log.limit > 0 ? config->log.limit : 0;
 
 #ifndef _WIN32
   if (config->logger->syslog_enabled) {
@@ -74,14 +91,82 @@ bud_error_t bud_logger_new(bud_config_t* config) {
   }
 #endif  /* !_WIN32 */
 
+  /* Daemon master starts it after fork(), see bud_master() */
+  if (config->is_daemon && !config->is_worker)
+    return bud_ok();
+  return bud_logger_start(config);
+}
+
+
+bud_error_t bud_logger_start(bud_config_t* config) {
+  int r;
+  bud_logger_t* logger;
+
+  logger = config->logger;
+  if (!config->log.async || logger->async)
+    return bud_ok();
+  if (!logger->stdio_enabled && !logger->syslog_enabled)
+    return bud_ok();
+  if (config->log.queue <= 0)
+    return bud_ok();
+
+  logger->size = config->log.queue;
+  logger->lines = calloc(logger->size, sizeof(*logger->lines));
+  if (logger->lines == NULL)
+    return bud_error_str(kBudErrNoMem, "log lines");
+
+  r = uv_sem_init(&logger->sem, 0);
+  if (r != 0)
+    goto fatal;
+
+  r = uv_thread_create(&logger->thread, bud_logger_writer, logger);
+  if (r != 0) {
+    uv_sem_destroy(&logger->sem);
+    goto fatal;
+  }
+
+  logger->async = 1;
   return bud_ok();
+
+fatal:
+  free(logger->lines);
+  logger->lines = NULL;
+  return bud_error_num(kBudErrLoggerThread, r);
 }
 
 
 void bud_logger_free(bud_config_t* config) {
-  if (config->logger == NULL)
+  bud_logger_t* logger;
+  char buf[64];
+  int i;
+
+  logger = config->logger;
+  if (logger == NULL)
     return;
 
+  /* Counts of the last storm, before the queue is drained */
+  for (i = 0; i < BUD_LOG_SITES; i++)
+    bud_logger_site_flush(logger, &logger->sites[i]);
+
+  /* Write out everything that is queued */
+  if (logger->async) {
+    logger->stop = 1;
+    uv_sem_post(&logger->sem);
+    uv_thread_join(&logger->thread);
+    uv_sem_destroy(&logger->sem);
+    free(logger->lines);
+    logger->lines = NULL;
+    logger->async = 0;
+
+    if (logger->dropped != 0) {
+      snprintf(buf,
+               sizeof(buf),
+               "%llu log lines dropped in total",
+               (unsigned long long) logger->dropped);
+      bud_logger_write(logger, kBudLogWarning, buf);
+    }
+  }
+
 #ifndef _WIN32
   if (config->logger->syslog_enabled)
     closelog();
@@ -91,18 +176,28 @@ void bud_logger_free(bud_config_t* config) {
 }
 
 
+int bud_logger_set_level(bud_logger_t* logger, const char* level) {
+  if (strcmp(level, "debug") == 0)
+    logger->level = kBudLogDebug;
+  else if (strcmp(level, "notice") == 0)
+    logger->level = kBudLogNotice;
+  else if (strcmp(level, "info") == 0)
+    logger->level = kBudLogInfo;
+  else if (strcmp(level, "warning") == 0)
+    logger->level = kBudLogWarning;
+  else if (strcmp(level, "fatal") == 0)
+    logger->level = kBudLogFatal;
+  else
+    return -1;
+  return 0;
+}
+
+
 void bud_logva(bud_config_t* config,
                bud_log_level_t level,
                const char* fmt,
                va_list ap) {
-  va_list stdio_ap;
-  va_list syslog_ap;
   bud_logger_t* logger;
-  int r;
-  static char buf[1024];
-#ifndef _WIN32
-  int priority;
-#endif  /* !_WIN32 */
 
   logger = config->logger;
   ASSERT(logger != NULL, "Logger not initalized");
@@ -110,12 +205,175 @@ void bud_logva(bud_config_t* config,
   /* Ignore low-level logging */
   if (logger->level > level)
     return;
+  if (!logger->stdio_enabled && !logger->syslog_enabled)
+    return;
 
-  if (logger->stdio_enabled) {
-    va_copy(stdio_ap, ap);
-    r = vsnprintf(buf, sizeof(buf), fmt, stdio_ap);
-    ASSERT(r < (int) sizeof(buf), "Log line overflow");
+  /* Same failure on every connection, before it is even formatted */
+  if (logger->limit != 0 && bud_logger_limited(logger, level, fmt))
+    return;
+
+  bud_logger_emit(logger, level, fmt, ap);
+}
 
+
+void bud_logger_emit(bud_logger_t* logger,
+                     bud_log_level_t level,
+                     const char* fmt,
+                     va_list ap) {
+  int r;
+  char buf[BUD_LOG_LINE_SIZE];
+
+  if (logger->async)
+    return bud_logger_enqueue(logger, level, fmt, ap);
+
+  r = vsnprintf(buf, sizeof(buf), fmt, ap);
+  ASSERT(r < (int) sizeof(buf), "Log line overflow");
+  bud_logger_write(logger, level, buf);
+}
+
+
+void bud_logger_emitf(bud_logger_t* logger,
+                      bud_log_level_t level,
+                      const char* fmt,
+                      ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  bud_logger_emit(logger, level, fmt, ap);
+  va_end(ap);
+}
+
+
+int bud_logger_limited(bud_logger_t* logger,
+                       bud_log_level_t level,
+                       const char* fmt) {
+  bud_log_site_t* site;
+  uintptr_t hash;
+  time_t now;
+
+  /* Info lines are access logs and traces, one per connection by design */
+  if (level != kBudLogNotice && level != kBudLogWarning)
+    return 0;
+
+  /* Format strings are literals, the address tells the call site */
+  hash = (uintptr_t) fmt;
+  hash ^= hash >> 12;
+  site = &logger->sites[(hash ^ level) % BUD_LOG_SITES];
+  now = time(NULL);
+
+  if (site->fmt != fmt || site->level != level) {
+    bud_logger_site_flush(logger, site);
+    site->fmt = fmt;
+    site->level = level;
+    site->second = now;
+    site->count = 0;
+  } else if (site->second != now) {
+    bud_logger_site_flush(logger, site);
+    site->second = now;
+    site->count = 0;
+  }
+
+  if (++site->count <= logger->limit)
+    return 0;
+  site->suppressed++;
+  return 1;
+}
+
+
+void bud_logger_site_flush(bud_logger_t* logger, bud_log_site_t* site) {
+  if (site->suppressed == 0)
+    return;
+
+  bud_logger_emitf(logger,
+                   site->level,
+                   "suppressed %llu similar messages: \"%.256s\"",
+                   (unsigned long long) site->suppressed,
+                   site->fmt);
+  site->suppressed = 0;
+}
+
+
+void bud_logger_enqueue(bud_logger_t* logger,
+                        bud_log_level_t level,
+                        const char* fmt,
+                        va_list ap) {
+  unsigned int head;
+  unsigned int used;
+  bud_log_line_t* line;
+  int r;
+
+  head = logger->head;
+  used = head - logger->tail;
+
+  /* Report the loss, once there is room for it and the line itself */
+  if (logger->dropped != logger->dropped_reported) {
+    if (used + 2 > logger->size) {
+      logger->dropped++;
+      return;
+    }
+
+    line = &logger->lines[head % logger->size];
+    line->level = kBudLogWarning;
+    snprintf(line->text,
+             sizeof(line->text),
+             "%llu log lines dropped",
+             (unsigned long long) (logger->dropped -
+                                   logger->dropped_reported));
+    logger->dropped_reported = logger->dropped;
+    head++;
+    used++;
+  }
+
+  if (used >= logger->size) {
+    logger->dropped++;
+    return;
+  }
+
+  line = &logger->lines[head % logger->size];
+  line->level = level;
+  r = vsnprintf(line->text, sizeof(line->text), fmt, ap);
+  ASSERT(r < (int) sizeof(line->text), "Log line overflow");
+  head++;
+
+  /* Lines must be complete before writer sees them */
+  __sync_synchronize();
+  logger->head = head;
+  uv_sem_post(&logger->sem);
+}
+
+
+void bud_logger_writer(void* arg) {
+  bud_logger_t* logger;
+  bud_log_line_t* line;
+
+  logger = arg;
+  for (;;) {
+    uv_sem_wait(&logger->sem);
+
+    while (logger->tail != logger->head) {
+      __sync_synchronize();
+      line = &logger->lines[logger->tail % logger->size];
+      bud_logger_write(logger, line->level, line->text);
+
+      /* Slot may be reused once `tail` moves past it */
+      __sync_synchronize();
+      logger->tail++;
+    }
+
+    if (logger->stop)
+      break;
+  }
+}
+
+
+void bud_logger_write(bud_logger_t* logger,
+                      bud_log_level_t level,
+                      const char* text) {
+#ifndef _WIN32
+  int priority;
+#endif  /* !_WIN32 */
+
+  if (logger->stdio_enabled) {
     fprintf(stderr,
             "(%s) [%d] %s\n",
             bud_log_level_str(level),
@@ -124,13 +382,11 @@ void bud_logva(bud_config_t* config,
 #else
             0,
 #endif  /* !_WIN32 */
-            buf);
-    va_end(stdio_ap);
+            text);
   }
 
 #ifndef _WIN32
   if (logger->syslog_enabled) {
-    va_copy(syslog_ap, ap);
     switch (level) {
       case kBudLogDebug:
         priority = LOG_DEBUG;
@@ -149,12 +405,12 @@ void bud_logva(bud_config_t* config,
         priority = LOG_WARNING;
         break;
     }
-    vsyslog(priority, fmt, syslog_ap);
-    va_end(syslog_ap);
+    syslog(priority, "%s", text);
   }
 #endif  /* !_WIN32 */
 }
 
+
 void bud_log(bud_config_t* config,
              bud_log_level_t level,
              const char* fmt,
@@ -1,11 +1,23 @@
 #ifndef SRC_LOGGER_H_
 #define SRC_LOGGER_H_
 
+#include <stdint.h>  /* uint64_t */
+#include <time.h>  /* time_t */
+
+#include "uv.h"
+
 #include "error.h"
 #include "config.h"
 
+#define BUD_LOG_LINE_SIZE 1024
+
+/* Call sites tracked by `log.limit`, colliding ones evict each other */
+#define BUD_LOG_SITES 256
+
 typedef enum bud_log_level_e bud_log_level_t;
 typedef struct bud_logger_s bud_logger_t;
+typedef struct bud_log_line_s bud_log_line_t;
+typedef struct bud_log_site_s bud_log_site_t;
 
 enum bud_log_level_e {
   kBudLogDebug = 0,
@@ -15,15 +27,62 @@ enum bud_log_level_e {
   kBudLogFatal = 4
 };
 
+struct bud_log_line_s {
+  bud_log_level_t level;
+  char text[BUD_LOG_LINE_SIZE];
+};
+
+/* Lines of one format string and level in the current second */
+struct bud_log_site_s {
+  const char* fmt;
+  bud_log_level_t level;
+  time_t second;
+  unsigned int count;
+  uint64_t suppressed;
+};
+
 struct bud_logger_s {
   bud_log_level_t level;
   int stdio_enabled;
   int syslog_enabled;
+
+  /*
+   * `log.limit`: notice and warning lines per second of each call site
+   * (format string), 0 - unlimited. The rest are counted and reported by
+   * one line once the site logs again in a later second, or on exit.
+   */
+  unsigned int limit;
+  bud_log_site_t sites[BUD_LOG_SITES];
+
+  /*
+   * `log.async`: lines are formatted on the loop and written by a thread.
+   * Single producer ring, `head` is advanced by the loop, `tail` by the
+   * writer. Full ring drops lines instead of blocking the loop.
+   */
+  int async;
+  bud_log_line_t* lines;
+  unsigned int size;
+  volatile unsigned int head;
+  volatile unsigned int tail;
+  uint64_t dropped;
+  uint64_t dropped_reported;
+  uv_thread_t thread;
+  uv_sem_t sem;
+  volatile int stop;
 };
 
 bud_error_t bud_logger_new(bud_config_t* config);
 void bud_logger_free(bud_config_t* logger);
 
+/* "debug", "notice", "info", "warning" or "fatal", -1 - unknown level */
+int bud_logger_set_level(bud_logger_t* logger, const char* level);
+
+/*
+ * Start the writer thread of `log.async`, threads do not survive `fork()`
+ * so daemon master calls it on its own after daemonizing
+ */
+bud_error_t bud_logger_start(bud_config_t* config);
+
 void bud_log(bud_config_t* config, bud_log_level_t level, const char* fmt, ...);
 void bud_logva(bud_config_t* config,
                bud_log_level_t level,
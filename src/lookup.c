@@ -0,0 +1,874 @@
+#include <netdb.h>  /* getaddrinfo, freeaddrinfo */
+#include <stdint.h>  /* int32_t, uint32_t */
+#include <stdlib.h>  /* calloc, malloc, realloc, free */
+#include <string.h>  /* memcpy, memmove, memset, strlen */
+
+#include "uv.h"
+#include "parson.h"
+
+#include "lookup.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "json-stream.h"
+#include "logger.h"
+#include "queue.h"
+#include "sni.h"
+
+/* Reconnect delay if the section has no `backoff` */
+#define BUD_LOOKUP_RETRY 1000
+
+/* Free space asked for on each read, and buffer kept between the frames */
+#define BUD_LOOKUP_READ_SIZE 16384
+#define BUD_LOOKUP_KEEP_BUF 65536
+
+typedef struct bud_lookup_record_s bud_lookup_record_t;
+
+struct bud_lookup_record_s {
+  bud_lookup_tag_t tag;
+  const char* data;
+  size_t len;
+};
+
+/* Stapling responses carry just the staple, SNI ones use `bud_sni_extract` */
+static const char* const bud_lookup_stapling_extract[] = { "ocsp", NULL };
+
+static bud_error_t bud_lookup_resolve(bud_lookup_t* lookup);
+static void bud_lookup_connect(bud_lookup_t* lookup);
+static void bud_lookup_connect_cb(uv_connect_t* req, int status);
+static void bud_lookup_retry_cb(uv_timer_t* timer, int status);
+static void bud_lookup_close(bud_lookup_t* lookup, bud_error_t err);
+static void bud_lookup_backoff(bud_lookup_t* lookup);
+static void bud_lookup_close_cb(uv_handle_t* handle);
+static void bud_lookup_timer_close_cb(uv_handle_t* handle);
+static void bud_lookup_unref(bud_lookup_t* lookup);
+static void bud_lookup_arm(bud_lookup_t* lookup);
+static void bud_lookup_timer_cb(uv_timer_t* timer, int status);
+static void bud_lookup_expire(bud_lookup_t* lookup, QUEUE* queue, uint64_t now);
+static void bud_lookup_fail_all(bud_lookup_t* lookup,
+                                QUEUE* queue,
+                                bud_error_t err);
+static bud_lookup_req_t* bud_lookup_request(bud_lookup_t* lookup,
+                                            bud_lookup_type_t type,
+                                            bud_lookup_record_t* records,
+                                            int count,
+                                            bud_lookup_cb cb,
+                                            bud_error_t* err);
+static bud_error_t bud_lookup_write(bud_lookup_t* lookup,
+                                    bud_lookup_req_t* req);
+static void bud_lookup_write_cb(uv_write_t* req, int status);
+static void bud_lookup_alloc_cb(uv_handle_t* handle,
+                                size_t suggested_size,
+                                uv_buf_t* buf);
+static void bud_lookup_read_cb(uv_stream_t* stream,
+                               ssize_t nread,
+                               const uv_buf_t* buf);
+static void bud_lookup_parse(bud_lookup_t* lookup);
+static bud_error_t bud_lookup_reply(bud_lookup_t* lookup,
+                                    const char* frame,
+                                    size_t size);
+static bud_error_t bud_lookup_records(bud_lookup_req_t* req,
+                                      const char* data,
+                                      size_t size);
+static const char* bud_lookup_tag_name(bud_lookup_req_t* req,
+                                       bud_lookup_tag_t tag);
+static bud_lookup_req_t* bud_lookup_find(bud_lookup_t* lookup, uint32_t id);
+static void bud_lookup_req_unlink(bud_lookup_req_t* req);
+static void bud_lookup_req_free(bud_lookup_req_t* req);
+static uint32_t bud_lookup_read32(const char* p);
+static void bud_lookup_write32(char* p, uint32_t value);
+
+
+bud_lookup_t* bud_lookup_new(bud_config_t* config,
+                             bud_config_http_pool_t* conf,
+                             bud_error_t* err) {
+  bud_lookup_t* lookup;
+  size_t host_len;
+  int r;
+
+  lookup = calloc(1, sizeof(*lookup));
+  if (lookup == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_lookup_t");
+    goto fatal;
+  }
+
+  host_len = strlen(conf->host);
+  lookup->host = malloc(host_len + 1);
+  if (lookup->host == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_lookup_t host");
+    goto failed_malloc_host;
+  }
+  memcpy(lookup->host, conf->host, host_len + 1);
+
+  lookup->config = config;
+  lookup->port = conf->port;
+  lookup->is_pipe = BUD_HOST_IS_PIPE(lookup->host);
+  lookup->state = kBudLookupDisconnected;
+  lookup->timeout = conf->timeout;
+  lookup->backoff = conf->backoff != 0 ? conf->backoff : BUD_LOOKUP_RETRY;
+  lookup->max_backoff = conf->max_backoff;
+  lookup->next_id = 1;
+  QUEUE_INIT(&lookup->pending);
+  QUEUE_INIT(&lookup->inflight);
+
+  if (!lookup->is_pipe) {
+    *err = bud_lookup_resolve(lookup);
+    if (!bud_is_ok(*err))
+      goto failed_resolve;
+  }
+
+  r = uv_timer_init(config->loop, &lookup->timer);
+  if (r != 0) {
+    *err = bud_error_num(kBudErrLookupTimer, r);
+    goto failed_resolve;
+  }
+  lookup->timer.data = lookup;
+  uv_unref((uv_handle_t*) &lookup->timer);
+
+  r = uv_timer_init(config->loop, &lookup->retry_timer);
+  if (r != 0) {
+    *err = bud_error_num(kBudErrLookupTimer, r);
+    goto failed_retry_timer_init;
+  }
+  lookup->retry_timer.data = lookup;
+  uv_unref((uv_handle_t*) &lookup->retry_timer);
+
+  /* Failure to connect is retried, lookups are failed meanwhile */
+  bud_lookup_connect(lookup);
+
+  *err = bud_ok();
+  return lookup;
+
+failed_retry_timer_init:
+  /* Freed in close_cb */
+  lookup->closing = 1;
+  lookup->refs = 1;
+  uv_close((uv_handle_t*) &lookup->timer, bud_lookup_timer_close_cb);
+  return NULL;
+
+failed_resolve:
+  free(lookup->host);
+
+failed_malloc_host:
+  free(lookup);
+
+fatal:
+  return NULL;
+}
+
+
+bud_error_t bud_lookup_resolve(bud_lookup_t* lookup) {
+  struct addrinfo hints;
+  struct addrinfo* res;
+  int r;
+
+  if (bud_config_str_to_addr(lookup->host,
+                             lookup->port,
+                             &lookup->addr) == 0) {
+    return bud_ok();
+  }
+
+  /* Just once, the connection is long-lived */
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  r = getaddrinfo(lookup->host, NULL, &hints, &res);
+  if (r != 0)
+    return bud_error_str(kBudErrHttpResolve, lookup->host);
+
+  memset(&lookup->addr, 0, sizeof(lookup->addr));
+  memcpy(&lookup->addr, res->ai_addr, res->ai_addrlen);
+  if (res->ai_family == AF_INET)
+    ((struct sockaddr_in*) &lookup->addr)->sin_port = htons(lookup->port);
+  else
+    ((struct sockaddr_in6*) &lookup->addr)->sin6_port = htons(lookup->port);
+  freeaddrinfo(res);
+
+  return bud_ok();
+}
+
+
+void bud_lookup_free(bud_lookup_t* lookup) {
+  /* Nobody waits for these anymore */
+  lookup->closing = 1;
+  bud_lookup_fail_all(lookup, &lookup->inflight, bud_ok());
+  bud_lookup_fail_all(lookup, &lookup->pending, bud_ok());
+
+  /* Freed once the timers and the connection are closed */
+  lookup->refs = 2;
+  uv_timer_stop(&lookup->timer);
+  uv_timer_stop(&lookup->retry_timer);
+  uv_close((uv_handle_t*) &lookup->timer, bud_lookup_timer_close_cb);
+  uv_close((uv_handle_t*) &lookup->retry_timer, bud_lookup_timer_close_cb);
+
+  if (lookup->state == kBudLookupDisconnected)
+    return;
+  lookup->refs++;
+  if (lookup->state != kBudLookupClosing) {
+    lookup->state = kBudLookupClosing;
+    uv_close((uv_handle_t*) &lookup->tcp, bud_lookup_close_cb);
+  }
+}
+
+
+void bud_lookup_connect(bud_lookup_t* lookup) {
+  int r;
+
+  if (lookup->is_pipe)
+    r = uv_pipe_init(lookup->config->loop, &lookup->pipe, 0);
+  else
+    r = uv_tcp_init(lookup->config->loop, &lookup->tcp);
+  if (r != 0) {
+    /* Nothing to close, just try again later */
+    bud_lookup_backoff(lookup);
+    uv_timer_start(&lookup->retry_timer,
+                   bud_lookup_retry_cb,
+                   lookup->down_backoff,
+                   0);
+    return;
+  }
+  lookup->tcp.data = lookup;
+  lookup->state = kBudLookupConnecting;
+
+  /* Errors are reported to the callback */
+  if (lookup->is_pipe) {
+    uv_pipe_connect(&lookup->connect,
+                    &lookup->pipe,
+                    lookup->host,
+                    bud_lookup_connect_cb);
+    return;
+  }
+
+  r = uv_tcp_connect(&lookup->connect,
+                     &lookup->tcp,
+                     (struct sockaddr*) &lookup->addr,
+                     bud_lookup_connect_cb);
+  if (r != 0)
+    bud_lookup_close(lookup, bud_error_num(kBudErrLookupConnect, r));
+}
+
+
+void bud_lookup_connect_cb(uv_connect_t* req, int status) {
+  bud_lookup_t* lookup;
+  QUEUE* q;
+  bud_error_t err;
+  int r;
+
+  /* Closed meanwhile */
+  if (status == UV_ECANCELED)
+    return;
+
+  lookup = container_of(req, bud_lookup_t, connect);
+  if (status != 0) {
+    bud_lookup_close(lookup, bud_error_num(kBudErrLookupConnect, status));
+    return;
+  }
+
+  r = uv_read_start((uv_stream_t*) &lookup->tcp,
+                    bud_lookup_alloc_cb,
+                    bud_lookup_read_cb);
+  if (r != 0) {
+    bud_lookup_close(lookup, bud_error_num(kBudErrLookupRead, r));
+    return;
+  }
+
+  if (lookup->down_backoff != 0) {
+    bud_log(lookup->config,
+            kBudLogInfo,
+            "lookup backend %s:%d is up again",
+            lookup->host,
+            (int) lookup->port);
+  }
+  lookup->state = kBudLookupConnected;
+  lookup->down_backoff = 0;
+
+  /* Queued while connecting, in order */
+  while (!QUEUE_EMPTY(&lookup->pending)) {
+    q = QUEUE_HEAD(&lookup->pending);
+    err = bud_lookup_write(lookup, QUEUE_DATA(q, bud_lookup_req_t, member));
+    if (!bud_is_ok(err)) {
+      bud_lookup_close(lookup, err);
+      return;
+    }
+  }
+}
+
+
+void bud_lookup_retry_cb(uv_timer_t* timer, int status) {
+  bud_lookup_connect(timer->data);
+}
+
+
+void bud_lookup_close(bud_lookup_t* lookup, bud_error_t err) {
+  if (lookup->state == kBudLookupDisconnected ||
+      lookup->state == kBudLookupClosing) {
+    return;
+  }
+
+  lookup->state = kBudLookupClosing;
+  lookup->len = 0;
+  uv_close((uv_handle_t*) &lookup->tcp, bud_lookup_close_cb);
+  bud_lookup_backoff(lookup);
+
+  /* Answers to the sent ones are lost with the connection */
+  bud_lookup_fail_all(lookup, &lookup->inflight, err);
+  bud_lookup_fail_all(lookup, &lookup->pending, err);
+}
+
+
+void bud_lookup_backoff(bud_lookup_t* lookup) {
+  /* First time, or the reconnect has failed too */
+  if (lookup->down_backoff == 0)
+    lookup->down_backoff = lookup->backoff;
+  else
+    lookup->down_backoff *= 2;
+  if (lookup->max_backoff != 0 && lookup->down_backoff > lookup->max_backoff)
+    lookup->down_backoff = lookup->max_backoff;
+
+  bud_log(lookup->config,
+          kBudLogWarning,
+          "lookup backend %s:%d is down, next try in %d ms",
+          lookup->host,
+          (int) lookup->port,
+          (int) lookup->down_backoff);
+}
+
+
+void bud_lookup_close_cb(uv_handle_t* handle) {
+  bud_lookup_t* lookup;
+
+  lookup = handle->data;
+  lookup->state = kBudLookupDisconnected;
+  if (lookup->closing) {
+    bud_lookup_unref(lookup);
+    return;
+  }
+
+  uv_timer_start(&lookup->retry_timer,
+                 bud_lookup_retry_cb,
+                 lookup->down_backoff,
+                 0);
+}
+
+
+void bud_lookup_timer_close_cb(uv_handle_t* handle) {
+  bud_lookup_unref(handle->data);
+}
+
+
+void bud_lookup_unref(bud_lookup_t* lookup) {
+  if (--lookup->refs != 0)
+    return;
+
+  free(lookup->buf);
+  free(lookup->host);
+  free(lookup);
+}
+
+
+void bud_lookup_arm(bud_lookup_t* lookup) {
+  uint64_t interval;
+
+  if (lookup->timeout == 0 || uv_is_active((uv_handle_t*) &lookup->timer))
+    return;
+
+  /* Check a few times per timeout */
+  interval = lookup->timeout / 4;
+  if (interval < BUD_LOOKUP_TIMER_MIN)
+    interval = BUD_LOOKUP_TIMER_MIN;
+  uv_timer_start(&lookup->timer, bud_lookup_timer_cb, interval, interval);
+}
+
+
+void bud_lookup_timer_cb(uv_timer_t* timer, int status) {
+  bud_lookup_t* lookup;
+  uint64_t now;
+
+  lookup = timer->data;
+  now = uv_now(lookup->config->loop);
+
+  /* Late answers are skipped, other lookups go on on the same connection */
+  bud_lookup_expire(lookup, &lookup->pending, now);
+  bud_lookup_expire(lookup, &lookup->inflight, now);
+
+  if (QUEUE_EMPTY(&lookup->pending) && QUEUE_EMPTY(&lookup->inflight))
+    uv_timer_stop(&lookup->timer);
+}
+
+
+void bud_lookup_expire(bud_lookup_t* lookup, QUEUE* queue, uint64_t now) {
+  QUEUE* q;
+  bud_lookup_req_t* req;
+
+  /* All share the timeout, so the oldest ones are at the head */
+  while (!QUEUE_EMPTY(queue)) {
+    q = QUEUE_HEAD(queue);
+    req = QUEUE_DATA(q, bud_lookup_req_t, member);
+    if (req->deadline > now)
+      break;
+
+    bud_lookup_req_unlink(req);
+    req->cb(req, bud_error_str(kBudErrHttpTimeout, lookup->host));
+    bud_lookup_req_free(req);
+  }
+}
+
+
+void bud_lookup_fail_all(bud_lookup_t* lookup,
+                         QUEUE* queue,
+                         bud_error_t err) {
+  QUEUE* q;
+  bud_lookup_req_t* req;
+
+  while (!QUEUE_EMPTY(queue)) {
+    q = QUEUE_HEAD(queue);
+    req = QUEUE_DATA(q, bud_lookup_req_t, member);
+    bud_lookup_req_unlink(req);
+    if (!lookup->closing)
+      req->cb(req, err);
+    bud_lookup_req_free(req);
+  }
+}
+
+
+bud_lookup_req_t* bud_lookup_sni(bud_lookup_t* lookup,
+                                 const char* servername,
+                                 size_t servername_len,
+                                 bud_lookup_cb cb,
+                                 bud_error_t* err) {
+  bud_lookup_record_t record;
+
+  record.tag = kBudLookupTagName;
+  record.data = servername;
+  record.len = servername_len;
+  return bud_lookup_request(lookup, kBudLookupSNI, &record, 1, cb, err);
+}
+
+
+bud_lookup_req_t* bud_lookup_stapling(bud_lookup_t* lookup,
+                                      const char* id,
+                                      size_t id_size,
+                                      const char* url,
+                                      size_t url_size,
+                                      const char* ocsp,
+                                      size_t ocsp_size,
+                                      bud_lookup_cb cb,
+                                      bud_error_t* err) {
+  bud_lookup_record_t records[3];
+  int count;
+
+  count = 0;
+  records[count].tag = kBudLookupTagName;
+  records[count].data = id;
+  records[count++].len = id_size;
+  if (url != NULL && ocsp != NULL) {
+    records[count].tag = kBudLookupTagOCSPUrl;
+    records[count].data = url;
+    records[count++].len = url_size;
+    records[count].tag = kBudLookupTagOCSPRequest;
+    records[count].data = ocsp;
+    records[count++].len = ocsp_size;
+  }
+  return bud_lookup_request(lookup,
+                            kBudLookupStapling,
+                            records,
+                            count,
+                            cb,
+                            err);
+}
+
+
+bud_lookup_req_t* bud_lookup_request(bud_lookup_t* lookup,
+                                     bud_lookup_type_t type,
+                                     bud_lookup_record_t* records,
+                                     int count,
+                                     bud_lookup_cb cb,
+                                     bud_error_t* err) {
+  bud_lookup_req_t* req;
+  bud_lookup_req_t** bucket;
+  bud_lookup_write_t* w;
+  size_t size;
+  char* p;
+  int i;
+
+  /* Connection is lost, don't wait for the next one */
+  if (lookup->state == kBudLookupDisconnected ||
+      lookup->state == kBudLookupClosing) {
+    *err = bud_error_str(kBudErrHttpDown, lookup->host);
+    goto fatal;
+  }
+
+  req = malloc(sizeof(*req));
+  if (req == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_lookup_req_t");
+    goto fatal;
+  }
+
+  size = BUD_LOOKUP_HEADER_SIZE;
+  for (i = 0; i < count; i++)
+    size += BUD_LOOKUP_RECORD_SIZE + records[i].len;
+  w = malloc(sizeof(*w) + size);
+  if (w == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_lookup_write_t");
+    goto failed_malloc_write;
+  }
+  w->size = size;
+
+  req->config = lookup->config;
+  req->lookup = lookup;
+  req->id = lookup->next_id++;
+  req->type = type;
+  req->write = w;
+  req->deadline = 0;
+  if (lookup->timeout != 0)
+    req->deadline = uv_now(lookup->config->loop) + lookup->timeout;
+  req->cb = cb;
+  req->data = NULL;
+  req->code = 0;
+  req->max_age = -1;
+  req->stale = -1;
+  req->response = NULL;
+  bud_json_stream_init(&req->stream,
+                       type == kBudLookupSNI ? bud_sni_extract :
+                                               bud_lookup_stapling_extract);
+
+  /* Length of the rest, id, type, then the records */
+  p = w->data;
+  bud_lookup_write32(p, size - 4);
+  bud_lookup_write32(p + 4, req->id);
+  p[8] = (char) type;
+  p += BUD_LOOKUP_HEADER_SIZE;
+  for (i = 0; i < count; i++) {
+    p[0] = (char) records[i].tag;
+    bud_lookup_write32(p + 1, records[i].len);
+    memcpy(p + BUD_LOOKUP_RECORD_SIZE, records[i].data, records[i].len);
+    p += BUD_LOOKUP_RECORD_SIZE + records[i].len;
+  }
+
+  bucket = &lookup->buckets[req->id % BUD_LOOKUP_BUCKETS];
+  req->next = *bucket;
+  *bucket = req;
+  QUEUE_INSERT_TAIL(&lookup->pending, &req->member);
+
+  /* Written from connect_cb otherwise */
+  if (lookup->state == kBudLookupConnected) {
+    *err = bud_lookup_write(lookup, req);
+    if (!bud_is_ok(*err))
+      goto failed_write;
+  }
+
+  bud_lookup_arm(lookup);
+  *err = bud_ok();
+  return req;
+
+failed_write:
+  /* Fail without calling cb, but do report to the others */
+  bud_lookup_req_unlink(req);
+  bud_lookup_req_free(req);
+  bud_lookup_close(lookup, *err);
+  return NULL;
+
+failed_malloc_write:
+  free(req);
+
+fatal:
+  return NULL;
+}
+
+
+bud_error_t bud_lookup_write(bud_lookup_t* lookup, bud_lookup_req_t* req) {
+  bud_lookup_write_t* w;
+  uv_buf_t buf;
+  int r;
+
+  /* Answer may come in any order, the queue is only for the deadlines */
+  w = req->write;
+  req->write = NULL;
+  QUEUE_REMOVE(&req->member);
+  QUEUE_INSERT_TAIL(&lookup->inflight, &req->member);
+
+  buf = uv_buf_init(w->data, w->size);
+  r = uv_write(&w->req,
+               (uv_stream_t*) &lookup->tcp,
+               &buf,
+               1,
+               bud_lookup_write_cb);
+  if (r != 0) {
+    free(w);
+    return bud_error_num(kBudErrLookupWrite, r);
+  }
+
+  return bud_ok();
+}
+
+
+void bud_lookup_write_cb(uv_write_t* req, int status) {
+  bud_lookup_write_t* w;
+  bud_lookup_t* lookup;
+
+  /* Frame isn't needed anymore, even if the request is still in flight */
+  w = container_of(req, bud_lookup_write_t, req);
+  lookup = req->handle->data;
+  free(w);
+
+  if (status == UV_ECANCELED)
+    return;
+  if (status != 0)
+    bud_lookup_close(lookup, bud_error_num(kBudErrLookupWrite, status));
+}
+
+
+void bud_lookup_alloc_cb(uv_handle_t* handle,
+                         size_t suggested_size,
+                         uv_buf_t* buf) {
+  bud_lookup_t* lookup;
+  size_t cap;
+  char* p;
+
+  lookup = handle->data;
+
+  /* NULL on OOM, `read_cb` is called with `UV_ENOBUFS` then */
+  if (lookup->cap - lookup->len < BUD_LOOKUP_READ_SIZE) {
+    cap = lookup->cap * 2;
+    if (cap < lookup->len + BUD_LOOKUP_READ_SIZE)
+      cap = lookup->len + BUD_LOOKUP_READ_SIZE;
+    p = realloc(lookup->buf, cap);
+    if (p == NULL) {
+      *buf = uv_buf_init(NULL, 0);
+      return;
+    }
+    lookup->buf = p;
+    lookup->cap = cap;
+  }
+
+  *buf = uv_buf_init(lookup->buf + lookup->len, lookup->cap - lookup->len);
+}
+
+
+void bud_lookup_read_cb(uv_stream_t* stream,
+                        ssize_t nread,
+                        const uv_buf_t* buf) {
+  bud_lookup_t* lookup;
+
+  lookup = stream->data;
+  if (nread == 0)
+    return;
+
+  /* EOF included, the backend isn't supposed to close it */
+  if (nread < 0) {
+    bud_lookup_close(lookup, bud_error_num(kBudErrLookupRead, nread));
+    return;
+  }
+
+  lookup->len += nread;
+  bud_lookup_parse(lookup);
+}
+
+
+void bud_lookup_parse(bud_lookup_t* lookup) {
+  size_t off;
+  uint32_t size;
+  bud_error_t err;
+
+  off = 0;
+  while (lookup->len - off >= 4) {
+    size = bud_lookup_read32(lookup->buf + off);
+    if (size < BUD_LOOKUP_REPLY_SIZE - 4 || size > BUD_LOOKUP_MAX_FRAME) {
+      bud_lookup_close(lookup,
+                       bud_error_str(kBudErrLookupFrame, lookup->host));
+      return;
+    }
+    if (lookup->len - off < 4 + (size_t) size)
+      break;
+
+    err = bud_lookup_reply(lookup, lookup->buf + off, 4 + size);
+    if (!bud_is_ok(err)) {
+      bud_lookup_close(lookup, err);
+      return;
+    }
+    off += 4 + size;
+
+    /* Callback has freed the lookup or dropped the connection */
+    if (lookup->state != kBudLookupConnected)
+      return;
+  }
+
+  /* Keep the partial frame, big buffer isn't needed between them */
+  lookup->len -= off;
+  if (lookup->len != 0) {
+    memmove(lookup->buf, lookup->buf + off, lookup->len);
+  } else if (lookup->cap > BUD_LOOKUP_KEEP_BUF) {
+    free(lookup->buf);
+    lookup->buf = NULL;
+    lookup->cap = 0;
+  }
+}
+
+
+bud_error_t bud_lookup_reply(bud_lookup_t* lookup,
+                             const char* frame,
+                             size_t size) {
+  bud_lookup_req_t* req;
+  bud_error_t err;
+
+  /* Cancelled or timed out */
+  req = bud_lookup_find(lookup, bud_lookup_read32(frame + 4));
+  if (req == NULL)
+    return bud_ok();
+  if ((bud_lookup_type_t) (unsigned char) frame[8] != req->type ||
+      req->write != NULL) {
+    return bud_error_str(kBudErrLookupFrame, lookup->host);
+  }
+
+  req->code = ((unsigned char) frame[9] << 8) | (unsigned char) frame[10];
+  req->max_age = (int32_t) bud_lookup_read32(frame + 11);
+  req->stale = (int32_t) bud_lookup_read32(frame + 15);
+  if (req->max_age < 0)
+    req->max_age = -1;
+  if (req->stale < 0)
+    req->stale = -1;
+
+  err = bud_lookup_records(req,
+                           frame + BUD_LOOKUP_REPLY_SIZE,
+                           size - BUD_LOOKUP_REPLY_SIZE);
+
+  /* Broken frame - the rest of the stream can't be trusted either */
+  if (err.code == kBudErrLookupFrame)
+    return err;
+
+  bud_lookup_req_unlink(req);
+  req->cb(req, err);
+  bud_lookup_req_free(req);
+  return bud_ok();
+}
+
+
+bud_error_t bud_lookup_records(bud_lookup_req_t* req,
+                               const char* data,
+                               size_t size) {
+  const char* p;
+  const char* end;
+  const char* json;
+  const char* name;
+  const char* rest;
+  size_t json_len;
+  uint32_t len;
+  bud_error_t err;
+
+  /* Check the lengths and find JSON record first, it goes in before DER */
+  json = "{}";
+  json_len = 2;
+  end = data + size;
+  for (p = data; p != end; p += BUD_LOOKUP_RECORD_SIZE + len) {
+    if (end - p < BUD_LOOKUP_RECORD_SIZE)
+      return bud_error_str(kBudErrLookupFrame, req->lookup->host);
+    len = bud_lookup_read32(p + 1);
+    if (len > (size_t) (end - p - BUD_LOOKUP_RECORD_SIZE))
+      return bud_error_str(kBudErrLookupFrame, req->lookup->host);
+    if ((bud_lookup_tag_t) (unsigned char) p[0] == kBudLookupTagJSON) {
+      json = p + BUD_LOOKUP_RECORD_SIZE;
+      json_len = len;
+    }
+  }
+
+  err = bud_json_stream_write(&req->stream, json, json_len);
+  if (bud_is_ok(err))
+    err = bud_json_stream_end(&req->stream, &rest);
+  if (!bud_is_ok(err))
+    return err;
+
+  for (p = data; p != end; p += BUD_LOOKUP_RECORD_SIZE + len) {
+    len = bud_lookup_read32(p + 1);
+
+    /* Unknown ones are skipped, there may be more of them later */
+    name = bud_lookup_tag_name(req, (unsigned char) p[0]);
+    if (name == NULL)
+      continue;
+    err = bud_json_stream_add(&req->stream,
+                              name,
+                              p + BUD_LOOKUP_RECORD_SIZE,
+                              len);
+    if (!bud_is_ok(err))
+      return err;
+  }
+  req->stream.der = 1;
+
+  req->response = json_parse_string(rest);
+  if (req->response == NULL)
+    return bud_error_str(kBudErrJSONParse, "<lookup response>");
+  return bud_ok();
+}
+
+
+const char* bud_lookup_tag_name(bud_lookup_req_t* req, bud_lookup_tag_t tag) {
+  switch (tag) {
+    case kBudLookupTagCert:
+      return req->type == kBudLookupSNI ? "cert" : NULL;
+    case kBudLookupTagKey:
+      return req->type == kBudLookupSNI ? "key" : NULL;
+    case kBudLookupTagOCSP:
+      return "ocsp";
+    default:
+      return NULL;
+  }
+}
+
+
+bud_lookup_req_t* bud_lookup_find(bud_lookup_t* lookup, uint32_t id) {
+  bud_lookup_req_t* req;
+
+  for (req = lookup->buckets[id % BUD_LOOKUP_BUCKETS];
+       req != NULL;
+       req = req->next) {
+    if (req->id == id)
+      return req;
+  }
+  return NULL;
+}
+
+
+void bud_lookup_cancel(bud_lookup_req_t* req) {
+  bud_lookup_req_unlink(req);
+  bud_lookup_req_free(req);
+}
+
+
+void bud_lookup_req_unlink(bud_lookup_req_t* req) {
+  bud_lookup_req_t** p;
+
+  for (p = &req->lookup->buckets[req->id % BUD_LOOKUP_BUCKETS];
+       *p != NULL;
+       p = &(*p)->next) {
+    if (*p == req) {
+      *p = req->next;
+      break;
+    }
+  }
+  QUEUE_REMOVE(&req->member);
+  QUEUE_INIT(&req->member);
+}
+
+
+void bud_lookup_req_free(bud_lookup_req_t* req) {
+  /* Not written yet */
+  free(req->write);
+  bud_json_stream_destroy(&req->stream);
+  free(req);
+}
+
+
+uint32_t bud_lookup_read32(const char* p) {
+  const unsigned char* u;
+
+  u = (const unsigned char*) p;
+  return ((uint32_t) u[0] << 24) | ((uint32_t) u[1] << 16) |
+         ((uint32_t) u[2] << 8) | (uint32_t) u[3];
+}
+
+
+void bud_lookup_write32(char* p, uint32_t value) {
+  p[0] = (value >> 24) & 0xff;
+  p[1] = (value >> 16) & 0xff;
+  p[2] = (value >> 8) & 0xff;
+  p[3] = value & 0xff;
+}
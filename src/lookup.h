@@ -0,0 +1,178 @@
+#ifndef SRC_LOOKUP_H_
+#define SRC_LOOKUP_H_
+
+#include <stdint.h>  /* uint8_t, uint32_t, uint64_t */
+#include <stdlib.h>  /* size_t */
+
+#include "uv.h"
+#include "parson.h"
+
+#include "config.h"
+#include "error.h"
+#include "json-stream.h"
+#include "queue.h"
+
+/* Requests in flight are found by id in a table of this many buckets */
+#define BUD_LOOKUP_BUCKETS 1024
+
+/* Largest frame accepted from the backend, the connection is dropped */
+#define BUD_LOOKUP_MAX_FRAME (4 * 1024 * 1024)
+
+/* Frame length and id, then type (and status, max-age and stale in reply) */
+#define BUD_LOOKUP_HEADER_SIZE 9
+#define BUD_LOOKUP_REPLY_SIZE (BUD_LOOKUP_HEADER_SIZE + 10)
+
+/* Record tag and length */
+#define BUD_LOOKUP_RECORD_SIZE 5
+
+/* Shortest interval of deadline checks and reconnects */
+#define BUD_LOOKUP_TIMER_MIN 10
+
+typedef struct bud_lookup_s bud_lookup_t;
+typedef struct bud_lookup_req_s bud_lookup_req_t;
+typedef struct bud_lookup_write_s bud_lookup_write_t;
+typedef enum bud_lookup_type_e bud_lookup_type_t;
+typedef enum bud_lookup_tag_e bud_lookup_tag_t;
+typedef enum bud_lookup_state_e bud_lookup_state_t;
+typedef void (*bud_lookup_cb)(bud_lookup_req_t* req, bud_error_t err);
+
+/* See "Binary lookup protocol" in README.md */
+enum bud_lookup_type_e {
+  kBudLookupSNI = 0x1,
+  kBudLookupStapling = 0x2
+};
+
+enum bud_lookup_tag_e {
+  kBudLookupTagName = 0x1,
+  kBudLookupTagCert = 0x2,
+  kBudLookupTagKey = 0x3,
+  kBudLookupTagOCSP = 0x4,
+  kBudLookupTagOCSPRequest = 0x5,
+  kBudLookupTagOCSPUrl = 0x6,
+  kBudLookupTagJSON = 0x7
+};
+
+enum bud_lookup_state_e {
+  kBudLookupDisconnected,
+  kBudLookupConnecting,
+  kBudLookupConnected,
+  kBudLookupClosing
+};
+
+/* Request frame, owned by the `uv_write()` once it is handed to it */
+struct bud_lookup_write_s {
+  uv_write_t req;
+  size_t size;
+  char data[1];
+};
+
+/*
+ * Persistent connection of a worker to the SNI or stapling backend that
+ * speaks the binary protocol (`binary` in the config section). All lookups
+ * are multiplexed over it, responses are matched by id in any order.
+ */
+struct bud_lookup_s {
+  bud_config_t* config;
+
+  /* Unix socket path (see BUD_HOST_IS_PIPE), or resolved once on start */
+  char* host;
+  uint16_t port;
+  int is_pipe;
+  struct sockaddr_storage addr;
+
+  union {
+    uv_tcp_t tcp;
+    uv_pipe_t pipe;
+  };
+  uv_connect_t connect;
+  bud_lookup_state_t state;
+
+  /*
+   * Lookups that aren't answered in `timeout` ms fail, 0 - never. Lost
+   * connection is made again in `backoff` ms, doubled on each failed one
+   * up to `max_backoff`, lookups fail right away until then.
+   */
+  uint64_t timeout;
+  uint64_t backoff;
+  uint64_t max_backoff;
+  uint64_t down_backoff;
+  uv_timer_t timer;
+  uv_timer_t retry_timer;
+
+  /* Waiting for the connection, and written ones, both oldest first */
+  QUEUE pending;
+  QUEUE inflight;
+  uint32_t next_id;
+  bud_lookup_req_t* buckets[BUD_LOOKUP_BUCKETS];
+
+  /* Partial frame of the backend */
+  char* buf;
+  size_t len;
+  size_t cap;
+
+  /* Handles to wait for in `bud_lookup_free()` */
+  int closing;
+  int refs;
+};
+
+struct bud_lookup_req_s {
+  /* In lookup's `pending` or `inflight`, and in a bucket by `id` */
+  QUEUE member;
+  bud_lookup_req_t* next;
+
+  bud_config_t* config;
+  bud_lookup_t* lookup;
+  uint32_t id;
+  bud_lookup_type_t type;
+  bud_lookup_write_t* write;
+
+  /* Creation time + `timeout`, 0 - none */
+  uint64_t deadline;
+
+  bud_lookup_cb cb;
+  void* data;
+
+  /*
+   * Response: status, and max-age and stale-while-revalidate in s (-1 -
+   * absent). DER records are in `stream` (with `der` set) under the same
+   * names as in the JSON responses, `response` is the JSON record (or an
+   * empty object) and is owned by the callback.
+   */
+  int code;
+  int max_age;
+  int stale;
+  bud_json_stream_t stream;
+  JSON_Value* response;
+};
+
+bud_lookup_t* bud_lookup_new(bud_config_t* config,
+                             bud_config_http_pool_t* conf,
+                             bud_error_t* err);
+void bud_lookup_free(bud_lookup_t* lookup);
+
+/* SNI response for `servername`, fields of `bud_sni_extract` in `stream` */
+bud_lookup_req_t* bud_lookup_sni(bud_lookup_t* lookup,
+                                 const char* servername,
+                                 size_t servername_len,
+                                 bud_lookup_cb cb,
+                                 bud_error_t* err);
+
+/*
+ * OCSP response of the certificate with OCSP `id`, `ocsp` field in
+ * `stream`. DER OCSP request and the responder's `url` are optional, the
+ * backend needs them if it has no cached response.
+ */
+bud_lookup_req_t* bud_lookup_stapling(bud_lookup_t* lookup,
+                                      const char* id,
+                                      size_t id_size,
+                                      const char* url,
+                                      size_t url_size,
+                                      const char* ocsp,
+                                      size_t ocsp_size,
+                                      bud_lookup_cb cb,
+                                      bud_error_t* err);
+
+/* Callback is not called, `req` is freed, late response is skipped */
+void bud_lookup_cancel(bud_lookup_req_t* req);
+
+#endif  /* SRC_LOOKUP_H_ */
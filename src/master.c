@@ -1,18 +1,51 @@
 #include <errno.h>
-#include <stdio.h>  /* freopen */
-#include <stdlib.h>  /* NULL */
-#include <string.h>  /* memset */
+#include <fcntl.h>  /* fcntl, FD_CLOEXEC */
+#include <netinet/in.h>  /* sockaddr_in, sockaddr_in6 */
+#include <stdio.h>  /* freopen, fopen, snprintf */
+#include <stdlib.h>  /* NULL, getenv, setenv */
+#include <string.h>  /* memset, strrchr */
+#include <sys/socket.h>  /* recv, MSG_PEEK */
 #include <unistd.h>  /* fork, setsid */
 
 #include "uv.h"
 
 #include "master.h"
+#include "admin.h"
+#include "affinity.h"
 #include "common.h"
 #include "config.h"
 #include "error.h"
+#include "handoff.h"
+#include "hello-parser.h"
 #include "logger.h"
+#include "metrics.h"
 #include "server.h"
 #include "client.h"
+#include "ipc.h"
+#include "ocsp.h"
+#include "session-cache.h"
+#include "shared-cache.h"
+#include "snapshot.h"
+#include "threads.h"
+#include "ticket.h"
+
+/* Check staples for refresh that often (ms) */
+#define BUD_MASTER_STAPLING_INTERVAL 60000
+
+/* Workers with larger event loop lag (ms) are avoided when balancing */
+#define BUD_MASTER_MAX_LAG 100
+
+/* `workers_autoscale`: quiet checks in a row before a worker is retired */
+#define BUD_MASTER_SCALE_DOWN_AFTER 6
+
+/*
+ * `workers_balance: "sni"`: peeked bytes of the ClientHello, how often the
+ * socket is peeked again while the rest is in flight, and for how long
+ * (ms), before the client goes to the least loaded worker instead.
+ */
+#define BUD_MASTER_PEEK_MAX 16384
+#define BUD_MASTER_PEEK_INTERVAL 2
+#define BUD_MASTER_PEEK_TIMEOUT 1000
 
 typedef struct bud_master_msg_s bud_master_msg_t;
 
@@ -20,6 +53,19 @@ struct bud_master_msg_s {
   bud_config_t* config;
   uv_tcp_t client;
   uv_write_t req;
+
+  /* Followed by the index of the listener */
+  char header[BUD_IPC_HEADER_SIZE + 4];
+  uint32_t listener;
+
+  /* `workers_balance: "sni"`, waiting for the rest of the hello */
+  bud_hello_parser_t parser;
+  uv_timer_t peek_timer;
+  int peek_init;
+  uint64_t peek_deadline;
+
+  /* Handles to be closed before it is freed */
+  int closing;
 };
 
 #ifndef _WIN32
@@ -27,6 +73,30 @@ static int bud_daemonize(bud_error_t* err);
 static bud_error_t bud_master_init_signals(bud_config_t* config);
 static void bud_master_signal_close_cb(uv_handle_t* handle);
 static void bud_master_signal_cb(uv_signal_t* handle, int signum);
+static void bud_master_sighup_cb(uv_signal_t* handle, int signum);
+static void bud_master_sigusr1_cb(uv_signal_t* handle, int signum);
+static void bud_master_sigusr2_cb(uv_signal_t* handle, int signum);
+static bud_error_t bud_master_upgrade(bud_config_t* config);
+static void bud_master_upgrade_exit_cb(uv_process_t* proc,
+                                       int64_t exit_status,
+                                       int term_signal);
+static void bud_master_upgrade_read_cb(uv_stream_t* stream,
+                                       ssize_t nread,
+                                       const uv_buf_t* buf);
+static void bud_master_upgrade_restore_cb(uv_timer_t* handle, int status);
+static void bud_master_retire(bud_config_t* config);
+static void bud_master_retire_cb(uv_timer_t* handle, int status);
+static void bud_master_reload(bud_config_t* config);
+static void bud_master_drain_worker(bud_worker_t* worker);
+static void bud_master_drain_timer_cb(uv_timer_t* handle, int status);
+static bud_error_t bud_master_init_autoscale(bud_config_t* config);
+static void bud_master_autoscale_cb(uv_timer_t* handle, int status);
+static bud_error_t bud_master_init_watchdog(bud_config_t* config);
+static void bud_master_watchdog_cb(uv_timer_t* handle, int status);
+static uint32_t bud_master_worker_cpu(bud_worker_t* worker,
+                                      uint64_t elapsed);
+static void bud_master_scale_up(bud_config_t* config);
+static void bud_master_scale_down(bud_config_t* config);
 #endif  /* !_WIN32 */
 static bud_error_t bud_master_spawn_worker(bud_worker_t* worker);
 static void bud_master_kill_worker(bud_worker_t* worker,
@@ -34,27 +104,93 @@ static void bud_master_kill_worker(bud_worker_t* worker,
                                    bud_worker_kill_cb cb);
 static void bud_worker_timer_cb(uv_timer_t* handle, int status);
 static void bud_worker_close_cb(uv_handle_t* handle);
+static void bud_master_replace_worker(bud_worker_t* worker);
 static void bud_master_respawn_worker(uv_process_t* proc,
                                       int64_t exit_status,
                                       int term_signal);
 static void bud_master_ipc_close_cb(uv_handle_t* handle);
 static void bud_master_msg_close_cb(uv_handle_t* handle);
 static void bud_master_msg_send_cb(uv_write_t* req, int status);
+static void bud_master_msg_close(bud_master_msg_t* msg);
+static void bud_master_balance_send(bud_master_msg_t* msg,
+                                    bud_worker_t* worker);
+static void bud_master_peek(bud_master_msg_t* msg);
+static void bud_master_peek_timer_cb(uv_timer_t* handle, int status);
+static void bud_master_peek_done(bud_master_msg_t* msg,
+                                 const bud_client_hello_t* hello);
+static bud_worker_t* bud_master_select_by_tag(bud_config_t* config,
+                                              const bud_client_hello_t* hello,
+                                              bud_worker_t* fallback);
+static void bud_master_send_identity(bud_worker_t* worker);
+static void bud_master_ipc_alloc_cb(uv_handle_t* handle,
+                                    size_t suggested_size,
+                                    uv_buf_t* buf);
+static void bud_master_ipc_read_cb(uv_pipe_t* pipe,
+                                   ssize_t nread,
+                                   const uv_buf_t* buf,
+                                   uv_handle_type pending);
+static void bud_master_ipc_msg_cb(bud_ipc_t* ipc, bud_ipc_msg_t* msg);
+static void bud_master_ipc_handoff(bud_worker_t* worker, bud_ipc_msg_t* msg);
+static void bud_master_accept_handoff(bud_worker_t* worker,
+                                      uv_handle_type pending);
+static void bud_master_handoff_cb(bud_handoff_t* handoff, int status);
+static int bud_master_promote_spare(bud_worker_t* dead);
+static bud_worker_t* bud_master_select_worker(bud_config_t* config);
+static bud_worker_t* bud_master_select_by_peer(bud_config_t* config,
+                                               uv_tcp_t* client,
+                                               bud_worker_t* fallback);
+static bud_worker_t* bud_master_select_by_hash(bud_config_t* config,
+                                               uint32_t hash,
+                                               bud_worker_t* fallback);
+static void bud_master_balance_pending(bud_config_t* config);
+static int bud_master_fixed_slots(bud_config_t* config);
+static uint32_t bud_master_warm_load(bud_config_t* config, uint64_t now);
+static bud_error_t bud_master_init_stapling(bud_config_t* config);
+static void bud_master_stapling_timer_cb(uv_timer_t* handle, int status);
+static bud_error_t bud_master_init_tickets(bud_config_t* config);
+static void bud_master_ticket_timer_cb(uv_timer_t* handle, int status);
 
 
 bud_error_t bud_master(bud_config_t* config) {
   int i;
+  const char* env;
   bud_error_t err;
 
   err = bud_ok();
 
   bud_log(config, kBudLogDebug, "master starting");
 
+  /* Balance messages are allocated on every accept */
+  bud_slab_init(&config->master_msg_slab,
+                "master msg",
+                kBudMemOther,
+                sizeof(bud_master_msg_t),
+                config->pool.low_watermark,
+                config->pool.high_watermark);
+
 #ifndef _WIN32
-  if (config->is_daemon)
+  /* Started by bud_master_upgrade() of the old master */
+  env = getenv(BUD_UPGRADE_ENV);
+  if (env != NULL) {
+    config->upgrade.child = 1;
+    config->upgrade.inherited = atoi(env);
+    if (config->upgrade.inherited > BUD_UPGRADE_MAX_FDS)
+      config->upgrade.inherited = BUD_UPGRADE_MAX_FDS;
+
+    /* Workers must not hold the pipe, it would never report EOF then */
+    fcntl(BUD_UPGRADE_FD, F_SETFD, FD_CLOEXEC);
+    unsetenv(BUD_UPGRADE_ENV);
+  }
+
+  if (config->is_daemon) {
     if (bud_daemonize(&err) != 0)
       goto fatal;
 
+    err = bud_logger_start(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+
   /* Initialize signal watchers */
   err = bud_master_init_signals(config);
   if (!bud_is_ok(err))
@@ -62,13 +198,44 @@ bud_error_t bud_master(bud_config_t* config) {
 #endif  /* !_WIN32 */
 
   /* Create server and send it to all workers */
-  err = bud_server_new(config);
+  if (!config->frontend.reuseport || config->worker_count == 0) {
+    err = bud_server_new(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+
+  /* No workers, accept in `threads` loops of our own */
+  if (config->worker_count == 0) {
+    err = bud_threads_start(config);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+
+  /* Start fetching staples, workers will receive them over IPC */
+  err = bud_master_init_stapling(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  /* Same with the ticket keys, and their rotation */
+  err = bud_master_init_tickets(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  err = bud_metrics_start(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  err = bud_admin_start(config);
   if (!bud_is_ok(err))
     goto fatal;
 
-  /* Spawn workers */
-  for (i = 0; i < config->worker_count; i++) {
+  /* Spawn workers, then the spares, autoscaled ones are spawned on demand */
+  for (i = 0; i < config->worker_slots; i++) {
     config->workers[i].config = config;
+    config->workers[i].spare = i >= config->worker_count;
+    config->workers[i].id = config->workers[i].spare ? -1 : i;
+    if (i >= bud_master_fixed_slots(config))
+      continue;
     err = bud_master_spawn_worker(&config->workers[i]);
 
     if (!bud_is_ok(err))
@@ -76,6 +243,13 @@ bud_error_t bud_master(bud_config_t* config) {
         bud_master_kill_worker(&config->workers[i], 0, NULL);
   }
 
+#ifndef _WIN32
+  if (bud_is_ok(err))
+    err = bud_master_init_autoscale(config);
+#endif  /* !_WIN32 */
+  if (bud_is_ok(err))
+    err = bud_master_init_watchdog(config);
+
   if (bud_is_ok(err)) {
     bud_log(config,
             kBudLogInfo,
@@ -84,6 +258,23 @@ bud_error_t bud_master(bud_config_t* config) {
             config->frontend.port,
             config->backend.host,
             config->backend.port);
+    for (i = 1; i < config->listener_count; i++) {
+      bud_log(config,
+              kBudLogInfo,
+              "bud also listening on [%s]:%d",
+              config->listeners[i].host,
+              config->listeners[i].port);
+    }
+
+#ifndef _WIN32
+    /* Serving now, the old master may stop accepting and drain */
+    if (config->upgrade.child) {
+      if (write(BUD_UPGRADE_FD, "1", 1) != 1)
+        bud_log(config, kBudLogWarning, "failed to notify the old master");
+      close(BUD_UPGRADE_FD);
+      config->upgrade.child = 0;
+    }
+#endif  /* !_WIN32 */
   }
 
 fatal:
@@ -94,13 +285,55 @@ fatal:
 bud_error_t bud_master_finalize(bud_config_t* config) {
   int i;
 
-  for (i = 0; i < config->worker_count; i++)
+  /* Both generations, draining workers are killed too */
+  for (i = 0; i < config->worker_slots * 2; i++)
     if (config->workers[i].active)
       bud_master_kill_worker(&config->workers[i], 0, NULL);
 
+  /* Initialized by bud_master_init_stapling() */
+  if (config->stapling_timer.loop != NULL)
+    uv_close((uv_handle_t*) &config->stapling_timer, bud_master_ipc_close_cb);
+
+  /* And by bud_master_init_tickets() */
+  if (config->ticket_timer.loop != NULL)
+    uv_close((uv_handle_t*) &config->ticket_timer, bud_master_ipc_close_cb);
+
+  /* Initialized by bud_master_init_autoscale() */
+  if (config->autoscale_timer.loop != NULL)
+    uv_close((uv_handle_t*) &config->autoscale_timer, bud_master_ipc_close_cb);
+
+  /* Initialized by bud_master_init_watchdog() */
+  if (config->watchdog_timer.loop != NULL)
+    uv_close((uv_handle_t*) &config->watchdog_timer, bud_master_ipc_close_cb);
+  bud_metrics_finalize(config);
+  bud_admin_finalize(config);
+
 #ifndef _WIN32
-  uv_close((uv_handle_t*) &config->signal.sigterm, bud_master_signal_close_cb);
-  uv_close((uv_handle_t*) &config->signal.sigint, bud_master_signal_close_cb);
+  /* Initialized by bud_master_init_signals() */
+  if (config->signal.sigterm.loop != NULL) {
+    uv_close((uv_handle_t*) &config->signal.sigterm,
+             bud_master_signal_close_cb);
+    uv_close((uv_handle_t*) &config->signal.sigint,
+             bud_master_signal_close_cb);
+    uv_close((uv_handle_t*) &config->signal.sighup,
+             bud_master_signal_close_cb);
+    uv_close((uv_handle_t*) &config->signal.sigusr1,
+             bud_master_signal_close_cb);
+    uv_close((uv_handle_t*) &config->signal.sigusr2,
+             bud_master_signal_close_cb);
+  }
+
+  /* New master outlives us, the handle is just forgotten */
+  if (config->upgrade.spawned) {
+    config->upgrade.spawned = 0;
+    uv_close((uv_handle_t*) &config->upgrade.proc, bud_master_ipc_close_cb);
+  }
+  if (config->upgrade.waiting) {
+    config->upgrade.waiting = 0;
+    uv_close((uv_handle_t*) &config->upgrade.pipe, bud_master_ipc_close_cb);
+  }
+  if (config->upgrade.timer.loop != NULL)
+    uv_close((uv_handle_t*) &config->upgrade.timer, bud_master_ipc_close_cb);
 #endif  /* !_WIN32 */
 
   return bud_ok();
@@ -152,6 +385,9 @@ bud_error_t bud_master_init_signals(bud_config_t* config) {
 
   config->signal.sigterm.data = config;
   config->signal.sigint.data = config;
+  config->signal.sighup.data = config;
+  config->signal.sigusr1.data = config;
+  config->signal.sigusr2.data = config;
 
   r = uv_signal_init(config->loop, &config->signal.sigterm);
   if (r != 0) {
@@ -163,17 +399,56 @@ bud_error_t bud_master_init_signals(bud_config_t* config) {
     err = bud_error_num(kBudErrSignalInit, r);
     goto failed_sigint_init;
   }
+  r = uv_signal_init(config->loop, &config->signal.sighup);
+  if (r != 0) {
+    err = bud_error_num(kBudErrSignalInit, r);
+    goto failed_sighup_init;
+  }
+  r = uv_signal_init(config->loop, &config->signal.sigusr2);
+  if (r != 0) {
+    err = bud_error_num(kBudErrSignalInit, r);
+    goto failed_sigusr2_init;
+  }
+  r = uv_signal_init(config->loop, &config->signal.sigusr1);
+  if (r != 0) {
+    err = bud_error_num(kBudErrSignalInit, r);
+    goto failed_sigusr1_init;
+  }
 
   r = uv_signal_start(&config->signal.sigterm, bud_master_signal_cb, SIGTERM);
   if (r == 0)
     r = uv_signal_start(&config->signal.sigint, bud_master_signal_cb, SIGINT);
+  if (r == 0)
+    r = uv_signal_start(&config->signal.sighup, bud_master_sighup_cb, SIGHUP);
+  if (r == 0) {
+    r = uv_signal_start(&config->signal.sigusr2,
+                        bud_master_sigusr2_cb,
+                        SIGUSR2);
+  }
+  if (r == 0) {
+    r = uv_signal_start(&config->signal.sigusr1,
+                        bud_master_sigusr1_cb,
+                        SIGUSR1);
+  }
   if (r != 0) {
     err = bud_error_num(kBudErrSignalStart, r);
-    goto failed_sigint_init;
+    goto failed_signal_start;
   }
 
   return bud_ok();
 
+failed_signal_start:
+  uv_close((uv_handle_t*) &config->signal.sigusr1, bud_master_signal_close_cb);
+
+failed_sigusr1_init:
+  uv_close((uv_handle_t*) &config->signal.sigusr2, bud_master_signal_close_cb);
+
+failed_sigusr2_init:
+  uv_close((uv_handle_t*) &config->signal.sighup, bud_master_signal_close_cb);
+
+failed_sighup_init:
+  uv_close((uv_handle_t*) &config->signal.sigint, bud_master_signal_close_cb);
+
 failed_sigint_init:
   uv_close((uv_handle_t*) &config->signal.sigterm, bud_master_signal_close_cb);
 
@@ -191,260 +466,1652 @@ void bud_master_signal_cb(uv_signal_t* handle, int signum) {
   /* Stop the loop and let finalize to be called */
   uv_stop(handle->loop);
 }
-#endif  /* !_WIN32 */
 
 
-bud_error_t bud_master_spawn_worker(bud_worker_t* worker) {
-  bud_error_t err;
+void bud_master_sighup_cb(uv_signal_t* handle, int signum) {
+  bud_master_reload(handle->data);
+}
+
+
+void bud_master_sigusr1_cb(uv_signal_t* handle, int signum) {
   bud_config_t* config;
+  bud_error_t err;
+
+  config = handle->data;
+  err = bud_master_upgrade(config);
+  if (!bud_is_ok(err))
+    bud_error_log(config, kBudLogWarning, err);
+}
+
+
+bud_error_t bud_master_upgrade(bud_config_t* config) {
   int i;
   int r;
+  int count;
+  char env[16];
+  uv_os_fd_t fd;
   uv_process_options_t options;
+  bud_server_t* server;
+  bud_error_t err;
 
-  config = worker->config;
-  ASSERT(config != NULL, "Worker config absent");
+  if (config->upgrade.waiting || config->upgrade.retiring) {
+    bud_log(config, kBudLogWarning, "binary upgrade in progress, ignoring");
+    return bud_ok();
+  }
+  bud_log(config, kBudLogInfo, "master upgrading binary");
+
+  if (config->upgrade.timer.loop == NULL) {
+    r = uv_timer_init(config->loop, &config->upgrade.timer);
+    if (r != 0)
+      return bud_error_num(kBudErrUpgradeSpawn, r);
+  }
 
   memset(&options, 0, sizeof(options));
-  options.exit_cb = bud_master_respawn_worker;
+  options.exit_cb = bud_master_upgrade_exit_cb;
   options.file = config->exepath;
-  options.stdio_count = 3;
+  options.args = config->argv;
+  options.flags = UV_PROCESS_DETACHED;
+  options.stdio_count = BUD_UPGRADE_LISTEN_FD + config->listener_count;
   options.stdio = calloc(options.stdio_count, sizeof(*options.stdio));
-  options.args = calloc(config->argc + 2, sizeof(*options.args));
-  if (options.stdio == NULL || options.args == NULL) {
-    err = bud_error(kBudErrNoMem);
-    goto done;
-  }
-
-  /* args = { config.argv, "--worker" } */
-  for (i = 0; i < config->argc; i++)
-    options.args[i] = config->argv[i];
-  options.args[i] = "--worker";
-  options.args[i + 1] = NULL;
-
-  /* stdio = { pipe, inherit, inherit } */
-  options.stdio[0].flags = UV_CREATE_PIPE | UV_WRITABLE_PIPE;
-  options.stdio[0].data.stream = (uv_stream_t*) &worker->ipc;
-  options.stdio[1].flags = UV_INHERIT_FD;
-  options.stdio[1].data.fd = 1;
-  options.stdio[2].flags = UV_INHERIT_FD;
-  options.stdio[2].data.fd = 2;
+  if (options.stdio == NULL)
+    return bud_error(kBudErrNoMem);
 
-  r = uv_timer_init(config->loop, &worker->restart_timer);
-  if (r != 0) {
-    err = bud_error_num(kBudErrRestartTimer, r);
-    goto done;
+  /* stdio = { inherit, inherit, inherit, pipe, listening sockets } */
+  for (i = 0; i < BUD_UPGRADE_FD; i++) {
+    options.stdio[i].flags = UV_INHERIT_FD;
+    options.stdio[i].data.fd = i;
   }
+  options.stdio[BUD_UPGRADE_FD].flags = UV_CREATE_PIPE |
+                                        UV_READABLE_PIPE |
+                                        UV_WRITABLE_PIPE;
+  options.stdio[BUD_UPGRADE_FD].data.stream =
+      (uv_stream_t*) &config->upgrade.pipe;
+
+  /* None in `reuseport` mode, new workers bind next to the old ones */
+  count = 0;
+  for (i = 0; i < config->listener_count; i++) {
+    server = config->listeners[i].server;
+    if (server == NULL || count == BUD_UPGRADE_MAX_FDS)
+      continue;
+    if (uv_fileno((uv_handle_t*) &server->tcp, &fd) != 0)
+      continue;
+    options.stdio[BUD_UPGRADE_LISTEN_FD + count].flags = UV_INHERIT_FD;
+    options.stdio[BUD_UPGRADE_LISTEN_FD + count].data.fd = fd;
+    count++;
+  }
+  options.stdio_count = BUD_UPGRADE_LISTEN_FD + count;
 
-  r = uv_pipe_init(config->loop, &worker->ipc, 1);
+  r = uv_pipe_init(config->loop, &config->upgrade.pipe, 0);
   if (r != 0) {
-    err = bud_error_num(kBudErrIPCPipeInit, r);
-    goto failed_pipe_init;
+    err = bud_error_num(kBudErrUpgradeSpawn, r);
+    goto done;
   }
 
-  r = uv_spawn(config->loop, &worker->proc, &options);
+  /* New master binds `metrics.port`, and takes `admin.path` over */
+  bud_metrics_finalize(config);
 
+  snprintf(env, sizeof(env), "%d", count);
+  setenv(BUD_UPGRADE_ENV, env, 1);
+  r = uv_spawn(config->loop, &config->upgrade.proc, &options);
+  unsetenv(BUD_UPGRADE_ENV);
   if (r != 0) {
-    err = bud_error_num(kBudErrSpawn, r);
-    goto failed_uv_spawn;
-  } else {
-    worker->active = 1;
-    err = bud_ok();
-    bud_log(worker->config,
-            kBudLogInfo,
-            "spawned bud worker<%d>",
-            worker->proc.pid);
-
-    /* Pending accept - try balancing */
-    if (config->pending_accept) {
-      config->pending_accept = 0;
-      bud_master_balance(config->server);
-    }
+    err = bud_error_num(kBudErrUpgradeSpawn, r);
+    uv_close((uv_handle_t*) &config->upgrade.pipe, bud_master_ipc_close_cb);
+    uv_timer_start(&config->upgrade.timer,
+                   bud_master_upgrade_restore_cb,
+                   0,
+                   0);
+    goto done;
   }
-
-  goto done;
-
-failed_uv_spawn:
-  uv_close((uv_handle_t*) &worker->ipc, bud_master_ipc_close_cb);
-
-failed_pipe_init:
-  uv_close((uv_handle_t*) &worker->restart_timer, bud_master_ipc_close_cb);
+  config->upgrade.spawned = 1;
+  config->upgrade.waiting = 1;
+  bud_log(config,
+          kBudLogInfo,
+          "spawned new bud master<%d>, %d listening sockets",
+          config->upgrade.proc.pid,
+          count);
+
+  /* Readiness, or EOF if it fails to start */
+  config->upgrade.pipe.data = config;
+  r = uv_read_start((uv_stream_t*) &config->upgrade.pipe,
+                    bud_master_ipc_alloc_cb,
+                    bud_master_upgrade_read_cb);
+  if (r != 0)
+    bud_log(config, kBudLogWarning, "can't wait for the new master: %d", r);
+  err = bud_ok();
 
 done:
   free(options.stdio);
-  free(options.args);
-  options.stdio = NULL;
-  options.args = NULL;
   return err;
 }
 
 
-void bud_master_respawn_worker(uv_process_t* proc,
-                               int64_t exit_status,
-                               int term_signal) {
-  bud_worker_t* worker;
-
-  worker = container_of(proc, bud_worker_t, proc);
-  ASSERT(worker != NULL, "Proc has no worker");
+void bud_master_upgrade_exit_cb(uv_process_t* proc,
+                                int64_t exit_status,
+                                int term_signal) {
+  bud_config_t* config;
 
-  bud_log(worker->config,
-          kBudLogWarning,
-          "bud worker<%d> died, signal: %d",
+  /* Daemonized one exits right away, readiness comes from its child */
+  config = container_of(proc, bud_config_t, upgrade.proc);
+  bud_log(config,
+          kBudLogInfo,
+          "new bud master<%d> exited, status: %d, signal: %d",
           proc->pid,
+          (int) exit_status,
           term_signal);
-
-  bud_master_kill_worker(worker,
-                         (uint64_t) worker->config->restart_timeout,
-                         bud_master_spawn_worker);
+  config->upgrade.spawned = 0;
+  uv_close((uv_handle_t*) proc, bud_master_ipc_close_cb);
 }
 
 
-void bud_master_kill_worker(bud_worker_t* worker,
-                            uint64_t delay,
-                            bud_worker_kill_cb cb) {
-  int r;
-  ASSERT(worker->active, "Tried to kill inactive worker");
+void bud_master_upgrade_read_cb(uv_stream_t* stream,
+                                ssize_t nread,
+                                const uv_buf_t* buf) {
+  bud_config_t* config;
 
-  uv_process_kill(&worker->proc, SIGKILL);
-  worker->active = 0;
-  worker->kill_cb = cb;
-  worker->proc.data = worker;
-  worker->ipc.data = worker;
-  worker->restart_timer.data = worker;
-  worker->close_waiting = 3;
-  uv_close((uv_handle_t*) &worker->proc, bud_worker_close_cb);
-  uv_close((uv_handle_t*) &worker->ipc, bud_worker_close_cb);
-  if (delay == 0) {
-    uv_close((uv_handle_t*) &worker->restart_timer, bud_worker_close_cb);
-  } else {
-    r = uv_timer_start(&worker->restart_timer, bud_worker_timer_cb, delay, 0);
-    if (r != 0)
-      uv_close((uv_handle_t*) &worker->restart_timer, bud_worker_close_cb);
-  }
+  config = stream->data;
+  if (nread == 0)
+    return;
+
+  config->upgrade.waiting = 0;
+  uv_close((uv_handle_t*) stream, bud_master_ipc_close_cb);
+  if (nread > 0)
+    return bud_master_retire(config);
+
+  /* Keep serving, metrics are started again once the handles are closed */
+  bud_log(config, kBudLogWarning, "new bud master failed to start");
+  uv_timer_start(&config->upgrade.timer, bud_master_upgrade_restore_cb, 0, 0);
 }
 
 
-void bud_worker_timer_cb(uv_timer_t* handle, int status) {
-  bud_worker_t* worker;
+void bud_master_upgrade_restore_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_error_t err;
 
-  worker = handle->data;
-  ASSERT(worker != NULL, "Timers\'s worker absent");
-  uv_close((uv_handle_t*) &worker->restart_timer, bud_worker_close_cb);
+  config = container_of(handle, bud_config_t, upgrade.timer);
+  err = bud_metrics_start(config);
+  if (!bud_is_ok(err))
+    bud_error_log(config, kBudLogWarning, err);
 }
 
 
-void bud_worker_close_cb(uv_handle_t* handle) {
+void bud_master_retire(bud_config_t* config) {
+  int i;
   bud_worker_t* worker;
 
-  worker = handle->data;
-  ASSERT(worker != NULL, "Handle\'s worker absent");
+  bud_log(config, kBudLogInfo, "new bud master is ready, draining workers");
+  config->upgrade.retiring = 1;
+
+  /* Sockets stay open in the new master, queued SYNs are its now */
+  bud_server_free(config);
+  bud_admin_finalize(config);
+  if (config->autoscale_timer.loop != NULL)
+    uv_timer_stop(&config->autoscale_timer);
+  if (config->watchdog_timer.loop != NULL)
+    uv_timer_stop(&config->watchdog_timer);
+
+  for (i = 0; i < config->worker_slots * 2; i++) {
+    worker = &config->workers[i];
+    if (worker->active && !worker->draining)
+      bud_master_drain_worker(worker);
+  }
 
-  if (--worker->close_waiting == 0 && worker->kill_cb != NULL)
-    worker->kill_cb(worker);
+  /* Exit once all of them are gone, `drain_timeout` bounds it */
+  uv_timer_start(&config->upgrade.timer, bud_master_retire_cb, 0, 1000);
 }
 
 
-void bud_master_ipc_close_cb(uv_handle_t* handle) {
-  /* No-op */
+void bud_master_retire_cb(uv_timer_t* handle, int status) {
+  int i;
+  bud_config_t* config;
+
+  config = container_of(handle, bud_config_t, upgrade.timer);
+  for (i = 0; i < config->worker_slots * 2; i++)
+    if (config->workers[i].active || config->workers[i].close_waiting != 0)
+      return;
+
+  bud_log(config, kBudLogInfo, "workers drained, old bud master exiting");
+  uv_stop(handle->loop);
 }
 
 
-void bud_master_balance(struct bud_server_s* server) {
-  int r;
+void bud_master_sigusr2_cb(uv_signal_t* handle, int signum) {
+  int i;
   bud_config_t* config;
   bud_worker_t* worker;
-  int last_index;
-  bud_master_msg_t* msg;
-  uv_buf_t buf;
+  bud_error_t err;
 
-  config = server->config;
+  config = handle->data;
+  bud_log(config, kBudLogInfo, "master reloading contexts");
 
-  if (config->worker_count == 0) {
-    bud_log(config, kBudLogDebug, "master self accept");
+  /* Master needs fresh certificates for stapling and self-accept */
+  err = bud_config_reload_contexts(config);
+  if (!bud_is_ok(err)) {
+    /* Don't let workers diverge from master */
+    bud_error_log(config, kBudLogWarning, err);
+    return;
+  }
 
-    /* Master = worker */
-    return bud_client_create(config, (uv_stream_t*) &server->tcp);
+  /* Fetch staples for new certificates right away */
+  if (config->stapling_timer.loop != NULL)
+    bud_ocsp_prewarm(config);
+
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active || worker->draining)
+      continue;
+
+    err = bud_ipc_send(config,
+                       (uv_stream_t*) &worker->ipc,
+                       kBudIPCReload,
+                       NULL,
+                       0,
+                       NULL,
+                       0);
+    if (!bud_is_ok(err))
+      bud_error_log(config, kBudLogWarning, err);
   }
+}
 
-  bud_log(config,
-          kBudLogDebug,
-          "master balance");
 
-  /* Round-robin worker selection */
-  last_index = (config->last_worker + 1) % config->worker_count;
-  do {
-    config->last_worker++;
-    config->last_worker %= config->worker_count;
-    worker = &config->workers[config->last_worker];
-  } while (!worker->active && config->last_worker != last_index);
+void bud_master_reload(bud_config_t* config) {
+  int i;
+  int old_base;
+  int fixed;
+  int scaled;
+  bud_worker_t* worker;
+  bud_worker_t* old;
+  bud_error_t err;
 
-  /* All workers are down... wait */
-  if (!worker->active) {
-    config->pending_accept = 1;
+  if (config->worker_count == 0) {
+    bud_log(config, kBudLogWarning, "reload requires workers, ignoring");
     return;
   }
-
-  msg = malloc(sizeof(*msg));
-  if (msg == NULL) {
-    bud_error_log(config,
-                  kBudLogWarning,
-                  bud_error_str(kBudErrNoMem, "bud_master_msg_t"));
+  if (config->upgrade.retiring) {
+    bud_log(config, kBudLogWarning, "replaced by new master, ignoring reload");
     return;
   }
-  msg->config = config;
 
-  /* Accept handle */
-  r = uv_tcp_init(config->loop, &msg->client);
-  if (r != 0) {
-    bud_log(config,
-            kBudLogWarning,
-            "master uv_tcp_init() failed with (%d) \"%s\"",
-            r,
-            uv_strerror(r));
-    goto failed_tcp_init;
+  bud_log(config, kBudLogInfo, "master reloading workers");
+
+  old_base = config->worker_base;
+  config->worker_base = old_base == 0 ? config->worker_slots : 0;
+  fixed = bud_master_fixed_slots(config);
+
+  /* Autoscaled workers are replaced too, keeping their ids */
+  scaled = fixed;
+  for (i = 0; i < config->worker_slots; i++) {
+    old = &config->workers[old_base + i];
+    if (!old->active || old->draining || old->spare ||
+        old->id < config->worker_count || scaled == config->worker_slots) {
+      continue;
+    }
+    config->workers[config->worker_base + scaled++].id = old->id;
   }
 
-  r = uv_accept((uv_stream_t*) &server->tcp, (uv_stream_t*) &msg->client);
-  if (r != 0) {
-    bud_log(config,
-            kBudLogWarning,
-            "master uv_accept() failed with (%d) \"%s\"",
-            r,
-            uv_strerror(r));
-    goto failed_accept;
+  /* Spawn new generation, workers will load the config file again */
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    worker->config = config;
+    if (i < fixed) {
+      worker->spare = i >= config->worker_count;
+      worker->id = worker->spare ? -1 : i;
+    } else {
+      worker->spare = 0;
+    }
+
+    /* Free autoscale slot, let the leftover of the previous reload go */
+    if (i >= scaled) {
+      if (worker->active)
+        bud_master_kill_worker(worker, 0, NULL);
+      else if (worker->close_waiting != 0)
+        worker->kill_cb = NULL;
+      continue;
+    }
+
+    /* Still draining after the previous reload - no more waiting */
+    if (worker->active) {
+      bud_master_kill_worker(worker, 0, bud_master_spawn_worker);
+    } else if (worker->close_waiting != 0) {
+      worker->kill_cb = bud_master_spawn_worker;
+    } else {
+      err = bud_master_spawn_worker(worker);
+      if (!bud_is_ok(err))
+        bud_error_log(config, kBudLogWarning, err);
+    }
   }
 
-  buf = uv_buf_init("x", 1);
+  /* Let the old one finish its connections */
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[old_base + i];
+    if (worker->active) {
+      bud_master_drain_worker(worker);
+      continue;
+    }
 
-  r = uv_write2(&msg->req,
-                (uv_stream_t*) &worker->ipc,
-                &buf,
-                1,
-                (uv_stream_t*) &msg->client,
-                bud_master_msg_send_cb);
+    /* Don't let it respawn after the restart timeout */
+    if (worker->close_waiting != 0)
+      worker->kill_cb = NULL;
+  }
+}
+
+
+void bud_master_drain_worker(bud_worker_t* worker) {
+  bud_config_t* config;
+  bud_error_t err;
+  int r;
+  char flags;
+
+  config = worker->config;
+  worker->draining = 1;
+
+  /* Retiring master has no workers to move the relays to */
+  flags = 0;
+  if (config->drain_handoff && !config->upgrade.retiring)
+    flags |= BUD_IPC_DRAIN_HANDOFF;
+
+  err = bud_ipc_send(config,
+                     (uv_stream_t*) &worker->ipc,
+                     kBudIPCDrain,
+                     &flags,
+                     1,
+                     NULL,
+                     0);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    return bud_master_kill_worker(worker, 0, NULL);
+  }
+
+  r = uv_timer_start(&worker->restart_timer,
+                     bud_master_drain_timer_cb,
+                     config->drain_timeout,
+                     0);
+  if (r != 0)
+    return bud_master_kill_worker(worker, 0, NULL);
+
+  bud_log(config,
+          kBudLogInfo,
+          "draining bud worker<%d>",
+          worker->proc.pid);
+}
+
+
+void bud_master_drain_timer_cb(uv_timer_t* handle, int status) {
+  bud_worker_t* worker;
+
+  worker = container_of(handle, bud_worker_t, restart_timer);
+  bud_log(worker->config,
+          kBudLogWarning,
+          "bud worker<%d> drain timed out, killing",
+          worker->proc.pid);
+  bud_master_kill_worker(worker, 0, NULL);
+}
+
+
+bud_error_t bud_master_init_autoscale(bud_config_t* config) {
+  int r;
+
+  if (config->autoscale.max <= config->worker_count ||
+      config->worker_count == 0 ||
+      config->autoscale.interval <= 0) {
+    return bud_ok();
+  }
+
+  r = uv_timer_init(config->loop, &config->autoscale_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrAutoscaleTimer, r);
+
+  r = uv_timer_start(&config->autoscale_timer,
+                     bud_master_autoscale_cb,
+                     config->autoscale.interval,
+                     config->autoscale.interval);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &config->autoscale_timer,
+             bud_master_ipc_close_cb);
+    return bud_error_num(kBudErrAutoscaleTimer, r);
+  }
+  uv_unref((uv_handle_t*) &config->autoscale_timer);
+
+  return bud_ok();
+}
+
+
+void bud_master_autoscale_cb(uv_timer_t* handle, int status) {
+  int i;
+  int serving;
+  int warming;
+  int busy;
+  int quiet;
+  uint64_t now;
+  uint64_t lag;
+  uint64_t cpu;
+  bud_config_t* config;
+  bud_worker_t* worker;
+
+  config = container_of(handle, bud_config_t, autoscale_timer);
+  now = uv_now(config->loop);
+
+  /* Average over the serving workers, spares and retiring ones are idle */
+  serving = 0;
+  warming = 0;
+  lag = 0;
+  cpu = 0;
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active || worker->spare || worker->draining)
+      continue;
+
+    worker->cpu = bud_master_worker_cpu(worker, config->autoscale.interval);
+    serving++;
+    lag += worker->lag;
+    cpu += worker->cpu;
+    if (worker->warm_until > now)
+      warming++;
+  }
+  if (serving == 0)
+    return;
+  lag /= serving;
+  cpu /= serving;
+
+  /* Quiet is well below the thresholds, so it doesn't flap */
+  busy = (config->autoscale.lag > 0 &&
+          lag >= (uint64_t) config->autoscale.lag) ||
+         (config->autoscale.cpu > 0 &&
+          cpu >= (uint64_t) config->autoscale.cpu);
+  quiet = (config->autoscale.lag <= 0 ||
+           lag < (uint64_t) config->autoscale.lag / 4) &&
+          (config->autoscale.cpu <= 0 ||
+           cpu < (uint64_t) config->autoscale.cpu / 2);
+
+  if (busy) {
+    config->autoscale_quiet = 0;
+
+    /* One at a time, the last one has to take its share first */
+    if (warming == 0 && serving < config->autoscale.max)
+      bud_master_scale_up(config);
+    return;
+  }
+
+  if (!quiet) {
+    config->autoscale_quiet = 0;
+    return;
+  }
+
+  if (++config->autoscale_quiet < BUD_MASTER_SCALE_DOWN_AFTER ||
+      serving <= config->worker_count) {
+    return;
+  }
+  config->autoscale_quiet = 0;
+  bud_master_scale_down(config);
+}
+
+
+bud_error_t bud_master_init_watchdog(bud_config_t* config) {
+  int r;
+
+  if (config->worker_count == 0 || config->watchdog.misses <= 0)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &config->watchdog_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrWatchdogTimer, r);
+
+  r = uv_timer_start(&config->watchdog_timer,
+                     bud_master_watchdog_cb,
+                     BUD_IPC_LOAD_INTERVAL,
+                     BUD_IPC_LOAD_INTERVAL);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &config->watchdog_timer, bud_master_ipc_close_cb);
+    return bud_error_num(kBudErrWatchdogTimer, r);
+  }
+  uv_unref((uv_handle_t*) &config->watchdog_timer);
+
+  return bud_ok();
+}
+
+
+void bud_master_watchdog_cb(uv_timer_t* handle, int status) {
+  int i;
+  uint64_t now;
+  uint64_t timeout;
+  bud_config_t* config;
+  bud_worker_t* worker;
+
+  config = container_of(handle, bud_config_t, watchdog_timer);
+  now = uv_now(config->loop);
+  timeout = (uint64_t) config->watchdog.misses * BUD_IPC_LOAD_INTERVAL;
+
+  /* Draining ones get no clients anyway, and have `drain_timeout` */
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active || worker->draining)
+      continue;
+    if (now - worker->seen < timeout)
+      continue;
+
+    if (worker->hung == 0) {
+      worker->hung = now;
+      bud_log(config,
+              kBudLogWarning,
+              "bud worker<%d> missed %d heartbeats, not balancing to it",
+              worker->proc.pid,
+              config->watchdog.misses);
+      continue;
+    }
+    if (now - worker->hung < (uint64_t) config->watchdog.grace)
+      continue;
+
+    bud_log(config,
+            kBudLogWarning,
+            "bud worker<%d> is stuck for %llums, killing",
+            worker->proc.pid,
+            (unsigned long long) (now - worker->seen));
+    bud_master_replace_worker(worker);
+  }
+}
+
+
+uint32_t bud_master_worker_cpu(bud_worker_t* worker, uint64_t elapsed) {
+  FILE* file;
+  char path[64];
+  char line[512];
+  char* p;
+  size_t len;
+  unsigned long utime;
+  unsigned long stime;
+  uint64_t ticks;
+  uint64_t prev;
+  long hz;
+
+  /* utime and stime are the 14th and 15th fields, after `(comm) state` */
+  snprintf(path, sizeof(path), "/proc/%d/stat", worker->proc.pid);
+  file = fopen(path, "r");
+  if (file == NULL)
+    return 0;
+  len = fread(line, 1, sizeof(line) - 1, file);
+  fclose(file);
+  line[len] = '\0';
+
+  p = strrchr(line, ')');
+  if (p == NULL ||
+      sscanf(p + 1,
+             " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+             &utime,
+             &stime) != 2) {
+    return 0;
+  }
+
+  ticks = (uint64_t) utime + stime;
+  prev = worker->cpu_ticks;
+  worker->cpu_ticks = ticks;
+  hz = sysconf(_SC_CLK_TCK);
+
+  /* First sample, nothing to compare with */
+  if (prev == 0 || ticks < prev || hz <= 0 || elapsed == 0)
+    return 0;
+  return (uint32_t) ((ticks - prev) * 1000 * 100 / hz / elapsed);
+}
+
+
+void bud_master_scale_up(bud_config_t* config) {
+  int i;
+  int id;
+  int used;
+  bud_worker_t* worker;
+  bud_worker_t* slot;
+  bud_error_t err;
+
+  /* Lowest id past the fixed ones, so that hashing keeps their clients */
+  for (id = config->worker_count; ; id++) {
+    used = 0;
+    for (i = 0; i < config->worker_slots; i++) {
+      worker = &config->workers[config->worker_base + i];
+      if (worker->active && !worker->spare && worker->id == id)
+        used = 1;
+    }
+    if (!used)
+      break;
+  }
+
+  /* Any slot that is not respawning, spares may have taken the others */
+  slot = NULL;
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active && worker->close_waiting == 0) {
+      slot = worker;
+      break;
+    }
+  }
+  if (slot == NULL)
+    return;
+
+  slot->config = config;
+  slot->spare = 0;
+  slot->id = id;
+  err = bud_master_spawn_worker(slot);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    return;
+  }
+  slot->warm_until = uv_now(config->loop) + config->autoscale.warmup;
+
+  bud_log(config,
+          kBudLogInfo,
+          "autoscale: added bud worker<%d>",
+          slot->proc.pid);
+}
+
+
+void bud_master_scale_down(bud_config_t* config) {
+  int i;
+  bud_worker_t* worker;
+  bud_worker_t* last;
+
+  /* Highest id goes first, the mapping of the fixed ones stays */
+  last = NULL;
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active || worker->spare || worker->draining)
+      continue;
+    if (worker->id < config->worker_count)
+      continue;
+    if (last == NULL || worker->id > last->id)
+      last = worker;
+  }
+  if (last == NULL)
+    return;
+
+  bud_log(config,
+          kBudLogInfo,
+          "autoscale: retiring bud worker<%d>",
+          last->proc.pid);
+  bud_master_drain_worker(last);
+}
+#endif  /* !_WIN32 */
+
+
+bud_error_t bud_master_spawn_worker(bud_worker_t* worker) {
+  bud_error_t err;
+  bud_config_t* config;
+  int i;
+  int r;
+  int index;
+  uv_process_options_t options;
+
+  config = worker->config;
+  ASSERT(config != NULL, "Worker config absent");
+
+  memset(&options, 0, sizeof(options));
+  options.exit_cb = bud_master_respawn_worker;
+  options.file = config->exepath;
+  if (config->snapshot != NULL && config->snapshot->fd != -1)
+    options.stdio_count = BUD_SNAPSHOT_FD + 1;
+  else if (config->shared_cache.cache != NULL)
+    options.stdio_count = BUD_SHARED_CACHE_FD + 1;
+  else if (config->session_cache.cache != NULL)
+    options.stdio_count = BUD_SESSION_CACHE_FD + 1;
+  else
+    options.stdio_count = 3;
+  options.stdio = calloc(options.stdio_count, sizeof(*options.stdio));
+  options.args = calloc(config->argc + 3, sizeof(*options.args));
+  if (options.stdio == NULL || options.args == NULL) {
+    err = bud_error(kBudErrNoMem);
+    goto done;
+  }
+
+  /* args = { config.argv, "--worker", ["--spare"] } */
+  for (i = 0; i < config->argc; i++)
+    options.args[i] = config->argv[i];
+  options.args[i++] = "--worker";
+  if (worker->spare)
+    options.args[i++] = "--spare";
+  options.args[i] = NULL;
+
+  /* stdio = { pipe, inherit, inherit } */
+  options.stdio[0].flags = UV_CREATE_PIPE |
+                           UV_READABLE_PIPE |
+                           UV_WRITABLE_PIPE;
+  options.stdio[0].data.stream = (uv_stream_t*) &worker->ipc;
+  options.stdio[1].flags = UV_INHERIT_FD;
+  options.stdio[1].data.fd = 1;
+  options.stdio[2].flags = UV_INHERIT_FD;
+  options.stdio[2].data.fd = 2;
+
+  /* stdio[3] = shared session cache */
+  if (config->session_cache.cache != NULL) {
+    options.stdio[BUD_SESSION_CACHE_FD].flags = UV_INHERIT_FD;
+    options.stdio[BUD_SESSION_CACHE_FD].data.fd =
+        config->session_cache.cache->fd;
+  }
+
+  /* stdio[4] = shared SNI and stapling cache, calloc() ignores stdio[3] */
+  if (config->shared_cache.cache != NULL) {
+    options.stdio[BUD_SHARED_CACHE_FD].flags = UV_INHERIT_FD;
+    options.stdio[BUD_SHARED_CACHE_FD].data.fd =
+        config->shared_cache.cache->fd;
+  }
+
+  /* stdio[5] = DER snapshot of contexts */
+  if (config->snapshot != NULL && config->snapshot->fd != -1) {
+    options.stdio[BUD_SNAPSHOT_FD].flags = UV_INHERIT_FD;
+    options.stdio[BUD_SNAPSHOT_FD].data.fd = config->snapshot->fd;
+  }
+
+  r = uv_timer_init(config->loop, &worker->restart_timer);
+  if (r != 0) {
+    err = bud_error_num(kBudErrRestartTimer, r);
+    goto done;
+  }
+
+  r = uv_pipe_init(config->loop, &worker->ipc, 1);
+  if (r != 0) {
+    err = bud_error_num(kBudErrIPCPipeInit, r);
+    goto failed_pipe_init;
+  }
+
+  /* Spares share CPUs with the workers */
+  index = (worker - config->workers) % config->worker_slots;
+  bud_affinity_spawn_start(config, index % config->worker_count);
+  r = uv_spawn(config->loop, &worker->proc, &options);
+  bud_affinity_spawn_end(config);
+
+  if (r != 0) {
+    err = bud_error_num(kBudErrSpawn, r);
+    goto failed_uv_spawn;
+  } else {
+    worker->active = 1;
+    worker->draining = 0;
+    err = bud_ok();
+    bud_log(worker->config,
+            kBudLogInfo,
+            "spawned %sbud worker<%d>",
+            worker->spare ? "spare " : "",
+            worker->proc.pid);
+
+    /* Receive load reports */
+    bud_ipc_init(&worker->ipc_parser, config, bud_master_ipc_msg_cb);
+    worker->clients = 0;
+    worker->lag = 0;
+    worker->shedding = 0;
+    worker->balanced = 0;
+    worker->seen = uv_now(config->loop);
+    worker->hung = 0;
+    worker->warm_until = 0;
+    worker->cpu_ticks = 0;
+    worker->cpu = 0;
+    memset(worker->metrics, 0, sizeof(worker->metrics));
+    worker->handoff = NULL;
+    worker->ipc.data = worker;
+    r = uv_read2_start((uv_stream_t*) &worker->ipc,
+                       bud_master_ipc_alloc_cb,
+                       bud_master_ipc_read_cb);
+    if (r != 0) {
+      bud_error_log(config,
+                    kBudLogWarning,
+                    bud_error_num(kBudErrMasterIPCRead, r));
+    }
+
+    /* Keys, staples and the id are queued before any client */
+    if (!worker->spare)
+      bud_master_send_identity(worker);
+    err = bud_ticket_send(config, (uv_stream_t*) &worker->ipc);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogWarning, err);
+      err = bud_ok();
+    }
+    err = bud_ocsp_send_staples(config, (uv_stream_t*) &worker->ipc);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogWarning, err);
+      err = bud_ok();
+    }
+
+    /* `frontend.shared_listen`, worker accepts on our sockets from now on */
+    err = bud_server_send_shared(config, (uv_stream_t*) &worker->ipc);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogWarning, err);
+      err = bud_ok();
+    }
+
+    /* Pending accept - try balancing */
+    if (config->pending_accept)
+      bud_master_balance_pending(config);
+  }
+
+  goto done;
+
+failed_uv_spawn:
+  uv_close((uv_handle_t*) &worker->ipc, bud_master_ipc_close_cb);
+
+failed_pipe_init:
+  uv_close((uv_handle_t*) &worker->restart_timer, bud_master_ipc_close_cb);
+
+done:
+  free(options.stdio);
+  free(options.args);
+  options.stdio = NULL;
+  options.args = NULL;
+  return err;
+}
+
+
+void bud_master_respawn_worker(uv_process_t* proc,
+                               int64_t exit_status,
+                               int term_signal) {
+  bud_worker_t* worker;
+
+  worker = container_of(proc, bud_worker_t, proc);
+  ASSERT(worker != NULL, "Proc has no worker");
+
+  /* Replaced by the new generation, see bud_master_reload() */
+  if (worker->draining) {
+    bud_log(worker->config,
+            kBudLogInfo,
+            "bud worker<%d> drained, exit status: %d",
+            proc->pid,
+            (int) exit_status);
+    return bud_master_kill_worker(worker, 0, NULL);
+  }
+
+  bud_log(worker->config,
+          kBudLogWarning,
+          "bud worker<%d> died, signal: %d",
+          proc->pid,
+          term_signal);
+  bud_master_replace_worker(worker);
+}
+
+
+void bud_master_replace_worker(bud_worker_t* worker) {
+  /* Standby takes over right away, the dead one comes back as a spare */
+  if (!worker->spare && bud_master_promote_spare(worker) == 0) {
+    worker->spare = 1;
+    worker->id = -1;
+  }
+
+  bud_master_kill_worker(worker,
+                         (uint64_t) worker->config->restart_timeout,
+                         bud_master_spawn_worker);
+}
+
+
+int bud_master_promote_spare(bud_worker_t* dead) {
+  int i;
+  bud_config_t* config;
+  bud_worker_t* worker;
+  bud_error_t err;
+
+  config = dead->config;
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active ||
+        !worker->spare ||
+        worker->draining ||
+        worker->hung != 0) {
+      continue;
+    }
+
+    err = bud_ipc_send(config,
+                       (uv_stream_t*) &worker->ipc,
+                       kBudIPCPromote,
+                       NULL,
+                       0,
+                       NULL,
+                       0);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogWarning, err);
+      continue;
+    }
+
+    worker->spare = 0;
+    worker->id = dead->id;
+    bud_master_send_identity(worker);
+    bud_log(config,
+            kBudLogInfo,
+            "spare bud worker<%d> replaces bud worker<%d>",
+            worker->proc.pid,
+            dead->proc.pid);
+
+    /* Clients that were waiting for the dead one */
+    if (config->pending_accept)
+      bud_master_balance_pending(config);
+    return 0;
+  }
+
+  bud_log(config, kBudLogWarning, "no spare bud worker to promote");
+  return -1;
+}
+
+
+void bud_master_kill_worker(bud_worker_t* worker,
+                            uint64_t delay,
+                            bud_worker_kill_cb cb) {
+  int r;
+  ASSERT(worker->active, "Tried to kill inactive worker");
+
+  uv_process_kill(&worker->proc, SIGKILL);
+  worker->active = 0;
+  worker->kill_cb = cb;
+  worker->proc.data = worker;
+  worker->ipc.data = worker;
+  worker->restart_timer.data = worker;
+  worker->close_waiting = 3;
+  uv_close((uv_handle_t*) &worker->proc, bud_worker_close_cb);
+  uv_close((uv_handle_t*) &worker->ipc, bud_worker_close_cb);
+  bud_ipc_destroy(&worker->ipc_parser);
+  if (worker->handoff != NULL)
+    bud_handoff_free(worker->handoff);
+  worker->handoff = NULL;
+  bud_metrics_forget(worker);
+  if (delay == 0) {
+    uv_close((uv_handle_t*) &worker->restart_timer, bud_worker_close_cb);
+  } else {
+    r = uv_timer_start(&worker->restart_timer, bud_worker_timer_cb, delay, 0);
+    if (r != 0)
+      uv_close((uv_handle_t*) &worker->restart_timer, bud_worker_close_cb);
+  }
+}
+
+
+void bud_worker_timer_cb(uv_timer_t* handle, int status) {
+  bud_worker_t* worker;
+
+  worker = handle->data;
+  ASSERT(worker != NULL, "Timers\'s worker absent");
+  uv_close((uv_handle_t*) &worker->restart_timer, bud_worker_close_cb);
+}
+
+
+void bud_worker_close_cb(uv_handle_t* handle) {
+  bud_worker_t* worker;
+
+  worker = handle->data;
+  ASSERT(worker != NULL, "Handle\'s worker absent");
+
+  if (--worker->close_waiting == 0 && worker->kill_cb != NULL)
+    worker->kill_cb(worker);
+}
+
+
+void bud_master_ipc_close_cb(uv_handle_t* handle) {
+  /* No-op */
+}
+
+
+void bud_master_ipc_alloc_cb(uv_handle_t* handle,
+                             size_t suggested_size,
+                             uv_buf_t* buf) {
+  static char tmp[128];
+
+  *buf = uv_buf_init(tmp, sizeof(tmp));
+}
+
+
+void bud_master_ipc_read_cb(uv_pipe_t* pipe,
+                            ssize_t nread,
+                            const uv_buf_t* buf,
+                            uv_handle_type pending) {
+  bud_worker_t* worker;
+  bud_error_t err;
+
+  worker = container_of(pipe, bud_worker_t, ipc);
+
+  /* Worker's death is handled by bud_master_respawn_worker() */
+  if (nread <= 0) {
+    if (nread < 0)
+      uv_read_stop((uv_stream_t*) pipe);
+    return;
+  }
+
+  /* Lost the framing, nothing else on this channel can be trusted */
+  err = bud_ipc_parse(&worker->ipc_parser, buf->base, nread);
+  if (!bud_is_ok(err)) {
+    bud_error_log(worker->config, kBudLogWarning, err);
+    if (worker->active)
+      bud_master_replace_worker(worker);
+    return;
+  }
+
+  /* Only relays of draining workers come with sockets */
+  if (pending != UV_UNKNOWN_HANDLE)
+    bud_master_accept_handoff(worker, pending);
+}
+
+
+void bud_master_ipc_msg_cb(bud_ipc_t* ipc, bud_ipc_msg_t* msg) {
+  bud_worker_t* worker;
+  const unsigned char* data;
+
+  worker = container_of(ipc, bud_worker_t, ipc_parser);
+
+  /* Any message means that its loop is running, see `workers_watchdog` */
+  worker->seen = uv_now(ipc->config->loop);
+  if (worker->hung != 0) {
+    worker->hung = 0;
+    bud_log(ipc->config,
+            kBudLogWarning,
+            "bud worker<%d> is responsive again",
+            worker->proc.pid);
+    if (ipc->config->pending_accept)
+      bud_master_balance_pending(ipc->config);
+  }
+
+  if (msg->type == kBudIPCMetrics)
+    return bud_metrics_receive(worker, msg->data, msg->size);
+  if (msg->type == kBudIPCMetricRows)
+    return bud_metrics_receive_rows(worker, msg->data, msg->size);
+  if (msg->type == kBudIPCAdmin)
+    return bud_admin_ipc_reply(worker, msg->data, msg->size);
+  if (msg->type == kBudIPCHandoff)
+    return bud_master_ipc_handoff(worker, msg);
+
+  /* Socket is taken in bud_master_ipc_read_cb() */
+  if (msg->type == kBudIPCHandoffFd)
+    return;
+
+  if (msg->type != kBudIPCLoad || msg->size < 8) {
+    bud_log(ipc->config,
+            kBudLogWarning,
+            "master received unknown ipc message: %d",
+            msg->type);
+    return;
+  }
+
+  data = (const unsigned char*) msg->data;
+  worker->clients = (data[0] << 24) | (data[1] << 16) |
+                    (data[2] << 8) | data[3];
+  worker->lag = (data[4] << 24) | (data[5] << 16) |
+                (data[6] << 8) | data[7];
+  worker->shedding = msg->size >= 12 &&
+                     (data[11] & BUD_IPC_LOAD_SHEDDING) != 0;
+  worker->balanced = 0;
+
+  /* Worker might be able to take more clients now */
+  if (ipc->config->pending_accept)
+    bud_master_balance_pending(ipc->config);
+}
+
+
+void bud_master_ipc_handoff(bud_worker_t* worker, bud_ipc_msg_t* msg) {
+  bud_config_t* config;
+
+  /* Sockets of the previous one never came */
+  config = worker->config;
+  if (worker->handoff != NULL)
+    bud_handoff_free(worker->handoff);
+
+  worker->handoff = bud_handoff_new(config, msg->size);
+  if (worker->handoff == NULL) {
+    bud_error_log(config,
+                  kBudLogWarning,
+                  bud_error_str(kBudErrNoMem, "bud_handoff_t"));
+    return;
+  }
+  memcpy(worker->handoff->payload, msg->data, msg->size);
+}
+
+
+void bud_master_accept_handoff(bud_worker_t* worker, uv_handle_type pending) {
+  int r;
+  bud_config_t* config;
+  bud_handoff_t* handoff;
+  bud_worker_t* target;
+  bud_error_t err;
+
+  config = worker->config;
+  handoff = worker->handoff;
+  if (handoff == NULL) {
+    bud_log(config,
+            kBudLogWarning,
+            "master received unexpected handle from bud worker<%d>",
+            worker->proc.pid);
+    return;
+  }
+
+  r = bud_handoff_accept(handoff, (uv_stream_t*) &worker->ipc, pending, &err);
+
+  /* Backend's socket is next */
+  if (r == 0)
+    return;
+  worker->handoff = NULL;
+  if (r == -1)
+    goto fatal;
+
+  /* Same as a new client, but it is here to stay */
+  target = bud_master_select_worker(config);
+  if (target == NULL) {
+    bud_log(config,
+            kBudLogWarning,
+            "no bud worker to take relay of bud worker<%d>, closing",
+            worker->proc.pid);
+    return bud_handoff_free(handoff);
+  }
+
+  err = bud_handoff_send(handoff,
+                         (uv_stream_t*) &target->ipc,
+                         (uv_stream_t*) &handoff->handles[0],
+                         (uv_stream_t*) &handoff->handles[1],
+                         bud_master_handoff_cb);
+  if (!bud_is_ok(err))
+    goto fatal;
+  target->balanced++;
+  return;
+
+fatal:
+  bud_error_log(config, kBudLogWarning, err);
+  bud_handoff_free(handoff);
+}
+
+
+void bud_master_handoff_cb(bud_handoff_t* handoff, int status) {
+  if (status != 0 && status != UV_ECANCELED) {
+    bud_log(handoff->config,
+            kBudLogWarning,
+            "master handoff write_cb() failed with (%d) \"%s\"",
+            status,
+            uv_strerror(status));
+  }
+
+  /* The new worker has its own copies of the sockets */
+  bud_handoff_free(handoff);
+}
+
+
+bud_worker_t* bud_master_select_worker(bud_config_t* config) {
+  int i;
+  int index;
+  uint32_t load;
+  uint32_t best_load;
+  uint32_t warm_load;
+  int best_lagging;
+  int lagging;
+  uint64_t now;
+  bud_worker_t* worker;
+  bud_worker_t* best;
+
+  /*
+   * Least loaded worker, preferring ones with responsive event loop, and
+   * ones that aren't shedding load (those read their pipe only later).
+   * Start after the last pick, so that ties are resolved round-robin.
+   */
+  best = NULL;
+  best_load = 0;
+  best_lagging = 0;
+  now = 0;
+  warm_load = 0;
+  if (config->autoscale.max > 0) {
+    now = uv_now(config->loop);
+    warm_load = bud_master_warm_load(config, now);
+  }
+  for (i = 1; i <= config->worker_slots; i++) {
+    index = (config->last_worker + i) % config->worker_slots;
+    worker = &config->workers[config->worker_base + index];
+    if (!worker->active ||
+        worker->spare ||
+        worker->draining ||
+        worker->hung != 0) {
+      continue;
+    }
+
+    load = worker->clients + worker->balanced;
+    if (config->frontend.max_clients > 0 &&
+        load >= (uint32_t) config->frontend.max_clients) {
+      continue;
+    }
+
+    /*
+     * Autoscaled worker is still warming up: look busier than it is, by the
+     * others' average load times the part of `warmup` that is left. So it
+     * doesn't take every new client while its caches are cold.
+     */
+    if (worker->warm_until > now) {
+      load += (uint32_t) ((uint64_t) warm_load * (worker->warm_until - now) /
+                          config->autoscale.warmup);
+    }
+    lagging = worker->shedding ? 2 : worker->lag > BUD_MASTER_MAX_LAG;
+    if (best == NULL ||
+        lagging < best_lagging ||
+        (lagging == best_lagging && load < best_load)) {
+      best = worker;
+      best_load = load;
+      best_lagging = lagging;
+      config->last_worker = index;
+    }
+  }
+
+  return best;
+}
+
+
+bud_worker_t* bud_master_select_by_peer(bud_config_t* config,
+                                        uv_tcp_t* client,
+                                        bud_worker_t* fallback) {
+  int r;
+  int len;
+  struct sockaddr_storage peer;
+  const char* key;
+  size_t key_len;
+
+  len = sizeof(peer);
+  r = uv_tcp_getpeername(client, (struct sockaddr*) &peer, &len);
+  if (r != 0)
+    return fallback;
+  if (peer.ss_family == AF_INET) {
+    key = (const char*) &((struct sockaddr_in*) &peer)->sin_addr;
+    key_len = sizeof(struct in_addr);
+  } else if (peer.ss_family == AF_INET6) {
+    key = (const char*) &((struct sockaddr_in6*) &peer)->sin6_addr;
+    key_len = sizeof(struct in6_addr);
+  } else {
+    return fallback;
+  }
+
+  return bud_master_select_by_hash(config,
+                                   bud_hash_lower(BUD_HASH_INIT, key, key_len),
+                                   fallback);
+}
+
+
+bud_worker_t* bud_master_select_by_hash(bud_config_t* config,
+                                        uint32_t hash,
+                                        bud_worker_t* fallback) {
+  int i;
+  uint32_t score;
+  uint32_t best_score;
+  bud_worker_t* worker;
+  bud_worker_t* best;
+
+  /*
+   * Rendezvous hashing over worker ids (not pids), so that clients of a
+   * dead worker come back to it once it is respawned (or go to the spare
+   * that took its id), and reload keeps the mapping.
+   */
+  best = NULL;
+  best_score = 0;
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active ||
+        worker->spare ||
+        worker->draining ||
+        worker->shedding ||
+        worker->hung != 0) {
+      continue;
+    }
+    if (config->frontend.max_clients > 0 &&
+        worker->clients + worker->balanced >=
+            (uint32_t) config->frontend.max_clients) {
+      continue;
+    }
+
+    /* Murmur3 finalizer of the (key, slot) pair */
+    score = hash ^ (0x9e3779b9 * (uint32_t) (worker->id + 1));
+    score ^= score >> 16;
+    score *= 0x85ebca6b;
+    score ^= score >> 13;
+    score *= 0xc2b2ae35;
+    score ^= score >> 16;
+    if (best != NULL && score <= best_score)
+      continue;
+    best = worker;
+    best_score = score;
+  }
+
+  return best == NULL ? fallback : best;
+}
+
+
+bud_worker_t* bud_master_select_by_tag(bud_config_t* config,
+                                       const bud_client_hello_t* hello,
+                                       bud_worker_t* fallback) {
+  int i;
+  int id;
+  bud_worker_t* worker;
+
+  /* Tickets aren't tagged, every worker can decrypt them */
+  id = bud_session_tag(hello->session, hello->session_len);
+  if (id == -1)
+    return fallback;
+
+  /* Same skips as in bud_master_select_by_hash() */
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active ||
+        worker->spare ||
+        worker->draining ||
+        worker->shedding ||
+        worker->hung != 0 ||
+        worker->id != id) {
+      continue;
+    }
+    if (config->frontend.max_clients > 0 &&
+        worker->clients + worker->balanced >=
+            (uint32_t) config->frontend.max_clients) {
+      continue;
+    }
+    return worker;
+  }
+
+  /* Issuer is gone or busy, the client does a full handshake elsewhere */
+  return fallback;
+}
+
+
+void bud_master_send_identity(bud_worker_t* worker) {
+  bud_error_t err;
+  uint32_t id;
+  char data[4];
+
+  id = (uint32_t) worker->id;
+  data[0] = (id >> 24) & 0xff;
+  data[1] = (id >> 16) & 0xff;
+  data[2] = (id >> 8) & 0xff;
+  data[3] = id & 0xff;
+  err = bud_ipc_send(worker->config,
+                     (uv_stream_t*) &worker->ipc,
+                     kBudIPCIdentity,
+                     data,
+                     sizeof(data),
+                     NULL,
+                     0);
+  if (!bud_is_ok(err))
+    bud_error_log(worker->config, kBudLogWarning, err);
+}
+
+
+uint32_t bud_master_warm_load(bud_config_t* config, uint64_t now) {
+  int i;
+  uint64_t total;
+  uint32_t count;
+  bud_worker_t* worker;
+
+  total = 0;
+  count = 0;
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active ||
+        worker->spare ||
+        worker->draining ||
+        worker->warm_until > now) {
+      continue;
+    }
+    total += worker->clients + worker->balanced;
+    count++;
+  }
+
+  return count == 0 ? 0 : (uint32_t) (total / count);
+}
+
+
+int bud_master_fixed_slots(bud_config_t* config) {
+  /* Serving workers and spares, autoscaled ones are after them */
+  if (config->worker_count == 0 || config->spare_count <= 0)
+    return config->worker_count;
+  return config->worker_count + config->spare_count;
+}
+
+
+void bud_master_balance_pending(bud_config_t* config) {
+  int i;
+  bud_server_t* server;
+
+  config->pending_accept = 0;
+  for (i = 0; i < config->listener_count; i++) {
+    server = config->listeners[i].server;
+    if (server == NULL || !server->pending)
+      continue;
+
+    /* Sets the flags again if there is still no worker */
+    server->pending = 0;
+    bud_master_balance(server);
+  }
+}
+
+
+void bud_master_balance(struct bud_server_s* server) {
+  int r;
+  bud_config_t* config;
+  bud_worker_t* worker;
+  bud_master_msg_t* msg;
+
+  config = server->config;
+
+  if (config->worker_count == 0) {
+    bud_log(config, kBudLogDebug, "master self accept");
+
+    /* Master = worker */
+    return bud_client_create(config,
+                             server->listener,
+                             (uv_stream_t*) &server->tcp);
+  }
+
+  bud_log(config,
+          kBudLogDebug,
+          "master balance");
+
+  /* All workers are down or overloaded... wait */
+  worker = bud_master_select_worker(config);
+  if (worker == NULL) {
+    server->pending = 1;
+    config->pending_accept = 1;
+    return;
+  }
+
+  msg = bud_slab_alloc(&config->master_msg_slab);
+  if (msg == NULL) {
+    bud_error_log(config,
+                  kBudLogWarning,
+                  bud_error_str(kBudErrNoMem, "bud_master_msg_t"));
+    return;
+  }
+  msg->config = config;
+  msg->listener = server->listener - config->listeners;
+  msg->peek_init = 0;
+  msg->closing = 0;
+
+  /* Accept handle */
+  r = uv_tcp_init(config->loop, &msg->client);
   if (r != 0) {
     bud_log(config,
             kBudLogWarning,
-            "master uv_write2() failed with (%d) \"%s\"",
+            "master uv_tcp_init() failed with (%d) \"%s\"",
+            r,
+            uv_strerror(r));
+    goto failed_tcp_init;
+  }
+  msg->client.data = msg;
+
+  r = uv_accept((uv_stream_t*) &server->tcp, (uv_stream_t*) &msg->client);
+  if (r != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "master uv_accept() failed with (%d) \"%s\"",
             r,
             uv_strerror(r));
     goto failed_accept;
   }
-  return;
+
+  /* Returning clients go to the worker that has their session */
+  if (config->workers_ip_hash)
+    worker = bud_master_select_by_peer(config, &msg->client, worker);
+
+  /* Servername's shard (or the session) is known once the hello is here */
+  if (config->workers_sni_hash || config->workers_session_hash) {
+    bud_hello_parser_init(&msg->parser);
+    msg->peek_deadline = uv_now(config->loop) + BUD_MASTER_PEEK_TIMEOUT;
+    return bud_master_peek(msg);
+  }
+
+  return bud_master_balance_send(msg, worker);
 
 failed_accept:
-  uv_close((uv_handle_t*) &msg->client, bud_master_msg_close_cb);
+  bud_master_msg_close(msg);
   return;
 
 failed_tcp_init:
-  free(msg);
+  bud_slab_free(&config->master_msg_slab, msg);
+}
+
+
+void bud_master_balance_send(bud_master_msg_t* msg, bud_worker_t* worker) {
+  int r;
+  uint32_t index;
+  bud_config_t* config;
+  uv_buf_t buf;
+
+  config = msg->config;
+
+  /* Worker picks the default context and backends by the listener */
+  index = msg->listener;
+  bud_ipc_write_header(msg->header, kBudIPCBalance, 4);
+  msg->header[BUD_IPC_HEADER_SIZE] = (index >> 24) & 0xff;
+  msg->header[BUD_IPC_HEADER_SIZE + 1] = (index >> 16) & 0xff;
+  msg->header[BUD_IPC_HEADER_SIZE + 2] = (index >> 8) & 0xff;
+  msg->header[BUD_IPC_HEADER_SIZE + 3] = index & 0xff;
+  buf = uv_buf_init(msg->header, sizeof(msg->header));
+
+  r = uv_write2(&msg->req,
+                (uv_stream_t*) &worker->ipc,
+                &buf,
+                1,
+                (uv_stream_t*) &msg->client,
+                bud_master_msg_send_cb);
+  if (r != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "master uv_write2() failed with (%d) \"%s\"",
+            r,
+            uv_strerror(r));
+    return bud_master_msg_close(msg);
+  }
+  worker->balanced++;
+}
+
+
+void bud_master_peek(bud_master_msg_t* msg) {
+  int r;
+  uv_os_fd_t fd;
+  ssize_t peeked;
+  bud_error_t err;
+  bud_client_hello_t hello;
+  char data[BUD_MASTER_PEEK_MAX];
+
+  r = uv_fileno((uv_handle_t*) &msg->client, &fd);
+  if (r != 0)
+    return bud_master_peek_done(msg, NULL);
+
+  /* Bytes stay in the socket, worker reads them again */
+  do
+    peeked = recv(fd, data, sizeof(data), MSG_PEEK | MSG_DONTWAIT);
+  while (peeked == -1 && errno == EINTR);
+
+  if (peeked == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    bud_log(msg->config,
+            kBudLogDebug,
+            "master peek failed with (%d) \"%s\"",
+            errno,
+            strerror(errno));
+    return bud_master_msg_close(msg);
+  }
+
+  /* Closed before sending anything */
+  if (peeked == 0)
+    return bud_master_msg_close(msg);
+
+  if (peeked > 0) {
+    /* Not a TLS handshake (PROXY header, plaintext), nothing to shard by */
+    if (data[0] != 0x16)
+      return bud_master_peek_done(msg, NULL);
+
+    /* Every peek returns everything from the start, feed only the new part */
+    err = bud_error(kBudErrParserNeedMore);
+    if ((size_t) peeked > msg->parser.consumed) {
+      err = bud_hello_parser_execute(&msg->parser,
+                                     data + msg->parser.consumed,
+                                     peeked - msg->parser.consumed,
+                                     &hello);
+    }
+    if (bud_is_ok(err))
+      return bud_master_peek_done(msg, &hello);
+
+    /* Malformed, or larger than the peek, worker will deal with it */
+    if (err.code != kBudErrParserNeedMore || peeked == sizeof(data))
+      return bud_master_peek_done(msg, NULL);
+  }
+
+  if (uv_now(msg->config->loop) >= msg->peek_deadline)
+    return bud_master_peek_done(msg, NULL);
+
+  /*
+   * Socket stays readable while the peeked part is there, so it is polled
+   * with a timer instead of waiting for the readability.
+   */
+  if (!msg->peek_init) {
+    r = uv_timer_init(msg->config->loop, &msg->peek_timer);
+    if (r != 0)
+      return bud_master_peek_done(msg, NULL);
+    msg->peek_timer.data = msg;
+    msg->peek_init = 1;
+  }
+  r = uv_timer_start(&msg->peek_timer,
+                     bud_master_peek_timer_cb,
+                     BUD_MASTER_PEEK_INTERVAL,
+                     0);
+  if (r != 0)
+    return bud_master_peek_done(msg, NULL);
+}
+
+
+void bud_master_peek_timer_cb(uv_timer_t* handle, int status) {
+  bud_master_peek(handle->data);
+}
+
+
+void bud_master_peek_done(bud_master_msg_t* msg,
+                          const bud_client_hello_t* hello) {
+  bud_config_t* config;
+  bud_worker_t* worker;
+  uint32_t hash;
+
+  config = msg->config;
+
+  /* Workers may have changed while the hello was on its way */
+  worker = bud_master_select_worker(config);
+  if (worker != NULL && hello != NULL && config->workers_session_hash) {
+    worker = bud_master_select_by_tag(config, hello, worker);
+  } else if (worker != NULL && hello != NULL && hello->servername_len != 0) {
+    hash = bud_hash_lower(BUD_HASH_INIT,
+                          hello->servername,
+                          hello->servername_len);
+    worker = bud_master_select_by_hash(config, hash, worker);
+  }
+  bud_hello_parser_destroy(&msg->parser);
+
+  if (worker == NULL) {
+    bud_log(config, kBudLogWarning, "master: no worker for peeked client");
+    return bud_master_msg_close(msg);
+  }
+
+  bud_master_balance_send(msg, worker);
+}
+
+
+void bud_master_msg_close(bud_master_msg_t* msg) {
+  /* Parser is destroyed in bud_master_peek_done(), if it was used */
+  msg->closing = 1;
+  if (msg->peek_init) {
+    msg->closing++;
+    uv_close((uv_handle_t*) &msg->peek_timer, bud_master_msg_close_cb);
+  }
+  uv_close((uv_handle_t*) &msg->client, bud_master_msg_close_cb);
 }
 
 
 void bud_master_msg_close_cb(uv_handle_t* handle) {
   bud_master_msg_t* msg;
 
-  msg = container_of(handle, bud_master_msg_t, client);
-  free(msg);
+  msg = handle->data;
+  if (--msg->closing != 0)
+    return;
+  bud_slab_free(&msg->config->master_msg_slab, msg);
 }
 
 
@@ -463,5 +2130,92 @@ void bud_master_msg_send_cb(uv_write_t* req, int status) {
             uv_strerror(status));
   }
 
-  uv_close((uv_handle_t*) &msg->client, bud_master_msg_close_cb);
+  bud_master_msg_close(msg);
+}
+
+
+bud_error_t bud_master_init_stapling(bud_config_t* config) {
+  int r;
+
+  /* Workers are doing it themselves */
+  if (!config->stapling.enabled || config->worker_count == 0)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &config->stapling_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrStaplingTimer, r);
+
+  /* Fetch right away, then check for refresh periodically */
+  r = uv_timer_start(&config->stapling_timer,
+                     bud_master_stapling_timer_cb,
+                     0,
+                     BUD_MASTER_STAPLING_INTERVAL);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &config->stapling_timer, bud_master_ipc_close_cb);
+    return bud_error_num(kBudErrStaplingTimer, r);
+  }
+  uv_unref((uv_handle_t*) &config->stapling_timer);
+
+  return bud_ok();
+}
+
+
+void bud_master_stapling_timer_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+
+  config = container_of(handle, bud_config_t, stapling_timer);
+  bud_ocsp_prewarm(config);
+}
+
+
+bud_error_t bud_master_init_tickets(bud_config_t* config) {
+  uint64_t interval;
+  int r;
+
+  /* Fixed `ticket_key` is shared with other instances, it can't change */
+  if (config->frontend.ticket_fixed || config->frontend.ticket_rotate <= 0)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &config->ticket_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrTicketTimer, r);
+
+  interval = (uint64_t) config->frontend.ticket_rotate * 1000;
+  r = uv_timer_start(&config->ticket_timer,
+                     bud_master_ticket_timer_cb,
+                     interval,
+                     interval);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &config->ticket_timer, bud_master_ipc_close_cb);
+    return bud_error_num(kBudErrTicketTimer, r);
+  }
+  uv_unref((uv_handle_t*) &config->ticket_timer);
+
+  return bud_ok();
+}
+
+
+void bud_master_ticket_timer_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_worker_t* worker;
+  bud_error_t err;
+  int i;
+
+  config = container_of(handle, bud_config_t, ticket_timer);
+  err = bud_ticket_rotate(config);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    return;
+  }
+
+  /* Draining ones get them too, they may still be renewing tickets */
+  for (i = 0; i < config->worker_slots * 2; i++) {
+    worker = &config->workers[i];
+    if (!worker->active)
+      continue;
+
+    err = bud_ticket_send(config, (uv_stream_t*) &worker->ipc);
+    if (!bud_is_ok(err))
+      bud_error_log(config, kBudLogWarning, err);
+  }
 }
@@ -1,8 +1,12 @@
 #ifndef SRC_MASTER_H_
 #define SRC_MASTER_H_
 
+#include <stdint.h>  /* uint32_t */
+
 #include "config.h"
 #include "error.h"
+#include "ipc.h"
+#include "metrics.h"
 
 /* Forward declaration */
 struct bud_server_s;
@@ -12,6 +16,7 @@ typedef bud_error_t (*bud_worker_kill_cb)(bud_worker_t* worker);
 
 struct bud_worker_s {
   int active;
+  int draining;
 
   bud_config_t* config;
   uv_process_t proc;
@@ -20,6 +25,48 @@ struct bud_worker_s {
   int close_waiting;
 
   bud_worker_kill_cb kill_cb;
+
+  /*
+   * Standby (`workers_spare`), not balanced to. `id` - position among the
+   * serving workers for `workers_balance`, handed over on promotion.
+   */
+  int spare;
+  int id;
+
+  /* Load, as reported by the worker (see kBudIPCLoad) */
+  bud_ipc_t ipc_parser;
+  uint32_t clients;
+  uint32_t lag;
+  int shedding;
+
+  /* Handles sent since the last report */
+  uint32_t balanced;
+
+  /*
+   * Time of the last message, and of the missed heartbeats that took it out
+   * of balancing (0 - it is responsive), see `workers_watchdog`
+   */
+  uint64_t seen;
+  uint64_t hung;
+
+  /* Relay of the draining worker, waiting for its sockets */
+  struct bud_handoff_s* handoff;
+
+  /*
+   * `workers_autoscale`: caches are cold until `warm_until`, gets a smaller
+   * share of clients till then. CPU ticks at the last check, and percent
+   * of one core used since the check before it.
+   */
+  uint64_t warm_until;
+  uint64_t cpu_ticks;
+  uint32_t cpu;
+
+  /* As reported by the worker (see kBudIPCMetrics) */
+  uint64_t metrics[kBudMetricCount];
+
+  /* Last kBudIPCMetricRows of every table, as they came */
+  char* rows[kBudMetricsTableCount];
+  size_t rows_size[kBudMetricsTableCount];
 };
 
 bud_error_t bud_master(bud_config_t* config);
@@ -0,0 +1,180 @@
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* malloc, realloc, free */
+#include <string.h>  /* memset */
+
+#include "openssl/crypto.h"
+
+#include "memstat.h"
+
+const char* const bud_mem_tag_names[kBudMemTagCount] = {
+  "openssl",
+  "ssl",
+  "ssl_ctx",
+  "ringbuffer",
+  "clients",
+  "http",
+  "caches",
+  "other"
+};
+
+#ifdef BUD_MEMSTAT
+
+typedef union bud_mem_header_u bud_mem_header_t;
+
+/* Precedes every allocation, keeps the rest of it aligned */
+union bud_mem_header_u {
+  struct {
+    size_t size;
+    bud_mem_tag_t tag;
+  } h;
+  long double align;
+};
+
+/* Updated by every thread of the process, see `threads` */
+static bud_mem_stat_t bud_mem_live[kBudMemTagCount];
+static __thread bud_mem_tag_t bud_mem_crypto_tag = kBudMemOpenSSL;
+
+static void* bud_mem_realloc(void* ptr, size_t size);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+static void* bud_mem_crypto_malloc(size_t size, const char* file, int line);
+static void* bud_mem_crypto_realloc(void* ptr,
+                                    size_t size,
+                                    const char* file,
+                                    int line);
+static void bud_mem_crypto_free(void* ptr, const char* file, int line);
+#else  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+static void* bud_mem_crypto_malloc(size_t size);
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+
+void bud_mem_init() {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  CRYPTO_set_mem_functions(bud_mem_crypto_malloc,
+                           bud_mem_crypto_realloc,
+                           bud_mem_crypto_free);
+#else  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+  CRYPTO_set_mem_functions(bud_mem_crypto_malloc,
+                           bud_mem_realloc,
+                           bud_mem_free);
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+}
+
+
+void* bud_mem_alloc(bud_mem_tag_t tag, size_t size) {
+  bud_mem_header_t* h;
+
+  h = malloc(sizeof(*h) + size);
+  if (h == NULL)
+    return NULL;
+  h->h.size = size;
+  h->h.tag = tag;
+  __sync_fetch_and_add(&bud_mem_live[tag].bytes, size);
+  __sync_fetch_and_add(&bud_mem_live[tag].count, 1);
+  if (size >= BUD_MEM_LARGE)
+    __sync_fetch_and_add(&bud_mem_live[tag].large, 1);
+  return h + 1;
+}
+
+
+void* bud_mem_calloc(bud_mem_tag_t tag, size_t count, size_t size) {
+  void* res;
+
+  if (size != 0 && count > ((size_t) -1 - sizeof(bud_mem_header_t)) / size)
+    return NULL;
+  res = bud_mem_alloc(tag, count * size);
+  if (res != NULL)
+    memset(res, 0, count * size);
+  return res;
+}
+
+
+void* bud_mem_realloc(void* ptr, size_t size) {
+  bud_mem_header_t* h;
+  bud_mem_tag_t tag;
+  size_t old;
+
+  if (ptr == NULL)
+    return bud_mem_alloc(bud_mem_crypto_tag, size);
+
+  /* Keeps the tag it was allocated with */
+  h = (bud_mem_header_t*) ptr - 1;
+  tag = h->h.tag;
+  old = h->h.size;
+  h = realloc(h, sizeof(*h) + size);
+  if (h == NULL)
+    return NULL;
+  h->h.size = size;
+  __sync_fetch_and_add(&bud_mem_live[tag].bytes, size);
+  __sync_fetch_and_sub(&bud_mem_live[tag].bytes, old);
+  return h + 1;
+}
+
+
+void bud_mem_free(void* ptr) {
+  bud_mem_header_t* h;
+
+  if (ptr == NULL)
+    return;
+
+  h = (bud_mem_header_t*) ptr - 1;
+  __sync_fetch_and_sub(&bud_mem_live[h->h.tag].bytes, h->h.size);
+  __sync_fetch_and_sub(&bud_mem_live[h->h.tag].count, 1);
+  free(h);
+}
+
+
+bud_mem_tag_t bud_mem_scope(bud_mem_tag_t tag) {
+  bud_mem_tag_t prev;
+
+  prev = bud_mem_crypto_tag;
+  bud_mem_crypto_tag = tag;
+  return prev;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+void* bud_mem_crypto_malloc(size_t size, const char* file, int line) {
+  return bud_mem_alloc(bud_mem_crypto_tag, size);
+}
+
+
+void* bud_mem_crypto_realloc(void* ptr,
+                             size_t size,
+                             const char* file,
+                             int line) {
+  return bud_mem_realloc(ptr, size);
+}
+
+
+void bud_mem_crypto_free(void* ptr, const char* file, int line) {
+  bud_mem_free(ptr);
+}
+#else  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+void* bud_mem_crypto_malloc(size_t size) {
+  return bud_mem_alloc(bud_mem_crypto_tag, size);
+}
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+
+void bud_mem_stats(bud_mem_stat_t* stats) {
+  int i;
+
+  for (i = 0; i < kBudMemTagCount; i++) {
+    stats[i].bytes = __sync_fetch_and_add(&bud_mem_live[i].bytes, 0);
+    stats[i].count = __sync_fetch_and_add(&bud_mem_live[i].count, 0);
+    stats[i].large = __sync_fetch_and_add(&bud_mem_live[i].large, 0);
+  }
+}
+
+#else  /* !BUD_MEMSTAT */
+
+bud_mem_tag_t bud_mem_scope(bud_mem_tag_t tag) {
+  return kBudMemOpenSSL;
+}
+
+
+void bud_mem_stats(bud_mem_stat_t* stats) {
+  memset(stats, 0, sizeof(*stats) * kBudMemTagCount);
+}
+
+#endif  /* BUD_MEMSTAT */
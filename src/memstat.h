@@ -0,0 +1,78 @@
+#ifndef SRC_MEMSTAT_H_
+#define SRC_MEMSTAT_H_
+
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* malloc, calloc, free, size_t */
+
+typedef enum bud_mem_tag_e bud_mem_tag_t;
+typedef struct bud_mem_stat_s bud_mem_stat_t;
+
+enum bud_mem_tag_e {
+  /* OpenSSL's allocations outside of the scopes below */
+  kBudMemOpenSSL,
+
+  /* OpenSSL's allocations while creating and driving clients' SSLs */
+  kBudMemSSL,
+
+  /* OpenSSL's allocations while loading SNI contexts */
+  kBudMemSSLCtx,
+
+  /* Chunks of the ringbuffer pools, sampled from their counters */
+  kBudMemRingbuffer,
+
+  kBudMemClients,
+  kBudMemHttp,
+  kBudMemCaches,
+  kBudMemOther,
+
+  kBudMemTagCount
+};
+
+/*
+ * Record buffers are the only allocations of clients' SSLs this large,
+ * unless `max_send_fragment` is below it
+ */
+#define BUD_MEM_LARGE 1024
+
+/* Live allocations of the tag, process-wide */
+struct bud_mem_stat_s {
+  uint64_t bytes;
+  uint64_t count;
+
+  /* Ever made of at least BUD_MEM_LARGE bytes, i.e. the buffer churn */
+  uint64_t large;
+};
+
+/*
+ * Allocations of bud and OpenSSL, tagged by subsystem. Compiled in with
+ * `-Dbud_memstat=1`, every allocation has a header then. Otherwise these
+ * are plain libc calls, and only the ringbuffer pools are accounted.
+ */
+#ifdef BUD_MEMSTAT
+
+/* Install OpenSSL hooks, must be called before anything is allocated */
+void bud_mem_init();
+
+void* bud_mem_alloc(bud_mem_tag_t tag, size_t size);
+void* bud_mem_calloc(bud_mem_tag_t tag, size_t count, size_t size);
+void bud_mem_free(void* ptr);
+
+#else  /* !BUD_MEMSTAT */
+
+# define bud_mem_init() do {} while (0)
+# define bud_mem_alloc(tag, size) malloc((size))
+# define bud_mem_calloc(tag, count, size) calloc((count), (size))
+# define bud_mem_free(ptr) free((ptr))
+
+#endif  /* BUD_MEMSTAT */
+
+/* Tag of OpenSSL's allocations on this thread, returns the previous one */
+bud_mem_tag_t bud_mem_scope(bud_mem_tag_t tag);
+
+/* Copy of the live allocations, zeroes without BUD_MEMSTAT */
+void bud_mem_stats(bud_mem_stat_t* stats);
+
+/* Names of the tags, for metrics */
+extern const char* const bud_mem_tag_names[kBudMemTagCount];
+
+#endif  /* SRC_MEMSTAT_H_ */
@@ -0,0 +1,1275 @@
+#include <stdarg.h>  /* va_list */
+#include <stdio.h>  /* snprintf, vsnprintf */
+#include <stdlib.h>  /* malloc, realloc, free */
+#include <string.h>  /* memset, memcpy, strstr */
+
+#include "uv.h"
+
+#include "metrics.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "ipc.h"
+#include "logger.h"
+#include "master.h"
+
+#define BUD_METRICS_BACKLOG 16
+
+/* Keeps kBudIPCMetricRows message under BUD_IPC_MAX_SIZE */
+#define BUD_METRICS_MAX_ROWS 2048
+
+typedef struct bud_metrics_desc_s bud_metrics_desc_t;
+typedef struct bud_metrics_row_desc_s bud_metrics_row_desc_t;
+typedef struct bud_metrics_buf_s bud_metrics_buf_t;
+typedef struct bud_metrics_conn_s bud_metrics_conn_t;
+
+struct bud_metrics_desc_s {
+  bud_metric_t metric;
+  const char* type;
+  const char* name;
+  const char* labels;
+};
+
+/* Summary's `value` is the sum, the count follows it */
+struct bud_metrics_row_desc_s {
+  int value;
+  const char* type;
+  const char* name;
+  const char* labels;
+};
+
+struct bud_metrics_buf_s {
+  char* data;
+  size_t len;
+  size_t cap;
+};
+
+struct bud_metrics_conn_s {
+  bud_config_t* config;
+  uv_tcp_t tcp;
+  uv_write_t req;
+  bud_metrics_buf_t out;
+
+  /* Request is not parsed, just waited for */
+  char in[1024];
+  size_t in_len;
+};
+
+static void bud_metrics_prepare_cb(uv_prepare_t* handle, int status);
+static void bud_metrics_check_cb(uv_check_t* handle, int status);
+static void bud_metrics_hist_add(uint64_t* values, uint64_t value);
+static void bud_metrics_collect(bud_config_t* config, uint64_t* values);
+static bud_error_t bud_metrics_table_init(bud_metrics_table_t* table,
+                                          int max);
+static bud_metrics_row_t* bud_metrics_table_get(bud_metrics_table_t* table,
+                                                const char* name,
+                                                size_t name_len);
+static void bud_metrics_table_add(bud_metrics_table_t* table,
+                                  const bud_metrics_row_t* row);
+static bud_error_t bud_metrics_send_rows(bud_config_t* config,
+                                         bud_metrics_table_type_t type);
+static const char* bud_metrics_row_decode(const char* p,
+                                          const char* end,
+                                          bud_metrics_row_t* row);
+static int bud_metrics_collect_rows(bud_config_t* config,
+                                    bud_metrics_table_type_t type,
+                                    bud_metrics_table_t* table);
+static int bud_metrics_printf(bud_metrics_buf_t* buf, const char* fmt, ...);
+static int bud_metrics_format(bud_config_t* config, bud_metrics_buf_t* buf);
+static int bud_metrics_format_rows(bud_config_t* config,
+                                   bud_metrics_buf_t* buf,
+                                   bud_metrics_table_type_t type);
+static int bud_metrics_format_hist(bud_metrics_buf_t* buf,
+                                   const char* name,
+                                   const char* labels,
+                                   const uint64_t* hist);
+static void bud_metrics_connection_cb(uv_stream_t* server, int status);
+static void bud_metrics_alloc_cb(uv_handle_t* handle,
+                                 size_t suggested_size,
+                                 uv_buf_t* buf);
+static void bud_metrics_read_cb(uv_stream_t* stream,
+                                ssize_t nread,
+                                const uv_buf_t* buf);
+static void bud_metrics_respond(bud_metrics_conn_t* conn);
+static void bud_metrics_write_cb(uv_write_t* req, int status);
+static void bud_metrics_close_cb(uv_handle_t* handle);
+
+/* Upper bounds of the histogram buckets, in ms or us (see the name) */
+static const uint64_t bud_metrics_bounds[BUD_METRICS_BUCKETS] = {
+  1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+/* NOTE: entries with the same name should be adjacent */
+static const bud_metrics_desc_t bud_metrics_desc[] = {
+  { kBudMetricAccepts, "counter", "bud_accepts_total", "" },
+  { kBudMetricHandshakesFull,
+    "counter",
+    "bud_handshakes_total",
+    "type=\"full\"" },
+  { kBudMetricHandshakesResumed,
+    "counter",
+    "bud_handshakes_total",
+    "type=\"resumed\"" },
+  { kBudMetricErrHello,
+    "counter",
+    "bud_handshake_errors_total",
+    "reason=\"hello\"" },
+  { kBudMetricErrSSL,
+    "counter",
+    "bud_handshake_errors_total",
+    "reason=\"ssl\"" },
+  { kBudMetricErrTimeout,
+    "counter",
+    "bud_handshake_errors_total",
+    "reason=\"timeout\"" },
+  { kBudMetricErrAborted,
+    "counter",
+    "bud_handshake_errors_total",
+    "reason=\"aborted\"" },
+  { kBudMetricSNIHits, "counter", "bud_sni_cache_total", "result=\"hit\"" },
+  { kBudMetricSNIMisses, "counter", "bud_sni_cache_total", "result=\"miss\"" },
+  { kBudMetricStapleHits,
+    "counter",
+    "bud_staple_cache_total",
+    "result=\"hit\"" },
+  { kBudMetricStapleMisses,
+    "counter",
+    "bud_staple_cache_total",
+    "result=\"miss\"" },
+  { kBudMetricBytesIn,
+    "counter",
+    "bud_frontend_bytes_total",
+    "direction=\"in\"" },
+  { kBudMetricBytesOut,
+    "counter",
+    "bud_frontend_bytes_total",
+    "direction=\"out\"" },
+  { kBudMetricThrottledFrontend,
+    "counter",
+    "bud_throttled_total",
+    "side=\"frontend\"" },
+  { kBudMetricThrottledBackend,
+    "counter",
+    "bud_throttled_total",
+    "side=\"backend\"" },
+  { kBudMetricReclaimRuns, "counter", "bud_reclaim_runs_total", "" },
+  { kBudMetricReclaimTrimmed,
+    "counter",
+    "bud_reclaim_bytes_total",
+    "action=\"trim\"" },
+  { kBudMetricReclaimPurged,
+    "counter",
+    "bud_reclaim_bytes_total",
+    "action=\"purge\"" },
+  { kBudMetricAdmitQueued,
+    "counter",
+    "bud_handshake_admission_total",
+    "result=\"queued\"" },
+  { kBudMetricAdmitRejected,
+    "counter",
+    "bud_handshake_admission_total",
+    "result=\"rejected\"" },
+  { kBudMetricUpstreamFull,
+    "counter",
+    "bud_backend_tls_handshakes_total",
+    "type=\"full\"" },
+  { kBudMetricUpstreamResumed,
+    "counter",
+    "bud_backend_tls_handshakes_total",
+    "type=\"resumed\"" },
+  { kBudMetricVerifyFull,
+    "counter",
+    "bud_client_verify_total",
+    "result=\"full\"" },
+  { kBudMetricVerifyCached,
+    "counter",
+    "bud_client_verify_total",
+    "result=\"cached\"" },
+  { kBudMetricBackendReused, "counter", "bud_backend_reused_total", "" },
+  { kBudMetricSSLReused, "counter", "bud_ssl_reused_total", "" },
+  { kBudMetricBandwidthPauses, "counter", "bud_bandwidth_pauses_total", "" },
+  { kBudMetricQuotaConnections,
+    "counter",
+    "bud_quota_rejected_total",
+    "type=\"connections\"" },
+  { kBudMetricQuotaHandshakes,
+    "counter",
+    "bud_quota_rejected_total",
+    "type=\"handshakes\"" },
+  { kBudMetricFingerprintDenied,
+    "counter",
+    "bud_fingerprint_denied_total",
+    "" },
+  { kBudMetricClassBulk,
+    "counter",
+    "bud_buffer_class_total",
+    "class=\"bulk\"" },
+  { kBudMetricClassInteractive,
+    "counter",
+    "bud_buffer_class_total",
+    "class=\"interactive\"" },
+  { kBudMetricSpilled, "counter", "bud_backend_spilled_bytes_total", "" },
+  { kBudMetricCPUHandshake,
+    "counter",
+    "bud_ssl_cpu_us_total",
+    "phase=\"handshake\"" },
+  { kBudMetricCPUCrypto,
+    "counter",
+    "bud_ssl_cpu_us_total",
+    "phase=\"crypto\"" },
+  { kBudMetricClients, "gauge", "bud_clients", "" },
+  { kBudMetricBuffers, "gauge", "bud_buffer_bytes", "" },
+  { kBudMetricLoopLag, "gauge", "bud_loop_lag_ms", "" },
+  { kBudMetricSSLBuffers,
+    "counter",
+    "bud_ssl_buffer_allocations_total",
+    "" },
+  { kBudMetricMemory + kBudMemOpenSSL * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"openssl\"" },
+  { kBudMetricMemory + kBudMemSSL * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"ssl\"" },
+  { kBudMetricMemory + kBudMemSSLCtx * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"ssl_ctx\"" },
+  { kBudMetricMemory + kBudMemRingbuffer * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"ringbuffer\"" },
+  { kBudMetricMemory + kBudMemClients * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"clients\"" },
+  { kBudMetricMemory + kBudMemHttp * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"http\"" },
+  { kBudMetricMemory + kBudMemCaches * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"caches\"" },
+  { kBudMetricMemory + kBudMemOther * 2,
+    "gauge",
+    "bud_memory_bytes",
+    "tag=\"other\"" },
+  { kBudMetricMemory + kBudMemOpenSSL * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"openssl\"" },
+  { kBudMetricMemory + kBudMemSSL * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"ssl\"" },
+  { kBudMetricMemory + kBudMemSSLCtx * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"ssl_ctx\"" },
+  { kBudMetricMemory + kBudMemRingbuffer * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"ringbuffer\"" },
+  { kBudMetricMemory + kBudMemClients * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"clients\"" },
+  { kBudMetricMemory + kBudMemHttp * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"http\"" },
+  { kBudMetricMemory + kBudMemCaches * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"caches\"" },
+  { kBudMetricMemory + kBudMemOther * 2 + 1,
+    "gauge",
+    "bud_memory_allocations",
+    "tag=\"other\"" },
+  { kBudMetricHandshakeTime, "histogram", "bud_handshake_duration_ms", "" },
+  { kBudMetricHttpTime, "histogram", "bud_http_request_duration_ms", "" },
+  { kBudMetricLoopBusy, "histogram", "bud_loop_busy_us", "" },
+  { kBudMetricReadTime,
+    "histogram",
+    "bud_callback_duration_us",
+    "callback=\"read\"" },
+  { kBudMetricSNITime,
+    "histogram",
+    "bud_callback_duration_us",
+    "callback=\"sni\"" },
+  { kBudMetricStaplingTime,
+    "histogram",
+    "bud_callback_duration_us",
+    "callback=\"stapling\"" },
+  { kBudMetricQueueFrontend,
+    "histogram",
+    "bud_queue_delay_ms",
+    "buffer=\"frontend.output\"" },
+  { kBudMetricQueueBackend,
+    "histogram",
+    "bud_queue_delay_ms",
+    "buffer=\"backend.output\"" },
+  { kBudMetricQueueEncrypt,
+    "histogram",
+    "bud_queue_delay_ms",
+    "buffer=\"backend.input\"" },
+  { kBudMetricTCPRetrans, "counter", "bud_tcp_retransmits_total", "" },
+  { kBudMetricTCPRTT, "histogram", "bud_tcp_rtt_ms", "" },
+  { kBudMetricTCPRate, "histogram", "bud_tcp_delivery_rate_mbps", "" }
+};
+
+static const char* bud_metrics_row_labels[kBudMetricsTableCount] = {
+  "context",
+  "backend"
+};
+
+static const bud_metrics_row_desc_t bud_metrics_context_desc[] = {
+  { kBudRowHandshakesFull,
+    "counter",
+    "bud_context_handshakes_total",
+    "type=\"full\"" },
+  { kBudRowHandshakesResumed,
+    "counter",
+    "bud_context_handshakes_total",
+    "type=\"resumed\"" },
+  { kBudRowHandshakeErrors,
+    "counter",
+    "bud_context_handshake_errors_total",
+    "" },
+  { kBudRowBytesIn, "counter", "bud_context_bytes_total", "direction=\"in\"" },
+  { kBudRowBytesOut,
+    "counter",
+    "bud_context_bytes_total",
+    "direction=\"out\"" },
+  { kBudRowClients, "gauge", "bud_context_clients", "" },
+  { kBudRowSNISum, "summary", "bud_context_sni_ms", "" },
+  { kBudRowCPUHandshake,
+    "counter",
+    "bud_context_cpu_us_total",
+    "phase=\"handshake\"" },
+  { kBudRowCPUCrypto,
+    "counter",
+    "bud_context_cpu_us_total",
+    "phase=\"crypto\"" },
+  { kBudRowTCPRetrans, "counter", "bud_context_tcp_retransmits_total", "" },
+  { kBudRowTCPRTT, "histogram", "bud_context_tcp_rtt_ms", "" },
+  { kBudRowTCPRate, "histogram", "bud_context_tcp_delivery_rate_mbps", "" }
+};
+
+static const bud_metrics_row_desc_t bud_metrics_backend_desc[] = {
+  { kBudRowConnects,
+    "counter",
+    "bud_backend_connects_total",
+    "result=\"ok\"" },
+  { kBudRowConnectErrors,
+    "counter",
+    "bud_backend_connects_total",
+    "result=\"error\"" },
+  { kBudRowBackendClients, "gauge", "bud_backend_clients", "" },
+  { kBudRowConnectSum, "summary", "bud_backend_connect_ms", "" },
+  { kBudRowFirstByteSum, "summary", "bud_backend_first_byte_ms", "" }
+};
+
+
+void bud_metrics_observe(bud_config_t* config,
+                         bud_metric_t hist,
+                         uint64_t value) {
+  bud_metrics_hist_add(&config->metrics.values[hist], value);
+}
+
+
+void bud_metrics_row_observe(bud_metrics_row_t* row,
+                             int hist,
+                             uint64_t value) {
+  bud_metrics_hist_add(&row->values[hist], value);
+}
+
+
+void bud_metrics_hist_add(uint64_t* values, uint64_t value) {
+  int i;
+
+  /* Buckets are cumulative, as Prometheus wants them */
+  for (i = BUD_METRICS_BUCKETS - 1; i >= 0; i--) {
+    if (value > bud_metrics_bounds[i])
+      break;
+    values[i]++;
+  }
+  values[BUD_METRICS_BUCKETS]++;
+  values[BUD_METRICS_BUCKETS + 1] += value;
+}
+
+
+bud_error_t bud_metrics_tables_init(bud_config_t* config) {
+  int i;
+  int max;
+  bud_error_t err;
+
+  for (i = 0; i < kBudMetricsTableCount; i++)
+    config->metrics.tables[i] = NULL;
+  if (config->metrics.port == 0 || config->metrics.breakdown <= 0)
+    return bud_ok();
+
+  max = config->metrics.breakdown;
+  if (max > BUD_METRICS_MAX_ROWS)
+    max = BUD_METRICS_MAX_ROWS;
+
+  for (i = 0; i < kBudMetricsTableCount; i++) {
+    config->metrics.tables[i] = malloc(sizeof(*config->metrics.tables[i]));
+    if (config->metrics.tables[i] == NULL) {
+      err = bud_error_str(kBudErrNoMem, "bud_metrics_table_t");
+      goto fatal;
+    }
+
+    err = bud_metrics_table_init(config->metrics.tables[i], max);
+    if (!bud_is_ok(err)) {
+      free(config->metrics.tables[i]);
+      config->metrics.tables[i] = NULL;
+      goto fatal;
+    }
+  }
+
+  return bud_ok();
+
+fatal:
+  bud_metrics_tables_free(config);
+  return err;
+}
+
+
+void bud_metrics_tables_free(bud_config_t* config) {
+  int i;
+
+  for (i = 0; i < kBudMetricsTableCount; i++) {
+    if (config->metrics.tables[i] == NULL)
+      continue;
+    free(config->metrics.tables[i]->rows);
+    free(config->metrics.tables[i]);
+    config->metrics.tables[i] = NULL;
+  }
+}
+
+
+bud_error_t bud_metrics_table_init(bud_metrics_table_t* table, int max) {
+  uint32_t count;
+
+  /* Power of two, at most half full */
+  count = 16;
+  while (count < (uint32_t) max * 2)
+    count <<= 1;
+
+  table->rows = calloc(count, sizeof(*table->rows));
+  if (table->rows == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_metrics_table_t rows");
+  table->mask = count - 1;
+  table->count = 0;
+  table->max = max;
+  memset(&table->other, 0, sizeof(table->other));
+  memcpy(table->other.name, "other", 5);
+  table->other.name_len = 5;
+
+  return bud_ok();
+}
+
+
+bud_metrics_row_t* bud_metrics_row(bud_config_t* config,
+                                   bud_metrics_table_type_t type,
+                                   const char* name,
+                                   size_t name_len) {
+  if (config->metrics.tables[type] == NULL)
+    return NULL;
+  return bud_metrics_table_get(config->metrics.tables[type], name, name_len);
+}
+
+
+bud_metrics_row_t* bud_metrics_table_get(bud_metrics_table_t* table,
+                                         const char* name,
+                                         size_t name_len) {
+  char label[BUD_METRICS_NAME_SIZE];
+  size_t i;
+  uint32_t hash;
+  uint32_t index;
+  bud_metrics_row_t* row;
+
+  /* Names come from the clients, keep them printable and unquoted */
+  if (name_len > sizeof(label) - 1)
+    name_len = sizeof(label) - 1;
+  for (i = 0; i < name_len; i++) {
+    if (name[i] < 0x21 || name[i] > 0x7e || name[i] == '"' || name[i] == '\\')
+      label[i] = '?';
+    else
+      label[i] = name[i];
+  }
+  if (name_len == 0) {
+    memcpy(label, "none", 4);
+    name_len = 4;
+  }
+
+  hash = bud_hash_lower(BUD_HASH_INIT, label, name_len);
+  for (index = hash & table->mask;; index = (index + 1) & table->mask) {
+    row = &table->rows[index];
+    if (row->name_len == 0)
+      break;
+    if (row->hash == hash &&
+        row->name_len == name_len &&
+        memcmp(row->name, label, name_len) == 0) {
+      return row;
+    }
+  }
+
+  /* Rest of the names are not worth the memory */
+  if (table->count >= table->max)
+    return &table->other;
+
+  row->hash = hash;
+  row->name_len = name_len;
+  memcpy(row->name, label, name_len);
+  row->name[name_len] = '\0';
+  table->count++;
+  return row;
+}
+
+
+void bud_metrics_table_add(bud_metrics_table_t* table,
+                           const bud_metrics_row_t* row) {
+  int i;
+  bud_metrics_row_t* sum;
+
+  sum = bud_metrics_table_get(table, row->name, row->name_len);
+  for (i = 0; i < BUD_METRICS_ROW_SIZE; i++)
+    sum->values[i] += row->values[i];
+}
+
+
+void bud_metrics_sample(bud_config_t* config) {
+  uint64_t buffers;
+  uint64_t chunks;
+  bud_mem_stat_t mem[kBudMemTagCount];
+  ringbuffer_pool* pools[3];
+  int i;
+
+  buffers = config->buffer_pool.used_count * config->buffer_pool.chunk_size;
+  buffers += config->frontend_pool.used_count *
+             config->frontend_pool.chunk_size;
+  buffers += config->backend_pool.used_count *
+             config->backend_pool.chunk_size;
+
+  config->metrics.values[kBudMetricClients] = config->client_slab.used_count;
+  config->metrics.values[kBudMetricBuffers] = buffers;
+
+  /* Ringbuffer chunks are allocated by the pools, not by the wrappers */
+  bud_mem_stats(mem);
+  pools[0] = &config->buffer_pool;
+  pools[1] = &config->frontend_pool;
+  pools[2] = &config->backend_pool;
+  for (i = 0; i < (int) ARRAY_SIZE(pools); i++) {
+    chunks = pools[i]->used_count + pools[i]->free_count;
+    mem[kBudMemRingbuffer].count += chunks;
+    mem[kBudMemRingbuffer].bytes += chunks * pools[i]->chunk_size;
+  }
+  for (i = 0; i < kBudMemTagCount; i++) {
+    config->metrics.values[kBudMetricMemory + i * 2] = mem[i].bytes;
+    config->metrics.values[kBudMetricMemory + i * 2 + 1] = mem[i].count;
+  }
+  config->metrics.values[kBudMetricSSLBuffers] = mem[kBudMemSSL].large;
+}
+
+
+bud_error_t bud_metrics_send(bud_config_t* config) {
+  int i;
+  int j;
+  uint64_t v;
+  char data[kBudMetricCount * 8];
+  bud_error_t err;
+
+  if (config->metrics.port == 0)
+    return bud_ok();
+
+  bud_metrics_sample(config);
+  for (i = 0; i < kBudMetricCount; i++) {
+    v = config->metrics.values[i];
+    for (j = 7; j >= 0; j--, v >>= 8)
+      data[i * 8 + j] = v & 0xff;
+  }
+
+  err = bud_ipc_send(config,
+                     (uv_stream_t*) &config->ipc,
+                     kBudIPCMetrics,
+                     NULL,
+                     0,
+                     data,
+                     sizeof(data));
+  for (i = 0; bud_is_ok(err) && i < kBudMetricsTableCount; i++)
+    err = bud_metrics_send_rows(config, i);
+  return err;
+}
+
+
+bud_error_t bud_metrics_send_rows(bud_config_t* config,
+                                  bud_metrics_table_type_t type) {
+  bud_metrics_table_t* table;
+  bud_metrics_row_t* row;
+  bud_error_t err;
+  char* data;
+  char* p;
+  uint32_t i;
+  int j;
+  uint64_t v;
+
+  table = config->metrics.tables[type];
+  if (table == NULL)
+    return bud_ok();
+
+  /* Type, then name length, name and values of every row */
+  data = malloc(1 + (table->count + 1) *
+                    (1 + BUD_METRICS_NAME_SIZE + BUD_METRICS_ROW_SIZE * 8));
+  if (data == NULL)
+    return bud_error_str(kBudErrNoMem, "kBudIPCMetricRows");
+
+  p = data;
+  *p++ = type;
+  for (i = 0; i <= table->mask + 1; i++) {
+    row = i <= table->mask ? &table->rows[i] : &table->other;
+    if (row->name_len == 0)
+      continue;
+    if (row == &table->other && table->count < table->max)
+      continue;
+
+    *p++ = row->name_len;
+    memcpy(p, row->name, row->name_len);
+    p += row->name_len;
+    for (j = 0; j < BUD_METRICS_ROW_SIZE; j++) {
+      v = row->values[j];
+      p[j * 8 + 0] = (v >> 56) & 0xff;
+      p[j * 8 + 1] = (v >> 48) & 0xff;
+      p[j * 8 + 2] = (v >> 40) & 0xff;
+      p[j * 8 + 3] = (v >> 32) & 0xff;
+      p[j * 8 + 4] = (v >> 24) & 0xff;
+      p[j * 8 + 5] = (v >> 16) & 0xff;
+      p[j * 8 + 6] = (v >> 8) & 0xff;
+      p[j * 8 + 7] = v & 0xff;
+    }
+    p += BUD_METRICS_ROW_SIZE * 8;
+  }
+
+  err = bud_ipc_send(config,
+                     (uv_stream_t*) &config->ipc,
+                     kBudIPCMetricRows,
+                     NULL,
+                     0,
+                     data,
+                     p - data);
+  free(data);
+  return err;
+}
+
+
+void bud_metrics_receive(bud_worker_t* worker,
+                         const char* data,
+                         size_t size) {
+  int i;
+  int j;
+  uint64_t v;
+  const unsigned char* p;
+
+  /* Older or newer worker, during the binary upgrade */
+  if (size != sizeof(worker->metrics[0]) * kBudMetricCount) {
+    bud_log(worker->config,
+            kBudLogWarning,
+            "master received metrics of unexpected size: %d",
+            (int) size);
+    return;
+  }
+
+  p = (const unsigned char*) data;
+  for (i = 0; i < kBudMetricCount; i++) {
+    v = 0;
+    for (j = 0; j < 8; j++)
+      v = (v << 8) | p[i * 8 + j];
+    worker->metrics[i] = v;
+  }
+}
+
+
+void bud_metrics_receive_rows(bud_worker_t* worker,
+                              const char* data,
+                              size_t size) {
+  unsigned char type;
+  char* copy;
+
+  type = size > 0 ? (unsigned char) data[0] : kBudMetricsTableCount;
+  if (type >= kBudMetricsTableCount) {
+    bud_log(worker->config,
+            kBudLogWarning,
+            "master received metric rows of unexpected type: %d",
+            (int) type);
+    return;
+  }
+
+  /* Decoded lazily, when the metrics are requested */
+  copy = malloc(size);
+  if (copy == NULL) {
+    bud_log(worker->config, kBudLogWarning, "no memory for metric rows");
+    return;
+  }
+  memcpy(copy, data, size);
+
+  free(worker->rows[type]);
+  worker->rows[type] = copy;
+  worker->rows_size[type] = size;
+}
+
+
+void bud_metrics_forget(bud_worker_t* worker) {
+  int i;
+
+  for (i = 0; i < kBudMetricsTableCount; i++) {
+    free(worker->rows[i]);
+    worker->rows[i] = NULL;
+    worker->rows_size[i] = 0;
+  }
+}
+
+
+bud_error_t bud_metrics_start(bud_config_t* config) {
+  int r;
+  bud_error_t err;
+  struct sockaddr_storage addr;
+
+  if (config->metrics.port == 0)
+    return bud_ok();
+
+  memset(&addr, 0, sizeof(addr));
+  r = bud_config_str_to_addr(config->metrics.host,
+                             config->metrics.port,
+                             &addr);
+  if (r != 0)
+    return bud_error_num(kBudErrPton, r);
+
+  r = uv_tcp_init(config->loop, &config->metrics.server);
+  if (r != 0)
+    return bud_error_num(kBudErrMetricsInit, r);
+  config->metrics.server.data = config;
+  config->metrics.server_init = 1;
+
+  r = uv_tcp_bind(&config->metrics.server, (struct sockaddr*) &addr);
+  if (r != 0) {
+    err = bud_error_num(kBudErrMetricsBind, r);
+    goto fatal;
+  }
+
+  r = uv_listen((uv_stream_t*) &config->metrics.server,
+                BUD_METRICS_BACKLOG,
+                bud_metrics_connection_cb);
+  if (r != 0) {
+    err = bud_error_num(kBudErrMetricsListen, r);
+    goto fatal;
+  }
+
+  err = bud_metrics_loop_start(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  bud_log(config,
+          kBudLogInfo,
+          "metrics available on [%s]:%d",
+          config->metrics.host,
+          config->metrics.port);
+  return bud_ok();
+
+fatal:
+  bud_metrics_finalize(config);
+  return err;
+}
+
+
+void bud_metrics_finalize(bud_config_t* config) {
+  if (config->metrics.loop_init) {
+    config->metrics.loop_init = 0;
+    uv_close((uv_handle_t*) &config->metrics.prepare, NULL);
+    uv_close((uv_handle_t*) &config->metrics.check, NULL);
+  }
+  if (config->metrics.server_init) {
+    config->metrics.server_init = 0;
+    uv_close((uv_handle_t*) &config->metrics.server, NULL);
+  }
+}
+
+
+bud_error_t bud_metrics_loop_start(bud_config_t* config) {
+  int r;
+
+  if (config->metrics.port == 0 || !config->metrics.timing)
+    return bud_ok();
+
+  r = uv_prepare_init(config->loop, &config->metrics.prepare);
+  if (r == 0)
+    r = uv_check_init(config->loop, &config->metrics.check);
+  if (r != 0)
+    return bud_error_num(kBudErrMetricsLoop, r);
+  config->metrics.loop_init = 1;
+  config->metrics.poll_end = 0;
+
+  r = uv_prepare_start(&config->metrics.prepare, bud_metrics_prepare_cb);
+  if (r == 0)
+    r = uv_check_start(&config->metrics.check, bud_metrics_check_cb);
+  if (r != 0)
+    return bud_error_num(kBudErrMetricsLoop, r);
+
+  /* Should not keep the loop alive */
+  uv_unref((uv_handle_t*) &config->metrics.prepare);
+  uv_unref((uv_handle_t*) &config->metrics.check);
+  return bud_ok();
+}
+
+
+void bud_metrics_prepare_cb(uv_prepare_t* handle, int status) {
+  bud_config_t* config;
+
+  /*
+   * Timers, idle handles, check and close callbacks of this iteration.
+   * I/O callbacks run within poll, see `bud_callback_duration_us`.
+   */
+  config = container_of(handle, bud_config_t, metrics.prepare);
+  if (config->metrics.poll_end == 0)
+    return;
+  bud_metrics_observe(config,
+                      kBudMetricLoopBusy,
+                      (uv_hrtime() - config->metrics.poll_end) / 1000);
+}
+
+
+void bud_metrics_check_cb(uv_check_t* handle, int status) {
+  bud_config_t* config;
+
+  config = container_of(handle, bud_config_t, metrics.check);
+  config->metrics.poll_end = uv_hrtime();
+}
+
+
+void bud_metrics_collect(bud_config_t* config, uint64_t* values) {
+  int i;
+  int j;
+
+  /* Master's own values (stapling), or everything if there are no workers */
+  bud_metrics_sample(config);
+  memcpy(values, config->metrics.values, sizeof(config->metrics.values));
+
+  /* NOTE: values of dead workers are lost, Prometheus treats it as reset */
+  for (i = 0; i < config->worker_slots * 2; i++) {
+    if (!config->workers[i].active)
+      continue;
+    for (j = 0; j < kBudMetricCount; j++)
+      values[j] += config->workers[i].metrics[j];
+  }
+}
+
+
+const char* bud_metrics_row_decode(const char* p,
+                                   const char* end,
+                                   bud_metrics_row_t* row) {
+  size_t len;
+  int i;
+  int j;
+  const unsigned char* v;
+
+  if (p >= end)
+    return NULL;
+  len = (unsigned char) *p++;
+  if (len == 0 ||
+      len >= BUD_METRICS_NAME_SIZE ||
+      (size_t) (end - p) < len + BUD_METRICS_ROW_SIZE * 8) {
+    return NULL;
+  }
+
+  memcpy(row->name, p, len);
+  row->name[len] = '\0';
+  row->name_len = len;
+  p += len;
+
+  v = (const unsigned char*) p;
+  for (i = 0; i < BUD_METRICS_ROW_SIZE; i++) {
+    row->values[i] = 0;
+    for (j = 0; j < 8; j++)
+      row->values[i] = (row->values[i] << 8) | v[i * 8 + j];
+  }
+  return p + BUD_METRICS_ROW_SIZE * 8;
+}
+
+
+/* Sum of the rows of the master and all workers, by name */
+int bud_metrics_collect_rows(bud_config_t* config,
+                             bud_metrics_table_type_t type,
+                             bud_metrics_table_t* table) {
+  int i;
+  int count;
+  uint32_t j;
+  const char* p;
+  const char* end;
+  bud_worker_t* worker;
+  bud_metrics_table_t* own;
+  bud_metrics_row_t row;
+
+  /* Every row might be unique, so the table should fit all of them */
+  own = config->metrics.tables[type];
+  count = own == NULL ? 0 : own->count + 1;
+  for (i = 0; i < config->worker_slots * 2; i++) {
+    worker = &config->workers[i];
+    if (!worker->active || worker->rows[type] == NULL)
+      continue;
+    end = worker->rows[type] + worker->rows_size[type];
+    for (p = worker->rows[type] + 1; p != NULL; count++)
+      p = bud_metrics_row_decode(p, end, &row);
+  }
+  if (!bud_is_ok(bud_metrics_table_init(table, count + 1)))
+    return -1;
+
+  for (j = 0; own != NULL && j <= own->mask; j++)
+    if (own->rows[j].name_len != 0)
+      bud_metrics_table_add(table, &own->rows[j]);
+  if (own != NULL && own->count >= own->max)
+    bud_metrics_table_add(table, &own->other);
+
+  for (i = 0; i < config->worker_slots * 2; i++) {
+    worker = &config->workers[i];
+    if (!worker->active || worker->rows[type] == NULL)
+      continue;
+    end = worker->rows[type] + worker->rows_size[type];
+    p = bud_metrics_row_decode(worker->rows[type] + 1, end, &row);
+    for (; p != NULL; p = bud_metrics_row_decode(p, end, &row))
+      bud_metrics_table_add(table, &row);
+  }
+
+  return 0;
+}
+
+
+int bud_metrics_printf(bud_metrics_buf_t* buf, const char* fmt, ...) {
+  va_list ap;
+  int r;
+  size_t cap;
+  char* data;
+
+  for (;;) {
+    va_start(ap, fmt);
+    r = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, ap);
+    va_end(ap);
+    if (r < 0)
+      return -1;
+    if ((size_t) r < buf->cap - buf->len)
+      break;
+
+    cap = buf->cap == 0 ? 4096 : buf->cap * 2;
+    data = realloc(buf->data, cap);
+    if (data == NULL)
+      return -1;
+    buf->data = data;
+    buf->cap = cap;
+  }
+
+  buf->len += r;
+  return 0;
+}
+
+
+int bud_metrics_format(bud_config_t* config, bud_metrics_buf_t* buf) {
+  int r;
+  size_t i;
+  const bud_metrics_desc_t* desc;
+  const char* last;
+  uint64_t values[kBudMetricCount];
+
+  bud_metrics_collect(config, values);
+
+  last = NULL;
+  for (i = 0; i < ARRAY_SIZE(bud_metrics_desc); i++) {
+    desc = &bud_metrics_desc[i];
+    if (last == NULL || strcmp(last, desc->name) != 0) {
+      if (bud_metrics_printf(buf,
+                             "# TYPE %s %s\n",
+                             desc->name,
+                             desc->type) != 0) {
+        return -1;
+      }
+    }
+    last = desc->name;
+
+    if (strcmp(desc->type, "histogram") == 0) {
+      r = bud_metrics_format_hist(buf,
+                                  desc->name,
+                                  desc->labels,
+                                  &values[desc->metric]);
+    } else {
+      r = bud_metrics_printf(buf,
+                             "%s%s%s%s %llu\n",
+                             desc->name,
+                             desc->labels[0] == '\0' ? "" : "{",
+                             desc->labels,
+                             desc->labels[0] == '\0' ? "" : "}",
+                             (unsigned long long) values[desc->metric]);
+    }
+    if (r != 0)
+      return -1;
+  }
+
+  for (i = 0; i < kBudMetricsTableCount; i++)
+    if (bud_metrics_format_rows(config, buf, i) != 0)
+      return -1;
+
+  return 0;
+}
+
+
+int bud_metrics_format_rows(bud_config_t* config,
+                            bud_metrics_buf_t* buf,
+                            bud_metrics_table_type_t type) {
+  int r;
+  size_t i;
+  size_t count;
+  uint32_t j;
+  const bud_metrics_row_desc_t* descs;
+  const bud_metrics_row_desc_t* desc;
+  const char* label;
+  const char* last;
+  char labels[BUD_METRICS_NAME_SIZE + 16];
+  bud_metrics_table_t table;
+  bud_metrics_row_t* row;
+
+  /* Nothing to report, unless `metrics.breakdown` is set */
+  if (config->metrics.breakdown <= 0)
+    return 0;
+  if (bud_metrics_collect_rows(config, type, &table) != 0)
+    return -1;
+
+  if (type == kBudMetricsContexts) {
+    descs = bud_metrics_context_desc;
+    count = ARRAY_SIZE(bud_metrics_context_desc);
+  } else {
+    descs = bud_metrics_backend_desc;
+    count = ARRAY_SIZE(bud_metrics_backend_desc);
+  }
+  label = bud_metrics_row_labels[type];
+
+  r = 0;
+  last = NULL;
+  for (i = 0; r == 0 && i < count; i++) {
+    desc = &descs[i];
+    if (last == NULL || strcmp(last, desc->name) != 0) {
+      r = bud_metrics_printf(buf,
+                             "# TYPE %s %s\n",
+                             desc->name,
+                             desc->type);
+    }
+    last = desc->name;
+
+    for (j = 0; r == 0 && j <= table.mask; j++) {
+      row = &table.rows[j];
+      if (row->name_len == 0)
+        continue;
+
+      if (strcmp(desc->type, "summary") == 0) {
+        r = bud_metrics_printf(buf,
+                               "%s_sum{%s=\"%s\"} %llu\n"
+                               "%s_count{%s=\"%s\"} %llu\n",
+                               desc->name,
+                               label,
+                               row->name,
+                               (unsigned long long) row->values[desc->value],
+                               desc->name,
+                               label,
+                               row->name,
+                               (unsigned long long)
+                                   row->values[desc->value + 1]);
+      } else if (strcmp(desc->type, "histogram") == 0) {
+        snprintf(labels, sizeof(labels), "%s=\"%s\"", label, row->name);
+        r = bud_metrics_format_hist(buf,
+                                    desc->name,
+                                    labels,
+                                    &row->values[desc->value]);
+      } else {
+        r = bud_metrics_printf(buf,
+                               "%s{%s=\"%s\"%s%s} %llu\n",
+                               desc->name,
+                               label,
+                               row->name,
+                               desc->labels[0] == '\0' ? "" : ",",
+                               desc->labels,
+                               (unsigned long long) row->values[desc->value]);
+      }
+    }
+  }
+
+  free(table.rows);
+  return r;
+}
+
+
+int bud_metrics_format_hist(bud_metrics_buf_t* buf,
+                            const char* name,
+                            const char* labels,
+                            const uint64_t* hist) {
+  int i;
+  const char* sep;
+
+  sep = labels[0] == '\0' ? "" : ",";
+  for (i = 0; i < BUD_METRICS_BUCKETS; i++) {
+    if (bud_metrics_printf(buf,
+                           "%s_bucket{%s%sle=\"%llu\"} %llu\n",
+                           name,
+                           labels,
+                           sep,
+                           (unsigned long long) bud_metrics_bounds[i],
+                           (unsigned long long) hist[i]) != 0) {
+      return -1;
+    }
+  }
+
+  return bud_metrics_printf(buf,
+                            "%s_bucket{%s%sle=\"+Inf\"} %llu\n"
+                            "%s_sum{%s} %llu\n"
+                            "%s_count{%s} %llu\n",
+                            name,
+                            labels,
+                            sep,
+                            (unsigned long long) hist[BUD_METRICS_BUCKETS],
+                            name,
+                            labels,
+                            (unsigned long long) hist[BUD_METRICS_BUCKETS + 1],
+                            name,
+                            labels,
+                            (unsigned long long) hist[BUD_METRICS_BUCKETS]);
+}
+
+
+void bud_metrics_connection_cb(uv_stream_t* server, int status) {
+  int r;
+  bud_config_t* config;
+  bud_metrics_conn_t* conn;
+
+  config = server->data;
+  if (status != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "metrics connection_cb() failed with (%d) \"%s\"",
+            status,
+            uv_strerror(status));
+    return;
+  }
+
+  conn = malloc(sizeof(*conn));
+  if (conn == NULL)
+    return;
+
+  conn->config = config;
+  conn->in_len = 0;
+  memset(&conn->out, 0, sizeof(conn->out));
+
+  r = uv_tcp_init(config->loop, &conn->tcp);
+  if (r != 0) {
+    free(conn);
+    return;
+  }
+  conn->tcp.data = conn;
+
+  r = uv_accept(server, (uv_stream_t*) &conn->tcp);
+  if (r == 0) {
+    r = uv_read_start((uv_stream_t*) &conn->tcp,
+                      bud_metrics_alloc_cb,
+                      bud_metrics_read_cb);
+  }
+  if (r != 0)
+    uv_close((uv_handle_t*) &conn->tcp, bud_metrics_close_cb);
+}
+
+
+void bud_metrics_alloc_cb(uv_handle_t* handle,
+                          size_t suggested_size,
+                          uv_buf_t* buf) {
+  bud_metrics_conn_t* conn;
+
+  /* Keep one byte for the terminating NUL */
+  conn = handle->data;
+  *buf = uv_buf_init(conn->in + conn->in_len,
+                     sizeof(conn->in) - conn->in_len - 1);
+}
+
+
+void bud_metrics_read_cb(uv_stream_t* stream,
+                         ssize_t nread,
+                         const uv_buf_t* buf) {
+  bud_metrics_conn_t* conn;
+
+  conn = stream->data;
+  if (nread == 0)
+    return;
+  if (nread < 0)
+    return uv_close((uv_handle_t*) stream, bud_metrics_close_cb);
+
+  conn->in_len += nread;
+  conn->in[conn->in_len] = '\0';
+
+  /* Wait for the end of the headers, unless they don't fit */
+  if (strstr(conn->in, "\r\n\r\n") == NULL &&
+      conn->in_len < sizeof(conn->in) - 1) {
+    return;
+  }
+
+  uv_read_stop(stream);
+  bud_metrics_respond(conn);
+}
+
+
+void bud_metrics_respond(bud_metrics_conn_t* conn) {
+  int r;
+  bud_metrics_buf_t body;
+  uv_buf_t buf;
+
+  memset(&body, 0, sizeof(body));
+  if (bud_metrics_format(conn->config, &body) != 0)
+    goto fatal;
+
+  r = bud_metrics_printf(&conn->out,
+                         "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %d\r\n"
+                         "Connection: close\r\n"
+                         "\r\n"
+                         "%s",
+                         (int) body.len,
+                         body.data);
+  if (r != 0)
+    goto fatal;
+  free(body.data);
+
+  buf = uv_buf_init(conn->out.data, conn->out.len);
+  r = uv_write(&conn->req,
+               (uv_stream_t*) &conn->tcp,
+               &buf,
+               1,
+               bud_metrics_write_cb);
+  if (r != 0)
+    uv_close((uv_handle_t*) &conn->tcp, bud_metrics_close_cb);
+  return;
+
+fatal:
+  free(body.data);
+  uv_close((uv_handle_t*) &conn->tcp, bud_metrics_close_cb);
+}
+
+
+void bud_metrics_write_cb(uv_write_t* req, int status) {
+  bud_metrics_conn_t* conn;
+
+  conn = container_of(req, bud_metrics_conn_t, req);
+  uv_close((uv_handle_t*) &conn->tcp, bud_metrics_close_cb);
+}
+
+
+void bud_metrics_close_cb(uv_handle_t* handle) {
+  bud_metrics_conn_t* conn;
+
+  conn = handle->data;
+  free(conn->out.data);
+  free(conn);
+}
@@ -0,0 +1,246 @@
+#ifndef SRC_METRICS_H_
+#define SRC_METRICS_H_
+
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* size_t */
+
+#include "uv.h"
+
+#include "error.h"
+#include "memstat.h"
+
+/* Forward declarations */
+struct bud_config_s;
+struct bud_worker_s;
+
+/* Finite buckets of the histograms (see bud_metrics_bounds), +Inf is extra */
+#define BUD_METRICS_BUCKETS 13
+
+/* Cumulative bucket counts, +Inf (total count), then the sum in ms */
+#define BUD_METRICS_HIST_SIZE (BUD_METRICS_BUCKETS + 2)
+
+/* Values in a row of `metrics.breakdown` table, and its longest label */
+#define BUD_METRICS_ROW_SIZE (11 + BUD_METRICS_HIST_SIZE * 2)
+#define BUD_METRICS_NAME_SIZE 64
+
+typedef enum bud_metric_e bud_metric_t;
+typedef enum bud_metrics_table_type_e bud_metrics_table_type_t;
+typedef struct bud_metrics_row_s bud_metrics_row_t;
+typedef struct bud_metrics_table_s bud_metrics_table_t;
+
+enum bud_metric_e {
+  /* Counters */
+  kBudMetricAccepts,
+  kBudMetricHandshakesFull,
+  kBudMetricHandshakesResumed,
+  kBudMetricErrHello,
+  kBudMetricErrSSL,
+  kBudMetricErrTimeout,
+  kBudMetricErrAborted,
+  kBudMetricSNIHits,
+  kBudMetricSNIMisses,
+  kBudMetricStapleHits,
+  kBudMetricStapleMisses,
+  kBudMetricBytesIn,
+  kBudMetricBytesOut,
+  kBudMetricThrottledFrontend,
+  kBudMetricThrottledBackend,
+  kBudMetricReclaimRuns,
+  kBudMetricReclaimTrimmed,
+  kBudMetricReclaimPurged,
+  kBudMetricAdmitQueued,
+  kBudMetricAdmitRejected,
+  kBudMetricUpstreamFull,
+  kBudMetricUpstreamResumed,
+  kBudMetricVerifyFull,
+  kBudMetricVerifyCached,
+  kBudMetricBackendReused,
+  kBudMetricSSLReused,
+  kBudMetricBandwidthPauses,
+  kBudMetricQuotaConnections,
+  kBudMetricQuotaHandshakes,
+  kBudMetricFingerprintDenied,
+  kBudMetricClassBulk,
+  kBudMetricClassInteractive,
+
+  /* Bytes of backends written to `backend.spill` files */
+  kBudMetricSpilled,
+
+  /* `metrics.timing`: microseconds in clients' SSL calls, see client.h */
+  kBudMetricCPUHandshake,
+  kBudMetricCPUCrypto,
+
+  /* `metrics.tcp_info`: segments retransmitted to the closed clients */
+  kBudMetricTCPRetrans,
+
+  /* Gauges, sampled by bud_metrics_sample() and the load timer */
+  kBudMetricClients,
+  kBudMetricBuffers,
+  kBudMetricLoopLag,
+
+  /* BUD_MEM_LARGE allocations of clients' SSLs so far, see memstat.h */
+  kBudMetricSSLBuffers,
+
+  /* Live bytes and allocations of every bud_mem_tag_t, see memstat.h */
+  kBudMetricMemory,
+
+  /* Histograms, BUD_METRICS_HIST_SIZE slots each */
+  kBudMetricHandshakeTime = kBudMetricMemory + kBudMemTagCount * 2,
+  kBudMetricHttpTime = kBudMetricHandshakeTime + BUD_METRICS_HIST_SIZE,
+
+  /* Histograms of `metrics.timing`, in microseconds */
+  kBudMetricLoopBusy = kBudMetricHttpTime + BUD_METRICS_HIST_SIZE,
+  kBudMetricReadTime = kBudMetricLoopBusy + BUD_METRICS_HIST_SIZE,
+  kBudMetricSNITime = kBudMetricReadTime + BUD_METRICS_HIST_SIZE,
+  kBudMetricStaplingTime = kBudMetricSNITime + BUD_METRICS_HIST_SIZE,
+
+  /*
+   * `metrics.timing`: ms that bytes wait in the relay buffers, frontend's
+   * and backend's output, and plaintext for SSL_write() (see client.h)
+   */
+  kBudMetricQueueFrontend = kBudMetricStaplingTime + BUD_METRICS_HIST_SIZE,
+  kBudMetricQueueBackend = kBudMetricQueueFrontend + BUD_METRICS_HIST_SIZE,
+  kBudMetricQueueEncrypt = kBudMetricQueueBackend + BUD_METRICS_HIST_SIZE,
+
+  /* Histograms of `metrics.tcp_info` samples, RTT in ms and rate in Mbit/s */
+  kBudMetricTCPRTT = kBudMetricQueueEncrypt + BUD_METRICS_HIST_SIZE,
+  kBudMetricTCPRate = kBudMetricTCPRTT + BUD_METRICS_HIST_SIZE,
+
+  kBudMetricCount = kBudMetricTCPRate + BUD_METRICS_HIST_SIZE
+};
+
+enum bud_metrics_table_type_e {
+  kBudMetricsContexts,
+  kBudMetricsBackends,
+  kBudMetricsTableCount
+};
+
+/*
+ * Values of the context rows, SNI - ms from hello to the response, CPU -
+ * microseconds in SSL calls (`metrics.timing`), TCP - `metrics.tcp_info`
+ * (histograms of BUD_METRICS_HIST_SIZE values, same units as the global)
+ */
+enum {
+  kBudRowHandshakesFull,
+  kBudRowHandshakesResumed,
+  kBudRowHandshakeErrors,
+  kBudRowBytesIn,
+  kBudRowBytesOut,
+  kBudRowClients,
+  kBudRowSNISum,
+  kBudRowSNICount,
+  kBudRowCPUHandshake,
+  kBudRowCPUCrypto,
+  kBudRowTCPRetrans,
+  kBudRowTCPRTT,
+  kBudRowTCPRate = kBudRowTCPRTT + BUD_METRICS_HIST_SIZE
+};
+
+/*
+ * Values of the backend rows, ms since the start of connect. Sums are
+ * followed by their counts, `kBudRowConnects` - successful connects.
+ */
+enum {
+  kBudRowConnectErrors,
+  kBudRowBackendClients,
+  kBudRowConnectSum,
+  kBudRowConnects,
+  kBudRowFirstByteSum,
+  kBudRowFirstByteCount
+};
+
+struct bud_metrics_row_s {
+  uint32_t hash;
+
+  /* 0 - free slot */
+  size_t name_len;
+  char name[BUD_METRICS_NAME_SIZE];
+  uint64_t values[BUD_METRICS_ROW_SIZE];
+};
+
+/*
+ * Per-worker rows by servername or backend address, open addressing. Rows
+ * are never removed, so the callers keep pointers to them. Names over
+ * `max` share the `other` row.
+ */
+struct bud_metrics_table_s {
+  uint32_t mask;
+  int count;
+  int max;
+  bud_metrics_row_t* rows;
+  bud_metrics_row_t other;
+};
+
+#define bud_metrics_inc(config, metric)                                       \
+    do {                                                                      \
+      (config)->metrics.values[(metric)]++;                                   \
+    } while (0)
+
+#define bud_metrics_add(config, metric, value)                                \
+    do {                                                                      \
+      (config)->metrics.values[(metric)] += (value);                          \
+    } while (0)
+
+/* Start of a timed callback, zero unless `metrics.timing` is set */
+#define bud_metrics_timer(config)                                             \
+    ((config)->metrics.timing ? uv_hrtime() : 0)
+
+#define bud_metrics_elapsed(config, hist, start)                              \
+    do {                                                                      \
+      if ((start) != 0) {                                                     \
+        bud_metrics_observe((config),                                         \
+                            (hist),                                           \
+                            (uv_hrtime() - (start)) / 1000);                  \
+      }                                                                       \
+    } while (0)
+
+/* Record `value` into the histogram starting at `hist` */
+void bud_metrics_observe(struct bud_config_s* config,
+                         bud_metric_t hist,
+                         uint64_t value);
+
+/* Same for the histogram at `hist` of the row */
+void bud_metrics_row_observe(bud_metrics_row_t* row,
+                             int hist,
+                             uint64_t value);
+
+/* Tables of `metrics.breakdown`, NULL if it or `metrics.port` is 0 */
+bud_error_t bud_metrics_tables_init(struct bud_config_s* config);
+void bud_metrics_tables_free(struct bud_config_s* config);
+
+/* Row of the name, NULL if breakdown is disabled */
+bud_metrics_row_t* bud_metrics_row(struct bud_config_s* config,
+                                   bud_metrics_table_type_t type,
+                                   const char* name,
+                                   size_t name_len);
+
+/* Master: rows of a dead worker are not reported any longer */
+void bud_metrics_forget(struct bud_worker_s* worker);
+
+/* Update gauges of this process */
+void bud_metrics_sample(struct bud_config_s* config);
+
+/* Worker: report values to the master, if `metrics.port` is set */
+bud_error_t bud_metrics_send(struct bud_config_s* config);
+
+/* Master: store values of kBudIPCMetrics message */
+void bud_metrics_receive(struct bud_worker_s* worker,
+                         const char* data,
+                         size_t size);
+
+/* Master: store rows of kBudIPCMetricRows message */
+void bud_metrics_receive_rows(struct bud_worker_s* worker,
+                              const char* data,
+                              size_t size);
+
+/*
+ * Measure time spent outside of the poll phase, if `metrics.timing` is set.
+ * Called by both master and workers.
+ */
+bud_error_t bud_metrics_loop_start(struct bud_config_s* config);
+
+/* Master: serve sum of all workers in Prometheus text format */
+bud_error_t bud_metrics_start(struct bud_config_s* config);
+void bud_metrics_finalize(struct bud_config_s* config);
+
+#endif  /* SRC_METRICS_H_ */
@@ -1,8 +1,11 @@
-#include <stdlib.h>  /* NULL */
-#include <string.h>  /* strlen */
+#include <stdio.h>  /* FILE, fopen, fread, fseek, ftell, fclose */
+#include <stdlib.h>  /* NULL, malloc, free, rand, atoi */
+#include <string.h>  /* strlen, strcmp, strrchr, memcpy */
+#include <time.h>  /* time, timegm */
 
 #include "openssl/ocsp.h"
 #include "openssl/ssl.h"
+#include "openssl/x509_vfy.h"
 #include "parson.h"
 
 #include "ocsp.h"
@@ -10,249 +13,1236 @@
 #include "client-private.h"
 #include "common.h"
 #include "config.h"
+#include "disk-cache.h"
 #include "error.h"
 #include "http-pool.h"
+#include "ipc.h"
+#include "logger.h"
+#include "lookup.h"
+#include "master.h"  /* bud_worker_t */
+#include "metrics.h"
+#include "probes.h"
+#include "shared-cache.h"
+
+/* Refresh interval for responses without nextUpdate */
+#define BUD_OCSP_DEFAULT_TTL 3600
+
+/* Retry interval after the backend failure */
+#define BUD_OCSP_RETRY_INTERVAL 60
+
+/* Allowed clock skew between bud and OCSP responder */
+#define BUD_OCSP_MAX_SKEW 300
+
+/* Largest `ocsp_file`, responses are a few KB at most */
+#define BUD_OCSP_FILE_MAX (64 * 1024)
+
+typedef struct bud_ocsp_responder_s bud_ocsp_responder_t;
+typedef struct bud_ocsp_watch_s bud_ocsp_watch_t;
+
+/* Pool per OCSP responder's host:port, shared by all contexts */
+struct bud_ocsp_responder_s {
+  bud_ocsp_responder_t* next;
+  char* host;
+  uint16_t port;
+  bud_http_pool_t* pool;
+};
+
+/*
+ * Directory of `ocsp_file` is watched rather than the file itself: the new
+ * one is usually renamed over it, and a watch of the old inode goes silent.
+ */
+struct bud_ocsp_watch_s {
+  uv_fs_event_t event;
+  bud_ocsp_watch_t* next;
+  bud_config_t* config;
+  int index;
+  char* dir;
+  const char* name;
+};
+
+static void bud_context_stapling_refresh(bud_config_t* config,
+                                         bud_context_t* context);
+static bud_error_t bud_context_stapling_direct(bud_config_t* config,
+                                               bud_context_t* context);
+static void bud_context_stapling_direct_cb(bud_http_request_t* req,
+                                           bud_error_t err);
+static bud_http_pool_t* bud_ocsp_responder_pool(bud_config_t* config,
+                                                const char* host,
+                                                uint16_t port,
+                                                bud_error_t* err);
+static void bud_context_stapling_cache_req_cb(bud_http_request_t* req,
+                                              bud_error_t err);
+static void bud_context_stapling_req_cb(bud_http_request_t* req,
+                                        bud_error_t err);
+static bud_error_t bud_context_stapling_lookup(bud_config_t* config,
+                                               bud_context_t* context);
+static void bud_context_stapling_lookup_cb(bud_lookup_req_t* req,
+                                           bud_error_t err);
+static int bud_context_staple_json(bud_context_t* context,
+                                   bud_json_stream_t* stream,
+                                   const char* field);
+static int bud_context_staple_der(bud_context_t* context,
+                                  char* body,
+                                  size_t body_len,
+                                  int verify);
+static int bud_context_staple_verify(bud_context_t* context,
+                                     OCSP_BASICRESP* basic);
+static int bud_context_staple_verify_cb(int ok, X509_STORE_CTX* ctx);
+static time_t bud_ocsp_time(ASN1_GENERALIZEDTIME* t);
+static void bud_context_staple_max_age(bud_context_t* context, int max_age);
+static void bud_context_staple_fetched(bud_config_t* config,
+                                       bud_context_t* context,
+                                       int max_age);
+static int bud_context_staple_restore(bud_config_t* config,
+                                      bud_context_t* context);
+static void bud_context_staple_share(bud_config_t* config,
+                                     bud_context_t* context);
+static int bud_context_staple_shared(bud_config_t* config,
+                                     bud_context_t* context);
+static void bud_context_staple_updated(bud_config_t* config,
+                                       bud_context_t* context);
+static bud_error_t bud_context_staple_send(bud_config_t* config,
+                                           bud_context_t* context,
+                                           uv_stream_t* stream);
+static void bud_context_staple_file(bud_config_t* config,
+                                    bud_context_t* context);
+static void bud_ocsp_watch_cb(uv_fs_event_t* handle,
+                              const char* filename,
+                              int events,
+                              int status);
+static void bud_ocsp_watch_close_cb(uv_handle_t* handle);
+
+/* Base64 DER staple in stapling server's responses */
+const char* const bud_ocsp_extract[] = { "response", NULL };
 
-static void bud_client_stapling_cache_req_cb(bud_http_request_t* req,
-                                             bud_error_t err);
-static void bud_client_stapling_req_cb(bud_http_request_t* req,
-                                       bud_error_t err);
-static int bud_client_staple_json(bud_client_t* client, JSON_Value* json);
 
 bud_error_t bud_client_ocsp_stapling(bud_client_t* client) {
   bud_config_t* config;
   bud_context_t* context;
   bud_error_t err;
-  const char* id;
-  size_t id_size;
 
   config = client->config;
 
-  if (client->sni_ctx.ctx != NULL) {
+  if (client->sni_ctx != NULL) {
     /* Async SNI success */
-    context = &client->sni_ctx;
-  } else if (client->hello.servername_len != 0) {
+    context = client->sni_ctx;
+  } else if (client->hs != NULL && client->hs->hello.servername_len != 0) {
     /* Matching context */
     context = bud_config_select_context(config,
-                                        client->hello.servername,
-                                        client->hello.servername_len);
+                                        client->hs->hello.servername,
+                                        client->hs->hello.servername_len);
+    if (context == &config->contexts[0])
+      context = bud_client_default_context(client);
+
+    /* Lazy context is built here, before its staple is looked at */
+    err = bud_context_use(config, context);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogWarning, err);
+      context = bud_client_default_context(client);
+    }
   } else {
     /* Default context */
-    context = &config->contexts[0];
+    context = bud_client_default_context(client);
   }
 
   /* Cache context to prevent second search in OpenSSL's callback */
-  if (!SSL_set_ex_data(client->ssl, kBudSSLSNIIndex, context)) {
-    err = bud_error(kBudErrStaplingSetData);
-    goto fatal;
+  if (!SSL_set_ex_data(client->ssl, kBudSSLSNIIndex, context))
+    return bud_error(kBudErrStaplingSetData);
+
+  /*
+   * Staple is served from the context in bud_client_stapling_cb(), handshake
+   * never waits for the backend.
+   */
+  bud_context_stapling_refresh(config, context);
+  return bud_ok();
+}
+
+
+void bud_context_stapling_refresh(bud_config_t* config,
+                                  bud_context_t* context) {
+  bud_error_t err;
+  const char* id;
+  size_t id_size;
+
+  /* Already in flight, or staple is still fresh */
+  if (context->staple_req != NULL ||
+      context->staple_lookup != NULL ||
+      context->staple_refresh > time(NULL)) {
+    return;
   }
 
+  /* Someone else keeps it fresh, just read it again */
+  if (context->ocsp_file != NULL) {
+    bud_context_staple_file(config, context);
+    return;
+  }
+
+  if (!config->stapling.enabled)
+    return;
+
   id = bud_context_get_ocsp_id(context, &id_size);
 
   /* Certificate has no OCSP id */
   if (id == NULL)
-    return bud_ok();
+    return;
 
-  /* Request backend for cached respose first */
-  client->stapling_cache_req = bud_http_get(config->stapling.pool,
-                                            config->stapling.query_fmt,
-                                            id,
-                                            id_size,
-                                            bud_client_stapling_cache_req_cb,
-                                            &err);
-  client->stapling_cache_req->data = client;
-
-  if (!bud_is_ok(err))
-    goto fatal;
-
-  client->hello_parse = kBudProgressRunning;
-  return bud_ok();
+  /* Other worker may have fetched a fresh one already */
+  if (config->shared_cache.cache != NULL &&
+      bud_context_staple_shared(config, context) == 0) {
+    return;
+  }
 
-fatal:
-  return err;
+  /* Cold start, previous run may have left a good one on disk */
+  if (context->staple == NULL &&
+      config->disk_cache.cache != NULL &&
+      bud_context_staple_restore(config, context) == 0) {
+    return;
+  }
+
+  if (config->stapling.direct) {
+    BUD_PROBE2(stapling__start, context, context->servername);
+    err = bud_context_stapling_direct(config, context);
+    if (!bud_is_ok(err)) {
+      bud_log(config,
+              kBudLogWarning,
+              "OCSP responder request failed: %d - \"%s\"",
+              err.code,
+              err.str);
+      context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+    }
+    return;
+  }
+
+  /* One request over the binary protocol, backend asks the responder */
+  if (config->stapling.lookup != NULL) {
+    BUD_PROBE2(stapling__start, context, context->servername);
+    err = bud_context_stapling_lookup(config, context);
+    if (!bud_is_ok(err)) {
+      bud_log(config,
+              kBudLogWarning,
+              "OCSP lookup failed: %d - \"%s\"",
+              err.code,
+              err.str);
+      context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+    }
+    return;
+  }
+
+  /* Request backend for cached respose first */
+  context->staple_req = bud_http_get(config->stapling.pool,
+                                     config->stapling.query_fmt,
+                                     id,
+                                     id_size,
+                                     bud_context_stapling_cache_req_cb,
+                                     &err);
+  if (!bud_is_ok(err)) {
+    bud_log(config,
+            kBudLogWarning,
+            "OCSP cache request failed: %d - \"%s\"",
+            err.code,
+            err.str);
+    context->staple_req = NULL;
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+    return;
+  }
+  context->staple_req->data = context;
+  BUD_PROBE2(stapling__start, context, context->servername);
 }
 
 
-void bud_client_stapling_cache_req_cb(bud_http_request_t* req,
-                                      bud_error_t err) {
-  bud_client_t* client;
+void bud_context_stapling_cache_req_cb(bud_http_request_t* req,
+                                       bud_error_t err) {
   bud_config_t* config;
   bud_context_t* context;
   const char* id;
   size_t id_size;
   const char* url;
   size_t url_size;
-  char* ocsp;
-  size_t ocsp_size;
-  char* json;
-  size_t json_size;
-  size_t offset;
-
-  client = req->data;
-  config = client->config;
-  context = SSL_get_ex_data(client->ssl, kBudSSLSNIIndex);
+  bud_http_body_t* ocsp;
+  bud_http_body_t* body;
+  JSON_Value* response;
+  uint64_t start;
 
-  client->hello_parse = kBudProgressDone;
-  client->stapling_cache_req = NULL;
-  json = NULL;
-  ocsp = NULL;
+  context = req->data;
+  config = req->config;
+  start = bud_metrics_timer(config);
+  BUD_PROBE3(stapling__done, context, context->servername, req->code);
 
-  ASSERT(context != NULL, "Context disappeared");
+  context->staple_req = NULL;
+  response = bud_is_ok(err) ? req->response : NULL;
 
   if (!bud_is_ok(err)) {
-    WARNING(&client->frontend,
+    bud_log(config,
+            kBudLogWarning,
             "OCSP cache cb failed: %d - \"%s\"",
             err.code,
             err.str);
-    goto done;
+    goto failed;
   }
 
   /* Cache hit, success */
   if ((req->code >= 200 && req->code < 400) &&
-      bud_client_staple_json(client, req->response) == 0) {
-    DBG_LN(&client->frontend, "stapling cache hit");
+      bud_context_staple_json(context, &req->stream, "response") == 0) {
+    bud_log(config, kBudLogDebug, "stapling cache hit");
+    bud_context_staple_fetched(config, context, req->max_age);
     goto done;
   }
 
-  DBG_LN(&client->frontend, "stapling cache miss");
+  bud_log(config, kBudLogDebug, "stapling cache miss");
   id = bud_context_get_ocsp_id(context, &id_size);
-  url = bud_context_get_ocsp_req(context, &url_size, &ocsp, &ocsp_size);
 
-  /* Certificate has no OCSP url */
-  if (url == NULL)
-    goto done;
+  url = bud_context_get_ocsp_req(context, &url_size, &ocsp);
 
-  /* Format JSON request */
-  json_size = 2 + bud_base64_encoded_size(ocsp_size) + 2 + url_size;
-  json_size += /* "ocsp": */ 7 + /* "url": */ 6 + /* {,}\0 */ 4;
-  json = malloc(json_size);
-  if (json == NULL)
+  /* Certificate has no OCSP url */
+  if (url == NULL) {
+    context->staple_refresh = time(NULL) + BUD_OCSP_DEFAULT_TTL;
     goto done;
+  }
 
-  offset = snprintf(json,
-                    json_size,
-                    "{\"url\":\"%.*s\",\"ocsp\":\"",
-                    (int) url_size,
-                    url);
-  bud_base64_encode(ocsp, ocsp_size, json + offset, json_size - offset);
-  offset += bud_base64_encoded_size(ocsp_size);
-  snprintf(json + offset, json_size - offset, "\"}");
+  /* JSON request is built once per certificate */
+  body = bud_context_get_ocsp_body(context);
+  if (body == NULL)
+    goto failed;
 
   /* Request OCSP response */
-  client->stapling_req = bud_http_post(config->stapling.pool,
-                                       config->stapling.query_fmt,
-                                       id,
-                                       id_size,
-                                       json,
-                                       json_size - 1,
-                                       bud_client_stapling_req_cb,
-                                       &err);
-  client->stapling_req->data = client;
-
-  if (!bud_is_ok(err))
-    goto done;
+  context->staple_req = bud_http_post(config->stapling.pool,
+                                      config->stapling.query_fmt,
+                                      id,
+                                      id_size,
+                                      body,
+                                      bud_context_stapling_req_cb,
+                                      &err);
+  if (!bud_is_ok(err)) {
+    context->staple_req = NULL;
+    goto failed;
+  }
+  context->staple_req->data = context;
+  goto done;
 
-  client->hello_parse = kBudProgressRunning;
+failed:
+  context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
 
 done:
-  free(ocsp);
-  free(json);
-  json_value_free(req->response);
-  bud_client_cycle(client);
+  if (response != NULL)
+    json_value_free(response);
+  bud_metrics_elapsed(config, kBudMetricStaplingTime, start);
 }
 
 
-void bud_client_stapling_req_cb(bud_http_request_t* req, bud_error_t err) {
-  bud_client_t* client;
+void bud_context_stapling_req_cb(bud_http_request_t* req, bud_error_t err) {
+  bud_config_t* config;
+  bud_context_t* context;
 
-  client = req->data;
-  client->stapling_req = NULL;
-  client->hello_parse = kBudProgressDone;
+  context = req->data;
+  config = req->config;
+  context->staple_req = NULL;
+  BUD_PROBE3(stapling__done, context, context->servername, req->code);
 
   if (!bud_is_ok(err)) {
-    WARNING(&client->frontend,
+    bud_log(config,
+            kBudLogWarning,
             "OCSP cb failed: %d - \"%s\"",
             err.code,
             err.str);
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+    return;
+  }
+
+  /* Stapling backend failure - keep serving the old staple until expired */
+  if (req->code < 200 || req->code >= 400 ||
+      bud_context_staple_json(context, &req->stream, "response") != 0) {
+    bud_log(config, kBudLogDebug, "stapling request failure");
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+  } else {
+    bud_log(config, kBudLogDebug, "stapling request success");
+    bud_context_staple_fetched(config, context, req->max_age);
+  }
+
+  if (req->response != NULL)
+    json_value_free(req->response);
+}
+
+
+bud_error_t bud_context_stapling_lookup(bud_config_t* config,
+                                        bud_context_t* context) {
+  const char* id;
+  size_t id_size;
+  const char* url;
+  size_t url_size;
+  bud_http_body_t* ocsp;
+  bud_error_t err;
+
+  id = bud_context_get_ocsp_id(context, &id_size);
+  url = bud_context_get_ocsp_req(context, &url_size, &ocsp);
+
+  /* Without OCSP url only the backend's cached one may be there */
+  context->staple_lookup = bud_lookup_stapling(config->stapling.lookup,
+                                               id,
+                                               id_size,
+                                               url,
+                                               url_size,
+                                               ocsp == NULL ? NULL : ocsp->data,
+                                               ocsp == NULL ? 0 : ocsp->len,
+                                               bud_context_stapling_lookup_cb,
+                                               &err);
+  if (context->staple_lookup == NULL)
+    return err;
+  context->staple_lookup->data = context;
+  return bud_ok();
+}
+
+
+void bud_context_stapling_lookup_cb(bud_lookup_req_t* req, bud_error_t err) {
+  bud_config_t* config;
+  bud_context_t* context;
+  uint64_t start;
+
+  context = req->data;
+  config = req->config;
+  start = bud_metrics_timer(config);
+  context->staple_lookup = NULL;
+  BUD_PROBE3(stapling__done, context, context->servername, req->code);
+
+  if (!bud_is_ok(err)) {
+    bud_log(config,
+            kBudLogWarning,
+            "OCSP lookup cb failed: %d - \"%s\"",
+            err.code,
+            err.str);
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
     goto done;
   }
 
-  /* Stapling backend failure - ignore */
-  if (req->code < 200 || req->code >= 400) {
-    DBG_LN(&client->frontend, "stapling request failure");
+  /* Keep serving the old staple until expired */
+  if (req->code < 200 || req->code >= 400 ||
+      bud_context_staple_json(context, &req->stream, "ocsp") != 0) {
+    bud_log(config, kBudLogDebug, "stapling lookup failure");
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+  } else {
+    bud_log(config, kBudLogDebug, "stapling lookup success");
+    bud_context_staple_fetched(config, context, req->max_age);
+  }
+
+done:
+  if (req->response != NULL)
+    json_value_free(req->response);
+  bud_metrics_elapsed(config, kBudMetricStaplingTime, start);
+}
+
+
+bud_error_t bud_context_stapling_direct(bud_config_t* config,
+                                        bud_context_t* context) {
+  bud_error_t err;
+  bud_http_pool_t* pool;
+  const char* url;
+  size_t url_size;
+  bud_http_body_t* ocsp;
+  char* url_copy;
+  char* host;
+  char* port;
+  char* path;
+  int ssl;
+
+  url_copy = NULL;
+  host = NULL;
+  port = NULL;
+  path = NULL;
+
+  url = bud_context_get_ocsp_req(context, &url_size, &ocsp);
+
+  /* Certificate has no OCSP url */
+  if (url == NULL) {
+    context->staple_refresh = time(NULL) + BUD_OCSP_DEFAULT_TTL;
+    return bud_ok();
+  }
+  if (ocsp == NULL)
+    return bud_error_str(kBudErrNoMem, "OCSP request");
+
+  /* OCSP_parse_url() modifies the string */
+  url_copy = malloc(url_size + 1);
+  if (url_copy == NULL) {
+    err = bud_error_str(kBudErrNoMem, "OCSP url");
+    goto done;
+  }
+  memcpy(url_copy, url, url_size);
+  url_copy[url_size] = '\0';
+
+  if (!OCSP_parse_url(url_copy, &host, &port, &path, &ssl) || ssl) {
+    err = bud_error_str(kBudErrStaplingUrl, url_copy);
     goto done;
   }
-  DBG_LN(&client->frontend, "stapling request success");
 
-  /* Note, ignoring return value here */
-  (void) bud_client_staple_json(client, req->response);
+  pool = bud_ocsp_responder_pool(config, host, atoi(port), &err);
+  if (pool == NULL)
+    goto done;
+
+  context->staple_req = bud_http_post_raw(pool,
+                                          path,
+                                          "application/ocsp-request",
+                                          ocsp,
+                                          bud_context_stapling_direct_cb,
+                                          &err);
+  if (!bud_is_ok(err)) {
+    context->staple_req = NULL;
+    goto done;
+  }
+  context->staple_req->data = context;
 
-  /* NOTE: Stapling failure should not prevent us from responding */
 done:
-  json_value_free(req->response);
-  bud_client_cycle(client);
+  free(url_copy);
+  if (host != NULL)
+    OPENSSL_free(host);
+  if (port != NULL)
+    OPENSSL_free(port);
+  if (path != NULL)
+    OPENSSL_free(path);
+  return err;
 }
 
 
-int bud_client_staple_json(bud_client_t* client, JSON_Value* json) {
-  JSON_Object* obj;
-  const char* b64_body;
-  size_t b64_body_len;
+void bud_context_stapling_direct_cb(bud_http_request_t* req,
+                                    bud_error_t err) {
+  bud_config_t* config;
+  bud_context_t* context;
+
+  context = req->data;
+  config = req->config;
+  context->staple_req = NULL;
+  BUD_PROBE3(stapling__done, context, context->servername, req->code);
+
+  if (!bud_is_ok(err)) {
+    bud_log(config,
+            kBudLogWarning,
+            "OCSP responder cb failed: %d - \"%s\"",
+            err.code,
+            err.str);
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+    return;
+  }
+
+  /* Takes ownership of the raw response */
+  if (req->code != 200 ||
+      bud_context_staple_der(context,
+                             req->raw_response,
+                             req->raw_response_len,
+                             1) != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "OCSP responder returned invalid response, code: %d",
+            req->code);
+    if (req->code != 200)
+      free(req->raw_response);
+    context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+  } else {
+    bud_log(config, kBudLogDebug, "stapling responder success");
+    bud_context_staple_fetched(config, context, req->max_age);
+  }
+  req->raw_response = NULL;
+}
+
+
+bud_http_pool_t* bud_ocsp_responder_pool(bud_config_t* config,
+                                         const char* host,
+                                         uint16_t port,
+                                         bud_error_t* err) {
+  bud_ocsp_responder_t* responder;
+  size_t host_len;
+
+  for (responder = config->ocsp_responders;
+       responder != NULL;
+       responder = responder->next) {
+    if (responder->port == port && strcmp(responder->host, host) == 0)
+      return responder->pool;
+  }
+
+  host_len = strlen(host);
+  responder = malloc(sizeof(*responder) + host_len + 1);
+  if (responder == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_ocsp_responder_t");
+    return NULL;
+  }
+
+  responder->pool = bud_http_pool_new(config, host, port, err);
+  if (responder->pool == NULL) {
+    free(responder);
+    return NULL;
+  }
+  bud_http_pool_configure(responder->pool, &config->stapling);
+
+  responder->host = (char*) (responder + 1);
+  memcpy(responder->host, host, host_len + 1);
+  responder->port = port;
+  responder->next = config->ocsp_responders;
+  config->ocsp_responders = responder;
+
+  return responder->pool;
+}
+
+
+void bud_ocsp_responders_free(bud_config_t* config) {
+  bud_ocsp_responder_t* responder;
+
+  while (config->ocsp_responders != NULL) {
+    responder = config->ocsp_responders;
+    config->ocsp_responders = responder->next;
+    bud_http_pool_free(responder->pool);
+    free(responder);
+  }
+}
+
+
+bud_error_t bud_ocsp_files_init(bud_config_t* config) {
+  bud_context_t* context;
+  bud_ocsp_watch_t* watch;
+  char* slash;
+  size_t len;
+  int i;
+  int r;
+
+  for (i = 1; i < config->context_count + 1; i++) {
+    context = &config->contexts[i];
+    if (context->ocsp_file == NULL)
+      continue;
+
+    bud_context_staple_file(config, context);
+
+    len = strlen(context->ocsp_file);
+    watch = malloc(sizeof(*watch) + len + 2);
+    if (watch == NULL)
+      return bud_error_str(kBudErrNoMem, "bud_ocsp_watch_t");
+    watch->config = config;
+    watch->index = i;
+    watch->dir = (char*) (watch + 1);
+    memcpy(watch->dir, context->ocsp_file, len + 1);
+
+    /* "name" is in ".", "/name" is in "/" */
+    slash = strrchr(watch->dir, '/');
+    if (slash == NULL) {
+      watch->name = context->ocsp_file;
+      memcpy(watch->dir, ".", 2);
+    } else {
+      watch->name = context->ocsp_file + (slash - watch->dir) + 1;
+      slash[slash == watch->dir ? 1 : 0] = '\0';
+    }
+
+    r = uv_fs_event_init(config->loop, &watch->event);
+    if (r != 0) {
+      free(watch);
+      return bud_error_num(kBudErrOCSPWatch, r);
+    }
+    watch->next = config->ocsp_watches;
+    config->ocsp_watches = watch;
+
+    r = uv_fs_event_start(&watch->event, bud_ocsp_watch_cb, watch->dir, 0);
+    if (r != 0)
+      return bud_error_num(kBudErrOCSPWatch, r);
+    uv_unref((uv_handle_t*) &watch->event);
+  }
+
+  return bud_ok();
+}
+
+
+void bud_ocsp_files_free(bud_config_t* config) {
+  bud_ocsp_watch_t* watch;
+
+  while (config->ocsp_watches != NULL) {
+    watch = config->ocsp_watches;
+    config->ocsp_watches = watch->next;
+    uv_close((uv_handle_t*) &watch->event, bud_ocsp_watch_close_cb);
+  }
+}
+
+
+void bud_ocsp_watch_close_cb(uv_handle_t* handle) {
+  free(container_of(handle, bud_ocsp_watch_t, event));
+}
+
+
+void bud_ocsp_watch_cb(uv_fs_event_t* handle,
+                       const char* filename,
+                       int events,
+                       int status) {
+  bud_ocsp_watch_t* watch;
+  bud_config_t* config;
+
+  watch = container_of(handle, bud_ocsp_watch_t, event);
+  config = watch->config;
+  if (status != 0) {
+    bud_log(config,
+            kBudLogWarning,
+            "ocsp_file watch failed: %d - \"%s\"",
+            status,
+            uv_strerror(status));
+    return;
+  }
+
+  /* Other files of the directory, NULL - platform doesn't tell which one */
+  if (filename != NULL && strcmp(filename, watch->name) != 0)
+    return;
+
+  bud_context_staple_file(config, &config->contexts[watch->index]);
+}
+
+
+void bud_context_staple_file(bud_config_t* config, bud_context_t* context) {
+  FILE* fp;
   char* body;
-  const unsigned char* pbody;
-  size_t body_len;
-  OCSP_RESPONSE* resp;
-  int status;
+  long size;
   int r;
 
-  r = -1;
+  /* Lazy context that isn't built here (yet), read on its first use */
+  if (context->ocsp_id == NULL)
+    return;
+
   body = NULL;
+  fp = fopen(context->ocsp_file, "rb");
+  if (fp == NULL)
+    goto failed;
+  if (fseek(fp, 0, SEEK_END) != 0)
+    goto failed;
+  size = ftell(fp);
+  if (size <= 0 || size > BUD_OCSP_FILE_MAX || fseek(fp, 0, SEEK_SET) != 0)
+    goto failed;
+
+  body = malloc(size);
+  if (body == NULL)
+    goto failed;
+  if (fread(body, 1, size, fp) != (size_t) size)
+    goto failed;
+  fclose(fp);
+  fp = NULL;
+
+  /*
+   * Half-written file fails here and the last staple stays, takes ownership
+   * of `body`
+   */
+  r = bud_context_staple_der(context, body, size, 1);
+  body = NULL;
+  if (r != 0)
+    goto failed;
+
+  bud_log(config, kBudLogDebug, "loaded staple from %s", context->ocsp_file);
+  return;
 
-  obj = json_value_get_object(json);
-  b64_body = json_object_get_string(obj, "response");
+failed:
+  if (fp != NULL)
+    fclose(fp);
+  free(body);
+  bud_log(config,
+          kBudLogWarning,
+          "failed to load staple from %s",
+          context->ocsp_file);
+  context->staple_refresh = time(NULL) + BUD_OCSP_RETRY_INTERVAL;
+}
+
+
+int bud_ocsp_sni_staple(bud_context_t* context, bud_json_stream_t* stream) {
+  /* No staple in the response, stapling backend will be asked for it */
+  if (bud_json_stream_count(stream, "ocsp") == 0)
+    return -1;
+
+  return bud_context_staple_json(context, stream, "ocsp");
+}
+
+
+/* `field` is extracted by the pool, see `bud_ocsp_extract` */
+int bud_context_staple_json(bud_context_t* context,
+                            bud_json_stream_t* stream,
+                            const char* field) {
+  const char* b64_body;
+  size_t b64_body_len;
+  char* body;
+  size_t body_len;
+
+  b64_body = bud_json_stream_value(stream, field, 0, &b64_body_len);
   if (b64_body == NULL)
-    goto done;
+    return -1;
+
+  /* Binary lookup, it is DER already */
+  if (stream->der) {
+    body = malloc(b64_body_len);
+    if (body == NULL)
+      return -1;
+    memcpy(body, b64_body, b64_body_len);
+    return bud_context_staple_der(context, body, b64_body_len, 0);
+  }
 
-  b64_body_len = strlen(b64_body);
   body_len = bud_base64_decoded_size_fast(b64_body_len);
   body = malloc(body_len);
   if (body == NULL)
-    goto done;
+    return -1;
 
   body_len = bud_base64_decode(body, body_len, b64_body, b64_body_len);
+
+  /* Backend is trusted, do not verify signature */
+  return bud_context_staple_der(context, body, body_len, 0);
+}
+
+
+int bud_context_staple_der(bud_context_t* context,
+                           char* body,
+                           size_t body_len,
+                           int verify) {
+  const unsigned char* pbody;
+  OCSP_RESPONSE* resp;
+  OCSP_BASICRESP* basic;
+  ASN1_GENERALIZEDTIME* this_update;
+  ASN1_GENERALIZEDTIME* next_update;
+  time_t now;
+  time_t expire;
+  time_t ttl;
+  int status;
+  int r;
+
+  r = -1;
+  resp = NULL;
+  basic = NULL;
+
   pbody = (const unsigned char*) body;
   resp = d2i_OCSP_RESPONSE(NULL, &pbody, body_len);
   if (resp == NULL)
     goto done;
 
   /* Not successful response, do not waste bandwidth on it */
-  status = OCSP_response_status(resp);
-  OCSP_RESPONSE_free(resp);
-  if (status != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+  if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+    goto done;
+
+  basic = OCSP_response_get1_basic(resp);
+  if (basic == NULL)
+    goto done;
+
+  if (verify && !bud_context_staple_verify(context, basic))
     goto done;
 
+  /* Response should be about our certificate and be valid for now */
+  if (!OCSP_resp_find_status(basic,
+                             context->ocsp_id,
+                             &status,
+                             NULL,
+                             NULL,
+                             &this_update,
+                             &next_update)) {
+    goto done;
+  }
+  if (!OCSP_check_validity(this_update, next_update, BUD_OCSP_MAX_SKEW, -1))
+    goto done;
+
+  /* Refresh somewhere between 1/2 and 3/4 of the remaining validity */
+  now = time(NULL);
+  expire = next_update == NULL ? 0 : bud_ocsp_time(next_update);
+  if (expire > now)
+    ttl = expire - now;
+  else
+    ttl = BUD_OCSP_DEFAULT_TTL;
+  ttl = ttl / 2 + (ttl >= 4 ? rand() % (ttl / 4) : 0);
+
   /* Set stapling! */
-  client->stapling_ocsp_resp = body;
-  client->stapling_ocsp_resp_len = body_len;
+  free(context->staple);
+  context->staple = body;
+  context->staple_len = body_len;
+  context->staple_expire = expire;
+  context->staple_refresh = now + ttl;
   body = NULL;
   r = 0;
 
 done:
+  if (basic != NULL)
+    OCSP_BASICRESP_free(basic);
+  if (resp != NULL)
+    OCSP_RESPONSE_free(resp);
   free(body);
   return r;
 }
 
 
+int bud_context_staple_verify(bud_context_t* context, OCSP_BASICRESP* basic) {
+  STACK_OF(X509)* certs;
+  X509_STORE* store;
+  int r;
+
+  if (context->issuer == NULL)
+    return 0;
+
+  r = 0;
+  certs = sk_X509_new_null();
+  store = X509_STORE_new();
+  if (certs == NULL || store == NULL)
+    goto done;
+
+  /*
+   * Response signed by the issuer is trusted as is (`certs`). Delegated
+   * responder's certificate comes in the response, and should be issued
+   * right by the issuer (hence OCSP_NOCHAIN) with id-kp-OCSPSigning, which
+   * OCSP_basic_verify() checks on the chain built up to the `store`.
+   */
+  if (!sk_X509_push(certs, context->issuer))
+    goto done;
+  if (!X509_STORE_add_cert(store, context->issuer))
+    goto done;
+  X509_STORE_set_verify_cb_func(store, bud_context_staple_verify_cb);
+
+  r = OCSP_basic_verify(basic,
+                        certs,
+                        store,
+                        OCSP_TRUSTOTHER | OCSP_NOCHAIN) > 0;
+
+done:
+  if (store != NULL)
+    X509_STORE_free(store);
+  if (certs != NULL)
+    sk_X509_free(certs);
+  return r;
+}
+
+
+int bud_context_staple_verify_cb(int ok, X509_STORE_CTX* ctx) {
+  X509_OBJECT obj;
+  int err;
+
+  if (ok)
+    return ok;
+
+  /*
+   * Issuer is usually an intermediate, without its root in the store. There
+   * is no X509_V_FLAG_PARTIAL_CHAIN in this OpenSSL, so take the chain that
+   * ends at the issuer from the store as trusted.
+   */
+  err = X509_STORE_CTX_get_error(ctx);
+  if (err != X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT &&
+      err != X509_V_ERR_CERT_UNTRUSTED) {
+    return 0;
+  }
+
+  obj.type = X509_LU_X509;
+  obj.data.x509 = X509_STORE_CTX_get_current_cert(ctx);
+  return obj.data.x509 != NULL &&
+         X509_OBJECT_retrieve_match(ctx->ctx->objs, &obj) != NULL;
+}
+
+
+time_t bud_ocsp_time(ASN1_GENERALIZEDTIME* t) {
+  struct tm tm;
+  const unsigned char* p;
+  int i;
+
+  /* YYYYMMDDHHMMSS[.fff]Z, OCSP times are always GeneralizedTime */
+  if (t->length < 15)
+    return 0;
+  p = t->data;
+  for (i = 0; i < 14; i++)
+    if (p[i] < '0' || p[i] > '9')
+      return 0;
+
+#define DIGITS2(off) ((p[(off)] - '0') * 10 + (p[(off) + 1] - '0'))
+  memset(&tm, 0, sizeof(tm));
+  tm.tm_year = DIGITS2(0) * 100 + DIGITS2(2) - 1900;
+  tm.tm_mon = DIGITS2(4) - 1;
+  tm.tm_mday = DIGITS2(6);
+  tm.tm_hour = DIGITS2(8);
+  tm.tm_min = DIGITS2(10);
+  tm.tm_sec = DIGITS2(12);
+#undef DIGITS2
+
+  return timegm(&tm);
+}
+
+
+void bud_context_staple_max_age(bud_context_t* context, int max_age) {
+  time_t refresh;
+
+  /*
+   * Staple is always served until it expires, while the refresh is running
+   * in the background. `Cache-Control: max-age` of the server only tells
+   * when to start it, but not more often than retries and not after expiry.
+   */
+  if (max_age < 0)
+    return;
+
+  refresh = time(NULL) + (max_age > BUD_OCSP_RETRY_INTERVAL ?
+                          max_age : BUD_OCSP_RETRY_INTERVAL);
+  if (context->staple_expire != 0 &&
+      refresh > context->staple_expire - BUD_OCSP_RETRY_INTERVAL) {
+    refresh = context->staple_expire - BUD_OCSP_RETRY_INTERVAL;
+  }
+  context->staple_refresh = refresh;
+}
+
+
+void bud_context_staple_fetched(bud_config_t* config,
+                                bud_context_t* context,
+                                int max_age) {
+  const char* id;
+  size_t id_size;
+  uv_buf_t buf;
+  int64_t expire;
+
+  bud_context_staple_max_age(context, max_age);
+  bud_context_staple_updated(config, context);
+  bud_context_staple_share(config, context);
+
+  /* Without nextUpdate it is good for as long as it would be refreshed in */
+  id = bud_context_get_ocsp_id(context, &id_size);
+  if (config->disk_cache.cache == NULL || id == NULL)
+    return;
+  expire = context->staple_expire;
+  if (expire == 0)
+    expire = time(NULL) + BUD_OCSP_DEFAULT_TTL;
+  buf = uv_buf_init(context->staple, context->staple_len);
+  bud_disk_cache_put(config->disk_cache.cache,
+                     kBudDiskStaple,
+                     id,
+                     id_size,
+                     expire,
+                     expire,
+                     &buf,
+                     1);
+}
+
+
+int bud_context_staple_restore(bud_config_t* config, bud_context_t* context) {
+  const bud_disk_record_t* rec;
+  const char* id;
+  size_t id_size;
+  char* body;
+
+  id = bud_context_get_ocsp_id(context, &id_size);
+  rec = bud_disk_cache_get(config->disk_cache.cache,
+                           kBudDiskStaple,
+                           id,
+                           id_size);
+  if (rec == NULL)
+    return -1;
+
+  body = malloc(rec->data_len);
+  if (body == NULL)
+    return -1;
+  memcpy(body, bud_disk_record_data(rec), rec->data_len);
+
+  /* Verified again, takes ownership of `body` */
+  if (bud_context_staple_der(context, body, rec->data_len, 1) != 0)
+    return -1;
+
+  bud_log(config, kBudLogDebug, "stapling restored from disk");
+  bud_context_staple_updated(config, context);
+  bud_context_staple_share(config, context);
+  return 0;
+}
+
+
+void bud_context_staple_share(bud_config_t* config, bud_context_t* context) {
+  const char* id;
+  size_t id_size;
+  uv_buf_t buf;
+  int64_t stale;
+
+  if (config->shared_cache.cache == NULL)
+    return;
+
+  /* Fresh for others until it is due to be refreshed here */
+  id = bud_context_get_ocsp_id(context, &id_size);
+  stale = context->staple_expire;
+  if (stale < context->staple_refresh)
+    stale = context->staple_refresh;
+  buf = uv_buf_init(context->staple, context->staple_len);
+  bud_shared_cache_put(config->shared_cache.cache,
+                       kBudSharedStaple,
+                       id,
+                       id_size,
+                       context->staple_refresh,
+                       stale,
+                       &buf,
+                       1);
+}
+
+
+int bud_context_staple_shared(bud_config_t* config, bud_context_t* context) {
+  const char* id;
+  size_t id_size;
+  char* body;
+  size_t len;
+  int64_t expire;
+  int64_t stale;
+
+  id = bud_context_get_ocsp_id(context, &id_size);
+  body = bud_shared_cache_get(config->shared_cache.cache,
+                              kBudSharedStaple,
+                              id,
+                              id_size,
+                              &len,
+                              &expire,
+                              &stale);
+  if (body == NULL)
+    return -1;
+
+  /* Fetching worker is due to refresh it too */
+  if (expire <= time(NULL)) {
+    free(body);
+    return -1;
+  }
+
+  /* Checked by the worker that fetched it, takes ownership of `body` */
+  if (bud_context_staple_der(context, body, len, 0) != 0)
+    return -1;
+
+  /* Refresh along with the fetching worker, not on our own schedule */
+  context->staple_refresh = expire;
+  bud_context_staple_updated(config, context);
+  return 0;
+}
+
+
+void bud_ocsp_prewarm(bud_config_t* config) {
+  int i;
+
+  for (i = 0; i < config->context_count + 1; i++)
+    bud_context_stapling_refresh(config, &config->contexts[i]);
+}
+
+
+bud_error_t bud_ocsp_send_staples(bud_config_t* config, uv_stream_t* stream) {
+  bud_error_t err;
+  int i;
+
+  for (i = 0; i < config->context_count + 1; i++) {
+    if (config->contexts[i].staple == NULL)
+      continue;
+
+    err = bud_context_staple_send(config, &config->contexts[i], stream);
+    if (!bud_is_ok(err))
+      return err;
+  }
+
+  return bud_ok();
+}
+
+
+void bud_context_staple_updated(bud_config_t* config, bud_context_t* context) {
+  bud_error_t err;
+  bud_worker_t* worker;
+  int i;
+
+  /* Only master is sharing staples */
+  if (config->is_worker || config->worker_count == 0)
+    return;
+
+  /* Draining workers won't accept new clients, spares will */
+  for (i = 0; i < config->worker_slots; i++) {
+    worker = &config->workers[config->worker_base + i];
+    if (!worker->active)
+      continue;
+
+    err = bud_context_staple_send(config,
+                                  context,
+                                  (uv_stream_t*) &worker->ipc);
+    if (!bud_is_ok(err))
+      bud_error_log(config, kBudLogWarning, err);
+  }
+}
+
+
+bud_error_t bud_context_staple_send(bud_config_t* config,
+                                    bud_context_t* context,
+                                    uv_stream_t* stream) {
+  char index[4];
+  uint32_t i;
+
+  i = context - config->contexts;
+  index[0] = (i >> 24) & 0xff;
+  index[1] = (i >> 16) & 0xff;
+  index[2] = (i >> 8) & 0xff;
+  index[3] = i & 0xff;
+
+  return bud_ipc_send(config,
+                      stream,
+                      kBudIPCStaple,
+                      index,
+                      sizeof(index),
+                      context->staple,
+                      context->staple_len);
+}
+
+
+void bud_ocsp_ipc_staple(bud_config_t* config,
+                         const char* data,
+                         size_t size) {
+  const unsigned char* p;
+  bud_context_t* context;
+  uint32_t index;
+  char* body;
+
+  if (size < 4)
+    return;
+
+  p = (const unsigned char*) data;
+  index = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  if (index >= (uint32_t) config->context_count + 1)
+    return;
+  context = &config->contexts[index];
+
+  /* Lazy context that isn't built here (yet) */
+  if (context->ocsp_id == NULL)
+    return;
+
+  body = malloc(size - 4);
+  if (body == NULL)
+    return;
+  memcpy(body, data + 4, size - 4);
+
+  /* Verified by master, takes ownership of `body` */
+  if (bud_context_staple_der(context, body, size - 4, 0) != 0) {
+    bud_log(config, kBudLogWarning, "received invalid staple from master");
+    return;
+  }
+
+  /* Master keeps it fresh, refresh it here only if it didn't */
+  if (context->staple_expire != 0)
+    context->staple_refresh = context->staple_expire - BUD_OCSP_RETRY_INTERVAL;
+  else
+    context->staple_refresh = time(NULL) + 2 * BUD_OCSP_DEFAULT_TTL;
+  bud_log(config, kBudLogDebug, "received staple for context %d", index);
+}
+
+
 int bud_client_stapling_cb(SSL* ssl, void* arg) {
+  bud_context_t* context;
   bud_client_t* client;
+  char* resp;
 
   client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
-  if (client->stapling_ocsp_resp == NULL)
-    return SSL_TLSEXT_ERR_NOACK;
+  context = SSL_get_ex_data(ssl, kBudSSLSNIIndex);
+  if (client != NULL)
+    client->stats.staple = uv_now(client->config->loop);
+  if (context == NULL || context->staple == NULL)
+    goto miss;
+
+  /* Handshake started before bud_config_reload_contexts() */
+  if (context->cert == NULL ||
+      SSL_get_certificate(ssl) == NULL ||
+      X509_cmp(SSL_get_certificate(ssl), context->cert) != 0) {
+    goto miss;
+  }
+
+  /* Never serve expired staple */
+  if (context->staple_expire != 0 && context->staple_expire <= time(NULL))
+    goto miss;
 
-  SSL_set_tlsext_status_ocsp_resp(ssl,
-                                  client->stapling_ocsp_resp,
-                                  client->stapling_ocsp_resp_len);
-  client->stapling_ocsp_resp = NULL;
+  /* OpenSSL takes ownership of the response */
+  resp = malloc(context->staple_len);
+  if (resp == NULL)
+    goto miss;
+  memcpy(resp, context->staple, context->staple_len);
+
+  SSL_set_tlsext_status_ocsp_resp(ssl, resp, context->staple_len);
+
+  if (client != NULL) {
+    client->stats.stapled = 1;
+    bud_metrics_inc(client->config, kBudMetricStapleHits);
+  }
   return SSL_TLSEXT_ERR_OK;
+
+miss:
+  if (client != NULL)
+    bud_metrics_inc(client->config, kBudMetricStapleMisses);
+  return SSL_TLSEXT_ERR_NOACK;
 }
@@ -1,14 +1,50 @@
 #ifndef SRC_OCSP_H_
 #define SRC_OCSP_H_
 
+#include "uv.h"
 #include "openssl/ssl.h"
 
 #include "error.h"
+#include "json-stream.h"
 
-/* Forward declaration */
+/* Forward declarations */
 struct bud_client_s;
+struct bud_config_s;
+struct bud_context_s;
 
 bud_error_t bud_client_ocsp_stapling(struct bud_client_s* client);
 int bud_client_stapling_cb(SSL* ssl, void* arg);
 
+/* Members of stapling server's response extracted by its http pool */
+extern const char* const bud_ocsp_extract[];
+
+/*
+ * Staple that came inline with SNI response (its `ocsp` member), saves the
+ * request to the stapling backend. Returns 0 if it was good and is used.
+ */
+int bud_ocsp_sni_staple(struct bud_context_s* context,
+                        bud_json_stream_t* stream);
+
+/* Pools for OCSP responders (`stapling.direct` mode) */
+void bud_ocsp_responders_free(struct bud_config_s* config);
+
+/*
+ * Contexts with `ocsp_file` staple it instead of asking the backend. It is
+ * read on start and whenever it changes, invalid one keeps the last staple.
+ * Missing file isn't fatal, handshakes just go without a staple until then.
+ */
+bud_error_t bud_ocsp_files_init(struct bud_config_s* config);
+void bud_ocsp_files_free(struct bud_config_s* config);
+
+/*
+ * Master fetches staples for static contexts and ships them to the workers
+ * (kBudIPCStaple), see bud_ocsp_ipc_staple().
+ */
+void bud_ocsp_prewarm(struct bud_config_s* config);
+bud_error_t bud_ocsp_send_staples(struct bud_config_s* config,
+                                  uv_stream_t* stream);
+void bud_ocsp_ipc_staple(struct bud_config_s* config,
+                         const char* data,
+                         size_t size);
+
 #endif  /* SRC_OCSP_H_ */
@@ -0,0 +1,269 @@
+#include <stdlib.h>  /* calloc, free */
+
+#include "uv.h"
+#include "openssl/bio.h"
+#include "openssl/crypto.h"
+#include "openssl/err.h"
+#include "openssl/evp.h"
+#include "openssl/pem.h"
+#include "openssl/x509.h"
+
+#include "preload.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+typedef struct bud_preload_state_s bud_preload_state_t;
+
+struct bud_preload_state_s {
+  bud_config_t* config;
+  bud_context_t* contexts;
+  bud_preload_t* preload;
+  int count;
+
+  /* Next context to take */
+  uv_mutex_t lock;
+  int next;
+};
+
+static void bud_preload_lock_cb(int mode, int n, const char* file, int line);
+static void bud_preload_thread(void* arg);
+static void bud_preload_context(bud_config_t* config,
+                                bud_context_t* ctx,
+                                int index,
+                                bud_preload_t* preload);
+
+/* OpenSSL 1.0.1 is thread-safe only with these, while threads are running */
+static uv_mutex_t* bud_preload_locks;
+static int bud_preload_lock_count;
+static int bud_preload_lock_refs;
+
+
+bud_preload_t* bud_preload_contexts(bud_config_t* config,
+                                    bud_context_t* contexts,
+                                    int count,
+                                    bud_error_t* err) {
+  bud_preload_state_t state;
+  uv_thread_t* threads;
+  int thread_count;
+  int i;
+  int r;
+
+  *err = bud_ok();
+  if (config->frontend.passthrough || config->lazy_contexts.enabled)
+    return NULL;
+
+  thread_count = config->load_threads;
+  if (thread_count > count)
+    thread_count = count;
+  if (thread_count < 2)
+    return NULL;
+
+  state.config = config;
+  state.contexts = contexts;
+  state.count = count;
+  state.next = 0;
+  state.preload = calloc(count, sizeof(*state.preload));
+  threads = calloc(thread_count, sizeof(*threads));
+  if (state.preload == NULL || threads == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_preload_t");
+    goto failed_alloc;
+  }
+
+  if (uv_mutex_init(&state.lock) != 0) {
+    *err = bud_error_str(kBudErrNoMem, "preload lock");
+    goto failed_alloc;
+  }
+
+  *err = bud_preload_locks_init();
+  if (!bud_is_ok(*err))
+    goto failed_locks_init;
+
+  for (i = 0; i < thread_count; i++) {
+    r = uv_thread_create(&threads[i], bud_preload_thread, &state);
+    if (r != 0) {
+      *err = bud_error_num(kBudErrPreloadThread, r);
+      break;
+    }
+  }
+
+  /* Let the started ones finish, even on failure */
+  thread_count = i;
+  for (i = 0; i < thread_count; i++)
+    uv_thread_join(&threads[i]);
+
+  bud_preload_locks_destroy();
+  uv_mutex_destroy(&state.lock);
+  free(threads);
+
+  if (!bud_is_ok(*err)) {
+    bud_preload_free(state.preload, count);
+    return NULL;
+  }
+
+  bud_log(config,
+          kBudLogDebug,
+          "preloaded %d contexts in %d threads",
+          count,
+          thread_count);
+  return state.preload;
+
+failed_locks_init:
+  uv_mutex_destroy(&state.lock);
+
+failed_alloc:
+  free(state.preload);
+  free(threads);
+  return NULL;
+}
+
+
+void bud_preload_free(bud_preload_t* preload, int count) {
+  int i;
+  int j;
+
+  if (preload == NULL)
+    return;
+
+  /* Whatever wasn't taken */
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < BUD_PRELOAD_MAX_PAIRS; j++) {
+      if (preload[i].certs[j] != NULL)
+        sk_X509_pop_free(preload[i].certs[j], X509_free);
+      if (preload[i].keys[j] != NULL)
+        EVP_PKEY_free(preload[i].keys[j]);
+    }
+  }
+  free(preload);
+}
+
+
+bud_error_t bud_preload_locks_init(void) {
+  int i;
+
+  /* Installed already, or somebody (i.e. an ENGINE) took care of it */
+  if (bud_preload_lock_refs++ > 0 || CRYPTO_get_locking_callback() != NULL)
+    return bud_ok();
+
+  bud_preload_lock_count = CRYPTO_num_locks();
+  bud_preload_locks = calloc(bud_preload_lock_count,
+                             sizeof(*bud_preload_locks));
+  if (bud_preload_locks == NULL) {
+    bud_preload_lock_refs--;
+    return bud_error_str(kBudErrNoMem, "OpenSSL locks");
+  }
+
+  for (i = 0; i < bud_preload_lock_count; i++) {
+    if (uv_mutex_init(&bud_preload_locks[i]) != 0)
+      break;
+  }
+  if (i != bud_preload_lock_count) {
+    while (--i >= 0)
+      uv_mutex_destroy(&bud_preload_locks[i]);
+    free(bud_preload_locks);
+    bud_preload_locks = NULL;
+    bud_preload_lock_refs--;
+    return bud_error_str(kBudErrNoMem, "OpenSSL locks");
+  }
+
+  /* Default thread id is the address of `errno`, which is per-thread */
+  CRYPTO_set_locking_callback(bud_preload_lock_cb);
+  return bud_ok();
+}
+
+
+void bud_preload_locks_destroy(void) {
+  int i;
+
+  if (--bud_preload_lock_refs > 0 || bud_preload_locks == NULL)
+    return;
+
+  /* Back to single thread, don't pay for the locks in the event loop */
+  CRYPTO_set_locking_callback(NULL);
+  for (i = 0; i < bud_preload_lock_count; i++)
+    uv_mutex_destroy(&bud_preload_locks[i]);
+  free(bud_preload_locks);
+  bud_preload_locks = NULL;
+}
+
+
+void bud_preload_lock_cb(int mode, int n, const char* file, int line) {
+  if (mode & CRYPTO_LOCK)
+    uv_mutex_lock(&bud_preload_locks[n]);
+  else
+    uv_mutex_unlock(&bud_preload_locks[n]);
+}
+
+
+void bud_preload_thread(void* arg) {
+  bud_preload_state_t* state;
+  int i;
+
+  state = arg;
+  for (;;) {
+    uv_mutex_lock(&state->lock);
+    i = state->next++;
+    uv_mutex_unlock(&state->lock);
+    if (i >= state->count)
+      break;
+
+    bud_preload_context(state->config,
+                        &state->contexts[i],
+                        i,
+                        &state->preload[i]);
+  }
+
+  /* Error queue of this thread */
+  ERR_remove_thread_state(NULL);
+}
+
+
+void bud_preload_context(bud_config_t* config,
+                         bud_context_t* ctx,
+                         int index,
+                         bud_preload_t* preload) {
+  const char* cert_file;
+  const char* key_file;
+  const bud_config_strs_t* cert_files;
+  const bud_config_strs_t* key_files;
+  BIO* bio;
+  int count;
+  int i;
+
+  bud_config_context_files(config,
+                           ctx,
+                           index,
+                           &cert_file,
+                           &key_file,
+                           &cert_files,
+                           &key_files);
+
+  count = cert_files == NULL ? 1 : cert_files->count;
+  for (i = 0; i < count && i < BUD_PRELOAD_MAX_PAIRS; i++) {
+    if (cert_files != NULL)
+      cert_file = cert_files->items[i];
+    if (cert_file == NULL)
+      return;
+
+    bio = BIO_new_file(cert_file, "r");
+    if (bio == NULL)
+      return;
+    preload->certs[i] = bud_config_read_pem_chain(bio);
+    BIO_free_all(bio);
+  }
+
+  count = key_files == NULL ? 1 : key_files->count;
+  for (i = 0; i < count && i < BUD_PRELOAD_MAX_PAIRS; i++) {
+    if (key_files != NULL)
+      key_file = key_files->items[i];
+    if (key_file == NULL)
+      return;
+
+    bio = BIO_new_file(key_file, "r");
+    if (bio == NULL)
+      return;
+    preload->keys[i] = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+    BIO_free_all(bio);
+  }
+}
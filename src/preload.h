@@ -0,0 +1,43 @@
+#ifndef SRC_PRELOAD_H_
+#define SRC_PRELOAD_H_
+
+#include "openssl/evp.h"
+#include "openssl/x509.h"
+
+#include "config.h"
+#include "error.h"
+
+/* Key pairs per context read ahead, contexts with more load serially */
+#define BUD_PRELOAD_MAX_PAIRS 4
+
+typedef struct bud_preload_s bud_preload_t;
+
+/*
+ * Certificate chains (leaf first) and keys of one context, read from its
+ * files by a pool of `load_threads` threads. NULL - failed or not read,
+ * bud_config_load_context() reads it on its own then (and reports errors).
+ * Consumers take the objects and NULL the slots.
+ */
+struct bud_preload_s {
+  STACK_OF(X509)* certs[BUD_PRELOAD_MAX_PAIRS];
+  EVP_PKEY* keys[BUD_PRELOAD_MAX_PAIRS];
+};
+
+/*
+ * One entry per item of `contexts` (of `count`, same indexes as in
+ * `config->contexts`). NULL with ok `err` - `load_threads` is less than 2.
+ */
+bud_preload_t* bud_preload_contexts(bud_config_t* config,
+                                    bud_context_t* contexts,
+                                    int count,
+                                    bud_error_t* err);
+void bud_preload_free(bud_preload_t* preload, int count);
+
+/*
+ * Locking callbacks for OpenSSL, reference counted. Must be installed for as
+ * long as more than one thread uses it (preload and `threads`).
+ */
+bud_error_t bud_preload_locks_init(void);
+void bud_preload_locks_destroy(void);
+
+#endif  /* SRC_PRELOAD_H_ */
@@ -0,0 +1,27 @@
+#ifndef SRC_PROBES_H_
+#define SRC_PROBES_H_
+
+/*
+ * USDT probes of the "bud" provider, compiled in with `-Dbud_usdt=1` (needs
+ * <sys/sdt.h> from systemtap-sdt-dev). Each one is a single `nop` and a note
+ * in the ELF until a tracer attaches to it, arguments are values that are
+ * at hand anyway. `__` in the name is `-` for the tracers, i.e.:
+ *
+ *   bpftrace -e 'usdt:./bud:bud:client-close { printf("%s\n", str(arg1)) }'
+ */
+
+#ifdef BUD_USDT
+# include <sys/sdt.h>
+# define BUD_PROBE1(name, a1) DTRACE_PROBE1(bud, name, a1)
+# define BUD_PROBE2(name, a1, a2) DTRACE_PROBE2(bud, name, a1, a2)
+# define BUD_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(bud, name, a1, a2, a3)
+# define BUD_PROBE4(name, a1, a2, a3, a4)                                     \
+    DTRACE_PROBE4(bud, name, a1, a2, a3, a4)
+#else  /* !BUD_USDT */
+# define BUD_PROBE1(name, a1) do {} while (0)
+# define BUD_PROBE2(name, a1, a2) do {} while (0)
+# define BUD_PROBE3(name, a1, a2, a3) do {} while (0)
+# define BUD_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#endif  /* BUD_USDT */
+
+#endif  /* SRC_PROBES_H_ */
@@ -0,0 +1,165 @@
+#include <arpa/inet.h>  /* htons */
+#include <netinet/in.h>  /* sockaddr_in, sockaddr_in6 */
+#include <stdio.h>  /* sscanf */
+#include <string.h>  /* memcmp, memcpy, memset, strcmp */
+
+#include "uv.h"
+
+#include "proxy-parser.h"
+#include "error.h"
+
+/* "PROXY TCP6 " and two full IPv6 addresses with ports, and CRLF */
+#define BUD_PROXY_V1_MAX 107
+
+static const char kProxyV2Sig[] = "\r\n\r\n\0\r\nQUIT\n";
+static const size_t kProxyV2SigLen = 12;
+static const char kProxyV1Prefix[] = "PROXY ";
+static const size_t kProxyV1PrefixLen = 6;
+
+static bud_error_t bud_proxy_parse_v1(bud_proxy_parser_t* parser,
+                                      struct sockaddr_storage* addr);
+static bud_error_t bud_proxy_parse_v2(bud_proxy_parser_t* parser,
+                                      struct sockaddr_storage* addr);
+
+
+void bud_proxy_parser_init(bud_proxy_parser_t* parser) {
+  parser->len = 0;
+  parser->consumed = 0;
+}
+
+
+bud_error_t bud_proxy_parser_execute(bud_proxy_parser_t* parser,
+                                     const char* data,
+                                     size_t size,
+                                     struct sockaddr_storage* addr) {
+  size_t avail;
+
+  /* The rest may be TLS, it is left in the input */
+  avail = sizeof(parser->buf) - parser->len;
+  if (size > avail)
+    size = avail;
+  memcpy(parser->buf + parser->len, data, size);
+  parser->len += size;
+
+  memset(addr, 0, sizeof(*addr));
+  if (parser->len == 0)
+    return bud_error(kBudErrParserNeedMore);
+  if (parser->buf[0] == '\r')
+    return bud_proxy_parse_v2(parser, addr);
+  if (parser->buf[0] == 'P')
+    return bud_proxy_parse_v1(parser, addr);
+  return bud_error_str(kBudErrParserErr, "no PROXY header");
+}
+
+
+bud_error_t bud_proxy_parse_v1(bud_proxy_parser_t* parser,
+                               struct sockaddr_storage* addr) {
+  char line[BUD_PROXY_V1_MAX + 1];
+  char proto[8];
+  char src[INET6_ADDRSTRLEN];
+  char dst[INET6_ADDRSTRLEN];
+  unsigned short sport;
+  unsigned short dport;
+  struct sockaddr_in* addr4;
+  struct sockaddr_in6* addr6;
+  size_t len;
+  size_t i;
+  int r;
+
+  len = parser->len < kProxyV1PrefixLen ? parser->len : kProxyV1PrefixLen;
+  if (memcmp(parser->buf, kProxyV1Prefix, len) != 0)
+    return bud_error_str(kBudErrParserErr, "no PROXY header");
+
+  /* "PROXY <proto> <src> <dst> <sport> <dport>\r\n" */
+  for (i = 1; i < parser->len && i < BUD_PROXY_V1_MAX; i++)
+    if (parser->buf[i - 1] == '\r' && parser->buf[i] == '\n')
+      break;
+  if (i >= BUD_PROXY_V1_MAX)
+    return bud_error_str(kBudErrParserErr, "PROXY v1 line is too long");
+  if (i >= parser->len)
+    return bud_error(kBudErrParserNeedMore);
+  parser->consumed = i + 1;
+
+  memcpy(line, parser->buf, i - 1);
+  line[i - 1] = '\0';
+  r = sscanf(line,
+             "PROXY %7s %45s %45s %hu %hu",
+             proto,
+             src,
+             dst,
+             &sport,
+             &dport);
+
+  /* Balancer doesn't know, keep its own address */
+  if (r >= 1 && strcmp(proto, "UNKNOWN") == 0)
+    return bud_ok();
+  if (r != 5)
+    return bud_error_str(kBudErrParserErr, "malformed PROXY v1 line");
+
+  addr4 = (struct sockaddr_in*) addr;
+  addr6 = (struct sockaddr_in6*) addr;
+  if (strcmp(proto, "TCP4") == 0) {
+    r = uv_inet_pton(AF_INET, src, &addr4->sin_addr);
+    addr4->sin_family = AF_INET;
+    addr4->sin_port = htons(sport);
+  } else if (strcmp(proto, "TCP6") == 0) {
+    r = uv_inet_pton(AF_INET6, src, &addr6->sin6_addr);
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(sport);
+  } else {
+    r = -1;
+  }
+  if (r != 0) {
+    memset(addr, 0, sizeof(*addr));
+    return bud_error_str(kBudErrParserErr, "malformed PROXY v1 address");
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_proxy_parse_v2(bud_proxy_parser_t* parser,
+                               struct sockaddr_storage* addr) {
+  const unsigned char* p;
+  struct sockaddr_in* addr4;
+  struct sockaddr_in6* addr6;
+  size_t len;
+
+  len = parser->len < kProxyV2SigLen ? parser->len : kProxyV2SigLen;
+  if (memcmp(parser->buf, kProxyV2Sig, len) != 0)
+    return bud_error_str(kBudErrParserErr, "no PROXY header");
+  if (parser->len < 16)
+    return bud_error(kBudErrParserNeedMore);
+
+  /* Signature, version and command, family, length of the rest */
+  p = (const unsigned char*) parser->buf;
+  if ((p[12] & 0xf0) != 0x20)
+    return bud_error_str(kBudErrParserErr, "unsupported PROXY version");
+  len = 16 + ((p[14] << 8) | p[15]);
+  if (len > sizeof(parser->buf))
+    return bud_error_str(kBudErrParserErr, "PROXY v2 header is too long");
+  if (parser->len < len)
+    return bud_error(kBudErrParserNeedMore);
+  parser->consumed = len;
+
+  /* LOCAL - connection of the balancer itself */
+  if ((p[12] & 0x0f) == 0x00)
+    return bud_ok();
+  if ((p[12] & 0x0f) != 0x01)
+    return bud_error_str(kBudErrParserErr, "unsupported PROXY command");
+
+  /* TLVs are ignored, UNSPEC and AF_UNIX keep the balancer's address */
+  addr4 = (struct sockaddr_in*) addr;
+  addr6 = (struct sockaddr_in6*) addr;
+  if ((p[13] >> 4) == 0x1 && len >= 16 + 12) {
+    addr4->sin_family = AF_INET;
+    memcpy(&addr4->sin_addr, p + 16, 4);
+    memcpy(&addr4->sin_port, p + 16 + 8, 2);
+  } else if ((p[13] >> 4) == 0x2 && len >= 16 + 36) {
+    addr6->sin6_family = AF_INET6;
+    memcpy(&addr6->sin6_addr, p + 16, 16);
+    memcpy(&addr6->sin6_port, p + 16 + 32, 2);
+  }
+
+  return bud_ok();
+}
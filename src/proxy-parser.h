@@ -0,0 +1,38 @@
+#ifndef SRC_PROXY_PARSER_H_
+#define SRC_PROXY_PARSER_H_
+
+#include <stdlib.h>  /* size_t */
+#include <sys/socket.h>  /* sockaddr_storage */
+
+#include "error.h"
+
+/* Senders must fit the whole header in 536 bytes (i.e. minimal TCP MSS) */
+#define BUD_PROXY_PARSER_MAX 536
+
+typedef struct bud_proxy_parser_s bud_proxy_parser_t;
+
+/*
+ * Resumable parser of PROXY protocol v1 line or v2 header in front of the
+ * ClientHello. Bytes are collected in `buf` until the whole header is there,
+ * `consumed` is its length then, everything after it is TLS.
+ */
+struct bud_proxy_parser_s {
+  char buf[BUD_PROXY_PARSER_MAX];
+  size_t len;
+  size_t consumed;
+};
+
+void bud_proxy_parser_init(bud_proxy_parser_t* parser);
+
+/*
+ * Feed bytes that follow the previously seen ones (see `len`). Returns
+ * `kBudErrParserNeedMore` until the header is complete. `addr` is the source
+ * address from it, `ss_family` is 0 for LOCAL command and UNKNOWN addresses
+ * (i.e. balancer's own health checks).
+ */
+bud_error_t bud_proxy_parser_execute(bud_proxy_parser_t* parser,
+                                     const char* data,
+                                     size_t size,
+                                     struct sockaddr_storage* addr);
+
+#endif  /* SRC_PROXY_PARSER_H_ */
@@ -0,0 +1,199 @@
+#include <errno.h>  /* errno */
+#include <fcntl.h>  /* open */
+#include <stdlib.h>  /* calloc, free */
+#include <sys/mman.h>  /* mmap, munmap */
+#include <unistd.h>  /* close, ftruncate */
+
+#include "ratelimit.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+
+static uint32_t bud_ratelimit_hash(const char* key, size_t key_len);
+static void bud_shape_refill(bud_shape_t* shape,
+                             uint64_t rate,
+                             uint64_t burst,
+                             uint64_t now);
+
+
+bud_error_t bud_ratelimit_new(bud_config_t* config, bud_ratelimit_t** out) {
+  int fd;
+  int r;
+  size_t len;
+  void* map;
+  bud_ratelimit_t* rl;
+  bud_error_t err;
+
+  *out = NULL;
+  if (config->frontend.rate_limit.rate <= 0)
+    return bud_ok();
+
+  rl = calloc(1, sizeof(*rl));
+  if (rl == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_ratelimit_t");
+
+  rl->rate = config->frontend.rate_limit.rate;
+  rl->burst = config->frontend.rate_limit.burst;
+  rl->size = config->frontend.rate_limit.size;
+  if (rl->burst == 0)
+    rl->burst = 1;
+  if (rl->size == 0)
+    rl->size = 1;
+  len = rl->size * sizeof(*rl->buckets);
+
+  if (config->frontend.rate_limit.shared == NULL) {
+    rl->buckets = calloc(rl->size, sizeof(*rl->buckets));
+    if (rl->buckets == NULL) {
+      err = bud_error_str(kBudErrNoMem, "rate limit buckets");
+      goto fatal;
+    }
+
+    *out = rl;
+    return bud_ok();
+  }
+
+  /*
+   * Workers are not forked from each other, share the table through a file.
+   * Buckets are updated without locking, concurrent handshakes from the same
+   * address may occasionally get an extra token
+   */
+  fd = open(config->frontend.rate_limit.shared, O_RDWR | O_CREAT, 0600);
+  if (fd == -1) {
+    err = bud_error_num(kBudErrRateLimitShared, errno);
+    goto fatal;
+  }
+
+  r = ftruncate(fd, len);
+  map = MAP_FAILED;
+  if (r == 0)
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    err = bud_error_num(kBudErrRateLimitShared, errno);
+  close(fd);
+  if (map == MAP_FAILED)
+    goto fatal;
+
+  rl->shared = 1;
+  rl->buckets = map;
+  *out = rl;
+  return bud_ok();
+
+fatal:
+  free(rl);
+  return err;
+}
+
+
+void bud_ratelimit_free(bud_ratelimit_t* rl) {
+  if (rl == NULL)
+    return;
+
+  if (rl->shared)
+    munmap(rl->buckets, rl->size * sizeof(*rl->buckets));
+  else
+    free(rl->buckets);
+  free(rl);
+}
+
+
+int bud_ratelimit_allow(bud_ratelimit_t* rl,
+                        const char* key,
+                        size_t key_len,
+                        uint64_t now) {
+  uint32_t hash;
+  uint64_t tokens;
+  uint64_t cap;
+  bud_ratelimit_bucket_t* b;
+
+  /* Unknown address family, nothing to key on */
+  if (key == NULL)
+    return 1;
+
+  hash = bud_ratelimit_hash(key, key_len);
+  b = &rl->buckets[hash % rl->size];
+  cap = rl->burst * 1000;
+
+  if (b->key != hash) {
+    /* New address (or evicted one), starts with the full bucket */
+    b->key = hash;
+    tokens = cap;
+  } else {
+    tokens = b->tokens;
+    if (now > b->last)
+      tokens += (now - b->last) * rl->rate;
+    if (tokens > cap)
+      tokens = cap;
+  }
+  b->last = now;
+
+  if (tokens < 1000) {
+    b->tokens = tokens;
+    return 0;
+  }
+
+  b->tokens = tokens - 1000;
+  return 1;
+}
+
+
+void bud_shape_refill(bud_shape_t* shape,
+                      uint64_t rate,
+                      uint64_t burst,
+                      uint64_t now) {
+  int64_t cap;
+
+  cap = burst * 1000;
+  if (shape->last == 0)
+    shape->tokens = cap;
+  else if (now > shape->last)
+    shape->tokens += (now - shape->last) * rate;
+  if (shape->tokens > cap)
+    shape->tokens = cap;
+  shape->last = now;
+}
+
+
+uint64_t bud_shape_spend(bud_shape_t* shape,
+                         uint64_t rate,
+                         uint64_t burst,
+                         uint64_t bytes,
+                         uint64_t now) {
+  bud_shape_refill(shape, rate, burst, now);
+  shape->tokens -= bytes * 1000;
+  if (shape->tokens >= 0)
+    return 0;
+
+  /* Rounded up, so that the bucket is not empty again after the pause */
+  return (-shape->tokens + rate - 1) / rate;
+}
+
+
+int bud_shape_take(bud_shape_t* shape,
+                   uint64_t rate,
+                   uint64_t burst,
+                   uint64_t now) {
+  bud_shape_refill(shape, rate, burst, now);
+  if (shape->tokens < 1000)
+    return 0;
+
+  shape->tokens -= 1000;
+  return 1;
+}
+
+
+/* FNV-1a, addresses are binary - no case folding */
+uint32_t bud_ratelimit_hash(const char* key, size_t key_len) {
+  uint32_t hash;
+  size_t i;
+
+  hash = BUD_HASH_INIT;
+  for (i = 0; i < key_len; i++) {
+    hash ^= (uint8_t) key[i];
+    hash *= 16777619u;
+  }
+
+  /* 0 marks an empty bucket */
+  if (hash == 0)
+    hash = 1;
+  return hash;
+}
@@ -0,0 +1,72 @@
+#ifndef SRC_RATELIMIT_H_
+#define SRC_RATELIMIT_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t */
+#include <stdlib.h>  /* size_t */
+
+#include "error.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+typedef struct bud_ratelimit_s bud_ratelimit_t;
+typedef struct bud_ratelimit_bucket_s bud_ratelimit_bucket_t;
+typedef struct bud_shape_s bud_shape_t;
+
+/* `tokens` are in 1/1000 of a handshake */
+struct bud_ratelimit_bucket_s {
+  uint32_t key;
+  uint32_t tokens;
+  uint64_t last;
+};
+
+struct bud_ratelimit_s {
+  uint64_t rate;
+  uint64_t burst;
+  size_t size;
+
+  /* Table is mmap()-ed from `frontend.rate_limit.shared` */
+  int shared;
+  bud_ratelimit_bucket_t* buckets;
+};
+
+/*
+ * Byte bucket of `frontend.bandwidth`, `tokens` are in 1/1000 of a byte and
+ * go below zero by the last read. `last` is zero for the full bucket.
+ */
+struct bud_shape_s {
+  int64_t tokens;
+  uint64_t last;
+};
+
+/*
+ * Table of `frontend.rate_limit.size` buckets, NULL if `rate` is 0. Buckets
+ * are indexed by address hash, colliding addresses just evict each other.
+ */
+bud_error_t bud_ratelimit_new(struct bud_config_s* config,
+                              bud_ratelimit_t** out);
+void bud_ratelimit_free(bud_ratelimit_t* rl);
+
+/* Take a token for the peer, returns zero if it is over the limit */
+int bud_ratelimit_allow(bud_ratelimit_t* rl,
+                        const char* key,
+                        size_t key_len,
+                        uint64_t now);
+
+/*
+ * Spend `bytes` read from the source, returns the number of ms to pause the
+ * reads for (until the bucket is positive again), 0 - no need to.
+ */
+uint64_t bud_shape_spend(bud_shape_t* shape,
+                         uint64_t rate,
+                         uint64_t burst,
+                         uint64_t bytes,
+                         uint64_t now);
+
+/* Take a whole token (`rate` per second), returns zero if there is none */
+int bud_shape_take(bud_shape_t* shape,
+                   uint64_t rate,
+                   uint64_t burst,
+                   uint64_t now);
+
+#endif  /* SRC_RATELIMIT_H_ */
@@ -1,25 +1,92 @@
-#include <arpa/inet.h>  /* ntohs */
+#ifdef __linux__
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
+# endif  /* !_GNU_SOURCE */
+# include <sys/epoll.h>  /* epoll_create1, epoll_ctl, epoll_wait */
+#endif  /* __linux__ */
+#include <arpa/inet.h>  /* htons, ntohs */
+#include <errno.h>  /* errno */
+#include <fcntl.h>  /* fcntl, FD_CLOEXEC, O_NONBLOCK */
+#include <netinet/in.h>  /* IPPROTO_IPV6, IPV6_V6ONLY */
+#include <netinet/tcp.h>  /* TCP_DEFER_ACCEPT, TCP_FASTOPEN */
 #include <stdlib.h>  /* calloc, free */
-#include <string.h>  /* snprintf */
+#include <string.h>  /* memcpy, memset, snprintf, strerror */
+#include <sys/socket.h>  /* socket, setsockopt, bind */
+#include <unistd.h>  /* close */
 
 #include "uv.h"
 
 #include "master.h"
 #include "server.h"
 #include "client.h"
+#include "ipc.h"
+#include "logger.h"
 
+/* Older libc headers don't have it, the kernel may still support it */
+#if defined(__linux__) && !defined(TCP_FASTOPEN)
+# define TCP_FASTOPEN 23
+#endif  /* __linux__ && !TCP_FASTOPEN */
+
+static bud_error_t bud_server_listen(bud_config_t* config,
+                                     bud_config_listener_t* listener);
 static void bud_server_close_cb(uv_handle_t* handle);
 static void bud_server_connection_cb(uv_stream_t* stream, int status);
+static void bud_server_idle_cb(uv_idle_t* handle, int status);
+static int bud_server_is_overloaded(bud_server_t* server);
 static bud_error_t bud_server_format_proxyline(bud_server_t* server);
+static void bud_server_format_proxyline_v2(bud_server_t* server);
+static bud_error_t bud_server_bind_socket(bud_server_t* server);
+static int bud_server_inherited_fd(bud_server_t* server);
+static bud_error_t bud_server_set_options(bud_server_t* server);
+static int bud_server_is_shared(bud_config_t* config);
+static bud_error_t bud_server_shared_poll(bud_server_t* server, int fd);
+static void bud_server_poll_start(bud_server_t* server);
+static void bud_server_poll_cb(uv_poll_t* handle, int status, int events);
+static void bud_server_accept_batch(bud_server_t* server);
+static int bud_server_accept_fd(int fd);
 
 bud_error_t bud_server_new(bud_config_t* config) {
+  int i;
+  bud_error_t err;
+
+  /* Ones that did start are closed by bud_server_free() */
+  for (i = 0; i < config->listener_count; i++) {
+    err = bud_server_listen(config, &config->listeners[i]);
+    if (!bud_is_ok(err))
+      return err;
+  }
+
+  /* Listeners that are gone from the new config */
+  for (i = 0; i < config->upgrade.inherited; i++)
+    if ((config->upgrade.adopted & (1ULL << i)) == 0)
+      close(BUD_UPGRADE_LISTEN_FD + i);
+  config->upgrade.inherited = 0;
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_server_listen(bud_config_t* config,
+                              bud_config_listener_t* listener) {
   int r;
+  int fd;
   bud_error_t err;
   bud_server_t* server;
 
   server = calloc(1, sizeof(*server));
+  if (server == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_server_t");
 
   server->config = config;
+  server->listener = listener;
+  server->close_waiting = 0;
+  server->paused = 0;
+  server->accept_tick = 0;
+  server->accept_count = 0;
+  server->pending = 0;
+  server->shared = 0;
+  server->epoll_fd = -1;
+  server->batch = BUD_SERVER_BATCH_MIN;
 
   /* Initialize tcp handle */
   r = uv_tcp_init(config->loop, &server->tcp);
@@ -27,29 +94,74 @@ bud_error_t bud_server_new(bud_config_t* config) {
     err = bud_error_num(kBudErrTcpServerInit, r);
     goto failed_tcp_init;
   }
+  server->close_waiting++;
 
-  r = uv_tcp_bind(&server->tcp, (struct sockaddr*) &config->frontend.addr);
+  /* Resumes accepting after reaching `frontend.accept_limit` */
+  r = uv_idle_init(config->loop, &server->idle);
   if (r != 0) {
-    err = bud_error_num(kBudErrTcpServerBind, r);
+    err = bud_error_num(kBudErrServerIdleInit, r);
     goto failed_bind;
   }
+  server->close_waiting++;
+
+  /* Old master's socket, its accept queue is kept through the upgrade */
+  fd = bud_server_inherited_fd(server);
+  if (fd != -1) {
+    r = uv_tcp_open(&server->tcp, fd);
+    if (r != 0) {
+      close(fd);
+      err = bud_error_num(kBudErrUpgradeOpen, r);
+      goto failed_bind;
+    }
+  } else if (config->frontend.reuseport ||
+             listener->addr.ss_family == AF_INET6) {
+    /* IPv6 sockets are dual-stack regardless of the OS default */
+    err = bud_server_bind_socket(server);
+    if (!bud_is_ok(err))
+      goto failed_bind;
+  } else {
+    r = uv_tcp_bind(&server->tcp, (struct sockaddr*) &listener->addr);
+    if (r != 0) {
+      err = bud_error_num(kBudErrTcpServerBind, r);
+      goto failed_bind;
+    }
+  }
+
+  err = bud_server_set_options(server);
+  if (!bud_is_ok(err))
+    goto failed_bind;
 
-  r = uv_listen((uv_stream_t*) &server->tcp, 256, bud_server_connection_cb);
+  /* Workers accept on the master's socket, master never polls it */
+  if (bud_server_is_shared(config)) {
+    r = uv_fileno((uv_handle_t*) &server->tcp, &fd);
+    if (r == 0 && listen(fd, config->frontend.backlog) != 0)
+      r = -errno;
+  } else {
+    r = uv_listen((uv_stream_t*) &server->tcp,
+                  config->frontend.backlog,
+                  bud_server_connection_cb);
+  }
   if (r != 0) {
     err = bud_error_num(kBudErrServerListen, r);
     goto failed_bind;
   }
 
-  if (config->frontend.proxyline)
+  if (config->frontend.proxyline == BUD_PROXYLINE_V2) {
+    bud_server_format_proxyline_v2(server);
+    err = bud_ok();
+  } else if (config->frontend.proxyline) {
     err = bud_server_format_proxyline(server);
-  else
+  } else {
     err = bud_ok();
+  }
 
-  config->server = server;
+  listener->server = server;
   return err;
 
 failed_bind:
   uv_close((uv_handle_t*) &server->tcp, bud_server_close_cb);
+  if (server->close_waiting == 2)
+    uv_close((uv_handle_t*) &server->idle, bud_server_close_cb);
   return err;
 
 failed_tcp_init:
@@ -60,55 +172,678 @@ failed_tcp_init:
 
 
 void bud_server_free(bud_config_t* config) {
-  config->server->config = NULL;
-  uv_close((uv_handle_t*) &config->server->tcp, bud_server_close_cb);
-  config->server = NULL;
+  int i;
+  bud_server_t* server;
+
+  for (i = 0; i < config->listener_count; i++) {
+    server = config->listeners[i].server;
+    if (server == NULL)
+      continue;
+
+    server->config = NULL;
+    uv_close((uv_handle_t*) &server->tcp, bud_server_close_cb);
+    uv_close((uv_handle_t*) &server->idle, bud_server_close_cb);
+    if (server->shared)
+      uv_close((uv_handle_t*) &server->poll, bud_server_close_cb);
+    config->listeners[i].server = NULL;
+  }
 }
 
 
 void bud_server_close_cb(uv_handle_t* handle) {
   bud_server_t* server;
 
-  server = container_of(handle, bud_server_t, tcp);
+  if (handle->type == UV_TCP)
+    server = container_of(handle, bud_server_t, tcp);
+  else if (handle->type == UV_POLL)
+    server = container_of(handle, bud_server_t, poll);
+  else
+    server = container_of(handle, bud_server_t, idle);
+
+  if (--server->close_waiting != 0)
+    return;
+
+  if (server->epoll_fd != -1)
+    close(server->epoll_fd);
   free(server);
 }
 
 
+int bud_server_is_shared(bud_config_t* config) {
+  /* Master accepts on its own without workers */
+  return config->frontend.shared_listen && config->worker_count != 0;
+}
+
+
+bud_error_t bud_server_send_shared(bud_config_t* config, uv_stream_t* ipc) {
+  int i;
+  uint32_t index;
+  char header[4];
+  bud_error_t err;
+  bud_server_t* server;
+
+  if (!bud_server_is_shared(config))
+    return bud_ok();
+
+  for (i = 0; i < config->listener_count; i++) {
+    server = config->listeners[i].server;
+    if (server == NULL)
+      continue;
+
+    index = i;
+    header[0] = (index >> 24) & 0xff;
+    header[1] = (index >> 16) & 0xff;
+    header[2] = (index >> 8) & 0xff;
+    header[3] = index & 0xff;
+
+    /* Servers outlive the workers, the handle stays valid */
+    err = bud_ipc_send_handle(config,
+                              ipc,
+                              kBudIPCListen,
+                              header,
+                              sizeof(header),
+                              (uv_stream_t*) &server->tcp);
+    if (!bud_is_ok(err))
+      return err;
+  }
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_server_adopt(bud_config_t* config,
+                             bud_config_listener_t* listener,
+                             uv_stream_t* ipc) {
+  int r;
+  uv_os_fd_t fd;
+  bud_error_t err;
+  bud_server_t* server;
+
+  server = calloc(1, sizeof(*server));
+  if (server == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_server_t");
+
+  server->config = config;
+  server->listener = listener;
+  server->close_waiting = 0;
+  server->paused = 0;
+  server->accept_tick = 0;
+  server->accept_count = 0;
+  server->pending = 0;
+  server->shared = 0;
+  server->epoll_fd = -1;
+  server->batch = BUD_SERVER_BATCH_MIN;
+
+  r = uv_tcp_init(config->loop, &server->tcp);
+  if (r != 0) {
+    err = bud_error_num(kBudErrTcpServerInit, r);
+    goto failed_tcp_init;
+  }
+  server->close_waiting++;
+
+  r = uv_accept(ipc, (uv_stream_t*) &server->tcp);
+  if (r != 0) {
+    err = bud_error_num(kBudErrServerIPCAccept, r);
+    goto fatal;
+  }
+
+  r = uv_idle_init(config->loop, &server->idle);
+  if (r != 0) {
+    err = bud_error_num(kBudErrServerIdleInit, r);
+    goto fatal;
+  }
+  server->close_waiting++;
+
+  /* Accepts must never block, the connection may go to another worker */
+  r = uv_fileno((uv_handle_t*) &server->tcp, &fd);
+  if (r != 0) {
+    err = bud_error_num(kBudErrServerIPCAccept, r);
+    goto fatal;
+  }
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0) {
+    err = bud_error_num(kBudErrServerIPCAccept, -errno);
+    goto fatal;
+  }
+
+  err = bud_server_shared_poll(server, fd);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  if (config->frontend.proxyline == BUD_PROXYLINE_V2) {
+    bud_server_format_proxyline_v2(server);
+  } else if (config->frontend.proxyline) {
+    err = bud_server_format_proxyline(server);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+
+  listener->server = server;
+  if (!config->is_spare)
+    bud_server_poll_start(server);
+  return bud_ok();
+
+fatal:
+  uv_close((uv_handle_t*) &server->tcp, bud_server_close_cb);
+  if (server->close_waiting >= 2)
+    uv_close((uv_handle_t*) &server->idle, bud_server_close_cb);
+  if (server->shared)
+    uv_close((uv_handle_t*) &server->poll, bud_server_close_cb);
+  return err;
+
+failed_tcp_init:
+  free(server);
+  return err;
+}
+
+
+bud_error_t bud_server_shared_poll(bud_server_t* server, int fd) {
+  int r;
+  bud_config_t* config;
+#ifdef EPOLLEXCLUSIVE
+  struct epoll_event ev;
+#endif  /* EPOLLEXCLUSIVE */
+
+  config = server->config;
+
+#ifdef EPOLLEXCLUSIVE
+  /*
+   * libuv's own epoll can't take EPOLLEXCLUSIVE, so the socket goes into a
+   * private one, which is watched by the loop instead
+   */
+  server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (server->epoll_fd == -1)
+    return bud_error_num(kBudErrServerEpoll, -errno);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+    r = -errno;
+    close(server->epoll_fd);
+    server->epoll_fd = -1;
+
+    /* Kernels before 4.5 - every worker wakes up, one of them gets it */
+    if (r != UV_EINVAL)
+      return bud_error_num(kBudErrServerEpoll, r);
+    bud_log(config,
+            kBudLogWarning,
+            "EPOLLEXCLUSIVE is not supported, all workers poll [%s]:%d",
+            server->listener->host,
+            server->listener->port);
+  }
+#endif  /* EPOLLEXCLUSIVE */
+
+  r = uv_poll_init(config->loop,
+                   &server->poll,
+                   server->epoll_fd != -1 ? server->epoll_fd : fd);
+  if (r != 0)
+    return bud_error_num(kBudErrServerPollInit, r);
+  server->shared = 1;
+  server->close_waiting++;
+
+  return bud_ok();
+}
+
+
+void bud_server_start_shared(bud_config_t* config) {
+  int i;
+  bud_server_t* server;
+
+  for (i = 0; i < config->listener_count; i++) {
+    server = config->listeners[i].server;
+    if (server != NULL && server->shared)
+      bud_server_poll_start(server);
+  }
+}
+
+
+void bud_server_poll_start(bud_server_t* server) {
+  int r;
+
+  r = uv_poll_start(&server->poll, UV_READABLE, bud_server_poll_cb);
+  if (r != 0) {
+    bud_error_log(server->config,
+                  kBudLogWarning,
+                  bud_error_num(kBudErrServerPollInit, r));
+  }
+}
+
+
+void bud_server_poll_cb(uv_poll_t* handle, int status, int events) {
+  bud_server_t* server;
+#ifdef EPOLLEXCLUSIVE
+  struct epoll_event ev;
+  int r;
+#endif  /* EPOLLEXCLUSIVE */
+
+  server = container_of(handle, bud_server_t, poll);
+
+#ifdef EPOLLEXCLUSIVE
+  /* Level-triggered, just collect the event */
+  if (server->epoll_fd != -1) {
+    do
+      r = epoll_wait(server->epoll_fd, &ev, 1, 0);
+    while (r == -1 && errno == EINTR);
+  }
+#endif  /* EPOLLEXCLUSIVE */
+
+  /* Polled again in bud_server_accept_batch(), like libuv does */
+  uv_poll_stop(handle);
+  server->paused = 1;
+  bud_server_resume(server);
+}
+
+
+void bud_server_accept_batch(bud_server_t* server) {
+  int r;
+  int fd;
+  int limit;
+  int count;
+  int err;
+  bud_config_t* config;
+
+  config = server->config;
+  r = uv_fileno((uv_handle_t*) &server->tcp, &fd);
+  if (r != 0)
+    return;
+
+  /* One is already counted by bud_server_resume() */
+  limit = server->batch;
+  if (config->frontend.accept_limit > 0 &&
+      limit > config->frontend.accept_limit - server->accept_count + 1) {
+    limit = config->frontend.accept_limit - server->accept_count + 1;
+  }
+
+  count = 0;
+  err = 0;
+  while (count < limit) {
+    r = bud_server_accept_fd(fd);
+    if (r == -1) {
+      err = errno;
+      break;
+    }
+    count++;
+    bud_client_create_fd(config, server->listener, r);
+
+    if (bud_server_is_overloaded(server))
+      break;
+  }
+  if (count > 1)
+    server->accept_count += count - 1;
+
+  /* Another worker took it, or the client is gone already */
+  if (err != 0 &&
+      err != EAGAIN &&
+      err != EWOULDBLOCK &&
+      err != ECONNABORTED) {
+    bud_log(config,
+            kBudLogWarning,
+            "worker accept() failed with (%d) \"%s\"",
+            err,
+            strerror(err));
+  }
+
+  /* Full batch - more are likely in the backlog */
+  if (count == server->batch && server->batch < BUD_SERVER_BATCH_MAX)
+    server->batch *= 2;
+  else if (count < server->batch / 2 && server->batch > BUD_SERVER_BATCH_MIN)
+    server->batch /= 2;
+
+  /* Resumed when clients go away, or the shedding stops */
+  if (bud_server_is_overloaded(server)) {
+    server->paused = 1;
+    return;
+  }
+  bud_server_poll_start(server);
+}
+
+
+int bud_server_accept_fd(int fd) {
+  int r;
+
+  do {
+#ifdef __linux__
+    r = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else  /* !__linux__ */
+    r = accept(fd, NULL, NULL);
+#endif  /* __linux__ */
+  } while (r == -1 && errno == EINTR);
+
+#ifndef __linux__
+  if (r != -1) {
+    fcntl(r, F_SETFL, fcntl(r, F_GETFL) | O_NONBLOCK);
+    fcntl(r, F_SETFD, FD_CLOEXEC);
+  }
+#endif  /* !__linux__ */
+
+  return r;
+}
+
+
 void bud_server_connection_cb(uv_stream_t* stream, int status) {
   bud_server_t* server;
 
   server = container_of(stream, bud_server_t, tcp);
 
+  /*
+   * NOTE: libuv stops polling the socket until the pending connection is
+   * accepted, so the kernel keeps queueing the rest in the backlog.
+   */
+  server->paused = 1;
+  bud_server_resume(server);
+}
+
+
+void bud_server_resume(bud_server_t* server) {
+  bud_config_t* config;
+  uint64_t now;
+
+  config = server->config;
+  if (!server->paused || config == NULL)
+    return;
+
+  /* Wait for some clients to go away, see bud_client_close_cb() */
+  if (bud_server_is_overloaded(server))
+    return;
+
+  /* Let the loop process other events, continue on the next iteration */
+  if (config->frontend.accept_limit > 0) {
+    now = uv_now(config->loop);
+    if (server->accept_tick != now) {
+      server->accept_tick = now;
+      server->accept_count = 0;
+    }
+
+    if (server->accept_count >= config->frontend.accept_limit) {
+      uv_idle_start(&server->idle, bud_server_idle_cb);
+      return;
+    }
+    server->accept_count++;
+  }
+
+  server->paused = 0;
+
+  /* Every worker has the master's socket, take what is there */
+  if (server->shared)
+    return bud_server_accept_batch(server);
+
+  /* Worker owns the socket in reuseport mode, accept right here */
+  if (config->is_worker) {
+    return bud_client_create(config,
+                             server->listener,
+                             (uv_stream_t*) &server->tcp);
+  }
+
   /* Create client and let it go */
   bud_master_balance(server);
 }
 
 
+void bud_server_resume_all(bud_config_t* config) {
+  int i;
+
+  for (i = 0; i < config->listener_count; i++) {
+    if (config->listeners[i].server != NULL)
+      bud_server_resume(config->listeners[i].server);
+  }
+}
+
+
+void bud_server_idle_cb(uv_idle_t* handle, int status) {
+  bud_server_t* server;
+
+  server = container_of(handle, bud_server_t, idle);
+  uv_idle_stop(handle);
+
+  /* New iteration, even if the loop time hasn't changed */
+  server->accept_count = 0;
+  bud_server_resume(server);
+}
+
+
+int bud_server_is_overloaded(bud_server_t* server) {
+  bud_config_t* config;
+
+  config = server->config;
+
+  /* Loop is lagging, see bud_worker_shed() */
+  if (config->shedding)
+    return 1;
+  if (config->frontend.max_clients <= 0)
+    return 0;
+
+  /* Master checks worker's load in bud_master_balance() */
+  if (!config->is_worker && config->worker_count != 0)
+    return 0;
+
+  return config->client_slab.used_count >=
+         (size_t) config->frontend.max_clients;
+}
+
+
+bud_error_t bud_server_bind_socket(bud_server_t* server) {
+  int r;
+  int fd;
+  int on;
+  socklen_t addrlen;
+  bud_config_t* config;
+  bud_config_listener_t* listener;
+  bud_error_t err;
+
+  config = server->config;
+  listener = server->listener;
+#ifndef SO_REUSEPORT
+  if (config->frontend.reuseport)
+    return bud_error(kBudErrServerNoReusePort);
+#endif  /* !SO_REUSEPORT */
+
+  if (listener->addr.ss_family == AF_INET)
+    addrlen = sizeof(struct sockaddr_in);
+  else
+    addrlen = sizeof(struct sockaddr_in6);
+
+  /*
+   * libuv can't set SO_REUSEPORT and IPV6_V6ONLY, create and bind the
+   * socket manually
+   */
+  fd = socket(listener->addr.ss_family, SOCK_STREAM, 0);
+  if (fd == -1)
+    return bud_error_num(kBudErrServerSocket, -errno);
+
+  on = 1;
+  r = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+  if (r == 0 && config->frontend.reuseport)
+    r = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif  /* SO_REUSEPORT */
+  if (r != 0) {
+    err = bud_error_num(kBudErrServerReusePort, -errno);
+    goto fatal;
+  }
+
+  if (listener->addr.ss_family == AF_INET6) {
+    on = listener->ipv6only;
+    r = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+    if (r != 0) {
+      err = bud_error_num(kBudErrServerV6Only, -errno);
+      goto fatal;
+    }
+  }
+
+  r = bind(fd, (struct sockaddr*) &listener->addr, addrlen);
+  if (r != 0) {
+    err = bud_error_num(kBudErrTcpServerBind, -errno);
+    goto fatal;
+  }
+
+  r = uv_tcp_open(&server->tcp, fd);
+  if (r != 0) {
+    err = bud_error_num(kBudErrTcpServerBind, r);
+    goto fatal;
+  }
+
+  return bud_ok();
+
+fatal:
+  close(fd);
+  return err;
+}
+
+
+int bud_server_inherited_fd(bud_server_t* server) {
+  int i;
+  int fd;
+  socklen_t len;
+  struct sockaddr_storage addr;
+  struct sockaddr_storage* expected;
+  bud_config_t* config;
+
+  /* Matched by the bound address, listeners may have been reordered */
+  config = server->config;
+  expected = &server->listener->addr;
+  for (i = 0; i < config->upgrade.inherited; i++) {
+    if ((config->upgrade.adopted & (1ULL << i)) != 0)
+      continue;
+
+    fd = BUD_UPGRADE_LISTEN_FD + i;
+    len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    if (getsockname(fd, (struct sockaddr*) &addr, &len) != 0)
+      continue;
+    if (addr.ss_family != expected->ss_family)
+      continue;
+
+    if (addr.ss_family == AF_INET) {
+      if (((struct sockaddr_in*) &addr)->sin_port !=
+              ((struct sockaddr_in*) expected)->sin_port ||
+          memcmp(&((struct sockaddr_in*) &addr)->sin_addr,
+                 &((struct sockaddr_in*) expected)->sin_addr,
+                 sizeof(struct in_addr)) != 0) {
+        continue;
+      }
+    } else if (addr.ss_family == AF_INET6) {
+      if (((struct sockaddr_in6*) &addr)->sin6_port !=
+              ((struct sockaddr_in6*) expected)->sin6_port ||
+          memcmp(&((struct sockaddr_in6*) &addr)->sin6_addr,
+                 &((struct sockaddr_in6*) expected)->sin6_addr,
+                 sizeof(struct in6_addr)) != 0) {
+        continue;
+      }
+    } else {
+      continue;
+    }
+
+    /* Workers get only what they are given */
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    config->upgrade.adopted |= 1ULL << i;
+    return fd;
+  }
+
+  return -1;
+}
+
+
+bud_error_t bud_server_set_options(bud_server_t* server) {
+  int r;
+  int val;
+  uv_os_fd_t fd;
+  bud_config_t* config;
+
+  config = server->config;
+  if (config->frontend.defer_accept <= 0 && config->frontend.fastopen <= 0)
+    return bud_ok();
+
+  /* Socket exists after bind, options must be set before listen */
+  r = uv_fileno((uv_handle_t*) &server->tcp, &fd);
+  if (r != 0)
+    return bud_error_num(kBudErrTcpServerBind, r);
+
+  if (config->frontend.defer_accept > 0) {
+#ifdef TCP_DEFER_ACCEPT
+    val = config->frontend.defer_accept;
+    r = setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &val, sizeof(val));
+    if (r != 0)
+      return bud_error_num(kBudErrServerDeferAccept, -errno);
+#else  /* !TCP_DEFER_ACCEPT */
+    return bud_error_num(kBudErrServerDeferAccept, UV_ENOTSUP);
+#endif  /* TCP_DEFER_ACCEPT */
+  }
+
+  if (config->frontend.fastopen > 0) {
+#ifdef TCP_FASTOPEN
+    val = config->frontend.fastopen;
+    r = setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &val, sizeof(val));
+    if (r != 0)
+      return bud_error_num(kBudErrServerFastOpen, -errno);
+#else  /* !TCP_FASTOPEN */
+    return bud_error_num(kBudErrServerFastOpen, UV_ENOTSUP);
+#endif  /* TCP_FASTOPEN */
+  }
+
+  return bud_ok();
+}
+
+
 bud_error_t bud_server_format_proxyline(bud_server_t* server) {
   int r;
   char host[INET6_ADDRSTRLEN];
   struct sockaddr_in* addr4;
   struct sockaddr_in6* addr6;
-  bud_config_t* config;
+  bud_config_listener_t* listener;
 
-  config = server->config;
-  addr4 = (struct sockaddr_in*) &config->frontend.addr;
-  addr6 = (struct sockaddr_in6*) &config->backend.addr;
+  listener = server->listener;
+  addr4 = (struct sockaddr_in*) &listener->addr;
+  addr6 = (struct sockaddr_in6*) &listener->addr;
 
-  if (config->frontend.addr.ss_family == AF_INET)
+  if (listener->addr.ss_family == AF_INET)
     r = uv_inet_ntop(AF_INET, &addr4->sin_addr, host, sizeof(host));
   else
     r = uv_inet_ntop(AF_INET6, &addr6->sin6_addr, host, sizeof(host));
   if (r != 0)
     return bud_error(kBudErrNtop);
 
-  r = snprintf(config->proxyline_fmt,
-               sizeof(config->proxyline_fmt),
+  r = snprintf(listener->proxyline_fmt,
+               sizeof(listener->proxyline_fmt),
                "PROXY %%s %%s %s %%hu %hu\r\n",
                host,
-               config->frontend.port);
-  ASSERT(r < (int) sizeof(config->proxyline_fmt),
+               listener->port);
+  ASSERT(r < (int) sizeof(listener->proxyline_fmt),
          "Proxyline format overflowed");
 
   return bud_ok();
 }
+
+
+void bud_server_format_proxyline_v2(bud_server_t* server) {
+  static const char sig[] = "\r\n\r\n\0\r\nQUIT\n";
+  bud_config_listener_t* listener;
+  struct sockaddr_in* addr4;
+  struct sockaddr_in6* addr6;
+  char* p;
+  size_t addr_len;
+  uint16_t port;
+
+  listener = server->listener;
+  addr4 = (struct sockaddr_in*) &listener->addr;
+  addr6 = (struct sockaddr_in6*) &listener->addr;
+  p = listener->proxyline_v2;
+
+  /* Signature, version 2 with PROXY command, TCP over IPv4 or IPv6 */
+  memcpy(p, sig, 12);
+  p[12] = 0x21;
+  if (listener->addr.ss_family == AF_INET) {
+    p[13] = 0x11;
+    addr_len = sizeof(addr4->sin_addr);
+    memcpy(p + 16 + addr_len, &addr4->sin_addr, addr_len);
+  } else {
+    p[13] = 0x21;
+    addr_len = sizeof(addr6->sin6_addr);
+    memcpy(p + 16 + addr_len, &addr6->sin6_addr, addr_len);
+  }
+
+  /* Source address and port are filled in for each client */
+  port = htons(listener->port);
+  memcpy(p + 16 + 2 * addr_len + 2, &port, sizeof(port));
+  p[14] = 0;
+  p[15] = 2 * addr_len + 2 * sizeof(port);
+  listener->proxyline_v2_len = 16 + 2 * addr_len + 2 * sizeof(port);
+}
@@ -1,6 +1,8 @@
 #ifndef SRC_SERVER_H_
 #define SRC_SERVER_H_
 
+#include <stdint.h>  /* uint64_t */
+
 #include "uv.h"
 
 #include "config.h"
@@ -8,12 +10,65 @@
 
 typedef struct bud_server_s bud_server_t;
 
+/*
+ * Binary upgrade: the new master reports readiness to the old one on
+ * BUD_UPGRADE_FD, and gets its listening sockets from BUD_UPGRADE_LISTEN_FD
+ * on (their count is in BUD_UPGRADE_ENV).
+ */
+#define BUD_UPGRADE_ENV "BUD_UPGRADE"
+#define BUD_UPGRADE_FD 3
+#define BUD_UPGRADE_LISTEN_FD 4
+#define BUD_UPGRADE_MAX_FDS 64
+
+/* Accepts per wakeup in `frontend.shared_listen` mode, see bud_server_t */
+#define BUD_SERVER_BATCH_MIN 4
+#define BUD_SERVER_BATCH_MAX 256
+
 struct bud_server_s {
   bud_config_t* config;
+  bud_config_listener_t* listener;
   uv_tcp_t tcp;
+  uv_idle_t idle;
+  int close_waiting;
+
+  /* Accept pacing */
+  int paused;
+  uint64_t accept_tick;
+  int accept_count;
+
+  /* Connection is waiting for a worker, see bud_master_balance() */
+  int pending;
+
+  /*
+   * `frontend.shared_listen`: worker's copy of the master's socket. `poll`
+   * watches `epoll_fd` that has it with EPOLLEXCLUSIVE (-1 - the socket
+   * itself), so that only one of the workers wakes up per connection. Up to
+   * `batch` are accepted then, it doubles when all of them were there and
+   * halves when less than a half were.
+   */
+  int shared;
+  int epoll_fd;
+  uv_poll_t poll;
+  int batch;
 };
 
+/* Servers of all `config->listeners` */
 bud_error_t bud_server_new(bud_config_t* config);
 void bud_server_free(bud_config_t* config);
 
+/*
+ * `frontend.shared_listen`: master sends its sockets to each worker once on
+ * spawn (kBudIPCListen), workers adopt them from `ipc`. Spares start
+ * accepting on bud_server_start_shared(), i.e. when they are promoted.
+ */
+bud_error_t bud_server_send_shared(bud_config_t* config, uv_stream_t* ipc);
+bud_error_t bud_server_adopt(bud_config_t* config,
+                             bud_config_listener_t* listener,
+                             uv_stream_t* ipc);
+void bud_server_start_shared(bud_config_t* config);
+
+/* Accept pending connection, if it was postponed and limits allow it */
+void bud_server_resume(bud_server_t* server);
+void bud_server_resume_all(bud_config_t* config);
+
 #endif  /* SRC_SERVER_H_ */
@@ -0,0 +1,689 @@
+#include <ctype.h>  /* tolower */
+#include <errno.h>  /* errno, EOWNERDEAD */
+#include <stdio.h>  /* snprintf */
+#include <stdlib.h>  /* calloc, free */
+#include <string.h>  /* memcpy, memcmp, memset */
+#include <time.h>  /* time */
+
+#ifndef _WIN32
+#include <fcntl.h>  /* O_* */
+#include <pthread.h>
+#include <sys/mman.h>  /* mmap, munmap, shm_open */
+#include <sys/stat.h>  /* fstat */
+#include <unistd.h>  /* close, ftruncate, getpid */
+#endif  /* !_WIN32 */
+
+#include "openssl/ssl.h"
+#include "parson.h"
+
+#include "session-cache.h"
+#include "client.h"
+#include "client-private.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "http-pool.h"
+#include "logger.h"
+
+#define BUD_SESSION_CACHE_MAGIC 0x62756473
+#define BUD_SESSION_ID_MAX SSL_MAX_SSL_SESSION_ID_LENGTH
+#define BUD_SESSION_DATA_MAX 2048
+#define BUD_SESSION_BUCKET_WAYS 4
+#define BUD_SESSION_HEX_MAX (2 * BUD_SESSION_ID_MAX)
+
+typedef struct bud_session_header_s bud_session_header_t;
+typedef struct bud_session_entry_s bud_session_entry_t;
+typedef struct bud_session_bucket_s bud_session_bucket_t;
+
+struct bud_session_header_s {
+  uint32_t magic;
+  uint32_t bucket_count;
+};
+
+struct bud_session_entry_s {
+  int64_t expire;
+  uint32_t id_len;
+  uint32_t data_len;
+  uint32_t name_len;
+  unsigned char id[BUD_SESSION_ID_MAX];
+  unsigned char data[BUD_SESSION_DATA_MAX];
+
+  /* See bud_session_servername() */
+  char name[BUD_SESSION_NAME_MAX];
+};
+
+struct bud_session_bucket_s {
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif  /* !_WIN32 */
+  bud_session_entry_t entries[BUD_SESSION_BUCKET_WAYS];
+};
+
+#ifndef _WIN32
+static bud_error_t bud_session_cache_map(bud_session_cache_t* cache);
+static bud_session_bucket_t* bud_session_cache_lock(bud_session_cache_t* cache,
+                                                    const unsigned char* id,
+                                                    uint32_t len);
+static void bud_session_cache_unlock(bud_session_bucket_t* bucket);
+#endif  /* !_WIN32 */
+static size_t bud_session_hex(const unsigned char* id,
+                              size_t len,
+                              char* out);
+static void bud_client_session_lookup_cb(bud_http_request_t* req,
+                                         bud_error_t err);
+static void bud_session_store(bud_config_t* config,
+                              const unsigned char* id,
+                              unsigned int id_len,
+                              const unsigned char* data,
+                              int data_len,
+                              const char* name,
+                              int name_len);
+static int bud_session_name_match(bud_client_t* client,
+                                  const char* name,
+                                  size_t name_len);
+static void bud_session_store_cb(bud_http_request_t* req, bud_error_t err);
+
+
+bud_error_t bud_session_cache_new(bud_config_t* config) {
+#ifndef _WIN32
+  bud_session_cache_t* cache;
+  bud_session_header_t* header;
+  pthread_mutexattr_t attr;
+  char name[64];
+  uint32_t i;
+  bud_error_t err;
+  int r;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_session_cache_t");
+
+  cache->bucket_count = (config->session_cache.size +
+                         BUD_SESSION_BUCKET_WAYS - 1) /
+                        BUD_SESSION_BUCKET_WAYS;
+  if (cache->bucket_count == 0)
+    cache->bucket_count = 1;
+  cache->size = sizeof(*header) +
+                cache->bucket_count * sizeof(*cache->buckets);
+
+  /* Anonymous shared memory, only reachable through inherited fd */
+  snprintf(name, sizeof(name), "/bud-sessions-%d", (int) getpid());
+  cache->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (cache->fd == -1) {
+    err = bud_error_num(kBudErrSessionCacheShm, errno);
+    goto failed_shm_open;
+  }
+  shm_unlink(name);
+
+  if (ftruncate(cache->fd, cache->size) != 0) {
+    err = bud_error_num(kBudErrSessionCacheShm, errno);
+    goto failed_map;
+  }
+
+  err = bud_session_cache_map(cache);
+  if (!bud_is_ok(err))
+    goto failed_map;
+
+  /* Initialize locks */
+  r = pthread_mutexattr_init(&attr);
+  if (r == 0)
+    r = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+  /* Worker may be killed while holding the lock */
+  if (r == 0)
+    r = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif  /* __linux__ */
+  for (i = 0; r == 0 && i < cache->bucket_count; i++)
+    r = pthread_mutex_init(&cache->buckets[i].lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (r != 0) {
+    err = bud_error_num(kBudErrSessionCacheLock, r);
+    goto failed_lock_init;
+  }
+
+  header = cache->mem;
+  header->bucket_count = cache->bucket_count;
+  header->magic = BUD_SESSION_CACHE_MAGIC;
+
+  config->session_cache.cache = cache;
+  return bud_ok();
+
+failed_lock_init:
+  munmap(cache->mem, cache->size);
+
+failed_map:
+  close(cache->fd);
+
+failed_shm_open:
+  free(cache);
+  return err;
+#else  /* _WIN32 */
+  return bud_error(kBudErrSessionCacheNotSupported);
+#endif  /* !_WIN32 */
+}
+
+
+bud_error_t bud_session_cache_open(bud_config_t* config, int fd) {
+#ifndef _WIN32
+  bud_session_cache_t* cache;
+  bud_session_header_t* header;
+  struct stat st;
+  bud_error_t err;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_session_cache_t");
+
+  cache->fd = fd;
+  if (fstat(fd, &st) != 0) {
+    err = bud_error_num(kBudErrSessionCacheShm, errno);
+    goto fatal;
+  }
+  cache->size = st.st_size;
+  if (cache->size < sizeof(*header)) {
+    err = bud_error_num(kBudErrSessionCacheShm, EINVAL);
+    goto fatal;
+  }
+
+  err = bud_session_cache_map(cache);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  header = cache->mem;
+  cache->bucket_count = header->bucket_count;
+  if (header->magic != BUD_SESSION_CACHE_MAGIC ||
+      sizeof(*header) + cache->bucket_count * sizeof(*cache->buckets) >
+          cache->size) {
+    munmap(cache->mem, cache->size);
+    err = bud_error_num(kBudErrSessionCacheShm, EINVAL);
+    goto fatal;
+  }
+
+  config->session_cache.cache = cache;
+  return bud_ok();
+
+fatal:
+  free(cache);
+  return err;
+#else  /* _WIN32 */
+  return bud_error(kBudErrSessionCacheNotSupported);
+#endif  /* !_WIN32 */
+}
+
+
+void bud_session_cache_free(bud_config_t* config) {
+  bud_session_cache_t* cache;
+
+  cache = config->session_cache.cache;
+  if (cache == NULL)
+    return;
+
+  bud_log(config,
+          kBudLogDebug,
+          "session cache hits: %llu misses: %llu stores: %llu",
+          (unsigned long long) cache->hits,
+          (unsigned long long) cache->misses,
+          (unsigned long long) cache->stores);
+
+#ifndef _WIN32
+  munmap(cache->mem, cache->size);
+  close(cache->fd);
+#endif  /* !_WIN32 */
+  free(cache);
+  config->session_cache.cache = NULL;
+}
+
+
+#ifndef _WIN32
+bud_error_t bud_session_cache_map(bud_session_cache_t* cache) {
+  cache->mem = mmap(NULL,
+                    cache->size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    cache->fd,
+                    0);
+  if (cache->mem == MAP_FAILED) {
+    cache->mem = NULL;
+    return bud_error_num(kBudErrSessionCacheShm, errno);
+  }
+
+  cache->buckets = (bud_session_bucket_t*) ((char*) cache->mem +
+                                            sizeof(bud_session_header_t));
+  return bud_ok();
+}
+
+
+bud_session_bucket_t* bud_session_cache_lock(bud_session_cache_t* cache,
+                                             const unsigned char* id,
+                                             uint32_t len) {
+  uint32_t hash;
+  uint32_t i;
+  bud_session_bucket_t* bucket;
+  int r;
+
+  /* FNV-1a */
+  hash = 2166136261u;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ id[i]) * 16777619u;
+
+  bucket = &cache->buckets[hash % cache->bucket_count];
+  r = pthread_mutex_lock(&bucket->lock);
+#ifdef __linux__
+  if (r == EOWNERDEAD) {
+    /* Previous owner died in the middle of update, drop everything */
+    memset(bucket->entries, 0, sizeof(bucket->entries));
+    r = pthread_mutex_consistent(&bucket->lock);
+  }
+#endif  /* __linux__ */
+  if (r != 0)
+    return NULL;
+
+  return bucket;
+}
+
+
+void bud_session_cache_unlock(bud_session_bucket_t* bucket) {
+  pthread_mutex_unlock(&bucket->lock);
+}
+#endif  /* !_WIN32 */
+
+
+size_t bud_session_hex(const unsigned char* id, size_t len, char* out) {
+  static const char digits[] = "0123456789abcdef";
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    out[2 * i] = digits[id[i] >> 4];
+    out[2 * i + 1] = digits[id[i] & 15];
+  }
+  return 2 * len;
+}
+
+
+int bud_session_servername(bud_client_t* client, char* out) {
+  size_t i;
+
+  if (client->hs == NULL ||
+      client->hs->hello.servername_len > BUD_SESSION_NAME_MAX) {
+    return -1;
+  }
+
+  for (i = 0; i < client->hs->hello.servername_len; i++)
+    out[i] = tolower((unsigned char) client->hs->hello.servername[i]);
+  return (int) i;
+}
+
+
+int bud_session_name_match(bud_client_t* client,
+                           const char* name,
+                           size_t name_len) {
+  char own[BUD_SESSION_NAME_MAX];
+  int own_len;
+
+  own_len = bud_session_servername(client, own);
+  return own_len >= 0 &&
+         (size_t) own_len == name_len &&
+         memcmp(own, name, name_len) == 0;
+}
+
+
+bud_error_t bud_client_session_lookup(bud_client_t* client) {
+  bud_config_t* config;
+  bud_error_t err;
+  char id[BUD_SESSION_HEX_MAX];
+  size_t id_len;
+
+  config = client->config;
+  if (client->hs->hello.session_len > BUD_SESSION_ID_MAX)
+    return bud_ok();
+
+  /* Session id is binary, and `hello` is gone after the handshake starts */
+  id_len = bud_session_hex((const unsigned char*) client->hs->hello.session,
+                           client->hs->hello.session_len,
+                           id);
+  client->hs->session_req = bud_http_get(config->session.pool,
+                                     config->session.query_fmt,
+                                     id,
+                                     id_len,
+                                     bud_client_session_lookup_cb,
+                                     &err);
+  if (!bud_is_ok(err))
+    return err;
+  client->hs->session_req->data = client;
+
+  return bud_ok();
+}
+
+
+void bud_client_session_lookup_cb(bud_http_request_t* req, bud_error_t err) {
+  bud_client_t* client;
+  JSON_Object* obj;
+  const char* b64_body;
+  size_t b64_body_len;
+  const char* b64_name;
+  char name[BUD_SESSION_NAME_MAX + 3];
+  size_t name_len;
+  char* body;
+  const unsigned char* pbody;
+  size_t body_len;
+
+  client = req->data;
+  client->hs->session_req = NULL;
+  body = NULL;
+
+  if (!bud_is_ok(err)) {
+    WARNING(&client->frontend,
+            "session lookup cb failed: %d - \"%s\"",
+            err.code,
+            err.str);
+    bud_client_cycle(client);
+    return;
+  }
+
+  if (req->code < 200 || req->code >= 400) {
+    DBG_LN(&client->frontend, "external session cache miss");
+    goto done;
+  }
+
+  obj = json_value_get_object(req->response);
+  b64_body = json_object_get_string(obj, "session");
+  b64_name = json_object_get_string(obj, "servername");
+  if (b64_body == NULL || b64_name == NULL)
+    goto done;
+
+  /* Issued for another servername, do a full handshake */
+  name_len = bud_base64_decoded_size_fast(strlen(b64_name));
+  if (name_len > sizeof(name))
+    goto done;
+  name_len = bud_base64_decode(name, sizeof(name), b64_name, strlen(b64_name));
+  if (!bud_session_name_match(client, name, name_len)) {
+    DBG_LN(&client->frontend, "external session of another servername");
+    goto done;
+  }
+
+  b64_body_len = strlen(b64_body);
+  body_len = bud_base64_decoded_size_fast(b64_body_len);
+  body = malloc(body_len);
+  if (body == NULL)
+    goto done;
+
+  body_len = bud_base64_decode(body, body_len, b64_body, b64_body_len);
+  pbody = (const unsigned char*) body;
+  client->hs->session = d2i_SSL_SESSION(NULL, &pbody, body_len);
+  if (client->hs->session != NULL)
+    DBG_LN(&client->frontend, "external session cache hit");
+
+done:
+  free(body);
+  json_value_free(req->response);
+  bud_client_cycle(client);
+}
+
+
+void bud_session_store(bud_config_t* config,
+                       const unsigned char* id,
+                       unsigned int id_len,
+                       const unsigned char* data,
+                       int data_len,
+                       const char* name,
+                       int name_len) {
+  bud_http_request_t* req;
+  bud_error_t err;
+  char hex[BUD_SESSION_HEX_MAX];
+  size_t hex_len;
+  bud_http_body_t* body;
+  char* json;
+  size_t json_size;
+  size_t offset;
+
+  /* {"session":"...","servername":"..."} */
+  json_size = 12 + bud_base64_encoded_size(data_len) +
+              16 + bud_base64_encoded_size(name_len) + 3;
+  body = bud_http_body_new(json_size - 1);
+  if (body == NULL)
+    return;
+  json = body->data;
+
+  offset = snprintf(json, json_size, "{\"session\":\"");
+  bud_base64_encode((const char*) data,
+                    data_len,
+                    json + offset,
+                    json_size - offset);
+  offset += bud_base64_encoded_size(data_len);
+  offset += snprintf(json + offset,
+                     json_size - offset,
+                     "\",\"servername\":\"");
+  bud_base64_encode(name, name_len, json + offset, json_size - offset);
+  offset += bud_base64_encoded_size(name_len);
+  snprintf(json + offset, json_size - offset, "\"}");
+
+  /* Fire and forget, request does not depend on the client */
+  hex_len = bud_session_hex(id, id_len, hex);
+  req = bud_http_post(config->session.pool,
+                      config->session.query_fmt,
+                      hex,
+                      hex_len,
+                      body,
+                      bud_session_store_cb,
+                      &err);
+  if (bud_is_ok(err))
+    req->data = NULL;
+  else
+    bud_error_log(config, kBudLogWarning, err);
+  bud_http_body_unref(body);
+}
+
+
+void bud_session_store_cb(bud_http_request_t* req, bud_error_t err) {
+  if (!bud_is_ok(err))
+    return bud_error_log(req->config, kBudLogWarning, err);
+  json_value_free(req->response);
+}
+
+
+int bud_session_cache_new_cb(SSL* ssl, SSL_SESSION* sess) {
+  bud_client_t* client;
+  const unsigned char* id;
+  unsigned int id_len;
+  unsigned char data[BUD_SESSION_DATA_MAX];
+  unsigned char* pdata;
+  int data_len;
+  char name[BUD_SESSION_NAME_MAX];
+  int name_len;
+#ifndef _WIN32
+  bud_session_cache_t* cache;
+  bud_session_bucket_t* bucket;
+  bud_session_entry_t* entry;
+  int64_t now;
+  int i;
+#endif  /* !_WIN32 */
+
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+  if (client == NULL)
+    return 0;
+
+  id = SSL_SESSION_get_id(sess, &id_len);
+  if (id_len == 0 || id_len > BUD_SESSION_ID_MAX)
+    return 0;
+
+  /* Not bound to a servername, would resume anywhere */
+  name_len = bud_session_servername(client, name);
+  if (name_len < 0)
+    return 0;
+
+  /* Serialize outside of the lock */
+  data_len = i2d_SSL_SESSION(sess, NULL);
+  if (data_len <= 0 || data_len > BUD_SESSION_DATA_MAX)
+    return 0;
+  pdata = data;
+  i2d_SSL_SESSION(sess, &pdata);
+
+  if (client->config->session.enabled)
+    bud_session_store(client->config,
+                      id,
+                      id_len,
+                      data,
+                      data_len,
+                      name,
+                      name_len);
+
+#ifndef _WIN32
+  cache = client->config->session_cache.cache;
+  if (cache == NULL)
+    return 0;
+
+  bucket = bud_session_cache_lock(cache, id, id_len);
+  if (bucket == NULL)
+    return 0;
+
+  /* Reuse own or expired slot, otherwise evict the one expiring first */
+  now = time(NULL);
+  entry = &bucket->entries[0];
+  for (i = 0; i < BUD_SESSION_BUCKET_WAYS; i++) {
+    if (bucket->entries[i].expire <= now ||
+        (bucket->entries[i].id_len == id_len &&
+         memcmp(bucket->entries[i].id, id, id_len) == 0)) {
+      entry = &bucket->entries[i];
+      break;
+    }
+    if (bucket->entries[i].expire < entry->expire)
+      entry = &bucket->entries[i];
+  }
+
+  entry->expire = (int64_t) SSL_SESSION_get_time(sess) +
+                  SSL_SESSION_get_timeout(sess);
+  entry->id_len = id_len;
+  entry->data_len = data_len;
+  entry->name_len = name_len;
+  memcpy(entry->id, id, id_len);
+  memcpy(entry->data, data, data_len);
+  memcpy(entry->name, name, name_len);
+  bud_session_cache_unlock(bucket);
+
+  cache->stores++;
+#endif  /* !_WIN32 */
+
+  /* No reference is kept */
+  return 0;
+}
+
+
+SSL_SESSION* bud_session_cache_get_cb(SSL* ssl,
+                                      unsigned char* id,
+                                      int len,
+                                      int* copy) {
+  bud_client_t* client;
+  SSL_SESSION* sess;
+  const unsigned char* sess_id;
+  unsigned int sess_id_len;
+#ifndef _WIN32
+  bud_session_cache_t* cache;
+  bud_session_bucket_t* bucket;
+  bud_session_entry_t* entry;
+  unsigned char data[BUD_SESSION_DATA_MAX];
+  const unsigned char* pdata;
+  uint32_t data_len;
+  int64_t now;
+  int i;
+#endif  /* !_WIN32 */
+
+  *copy = 0;
+  sess = NULL;
+
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+  if (client == NULL)
+    return NULL;
+
+  /* Prefetched from the external store */
+  if (client->hs != NULL && client->hs->session != NULL) {
+    sess = client->hs->session;
+    client->hs->session = NULL;
+
+    sess_id = SSL_SESSION_get_id(sess, &sess_id_len);
+    if (sess_id_len == (unsigned int) len &&
+        memcmp(sess_id, id, len) == 0) {
+      return sess;
+    }
+    SSL_SESSION_free(sess);
+    sess = NULL;
+  }
+
+#ifndef _WIN32
+  cache = client->config->session_cache.cache;
+  if (cache == NULL || len <= 0 || len > BUD_SESSION_ID_MAX)
+    return NULL;
+
+  bucket = bud_session_cache_lock(cache, id, len);
+  if (bucket == NULL)
+    return NULL;
+
+  now = time(NULL);
+  data_len = 0;
+  for (i = 0; i < BUD_SESSION_BUCKET_WAYS; i++) {
+    entry = &bucket->entries[i];
+    if (entry->expire <= now ||
+        entry->id_len != (uint32_t) len ||
+        memcmp(entry->id, id, len) != 0) {
+      continue;
+    }
+
+    /* Issued for another servername, may be another tenant's */
+    if (!bud_session_name_match(client, entry->name, entry->name_len))
+      break;
+
+    data_len = entry->data_len;
+    memcpy(data, entry->data, data_len);
+    break;
+  }
+  bud_session_cache_unlock(bucket);
+
+  if (data_len == 0) {
+    cache->misses++;
+    return NULL;
+  }
+
+  pdata = data;
+  sess = d2i_SSL_SESSION(NULL, &pdata, data_len);
+  if (sess == NULL)
+    cache->misses++;
+  else
+    cache->hits++;
+#endif  /* !_WIN32 */
+
+  return sess;
+}
+
+
+void bud_session_cache_remove_cb(SSL_CTX* ctx, SSL_SESSION* sess) {
+#ifndef _WIN32
+  bud_config_t* config;
+  bud_session_cache_t* cache;
+  bud_session_bucket_t* bucket;
+  bud_session_entry_t* entry;
+  const unsigned char* id;
+  unsigned int id_len;
+  int i;
+
+  config = SSL_CTX_get_ex_data(ctx, kBudSSLConfigIndex);
+  if (config == NULL || config->session_cache.cache == NULL)
+    return;
+  cache = config->session_cache.cache;
+
+  id = SSL_SESSION_get_id(sess, &id_len);
+  if (id_len == 0 || id_len > BUD_SESSION_ID_MAX)
+    return;
+
+  bucket = bud_session_cache_lock(cache, id, id_len);
+  if (bucket == NULL)
+    return;
+
+  for (i = 0; i < BUD_SESSION_BUCKET_WAYS; i++) {
+    entry = &bucket->entries[i];
+    if (entry->id_len == id_len && memcmp(entry->id, id, id_len) == 0) {
+      memset(entry, 0, sizeof(*entry));
+      break;
+    }
+  }
+  bud_session_cache_unlock(bucket);
+#endif  /* !_WIN32 */
+}
@@ -0,0 +1,63 @@
+#ifndef SRC_SESSION_CACHE_H_
+#define SRC_SESSION_CACHE_H_
+
+#include <stdint.h>  /* uint32_t */
+
+#include "openssl/ssl.h"
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+struct bud_client_s;
+struct bud_session_bucket_s;
+
+/* Workers inherit shared memory fd from the master at this position */
+#define BUD_SESSION_CACHE_FD 3
+
+/* Longest servername that sessions are bound to, longer ones aren't cached */
+#define BUD_SESSION_NAME_MAX 255
+
+typedef struct bud_session_cache_s bud_session_cache_t;
+
+struct bud_session_cache_s {
+  int fd;
+  size_t size;
+  void* mem;
+  uint32_t bucket_count;
+  struct bud_session_bucket_s* buckets;
+
+  /* Per-process stats */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stores;
+};
+
+/*
+ * Master creates the shared memory before spawning workers, workers
+ * map the inherited descriptor (see BUD_SESSION_CACHE_FD).
+ */
+bud_error_t bud_session_cache_new(struct bud_config_s* config);
+bud_error_t bud_session_cache_open(struct bud_config_s* config, int fd);
+void bud_session_cache_free(struct bud_config_s* config);
+
+/* Prefetch session from the external store (`session` http pool) */
+bud_error_t bud_client_session_lookup(struct bud_client_s* client);
+
+/*
+ * Lower-cased servername of the client's hello, written to `out` (at least
+ * BUD_SESSION_NAME_MAX bytes). Sessions resume only on the servername they
+ * were issued for: OpenSSL looks them up before the SNI callback switches
+ * the context. -1 - the hello is gone or the name is too long.
+ */
+int bud_session_servername(struct bud_client_s* client, char* out);
+
+/* SSL_CTX callbacks */
+int bud_session_cache_new_cb(SSL* ssl, SSL_SESSION* sess);
+SSL_SESSION* bud_session_cache_get_cb(SSL* ssl,
+                                      unsigned char* id,
+                                      int len,
+                                      int* copy);
+void bud_session_cache_remove_cb(SSL_CTX* ctx, SSL_SESSION* sess);
+
+#endif  /* SRC_SESSION_CACHE_H_ */
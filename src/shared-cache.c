@@ -0,0 +1,387 @@
+#include <errno.h>  /* errno, EOWNERDEAD */
+#include <stdio.h>  /* snprintf */
+#include <stdlib.h>  /* calloc, malloc, free */
+#include <string.h>  /* memcpy, memcmp, memset */
+#include <time.h>  /* time */
+
+#ifndef _WIN32
+#include <fcntl.h>  /* O_* */
+#include <pthread.h>
+#include <sys/mman.h>  /* mmap, munmap, shm_open */
+#include <sys/stat.h>  /* fstat */
+#include <unistd.h>  /* close, ftruncate, getpid */
+#endif  /* !_WIN32 */
+
+#include "uv.h"
+
+#include "shared-cache.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+#define BUD_SHARED_CACHE_MAGIC 0x62756468
+#define BUD_SHARED_BUCKET_WAYS 2
+
+typedef struct bud_shared_header_s bud_shared_header_t;
+typedef struct bud_shared_entry_s bud_shared_entry_t;
+typedef struct bud_shared_bucket_s bud_shared_bucket_t;
+
+struct bud_shared_header_s {
+  uint32_t magic;
+  uint32_t bucket_count;
+};
+
+struct bud_shared_entry_s {
+  int64_t expire;
+  int64_t stale;
+  uint32_t kind;
+  uint32_t key_len;
+  uint32_t data_len;
+  uint32_t reserved;
+  char key[BUD_SHARED_KEY_MAX];
+  char data[BUD_SHARED_DATA_MAX];
+};
+
+struct bud_shared_bucket_s {
+#ifndef _WIN32
+  pthread_mutex_t lock;
+#endif  /* !_WIN32 */
+  bud_shared_entry_t entries[BUD_SHARED_BUCKET_WAYS];
+};
+
+#ifndef _WIN32
+static bud_error_t bud_shared_cache_map(bud_shared_cache_t* cache);
+static bud_shared_bucket_t* bud_shared_cache_lock(bud_shared_cache_t* cache,
+                                                  bud_shared_kind_t kind,
+                                                  const char* key,
+                                                  size_t key_len);
+static void bud_shared_cache_unlock(bud_shared_bucket_t* bucket);
+static bud_shared_entry_t* bud_shared_cache_find(bud_shared_bucket_t* bucket,
+                                                 bud_shared_kind_t kind,
+                                                 const char* key,
+                                                 size_t key_len);
+#endif  /* !_WIN32 */
+
+
+bud_error_t bud_shared_cache_new(bud_config_t* config) {
+#ifndef _WIN32
+  bud_shared_cache_t* cache;
+  bud_shared_header_t* header;
+  pthread_mutexattr_t attr;
+  char name[64];
+  uint32_t i;
+  bud_error_t err;
+  int r;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_shared_cache_t");
+
+  cache->bucket_count = (config->shared_cache.size +
+                         BUD_SHARED_BUCKET_WAYS - 1) /
+                        BUD_SHARED_BUCKET_WAYS;
+  if (cache->bucket_count == 0)
+    cache->bucket_count = 1;
+  cache->size = sizeof(*header) +
+                cache->bucket_count * sizeof(*cache->buckets);
+
+  /* Anonymous shared memory, only reachable through inherited fd */
+  snprintf(name, sizeof(name), "/bud-shared-%d", (int) getpid());
+  cache->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (cache->fd == -1) {
+    err = bud_error_num(kBudErrSharedCacheShm, errno);
+    goto failed_shm_open;
+  }
+  shm_unlink(name);
+
+  /* Pages are zero-filled (i.e. empty entries) and allocated on write */
+  if (ftruncate(cache->fd, cache->size) != 0) {
+    err = bud_error_num(kBudErrSharedCacheShm, errno);
+    goto failed_map;
+  }
+
+  err = bud_shared_cache_map(cache);
+  if (!bud_is_ok(err))
+    goto failed_map;
+
+  /* Initialize locks */
+  r = pthread_mutexattr_init(&attr);
+  if (r == 0)
+    r = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+  /* Worker may be killed while holding the lock */
+  if (r == 0)
+    r = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif  /* __linux__ */
+  for (i = 0; r == 0 && i < cache->bucket_count; i++)
+    r = pthread_mutex_init(&cache->buckets[i].lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  if (r != 0) {
+    err = bud_error_num(kBudErrSharedCacheLock, r);
+    goto failed_lock_init;
+  }
+
+  header = cache->mem;
+  header->bucket_count = cache->bucket_count;
+  header->magic = BUD_SHARED_CACHE_MAGIC;
+
+  config->shared_cache.cache = cache;
+  return bud_ok();
+
+failed_lock_init:
+  munmap(cache->mem, cache->size);
+
+failed_map:
+  close(cache->fd);
+
+failed_shm_open:
+  free(cache);
+  return err;
+#else  /* _WIN32 */
+  return bud_error(kBudErrSharedCacheNotSupported);
+#endif  /* !_WIN32 */
+}
+
+
+bud_error_t bud_shared_cache_open(bud_config_t* config, int fd) {
+#ifndef _WIN32
+  bud_shared_cache_t* cache;
+  bud_shared_header_t* header;
+  struct stat st;
+  bud_error_t err;
+
+  cache = calloc(1, sizeof(*cache));
+  if (cache == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_shared_cache_t");
+
+  cache->fd = fd;
+  if (fstat(fd, &st) != 0) {
+    err = bud_error_num(kBudErrSharedCacheShm, errno);
+    goto fatal;
+  }
+  cache->size = st.st_size;
+  if (cache->size < sizeof(*header)) {
+    err = bud_error_num(kBudErrSharedCacheShm, EINVAL);
+    goto fatal;
+  }
+
+  err = bud_shared_cache_map(cache);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  header = cache->mem;
+  cache->bucket_count = header->bucket_count;
+  if (header->magic != BUD_SHARED_CACHE_MAGIC ||
+      sizeof(*header) + cache->bucket_count * sizeof(*cache->buckets) >
+          cache->size) {
+    munmap(cache->mem, cache->size);
+    err = bud_error_num(kBudErrSharedCacheShm, EINVAL);
+    goto fatal;
+  }
+
+  config->shared_cache.cache = cache;
+  return bud_ok();
+
+fatal:
+  free(cache);
+  return err;
+#else  /* _WIN32 */
+  return bud_error(kBudErrSharedCacheNotSupported);
+#endif  /* !_WIN32 */
+}
+
+
+void bud_shared_cache_free(bud_config_t* config) {
+  bud_shared_cache_t* cache;
+
+  cache = config->shared_cache.cache;
+  if (cache == NULL)
+    return;
+
+  bud_log(config,
+          kBudLogDebug,
+          "shared cache hits: %llu misses: %llu stores: %llu",
+          (unsigned long long) cache->hits,
+          (unsigned long long) cache->misses,
+          (unsigned long long) cache->stores);
+
+#ifndef _WIN32
+  munmap(cache->mem, cache->size);
+  close(cache->fd);
+#endif  /* !_WIN32 */
+  free(cache);
+  config->shared_cache.cache = NULL;
+}
+
+
+#ifndef _WIN32
+bud_error_t bud_shared_cache_map(bud_shared_cache_t* cache) {
+  cache->mem = mmap(NULL,
+                    cache->size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED,
+                    cache->fd,
+                    0);
+  if (cache->mem == MAP_FAILED) {
+    cache->mem = NULL;
+    return bud_error_num(kBudErrSharedCacheShm, errno);
+  }
+
+  cache->buckets = (bud_shared_bucket_t*) ((char*) cache->mem +
+                                           sizeof(bud_shared_header_t));
+  return bud_ok();
+}
+
+
+bud_shared_bucket_t* bud_shared_cache_lock(bud_shared_cache_t* cache,
+                                           bud_shared_kind_t kind,
+                                           const char* key,
+                                           size_t key_len) {
+  uint32_t hash;
+  size_t i;
+  bud_shared_bucket_t* bucket;
+  int r;
+
+  /* FNV-1a */
+  hash = (2166136261u ^ kind) * 16777619u;
+  for (i = 0; i < key_len; i++)
+    hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+
+  bucket = &cache->buckets[hash % cache->bucket_count];
+  r = pthread_mutex_lock(&bucket->lock);
+#ifdef __linux__
+  if (r == EOWNERDEAD) {
+    /* Previous owner died in the middle of update, drop everything */
+    memset(bucket->entries, 0, sizeof(bucket->entries));
+    r = pthread_mutex_consistent(&bucket->lock);
+  }
+#endif  /* __linux__ */
+  if (r != 0)
+    return NULL;
+
+  return bucket;
+}
+
+
+void bud_shared_cache_unlock(bud_shared_bucket_t* bucket) {
+  pthread_mutex_unlock(&bucket->lock);
+}
+
+
+bud_shared_entry_t* bud_shared_cache_find(bud_shared_bucket_t* bucket,
+                                          bud_shared_kind_t kind,
+                                          const char* key,
+                                          size_t key_len) {
+  bud_shared_entry_t* entry;
+  int i;
+
+  for (i = 0; i < BUD_SHARED_BUCKET_WAYS; i++) {
+    entry = &bucket->entries[i];
+    if (entry->kind == (uint32_t) kind &&
+        entry->key_len == key_len &&
+        memcmp(entry->key, key, key_len) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+#endif  /* !_WIN32 */
+
+
+char* bud_shared_cache_get(bud_shared_cache_t* cache,
+                           bud_shared_kind_t kind,
+                           const char* key,
+                           size_t key_len,
+                           size_t* len,
+                           int64_t* expire,
+                           int64_t* stale) {
+#ifndef _WIN32
+  bud_shared_bucket_t* bucket;
+  bud_shared_entry_t* entry;
+  char* res;
+
+  if (key_len > BUD_SHARED_KEY_MAX)
+    return NULL;
+
+  bucket = bud_shared_cache_lock(cache, kind, key, key_len);
+  if (bucket == NULL)
+    return NULL;
+
+  res = NULL;
+  entry = bud_shared_cache_find(bucket, kind, key, key_len);
+  if (entry == NULL || entry->stale <= time(NULL))
+    goto done;
+
+  /* Copy it out, other worker may replace the entry right after unlock */
+  res = malloc(entry->data_len == 0 ? 1 : entry->data_len);
+  if (res == NULL)
+    goto done;
+  memcpy(res, entry->data, entry->data_len);
+  *len = entry->data_len;
+  *expire = entry->expire;
+  *stale = entry->stale;
+
+done:
+  bud_shared_cache_unlock(bucket);
+  if (res == NULL)
+    cache->misses++;
+  else
+    cache->hits++;
+  return res;
+#else  /* _WIN32 */
+  return NULL;
+#endif  /* !_WIN32 */
+}
+
+
+void bud_shared_cache_put(bud_shared_cache_t* cache,
+                          bud_shared_kind_t kind,
+                          const char* key,
+                          size_t key_len,
+                          int64_t expire,
+                          int64_t stale,
+                          const uv_buf_t* bufs,
+                          int count) {
+#ifndef _WIN32
+  bud_shared_bucket_t* bucket;
+  bud_shared_entry_t* entry;
+  bud_shared_entry_t* victim;
+  size_t size;
+  int i;
+
+  size = 0;
+  for (i = 0; i < count; i++)
+    size += bufs[i].len;
+  if (key_len > BUD_SHARED_KEY_MAX || size > BUD_SHARED_DATA_MAX)
+    return;
+
+  bucket = bud_shared_cache_lock(cache, kind, key, key_len);
+  if (bucket == NULL)
+    return;
+
+  /* Replace the same key, or the one that goes stale first */
+  victim = bud_shared_cache_find(bucket, kind, key, key_len);
+  if (victim == NULL) {
+    victim = &bucket->entries[0];
+    for (i = 1; i < BUD_SHARED_BUCKET_WAYS; i++) {
+      entry = &bucket->entries[i];
+      if (entry->stale < victim->stale)
+        victim = entry;
+    }
+  }
+
+  victim->expire = expire;
+  victim->stale = stale;
+  victim->kind = kind;
+  victim->key_len = key_len;
+  memcpy(victim->key, key, key_len);
+  victim->data_len = 0;
+  for (i = 0; i < count; i++) {
+    memcpy(victim->data + victim->data_len, bufs[i].base, bufs[i].len);
+    victim->data_len += bufs[i].len;
+  }
+
+  bud_shared_cache_unlock(bucket);
+  cache->stores++;
+#endif  /* !_WIN32 */
+}
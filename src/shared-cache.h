@@ -0,0 +1,81 @@
+#ifndef SRC_SHARED_CACHE_H_
+#define SRC_SHARED_CACHE_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t, int64_t */
+#include <stdlib.h>  /* size_t */
+
+#include "uv.h"
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+struct bud_shared_bucket_s;
+
+/* Workers inherit shared memory fd from the master at this position */
+#define BUD_SHARED_CACHE_FD 4
+
+/* Longest key (servername, OCSP id) and value that fit into the entry */
+#define BUD_SHARED_KEY_MAX 256
+#define BUD_SHARED_DATA_MAX 16384
+
+typedef struct bud_shared_cache_s bud_shared_cache_t;
+typedef enum bud_shared_kind_e bud_shared_kind_t;
+
+enum bud_shared_kind_e {
+  /* Servername => SNI response, same as on disk (see bud_sni_save()) */
+  kBudSharedSNI = 1,
+
+  /* OCSP id => DER staple */
+  kBudSharedStaple = 2
+};
+
+/*
+ * Raw SNI responses (DER certs and keys) and staples, shared between the
+ * workers so that only one of them has to go to the backend for them.
+ * Every worker builds its own SSL_CTX out of these.
+ */
+struct bud_shared_cache_s {
+  int fd;
+  size_t size;
+  void* mem;
+  uint32_t bucket_count;
+  struct bud_shared_bucket_s* buckets;
+
+  /* Per-process stats */
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t stores;
+};
+
+/*
+ * Master creates the shared memory before spawning workers, workers
+ * map the inherited descriptor (see BUD_SHARED_CACHE_FD).
+ */
+bud_error_t bud_shared_cache_new(struct bud_config_s* config);
+bud_error_t bud_shared_cache_open(struct bud_config_s* config, int fd);
+void bud_shared_cache_free(struct bud_config_s* config);
+
+/*
+ * Copy of the value that is still usable (`stale` is in the future), should
+ * be free()'d. NULL - none. Wall clock times are in s.
+ */
+char* bud_shared_cache_get(bud_shared_cache_t* cache,
+                           bud_shared_kind_t kind,
+                           const char* key,
+                           size_t key_len,
+                           size_t* len,
+                           int64_t* expire,
+                           int64_t* stale);
+
+/* Value is `bufs` back to back, too big ones are not stored */
+void bud_shared_cache_put(bud_shared_cache_t* cache,
+                          bud_shared_kind_t kind,
+                          const char* key,
+                          size_t key_len,
+                          int64_t expire,
+                          int64_t stale,
+                          const uv_buf_t* bufs,
+                          int count);
+
+#endif  /* SRC_SHARED_CACHE_H_ */
@@ -0,0 +1,99 @@
+#include <stdlib.h>  /* NULL */
+
+#include "slab.h"
+#include "common.h"
+#include "config.h"
+#include "logger.h"
+#include "memstat.h"
+
+static void bud_slab_trim(bud_slab_t* slab, size_t count);
+
+
+void bud_slab_init(bud_slab_t* slab,
+                   const char* name,
+                   bud_mem_tag_t tag,
+                   size_t size,
+                   size_t low_watermark,
+                   size_t high_watermark) {
+  /* Free objects are linked through their first word */
+  if (size < sizeof(void*))
+    size = sizeof(void*);
+  if (low_watermark > high_watermark)
+    low_watermark = high_watermark;
+
+  slab->name = name;
+  slab->tag = tag;
+  slab->size = size;
+  slab->free_list = NULL;
+  slab->free_count = 0;
+  slab->low_watermark = low_watermark;
+  slab->high_watermark = high_watermark;
+  slab->used_count = 0;
+  slab->hits = 0;
+  slab->misses = 0;
+}
+
+
+void bud_slab_destroy(bud_slab_t* slab) {
+  bud_slab_trim(slab, 0);
+}
+
+
+void* bud_slab_alloc(bud_slab_t* slab) {
+  void* res;
+
+  if (slab->free_list != NULL) {
+    res = slab->free_list;
+    slab->free_list = *(void**) res;
+    slab->free_count--;
+    slab->hits++;
+  } else {
+    res = bud_mem_alloc(slab->tag, slab->size);
+    if (res == NULL)
+      return NULL;
+    slab->misses++;
+  }
+
+  slab->used_count++;
+  return res;
+}
+
+
+void bud_slab_free(bud_slab_t* slab, void* ptr) {
+  if (ptr == NULL)
+    return;
+
+  ASSERT(slab->used_count > 0, "Slab double free");
+  slab->used_count--;
+
+  *(void**) ptr = slab->free_list;
+  slab->free_list = ptr;
+  slab->free_count++;
+
+  if (slab->free_count > slab->high_watermark)
+    bud_slab_trim(slab, slab->low_watermark);
+}
+
+
+void bud_slab_trim(bud_slab_t* slab, size_t count) {
+  void* next;
+
+  while (slab->free_count > count) {
+    next = *(void**) slab->free_list;
+    bud_mem_free(slab->free_list);
+    slab->free_list = next;
+    slab->free_count--;
+  }
+}
+
+
+void bud_slab_log_stats(bud_config_t* config, bud_slab_t* slab) {
+  bud_log(config,
+          kBudLogDebug,
+          "slab \"%s\" used: %lu free: %lu hits: %llu misses: %llu",
+          slab->name,
+          (unsigned long) slab->used_count,
+          (unsigned long) slab->free_count,
+          (unsigned long long) slab->hits,
+          (unsigned long long) slab->misses);
+}
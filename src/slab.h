@@ -0,0 +1,50 @@
+#ifndef SRC_SLAB_H_
+#define SRC_SLAB_H_
+
+#include <stddef.h>  /* size_t */
+#include <stdint.h>  /* uint64_t */
+
+#include "memstat.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+typedef struct bud_slab_s bud_slab_t;
+
+/*
+ * Per-worker free-list of fixed-size objects.
+ *
+ * Freed objects are cached for reuse, until there are more than
+ * `high_watermark` of them - then the list is trimmed down to
+ * `low_watermark` in a single pass.
+ */
+struct bud_slab_s {
+  const char* name;
+  bud_mem_tag_t tag;
+  size_t size;
+
+  void* free_list;
+  size_t free_count;
+  size_t low_watermark;
+  size_t high_watermark;
+
+  /* Stats */
+  size_t used_count;
+  uint64_t hits;
+  uint64_t misses;
+};
+
+void bud_slab_init(bud_slab_t* slab,
+                   const char* name,
+                   bud_mem_tag_t tag,
+                   size_t size,
+                   size_t low_watermark,
+                   size_t high_watermark);
+void bud_slab_destroy(bud_slab_t* slab);
+
+void* bud_slab_alloc(bud_slab_t* slab);
+void bud_slab_free(bud_slab_t* slab, void* ptr);
+
+void bud_slab_log_stats(struct bud_config_s* config, bud_slab_t* slab);
+
+#endif  /* SRC_SLAB_H_ */
@@ -0,0 +1,572 @@
+#include <errno.h>  /* errno */
+#include <stdio.h>  /* snprintf */
+#include <stdlib.h>  /* calloc, free, malloc */
+#include <string.h>  /* memcpy, memcmp, memset, strlen */
+
+#ifndef _WIN32
+#include <fcntl.h>  /* O_* */
+#include <sys/mman.h>  /* mmap, munmap, shm_open */
+#include <sys/stat.h>  /* fstat, stat */
+#include <unistd.h>  /* close, getpid, write */
+#endif  /* !_WIN32 */
+
+#include "openssl/evp.h"
+#include "openssl/x509.h"
+
+#include "snapshot.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+#include "preload.h"
+
+#define BUD_SNAPSHOT_MAGIC 0x62756470
+#define BUD_SNAPSHOT_VERSION 1
+
+typedef struct bud_snapshot_header_s bud_snapshot_header_t;
+typedef struct bud_snapshot_entry_s bud_snapshot_entry_t;
+typedef enum bud_snapshot_type_e bud_snapshot_type_t;
+
+enum bud_snapshot_type_e {
+  kBudSnapshotChain = 1,
+  kBudSnapshotKey = 2
+};
+
+struct bud_snapshot_header_s {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+/* Followed by `path_len` bytes of path, then `items` of (uint32_t, DER) */
+struct bud_snapshot_entry_s {
+  uint32_t type;
+  uint32_t index;
+  uint32_t pair;
+  uint32_t path_len;
+  uint32_t items;
+  uint32_t reserved;
+  uint64_t size;
+  uint64_t mtime;
+  uint64_t ino;
+  uint64_t dev;
+};
+
+#ifndef _WIN32
+static char* bud_snapshot_reserve(bud_snapshot_t* snapshot, size_t size);
+static int bud_snapshot_add_entry(bud_snapshot_t* snapshot,
+                                  bud_snapshot_type_t type,
+                                  int index,
+                                  int pair,
+                                  const char* file,
+                                  uint32_t items);
+static int bud_snapshot_add_der(bud_snapshot_t* snapshot, int len);
+static int bud_snapshot_file_ok(const bud_snapshot_entry_t* entry,
+                                const char* path);
+static const char* bud_snapshot_expected_file(bud_config_t* config,
+                                              int index,
+                                              int pair,
+                                              int type);
+static int bud_snapshot_decode(bud_preload_t* preload,
+                               const bud_snapshot_entry_t* entry,
+                               const char* data,
+                               size_t size);
+#endif  /* !_WIN32 */
+
+
+void bud_snapshot_new(bud_config_t* config) {
+#ifndef _WIN32
+  bud_snapshot_t* snapshot;
+  bud_snapshot_header_t* header;
+
+  if (!config->snapshot_enabled ||
+      config->is_worker ||
+      config->worker_count == 0) {
+    return;
+  }
+
+  snapshot = calloc(1, sizeof(*snapshot));
+  if (snapshot == NULL)
+    goto fatal;
+  snapshot->fd = -1;
+
+  header = (bud_snapshot_header_t*) bud_snapshot_reserve(snapshot,
+                                                         sizeof(*header));
+  if (header == NULL) {
+    free(snapshot);
+    goto fatal;
+  }
+  header->magic = BUD_SNAPSHOT_MAGIC;
+  header->version = BUD_SNAPSHOT_VERSION;
+  header->count = 0;
+  header->reserved = 0;
+
+  config->snapshot = snapshot;
+  return;
+
+fatal:
+  bud_error_log(config,
+                kBudLogWarning,
+                bud_error_str(kBudErrNoMem, "bud_snapshot_t"));
+#endif  /* !_WIN32 */
+}
+
+
+void bud_snapshot_finish(bud_config_t* config) {
+#ifndef _WIN32
+  bud_snapshot_t* snapshot;
+  bud_snapshot_header_t header;
+  char name[64];
+  size_t off;
+  ssize_t r;
+  int err;
+
+  snapshot = config->snapshot;
+  if (snapshot == NULL || snapshot->fd != -1)
+    return;
+
+  memcpy(&header, snapshot->buf, sizeof(header));
+  header.count = snapshot->count;
+  memcpy(snapshot->buf, &header, sizeof(header));
+
+  /* Anonymous shared memory, only reachable through inherited fd */
+  snprintf(name, sizeof(name), "/bud-snapshot-%d", (int) getpid());
+  snapshot->fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (snapshot->fd == -1) {
+    err = errno;
+    goto fatal;
+  }
+  shm_unlink(name);
+
+  for (off = 0; off < snapshot->len; off += r) {
+    r = write(snapshot->fd, snapshot->buf + off, snapshot->len - off);
+    if (r == -1 && errno == EINTR) {
+      r = 0;
+    } else if (r <= 0) {
+      err = errno;
+      close(snapshot->fd);
+      goto fatal;
+    }
+  }
+
+  bud_log(config,
+          kBudLogDebug,
+          "context snapshot: %u entries, %lu bytes",
+          (unsigned int) snapshot->count,
+          (unsigned long) snapshot->len);
+
+  /* Keys stay only in the shared memory */
+  OPENSSL_cleanse(snapshot->buf, snapshot->len);
+  free(snapshot->buf);
+  snapshot->buf = NULL;
+  snapshot->len = 0;
+  snapshot->cap = 0;
+  return;
+
+fatal:
+  bud_error_log(config, kBudLogWarning, bud_error_num(kBudErrSnapshot, err));
+  snapshot->fd = -1;
+  bud_snapshot_free(config);
+#endif  /* !_WIN32 */
+}
+
+
+void bud_snapshot_free(bud_config_t* config) {
+  bud_snapshot_t* snapshot;
+
+  snapshot = config->snapshot;
+  if (snapshot == NULL)
+    return;
+
+#ifndef _WIN32
+  if (snapshot->fd != -1)
+    close(snapshot->fd);
+#endif  /* !_WIN32 */
+  if (snapshot->buf != NULL) {
+    OPENSSL_cleanse(snapshot->buf, snapshot->len);
+    free(snapshot->buf);
+  }
+  free(snapshot);
+  config->snapshot = NULL;
+}
+
+
+void bud_snapshot_add_chain(bud_snapshot_t* snapshot,
+                            int index,
+                            int pair,
+                            const char* file,
+                            STACK_OF(X509)* chain) {
+#ifndef _WIN32
+  int i;
+  int len;
+  size_t start;
+  unsigned char* p;
+  X509* x;
+
+  if (snapshot == NULL || snapshot->buf == NULL || sk_X509_num(chain) == 0)
+    return;
+
+  /* Rolled back on any failure */
+  start = snapshot->len;
+  if (bud_snapshot_add_entry(snapshot,
+                             kBudSnapshotChain,
+                             index,
+                             pair,
+                             file,
+                             sk_X509_num(chain)) != 0) {
+    goto fatal;
+  }
+
+  for (i = 0; i < sk_X509_num(chain); i++) {
+    x = sk_X509_value(chain, i);
+    len = i2d_X509(x, NULL);
+    if (bud_snapshot_add_der(snapshot, len) != 0)
+      goto fatal;
+    p = (unsigned char*) snapshot->buf + snapshot->len - len;
+    i2d_X509(x, &p);
+  }
+
+  snapshot->count++;
+  return;
+
+fatal:
+  snapshot->len = start;
+#endif  /* !_WIN32 */
+}
+
+
+void bud_snapshot_add_key(bud_snapshot_t* snapshot,
+                          int index,
+                          int pair,
+                          const char* file,
+                          EVP_PKEY* key) {
+#ifndef _WIN32
+  int len;
+  size_t start;
+  unsigned char* p;
+
+  if (snapshot == NULL || snapshot->buf == NULL)
+    return;
+
+  /* Keys of engines (HSM and the like) can't be exported, that's fine */
+  len = i2d_PrivateKey(key, NULL);
+  if (len <= 0)
+    return;
+
+  start = snapshot->len;
+  if (bud_snapshot_add_entry(snapshot,
+                             kBudSnapshotKey,
+                             index,
+                             pair,
+                             file,
+                             1) != 0 ||
+      bud_snapshot_add_der(snapshot, len) != 0) {
+    snapshot->len = start;
+    return;
+  }
+  p = (unsigned char*) snapshot->buf + snapshot->len - len;
+  if (i2d_PrivateKey(key, &p) != len) {
+    snapshot->len = start;
+    return;
+  }
+
+  snapshot->count++;
+#endif  /* !_WIN32 */
+}
+
+
+bud_preload_t* bud_snapshot_preload(bud_config_t* config, int fd, int count) {
+#ifndef _WIN32
+  struct stat st;
+  char* mem;
+  size_t size;
+  size_t off;
+  uint32_t i;
+  uint32_t used;
+  bud_snapshot_header_t header;
+  bud_snapshot_entry_t entry;
+  const char* path;
+  const char* expected;
+  bud_preload_t* preload;
+
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(header))
+    goto fatal;
+  size = st.st_size;
+
+  mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED)
+    goto fatal;
+
+  memcpy(&header, mem, sizeof(header));
+  if (header.magic != BUD_SNAPSHOT_MAGIC ||
+      header.version != BUD_SNAPSHOT_VERSION) {
+    munmap(mem, size);
+    goto fatal;
+  }
+
+  preload = calloc(count, sizeof(*preload));
+  if (preload == NULL) {
+    munmap(mem, size);
+    bud_error_log(config,
+                  kBudLogWarning,
+                  bud_error_str(kBudErrNoMem, "bud_preload_t"));
+    return NULL;
+  }
+
+  used = 0;
+  off = sizeof(header);
+  for (i = 0; i < header.count; i++) {
+    if (size - off < sizeof(entry))
+      break;
+    memcpy(&entry, mem + off, sizeof(entry));
+    off += sizeof(entry);
+    if (size - off < entry.path_len)
+      break;
+    path = mem + off;
+    off += entry.path_len;
+
+    /*
+     * Same context, same file, and the file wasn't touched since - otherwise
+     * bud_config_load_context() reads the file on its own.
+     */
+    expected = bud_snapshot_expected_file(config,
+                                          entry.index,
+                                          entry.pair,
+                                          entry.type);
+    if (entry.index < (uint32_t) count &&
+        entry.pair < BUD_PRELOAD_MAX_PAIRS &&
+        expected != NULL &&
+        strlen(expected) == entry.path_len &&
+        memcmp(expected, path, entry.path_len) == 0 &&
+        bud_snapshot_file_ok(&entry, expected) &&
+        bud_snapshot_decode(&preload[entry.index],
+                            &entry,
+                            mem + off,
+                            size - off) == 0) {
+      used++;
+    }
+
+    /* Skip the items, decoded or not */
+    for (; entry.items > 0; entry.items--) {
+      uint32_t len;
+
+      if (size - off < sizeof(len))
+        break;
+      memcpy(&len, mem + off, sizeof(len));
+      off += sizeof(len);
+      if (size - off < len)
+        break;
+      off += len;
+    }
+    if (entry.items > 0)
+      break;
+  }
+
+  munmap(mem, size);
+  bud_log(config,
+          kBudLogDebug,
+          "context snapshot: %u of %u entries used",
+          (unsigned int) used,
+          (unsigned int) header.count);
+  return preload;
+
+fatal:
+  bud_error_log(config,
+                kBudLogWarning,
+                bud_error_num(kBudErrSnapshot, errno == 0 ? EINVAL : errno));
+  return NULL;
+#else  /* _WIN32 */
+  return NULL;
+#endif  /* !_WIN32 */
+}
+
+
+#ifndef _WIN32
+char* bud_snapshot_reserve(bud_snapshot_t* snapshot, size_t size) {
+  size_t cap;
+  char* buf;
+
+  if (snapshot->cap - snapshot->len < size) {
+    cap = snapshot->cap == 0 ? 65536 : snapshot->cap;
+    while (cap - snapshot->len < size)
+      cap *= 2;
+
+    /* Don't leave copies of the keys behind in realloc()-ed memory */
+    buf = malloc(cap);
+    if (buf == NULL)
+      return NULL;
+    if (snapshot->buf != NULL) {
+      memcpy(buf, snapshot->buf, snapshot->len);
+      OPENSSL_cleanse(snapshot->buf, snapshot->len);
+      free(snapshot->buf);
+    }
+    snapshot->buf = buf;
+    snapshot->cap = cap;
+  }
+
+  buf = snapshot->buf + snapshot->len;
+  snapshot->len += size;
+  return buf;
+}
+
+
+int bud_snapshot_add_entry(bud_snapshot_t* snapshot,
+                           bud_snapshot_type_t type,
+                           int index,
+                           int pair,
+                           const char* file,
+                           uint32_t items) {
+  struct stat st;
+  bud_snapshot_entry_t entry;
+  size_t path_len;
+  char* p;
+
+  if (stat(file, &st) != 0)
+    return -1;
+
+  path_len = strlen(file);
+  memset(&entry, 0, sizeof(entry));
+  entry.type = type;
+  entry.index = index;
+  entry.pair = pair;
+  entry.path_len = path_len;
+  entry.items = items;
+  entry.size = st.st_size;
+  entry.mtime = st.st_mtime;
+  entry.ino = st.st_ino;
+  entry.dev = st.st_dev;
+
+  p = bud_snapshot_reserve(snapshot, sizeof(entry) + path_len);
+  if (p == NULL)
+    return -1;
+  memcpy(p, &entry, sizeof(entry));
+  memcpy(p + sizeof(entry), file, path_len);
+  return 0;
+}
+
+
+int bud_snapshot_add_der(bud_snapshot_t* snapshot, int len) {
+  uint32_t len32;
+  char* p;
+
+  if (len <= 0)
+    return -1;
+
+  /* DER itself is written by the caller, right at the end of the buffer */
+  len32 = len;
+  p = bud_snapshot_reserve(snapshot, sizeof(len32) + len);
+  if (p == NULL)
+    return -1;
+  memcpy(p, &len32, sizeof(len32));
+  return 0;
+}
+
+
+int bud_snapshot_file_ok(const bud_snapshot_entry_t* entry,
+                         const char* path) {
+  struct stat st;
+
+  if (stat(path, &st) != 0)
+    return 0;
+
+  return entry->size == (uint64_t) st.st_size &&
+         entry->mtime == (uint64_t) st.st_mtime &&
+         entry->ino == (uint64_t) st.st_ino &&
+         entry->dev == (uint64_t) st.st_dev;
+}
+
+
+const char* bud_snapshot_expected_file(bud_config_t* config,
+                                       int index,
+                                       int pair,
+                                       int type) {
+  const char* cert_file;
+  const char* key_file;
+  const bud_config_strs_t* cert_files;
+  const bud_config_strs_t* key_files;
+
+  if (index < 0 || index > config->context_count)
+    return NULL;
+
+  bud_config_context_files(config,
+                           &config->contexts[index],
+                           index,
+                           &cert_file,
+                           &key_file,
+                           &cert_files,
+                           &key_files);
+  if (pair < 0)
+    return NULL;
+  if (type == kBudSnapshotChain) {
+    if (cert_files != NULL)
+      return pair < cert_files->count ? cert_files->items[pair] : NULL;
+    return pair == 0 ? cert_file : NULL;
+  }
+  if (key_files != NULL)
+    return pair < key_files->count ? key_files->items[pair] : NULL;
+  return pair == 0 ? key_file : NULL;
+}
+
+
+int bud_snapshot_decode(bud_preload_t* preload,
+                        const bud_snapshot_entry_t* entry,
+                        const char* data,
+                        size_t size) {
+  uint32_t i;
+  uint32_t len;
+  size_t off;
+  const unsigned char* p;
+  X509* x;
+  EVP_PKEY* key;
+  STACK_OF(X509)* chain;
+
+  chain = NULL;
+  if (entry->type == kBudSnapshotChain) {
+    if (preload->certs[entry->pair] != NULL)
+      return -1;
+    chain = sk_X509_new_null();
+    if (chain == NULL)
+      return -1;
+  } else if (entry->type != kBudSnapshotKey ||
+             entry->items != 1 ||
+             preload->keys[entry->pair] != NULL) {
+    return -1;
+  }
+
+  off = 0;
+  for (i = 0; i < entry->items; i++) {
+    if (size - off < sizeof(len))
+      goto fatal;
+    memcpy(&len, data + off, sizeof(len));
+    off += sizeof(len);
+    if (size - off < len)
+      goto fatal;
+    p = (const unsigned char*) data + off;
+    off += len;
+
+    if (entry->type == kBudSnapshotKey) {
+      key = d2i_AutoPrivateKey(NULL, &p, len);
+      if (key == NULL)
+        return -1;
+      preload->keys[entry->pair] = key;
+      return 0;
+    }
+
+    x = d2i_X509(NULL, &p, len);
+    if (x == NULL)
+      goto fatal;
+    if (!sk_X509_push(chain, x)) {
+      X509_free(x);
+      goto fatal;
+    }
+  }
+
+  preload->certs[entry->pair] = chain;
+  return 0;
+
+fatal:
+  if (chain != NULL)
+    sk_X509_pop_free(chain, X509_free);
+  return -1;
+}
+#endif  /* !_WIN32 */
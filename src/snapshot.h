@@ -0,0 +1,65 @@
+#ifndef SRC_SNAPSHOT_H_
+#define SRC_SNAPSHOT_H_
+
+#include <stdint.h>  /* uint32_t */
+#include <stdlib.h>  /* size_t */
+
+#include "openssl/evp.h"
+#include "openssl/x509.h"
+
+#include "error.h"
+#include "preload.h"
+
+/* Workers inherit the snapshot fd from the master at this position */
+#define BUD_SNAPSHOT_FD 5
+
+/* Forward declaration */
+struct bud_config_s;
+
+typedef struct bud_snapshot_s bud_snapshot_t;
+
+/*
+ * DER certificate chains and keys of the contexts that master has loaded,
+ * each tagged with the file it came from (path, size, mtime and inode).
+ */
+struct bud_snapshot_s {
+  char* buf;
+  size_t len;
+  size_t cap;
+  uint32_t count;
+
+  /* Read-only copy for workers, -1 until bud_snapshot_finish() */
+  int fd;
+};
+
+/*
+ * Master: start recording (`snapshot` with workers), contexts loaded until
+ * bud_snapshot_finish() are added to it by bud_config_load_context().
+ * Failures only disable the snapshot, workers read the files then.
+ */
+void bud_snapshot_new(struct bud_config_s* config);
+void bud_snapshot_finish(struct bud_config_s* config);
+void bud_snapshot_free(struct bud_config_s* config);
+
+/* No-op if `snapshot` is NULL or finished, `chain` is leaf first */
+void bud_snapshot_add_chain(bud_snapshot_t* snapshot,
+                            int index,
+                            int pair,
+                            const char* file,
+                            STACK_OF(X509)* chain);
+void bud_snapshot_add_key(bud_snapshot_t* snapshot,
+                          int index,
+                          int pair,
+                          const char* file,
+                          EVP_PKEY* key);
+
+/*
+ * Worker: decode entries of the inherited snapshot into preload slots of
+ * `count` contexts. Entries of files that were changed since (or that the
+ * reloaded config doesn't use anymore) are skipped. NULL - no snapshot.
+ */
+bud_preload_t* bud_snapshot_preload(struct bud_config_s* config,
+                                    int fd,
+                                    int count);
+
+#endif  /* SRC_SNAPSHOT_H_ */
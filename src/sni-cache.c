@@ -0,0 +1,317 @@
+#include <stdlib.h>  /* calloc, malloc, free */
+#include <string.h>  /* memcpy */
+#include <strings.h>  /* strncasecmp */
+
+#include "uv.h"
+
+#include "sni-cache.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "memstat.h"
+#include "queue.h"
+#include "sni.h"
+
+static bud_sni_cache_entry_t** bud_sni_cache_find(bud_sni_cache_t* cache,
+                                                  const char* servername,
+                                                  size_t servername_len,
+                                                  uint32_t hash);
+static void bud_sni_cache_remove(bud_sni_cache_t* cache,
+                                 bud_sni_cache_entry_t** pentry);
+static bud_sni_pending_t** bud_sni_cache_pending_find(bud_sni_cache_t* cache,
+                                                      const char* servername,
+                                                      size_t servername_len,
+                                                      uint32_t hash);
+
+
+bud_sni_cache_t* bud_sni_cache_new(bud_config_t* config, bud_error_t* err) {
+  bud_sni_cache_t* cache;
+
+  cache = malloc(sizeof(*cache));
+  if (cache == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_sni_cache_t");
+    return NULL;
+  }
+
+  cache->config = config;
+  QUEUE_INIT(&cache->lru);
+  cache->count = 0;
+  cache->max = config->sni.cache.size;
+
+  /* Power of two, not less than the max count */
+  cache->bucket_count = 16;
+  while (cache->bucket_count < cache->max)
+    cache->bucket_count <<= 1;
+  cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+  cache->pending = calloc(cache->bucket_count, sizeof(*cache->pending));
+  if (cache->buckets == NULL || cache->pending == NULL) {
+    free(cache->buckets);
+    free(cache->pending);
+    free(cache);
+    *err = bud_error_str(kBudErrNoMem, "bud_sni_cache_t buckets");
+    return NULL;
+  }
+
+  *err = bud_ok();
+  return cache;
+}
+
+
+void bud_sni_cache_free(bud_sni_cache_t* cache) {
+  uint32_t i;
+  bud_sni_pending_t** ppending;
+  bud_sni_pending_t* pending;
+
+  bud_sni_cache_flush(cache);
+
+  /*
+   * Requests are owned (and cancelled) by the waiting clients. Background
+   * refreshes have none, their requests went away with the pool.
+   */
+  for (i = 0; i < cache->bucket_count; i++) {
+    ppending = &cache->pending[i];
+    while (*ppending != NULL) {
+      pending = *ppending;
+      if (!QUEUE_EMPTY(&pending->waiters)) {
+        ppending = &pending->next;
+        continue;
+      }
+      *ppending = pending->next;
+      bud_mem_free(pending);
+    }
+  }
+  free(cache->buckets);
+  free(cache->pending);
+  free(cache);
+}
+
+
+void bud_sni_cache_flush(bud_sni_cache_t* cache) {
+  uint32_t i;
+
+  for (i = 0; i < cache->bucket_count; i++)
+    while (cache->buckets[i] != NULL)
+      bud_sni_cache_remove(cache, &cache->buckets[i]);
+}
+
+
+bud_sni_cache_entry_t** bud_sni_cache_find(bud_sni_cache_t* cache,
+                                           const char* servername,
+                                           size_t servername_len,
+                                           uint32_t hash) {
+  bud_sni_cache_entry_t** pentry;
+
+  pentry = &cache->buckets[hash & (cache->bucket_count - 1)];
+  for (; *pentry != NULL; pentry = &(*pentry)->next) {
+    if ((*pentry)->hash == hash &&
+        (*pentry)->servername_len == servername_len &&
+        strncasecmp((*pentry)->servername, servername, servername_len) == 0) {
+      break;
+    }
+  }
+
+  return pentry;
+}
+
+
+void bud_sni_cache_remove(bud_sni_cache_t* cache,
+                          bud_sni_cache_entry_t** pentry) {
+  bud_sni_cache_entry_t* entry;
+
+  entry = *pentry;
+  *pentry = entry->next;
+  QUEUE_REMOVE(&entry->member);
+  cache->count--;
+
+  if (entry->ctx != NULL)
+    bud_sni_context_unref(entry->ctx);
+  bud_mem_free(entry);
+}
+
+
+int bud_sni_cache_get(bud_sni_cache_t* cache,
+                      const char* servername,
+                      size_t servername_len,
+                      bud_context_t** ctx,
+                      int* stale) {
+  bud_sni_cache_entry_t** pentry;
+  bud_sni_cache_entry_t* entry;
+  uint32_t hash;
+  uint64_t now;
+
+  hash = bud_hash_lower(BUD_HASH_INIT, servername, servername_len);
+  pentry = bud_sni_cache_find(cache, servername, servername_len, hash);
+  entry = *pentry;
+  if (entry == NULL)
+    return 0;
+
+  /* Past the grace period too */
+  now = uv_now(cache->config->loop);
+  if (entry->stale <= now) {
+    bud_sni_cache_remove(cache, pentry);
+    return 0;
+  }
+  *stale = entry->expire <= now;
+
+  /* Move to the LRU head */
+  QUEUE_REMOVE(&entry->member);
+  QUEUE_INSERT_HEAD(&cache->lru, &entry->member);
+
+  *ctx = entry->ctx;
+  return 1;
+}
+
+
+void bud_sni_cache_set(bud_sni_cache_t* cache,
+                       const char* servername,
+                       size_t servername_len,
+                       bud_context_t* ctx,
+                       int ttl,
+                       int stale_ttl) {
+  bud_sni_cache_entry_t** pentry;
+  bud_sni_cache_entry_t* entry;
+  uint32_t hash;
+  uint64_t now;
+  QUEUE* q;
+
+  bud_sni_cache_ttl(cache, ctx, &ttl, &stale_ttl);
+
+  /* Replace existing entry */
+  hash = bud_hash_lower(BUD_HASH_INIT, servername, servername_len);
+  pentry = bud_sni_cache_find(cache, servername, servername_len, hash);
+  if (*pentry != NULL)
+    bud_sni_cache_remove(cache, pentry);
+
+  if ((ttl == 0 && stale_ttl == 0) || cache->max == 0)
+    return;
+
+  /* Evict least recently used */
+  if (cache->count >= cache->max) {
+    q = QUEUE_PREV(&cache->lru);
+    entry = QUEUE_DATA(q, bud_sni_cache_entry_t, member);
+    bud_sni_cache_remove(cache,
+                         bud_sni_cache_find(cache,
+                                            entry->servername,
+                                            entry->servername_len,
+                                            entry->hash));
+  }
+
+  entry = bud_mem_alloc(kBudMemCaches, sizeof(*entry) + servername_len);
+  if (entry == NULL)
+    return;
+
+  now = uv_now(cache->config->loop);
+  entry->hash = hash;
+  entry->expire = now + (uint64_t) ttl * 1000;
+  entry->stale = entry->expire + (uint64_t) stale_ttl * 1000;
+  entry->ctx = ctx;
+  if (ctx != NULL)
+    bud_sni_context_ref(ctx);
+  entry->servername_len = servername_len;
+  memcpy(entry->servername, servername, servername_len);
+  entry->servername[servername_len] = '\0';
+
+  pentry = &cache->buckets[hash & (cache->bucket_count - 1)];
+  entry->next = *pentry;
+  *pentry = entry;
+  QUEUE_INSERT_HEAD(&cache->lru, &entry->member);
+  cache->count++;
+}
+
+
+void bud_sni_cache_ttl(bud_sni_cache_t* cache,
+                       bud_context_t* ctx,
+                       int* ttl,
+                       int* stale_ttl) {
+  /* Backend's `Cache-Control` wins over the config */
+  if (*ttl == -1 && ctx == NULL)
+    *ttl = cache->config->sni.cache.negative_ttl;
+  else if (*ttl == -1)
+    *ttl = cache->config->sni.cache.ttl;
+  if (*stale_ttl == -1)
+    *stale_ttl = cache->config->sni.cache.stale_ttl;
+}
+
+
+bud_sni_pending_t** bud_sni_cache_pending_find(bud_sni_cache_t* cache,
+                                               const char* servername,
+                                               size_t servername_len,
+                                               uint32_t hash) {
+  bud_sni_pending_t** ppending;
+
+  ppending = &cache->pending[hash & (cache->bucket_count - 1)];
+  for (; *ppending != NULL; ppending = &(*ppending)->next) {
+    if ((*ppending)->hash == hash &&
+        (*ppending)->servername_len == servername_len &&
+        strncasecmp((*ppending)->servername,
+                    servername,
+                    servername_len) == 0) {
+      break;
+    }
+  }
+
+  return ppending;
+}
+
+
+bud_sni_pending_t* bud_sni_cache_pending_get(bud_sni_cache_t* cache,
+                                             const char* servername,
+                                             size_t servername_len) {
+  return *bud_sni_cache_pending_find(
+      cache,
+      servername,
+      servername_len,
+      bud_hash_lower(BUD_HASH_INIT, servername, servername_len));
+}
+
+
+bud_sni_pending_t* bud_sni_cache_pending_new(bud_sni_cache_t* cache,
+                                             const char* servername,
+                                             size_t servername_len,
+                                             bud_error_t* err) {
+  bud_sni_pending_t** ppending;
+  bud_sni_pending_t* pending;
+  uint32_t hash;
+
+  hash = bud_hash_lower(BUD_HASH_INIT, servername, servername_len);
+  ppending = bud_sni_cache_pending_find(cache,
+                                        servername,
+                                        servername_len,
+                                        hash);
+  ASSERT(*ppending == NULL, "Duplicate pending SNI request");
+
+  pending = bud_mem_alloc(kBudMemCaches, sizeof(*pending) + servername_len);
+  if (pending == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_sni_pending_t");
+    return NULL;
+  }
+
+  pending->hash = hash;
+  pending->req = NULL;
+  pending->lookup = NULL;
+  pending->file = NULL;
+  QUEUE_INIT(&pending->waiters);
+  pending->servername_len = servername_len;
+  memcpy(pending->servername, servername, servername_len);
+  pending->servername[servername_len] = '\0';
+
+  pending->next = NULL;
+  *ppending = pending;
+
+  *err = bud_ok();
+  return pending;
+}
+
+
+void bud_sni_cache_pending_free(bud_sni_cache_t* cache,
+                                bud_sni_pending_t* pending) {
+  bud_sni_pending_t** ppending;
+
+  ppending = bud_sni_cache_pending_find(cache,
+                                        pending->servername,
+                                        pending->servername_len,
+                                        pending->hash);
+  ASSERT(*ppending == pending, "Pending SNI request not found");
+  *ppending = pending->next;
+  bud_mem_free(pending);
+}
@@ -0,0 +1,113 @@
+#ifndef SRC_SNI_CACHE_H_
+#define SRC_SNI_CACHE_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t */
+
+#include "config.h"
+#include "error.h"
+#include "queue.h"
+
+typedef struct bud_sni_cache_s bud_sni_cache_t;
+typedef struct bud_sni_cache_entry_s bud_sni_cache_entry_t;
+typedef struct bud_sni_pending_s bud_sni_pending_t;
+
+/* Forward declarations */
+struct bud_http_request_s;
+struct bud_lookup_req_s;
+struct bud_sni_file_s;
+
+struct bud_sni_cache_entry_s {
+  QUEUE member;
+  bud_sni_cache_entry_t* next;
+  uint32_t hash;
+
+  /* Fresh until `expire`, then served while revalidated until `stale` */
+  uint64_t expire;
+  uint64_t stale;
+
+  /* NULL - negative entry (SNI backend responded with 404) */
+  bud_context_t* ctx;
+
+  size_t servername_len;
+  char servername[1];
+};
+
+/* SNI backend request in flight, shared by all clients with the same name */
+struct bud_sni_pending_s {
+  bud_sni_pending_t* next;
+  uint32_t hash;
+  struct bud_http_request_s* req;
+
+  /* Or a lookup over the binary protocol, see lookup.h */
+  struct bud_lookup_req_s* lookup;
+
+  /* Or a read of `sni.directory` file instead, see bud_sni_file_read() */
+  struct bud_sni_file_s* file;
+
+  /* Clients waiting for the response, see bud_client_t.sni_member */
+  QUEUE waiters;
+
+  size_t servername_len;
+  char servername[1];
+};
+
+/* Per-worker LRU cache of contexts built from SNI backend responses */
+struct bud_sni_cache_s {
+  bud_config_t* config;
+
+  /* Most recently used entries first */
+  QUEUE lru;
+  size_t count;
+  size_t max;
+
+  uint32_t bucket_count;
+  bud_sni_cache_entry_t** buckets;
+  bud_sni_pending_t** pending;
+};
+
+bud_sni_cache_t* bud_sni_cache_new(bud_config_t* config, bud_error_t* err);
+void bud_sni_cache_free(bud_sni_cache_t* cache);
+
+/* Drop all entries, clients keep their references to the contexts */
+void bud_sni_cache_flush(bud_sni_cache_t* cache);
+
+/*
+ * Returns non-zero on hit, `*ctx` is NULL for negative entries. Cache keeps
+ * its reference, use bud_sni_context_ref() to hold on to the context.
+ * `*stale` is set if the entry is past its ttl and should be refreshed.
+ */
+int bud_sni_cache_get(bud_sni_cache_t* cache,
+                      const char* servername,
+                      size_t servername_len,
+                      bud_context_t** ctx,
+                      int* stale);
+
+/*
+ * Takes a new reference to `ctx`. `ttl` and `stale_ttl` are in seconds,
+ * -1 - from config (e.g. backend's response had no `Cache-Control`).
+ */
+void bud_sni_cache_set(bud_sni_cache_t* cache,
+                       const char* servername,
+                       size_t servername_len,
+                       bud_context_t* ctx,
+                       int ttl,
+                       int stale_ttl);
+
+/* Replaces -1 `ttl`s with the ones from config */
+void bud_sni_cache_ttl(bud_sni_cache_t* cache,
+                       bud_context_t* ctx,
+                       int* ttl,
+                       int* stale_ttl);
+
+/* Returns request in flight for the servername, or NULL */
+bud_sni_pending_t* bud_sni_cache_pending_get(bud_sni_cache_t* cache,
+                                             const char* servername,
+                                             size_t servername_len);
+bud_sni_pending_t* bud_sni_cache_pending_new(bud_sni_cache_t* cache,
+                                             const char* servername,
+                                             size_t servername_len,
+                                             bud_error_t* err);
+void bud_sni_cache_pending_free(bud_sni_cache_t* cache,
+                                bud_sni_pending_t* pending);
+
+#endif  /* SRC_SNI_CACHE_H_ */
@@ -1,30 +1,107 @@
-#include <stdlib.h>  /* NULL */
-#include <string.h>  /* memset */
+#include <fcntl.h>  /* O_RDONLY */
+#include <stdint.h>  /* uint32_t, int64_t */
+#include <stdlib.h>  /* NULL, calloc, malloc, free */
+#include <string.h>  /* memcpy, memset, strlen, strstr */
+#include <time.h>  /* time */
 
+#include "uv.h"
 #include "openssl/err.h"
 #include "openssl/evp.h"
 #include "openssl/ssl.h"
 #include "parson.h"
 
+#include "sni.h"
+#include "backend.h"
+#include "cert-cache.h"
+#include "common.h"
+#include "disk-cache.h"
 #include "error.h"
 #include "config.h"
+#include "json-stream.h"
+#include "logger.h"
+#include "memstat.h"
+#include "ocsp.h"
+#include "shared-cache.h"
+
+/* Longest servername, the rest isn't saved */
+#define BUD_SNI_MAX_NAME 255
+
+/* Largest `sni.directory` file, a chain with a key is a few KB */
+#define BUD_SNI_MAX_FILE (1024 * 1024)
+
+/* Either a string or an array of strings (i.e. RSA and ECDSA) */
+const char* const bud_sni_extract[] = { "cert", "key", "ocsp", NULL };
+
+static size_t bud_sni_disk_key(const char* servername,
+                               size_t servername_len,
+                               char* key);
+static int bud_sni_is_pem(const char* str);
+static char* bud_sni_der(bud_json_stream_t* stream,
+                         const char* str,
+                         size_t len,
+                         size_t* size);
+static void bud_sni_der_free(bud_json_stream_t* stream,
+                             char* der,
+                             size_t size);
+static bud_error_t bud_sni_use_der_chain(bud_config_t* config,
+                                         bud_context_t* ctx,
+                                         bud_json_stream_t* stream,
+                                         const char* str,
+                                         size_t len,
+                                         int primary);
+static bud_error_t bud_sni_der_key(bud_config_t* config,
+                                   bud_json_stream_t* stream,
+                                   const char* str,
+                                   size_t len,
+                                   EVP_PKEY** key);
+static int bud_sni_pack(bud_json_stream_t* stream,
+                        uint32_t* lens,
+                        uv_buf_t* bufs);
+static bud_context_t* bud_sni_unpack(bud_config_t* config,
+                                     const char* data,
+                                     size_t size,
+                                     bud_error_t* err);
+static void bud_sni_ttls(int64_t expire,
+                         int64_t stale,
+                         int* ttl,
+                         int* stale_ttl);
+static void bud_sni_restore_shared(bud_config_t* config,
+                                   const char* key,
+                                   size_t key_len,
+                                   const bud_disk_record_t* rec);
+static int bud_sni_file_name_ok(const char* servername,
+                                size_t servername_len);
+static void bud_sni_file_open_cb(uv_fs_t* req);
+static void bud_sni_file_stat_cb(uv_fs_t* req);
+static void bud_sni_file_read_next(bud_sni_file_t* file);
+static void bud_sni_file_read_cb(uv_fs_t* req);
+static void bud_sni_file_close(bud_sni_file_t* file);
+static void bud_sni_file_close_cb(uv_fs_t* req);
+static void bud_sni_file_finish(bud_sni_file_t* file);
+static bud_context_t* bud_sni_file_context(bud_sni_file_t* file,
+                                           bud_error_t* err);
 
 
 bud_error_t bud_sni_from_json(bud_config_t* config,
                               struct json_value_t* json,
+                              bud_json_stream_t* stream,
                               bud_context_t* ctx) {
   int r;
+  int i;
+  int cert_count;
+  int key_count;
   JSON_Object* obj;
-  const char* cert_str;
-  const char* key_str;
+  const char* str;
+  size_t len;
   bud_error_t err;
+  bud_arena_t arena;
   BIO* bio;
   EVP_PKEY* key;
 
   obj = json_value_get_object(json);
-  cert_str = json_object_get_string(obj, "cert");
-  key_str = json_object_get_string(obj, "key");
-  if (obj == NULL || cert_str == NULL || key_str == NULL) {
+  cert_count = bud_json_stream_count(stream, "cert");
+  key_count = bud_json_stream_count(stream, "key");
+  if (obj == NULL || cert_count == 0 || key_count == 0) {
     err = bud_error_str(kBudErrJSONParse, "<SNI Response>");
     goto fatal;
   }
@@ -33,51 +110,850 @@ bud_error_t bud_sni_from_json(bud_config_t* config,
   memset(ctx, 0, sizeof(*ctx));
   ctx->ciphers = json_object_get_string(obj, "ciphers");
   ctx->ecdh = json_object_get_string(obj, "ecdh");
-  ctx->npn = json_object_get_array(obj, "npn");
+  ctx->release_buffers = config->frontend.release_buffers;
+  ctx->max_send_fragment = config->frontend.max_send_fragment;
 
-  err = bud_config_new_ssl_ctx(config, ctx);
+  /* NPN line is encoded right away, the list is needed only until then */
+  bud_arena_init(&arena);
+  ctx->npn = bud_config_read_strs(&arena, json_object_get_array(obj, "npn"));
+  if (arena.failed)
+    err = bud_error_str(kBudErrNoMem, "SNI npn");
+  else
+    err = bud_config_new_ssl_ctx(config, ctx);
+  ctx->npn = NULL;
+  bud_arena_destroy(&arena);
   if (!bud_is_ok(err))
     goto fatal;
 
-  bio = BIO_new_mem_buf((void*) cert_str, strlen(cert_str));
-  if (bio == NULL) {
-    err = bud_error_str(kBudErrNoMem, "BIO_new_mem_buf");
+  /* Multiple pairs (i.e. RSA and ECDSA) may be in the arrays */
+  for (i = 0; i < cert_count; i++) {
+    str = bud_json_stream_value(stream, "cert", i, &len);
+    if (stream->der || !bud_sni_is_pem(str)) {
+      err = bud_sni_use_der_chain(config, ctx, stream, str, len, i == 0);
+      if (!bud_is_ok(err))
+        goto fatal;
+      continue;
+    }
+
+    bio = BIO_new_mem_buf((void*) str, len);
+    if (bio == NULL) {
+      err = bud_error_str(kBudErrNoMem, "BIO_new_mem_buf");
+      goto fatal;
+    }
+
+    r = bud_context_use_certificate_chain(config, ctx, bio, i == 0);
+    BIO_free_all(bio);
+    if (!r) {
+      err = bud_error_str(kBudErrParseCert, "<SNI>");
+      goto fatal;
+    }
+  }
+
+  for (i = 0; i < key_count; i++) {
+    str = bud_json_stream_value(stream, "key", i, &len);
+    if (stream->der || !bud_sni_is_pem(str)) {
+      err = bud_sni_der_key(config, stream, str, len, &key);
+      if (!bud_is_ok(err))
+        goto fatal;
+    } else {
+      bio = BIO_new_mem_buf((void*) str, len);
+      if (bio == NULL) {
+        err = bud_error_str(kBudErrNoMem, "BIO_new_mem_buf");
+        goto fatal;
+      }
+
+      key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+      BIO_free_all(bio);
+      if (key == NULL) {
+        err = bud_error_str(kBudErrNoMem, "EVP_PKEY");
+        goto fatal;
+      }
+    }
+
+    r = SSL_CTX_use_PrivateKey(ctx->ctx, key);
+    EVP_PKEY_free(key);
+    if (!r) {
+      err = bud_error_str(kBudErrParseKey, "<SNI>");
+      goto fatal;
+    }
+  }
+  bud_context_compress_certs(config, ctx);
+
+  /* Servername's own backends, hosts are copied out of the response */
+  err = bud_backend_list_init_json(config,
+                                   &ctx->backends,
+                                   json_object_get_array(obj, "backends"));
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  /* OCSP response may ride along, sparing the handshake a stapling lookup */
+  if (config->stapling.enabled && bud_ocsp_sni_staple(ctx, stream) == 0)
+    bud_log(config, kBudLogDebug, "SNI response had a staple");
+
+  return bud_ok();
+
+fatal:
+  if (!bud_is_ok(err)) {
+    SSL_CTX_free(ctx->ctx);
+    ctx->ctx = NULL;
+  }
+  return err;
+}
+
+
+int bud_sni_is_pem(const char* str) {
+  /* There is no `-` in base64 */
+  return strstr(str, "-----BEGIN ") != NULL;
+}
+
+
+char* bud_sni_der(bud_json_stream_t* stream,
+                  const char* str,
+                  size_t len,
+                  size_t* size) {
+  char* der;
+
+  /* Binary lookups have it decoded already */
+  if (stream->der) {
+    *size = len;
+    return (char*) str;
+  }
+
+  der = malloc(bud_base64_decoded_size_fast(len));
+  if (der == NULL)
+    return NULL;
+  *size = bud_base64_decode(der, bud_base64_decoded_size_fast(len), str, len);
+  return der;
+}
+
+
+void bud_sni_der_free(bud_json_stream_t* stream, char* der, size_t size) {
+  /* Stream's own, it may still be saved */
+  if (stream->der)
+    return;
+
+  /* Don't leave key bytes around */
+  OPENSSL_cleanse(der, size);
+  free(der);
+}
+
+
+bud_error_t bud_sni_use_der_chain(bud_config_t* config,
+                                  bud_context_t* ctx,
+                                  bud_json_stream_t* stream,
+                                  const char* str,
+                                  size_t len,
+                                  int primary) {
+  STACK_OF(X509)* chain;
+  X509* x;
+  X509* ca;
+  char* der;
+  size_t size;
+  const unsigned char* p;
+  const unsigned char* end;
+  bud_error_t err;
+
+  /* Leaf certificate, then the intermediates, back to back */
+  der = bud_sni_der(stream, str, len, &size);
+  if (der == NULL)
+    return bud_error_str(kBudErrNoMem, "SNI DER cert");
+
+  x = NULL;
+  chain = NULL;
+  err = bud_error_str(kBudErrParseCert, "<SNI>");
+  p = (const unsigned char*) der;
+  end = p + size;
+  x = bud_cert_cache_x509(config->cert_cache, &p, end - p);
+  if (x == NULL)
+    goto fatal;
+
+  chain = sk_X509_new_null();
+  if (chain == NULL) {
+    err = bud_error_str(kBudErrNoMem, "SNI DER chain");
     goto fatal;
   }
+  while (p < end) {
+    ca = bud_cert_cache_x509(config->cert_cache, &p, end - p);
+    if (ca == NULL)
+      goto fatal;
+    if (!sk_X509_push(chain, ca)) {
+      X509_free(ca);
+      err = bud_error_str(kBudErrNoMem, "SNI DER chain");
+      goto fatal;
+    }
+  }
+  bud_sni_der_free(stream, der, size);
+
+  if (!bud_context_use_x509_chain(config, ctx, x, chain, primary))
+    return bud_error_str(kBudErrParseCert, "<SNI>");
+  return bud_ok();
+
+fatal:
+  bud_sni_der_free(stream, der, size);
+  if (x != NULL)
+    X509_free(x);
+  if (chain != NULL)
+    sk_X509_pop_free(chain, X509_free);
+  return err;
+}
+
+
+bud_error_t bud_sni_der_key(bud_config_t* config,
+                            bud_json_stream_t* stream,
+                            const char* str,
+                            size_t len,
+                            EVP_PKEY** key) {
+  char* der;
+  size_t size;
+
+  der = bud_sni_der(stream, str, len, &size);
+  if (der == NULL)
+    return bud_error_str(kBudErrNoMem, "SNI DER key");
+
+  *key = bud_cert_cache_key(config->cert_cache,
+                            (const unsigned char*) der,
+                            size);
+  bud_sni_der_free(stream, der, size);
+  if (*key == NULL)
+    return bud_error_str(kBudErrParseKey, "<SNI>");
+  return bud_ok();
+}
+
+
+bud_context_t* bud_sni_context_new(bud_config_t* config,
+                                   struct json_value_t* json,
+                                   bud_json_stream_t* stream,
+                                   bud_error_t* err) {
+  bud_context_t* ctx;
+  bud_mem_tag_t prev;
+
+  ctx = calloc(1, sizeof(*ctx));
+  if (ctx == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "SNI bud_context_t");
+    return NULL;
+  }
+
+  prev = bud_mem_scope(kBudMemSSLCtx);
+  *err = bud_sni_from_json(config, json, stream, ctx);
+  bud_mem_scope(prev);
+  if (!bud_is_ok(*err)) {
+    free(ctx);
+    return NULL;
+  }
+
+  /* These are pointing into the json, which won't outlive the call */
+  ctx->ciphers = NULL;
+  ctx->ecdh = NULL;
+  ctx->refcount = 1;
+  ctx->bandwidth = config->frontend.bandwidth.context;
+  ctx->quota.connections = config->frontend.quota.connections;
+  ctx->quota.handshakes = config->frontend.quota.handshakes;
+
+  return ctx;
+}
+
+
+void bud_sni_context_ref(bud_context_t* ctx) {
+  ctx->refcount++;
+}
+
+
+void bud_sni_context_unref(bud_context_t* ctx) {
+  ASSERT(ctx->refcount > 0, "SNI context refcount underflow");
+  if (--ctx->refcount != 0)
+    return;
+
+  bud_backend_list_free(&ctx->backends);
+  bud_context_free(ctx);
+  free(ctx);
+}
+
+
+size_t bud_sni_disk_key(const char* servername,
+                        size_t servername_len,
+                        char* key) {
+  size_t i;
+
+  /* Lookups are case-insensitive */
+  for (i = 0; i < servername_len; i++) {
+    key[i] = servername[i];
+    if (key[i] >= 'A' && key[i] <= 'Z')
+      key[i] += 'a' - 'A';
+  }
+  return servername_len;
+}
+
+
+int bud_sni_pack(bud_json_stream_t* stream, uint32_t* lens, uv_buf_t* bufs) {
+  const char* value;
+  size_t len;
+  int count;
+  int nlens;
+  int i;
+  int j;
+
+  /*
+   * Whether values are DER, for each extracted field: number of values and
+   * their lengths, then length of the rest of JSON (with NUL). Values and
+   * the rest follow.
+   */
+  count = 0;
+  nlens = 0;
+  bufs[count++] = uv_buf_init((char*) lens, 0);
+  lens[nlens++] = stream->der;
+  for (i = 0; bud_sni_extract[i] != NULL; i++) {
+    lens[nlens++] = bud_json_stream_count(stream, bud_sni_extract[i]);
+    for (j = 0; j < (int) lens[nlens - 1]; j++) {
+      value = bud_json_stream_value(stream, bud_sni_extract[i], j, &len);
+      lens[nlens++] = len;
+      bufs[count++] = uv_buf_init((char*) value, len);
+    }
+  }
+  lens[nlens++] = stream->rest_size + 1;
+  bufs[0].len = nlens * sizeof(lens[0]);
+  bufs[count++] = uv_buf_init(stream->rest, stream->rest_size + 1);
 
-  r = bud_context_use_certificate_chain(ctx, bio);
+  return count;
+}
+
+
+bud_context_t* bud_sni_unpack(bud_config_t* config,
+                              const char* data,
+                              size_t size,
+                              bud_error_t* err) {
+  bud_json_stream_t stream;
+  bud_context_t* ctx;
+  JSON_Value* json;
+  const char* start;
+  const char* end;
+  const char* p;
+  uint32_t der;
+  uint32_t count;
+  uint32_t len;
+  int i;
+
+  /* Lengths, then the data. Checksum is fine, but don't trust it blindly */
+  bud_json_stream_init(&stream, bud_sni_extract);
+  ctx = NULL;
+  json = NULL;
+  *err = bud_error_str(kBudErrJSONParse, "<saved SNI response>");
+  end = data + size;
+  if (size < sizeof(der))
+    goto done;
+  memcpy(&der, data, sizeof(der));
+  stream.der = der != 0;
+  data += sizeof(der);
+  start = data;
+  p = data;
+  for (i = 0; bud_sni_extract[i] != NULL; i++) {
+    if (end - p < (ssize_t) sizeof(count))
+      goto done;
+    memcpy(&count, p, sizeof(count));
+    if (count > BUD_JSON_STREAM_MAX_VALUES ||
+        end - p < (ssize_t) (sizeof(count) * (1 + count))) {
+      goto done;
+    }
+    p += sizeof(count) * (1 + count);
+  }
+  if (end - p < (ssize_t) sizeof(len))
+    goto done;
+  p += sizeof(len);
+
+  /* `p` walks the lengths, `data` the values */
+  data = p;
+  p = start;
+  for (i = 0; bud_sni_extract[i] != NULL; i++) {
+    memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+    for (; count > 0; count--) {
+      memcpy(&len, p, sizeof(len));
+      p += sizeof(len);
+      if (len > (size_t) (end - data))
+        goto done;
+      *err = bud_json_stream_add(&stream, bud_sni_extract[i], data, len);
+      if (!bud_is_ok(*err))
+        goto done;
+      data += len;
+    }
+  }
+
+  /* NUL-terminated rest of JSON */
+  memcpy(&len, p, sizeof(len));
+  if (len == 0 || len != (size_t) (end - data) || data[len - 1] != '\0') {
+    *err = bud_error_str(kBudErrJSONParse, "<saved SNI response>");
+    goto done;
+  }
+  json = json_parse_string(data);
+  if (json == NULL) {
+    *err = bud_error_str(kBudErrJSONParse, "<saved SNI response>");
+    goto done;
+  }
+
+  ctx = bud_sni_context_new(config, json, &stream, err);
+
+done:
+  if (json != NULL)
+    json_value_free(json);
+  bud_json_stream_destroy(&stream);
+  return ctx;
+}
+
+
+void bud_sni_ttls(int64_t expire, int64_t stale, int* ttl, int* stale_ttl) {
+  int64_t now;
+  int64_t fresh;
+
+  now = time(NULL);
+  fresh = expire > now ? expire : now;
+  *ttl = fresh - now;
+  *stale_ttl = stale - fresh;
+}
+
+
+void bud_sni_save(bud_config_t* config,
+                  const char* servername,
+                  size_t servername_len,
+                  bud_json_stream_t* stream,
+                  int ttl,
+                  int stale_ttl) {
+  uint32_t lens[ARRAY_SIZE(bud_sni_extract) *
+                (1 + BUD_JSON_STREAM_MAX_VALUES)];
+  uv_buf_t bufs[BUD_DISK_CACHE_MAX_BUFS];
+  char key[BUD_SNI_MAX_NAME];
+  size_t key_len;
+  int64_t now;
+  int count;
+
+  if (config->shared_cache.cache == NULL && config->disk_cache.cache == NULL)
+    return;
+  if (servername_len > sizeof(key))
+    return;
+
+  /* 404 is an empty record */
+  count = stream == NULL ? 0 : bud_sni_pack(stream, lens, bufs);
+  key_len = bud_sni_disk_key(servername, servername_len, key);
+  now = time(NULL);
+
+  /* Other workers pick it up from here instead of asking the backend */
+  if (config->shared_cache.cache != NULL) {
+    bud_shared_cache_put(config->shared_cache.cache,
+                         kBudSharedSNI,
+                         key,
+                         key_len,
+                         now + ttl,
+                         now + ttl + stale_ttl,
+                         bufs,
+                         count);
+  }
+  if (config->disk_cache.cache != NULL) {
+    bud_disk_cache_put(config->disk_cache.cache,
+                       kBudDiskSNI,
+                       key,
+                       key_len,
+                       now + ttl,
+                       now + ttl + stale_ttl,
+                       bufs,
+                       count);
+  }
+}
+
+
+int bud_sni_restore(bud_config_t* config,
+                    const char* servername,
+                    size_t servername_len,
+                    bud_context_t** ctx,
+                    int* ttl,
+                    int* stale_ttl) {
+  const bud_disk_record_t* rec;
+  char key[BUD_SNI_MAX_NAME];
+  size_t key_len;
+  char* data;
+  size_t len;
+  int64_t expire;
+  int64_t stale;
+  bud_error_t err;
+
+  if (servername_len > sizeof(key))
+    return 0;
+  key_len = bud_sni_disk_key(servername, servername_len, key);
+  *ctx = NULL;
+
+  /* Fetched by other worker, or restored by it from disk */
+  data = NULL;
+  if (config->shared_cache.cache != NULL) {
+    data = bud_shared_cache_get(config->shared_cache.cache,
+                                kBudSharedSNI,
+                                key,
+                                key_len,
+                                &len,
+                                &expire,
+                                &stale);
+  }
+  if (data != NULL) {
+    bud_sni_ttls(expire, stale, ttl, stale_ttl);
+
+    /* 404 */
+    if (len == 0) {
+      free(data);
+      return 1;
+    }
+
+    *ctx = bud_sni_unpack(config, data, len, &err);
+    free(data);
+    if (*ctx != NULL)
+      return 1;
+    goto failed;
+  }
+
+  if (config->disk_cache.cache == NULL)
+    return 0;
+  rec = bud_disk_cache_get(config->disk_cache.cache, kBudDiskSNI, key, key_len);
+  if (rec == NULL)
+    return 0;
+  bud_sni_ttls(rec->expire, rec->stale, ttl, stale_ttl);
+
+  /* 404 */
+  if (rec->data_len == 0) {
+    bud_sni_restore_shared(config, key, key_len, rec);
+    return 1;
+  }
+
+  *ctx = bud_sni_unpack(config,
+                        bud_disk_record_data(rec),
+                        rec->data_len,
+                        &err);
+  if (*ctx != NULL) {
+    bud_sni_restore_shared(config, key, key_len, rec);
+    return 1;
+  }
+
+failed:
+  /* Fetch it from the backend then */
+  bud_log(config,
+          kBudLogDebug,
+          "saved SNI response for \"%.*s\" is unusable: %d",
+          (int) servername_len,
+          servername,
+          err.code);
+  return 0;
+}
+
+
+void bud_sni_restore_shared(bud_config_t* config,
+                            const char* key,
+                            size_t key_len,
+                            const bud_disk_record_t* rec) {
+  uv_buf_t buf;
+
+  /* Let the rest of workers skip parsing the disk record */
+  if (config->shared_cache.cache == NULL)
+    return;
+  buf = uv_buf_init((char*) bud_disk_record_data(rec), rec->data_len);
+  bud_shared_cache_put(config->shared_cache.cache,
+                       kBudSharedSNI,
+                       key,
+                       key_len,
+                       rec->expire,
+                       rec->stale,
+                       &buf,
+                       1);
+}
+
+
+int bud_sni_file_name_ok(const char* servername, size_t servername_len) {
+  size_t i;
+  char c;
+
+  /* Hostname characters only, so that it stays inside of the directory */
+  if (servername_len == 0 ||
+      servername_len > BUD_SNI_MAX_NAME ||
+      servername[0] == '.') {
+    return 0;
+  }
+  for (i = 0; i < servername_len; i++) {
+    c = servername[i];
+    if (!((c >= 'a' && c <= 'z') ||
+          (c >= 'A' && c <= 'Z') ||
+          (c >= '0' && c <= '9') ||
+          c == '-' ||
+          c == '.' ||
+          c == '_')) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+bud_sni_file_t* bud_sni_file_read(bud_config_t* config,
+                                  const char* servername,
+                                  size_t servername_len,
+                                  bud_sni_file_cb cb,
+                                  void* data,
+                                  bud_error_t* err) {
+  bud_sni_file_t* file;
+  size_t dir_len;
+  char* p;
+  int r;
+
+  if (!bud_sni_file_name_ok(servername, servername_len)) {
+    *err = bud_error_num(kBudErrSNIFile, UV_EINVAL);
+    return NULL;
+  }
+
+  dir_len = strlen(config->sni.directory);
+  file = malloc(sizeof(*file) + dir_len + 1 + servername_len + 4);
+  if (file == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "bud_sni_file_t");
+    return NULL;
+  }
+
+  file->config = config;
+  file->cb = cb;
+  file->data = data;
+  file->fd = -1;
+  file->buf = NULL;
+  file->len = 0;
+  file->size = 0;
+  file->err = bud_ok();
+
+  /* `<directory>/<servername>.pem`, names are case-insensitive */
+  memcpy(file->path, config->sni.directory, dir_len);
+  p = file->path + dir_len;
+  *p++ = '/';
+  p += bud_sni_disk_key(servername, servername_len, p);
+  memcpy(p, ".pem", 5);
+
+  r = uv_fs_open(config->loop,
+                 &file->req,
+                 file->path,
+                 O_RDONLY,
+                 0,
+                 bud_sni_file_open_cb);
+  if (r != 0) {
+    free(file);
+    *err = bud_error_num(kBudErrSNIFile, r);
+    return NULL;
+  }
+
+  *err = bud_ok();
+  return file;
+}
+
+
+void bud_sni_file_open_cb(uv_fs_t* req) {
+  bud_sni_file_t* file;
+  int r;
+
+  file = container_of(req, bud_sni_file_t, req);
+  r = req->result;
+  uv_fs_req_cleanup(req);
+
+  /* No file - no such servername, cached as negative entry */
+  if (r == UV_ENOENT)
+    return bud_sni_file_finish(file);
+  if (r < 0) {
+    file->err = bud_error_num(kBudErrSNIFile, r);
+    return bud_sni_file_finish(file);
+  }
+
+  file->fd = r;
+  r = uv_fs_fstat(file->config->loop,
+                  &file->req,
+                  file->fd,
+                  bud_sni_file_stat_cb);
+  if (r != 0) {
+    file->err = bud_error_num(kBudErrSNIFile, r);
+    bud_sni_file_close(file);
+  }
+}
+
+
+void bud_sni_file_stat_cb(uv_fs_t* req) {
+  bud_sni_file_t* file;
+  int r;
+
+  file = container_of(req, bud_sni_file_t, req);
+  r = req->result;
+  file->size = req->statbuf.st_size;
+  uv_fs_req_cleanup(req);
+
+  if (r < 0) {
+    file->err = bud_error_num(kBudErrSNIFile, r);
+    return bud_sni_file_close(file);
+  }
+  if (file->size == 0 || file->size > BUD_SNI_MAX_FILE) {
+    file->err = bud_error_num(kBudErrSNIFile, UV_EFBIG);
+    return bud_sni_file_close(file);
+  }
+
+  file->buf = malloc(file->size);
+  if (file->buf == NULL) {
+    file->err = bud_error_str(kBudErrNoMem, "SNI file");
+    return bud_sni_file_close(file);
+  }
+
+  bud_sni_file_read_next(file);
+}
+
+
+void bud_sni_file_read_next(bud_sni_file_t* file) {
+  uv_buf_t buf;
+  int r;
+
+  buf = uv_buf_init(file->buf + file->len, file->size - file->len);
+  r = uv_fs_read(file->config->loop,
+                 &file->req,
+                 file->fd,
+                 &buf,
+                 1,
+                 file->len,
+                 bud_sni_file_read_cb);
+  if (r != 0) {
+    file->err = bud_error_num(kBudErrSNIFile, r);
+    bud_sni_file_close(file);
+  }
+}
+
+
+void bud_sni_file_read_cb(uv_fs_t* req) {
+  bud_sni_file_t* file;
+  ssize_t r;
+
+  file = container_of(req, bud_sni_file_t, req);
+  r = req->result;
+  uv_fs_req_cleanup(req);
+
+  if (r < 0) {
+    file->err = bud_error_num(kBudErrSNIFile, r);
+    return bud_sni_file_close(file);
+  }
+
+  /* Truncated after the stat, parse what is there */
+  file->len += r;
+  if (r == 0 || file->len == file->size)
+    return bud_sni_file_close(file);
+
+  bud_sni_file_read_next(file);
+}
+
+
+void bud_sni_file_close(bud_sni_file_t* file) {
+  int r;
+
+  r = uv_fs_close(file->config->loop,
+                  &file->req,
+                  file->fd,
+                  bud_sni_file_close_cb);
+
+  /* Only invoked from the callbacks, so `cb` can't run synchronously */
+  if (r != 0)
+    bud_sni_file_finish(file);
+}
+
+
+void bud_sni_file_close_cb(uv_fs_t* req) {
+  bud_sni_file_t* file;
+
+  file = container_of(req, bud_sni_file_t, req);
+  uv_fs_req_cleanup(req);
+  bud_sni_file_finish(file);
+}
+
+
+void bud_sni_file_finish(bud_sni_file_t* file) {
+  bud_context_t* ctx;
+  bud_mem_tag_t prev;
+
+  ctx = NULL;
+  if (bud_is_ok(file->err) && file->buf != NULL) {
+    prev = bud_mem_scope(kBudMemSSLCtx);
+    ctx = bud_sni_file_context(file, &file->err);
+    bud_mem_scope(prev);
+    if (!bud_is_ok(file->err)) {
+      bud_log(file->config,
+              kBudLogWarning,
+              "failed to load SNI file \"%s\": %d",
+              file->path,
+              file->err.code);
+    }
+  }
+
+  /* Don't leave key bytes around */
+  if (file->buf != NULL) {
+    OPENSSL_cleanse(file->buf, file->size);
+    free(file->buf);
+  }
+
+  file->cb(file, ctx, file->err);
+  if (ctx != NULL)
+    bud_sni_context_unref(ctx);
+  free(file);
+}
+
+
+bud_context_t* bud_sni_file_context(bud_sni_file_t* file, bud_error_t* err) {
+  bud_config_t* config;
+  bud_context_t* ctx;
+  BIO* bio;
+  EVP_PKEY* key;
+  int r;
+
+  config = file->config;
+  ctx = calloc(1, sizeof(*ctx));
+  if (ctx == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "SNI bud_context_t");
+    return NULL;
+  }
+
+  /* `ciphers`, `ecdh` and `npn` are the frontend's */
+  ctx->release_buffers = config->frontend.release_buffers;
+  ctx->max_send_fragment = config->frontend.max_send_fragment;
+  *err = bud_config_new_ssl_ctx(config, ctx);
+  if (!bud_is_ok(*err))
+    goto failed_ssl_ctx;
+
+  /* Certificate with its intermediates, and the key, in any order */
+  bio = BIO_new_mem_buf(file->buf, file->len);
+  if (bio == NULL) {
+    *err = bud_error_str(kBudErrNoMem, "BIO_new_mem_buf");
+    goto fatal;
+  }
+  r = bud_context_use_certificate_chain(config, ctx, bio, 1);
   BIO_free_all(bio);
   if (!r) {
-    err = bud_error_str(kBudErrParseCert, "<SNI>");
+    *err = bud_error_str(kBudErrParseCert, file->path);
     goto fatal;
   }
 
-  bio = BIO_new_mem_buf((void*) key_str, strlen(key_str));
+  bio = BIO_new_mem_buf(file->buf, file->len);
   if (bio == NULL) {
-    err = bud_error_str(kBudErrNoMem, "BIO_new_mem_buf");
+    *err = bud_error_str(kBudErrNoMem, "BIO_new_mem_buf");
     goto fatal;
   }
-
   key = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
   BIO_free_all(bio);
-  if (key == NULL) {
-    err = bud_error_str(kBudErrNoMem, "EVP_PKEY");
+  r = key != NULL && SSL_CTX_use_PrivateKey(ctx->ctx, key);
+  if (key != NULL)
+    EVP_PKEY_free(key);
+  if (!r) {
+    *err = bud_error_str(kBudErrParseKey, file->path);
     goto fatal;
   }
+  bud_context_compress_certs(config, ctx);
 
-  r = SSL_CTX_use_PrivateKey(ctx->ctx, key);
-  EVP_PKEY_free(key);
-  if (!r) {
-    err = bud_error_str(kBudErrParseKey, "<SNI>");
+  /* Default backends */
+  *err = bud_backend_list_init(config, &ctx->backends, NULL, 1);
+  if (!bud_is_ok(*err))
     goto fatal;
-  }
 
-  return bud_ok();
+  ctx->refcount = 1;
+  return ctx;
 
 fatal:
-  if (!bud_is_ok(err)) {
-    SSL_CTX_free(ctx->ctx);
-    ctx->ctx = NULL;
-  }
-  return err;
+  bud_context_free(ctx);
+
+failed_ssl_ctx:
+  free(ctx);
+  return NULL;
 }
@@ -1,13 +1,91 @@
 #ifndef SRC_SNI_H_
 #define SRC_SNI_H_
 
+#include "uv.h"
 #include "parson.h"
 
 #include "error.h"
 #include "config.h"
+#include "json-stream.h"
 
+/* Members of SNI response extracted by the http pool, `extract` there */
+extern const char* const bud_sni_extract[];
+
+/* `cert` and `key` are taken from `stream`, the rest from `json` */
 bud_error_t bud_sni_from_json(bud_config_t* config,
                               struct json_value_t* json,
+                              bud_json_stream_t* stream,
                               bud_context_t* ctx);
 
+/*
+ * Heap-allocated context, shared between clients and the SNI cache.
+ * Starts with one reference owned by the caller.
+ */
+bud_context_t* bud_sni_context_new(bud_config_t* config,
+                                   struct json_value_t* json,
+                                   bud_json_stream_t* stream,
+                                   bud_error_t* err);
+void bud_sni_context_ref(bud_context_t* ctx);
+void bud_sni_context_unref(bud_context_t* ctx);
+
+typedef struct bud_sni_file_s bud_sni_file_t;
+typedef void (*bud_sni_file_cb)(bud_sni_file_t* file,
+                                bud_context_t* ctx,
+                                bud_error_t err);
+
+/* `sni.directory` lookup in flight, see bud_sni_file_read() */
+struct bud_sni_file_s {
+  uv_fs_t req;
+  bud_config_t* config;
+  bud_sni_file_cb cb;
+  void* data;
+
+  uv_file fd;
+  char* buf;
+  size_t len;
+  size_t size;
+  bud_error_t err;
+
+  char path[1];
+};
+
+/*
+ * Reads `<sni.directory>/<servername>.pem` (certificate chain and the key)
+ * through the loop's thread pool and builds a context out of it. `cb` gets
+ * NULL `ctx` if there is no such file, otherwise the reference is held
+ * only for the duration of the call. Reads can't be cancelled, `cb` is
+ * always invoked.
+ */
+bud_sni_file_t* bud_sni_file_read(bud_config_t* config,
+                                  const char* servername,
+                                  size_t servername_len,
+                                  bud_sni_file_cb cb,
+                                  void* data,
+                                  bud_error_t* err);
+
+/*
+ * Shared and disk caches of SNI responses (see shared-cache.h and
+ * disk-cache.h), no-op if both are disabled. `stream` is the response's,
+ * NULL - 404. `ttl`s are in seconds.
+ */
+void bud_sni_save(bud_config_t* config,
+                  const char* servername,
+                  size_t servername_len,
+                  bud_json_stream_t* stream,
+                  int ttl,
+                  int stale_ttl);
+
+/*
+ * Builds context from the saved response, returns non-zero on success.
+ * Shared cache is looked up first, disk records are copied into it.
+ * `*ctx` is NULL for 404, otherwise it has one reference owned by the
+ * caller. `ttl`s are what is left of them.
+ */
+int bud_sni_restore(bud_config_t* config,
+                    const char* servername,
+                    size_t servername_len,
+                    bud_context_t** ctx,
+                    int* ttl,
+                    int* stale_ttl);
+
 #endif  /* SRC_SNI_H_ */
@@ -0,0 +1,135 @@
+#include <errno.h>  /* errno, EINTR */
+#include <fcntl.h>  /* open, fcntl, O_TMPFILE */
+#include <limits.h>  /* PATH_MAX */
+#include <stdio.h>  /* snprintf */
+#include <stdlib.h>  /* malloc, free, mkstemp */
+#include <unistd.h>  /* close, unlink, pread, pwrite, ftruncate */
+
+#include "spill.h"
+
+static int bud_spill_open(const char* dir);
+
+
+bud_spill_t* bud_spill_new(const char* dir, uint64_t cap) {
+  bud_spill_t* spill;
+  int fd;
+  int err;
+
+  fd = bud_spill_open(dir);
+  if (fd == -1)
+    return NULL;
+
+  spill = malloc(sizeof(*spill));
+  if (spill == NULL) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+
+  spill->fd = fd;
+  spill->cap = cap;
+  spill->head = 0;
+  spill->size = 0;
+  return spill;
+}
+
+
+int bud_spill_open(const char* dir) {
+  char path[PATH_MAX];
+  int fd;
+  int err;
+
+#ifdef O_TMPFILE
+  /* Never has a name, nothing is left behind by a crash */
+  fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd != -1)
+    return fd;
+#endif  /* O_TMPFILE */
+
+  if (snprintf(path, sizeof(path), "%s/bud-spill.XXXXXX", dir) >=
+      (int) sizeof(path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  fd = mkstemp(path);
+  if (fd == -1)
+    return -1;
+  unlink(path);
+
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+
+void bud_spill_free(bud_spill_t* spill) {
+  if (spill == NULL)
+    return;
+
+  close(spill->fd);
+  free(spill);
+}
+
+
+int bud_spill_write(bud_spill_t* spill, const char* data, size_t size) {
+  uint64_t off;
+  size_t chunk;
+  ssize_t r;
+
+  if (spill->size + size > spill->cap)
+    return -1;
+
+  /* Wraps around at `cap`, at most two pieces */
+  off = (spill->head + spill->size) % spill->cap;
+  while (size > 0) {
+    chunk = size;
+    if (chunk > spill->cap - off)
+      chunk = spill->cap - off;
+
+    do
+      r = pwrite(spill->fd, data, chunk, off);
+    while (r == -1 && errno == EINTR);
+    if (r <= 0)
+      return -1;
+
+    data += r;
+    size -= r;
+    spill->size += r;
+    off = (off + r) % spill->cap;
+  }
+  return 0;
+}
+
+
+int bud_spill_read(bud_spill_t* spill, char* out, size_t size) {
+  ssize_t r;
+
+  if (size > spill->size)
+    size = spill->size;
+  if (size > spill->cap - spill->head)
+    size = spill->cap - spill->head;
+  if (size == 0)
+    return 0;
+
+  do
+    r = pread(spill->fd, out, size, spill->head);
+  while (r == -1 && errno == EINTR);
+  if (r <= 0)
+    return -1;
+
+  spill->head = (spill->head + r) % spill->cap;
+  spill->size -= r;
+
+  /* Start over, the pages of tmpfs are freed */
+  if (spill->size == 0) {
+    spill->head = 0;
+    if (ftruncate(spill->fd, 0) != 0)
+      return -1;
+  }
+  return r;
+}
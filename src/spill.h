@@ -0,0 +1,33 @@
+#ifndef SRC_SPILL_H_
+#define SRC_SPILL_H_
+
+#include <stdint.h>  /* uint64_t */
+#include <stdlib.h>  /* size_t */
+
+typedef struct bud_spill_s bud_spill_t;
+
+/*
+ * FIFO of a client's backend data in an unlinked file of `backend.spill.dir`,
+ * used as a ring of `cap` bytes. Emptied file is truncated, so that tmpfs
+ * gives its pages back between the bursts.
+ */
+struct bud_spill_s {
+  int fd;
+  uint64_t cap;
+
+  /* Offset of the oldest byte, and bytes stored from it on */
+  uint64_t head;
+  uint64_t size;
+};
+
+/* NULL on failure, `errno` has the reason */
+bud_spill_t* bud_spill_new(const char* dir, uint64_t cap);
+void bud_spill_free(bud_spill_t* spill);
+
+/* Appends all of `data`, -1 if it doesn't fit or on error */
+int bud_spill_write(bud_spill_t* spill, const char* data, size_t size);
+
+/* Oldest bytes, up to `size`, into `out`. Returns their number, or -1 */
+int bud_spill_read(bud_spill_t* spill, char* out, size_t size);
+
+#endif  /* SRC_SPILL_H_ */
@@ -0,0 +1,68 @@
+#include <stddef.h>  /* offsetof */
+#include <string.h>  /* memset */
+#ifdef __linux__
+# include <netinet/in.h>  /* IPPROTO_TCP */
+# include <netinet/tcp.h>  /* TCP_INFO, tcp_info */
+# include <sys/socket.h>  /* getsockopt, socklen_t */
+#endif  /* __linux__ */
+
+#include "uv.h"
+
+#include "tcp-info.h"
+
+#if defined(__linux__) && defined(TCP_INFO)
+
+typedef struct bud_tcp_info_linux_s bud_tcp_info_linux_t;
+
+/*
+ * libc's `struct tcp_info` stops at `tcpi_total_retrans`, the rest is laid
+ * out as in linux/tcp.h (which conflicts with netinet/tcp.h). Older kernels
+ * just fill less of it, see `len` below.
+ */
+struct bud_tcp_info_linux_s {
+  struct tcp_info base;
+  uint64_t pacing_rate;
+  uint64_t max_pacing_rate;
+  uint64_t bytes_acked;
+  uint64_t bytes_received;
+  uint32_t segs_out;
+  uint32_t segs_in;
+  uint32_t notsent_bytes;
+  uint32_t min_rtt;
+  uint32_t data_segs_in;
+  uint32_t data_segs_out;
+  uint64_t delivery_rate;
+};
+
+#endif  /* __linux__ && TCP_INFO */
+
+
+int bud_tcp_info_sample(uv_tcp_t* tcp, bud_tcp_info_t* info) {
+#if defined(__linux__) && defined(TCP_INFO)
+  bud_tcp_info_linux_t raw;
+  socklen_t len;
+  uv_os_fd_t fd;
+
+  if (uv_fileno((uv_handle_t*) tcp, &fd) != 0)
+    return -1;
+
+  memset(&raw, 0, sizeof(raw));
+  len = sizeof(raw);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &raw, &len) != 0)
+    return -1;
+  if (len < sizeof(raw.base))
+    return -1;
+
+  info->rtt = raw.base.tcpi_rtt;
+  info->rttvar = raw.base.tcpi_rttvar;
+  info->retrans = raw.base.tcpi_total_retrans;
+  info->cwnd = raw.base.tcpi_snd_cwnd;
+  info->delivery_rate = 0;
+  if (len >= offsetof(bud_tcp_info_linux_t, delivery_rate) + 8)
+    info->delivery_rate = raw.delivery_rate;
+  return 0;
+#else  /* !(__linux__ && TCP_INFO) */
+  memset(info, 0, sizeof(*info));
+  return -1;
+#endif  /* __linux__ && TCP_INFO */
+}
@@ -0,0 +1,29 @@
+#ifndef SRC_TCP_INFO_H_
+#define SRC_TCP_INFO_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t */
+
+#include "uv.h"
+
+typedef struct bud_tcp_info_s bud_tcp_info_t;
+
+/* Kernel's view of the connection, see `metrics.tcp_info` */
+struct bud_tcp_info_s {
+  /* Smoothed round-trip time and its variance, in microseconds */
+  uint32_t rtt;
+  uint32_t rttvar;
+
+  /* Segments retransmitted since the connection was opened */
+  uint32_t retrans;
+
+  /* Congestion window, in segments */
+  uint32_t cwnd;
+
+  /* Bytes per second of the recent deliveries, 0 - before Linux 4.9 */
+  uint64_t delivery_rate;
+};
+
+/* `getsockopt(TCP_INFO)` of the handle, -1 with no socket (or not on Linux) */
+int bud_tcp_info_sample(uv_tcp_t* tcp, bud_tcp_info_t* info);
+
+#endif  /* SRC_TCP_INFO_H_ */
@@ -0,0 +1,504 @@
+#include <stdlib.h>  /* calloc, free */
+#include <unistd.h>  /* close, dup */
+
+#include "uv.h"
+#include "openssl/err.h"
+
+#include "threads.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "client.h"
+#include "logger.h"
+#include "queue.h"
+#include "preload.h"
+#include "server.h"
+#include "worker.h"
+
+static void bud_thread_main(void* arg);
+static bud_error_t bud_thread_init(bud_thread_t* t);
+static void bud_thread_drain_cb(uv_async_t* handle, int status);
+static void bud_thread_drain_timer_cb(uv_timer_t* handle, int status);
+static bud_error_t bud_steals_init(bud_config_t* config);
+static void bud_steals_free(bud_config_t* config);
+static bud_error_t bud_steal_open(bud_config_t* config, bud_steal_t* steal);
+static void bud_steal_close(bud_config_t* config);
+static void bud_steal_async_cb(uv_async_t* handle, int status);
+static int bud_steal_pop(bud_steal_t* steal, int head, bud_steal_item_t* item);
+static void bud_steal_flush(bud_config_t* config);
+
+
+bud_error_t bud_threads_start(bud_config_t* config) {
+  bud_thread_t* t;
+  bud_error_t err;
+  int i;
+  int r;
+
+  if (config->thread_count <= 1)
+    return bud_ok();
+
+  config->threads = calloc(config->thread_count - 1,
+                           sizeof(*config->threads));
+  if (config->threads == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_thread_t");
+
+  /* OpenSSL 1.0.1 needs these for as long as other threads are running */
+  err = bud_preload_locks_init();
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  err = bud_steals_init(config);
+  if (!bud_is_ok(err)) {
+    bud_preload_locks_destroy();
+    goto fatal;
+  }
+
+  /* Start them one by one, so that they load the config file in turn */
+  for (i = 0; i < config->thread_count - 1; i++) {
+    t = &config->threads[i];
+    t->parent = config;
+    t->index = i + 1;
+
+    if (uv_sem_init(&t->ready, 0) != 0) {
+      err = bud_error_str(kBudErrNoMem, "thread semaphore");
+      break;
+    }
+
+    r = uv_thread_create(&t->thread, bud_thread_main, t);
+    if (r != 0) {
+      uv_sem_destroy(&t->ready);
+      err = bud_error_num(kBudErrThreadCreate, r);
+      break;
+    }
+    uv_sem_wait(&t->ready);
+    uv_sem_destroy(&t->ready);
+    config->thread_started++;
+
+    err = t->err;
+    if (!bud_is_ok(err))
+      break;
+  }
+
+  if (bud_is_ok(err)) {
+    bud_log(config,
+            kBudLogInfo,
+            "started %d more event loop threads",
+            config->thread_count - 1);
+    return bud_ok();
+  }
+
+  bud_threads_stop(config);
+  return err;
+
+fatal:
+  free(config->threads);
+  config->threads = NULL;
+  return err;
+}
+
+
+void bud_threads_drain(bud_config_t* config) {
+  bud_thread_t* t;
+  int i;
+
+  for (i = 0; i < config->thread_started; i++) {
+    t = &config->threads[i];
+
+    /* Failed ones are exiting already */
+    if (!bud_is_ok(t->err) || t->drain_sent)
+      continue;
+    t->drain_sent = 1;
+    uv_async_send(&t->drain);
+  }
+
+  /* Nobody else will take them now, see bud_worker_drain() */
+  if (config->draining)
+    bud_steal_flush(config);
+}
+
+
+void bud_threads_stop(bud_config_t* config) {
+  int i;
+
+  if (config->threads == NULL)
+    return;
+
+  bud_threads_drain(config);
+  for (i = 0; i < config->thread_started; i++)
+    uv_thread_join(&config->threads[i].thread);
+
+  bud_steals_free(config);
+  bud_preload_locks_destroy();
+  free(config->threads);
+  config->threads = NULL;
+  config->thread_started = 0;
+}
+
+
+void bud_thread_main(void* arg) {
+  bud_thread_t* t;
+
+  t = arg;
+  t->err = bud_thread_init(t);
+  uv_sem_post(&t->ready);
+  if (!bud_is_ok(t->err))
+    goto done;
+
+  uv_run(t->loop, UV_RUN_DEFAULT);
+
+  /* Same as main() does, the process is about to exit */
+  bud_steal_close(t->config);
+  bud_server_free(t->config);
+  uv_run(t->loop, UV_RUN_ONCE);
+  bud_config_free(t->config);
+  t->config = NULL;
+
+done:
+  /* Error queue of this thread */
+  ERR_remove_thread_state(NULL);
+}
+
+
+bud_error_t bud_thread_init(bud_thread_t* t) {
+  bud_config_t* parent;
+  bud_config_t* config;
+  bud_error_t err;
+  int r;
+
+  parent = t->parent;
+  t->loop = uv_loop_new();
+  if (t->loop == NULL)
+    return bud_error_str(kBudErrNoMem, "thread loop");
+
+  config = bud_config_load(t->loop, parent->path, &err);
+  if (config == NULL)
+    return err;
+
+  /* Maps parent's caches (if any), doesn't spawn anything on its own */
+  config->is_worker = parent->is_worker;
+  config->thread_parent = parent;
+  config->thread_count = 1;
+  config->load_threads = 0;
+  err = bud_config_init(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  err = bud_server_new(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  r = uv_async_init(t->loop, &t->drain, bud_thread_drain_cb);
+  if (r != 0) {
+    err = bud_error_num(kBudErrThreadAsync, r);
+    goto fatal;
+  }
+  uv_unref((uv_handle_t*) &t->drain);
+
+  r = uv_timer_init(t->loop, &t->drain_timer);
+  if (r != 0) {
+    err = bud_error_num(kBudErrThreadAsync, r);
+    goto fatal;
+  }
+
+  /* Last, nothing can fail after others can wake us up */
+  if (parent->steals != NULL) {
+    err = bud_steal_open(config, &parent->steals[t->index]);
+    if (!bud_is_ok(err))
+      goto fatal;
+  }
+
+  t->config = config;
+  bud_log(config, kBudLogDebug, "thread %d listening", t->index);
+  return bud_ok();
+
+fatal:
+  bud_server_free(config);
+  bud_config_free(config);
+  return err;
+}
+
+
+void bud_thread_drain_cb(uv_async_t* handle, int status) {
+  bud_thread_t* t;
+  bud_config_t* config;
+
+  t = container_of(handle, bud_thread_t, drain);
+  config = t->config;
+  if (config->draining)
+    return;
+
+  bud_log(config,
+          kBudLogInfo,
+          "thread %d draining, clients: %d",
+          t->index,
+          (int) config->client_slab.used_count);
+  config->draining = 1;
+  bud_server_free(config);
+  bud_steal_flush(config);
+
+  /* Don't wait for idle clients forever */
+  if (config->drain_timeout > 0) {
+    uv_timer_start(&t->drain_timer,
+                   bud_thread_drain_timer_cb,
+                   config->drain_timeout,
+                   0);
+  }
+
+  bud_worker_drain_check(config);
+}
+
+
+void bud_thread_drain_timer_cb(uv_timer_t* handle, int status) {
+  bud_thread_t* t;
+
+  t = container_of(handle, bud_thread_t, drain_timer);
+  bud_log(t->config,
+          kBudLogWarning,
+          "thread %d drain timed out, clients: %d",
+          t->index,
+          (int) t->config->client_slab.used_count);
+  uv_stop(t->loop);
+}
+
+
+int bud_threads_offer(bud_config_t* config,
+                      bud_config_listener_t* listener,
+                      uv_stream_t* stream) {
+  bud_steal_t* steal;
+  bud_steal_t* peers;
+  bud_config_t* root;
+  uv_os_fd_t ofd;
+  int fd;
+  int i;
+
+  steal = config->steal;
+  if (steal == NULL || config->draining)
+    return 0;
+
+  /* Not busy, handshake it right here */
+  if (QUEUE_EMPTY(&config->handshake_parked))
+    return 0;
+
+  /* libuv handles can't be moved, pass the socket on (see backend-pool.c) */
+  if (uv_fileno((uv_handle_t*) stream, &ofd) != 0)
+    return 0;
+  fd = dup(ofd);
+  if (fd == -1)
+    return 0;
+
+  uv_mutex_lock(&steal->lock);
+  if (steal->count == BUD_STEAL_MAX) {
+    uv_mutex_unlock(&steal->lock);
+    close(fd);
+    return 0;
+  }
+  i = (steal->head + steal->count) % BUD_STEAL_MAX;
+  steal->items[i].fd = fd;
+  steal->items[i].listener = listener - config->listeners;
+  steal->count++;
+  uv_mutex_unlock(&steal->lock);
+
+  /* Wake everyone up, busy ones will ignore it */
+  root = config->thread_parent == NULL ? config : config->thread_parent;
+  peers = root->steals;
+  for (i = 0; i < root->thread_count; i++) {
+    if (&peers[i] == steal)
+      continue;
+    uv_mutex_lock(&peers[i].lock);
+    if (peers[i].config != NULL)
+      uv_async_send(&peers[i].config->steal_async);
+    uv_mutex_unlock(&peers[i].lock);
+  }
+
+  return 1;
+}
+
+
+void bud_threads_steal(bud_config_t* config) {
+  bud_steal_item_t item;
+  bud_steal_t* peers;
+  bud_steal_t* victim;
+  bud_config_t* root;
+  int count;
+  int max;
+  int n;
+  int i;
+
+  if (config->steal == NULL)
+    return;
+
+  root = config->thread_parent == NULL ? config : config->thread_parent;
+  peers = root->steals;
+
+  /* As many as it is allowed to handshake at once */
+  for (n = 0; n < config->frontend.handshake_limit; n++) {
+    if (config->draining || !QUEUE_EMPTY(&config->handshake_parked))
+      break;
+
+    /* Own ones are the oldest, that were accepted first */
+    if (!bud_steal_pop(config->steal, 1, &item)) {
+      victim = NULL;
+      max = 0;
+      for (i = 0; i < root->thread_count; i++) {
+        uv_mutex_lock(&peers[i].lock);
+        count = peers[i].count;
+        uv_mutex_unlock(&peers[i].lock);
+        if (count > max) {
+          max = count;
+          victim = &peers[i];
+        }
+      }
+      if (victim == NULL || !bud_steal_pop(victim, 0, &item))
+        break;
+    }
+
+    /* Same config file, same listeners */
+    if (item.listener >= config->listener_count) {
+      close(item.fd);
+      continue;
+    }
+    bud_client_create_fd(config, &config->listeners[item.listener], item.fd);
+  }
+}
+
+
+bud_error_t bud_steals_init(bud_config_t* config) {
+  bud_error_t err;
+  int i;
+
+  /* Only loops that park handshakes have anything to give away */
+  if (config->frontend.handshake_limit <= 0)
+    return bud_ok();
+
+  config->steals = calloc(config->thread_count, sizeof(*config->steals));
+  if (config->steals == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_steal_t");
+
+  for (i = 0; i < config->thread_count; i++) {
+    if (uv_mutex_init(&config->steals[i].lock) != 0)
+      break;
+  }
+  if (i != config->thread_count) {
+    while (--i >= 0)
+      uv_mutex_destroy(&config->steals[i].lock);
+    err = bud_error_str(kBudErrNoMem, "steal lock");
+    goto fatal;
+  }
+
+  err = bud_steal_open(config, &config->steals[0]);
+  if (bud_is_ok(err))
+    return err;
+
+  for (i = 0; i < config->thread_count; i++)
+    uv_mutex_destroy(&config->steals[i].lock);
+
+fatal:
+  free(config->steals);
+  config->steals = NULL;
+  return err;
+}
+
+
+void bud_steals_free(bud_config_t* config) {
+  bud_steal_item_t item;
+  int i;
+
+  if (config->steals == NULL)
+    return;
+
+  /* Threads are gone, only ours may be still listening */
+  bud_steal_close(config);
+  for (i = 0; i < config->thread_count; i++) {
+    while (bud_steal_pop(&config->steals[i], 1, &item))
+      close(item.fd);
+    uv_mutex_destroy(&config->steals[i].lock);
+  }
+  free(config->steals);
+  config->steals = NULL;
+}
+
+
+bud_error_t bud_steal_open(bud_config_t* config, bud_steal_t* steal) {
+  int r;
+
+  r = uv_async_init(config->loop, &config->steal_async, bud_steal_async_cb);
+  if (r != 0)
+    return bud_error_num(kBudErrThreadAsync, r);
+
+  /* Wakeups shouldn't keep the loop running */
+  uv_unref((uv_handle_t*) &config->steal_async);
+
+  uv_mutex_lock(&steal->lock);
+  steal->config = config;
+  uv_mutex_unlock(&steal->lock);
+  config->steal = steal;
+
+  return bud_ok();
+}
+
+
+void bud_steal_close(bud_config_t* config) {
+  bud_steal_t* steal;
+
+  steal = config->steal;
+  if (steal == NULL)
+    return;
+
+  /* No more wakeups after this */
+  uv_mutex_lock(&steal->lock);
+  steal->config = NULL;
+  uv_mutex_unlock(&steal->lock);
+  config->steal = NULL;
+
+  uv_close((uv_handle_t*) &config->steal_async, NULL);
+}
+
+
+void bud_steal_async_cb(uv_async_t* handle, int status) {
+  bud_config_t* config;
+
+  config = container_of(handle, bud_config_t, steal_async);
+  bud_threads_steal(config);
+}
+
+
+int bud_steal_pop(bud_steal_t* steal, int head, bud_steal_item_t* item) {
+  int i;
+
+  uv_mutex_lock(&steal->lock);
+  if (steal->count == 0) {
+    uv_mutex_unlock(&steal->lock);
+    return 0;
+  }
+
+  if (head) {
+    i = steal->head;
+    steal->head = (steal->head + 1) % BUD_STEAL_MAX;
+  } else {
+    i = (steal->head + steal->count - 1) % BUD_STEAL_MAX;
+  }
+  steal->count--;
+  *item = steal->items[i];
+  uv_mutex_unlock(&steal->lock);
+
+  return 1;
+}
+
+
+void bud_steal_flush(bud_config_t* config) {
+  bud_steal_item_t item;
+
+  if (config->steal == NULL)
+    return;
+
+  /* Draining, but these were accepted already */
+  while (bud_steal_pop(config->steal, 1, &item)) {
+    if (item.listener >= config->listener_count) {
+      close(item.fd);
+      continue;
+    }
+    bud_client_create_fd(config,
+                         &config->listeners[item.listener],
+                         item.fd);
+  }
+}
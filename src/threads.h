@@ -0,0 +1,80 @@
+#ifndef SRC_THREADS_H_
+#define SRC_THREADS_H_
+
+#include "uv.h"
+
+#include "config.h"
+#include "error.h"
+
+/* Accepted sockets waiting for a handshake, per event loop */
+#define BUD_STEAL_MAX 256
+
+typedef struct bud_thread_s bud_thread_t;
+typedef struct bud_steal_s bud_steal_t;
+typedef struct bud_steal_item_s bud_steal_item_t;
+
+/*
+ * One of `threads - 1` extra event loops of the process. Each loads its own
+ * copy of the config file and accepts on its own SO_REUSEPORT sockets, so
+ * nothing but the process-wide caches (`shared_cache`, `session_cache`) is
+ * shared with the others.
+ */
+struct bud_thread_s {
+  bud_config_t* parent;
+  int index;
+  uv_thread_t thread;
+  uv_loop_t* loop;
+  bud_config_t* config;
+
+  /* Thread has started (or failed to), `err` is set */
+  uv_sem_t ready;
+  bud_error_t err;
+
+  /* Sent by the parent, stop accepting and exit once clients are gone */
+  uv_async_t drain;
+  int drain_sent;
+  uv_timer_t drain_timer;
+};
+
+struct bud_steal_item_s {
+  int fd;
+  int listener;
+};
+
+/*
+ * Deque of sockets accepted by a loop that has handshakes parked over
+ * `frontend.handshake_limit`. The owner takes the oldest ones once it
+ * catches up, idle loops steal the newest ones. One per loop, in the
+ * parent's `steals`, index 0 is the parent.
+ */
+struct bud_steal_s {
+  uv_mutex_t lock;
+
+  /* Wakes it up with `steal_async`, NULL - gone */
+  bud_config_t* config;
+  int head;
+  int count;
+  bud_steal_item_t items[BUD_STEAL_MAX];
+};
+
+/* Called by the process that accepts clients, once its server is up */
+bud_error_t bud_threads_start(bud_config_t* config);
+
+/* Stop accepting in all threads, they exit when drained */
+void bud_threads_drain(bud_config_t* config);
+
+/* Drain and wait for all threads */
+void bud_threads_stop(bud_config_t* config);
+
+/*
+ * Give the just accepted `stream` to whichever loop is idle. Returns
+ * non-zero if it was taken, `stream` should be closed then.
+ */
+int bud_threads_offer(bud_config_t* config,
+                      bud_config_listener_t* listener,
+                      uv_stream_t* stream);
+
+/* Take offered sockets, while not busy with handshakes */
+void bud_threads_steal(bud_config_t* config);
+
+#endif  /* SRC_THREADS_H_ */
@@ -0,0 +1,355 @@
+#include <stdio.h>  /* fopen, fread, fclose */
+#include <stdlib.h>  /* malloc, free */
+#include <string.h>  /* memcpy, memcmp, memmove, strlen */
+
+#include "uv.h"
+
+#include "openssl/evp.h"
+#include "openssl/hmac.h"
+#include "openssl/rand.h"
+#include "openssl/ssl.h"
+
+#include "ticket.h"
+#include "client.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "ipc.h"
+#include "logger.h"
+#include "session-cache.h"
+
+/* Secrets shorter than that are refused */
+#define BUD_TICKET_SECRET_MIN 16
+#define BUD_TICKET_SECRET_MAX 1024
+
+static bud_error_t bud_ticket_read_secret(bud_config_t* config,
+                                          bud_ticket_key_t* key);
+static int bud_ticket_derive(const char* secret,
+                             size_t len,
+                             bud_ticket_key_t* key);
+static int bud_ticket_random(bud_ticket_key_t* key);
+static int bud_ticket_bind(bud_client_t* client, HMAC_CTX* hctx);
+static int bud_session_tag_write(bud_config_t* config, unsigned char* out);
+
+
+bud_error_t bud_ticket_load(bud_config_t* config) {
+  bud_ticket_ring_t* ring;
+  bud_error_t err;
+  int cap;
+
+  /* Rotated by the main loop of the process */
+  if (config->thread_parent != NULL) {
+    config->frontend.ticket_ring = config->thread_parent->frontend.ticket_ring;
+    return bud_ok();
+  }
+
+  cap = config->frontend.ticket_previous + 1;
+  ring = malloc(sizeof(*ring) + (cap - 1) * sizeof(ring->keys[0]));
+  if (ring == NULL)
+    return bud_error_str(kBudErrNoMem, "ticket keys");
+  if (uv_mutex_init(&ring->lock) != 0) {
+    free(ring);
+    return bud_error_str(kBudErrNoMem, "ticket keys lock");
+  }
+  ring->cap = cap;
+  ring->count = 1;
+  config->frontend.ticket_ring = ring;
+
+  /*
+   * Worker's own key is used only until master's arrive. Configured secret
+   * is read just by master, which has no SSL_CTX with it anyway.
+   */
+  if (!config->is_worker &&
+      (config->frontend.ticket_key != NULL ||
+       config->frontend.ticket_key_file != NULL)) {
+    err = bud_ticket_read_secret(config, &ring->keys[0]);
+    if (!bud_is_ok(err))
+      return err;
+    config->frontend.ticket_fixed = 1;
+  } else if (bud_ticket_random(&ring->keys[0]) != 0) {
+    return bud_error_str(kBudErrTicketKey, "<random key>");
+  }
+
+  return bud_ok();
+}
+
+
+void bud_ticket_free(bud_config_t* config) {
+  bud_ticket_ring_t* ring;
+
+  ring = config->frontend.ticket_ring;
+  config->frontend.ticket_ring = NULL;
+  if (ring == NULL || config->thread_parent != NULL)
+    return;
+
+  OPENSSL_cleanse(ring->keys, ring->cap * sizeof(ring->keys[0]));
+  uv_mutex_destroy(&ring->lock);
+  free(ring);
+}
+
+
+bud_error_t bud_ticket_read_secret(bud_config_t* config,
+                                   bud_ticket_key_t* key) {
+  FILE* fp;
+  char* secret;
+  const char* path;
+  size_t len;
+  bud_error_t err;
+
+  path = config->frontend.ticket_key_file;
+  secret = malloc(BUD_TICKET_SECRET_MAX);
+  if (secret == NULL)
+    return bud_error_str(kBudErrNoMem, "ticket secret");
+
+  if (path != NULL) {
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+      err = bud_error_str(kBudErrTicketKey, path);
+      goto done;
+    }
+    len = fread(secret, 1, BUD_TICKET_SECRET_MAX, fp);
+    fclose(fp);
+  } else {
+    len = strlen(config->frontend.ticket_key);
+    if (len > BUD_TICKET_SECRET_MAX)
+      len = BUD_TICKET_SECRET_MAX;
+    memcpy(secret, config->frontend.ticket_key, len);
+  }
+
+  if (len < BUD_TICKET_SECRET_MIN) {
+    err = bud_error_str(kBudErrTicketKey,
+                        path != NULL ? path : "<inline key is too short>");
+  } else if (bud_ticket_derive(secret, len, key) != 0) {
+    err = bud_error_str(kBudErrTicketKey, "<derive>");
+  } else {
+    err = bud_ok();
+  }
+
+done:
+  OPENSSL_cleanse(secret, BUD_TICKET_SECRET_MAX);
+  free(secret);
+  return err;
+}
+
+
+int bud_ticket_derive(const char* secret,
+                      size_t len,
+                      bud_ticket_key_t* key) {
+  unsigned char msg;
+  unsigned char out[EVP_MAX_MD_SIZE];
+  unsigned int out_len;
+
+  /*
+   * Same key in every bud with the same secret:
+   *   HMAC-SHA256(secret, 1) = name || aes_key
+   *   HMAC-SHA256(secret, 2) = hmac_key
+   */
+  msg = 1;
+  if (HMAC(EVP_sha256(), secret, len, &msg, 1, out, &out_len) == NULL)
+    return -1;
+  ASSERT(out_len >= BUD_TICKET_NAME_LEN + BUD_TICKET_AES_LEN,
+         "Ticket HMAC is too short");
+  memcpy(key->name, out, BUD_TICKET_NAME_LEN);
+  memcpy(key->aes_key, out + BUD_TICKET_NAME_LEN, BUD_TICKET_AES_LEN);
+
+  msg = 2;
+  if (HMAC(EVP_sha256(), secret, len, &msg, 1, out, &out_len) == NULL)
+    return -1;
+  ASSERT(out_len >= BUD_TICKET_HMAC_LEN, "Ticket HMAC is too short");
+  memcpy(key->hmac_key, out, BUD_TICKET_HMAC_LEN);
+  OPENSSL_cleanse(out, sizeof(out));
+
+  return 0;
+}
+
+
+int bud_ticket_random(bud_ticket_key_t* key) {
+  if (RAND_bytes((unsigned char*) key, sizeof(*key)) <= 0)
+    return -1;
+  return 0;
+}
+
+
+bud_error_t bud_ticket_rotate(bud_config_t* config) {
+  bud_ticket_ring_t* ring;
+  bud_ticket_key_t key;
+
+  ring = config->frontend.ticket_ring;
+  if (bud_ticket_random(&key) != 0)
+    return bud_error_str(kBudErrTicketKey, "<random key>");
+
+  /* Oldest one falls off, nothing derives it again */
+  uv_mutex_lock(&ring->lock);
+  memmove(&ring->keys[1],
+          &ring->keys[0],
+          (ring->cap - 1) * sizeof(ring->keys[0]));
+  ring->keys[0] = key;
+  if (ring->count < ring->cap)
+    ring->count++;
+  uv_mutex_unlock(&ring->lock);
+  OPENSSL_cleanse(&key, sizeof(key));
+
+  return bud_ok();
+}
+
+
+bud_error_t bud_ticket_send(bud_config_t* config, uv_stream_t* stream) {
+  bud_ticket_ring_t* ring;
+
+  /* Master's loop is the only one that rotates them, no need to lock */
+  ring = config->frontend.ticket_ring;
+  return bud_ipc_send(config,
+                      stream,
+                      kBudIPCTicketKeys,
+                      (const char*) ring->keys,
+                      ring->count * sizeof(ring->keys[0]),
+                      NULL,
+                      0);
+}
+
+
+void bud_ticket_ipc_keys(bud_config_t* config,
+                         const char* data,
+                         size_t size) {
+  bud_ticket_ring_t* ring;
+  size_t count;
+
+  ring = config->frontend.ticket_ring;
+  count = size / sizeof(ring->keys[0]);
+  if (count == 0 || size % sizeof(ring->keys[0]) != 0) {
+    bud_log(config, kBudLogWarning, "received invalid ticket keys");
+    return;
+  }
+
+  /* Same config file, but master could have started with another one */
+  if (count > (size_t) ring->cap)
+    count = ring->cap;
+
+  uv_mutex_lock(&ring->lock);
+  OPENSSL_cleanse(ring->keys, ring->cap * sizeof(ring->keys[0]));
+  memcpy(ring->keys, data, count * sizeof(ring->keys[0]));
+  ring->count = count;
+  uv_mutex_unlock(&ring->lock);
+}
+
+
+int bud_ticket_key_cb(SSL* ssl,
+                      unsigned char* name,
+                      unsigned char* iv,
+                      EVP_CIPHER_CTX* ectx,
+                      HMAC_CTX* hctx,
+                      int enc) {
+  bud_client_t* client;
+  bud_ticket_ring_t* ring;
+  bud_ticket_key_t* key;
+  int r;
+  int i;
+
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+  if (client == NULL)
+    return -1;
+  ring = client->config->frontend.ticket_ring;
+
+  if (enc) {
+    if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_128_cbc())) <= 0)
+      return -1;
+
+    /* Contexts copy the keys, the ring can change right after */
+    uv_mutex_lock(&ring->lock);
+    key = &ring->keys[0];
+    memcpy(name, key->name, BUD_TICKET_NAME_LEN);
+    EVP_EncryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes_key, iv);
+    HMAC_Init_ex(hctx, key->hmac_key, BUD_TICKET_HMAC_LEN, EVP_sha256(), NULL);
+    uv_mutex_unlock(&ring->lock);
+    bud_ticket_bind(client, hctx);
+    return 1;
+  }
+
+  /* Current key, or one of the previous (then ask for the ticket renewal) */
+  r = 0;
+  uv_mutex_lock(&ring->lock);
+  for (i = 0; i < ring->count; i++) {
+    key = &ring->keys[i];
+    if (memcmp(name, key->name, BUD_TICKET_NAME_LEN) != 0)
+      continue;
+
+    HMAC_Init_ex(hctx, key->hmac_key, BUD_TICKET_HMAC_LEN, EVP_sha256(), NULL);
+    EVP_DecryptInit_ex(ectx, EVP_aes_128_cbc(), NULL, key->aes_key, iv);
+    r = i == 0 ? 1 : 2;
+    break;
+  }
+  uv_mutex_unlock(&ring->lock);
+
+  /* 0 - unknown key, full handshake */
+  if (r != 0 && bud_ticket_bind(client, hctx) != 0)
+    r = 0;
+  return r;
+}
+
+
+/*
+ * Keys are shared by all contexts, so the MAC covers the servername too: a
+ * ticket of another servername fails it, and OpenSSL does a full handshake
+ */
+int bud_ticket_bind(bud_client_t* client, HMAC_CTX* hctx) {
+  unsigned char prefix[2];
+  char name[BUD_SESSION_NAME_MAX];
+  int name_len;
+
+  name_len = bud_session_servername(client, name);
+
+  /* No hello, the ticket won't match any */
+  if (name_len < 0) {
+    prefix[0] = 0xff;
+    prefix[1] = 0xff;
+    HMAC_Update(hctx, prefix, sizeof(prefix));
+    return -1;
+  }
+
+  prefix[0] = 0;
+  prefix[1] = name_len;
+  HMAC_Update(hctx, prefix, sizeof(prefix));
+  HMAC_Update(hctx, (const unsigned char*) name, name_len);
+  return 0;
+}
+
+
+int bud_session_generate_id(const SSL* ssl,
+                            unsigned char* id,
+                            unsigned int* id_len) {
+  bud_client_t* client;
+  int i;
+
+  client = SSL_get_ex_data(ssl, kBudSSLClientIndex);
+
+  /* Collisions are unlikely, but are refused by OpenSSL */
+  for (i = 0; i < 8; i++) {
+    if (RAND_bytes(id, *id_len) <= 0)
+      return 0;
+    if (client != NULL && *id_len >= BUD_SESSION_TAG_LEN)
+      bud_session_tag_write(client->config, id);
+    if (!SSL_has_matching_session_id(ssl, id, *id_len))
+      return 1;
+  }
+  return 0;
+}
+
+
+int bud_session_tag(const char* data, size_t len) {
+  if (len < BUD_SESSION_TAG_LEN ||
+      (unsigned char) data[0] != BUD_SESSION_TAG) {
+    return -1;
+  }
+  return (unsigned char) data[1];
+}
+
+
+int bud_session_tag_write(bud_config_t* config, unsigned char* out) {
+  /* Id is not known yet, or doesn't fit */
+  if (config->worker_id < 0 || config->worker_id > 0xff)
+    return -1;
+
+  out[0] = BUD_SESSION_TAG;
+  out[1] = config->worker_id;
+  return 0;
+}
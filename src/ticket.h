@@ -0,0 +1,78 @@
+#ifndef SRC_TICKET_H_
+#define SRC_TICKET_H_
+
+#include <stddef.h>  /* size_t */
+
+#include "uv.h"
+#include "openssl/evp.h"
+#include "openssl/hmac.h"
+#include "openssl/ssl.h"
+
+#include "error.h"
+
+/* Forward declaration */
+struct bud_config_s;
+
+#define BUD_TICKET_NAME_LEN 16
+#define BUD_TICKET_AES_LEN 16
+#define BUD_TICKET_HMAC_LEN 32
+#define BUD_TICKET_KEY_LEN \
+    (BUD_TICKET_NAME_LEN + BUD_TICKET_AES_LEN + BUD_TICKET_HMAC_LEN)
+
+/*
+ * `workers_balance: "session"`: session ids start with this byte and
+ * worker's id. Tickets don't need it, any worker has their keys.
+ */
+#define BUD_SESSION_TAG 0xbd
+#define BUD_SESSION_TAG_LEN 2
+
+typedef struct bud_ticket_key_s bud_ticket_key_t;
+typedef struct bud_ticket_ring_s bud_ticket_ring_t;
+
+/* Layout of a key in kBudIPCTicketKeys too */
+struct bud_ticket_key_s {
+  unsigned char name[BUD_TICKET_NAME_LEN];
+  unsigned char aes_key[BUD_TICKET_AES_LEN];
+  unsigned char hmac_key[BUD_TICKET_HMAC_LEN];
+};
+
+/*
+ * Current key first, then the `ticket_previous` ones that still decrypt.
+ * Master generates them, and sends them to the workers on spawn and on
+ * every rotation. Threads of the process share one ring.
+ */
+struct bud_ticket_ring_s {
+  uv_mutex_t lock;
+  int count;
+  int cap;
+  bud_ticket_key_t keys[1];
+};
+
+bud_error_t bud_ticket_load(struct bud_config_s* config);
+void bud_ticket_free(struct bud_config_s* config);
+
+/* Master: new random key becomes the current one */
+bud_error_t bud_ticket_rotate(struct bud_config_s* config);
+bud_error_t bud_ticket_send(struct bud_config_s* config, uv_stream_t* stream);
+
+/* Worker: keys from master replace the own ones */
+void bud_ticket_ipc_keys(struct bud_config_s* config,
+                         const char* data,
+                         size_t size);
+
+int bud_ticket_key_cb(SSL* ssl,
+                      unsigned char* name,
+                      unsigned char* iv,
+                      EVP_CIPHER_CTX* ectx,
+                      HMAC_CTX* hctx,
+                      int enc);
+
+/* SSL_CTX_set_generate_session_id() callback, random id with the tag */
+int bud_session_generate_id(const SSL* ssl,
+                            unsigned char* id,
+                            unsigned int* id_len);
+
+/* Worker id from the tag of a session id or a ticket, -1 - not tagged */
+int bud_session_tag(const char* data, size_t len);
+
+#endif  /* SRC_TICKET_H_ */
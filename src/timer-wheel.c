@@ -0,0 +1,133 @@
+#include "uv.h"
+
+#include "timer-wheel.h"
+#include "common.h"
+#include "error.h"
+#include "queue.h"
+
+static void bud_timer_wheel_tick(uv_timer_t* timer, int status);
+
+
+bud_error_t bud_timer_wheel_init(bud_timer_wheel_t* wheel,
+                                 uv_loop_t* loop,
+                                 uint64_t resolution,
+                                 bud_timer_wheel_cb cb) {
+  int r;
+  int i;
+
+  for (i = 0; i < BUD_TIMER_WHEEL_SLOTS; i++)
+    QUEUE_INIT(&wheel->slots[i]);
+  wheel->resolution = resolution;
+  wheel->tick = uv_now(loop) / resolution;
+  wheel->cb = cb;
+
+  r = uv_timer_init(loop, &wheel->timer);
+  if (r != 0)
+    return bud_error_num(kBudErrTimerWheel, r);
+  wheel->timer.data = wheel;
+
+  r = uv_timer_start(&wheel->timer,
+                     bud_timer_wheel_tick,
+                     resolution,
+                     resolution);
+  if (r != 0) {
+    uv_close((uv_handle_t*) &wheel->timer, NULL);
+    return bud_error_num(kBudErrTimerWheel, r);
+  }
+  uv_unref((uv_handle_t*) &wheel->timer);
+
+  return bud_ok();
+}
+
+
+void bud_timer_wheel_close(bud_timer_wheel_t* wheel) {
+  uv_close((uv_handle_t*) &wheel->timer, NULL);
+}
+
+
+void bud_timer_entry_init(bud_timer_entry_t* entry) {
+  entry->active = 0;
+  entry->expire = 0;
+  entry->slot = 0;
+}
+
+
+void bud_timer_wheel_schedule(bud_timer_wheel_t* wheel,
+                              bud_timer_entry_t* entry,
+                              uint64_t expire) {
+  uint64_t tick;
+
+  tick = (expire + wheel->resolution - 1) / wheel->resolution;
+  if (tick <= wheel->tick)
+    tick = wheel->tick + 1;
+
+  if (entry->active) {
+    /* Current slot comes first, entry will be moved on from there */
+    if (entry->slot <= tick) {
+      entry->expire = expire;
+      return;
+    }
+    QUEUE_REMOVE(&entry->member);
+  }
+
+  entry->active = 1;
+  entry->expire = expire;
+  entry->slot = tick;
+  QUEUE_INSERT_TAIL(&wheel->slots[tick % BUD_TIMER_WHEEL_SLOTS],
+                    &entry->member);
+}
+
+
+void bud_timer_wheel_cancel(bud_timer_entry_t* entry) {
+  if (!entry->active)
+    return;
+
+  entry->active = 0;
+  QUEUE_REMOVE(&entry->member);
+}
+
+
+void bud_timer_wheel_tick(uv_timer_t* timer, int status) {
+  bud_timer_wheel_t* wheel;
+  bud_timer_entry_t* entry;
+  uint64_t now;
+  uint64_t target;
+  QUEUE* slot;
+  QUEUE* q;
+  QUEUE pending;
+
+  wheel = timer->data;
+  now = uv_now(timer->loop);
+  target = now / wheel->resolution;
+
+  /* Loop was blocked for a full round, every slot is visited once anyway */
+  if (target - wheel->tick > BUD_TIMER_WHEEL_SLOTS)
+    wheel->tick = target - BUD_TIMER_WHEEL_SLOTS;
+
+  while (wheel->tick < target) {
+    wheel->tick++;
+    slot = &wheel->slots[wheel->tick % BUD_TIMER_WHEEL_SLOTS];
+
+    /* Callbacks may schedule or cancel, detach the slot first */
+    QUEUE_INIT(&pending);
+    if (!QUEUE_EMPTY(slot)) {
+      q = QUEUE_HEAD(slot);
+      QUEUE_SPLIT(slot, q, &pending);
+    }
+
+    while (!QUEUE_EMPTY(&pending)) {
+      q = QUEUE_HEAD(&pending);
+      entry = QUEUE_DATA(q, bud_timer_entry_t, member);
+      QUEUE_REMOVE(q);
+      entry->active = 0;
+
+      /* Later round, or postponed */
+      if (entry->expire > now) {
+        bud_timer_wheel_schedule(wheel, entry, entry->expire);
+        continue;
+      }
+
+      wheel->cb(entry);
+    }
+  }
+}
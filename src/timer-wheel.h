@@ -0,0 +1,57 @@
+#ifndef SRC_TIMER_WHEEL_H_
+#define SRC_TIMER_WHEEL_H_
+
+#include <stdint.h>  /* uint64_t */
+
+#include "uv.h"
+
+#include "error.h"
+#include "queue.h"
+
+#define BUD_TIMER_WHEEL_SLOTS 256
+
+typedef struct bud_timer_wheel_s bud_timer_wheel_t;
+typedef struct bud_timer_entry_s bud_timer_entry_t;
+typedef void (*bud_timer_wheel_cb)(bud_timer_entry_t* entry);
+
+struct bud_timer_entry_s {
+  QUEUE member;
+  int active;
+
+  /* Deadline (in `uv_now()` ms), and the tick of the slot entry is in */
+  uint64_t expire;
+  uint64_t slot;
+};
+
+/*
+ * Hashed timer wheel, a single `uv_timer_t` for any number of timeouts.
+ * Entries fire up to `resolution` ms late.
+ */
+struct bud_timer_wheel_s {
+  uv_timer_t timer;
+  uint64_t resolution;
+  uint64_t tick;
+  bud_timer_wheel_cb cb;
+  QUEUE slots[BUD_TIMER_WHEEL_SLOTS];
+};
+
+bud_error_t bud_timer_wheel_init(bud_timer_wheel_t* wheel,
+                                 uv_loop_t* loop,
+                                 uint64_t resolution,
+                                 bud_timer_wheel_cb cb);
+
+/* Entries are left as they are, must be followed by `uv_run` */
+void bud_timer_wheel_close(bud_timer_wheel_t* wheel);
+
+void bud_timer_entry_init(bud_timer_entry_t* entry);
+
+/*
+ * (Re)arm entry. Postponing an armed entry is O(1): it is only moved once
+ * its current slot is reached
+ */
+void bud_timer_wheel_schedule(bud_timer_wheel_t* wheel,
+                              bud_timer_entry_t* entry,
+                              uint64_t expire);
+void bud_timer_wheel_cancel(bud_timer_entry_t* entry);
+
+#endif  /* SRC_TIMER_WHEEL_H_ */
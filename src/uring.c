@@ -0,0 +1,390 @@
+#include <errno.h>  /* errno */
+#include <stdlib.h>  /* calloc, free */
+#include <string.h>  /* memset */
+#include <unistd.h>  /* close, syscall */
+
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>  /* io_uring_params, io_uring_sqe */
+#  include <sys/mman.h>  /* mmap, munmap */
+#  include <sys/syscall.h>  /* __NR_io_uring_setup */
+#  define BUD_HAVE_URING 1
+# endif
+#endif  /* __linux__ && __has_include */
+
+#include "uv.h"
+
+#include "uring.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "logger.h"
+
+#ifdef BUD_HAVE_URING
+
+/* Same on every architecture but alpha, older libc headers don't have it */
+# ifndef __NR_io_uring_setup
+#  define __NR_io_uring_setup 425
+# endif  /* !__NR_io_uring_setup */
+# ifndef __NR_io_uring_enter
+#  define __NR_io_uring_enter 426
+# endif  /* !__NR_io_uring_enter */
+
+static bud_error_t bud_uring_setup(bud_uring_t* uring);
+static void bud_uring_submit(bud_uring_t* uring);
+static void bud_uring_reap(bud_uring_t* uring);
+static void bud_uring_prepare_cb(uv_prepare_t* handle, int status);
+static void bud_uring_check_cb(uv_check_t* handle, int status);
+static void bud_uring_poll_cb(uv_poll_t* handle, int status, int events);
+static void bud_uring_close_cb(uv_handle_t* handle);
+static struct io_uring_sqe* bud_uring_get_sqe(bud_uring_t* uring);
+
+#endif  /* BUD_HAVE_URING */
+
+
+bud_error_t bud_uring_new(bud_config_t* config, bud_uring_t** out) {
+#ifdef BUD_HAVE_URING
+  bud_uring_t* uring;
+  bud_error_t err;
+  int r;
+
+  *out = NULL;
+  if (!config->frontend.io_uring)
+    return bud_ok();
+
+  uring = calloc(1, sizeof(*uring));
+  if (uring == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_uring_t");
+  uring->config = config;
+  uring->fd = -1;
+
+  /* Old kernel, or io_uring is disabled by sysctl or seccomp */
+  err = bud_uring_setup(uring);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogWarning, err);
+    bud_log(config, kBudLogWarning, "io_uring: using libuv writes");
+    bud_uring_free(uring);
+    return bud_ok();
+  }
+
+  r = uv_prepare_init(config->loop, &uring->prepare);
+  if (r != 0)
+    goto failed_prepare_init;
+  r = uv_check_init(config->loop, &uring->check);
+  if (r != 0)
+    goto failed_check_init;
+  r = uv_poll_init(config->loop, &uring->poll, uring->fd);
+  if (r != 0)
+    goto failed_poll_init;
+  uring->close_waiting = 3;
+  uring->prepare.data = uring;
+  uring->check.data = uring;
+  uring->poll.data = uring;
+
+  r = uv_prepare_start(&uring->prepare, bud_uring_prepare_cb);
+  if (r == 0)
+    r = uv_check_start(&uring->check, bud_uring_check_cb);
+  if (r == 0)
+    r = uv_poll_start(&uring->poll, UV_READABLE, bud_uring_poll_cb);
+  if (r != 0) {
+    bud_uring_free(uring);
+    return bud_error_num(kBudErrUringLoop, r);
+  }
+
+  /* Clients keep the loop alive while there are writes in flight */
+  uv_unref((uv_handle_t*) &uring->prepare);
+  uv_unref((uv_handle_t*) &uring->check);
+  uv_unref((uv_handle_t*) &uring->poll);
+
+  bud_log(config,
+          kBudLogDebug,
+          "io_uring: %u entries",
+          (unsigned int) uring->sq_entries);
+  *out = uring;
+  return bud_ok();
+
+failed_poll_init:
+  uv_close((uv_handle_t*) &uring->check, NULL);
+
+failed_check_init:
+  uv_close((uv_handle_t*) &uring->prepare, NULL);
+
+failed_prepare_init:
+  /* Handles are closed on the next iteration, leak it instead */
+  return bud_error_num(kBudErrUringLoop, r);
+#else  /* !BUD_HAVE_URING */
+  *out = NULL;
+  if (config->frontend.io_uring) {
+    bud_error_log(config,
+                  kBudLogWarning,
+                  bud_error_num(kBudErrUringSetup, UV_ENOSYS));
+  }
+  return bud_ok();
+#endif  /* BUD_HAVE_URING */
+}
+
+
+void bud_uring_free(bud_uring_t* uring) {
+#ifdef BUD_HAVE_URING
+  if (uring == NULL)
+    return;
+
+  /* The ring goes away with the last handle */
+  if (uring->close_waiting != 0) {
+    uv_close((uv_handle_t*) &uring->prepare, bud_uring_close_cb);
+    uv_close((uv_handle_t*) &uring->check, bud_uring_close_cb);
+    uv_close((uv_handle_t*) &uring->poll, bud_uring_close_cb);
+    return;
+  }
+
+  /* Kernel cancels whatever is still in flight */
+  if (uring->sqes_map != NULL)
+    munmap(uring->sqes_map, uring->sqes_map_size);
+  if (uring->cq_map != NULL && uring->cq_map != uring->sq_map)
+    munmap(uring->cq_map, uring->cq_map_size);
+  if (uring->sq_map != NULL)
+    munmap(uring->sq_map, uring->sq_map_size);
+  if (uring->fd != -1)
+    close(uring->fd);
+  free(uring);
+#endif  /* BUD_HAVE_URING */
+}
+
+
+int bud_uring_writev(bud_uring_t* uring,
+                     int fd,
+                     const struct iovec* iov,
+                     int count,
+                     bud_uring_op_t* op) {
+#ifdef BUD_HAVE_URING
+  struct io_uring_sqe* sqe;
+
+  sqe = bud_uring_get_sqe(uring);
+  if (sqe == NULL)
+    return UV_ENOBUFS;
+
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t) iov;
+  sqe->len = count;
+  sqe->user_data = (uintptr_t) op;
+  return 0;
+#else  /* !BUD_HAVE_URING */
+  return UV_ENOSYS;
+#endif  /* BUD_HAVE_URING */
+}
+
+
+void bud_uring_cancel(bud_uring_t* uring, bud_uring_op_t* op) {
+#ifdef BUD_HAVE_URING
+  struct io_uring_sqe* sqe;
+
+  /* Best effort, the write completes on its own otherwise */
+  sqe = bud_uring_get_sqe(uring);
+  if (sqe == NULL)
+    return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = (uintptr_t) op;
+  sqe->user_data = 0;
+#endif  /* BUD_HAVE_URING */
+}
+
+
+#ifdef BUD_HAVE_URING
+
+bud_error_t bud_uring_setup(bud_uring_t* uring) {
+  struct io_uring_params p;
+  char* sq;
+  char* cq;
+  int single;
+
+  memset(&p, 0, sizeof(p));
+  uring->fd = syscall(__NR_io_uring_setup, BUD_URING_ENTRIES, &p);
+  if (uring->fd == -1)
+    return bud_error_num(kBudErrUringSetup, -errno);
+
+  uring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+  uring->cq_map_size = p.cq_off.cqes +
+                       p.cq_entries * sizeof(struct io_uring_cqe);
+  single = 0;
+# ifdef IORING_FEAT_SINGLE_MMAP
+  /* Linux 5.4+, both rings are in one mapping */
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    single = 1;
+    if (uring->cq_map_size > uring->sq_map_size)
+      uring->sq_map_size = uring->cq_map_size;
+    uring->cq_map_size = uring->sq_map_size;
+  }
+# endif  /* IORING_FEAT_SINGLE_MMAP */
+
+  uring->sq_map = mmap(NULL,
+                       uring->sq_map_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       uring->fd,
+                       IORING_OFF_SQ_RING);
+  if (uring->sq_map == MAP_FAILED) {
+    uring->sq_map = NULL;
+    return bud_error_num(kBudErrUringSetup, -errno);
+  }
+
+  if (single) {
+    uring->cq_map = uring->sq_map;
+  } else {
+    uring->cq_map = mmap(NULL,
+                         uring->cq_map_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         uring->fd,
+                         IORING_OFF_CQ_RING);
+    if (uring->cq_map == MAP_FAILED) {
+      uring->cq_map = NULL;
+      return bud_error_num(kBudErrUringSetup, -errno);
+    }
+  }
+
+  uring->sqes_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes_map = mmap(NULL,
+                         uring->sqes_map_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         uring->fd,
+                         IORING_OFF_SQES);
+  if (uring->sqes_map == MAP_FAILED) {
+    uring->sqes_map = NULL;
+    return bud_error_num(kBudErrUringSetup, -errno);
+  }
+
+  sq = uring->sq_map;
+  cq = uring->cq_map;
+  uring->sq_head = (uint32_t*) (sq + p.sq_off.head);
+  uring->sq_tail = (uint32_t*) (sq + p.sq_off.tail);
+  uring->sq_array = (uint32_t*) (sq + p.sq_off.array);
+  uring->sq_mask = *(uint32_t*) (sq + p.sq_off.ring_mask);
+  uring->sq_entries = p.sq_entries;
+  uring->cq_head = (uint32_t*) (cq + p.cq_off.head);
+  uring->cq_tail = (uint32_t*) (cq + p.cq_off.tail);
+  uring->cq_mask = *(uint32_t*) (cq + p.cq_off.ring_mask);
+  uring->sqes = uring->sqes_map;
+  uring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+  return bud_ok();
+}
+
+
+struct io_uring_sqe* bud_uring_get_sqe(bud_uring_t* uring) {
+  struct io_uring_sqe* sqe;
+  uint32_t tail;
+  uint32_t index;
+
+  /* Full, make room */
+  tail = *uring->sq_tail;
+  if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) ==
+      uring->sq_entries) {
+    bud_uring_submit(uring);
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) ==
+        uring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  index = tail & uring->sq_mask;
+  sqe = &uring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  uring->sq_array[index] = index;
+
+  /* Fields are filled by the caller before the next submit */
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring->pending++;
+  return sqe;
+}
+
+
+void bud_uring_submit(bud_uring_t* uring) {
+  int r;
+
+  while (uring->pending != 0) {
+    r = syscall(__NR_io_uring_enter, uring->fd, uring->pending, 0, 0, NULL, 0);
+    if (r >= 0) {
+      uring->pending -= r;
+      if (r == 0)
+        break;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+
+    /* EAGAIN, EBUSY - no room for completions, try after reaping */
+    bud_log(uring->config,
+            kBudLogDebug,
+            "io_uring_enter() failed: %d",
+            errno);
+    break;
+  }
+}
+
+
+void bud_uring_reap(bud_uring_t* uring) {
+  struct io_uring_cqe* cqe;
+  bud_uring_op_t* op;
+  uint32_t head;
+  int res;
+
+  head = *uring->cq_head;
+  while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+    cqe = &uring->cqes[head & uring->cq_mask];
+    op = (bud_uring_op_t*) (uintptr_t) cqe->user_data;
+    res = cqe->res;
+
+    /* Let the kernel reuse the slot, callbacks may queue new writes */
+    head++;
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+    /* Cancellations have no op */
+    if (op != NULL)
+      op->cb(op, res);
+  }
+}
+
+
+void bud_uring_prepare_cb(uv_prepare_t* handle, int status) {
+  bud_uring_t* uring;
+
+  /* Writes queued by timers and idle callbacks */
+  uring = container_of(handle, bud_uring_t, prepare);
+  bud_uring_submit(uring);
+}
+
+
+void bud_uring_check_cb(uv_check_t* handle, int status) {
+  bud_uring_t* uring;
+
+  /* Writes queued by this iteration's reads, in one go */
+  uring = container_of(handle, bud_uring_t, check);
+  bud_uring_submit(uring);
+  bud_uring_reap(uring);
+}
+
+
+void bud_uring_poll_cb(uv_poll_t* handle, int status, int events) {
+  bud_uring_t* uring;
+
+  uring = container_of(handle, bud_uring_t, poll);
+  bud_uring_reap(uring);
+
+  /* Submission may have failed for lack of room for completions */
+  bud_uring_submit(uring);
+}
+
+
+void bud_uring_close_cb(uv_handle_t* handle) {
+  bud_uring_t* uring;
+
+  uring = handle->data;
+  if (--uring->close_waiting == 0)
+    bud_uring_free(uring);
+}
+
+#endif  /* BUD_HAVE_URING */
@@ -0,0 +1,80 @@
+#ifndef SRC_URING_H_
+#define SRC_URING_H_
+
+#include <stdint.h>  /* uint32_t */
+#include <sys/uio.h>  /* struct iovec */
+
+#include "uv.h"
+
+#include "error.h"
+
+/* Submission queue entries, writes over it are submitted right away */
+#define BUD_URING_ENTRIES 1024
+
+/* Forward declaration */
+struct bud_config_s;
+
+typedef struct bud_uring_s bud_uring_t;
+typedef struct bud_uring_op_s bud_uring_op_t;
+typedef void (*bud_uring_cb)(bud_uring_op_t* op, int res);
+
+/* Must stay allocated (along with iovecs) until `cb` is called */
+struct bud_uring_op_s {
+  bud_uring_cb cb;
+  void* data;
+};
+
+struct bud_uring_s {
+  struct bud_config_s* config;
+  int fd;
+
+  /* Rings shared with the kernel */
+  void* sq_map;
+  size_t sq_map_size;
+  void* cq_map;
+  size_t cq_map_size;
+  void* sqes_map;
+  size_t sqes_map_size;
+  uint32_t* sq_head;
+  uint32_t* sq_tail;
+  uint32_t* sq_array;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t* cq_head;
+  uint32_t* cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+
+  /* Queued, but not submitted yet */
+  uint32_t pending;
+
+  /* Submits before and after polling, reaps once the ring is readable */
+  uv_prepare_t prepare;
+  uv_check_t check;
+  uv_poll_t poll;
+  int close_waiting;
+};
+
+/*
+ * Linux 5.1+, with `frontend.io_uring`. NULL with ok error - disabled, or
+ * not supported (a warning is logged then), libuv writes are used instead.
+ */
+bud_error_t bud_uring_new(struct bud_config_s* config, bud_uring_t** out);
+void bud_uring_free(bud_uring_t* uring);
+
+/*
+ * Queue writev(2) of `iov` to `fd`, all writes queued in one loop iteration
+ * go to the kernel in one syscall. `cb` receives the result of writev(2)
+ * (or -errno). Returns 0 or uv error.
+ */
+int bud_uring_writev(bud_uring_t* uring,
+                     int fd,
+                     const struct iovec* iov,
+                     int count,
+                     bud_uring_op_t* op);
+
+/* Ask the kernel to finish `op` early, its `cb` is still called */
+void bud_uring_cancel(bud_uring_t* uring, bud_uring_op_t* op);
+
+#endif  /* SRC_URING_H_ */
@@ -0,0 +1,360 @@
+#include <stdlib.h>  /* calloc, malloc, free */
+#include <string.h>  /* memcmp, memcpy, strcmp, strlen */
+#include <time.h>  /* time */
+
+#include "uv.h"
+#include "openssl/evp.h"
+#include "openssl/sha.h"
+#include "openssl/ssl.h"
+#include "openssl/x509.h"
+#include "openssl/x509_vfy.h"
+#include "parson.h"
+
+#include "verify.h"
+#include "common.h"
+#include "config.h"
+#include "error.h"
+#include "http-pool.h"
+#include "json-stream.h"
+#include "logger.h"
+#include "metrics.h"
+
+/* Retry interval after the CRL backend failure, in seconds */
+#define BUD_VERIFY_CRL_RETRY 60
+
+static const char* bud_verify_mode(bud_config_t* config,
+                                   bud_context_t* context);
+static int bud_verify_cert_cb(X509_STORE_CTX* store, void* arg);
+static uint32_t bud_verify_ca_hash(bud_config_t* config,
+                                   bud_context_t* context);
+static void bud_verify_crl_refresh(bud_config_t* config,
+                                   bud_context_t* context);
+static void bud_verify_crl_cb(bud_http_request_t* req, bud_error_t err);
+static int bud_verify_crl_json(bud_context_t* context,
+                               bud_json_stream_t* stream);
+
+const char* const bud_verify_extract[] = { "crls", NULL };
+
+
+bud_error_t bud_verify_init(bud_config_t* config) {
+  int i;
+  int needed;
+  uint32_t count;
+  bud_verify_cache_t* cache;
+
+  config->verify_cache.cache = NULL;
+
+  needed = 0;
+  for (i = 0; !needed && i < config->context_count + 1; i++)
+    needed = strcmp(bud_verify_mode(config, &config->contexts[i]), "none");
+  if (!needed || config->verify_cache.size <= 0)
+    return bud_ok();
+
+  cache = malloc(sizeof(*cache));
+  if (cache == NULL)
+    return bud_error_str(kBudErrNoMem, "bud_verify_cache_t");
+
+  /* Power of two, not less than the `size` */
+  count = 16;
+  while (count < (uint32_t) config->verify_cache.size)
+    count <<= 1;
+  cache->entries = calloc(count, sizeof(*cache->entries));
+  if (cache->entries == NULL) {
+    free(cache);
+    return bud_error_str(kBudErrNoMem, "bud_verify_cache_t entries");
+  }
+  cache->config = config;
+  cache->mask = count - 1;
+
+  config->verify_cache.cache = cache;
+  return bud_ok();
+}
+
+
+void bud_verify_free(bud_config_t* config) {
+  if (config->verify_cache.cache == NULL)
+    return;
+
+  free(config->verify_cache.cache->entries);
+  free(config->verify_cache.cache);
+  config->verify_cache.cache = NULL;
+}
+
+
+const char* bud_verify_mode(bud_config_t* config, bud_context_t* context) {
+  if (context->verify_client != NULL)
+    return context->verify_client;
+  return config->frontend.verify_client;
+}
+
+
+bud_error_t bud_verify_setup(bud_config_t* config,
+                             bud_context_t* context,
+                             SSL_CTX* ctx) {
+  const char* mode;
+  const char* ca;
+  STACK_OF(X509_NAME)* names;
+  unsigned char sid_ctx[SHA256_DIGEST_LENGTH];
+  int flags;
+
+  mode = bud_verify_mode(config, context);
+  if (strcmp(mode, "none") == 0)
+    return bud_ok();
+  else if (strcmp(mode, "optional") == 0)
+    flags = SSL_VERIFY_PEER;
+  else if (strcmp(mode, "require") == 0)
+    flags = SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
+  else
+    return bud_error_str(kBudErrVerifyMode, mode);
+
+  ca = context->client_ca != NULL ? context->client_ca :
+                                    config->frontend.client_ca;
+  if (ca == NULL)
+    return bud_error_str(kBudErrClientCA, "null");
+  if (!SSL_CTX_load_verify_locations(ctx, ca, NULL))
+    return bud_error_str(kBudErrClientCA, ca);
+
+  /* Listed in CertificateRequest, so that clients pick the right one */
+  names = SSL_load_client_CA_file(ca);
+  if (names == NULL)
+    return bud_error_str(kBudErrClientCA, ca);
+  SSL_CTX_set_client_CA_list(ctx, names);
+
+  /* Resumption of verified sessions needs it even without the cache */
+  bud_context_sid_ctx(context, sid_ctx);
+  SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx));
+  SSL_CTX_set_ex_data(ctx, kBudSSLConfigIndex, config);
+  SSL_CTX_set_verify(ctx, flags, NULL);
+  SSL_CTX_set_cert_verify_callback(ctx, bud_verify_cert_cb, context);
+
+  return bud_ok();
+}
+
+
+void bud_verify_swap(bud_context_t* context) {
+  if (context->ctx == NULL ||
+      SSL_CTX_get_verify_mode(context->ctx) == SSL_VERIFY_NONE) {
+    return;
+  }
+
+  /* Callback's argument should outlive the temporary context */
+  SSL_CTX_set_cert_verify_callback(context->ctx, bud_verify_cert_cb, context);
+
+  /* `client_ca` file might have changed */
+  context->crl_gen++;
+}
+
+
+void bud_verify_context_free(bud_context_t* context) {
+  if (context->crl_req != NULL)
+    bud_http_request_cancel(context->crl_req);
+  if (context->crls != NULL)
+    sk_X509_CRL_pop_free(context->crls, X509_CRL_free);
+  context->crl_req = NULL;
+  context->crls = NULL;
+}
+
+
+uint32_t bud_verify_ca_hash(bud_config_t* config, bud_context_t* context) {
+  const char* ca;
+  uint32_t hash;
+
+  ca = context->client_ca != NULL ? context->client_ca :
+                                    config->frontend.client_ca;
+  hash = bud_hash_lower(BUD_HASH_INIT, ca, strlen(ca));
+  return bud_hash_lower(hash,
+                        (const char*) &context->crl_gen,
+                        sizeof(context->crl_gen));
+}
+
+
+int bud_verify_cert_cb(X509_STORE_CTX* store, void* arg) {
+  bud_context_t* context;
+  bud_config_t* config;
+  bud_verify_cache_t* cache;
+  bud_verify_entry_t* entry;
+  SSL* ssl;
+  X509* cert;
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  unsigned int digest_len;
+  uint32_t index;
+  uint32_t ca_hash;
+  uint64_t now;
+  int result;
+  int r;
+
+  context = arg;
+  ssl = X509_STORE_CTX_get_ex_data(store,
+                                   SSL_get_ex_data_X509_STORE_CTX_idx());
+  config = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), kBudSSLConfigIndex);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  cert = X509_STORE_CTX_get0_cert(store);
+#else  /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+  cert = store->cert;
+#endif  /* OPENSSL_VERSION_NUMBER >= 0x10100000L */
+
+  /* In background, this handshake gets the CRLs that are loaded now */
+  if (config->crl.pool != NULL)
+    bud_verify_crl_refresh(config, context);
+
+  cache = config->verify_cache.cache;
+  entry = NULL;
+  now = uv_now(config->loop);
+  ca_hash = 0;
+  if (cache != NULL &&
+      X509_digest(cert, EVP_sha256(), digest, &digest_len)) {
+    memcpy(&index, digest, sizeof(index));
+    entry = &cache->entries[index & cache->mask];
+    ca_hash = bud_verify_ca_hash(config, context);
+
+    if (entry->expire > now &&
+        entry->ca_hash == ca_hash &&
+        memcmp(entry->digest, digest, sizeof(digest)) == 0) {
+      bud_metrics_inc(config, kBudMetricVerifyCached);
+      X509_STORE_CTX_set_error(store, entry->result);
+      return entry->result == X509_V_OK;
+    }
+  }
+
+  if (context->crls != NULL) {
+    X509_STORE_CTX_set0_crls(store, context->crls);
+    X509_STORE_CTX_set_flags(store, X509_V_FLAG_CRL_CHECK);
+  }
+  r = X509_verify_cert(store);
+  bud_metrics_inc(config, kBudMetricVerifyFull);
+
+  /* Internal errors (e.g. allocation failures) are not cached */
+  result = X509_STORE_CTX_get_error(store);
+  if (entry != NULL && (r > 0) == (result == X509_V_OK)) {
+    memcpy(entry->digest, digest, sizeof(digest));
+    entry->ca_hash = ca_hash;
+    entry->result = result;
+    entry->expire = now + (uint64_t) config->verify_cache.ttl * 1000;
+  }
+
+  return r;
+}
+
+
+void bud_verify_crl_refresh(bud_config_t* config, bud_context_t* context) {
+  const char* name;
+  bud_error_t err;
+
+  /* Already in flight, or CRLs are still fresh */
+  if (context->crl_req != NULL || context->crl_refresh > time(NULL))
+    return;
+
+  /* Default context has no servername */
+  name = context->servername != NULL ? context->servername : "default";
+  context->crl_req = bud_http_get(config->crl.pool,
+                                  config->crl.query_fmt,
+                                  name,
+                                  strlen(name),
+                                  bud_verify_crl_cb,
+                                  &err);
+  if (!bud_is_ok(err)) {
+    bud_log(config,
+            kBudLogWarning,
+            "CRL request failed: %d - \"%s\"",
+            err.code,
+            err.str);
+    context->crl_req = NULL;
+    context->crl_refresh = time(NULL) + BUD_VERIFY_CRL_RETRY;
+    return;
+  }
+  context->crl_req->data = context;
+}
+
+
+void bud_verify_crl_cb(bud_http_request_t* req, bud_error_t err) {
+  bud_config_t* config;
+  bud_context_t* context;
+  JSON_Value* response;
+
+  context = req->data;
+  config = req->config;
+  context->crl_req = NULL;
+  response = bud_is_ok(err) ? req->response : NULL;
+
+  if (!bud_is_ok(err)) {
+    bud_log(config,
+            kBudLogWarning,
+            "CRL cb failed: %d - \"%s\"",
+            err.code,
+            err.str);
+    context->crl_refresh = time(NULL) + BUD_VERIFY_CRL_RETRY;
+    goto done;
+  }
+
+  /* Keep verifying with the old CRLs until the backend is back */
+  if (req->code < 200 ||
+      req->code >= 400 ||
+      bud_verify_crl_json(context, &req->stream) != 0) {
+    bud_log(config, kBudLogDebug, "CRL request failure");
+    context->crl_refresh = time(NULL) + BUD_VERIFY_CRL_RETRY;
+    goto done;
+  }
+
+  bud_log(config,
+          kBudLogDebug,
+          "loaded %d CRLs",
+          sk_X509_CRL_num(context->crls));
+  context->crl_refresh = time(NULL) + config->verify_cache.crl_refresh;
+
+done:
+  if (response != NULL)
+    json_value_free(response);
+}
+
+
+/* `crls` is extracted by the pool, see `bud_verify_extract` */
+int bud_verify_crl_json(bud_context_t* context, bud_json_stream_t* stream) {
+  STACK_OF(X509_CRL)* crls;
+  X509_CRL* crl;
+  const char* b64;
+  size_t b64_len;
+  char* der;
+  size_t der_len;
+  const unsigned char* p;
+  int count;
+  int i;
+
+  crls = sk_X509_CRL_new_null();
+  if (crls == NULL)
+    return -1;
+
+  count = bud_json_stream_count(stream, "crls");
+  for (i = 0; i < count; i++) {
+    b64 = bud_json_stream_value(stream, "crls", i, &b64_len);
+    if (b64 == NULL)
+      goto fatal;
+
+    der_len = bud_base64_decoded_size_fast(b64_len);
+    der = malloc(der_len);
+    if (der == NULL)
+      goto fatal;
+    der_len = bud_base64_decode(der, der_len, b64, b64_len);
+
+    p = (const unsigned char*) der;
+    crl = d2i_X509_CRL(NULL, &p, der_len);
+    free(der);
+    if (crl == NULL)
+      goto fatal;
+    if (!sk_X509_CRL_push(crls, crl)) {
+      X509_CRL_free(crl);
+      goto fatal;
+    }
+  }
+
+  if (context->crls != NULL)
+    sk_X509_CRL_pop_free(context->crls, X509_CRL_free);
+  context->crls = crls;
+
+  /* Results that were verified without these CRLs are stale now */
+  context->crl_gen++;
+  return 0;
+
+fatal:
+  sk_X509_CRL_pop_free(crls, X509_CRL_free);
+  return -1;
+}
@@ -0,0 +1,62 @@
+#ifndef SRC_VERIFY_H_
+#define SRC_VERIFY_H_
+
+#include <stdint.h>  /* uint32_t, uint64_t */
+
+#include "openssl/sha.h"
+#include "openssl/ssl.h"
+
+#include "error.h"
+
+/* Forward declarations */
+struct bud_config_s;
+struct bud_context_s;
+
+typedef struct bud_verify_cache_s bud_verify_cache_t;
+typedef struct bud_verify_entry_s bud_verify_entry_t;
+
+struct bud_verify_entry_s {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+
+  /* Context's `client_ca` file and its CRL generation */
+  uint32_t ca_hash;
+
+  /* X509_V_OK, or the error of the chain verification */
+  int result;
+  uint64_t expire;
+};
+
+/*
+ * Per-worker results of client chain verification (with CRLs), keyed by
+ * SHA-256 of the client certificate. Direct-mapped: an entry is replaced
+ * by the next certificate that falls into its slot. New CRLs and reloads
+ * change the context's `ca_hash`, so that its old results are not used.
+ */
+struct bud_verify_cache_s {
+  struct bud_config_s* config;
+  uint32_t mask;
+  bud_verify_entry_t* entries;
+};
+
+/* Cache is created only if some context verifies clients */
+bud_error_t bud_verify_init(struct bud_config_s* config);
+void bud_verify_free(struct bud_config_s* config);
+
+/*
+ * Apply `verify_client` and `client_ca` of the context (or `frontend`'s) to
+ * its new `ctx`, no-op for "none"
+ */
+bud_error_t bud_verify_setup(struct bud_config_s* config,
+                             struct bud_context_s* context,
+                             SSL_CTX* ctx);
+
+/* Context got SSL_CTX of the temporary one, see bud_context_swap() */
+void bud_verify_swap(struct bud_context_s* context);
+
+/* Cancel CRL request, free CRLs */
+void bud_verify_context_free(struct bud_context_s* context);
+
+/* Base64 DER CRLs in CRL server's responses */
+extern const char* const bud_verify_extract[];
+
+#endif  /* SRC_VERIFY_H_ */
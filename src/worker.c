@@ -1,13 +1,31 @@
 #include <stdlib.h>  /* NULL */
+#include <string.h>  /* memcpy */
 
 #include "uv.h"
 
 #include "worker.h"
+#include "admin.h"
 #include "client.h"
 #include "common.h"
 #include "config.h"
 #include "error.h"
+#include "handoff.h"
+#include "ipc.h"
 #include "logger.h"
+#include "metrics.h"
+#include "ocsp.h"
+#include "server.h"
+#include "threads.h"
+#include "ticket.h"
+
+/* Report load to the master that often (ms) */
+#define BUD_WORKER_LOAD_INTERVAL BUD_IPC_LOAD_INTERVAL
+
+/* Sample loop lag for `frontend.max_lag` that often (ms) */
+#define BUD_WORKER_LAG_INTERVAL 100
+
+/* Retry relays that were busy on `drain_handoff` that often (ms) */
+#define BUD_WORKER_HANDOFF_INTERVAL 100
 
 static void bud_worker_alloc_cb(uv_handle_t* handle,
                                 size_t suggested_size,
@@ -16,6 +34,23 @@ static void bud_worker_read_cb(uv_pipe_t* pipe,
                                ssize_t nread,
                                const uv_buf_t* buf,
                                uv_handle_type pending);
+static void bud_worker_ipc_msg_cb(bud_ipc_t* ipc, bud_ipc_msg_t* msg);
+static void bud_worker_ipc_balance(bud_config_t* config, bud_ipc_msg_t* msg);
+static void bud_worker_ipc_identity(bud_config_t* config, bud_ipc_msg_t* msg);
+static void bud_worker_ipc_handoff(bud_config_t* config, bud_ipc_msg_t* msg);
+static void bud_worker_accept_handoff(bud_config_t* config,
+                                      uv_handle_type pending);
+static bud_error_t bud_worker_init_load(bud_config_t* config);
+static void bud_worker_load_timer_cb(uv_timer_t* handle, int status);
+static void bud_worker_send_load(bud_config_t* config, uint64_t lag);
+static bud_error_t bud_worker_init_lag(bud_config_t* config);
+static void bud_worker_lag_timer_cb(uv_timer_t* handle, int status);
+static void bud_worker_shed(bud_config_t* config, int on, uint64_t lag);
+static void bud_worker_drain(bud_config_t* config, bud_ipc_msg_t* msg);
+static void bud_worker_handoff(bud_config_t* config);
+static void bud_worker_handoff_timer_cb(uv_timer_t* handle, int status);
+static bud_error_t bud_worker_listen(bud_config_t* config);
+static void bud_worker_promote(bud_config_t* config);
 
 bud_error_t bud_worker(bud_config_t* config) {
   int r;
@@ -35,6 +70,8 @@ bud_error_t bud_worker(bud_config_t* config) {
     goto fatal;
   }
 
+  bud_ipc_init(&config->ipc_parser, config, bud_worker_ipc_msg_cb);
+
   r = uv_read2_start((uv_stream_t*) &config->ipc,
                      bud_worker_alloc_cb,
                      bud_worker_read_cb);
@@ -43,13 +80,79 @@ bud_error_t bud_worker(bud_config_t* config) {
     goto fatal;
   }
 
-  err = bud_ok();
+  err = bud_worker_init_load(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  err = bud_worker_init_lag(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  err = bud_metrics_loop_start(config);
+  if (!bud_is_ok(err))
+    goto fatal;
+
+  /* Spares are fully loaded, but wait for kBudIPCPromote to listen */
+  if (config->is_spare) {
+    bud_log(config, kBudLogDebug, "worker is a spare");
+    return bud_ok();
+  }
+
+  err = bud_worker_listen(config);
 
 fatal:
   return err;
 }
 
 
+bud_error_t bud_worker_listen(bud_config_t* config) {
+  int i;
+  bud_error_t err;
+
+  /* Sockets of the master came on spawn, start accepting on them */
+  if (config->frontend.shared_listen) {
+    bud_server_start_shared(config);
+    return bud_ok();
+  }
+
+  /* Master won't send any handles, listen on our own socket */
+  if (!config->frontend.reuseport)
+    return bud_ok();
+
+  err = bud_server_new(config);
+  if (!bud_is_ok(err))
+    return err;
+
+  for (i = 0; i < config->listener_count; i++) {
+    bud_log(config,
+            kBudLogInfo,
+            "worker listening on [%s]:%d with SO_REUSEPORT",
+            config->listeners[i].host,
+            config->listeners[i].port);
+  }
+
+  return bud_threads_start(config);
+}
+
+
+void bud_worker_promote(bud_config_t* config) {
+  bud_error_t err;
+
+  if (!config->is_spare || config->draining)
+    return;
+
+  bud_log(config, kBudLogInfo, "spare worker promoted");
+  config->is_spare = 0;
+
+  /* Useless without its sockets, let master spawn another one */
+  err = bud_worker_listen(config);
+  if (!bud_is_ok(err)) {
+    bud_error_log(config, kBudLogFatal, err);
+    uv_stop(config->loop);
+  }
+}
+
+
 void bud_worker_alloc_cb(uv_handle_t* handle,
                          size_t suggested_size,
                          uv_buf_t* buf) {
@@ -64,18 +167,425 @@ void bud_worker_read_cb(uv_pipe_t* pipe,
                         const uv_buf_t* buf,
                         uv_handle_type pending) {
   bud_config_t* config;
+  bud_error_t err;
 
   config = container_of(pipe, bud_config_t, ipc);
   ASSERT(config != NULL, "worker ipc failed to get config");
   ASSERT(nread >= 0 || nread == UV_EOF, "worker ipc read failure");
 
-  /* Ignore reads without handles */
+  if (nread > 0) {
+    /* Lost the framing, let master spawn another one */
+    err = bud_ipc_parse(&config->ipc_parser, buf->base, nread);
+    if (!bud_is_ok(err)) {
+      bud_error_log(config, kBudLogFatal, err);
+      uv_stop(config->loop);
+      return;
+    }
+  }
+
+  /* Reads without handles are messages */
   if (pending == UV_UNKNOWN_HANDLE)
     return;
 
+  /* Sockets of the relay from kBudIPCHandoff */
+  if (config->handoff != NULL)
+    return bud_worker_accept_handoff(config, pending);
+
   ASSERT(pending == UV_TCP, "worker received non-tcp handle on ipc");
+
+  /* Listening socket of the master, from kBudIPCListen */
+  if (config->ipc_listen) {
+    config->ipc_listen = 0;
+    err = bud_server_adopt(config,
+                           &config->listeners[config->ipc_listener],
+                           (uv_stream_t*) &config->ipc);
+    if (!bud_is_ok(err))
+      bud_error_log(config, kBudLogWarning, err);
+    return;
+  }
+
   bud_log(config, kBudLogDebug, "worker received handle");
 
-  /* Accept client */
-  bud_client_create(config, (uv_stream_t*) &config->ipc);
+  /* Accept client, on the listener from the preceding balance message */
+  bud_client_create(config,
+                    &config->listeners[config->ipc_listener],
+                    (uv_stream_t*) &config->ipc);
+}
+
+
+void bud_worker_ipc_msg_cb(bud_ipc_t* ipc, bud_ipc_msg_t* msg) {
+  bud_error_t err;
+
+  switch (msg->type) {
+    case kBudIPCBalance:
+      /* Handle is accepted in bud_worker_read_cb() */
+      bud_worker_ipc_balance(ipc->config, msg);
+      break;
+    case kBudIPCListen:
+      /* Same payload, but the handle is adopted as a server */
+      bud_worker_ipc_balance(ipc->config, msg);
+      ipc->config->ipc_listen = 1;
+      break;
+    case kBudIPCStaple:
+      bud_ocsp_ipc_staple(ipc->config, msg->data, msg->size);
+      break;
+    case kBudIPCTicketKeys:
+      bud_ticket_ipc_keys(ipc->config, msg->data, msg->size);
+      break;
+    case kBudIPCDrain:
+      bud_worker_drain(ipc->config, msg);
+      break;
+    case kBudIPCHandoff:
+      /* Sockets are accepted in bud_worker_read_cb() */
+      bud_worker_ipc_handoff(ipc->config, msg);
+      break;
+    case kBudIPCHandoffFd:
+      break;
+    case kBudIPCPromote:
+      bud_worker_promote(ipc->config);
+      break;
+    case kBudIPCIdentity:
+      bud_worker_ipc_identity(ipc->config, msg);
+      break;
+    case kBudIPCAdmin:
+      bud_admin_ipc_request(ipc->config, msg->data, msg->size);
+      break;
+    case kBudIPCReload:
+      err = bud_config_reload_contexts(ipc->config);
+      if (!bud_is_ok(err))
+        bud_error_log(ipc->config, kBudLogWarning, err);
+      break;
+    default:
+      bud_log(ipc->config,
+              kBudLogWarning,
+              "worker received unknown ipc message: %d",
+              msg->type);
+      break;
+  }
+}
+
+
+void bud_worker_ipc_balance(bud_config_t* config, bud_ipc_msg_t* msg) {
+  const unsigned char* data;
+  uint32_t index;
+
+  /* Same config file, same listeners - but don't trust it blindly */
+  config->ipc_listener = 0;
+  if (msg->size < 4)
+    return;
+
+  data = (const unsigned char*) msg->data;
+  index = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+  if (index < (uint32_t) config->listener_count)
+    config->ipc_listener = index;
+}
+
+
+void bud_worker_ipc_identity(bud_config_t* config, bud_ipc_msg_t* msg) {
+  const unsigned char* data;
+
+  if (msg->size < 4)
+    return;
+
+  data = (const unsigned char*) msg->data;
+  config->worker_id = (data[0] << 24) | (data[1] << 16) |
+                      (data[2] << 8) | data[3];
+}
+
+
+void bud_worker_ipc_handoff(bud_config_t* config, bud_ipc_msg_t* msg) {
+  /* Sockets of the previous one never came */
+  if (config->handoff != NULL)
+    bud_handoff_free(config->handoff);
+
+  config->handoff = bud_handoff_new(config, msg->size);
+  if (config->handoff == NULL) {
+    bud_error_log(config,
+                  kBudLogWarning,
+                  bud_error_str(kBudErrNoMem, "bud_handoff_t"));
+    return;
+  }
+  memcpy(config->handoff->payload, msg->data, msg->size);
+}
+
+
+void bud_worker_accept_handoff(bud_config_t* config, uv_handle_type pending) {
+  int r;
+  bud_error_t err;
+
+  r = bud_handoff_accept(config->handoff,
+                         (uv_stream_t*) &config->ipc,
+                         pending,
+                         &err);
+
+  /* Backend's socket is next */
+  if (r == 0)
+    return;
+
+  bud_log(config, kBudLogDebug, "worker received relay");
+  if (r == 1) {
+    bud_client_create_handoff(config, config->handoff);
+  } else {
+    bud_error_log(config, kBudLogWarning, err);
+    bud_handoff_free(config->handoff);
+  }
+  config->handoff = NULL;
+}
+
+
+bud_error_t bud_worker_init_load(bud_config_t* config) {
+  int r;
+
+  r = uv_timer_init(config->loop, &config->load_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrLoadTimer, r);
+
+  config->load_last = uv_now(config->loop);
+  r = uv_timer_start(&config->load_timer,
+                     bud_worker_load_timer_cb,
+                     BUD_WORKER_LOAD_INTERVAL,
+                     BUD_WORKER_LOAD_INTERVAL);
+  if (r != 0)
+    return bud_error_num(kBudErrLoadTimer, r);
+  uv_unref((uv_handle_t*) &config->load_timer);
+
+  return bud_ok();
+}
+
+
+void bud_worker_load_timer_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  bud_error_t err;
+  uint64_t now;
+  uint64_t lag;
+
+  config = container_of(handle, bud_config_t, load_timer);
+
+  /* Timer firing late means that the loop is busy */
+  now = uv_now(config->loop);
+  lag = now - config->load_last;
+  if (lag > BUD_WORKER_LOAD_INTERVAL)
+    lag -= BUD_WORKER_LOAD_INTERVAL;
+  else
+    lag = 0;
+  config->load_last = now;
+  config->metrics.values[kBudMetricLoopLag] = lag;
+
+  bud_worker_send_load(config, lag);
+  err = bud_metrics_send(config);
+  if (!bud_is_ok(err))
+    bud_error_log(config, kBudLogWarning, err);
+}
+
+
+void bud_worker_send_load(bud_config_t* config, uint64_t lag) {
+  bud_error_t err;
+  uint32_t clients;
+  char header[12];
+
+  clients = (uint32_t) config->client_slab.used_count;
+  header[0] = (clients >> 24) & 0xff;
+  header[1] = (clients >> 16) & 0xff;
+  header[2] = (clients >> 8) & 0xff;
+  header[3] = clients & 0xff;
+  header[4] = (lag >> 24) & 0xff;
+  header[5] = (lag >> 16) & 0xff;
+  header[6] = (lag >> 8) & 0xff;
+  header[7] = lag & 0xff;
+  header[8] = 0;
+  header[9] = 0;
+  header[10] = 0;
+  header[11] = config->shedding ? BUD_IPC_LOAD_SHEDDING : 0;
+
+  err = bud_ipc_send(config,
+                     (uv_stream_t*) &config->ipc,
+                     kBudIPCLoad,
+                     header,
+                     sizeof(header),
+                     NULL,
+                     0);
+  if (!bud_is_ok(err))
+    bud_error_log(config, kBudLogWarning, err);
+}
+
+
+bud_error_t bud_worker_init_lag(bud_config_t* config) {
+  int r;
+
+  config->shedding = 0;
+  if (config->frontend.max_lag <= 0)
+    return bud_ok();
+
+  r = uv_timer_init(config->loop, &config->lag_timer);
+  if (r != 0)
+    return bud_error_num(kBudErrLoadTimer, r);
+
+  config->lag_last = uv_now(config->loop);
+  r = uv_timer_start(&config->lag_timer,
+                     bud_worker_lag_timer_cb,
+                     BUD_WORKER_LAG_INTERVAL,
+                     BUD_WORKER_LAG_INTERVAL);
+  if (r != 0)
+    return bud_error_num(kBudErrLoadTimer, r);
+  uv_unref((uv_handle_t*) &config->lag_timer);
+
+  return bud_ok();
+}
+
+
+void bud_worker_lag_timer_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+  uint64_t now;
+  uint64_t lag;
+
+  config = container_of(handle, bud_config_t, lag_timer);
+
+  /* Same as in bud_worker_load_timer_cb(), but finer */
+  now = uv_now(config->loop);
+  lag = now - config->lag_last;
+  if (lag > BUD_WORKER_LAG_INTERVAL)
+    lag -= BUD_WORKER_LAG_INTERVAL;
+  else
+    lag = 0;
+  config->lag_last = now;
+
+  /* Resume only well under the threshold, so it doesn't flap */
+  if (!config->shedding && lag > (uint64_t) config->frontend.max_lag)
+    bud_worker_shed(config, 1, lag);
+  else if (config->shedding && lag * 2 <= (uint64_t) config->frontend.max_lag)
+    bud_worker_shed(config, 0, lag);
+}
+
+
+void bud_worker_shed(bud_config_t* config, int on, uint64_t lag) {
+  int r;
+
+  if (config->draining || config->is_spare)
+    return;
+
+  bud_log(config,
+          on ? kBudLogNotice : kBudLogInfo,
+          "worker loop lag %dms, %s new clients",
+          (int) lag,
+          on ? "shedding" : "taking");
+  config->shedding = on;
+
+  /*
+   * Handles queue up in the pipe (master steers the next ones elsewhere),
+   * and connections in the backlog of our `reuseport` (or shared) sockets.
+   * NOTE: other ipc messages wait too, but only until the loop catches up
+   */
+  if (!config->frontend.reuseport && !config->frontend.shared_listen) {
+    if (on) {
+      uv_read_stop((uv_stream_t*) &config->ipc);
+    } else {
+      r = uv_read2_start((uv_stream_t*) &config->ipc,
+                         bud_worker_alloc_cb,
+                         bud_worker_read_cb);
+      if (r != 0) {
+        bud_error_log(config,
+                      kBudLogFatal,
+                      bud_error_num(kBudErrIPCReadStart, r));
+        uv_stop(config->loop);
+        return;
+      }
+    }
+  } else if (!on) {
+    bud_server_resume_all(config);
+  }
+
+  /* Don't wait for the next report */
+  bud_worker_send_load(config, lag);
+}
+
+
+void bud_worker_drain(bud_config_t* config, bud_ipc_msg_t* msg) {
+  if (config->draining)
+    return;
+
+  bud_log(config,
+          kBudLogInfo,
+          "worker draining, clients: %d",
+          (int) config->client_slab.used_count);
+  config->draining = 1;
+
+  /* Stop accepting, in reuseport mode sockets are ours (or our copies) */
+  bud_server_free(config);
+  bud_threads_drain(config);
+
+  /* Relays move to the new generation, the rest finish here */
+  if (config->drain_handoff &&
+      config->frontend.passthrough &&
+      msg->size >= 1 &&
+      (msg->data[0] & BUD_IPC_DRAIN_HANDOFF) != 0) {
+    bud_worker_handoff(config);
+  }
+
+  bud_worker_drain_check(config);
+}
+
+
+void bud_worker_handoff(bud_config_t* config) {
+  int r;
+  int busy;
+  int sent;
+  QUEUE* q;
+  bud_client_t* client;
+
+  /* Closed clients are removed only in their close_cb */
+  busy = 0;
+  sent = 0;
+  QUEUE_FOREACH(q, &config->clients) {
+    client = QUEUE_DATA(q, bud_client_t, member);
+    if (client->handoff)
+      continue;
+
+    r = bud_client_handoff(client);
+    if (r == 0)
+      sent++;
+    else if (r == 1)
+      busy++;
+  }
+  if (sent != 0) {
+    bud_log(config,
+            kBudLogInfo,
+            "worker handing off relays: %d, busy: %d",
+            sent,
+            busy);
+  }
+
+  /* Sockets are still writing, or the hello is still coming */
+  if (busy == 0) {
+    if (config->handoff_timer_init)
+      uv_timer_stop(&config->handoff_timer);
+    return;
+  }
+  if (!config->handoff_timer_init) {
+    r = uv_timer_init(config->loop, &config->handoff_timer);
+    if (r != 0)
+      return;
+    config->handoff_timer_init = 1;
+  }
+  uv_timer_start(&config->handoff_timer,
+                 bud_worker_handoff_timer_cb,
+                 BUD_WORKER_HANDOFF_INTERVAL,
+                 0);
+}
+
+
+void bud_worker_handoff_timer_cb(uv_timer_t* handle, int status) {
+  bud_config_t* config;
+
+  config = container_of(handle, bud_config_t, handoff_timer);
+  bud_worker_handoff(config);
+}
+
+
+void bud_worker_drain_check(bud_config_t* config) {
+  if (!config->draining || config->client_slab.used_count != 0)
+    return;
+
+  /* Last client is gone, exit and let bud_config_free() clean up */
+  bud_log(config, kBudLogInfo, "worker drained");
+  uv_stop(config->loop);
 }
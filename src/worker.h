@@ -6,4 +6,7 @@
 
 bud_error_t bud_worker(bud_config_t* config);
 
+/* Exit when the last client closes after kBudIPCDrain */
+void bud_worker_drain_check(bud_config_t* config);
+
 #endif  /* SRC_WORKER_H_ */